@@ -0,0 +1,193 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   A compact, fixed size form of an IP address, for comparing and hashing.
+
+ */
+#pragma once
+
+#include "SockAddr.h"
+#include <string.h>
+
+/**
+ * An IPv4 or IPv6 address, without a port, in 24 bytes. IPv4 addresses are
+ * held as IPv4 mapped IPv6 addresses, so that all keys have the same layout,
+ * and two keys are compared with three 64 bit compares, without branching on
+ * the family. The family is kept, so an IPv4 address never equals the IPv6
+ * address that maps it, just as with IpAddr.
+ *
+ * This is used on the receive path, which builds keys directly from the
+ * received data, and only builds an IpAddr or SockAddr when one is needed, such
+ * as for logging. Two keys are equal exactly when the IpAddr values that they
+ * were made from are equal (any IPv6 flow info is ignored).
+ */
+class AddrKey
+{
+public:
+  /**
+   * An invalid key.
+   */
+  AddrKey() { m_words[0] = m_words[1] = m_words[2] = 0;}
+
+  explicit AddrKey(const IpAddr &addr) { Set(addr);}
+  explicit AddrKey(const SockAddr &addr) { Set(addr);}
+
+  /**
+   * Sets from an address. The port is ignored.
+   */
+  void Set(const sockAddrBase &addr)
+  {
+    const sockaddr &base = addr.GetSockAddr();
+    if (base.sa_family == AF_INET)
+      SetIPv4(reinterpret_cast<const sockaddr_in &>(base).sin_addr);
+    else if (base.sa_family == AF_INET6)
+      SetIPv6(reinterpret_cast<const sockaddr_in6 &>(base).sin6_addr, reinterpret_cast<const sockaddr_in6 &>(base).sin6_scope_id);
+    else
+      clear();
+  }
+
+  /**
+   * Sets from a socket address, such as from recvmsg().
+   *
+   * @param outPort [out] - The port, in host order. May be NULL.
+   *
+   * @return bool - false if the address is not IPv4 or IPv6. The key is then
+   *         invalid.
+   */
+  bool Set(const sockaddr *addr, socklen_t addrLength, in_port_t *outPort)
+  {
+    if (addr->sa_family == AF_INET && addrLength >= socklen_t(sizeof(sockaddr_in)))
+    {
+      const sockaddr_in *in = reinterpret_cast<const sockaddr_in *>(addr);
+      SetIPv4(in->sin_addr);
+      if (outPort)
+        *outPort = ntohs(in->sin_port);
+      return true;
+    }
+    if (addr->sa_family == AF_INET6 && addrLength >= socklen_t(sizeof(sockaddr_in6)))
+    {
+      const sockaddr_in6 *in6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+      SetIPv6(in6->sin6_addr, in6->sin6_scope_id);
+      if (outPort)
+        *outPort = ntohs(in6->sin6_port);
+      return true;
+    }
+    clear();
+    return false;
+  }
+
+  void SetIPv4(const in_addr &addr)
+  {
+    uint8_t bytes[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+    memcpy(bytes + 12, &addr, 4);
+    memcpy(m_words, bytes, sizeof(bytes));
+    m_words[2] = uint64_t(FamilyIPv4) << 32;
+  }
+
+  /**
+   * @param scopeId [in] - Kept as given. Use ScopeIdIfLinkLocal() for an
+   *                interface index that should only apply to link local
+   *                addresses.
+   */
+  void SetIPv6(const in6_addr &addr, uint32_t scopeId)
+  {
+    memcpy(m_words, &addr, 16);
+    m_words[2] = (uint64_t(FamilyIPv6) << 32) | scopeId;
+  }
+
+  /**
+   * @return uint32_t - scopeId if addr is link local, otherwise 0. This matches
+   *         sockAddrBase::SetScopIdIfLinkLocal().
+   */
+  static uint32_t ScopeIdIfLinkLocal(const in6_addr &addr, uint32_t scopeId)
+  {
+    return IN6_IS_ADDR_LINKLOCAL(&addr) ? scopeId : 0;
+  }
+
+  void clear() { m_words[0] = m_words[1] = m_words[2] = 0;}
+
+  bool IsValid() const { return m_words[2] != 0;}
+
+  Addr::Type Type() const
+  {
+    switch (m_words[2] >> 32)
+    {
+    case FamilyIPv4:
+      return Addr::IPv4;
+    case FamilyIPv6:
+      return Addr::IPv6;
+    default:
+      return Addr::Invalid;
+    }
+  }
+
+  bool operator==(const AddrKey &other) const
+  {
+    return ((m_words[0] ^ other.m_words[0]) | (m_words[1] ^ other.m_words[1]) | (m_words[2] ^ other.m_words[2])) == 0;
+  }
+
+  bool operator!=(const AddrKey &other) const { return !(*this == other);}
+
+  /**
+   * A hash of all bits of the key.
+   */
+  uint32_t Hash() const
+  {
+    uint64_t hash = m_words[0] * 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ m_words[1]) * 0xC2B2AE3D27D4EB4FULL;
+    hash = (hash ^ m_words[2]) * 0x165667B19E3779F9ULL;
+    return uint32_t(hash >> 32);
+  }
+
+  /**
+   * @return const uint8_t* - The 16 bytes of the IPv6 address, or of the IPv4
+   *         mapped address, with the IPv4 address in the last 4.
+   */
+  const uint8_t* GetBytes() const { return reinterpret_cast<const uint8_t *>(m_words);}
+
+  /**
+   * @return IpAddr - The address. Invalid if the key is invalid.
+   */
+  IpAddr ToIpAddr() const
+  {
+    if (Type() == Addr::IPv4)
+    {
+      in_addr addr;
+      memcpy(&addr, reinterpret_cast<const uint8_t *>(m_words) + 12, 4);
+      return IpAddr(&addr);
+    }
+    if (Type() == Addr::IPv6)
+    {
+      sockaddr_in6 addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin6_family = AF_INET6;
+      memcpy(&addr.sin6_addr, m_words, 16);
+      addr.sin6_scope_id = uint32_t(m_words[2]);
+      return IpAddr(&addr);
+    }
+    return IpAddr();
+  }
+
+  /**
+   * @param port [in] - In host order.
+   *
+   * @return SockAddr - The address, with the port.
+   */
+  SockAddr ToSockAddr(in_port_t port) const
+  {
+    return SockAddr(ToIpAddr(), port);
+  }
+
+private:
+  // Not AF_ values, which may vary, and may be 0.
+  static const uint32_t FamilyIPv4 = 4;
+  static const uint32_t FamilyIPv6 = 6;
+
+  // The IPv6, or IPv4 mapped, address in [0] and [1]. The family in the high
+  // half of [2], and the scope id in the low half.
+  uint64_t m_words[3];
+};
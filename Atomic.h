@@ -0,0 +1,38 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Minimal atomic operations, using the compiler builtins.
+
+ */
+#pragma once
+
+#include "standard.h"
+
+// All operations are sequentially consistent. These do not log, so they can be
+// used by the logger.
+#ifdef HAVE_ATOMIC_BUILTINS
+template <typename T> inline T atomicLoad(T *ptr) { return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);}
+template <typename T> inline void atomicStore(T *ptr, T val) { __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST);}
+template <typename T> inline T atomicFetchAdd(T *ptr, T val) { return __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);}
+template <typename T> inline T atomicExchange(T *ptr, T val) { return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);}
+template <typename T> inline bool atomicCompareExchange(T *ptr, T expected, T val) { return __atomic_compare_exchange_n(ptr, &expected, val, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);}
+inline void atomicFence() { __atomic_thread_fence(__ATOMIC_SEQ_CST);}
+
+// No ordering. Use with atomicFence() to copy data guarded by a sequence lock.
+template <typename T> inline T atomicLoadRelaxed(T *ptr) { return __atomic_load_n(ptr, __ATOMIC_RELAXED);}
+template <typename T> inline void atomicStoreRelaxed(T *ptr, T val) { __atomic_store_n(ptr, val, __ATOMIC_RELAXED);}
+#else
+template <typename T> inline T atomicLoad(T *ptr) { __sync_synchronize(); T val = *(volatile T *)ptr; __sync_synchronize(); return val;}
+template <typename T> inline void atomicStore(T *ptr, T val) { __sync_synchronize(); *(volatile T *)ptr = val; __sync_synchronize();}
+template <typename T> inline T atomicFetchAdd(T *ptr, T val) { return __sync_fetch_and_add(ptr, val);}
+template <typename T> inline T atomicExchange(T *ptr, T val) { __sync_synchronize(); return __sync_lock_test_and_set(ptr, val);}
+template <typename T> inline bool atomicCompareExchange(T *ptr, T expected, T val) { return __sync_bool_compare_and_swap(ptr, expected, val);}
+inline void atomicFence() { __sync_synchronize();}
+
+template <typename T> inline T atomicLoadRelaxed(T *ptr) { return *(volatile T *)ptr;}
+template <typename T> inline void atomicStoreRelaxed(T *ptr, T val) { *(volatile T *)ptr = val;}
+#endif
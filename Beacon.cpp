@@ -9,9 +9,35 @@
 #include "CommandProcessor.h"
 #include "SelectScheduler.h"
 #include "KeventScheduler.h"
+#include "EpollScheduler.h"
+#include "IoUringScheduler.h"
+#include "Atomic.h"
+#include "BfdPacketView.h"
+#include "SessionCheckpoint.h"
+#include "StatusExport.h"
+#include "MetricsServer.h"
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <new>
+#include <algorithm>
 
 using namespace std;
 
+const size_t Beacon::DefaultReceiveBatchSize;
+const size_t Beacon::MaxReceiveBatchSize;
+const size_t Beacon::DefaultReceiveBudget;
+const size_t Beacon::MaxReceiveBudget;
+const size_t Beacon::MaxShardCount;
+const uint32_t Beacon::OperationTimeSlice;
+const size_t Beacon::SessionSlabSize;
+const uint32_t Beacon::DefaultProfile;
+const uint32_t Beacon::NoProfile;
+const char *Beacon::DefaultProfileName = "default";
+
 struct ListenCallbackData
 {
   Beacon *beacon;
@@ -20,21 +46,210 @@ struct ListenCallbackData
 typedef list<ListenCallbackData *> ListenCallbackDataList;
 typedef list<CommandProcessor *> CommandProcessorList;
 
+// A control packet received by one shard, for a session on another.
+struct ForwardedPacket
+{
+  uint8_t data[bfd::MaxPacketSize]; // Wire format.
+  size_t dataLength;
+  AddrKey sourceAddr;
+  in_port_t sourcePort;
+  AddrKey destAddr;
+  TimeSpec receiveTime; // Monotonic.
+};
+
+// Raw packet info, for LogDeferred(). Addresses are formatted only if logged.
+struct PacketLogData
+{
+  PacketLogData(size_t dataSize, const AddrKey &source, in_port_t port, const AddrKey &dest, uint32_t disc = 0) :
+     size(dataSize)
+     , sourceAddr(source)
+     , sourcePort(port)
+     , destAddr(dest)
+     , yourDisc(disc)
+  {
+  }
+
+  const char* SourceString() const { return sourceAddr.ToSockAddr(sourcePort).ToString();}
+  const char* DestString() const { return destAddr.ToIpAddr().ToString();}
+
+  size_t size;
+  AddrKey sourceAddr;
+  in_port_t sourcePort;
+  AddrKey destAddr;
+  uint32_t yourDisc;
+};
+
+static void formatReceivedPacket(char *outBuf, size_t bufSize, const PacketLogData &data)
+{
+  snprintf(outBuf, bufSize, "Received bfd packet %zu bytes from %s to %s", data.size, data.SourceString(), data.DestString());
+}
+
+static void formatBadSourcePort(char *outBuf, size_t bufSize, const PacketLogData &data)
+{
+  snprintf(outBuf, bufSize, "Discard packet: bad source port %s to %s", data.SourceString(), data.DestString());
+}
+
+static void formatMismatchedDisc(char *outBuf, size_t bufSize, const PacketLogData &data)
+{
+  snprintf(outBuf, bufSize, "Discard packet: mismatched yourDisc <%u> and ip <from %s to %s>.", data.yourDisc, data.SourceString(), data.DestString());
+}
+
+static void formatUnauthorized(char *outBuf, size_t bufSize, const PacketLogData &data)
+{
+  snprintf(outBuf, bufSize, "Ignoring unauthorized bfd packets from %s",  data.SourceString());
+}
+
 Beacon::Beacon() :
    m_scheduler(NULL),
-   m_discMap(32),
-   m_IdMap(32),
-   m_sourceMap(32),
+   m_transmitQueue(NULL),
+   m_transmitEngine(NULL),
+   m_packetRing(NULL),
+   m_sessionPool(sizeof(Session), SessionSlabSize),
    m_allowAnyPassiveIP(false),
    m_strictPorts(false),
-   m_initialSessionParams(),
+   m_profiles(1, Profile(DefaultProfileName)),
+   m_newSessionProfile(DefaultProfile),
+   m_authKeys(),
+   m_currentBatch(NULL),
    m_selfSignalId(-1),
+   m_receiveBatchSize(DefaultReceiveBatchSize),
+   m_receiveBudget(DefaultReceiveBudget),
+   m_transmitDepth(TransmitQueue::DefaultMaxDepth),
+   m_transmitWindow(TransmitQueue::DefaultWindow),
+   m_transmitSharedSockets(false),
+   m_transmitThread(false),
+   m_ioUringScheduler(false),
+   m_schedulerClock(Scheduler::ClockSource::Precise),
+   m_schedulerBudget(),
+   m_realtimeParams(),
+   m_realtimeStatus(),
+   m_receiveRingFrames(0),
+   m_discQuarantineMs(DiscriminatorAllocator::DefaultQuarantineMs),
+   m_primary(this),
+   m_shardIndex(0),
+   m_shardCount(1),
+   m_shardListenAddrs(NULL),
+   m_restore(NULL),
+   m_sessionsSaved(false),
+   m_statusExportPath(),
+   m_statusExportSessions(DefaultStatusExportSessions),
+   m_statusExport(NULL),
+   m_exportShard(NULL),
+   m_exportTimer(NULL),
+   m_exportStep(0),
+   m_metricsAddr(),
+   m_publishSchedulerStats(false),
+   m_overloadParams(),
+   m_overloadStats(),
+   m_overloadTimer(NULL),
+   m_overloadLateness(),
+   m_overloadBusyTime(0),
+   m_overloadCheckTime(),
+   m_overloadQuietTime(),
+   m_overloadCursor(0),
+   m_overloadSweepChanged(0),
+   m_overloadSweeping(false),
+   m_echoReceiveInterval(0),
+   m_echoControlInterval(DefaultEchoControlInterval),
+   m_echoInstance(0),
+   m_profileRate(DefaultProfileRate),
+   m_profileTimer(NULL),
+   m_profileCursor(0),
+   m_profilePassChanged(0),
+   m_capturePath(),
+   m_capture(NULL),
+   m_captureOwner(NULL),
+   m_captureLock(true),
    m_paramsLock(true),
-   m_shutownRequested(false)
+   m_shutownRequested(false),
+   m_shardStartupComplete(false),
+   m_shardStartupSuccess(false),
+   m_shardRunAllowed(false),
+   m_operations(),
+   m_operationsSignaled(0),
+   m_operationPushers(0),
+   m_schedulerStatsSequence(0)
 {
   // Do as little as possible. Logging not even initialized.
 }
 
+/**
+ * Creates an additional shard. Settings are copied from the primary.
+ */
+Beacon::Beacon(Beacon &primary, size_t shardIndex) :
+   m_scheduler(NULL),
+   m_transmitQueue(NULL),
+   m_transmitEngine(NULL),
+   m_packetRing(NULL),
+   m_sessionPool(sizeof(Session), SessionSlabSize),
+   m_allowedPassiveIP(primary.m_allowedPassiveIP),
+   m_allowAnyPassiveIP(primary.m_allowAnyPassiveIP),
+   m_strictPorts(primary.m_strictPorts),
+   m_profiles(primary.m_profiles),
+   m_newSessionProfile(primary.m_newSessionProfile),
+   m_authKeys(primary.m_authKeys),
+   m_currentBatch(NULL),
+   m_selfSignalId(-1),
+   m_receiveBatchSize(primary.m_receiveBatchSize),
+   m_receiveBudget(primary.m_receiveBudget),
+   m_transmitDepth(primary.m_transmitDepth),
+   m_transmitWindow(primary.m_transmitWindow),
+   m_transmitSharedSockets(primary.m_transmitSharedSockets),
+   m_transmitThread(primary.m_transmitThread),
+   m_ioUringScheduler(primary.m_ioUringScheduler),
+   m_schedulerClock(primary.m_schedulerClock),
+   m_schedulerBudget(primary.m_schedulerBudget),
+   m_realtimeParams(primary.m_realtimeParams),
+   m_realtimeStatus(),
+   m_receiveRingFrames(primary.m_receiveRingFrames),
+   m_discQuarantineMs(primary.m_discQuarantineMs),
+   m_primary(&primary),
+   m_shardIndex(shardIndex),
+   m_shardCount(primary.m_shardCount),
+   m_shardListenAddrs(NULL),
+   m_restore(NULL),
+   m_sessionsSaved(false),
+   m_statusExportPath(),
+   m_statusExportSessions(0),
+   m_statusExport(primary.m_statusExport),
+   m_exportShard(NULL),
+   m_exportTimer(NULL),
+   m_exportStep(0),
+   m_metricsAddr(),
+   m_publishSchedulerStats(primary.m_metricsAddr.IsValid()),
+   m_overloadParams(primary.m_overloadParams),
+   m_overloadStats(),
+   m_overloadTimer(NULL),
+   m_overloadLateness(),
+   m_overloadBusyTime(0),
+   m_overloadCheckTime(),
+   m_overloadQuietTime(),
+   m_overloadCursor(0),
+   m_overloadSweepChanged(0),
+   m_overloadSweeping(false),
+   m_echoReceiveInterval(primary.m_echoReceiveInterval),
+   m_echoControlInterval(primary.m_echoControlInterval),
+   m_echoInstance(0),
+   m_profileRate(primary.m_profileRate),
+   m_profileTimer(NULL),
+   m_profileCursor(0),
+   m_profilePassChanged(0),
+   m_capturePath(),
+   m_capture(primary.m_capture),
+   m_captureOwner(NULL),
+   m_captureLock(true),
+   m_paramsLock(true),
+   m_shutownRequested(false),
+   m_shardStartupComplete(false),
+   m_shardStartupSuccess(false),
+   m_shardRunAllowed(false),
+   m_operations(),
+   m_operationsSignaled(0),
+   m_operationPushers(0),
+   m_schedulerStatsSequence(0)
+{
+}
+
 Beacon::~Beacon()
 {
 }
@@ -69,9 +284,24 @@ void closeListenCallbackDataList(ListenCallbackDataList *callbackList)
   delete callbackList;
 }
 
+static bool startCommandProcessors(Beacon &beacon, const list<SockAddr> &controlPorts, CommandProcessorList &outProcessors)
+{
+  for (list<SockAddr>::const_iterator it = controlPorts.begin(); it != controlPorts.end(); ++it)
+  {
+    CommandProcessor *processor = MakeCommandProcessor(beacon);
+    outProcessors.push_back(processor);
+    if (!processor->BeginListening(*it))
+    {
+      gLog.LogError("Failed to start command processing thread on %s.  Aborting.", it->ToString());
+      return false;
+    }
+  }
+  return true;
+}
+
 bool Beacon::Run(const list<SockAddr> &controlPorts, const list<IpAddr> &listenAddrs)
 {
-  if (m_scheduler != NULL)
+  if (m_scheduler != NULL || m_primary != this)
   {
     gLog.LogError("Can not call Beacon::Run twice. Aborting.");
     return false;
@@ -83,29 +313,162 @@ bool Beacon::Run(const list<SockAddr> &controlPorts, const list<IpAddr> &listenA
     return false;
   }
 
+  bool returnVal = false;
+  RaiiNullBase<ListenCallbackDataList, closeListenCallbackDataList> callbackData(new ListenCallbackDataList);
   RaiiNullBase<CommandProcessorList, closeCommandProcessorList> commandProcessors(new CommandProcessorList);
 
-  for (list<SockAddr>::const_iterator it = controlPorts.begin(); it != controlPorts.end(); ++it)
+  // Before the shards allocate anything, so that all of it is locked.
+  if (m_realtimeParams.lockMemory)
   {
-    CommandProcessor *processor = MakeCommandProcessor(*this);
-    commandProcessors->push_back(processor);
-    if (!processor->BeginListening(*it))
+#ifdef HAVE_MLOCKALL
+    if (0 == ::mlockall(MCL_CURRENT | MCL_FUTURE))
     {
-      gLog.LogError("Failed to start command processing thread on %s.  Aborting.", it->ToString());
-      return false;
+      m_realtimeStatus.memoryLocked = true;
+      gLog.Optional(Log::App, "Locked all memory.");
+    }
+    else
+      gLog.ErrnoError(errno, "Failed to lock memory");
+#else
+    gLog.LogWarn("Locking memory is not supported on this system.");
+#endif
+  }
+
+  if (!m_checkpointPath.empty())
+    loadCheckpoint();
+
+  // Before the shards start, so that they all capture from their first packet.
+  bool captureStarted = true;
+  if (!m_capturePath.empty())
+  {
+    m_captureOwner = new PacketCapture();
+    captureStarted = m_captureOwner->Start(m_capturePath.c_str(), m_shardCount, PacketCapture::DefaultRingSize, 0);
+    if (captureStarted)
+      m_capture = m_captureOwner;
+    else
+      gLog.LogError("Failed to start capture. Aborting.");
+  }
+
+  // The shards must all be running before the command processors can queue
+  // operations to them. The status export must exist before any of them start.
+  bool started = captureStarted
+     && createStatusExport()
+     && startScheduler(listenAddrs, *callbackData)
+     && startShards(listenAddrs);
+  if (started)
+    restoreSessions();
+
+  // The shards have restored their sessions by now.
+  delete m_restore;
+  m_restore = NULL;
+
+  Raii<MetricsServer>::Delete metricsServer;
+  if (started && m_metricsAddr.IsValid())
+  {
+    metricsServer = new MetricsServer(*this);
+    started = metricsServer->Start(m_metricsAddr);
+  }
+
+  if (started && startCommandProcessors(*this, controlPorts, *commandProcessors))
+  {
+    // After the other threads are created, so that they do not inherit it.
+    applyRealtime();
+    if (!m_scheduler->Run())
+      gLog.LogError("Failed to start m_scheduler. Aborting.");
+    else
+      returnVal = true;
+  }
+
+  commandProcessors.Dispose();
+  metricsServer.Dispose();
+  if (returnVal && !m_checkpointPath.empty())
+    saveSessions();
+  stopShards();
+  if (m_sessionsSaved)
+    writeCheckpoint();
+
+  // In theory we should not be using m_scheduler except on the scheduler
+  // callbacks, which end when Scheduler::Run() ends
+  stopScheduler();
+
+  // No shard writes to it now.
+  delete m_statusExport;
+  m_statusExport = NULL;
+  delete m_captureOwner;
+  m_captureOwner = NULL;
+  m_capture = NULL;
+
+  return returnVal;
+}
+
+/**
+ * Creates the scheduler, transmit queue and listen sockets for this shard.
+ * Call on the thread that will run the scheduler.
+ *
+ * @param listenAddrs [in] - The addresses to listen on.
+ * @param outCallbackData [out] - Holds the listen sockets. Must outlive the
+ *                        scheduler.
+ *
+ * @return bool - false on failure. Call stopScheduler() in either case.
+ */
+bool Beacon::startScheduler(const list<IpAddr> &listenAddrs, ListenCallbackDataList &outCallbackData)
+{
+  Scheduler *scheduler = NULL;
+
+#ifdef USE_IOURING_SCHEDULER
+  if (m_ioUringScheduler)
+  {
+    IoUringScheduler *ringScheduler = new IoUringScheduler();
+    if (ringScheduler->IsReady())
+    {
+      scheduler = ringScheduler;
+      gLog.Optional(Log::App, "Shard %zu using io_uring scheduler.", m_shardIndex);
+    }
+    else
+    {
+      delete ringScheduler;
+      gLog.LogWarn("Shard %zu could not use io_uring. Using the default scheduler.", m_shardIndex);
     }
   }
+#endif
 
+  if (!scheduler)
+  {
 #ifdef USE_KEVENT_SCHEDULER
-  m_scheduler = new KeventScheduler();
+    scheduler = new KeventScheduler();
+#elif defined(USE_EPOLL_SCHEDULER)
+    scheduler = new EpollScheduler();
 #else
-  m_scheduler = new SelectScheduler();
+    scheduler = new SelectScheduler();
 #endif
+  }
+
+  if (!scheduler->SetClockSource(m_schedulerClock))
+    gLog.LogWarn("Shard %zu could not use the requested scheduler clock. Using the precise clock.", m_shardIndex);
+  scheduler->SetBudget(m_schedulerBudget);
+
+  {
+    // m_scheduler is used by triggerSelfMessage() on other threads.
+    AutoQuickLock lock(m_paramsLock);
+    m_scheduler = scheduler;
+  }
+
+  m_transmitQueue = new TransmitQueue(*m_scheduler, *GetPortAllocator(), m_transmitDepth, m_transmitWindow, m_transmitSharedSockets);
 
-  m_packet.AllocBuffers(bfd::MaxPacketSize,
-                        Socket::GetMaxControlSizeReceiveDestinationAddress() +
-                        Socket::GetMaxControlSizeReceiveTTLOrHops() +
-                        +8 /*just in case*/);
+  if (m_transmitThread)
+  {
+    m_transmitEngine = new TransmitEngine();
+    if (!m_transmitEngine->Start())
+    {
+      gLog.LogError("Failed to start transmit thread. Aborting.");
+      return false;
+    }
+  }
+
+  size_t listenControlSize = Socket::GetMaxControlSizeReceiveDestinationAddress() +
+     Socket::GetMaxControlSizeReceiveTTLOrHops() +
+     Socket::GetMaxControlSizeReceiveTimestamp() +
+     +8 /*just in case*/;
+  m_packets.AllocBuffers(m_receiveBatchSize, bfd::MaxPacketSize, listenControlSize);
 
   // We use this "signal channel" to communicate back to ourself in the Scheduler
   // thread.
@@ -115,12 +478,11 @@ bool Beacon::Run(const list<SockAddr> &controlPorts, const list<IpAddr> &listenA
     return false;
   }
 
-  RaiiNullBase<ListenCallbackDataList, closeListenCallbackDataList> callbackData(new ListenCallbackDataList);
   for (list<IpAddr>::const_iterator it = listenAddrs.begin(); it != listenAddrs.end(); ++it)
   {
     ListenCallbackData *data = new ListenCallbackData;
     data->beacon = this;
-    callbackData->push_back(data);
+    outCallbackData.push_back(data);
 
     makeListenSocket(*it, data->socket);
     if (data->socket.empty())
@@ -128,6 +490,20 @@ bool Beacon::Run(const list<SockAddr> &controlPorts, const list<IpAddr> &listenA
       gLog.LogError("Failed to create listen socket for %s on BFD port %hd.", it->ToString(), bfd::ListenPort);
       return false;
     }
+    // With a ring, the socket only holds the port, and receives nothing.
+    if (m_receiveRingFrames)
+      continue;
+    // A scheduler that receives the datagrams itself hands them over one by
+    // one, without any receive calls here.
+    if (m_scheduler->HandlesDatagrams())
+    {
+      if (!m_scheduler->SetDatagramCallback(data->socket, bfd::MaxPacketSize, listenControlSize, handleListenDatagramCallback, data))
+      {
+        gLog.LogError("Failed to set m_scheduler datagram processing for %s. Aborting.", it->ToString());
+        return false;
+      }
+      continue;
+    }
     if (!m_scheduler->SetSocketCallback(data->socket, handleListenSocketCallback, data))
     {
       gLog.LogError("Failed to set m_scheduler socket processing for %s. Aborting.", it->ToString());
@@ -135,336 +511,2853 @@ bool Beacon::Run(const list<SockAddr> &controlPorts, const list<IpAddr> &listenA
     }
   }
 
-  bool returnVal = false;
-  if (!m_scheduler->Run())
-    gLog.LogError("Failed to start m_scheduler. Aborting.");
-  else
-    returnVal = true;
+  if (m_receiveRingFrames && !startPacketRing(listenAddrs))
+    return false;
 
-  commandProcessors.Dispose();
+  if (m_echoReceiveInterval)
+  {
+    size_t echoControlSize = Socket::GetMaxControlSizeReceiveDestinationAddress() +
+       Socket::GetMaxControlSizeReceiveTimestamp() +
+       +8 /*just in case*/;
+    m_echoPackets.AllocBuffers(m_receiveBatchSize, bfd::MaxPacketSize, echoControlSize);
 
-  // In theory we should not be using m_scheduler except on the scheduler
-  // callbacks, which end when Scheduler::Run() ends
-  Scheduler *oldScheduler = m_scheduler;
-  m_scheduler = NULL;
-  delete oldScheduler;
+    for (list<IpAddr>::const_iterator it = listenAddrs.begin(); it != listenAddrs.end(); ++it)
+    {
+      ListenCallbackData *data = new ListenCallbackData;
+      data->beacon = this;
+      outCallbackData.push_back(data);
 
-  return returnVal;
+      if (!makeEchoSocket(*it, data->socket))
+      {
+        gLog.LogError("Failed to create echo socket for %s on BFD echo port %hd.", it->ToString(), bfd::EchoPort);
+        return false;
+      }
+      if (m_scheduler->HandlesDatagrams())
+      {
+        if (!m_scheduler->SetDatagramCallback(data->socket, bfd::MaxPacketSize, echoControlSize, handleEchoDatagramCallback, data))
+        {
+          gLog.LogError("Failed to set m_scheduler datagram processing for echo socket %s. Aborting.", it->ToString());
+          return false;
+        }
+      }
+      else if (!m_scheduler->SetSocketCallback(data->socket, handleEchoSocketCallback, data))
+      {
+        gLog.LogError("Failed to set m_scheduler socket processing for echo socket %s. Aborting.", it->ToString());
+        return false;
+      }
+      m_echoSockets.push_back(std::make_pair(*it, data->socket.GetSocket()));
+    }
+  }
+
+  startExportRefresh();
+  startOverloadControl();
+  reserveStorage();
+
+  return true;
 }
 
-bool Beacon::StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr)
+/**
+ * Allocates room for this shard's share of the configured maximum sessions, so
+ * that adding them does not allocate memory on the scheduler thread. Call at
+ * the end of startScheduler().
+ */
+void Beacon::reserveStorage()
 {
-  Session *session = NULL;
+  size_t count = (m_realtimeParams.maxSessions + m_shardCount - 1) / m_shardCount;
+  if (count == 0)
+    return;
 
-  LogAssert(m_scheduler->IsMainThread());
+  // Sessions are spread over the shards by a hash, so allow for some imbalance.
+  if (m_shardCount > 1)
+    count += count / 8;
 
-  session = findInSourceMap(remoteAddr, localAddr);
-  if (session)
+  m_realtimeStatus.reserveSessions = count;
+  try
   {
-    if (session->IsActiveSession())
-      return true;
-    if (!session->UpgradeToActiveSession())
-    {
-      LogOptional(Log::Session, "Failed to upgrade Session id=%u for %s to %s is to an active session.",
-                  session->GetId(),
-                  localAddr.ToString(),
-                  remoteAddr.ToString()
-                 );
-      return false;
-    }
-
-
-    LogOptional(Log::Session, "Session id=%u for %s to %s is now an active session.",
-                session->GetId(),
-                localAddr.ToString(),
-                remoteAddr.ToString()
-               );
-    return true;
+    m_sessionPool.Reserve(count);
+    m_discMap.Reserve(count);
+    m_IdMap.Reserve(count);
+    m_sourceMap.Reserve(count);
+    // Each session has a receive and a transmit timer, in the session itself.
+    // The shard has a few more, from the pool.
+    m_scheduler->ReserveTimers(16, count * 2);
+    if (m_transmitEngine)
+      m_transmitEngine->Reserve(count);
+    m_realtimeStatus.reserved = m_statusTable.Reserve(count);
   }
-  else
+  catch (std::bad_alloc &)
   {
-    session = addSession(remoteAddr, localAddr);
-    if (!session)
-      return false;
+    m_realtimeStatus.reserved = false;
+  }
 
-    LogOptional(Log::Session, "Manually added new session for %s to %s id=%u.",
-                localAddr.ToString(),
-                remoteAddr.ToString(),
-                session->GetId());
+  m_realtimeStatus.reservedBytes = storageBytes();
+  if (m_realtimeStatus.reserved)
+    gLog.Optional(Log::App, "Shard %zu allocated room for %zu sessions. %zu bytes.", m_shardIndex, count, m_realtimeStatus.reservedBytes);
+  else
+    gLog.LogWarn("Shard %zu could not allocate room for %zu sessions.", m_shardIndex, count);
+}
 
+/**
+ * Creates the status export file, if there is one. Each shard gets an equal
+ * share of the records, with room for some imbalance, as in reserveStorage().
+ *
+ * @note call only from the primary, before startScheduler().
+ *
+ * @return bool - false on failure.
+ */
+bool Beacon::createStatusExport()
+{
+  // The metrics server reads sessions from the export, so it needs one, if
+  // only in memory.
+  if (m_statusExportPath.empty() && !m_metricsAddr.IsValid())
+    return true;
+  const char *path = m_statusExportPath.empty() ? NULL : m_statusExportPath.c_str();
 
-    if (!session->StartActiveSession(remoteAddr, localAddr))
-    {
-      LogOptional(Log::Session, "Failed to start active session id=%u for %s to %s.",
-                  session->GetId(),
-                  localAddr.ToString(),
-                  remoteAddr.ToString()
-                 );
-      return false;
-    }
+  size_t count = (m_statusExportSessions + m_shardCount - 1) / m_shardCount;
+  if (m_shardCount > 1)
+    count += count / 8;
+  if (count == 0)
+    count = 1;
 
-    LogOptional(Log::Session, "Session id=%u for %s to %s is started as an active session.",
-                session->GetId(),
-                localAddr.ToString(),
-                remoteAddr.ToString()
-               );
-    return true;
+  Raii<StatusExport>::Delete statusExport(new StatusExport);
+  if (!statusExport->Create(path, m_shardCount, count, ExportRefreshMs))
+  {
+    gLog.LogError("Failed to create status export %s. Aborting.", path ? path : "in memory");
+    return false;
   }
+
+  gLog.Optional(Log::App, "Exporting status of up to %zu sessions per shard to %s.", count, path ? path : "memory");
+  m_statusExport = statusExport.Detach();
+  return true;
 }
 
-void Beacon::AllowPassiveIP(const IpAddr &addr)
+/**
+ * Starts the timer that refreshes this shard's exported counters, if there is
+ * a status export. Call from startScheduler().
+ */
+void Beacon::startExportRefresh()
 {
-  LogAssert(m_scheduler->IsMainThread());
+  if (!m_statusExport)
+    return;
 
-  m_allowedPassiveIP.insert(addr);
+  m_exportShard = m_statusExport->GetShard(m_shardIndex);
+  m_exportStep = 0;
+  m_exportTimer = m_scheduler->MakeTimer("Export");
+  m_exportTimer->SetCallback(handleExportTimerCallback, this);
+  m_exportTimer->SetPriority(Timer::Priority::Low);
+  m_exportTimer->SetMsTimer(ExportRefreshMs / ExportRefreshSteps);
 }
 
-void Beacon::BlockPassiveIP(const IpAddr &addr)
+void Beacon::handleExportTimerCallback(Timer *ATTR_UNUSED(timer), void *userdata)
 {
-  LogAssert(m_scheduler->IsMainThread());
-
-  m_allowedPassiveIP.erase(addr);
+  reinterpret_cast<Beacon *>(userdata)->handleExportTimer();
 }
 
-void Beacon::AllowAllPassiveConnections(bool allow)
+/**
+ * Rewrites the exported records of a part of the sessions, so that all of them
+ * are rewritten every ExportRefreshMs, without a long pause for any one pass.
+ */
+void Beacon::handleExportTimer()
 {
-  LogAssert(m_scheduler->IsMainThread());
-
-  m_allowAnyPassiveIP = allow;
-}
+  size_t slots = m_IdMap.SlotCount();
+  size_t begin = slots * m_exportStep / ExportRefreshSteps;
+  size_t end = slots * (m_exportStep + 1) / ExportRefreshSteps;
 
+  for (size_t index = begin; index < end; index++)
+  {
+    Session *session = m_IdMap.GetSlot(index);
+    if (session)
+      session->ExportStatus();
+  }
 
-void Beacon::RequestShutdown()
-{
-  gLog.Message(Log::App, "Received shutdown request.");
+  if (++m_exportStep == ExportRefreshSteps)
+  {
+    m_exportStep = 0;
+    atomicStore(&m_exportShard->refreshTime, uint64_t(m_scheduler->LoopTime().ToNanoseconds()));
+    if (m_publishSchedulerStats)
+      publishSchedulerStats();
+  }
 
-  AutoQuickLock lock(m_paramsLock);
-  m_shutownRequested = true;
-  triggerSelfMessage();
+  m_exportTimer->SetMsTimer(ExportRefreshMs / ExportRefreshSteps);
 }
 
-bool Beacon::IsShutdownRequested()
+/**
+ * Copies the scheduler statistics for GetPublishedSchedulerStats(), guarded by
+ * m_schedulerStatsSequence, in the same way as StatusExport::Write().
+ */
+void Beacon::publishSchedulerStats()
 {
-  AutoQuickLock lock(m_paramsLock);
-  return m_shutownRequested;
+  Scheduler::Stats stats;
+  m_scheduler->GetStats(stats);
+
+  uint32_t *dest = reinterpret_cast<uint32_t *>(&m_schedulerStats);
+  const uint32_t *src = reinterpret_cast<const uint32_t *>(&stats);
+  uint32_t sequence = m_schedulerStatsSequence;
+
+  atomicStore(&m_schedulerStatsSequence, sequence + 1);
+  atomicFence();
+  for (size_t index = 0; index < sizeof(stats) / sizeof(uint32_t); index++)
+    atomicStoreRelaxed(dest + index, src[index]);
+  atomicStore(&m_schedulerStatsSequence, sequence + 2);
 }
 
-Session* Beacon::FindSessionId(uint32_t id)
+/**
+ * Starts the overload controller's timer, if it is enabled. Call from
+ * startScheduler().
+ */
+void Beacon::startOverloadControl()
 {
-  LogAssert(m_scheduler->IsMainThread());
+  if (!m_overloadParams.enabled)
+    return;
 
-  IdMapIt found = m_IdMap.find(id);
-  if (found == m_IdMap.end())
-    return NULL;
-  return found->second;
+  Scheduler::Stats stats;
+  m_scheduler->GetStats(stats);
+  m_overloadLateness = stats.timerLateness[Timer::Priority::Low];
+  m_overloadLateness.Merge(stats.timerLateness[Timer::Priority::Hi]);
+  m_overloadBusyTime = stats.iterationTime.Sum();
+  m_overloadCheckTime = m_scheduler->LoopTime();
+
+  // High priority, so that the check is not put off by the very load it is
+  // looking for.
+  m_overloadTimer = m_scheduler->MakeTimer("Overload");
+  m_overloadTimer->SetCallback(handleOverloadTimerCallback, this);
+  m_overloadTimer->SetPriority(Timer::Priority::Hi);
+  m_overloadTimer->SetMsTimer(OverloadCheckMs);
 }
 
-
-Session* Beacon::FindSessionIp(const IpAddr &remoteAddr, const IpAddr &localAddr)
+void Beacon::handleOverloadTimerCallback(Timer *ATTR_UNUSED(timer), void *userdata)
 {
-  LogAssert(m_scheduler->IsMainThread());
-  return findInSourceMap(remoteAddr, localAddr);
+  reinterpret_cast<Beacon *>(userdata)->handleOverloadTimer();
 }
 
 /**
- *
- * @param remoteAddr [in] - Port ignored
- * @param localAddr [in] - Port ignored
- *
- * @return Session* - NULL on failure
+ * Measures the load since the last check, from the scheduler statistics, and
+ * slows or restores low priority sessions as needed.
  */
-Session* Beacon::findInSourceMap(const IpAddr &remoteAddr, const IpAddr &localAddr)
+void Beacon::handleOverloadTimer()
 {
-  LogAssert(m_scheduler->IsMainThread());
-  SourceMapIt found = m_sourceMap.find(SourceMapKey(remoteAddr, localAddr));
-  if (found == m_sourceMap.end())
-    return NULL;
-  return found->second;
-}
+  Scheduler::Stats stats;
+  m_scheduler->GetStats(stats);
+  TimeSpec now(m_scheduler->LoopTime());
+
+  Histogram lateness(stats.timerLateness[Timer::Priority::Low]);
+  lateness.Merge(stats.timerLateness[Timer::Priority::Hi]);
+  Histogram window(lateness);
+  // After the statistics are reset, everything is since then.
+  if (!window.Subtract(m_overloadLateness))
+    window = lateness;
+  m_overloadLateness = lateness;
+
+  uint64_t busyTime = stats.iterationTime.Sum();
+  uint64_t busyDelta = busyTime >= m_overloadBusyTime ? busyTime - m_overloadBusyTime : busyTime;
+  int64_t elapsedUs = (now - m_overloadCheckTime).ToNanoseconds() / TimeSpec::NSecPerUs;
+  m_overloadBusyTime = busyTime;
+  m_overloadCheckTime = now;
+
+  m_overloadStats.latenessP99 = window.Percentile(99);
+  m_overloadStats.busyPercent = elapsedUs > 0 ? uint32_t(min(busyDelta * 100 / uint64_t(elapsedUs), uint64_t(100))) : 0;
+
+  bool overloaded = m_overloadStats.latenessP99 > m_overloadParams.latenessUs
+     || m_overloadStats.busyPercent >= m_overloadParams.busyPercent;
+
+  if (overloaded)
+  {
+    m_overloadQuietTime.clear();
+    if (!m_overloadStats.overloaded)
+    {
+      m_overloadStats.overloaded = true;
+      m_overloadStats.overloads++;
+      m_overloadSweeping = true;
+      gLog.LogWarn("Shard %zu is overloaded, timer lateness %s us, busy %u%%. Slowing low priority sessions to %s us.",
+                   m_shardIndex, FormatInteger(m_overloadStats.latenessP99), m_overloadStats.busyPercent,
+                   FormatInteger(m_overloadParams.backoffInterval));
+    }
+  }
+  else if (m_overloadStats.overloaded)
+  {
+    if (m_overloadQuietTime.empty())
+      m_overloadQuietTime = now;
+    else if ((now - m_overloadQuietTime).ToNanoseconds() >= int64_t(m_overloadParams.holdMs) * TimeSpec::NSecPerMs)
+    {
+      m_overloadStats.overloaded = false;
+      m_overloadStats.recoveries++;
+      // Make sure that a whole sweep is made, from slot 0.
+      m_overloadSweepChanged++;
+      gLog.Message(Log::App, "Shard %zu is no longer overloaded. Restoring low priority sessions.", m_shardIndex);
+    }
+  }
 
+  if (m_overloadSweeping)
+    sweepBackoff();
 
-void Beacon::GetSessionIdList(std::vector<uint32_t> &outList)
-{
-  LogAssert(m_scheduler->IsMainThread());
+  m_overloadTimer->SetMsTimer(OverloadCheckMs);
+}
 
-  outList.clear();
-  outList.reserve(m_IdMap.size());
+/**
+ * Moves on through the sessions, slowing low priority sessions while
+ * overloaded, and restoring all others. Stops once a whole pass changes nothing
+ * while not overloaded. While overloaded, the sweep goes on, so that new low
+ * priority sessions are slowed too.
+ */
+void Beacon::sweepBackoff()
+{
+  size_t slots = m_IdMap.SlotCount();
+  size_t changed = 0;
+  bool overloaded = m_overloadStats.overloaded;
 
-  for (IdMapIt found = m_IdMap.begin(); found != m_IdMap.end(); found++)
+  for (size_t visited = 0; visited < OverloadSweepSlots && changed < OverloadSweepChanges; visited++)
   {
-    outList.push_back(found->first);
+    if (m_overloadCursor >= slots)
+    {
+      m_overloadCursor = 0;
+      if (!overloaded && m_overloadSweepChanged + changed == 0)
+      {
+        m_overloadSweeping = false;
+        gLog.Optional(Log::App, "Shard %zu restored all sessions.", m_shardIndex);
+        return;
+      }
+      m_overloadSweepChanged = 0;
+      changed = 0;
+      if (slots == 0)
+        break;
+    }
+
+    Session *session = m_IdMap.GetSlot(m_overloadCursor++);
+    if (!session)
+      continue;
+
+    uint32_t backoff = (overloaded && session->IsLowPriority()) ? m_overloadParams.backoffInterval : 0;
+    if (session->GetBackoff() == backoff)
+      continue;
+    session->SetBackoff(backoff);
+    changed++;
+    if (backoff)
+      m_overloadStats.backoffs++;
+    else
+      m_overloadStats.restores++;
   }
+
+  m_overloadSweepChanged += changed;
 }
 
+void Beacon::GetOverloadStats(OverloadStats &outStats)
+{
+  LogAssert(m_scheduler->IsMainThread());
 
-void Beacon::KillSession(Session *session)
+  outStats = m_overloadStats;
+  outStats.params = m_overloadParams;
+  outStats.lowPriority = 0;
+  outStats.backedOff = 0;
+  for (size_t index = 0; index < m_IdMap.SlotCount(); index++)
+  {
+    Session *session = m_IdMap.GetSlot(index);
+    if (!session)
+      continue;
+    if (session->IsLowPriority())
+      outStats.lowPriority++;
+    if (session->GetBackoff())
+      outStats.backedOff++;
+  }
+}
+
+uint32_t Beacon::FindProfile(const char *name)
 {
+  LogAssert(m_scheduler->IsMainThread());
 
-  if (!LogVerify(session))
-    return;
+  for (size_t id = 0; id < m_profiles.size(); id++)
+  {
+    if (!m_profiles[id].name.empty() && m_profiles[id].name == name)
+      return uint32_t(id);
+  }
+  return NoProfile;
+}
 
+uint32_t Beacon::MakeProfile(const char *name)
+{
   LogAssert(m_scheduler->IsMainThread());
 
-  LogVerify(1 == m_discMap.erase(session->GetLocalDiscriminator()));
-  LogVerify(1 == m_IdMap.erase(session->GetId()));
-  LogVerify(1 == m_sourceMap.erase(SourceMapKey(session->GetRemoteAddress(), session->GetLocalAddress())));
+  if (!LogVerify(*name && FindProfile(name) == NoProfile))
+    return NoProfile;
+  if (m_profiles.size() >= MaxProfiles)
+    return NoProfile;
 
-  LogOptional(Log::Session, "Removed session %s to %s id=%d.",
-              session->GetLocalAddress().ToString(),
-              session->GetRemoteAddress().ToString(),
-              session->GetId());
+  Profile profile(name);
+  profile.params = m_profiles[DefaultProfile].params;
+  m_profiles.push_back(profile);
+  gLog.Optional(Log::App, "Shard %zu made profile %s.", m_shardIndex, name);
+  return uint32_t(m_profiles.size() - 1);
+}
+
+bool Beacon::DeleteProfile(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
 
-  delete session;
+  if (!isProfile(id) || id == DefaultProfile)
+    return false;
+
+  gLog.Optional(Log::App, "Shard %zu deleted profile %s.", m_shardIndex, m_profiles[id].name.c_str());
+  m_profiles[id].name.clear();
+  if (m_newSessionProfile == id)
+    m_newSessionProfile = DefaultProfile;
+  // The sessions are moved by the rollout.
+  startProfileRollout();
+  return true;
 }
 
+const Session::InitialParams* Beacon::GetProfileParams(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
 
+  if (!isProfile(id))
+    return NULL;
+  return &m_profiles[id].params;
+}
 
-bool Beacon::QueueOperation(OperationCallback callback, void *userdata, bool waitForCompletion)
+bool Beacon::SetProfileParams(uint32_t id, const Session::InitialParams &params)
 {
-  WaitCondition condition(false);
-  PendingOperation operation;
-  PendingOperation *useOperation;
-  Raii<PendingOperation>::Delete allocOperation;
+  LogAssert(m_scheduler->IsMainThread());
 
+  if (!isProfile(id))
+    return false;
 
-  if (!callback)
+  Profile &profile = m_profiles[id];
+  profile.params = params;
+  if (++profile.version == 0)
+    profile.version = 1;
+  startProfileRollout();
+  return true;
+}
+
+bool Beacon::SetSessionProfile(Session *session, uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!isProfile(id))
+    return false;
+
+  if (session->GetProfileId() == id)
+    return true;
+  session->SetProfile(id, 0);
+  startProfileRollout();
+  return true;
+}
+
+bool Beacon::SetNewSessionProfile(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!isProfile(id))
+    return false;
+  m_newSessionProfile = id;
+  return true;
+}
+
+const char* Beacon::GetSessionProfileName(Session *session)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  // A deleted profile's sessions are on their way to the default.
+  uint32_t id = session->GetProfileId();
+  return isProfile(id) ? m_profiles[id].name.c_str() : DefaultProfileName;
+}
+
+bool Beacon::IsProfileCurrent(Session *session)
+{
+  uint32_t id = session->GetProfileId();
+  return isProfile(id) && session->GetProfileVersion() == m_profiles[id].version;
+}
+
+void Beacon::GetProfiles(vector<ProfileInfo> &outProfiles)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  outProfiles.clear();
+  vector<size_t> index(m_profiles.size(), SIZE_MAX);
+  for (size_t id = 0; id < m_profiles.size(); id++)
   {
-    LogAssert(false);
+    const Profile &profile = m_profiles[id];
+    if (profile.name.empty())
+      continue;
+    index[id] = outProfiles.size();
+    outProfiles.push_back(ProfileInfo());
+    ProfileInfo &info = outProfiles.back();
+    info.id = uint32_t(id);
+    info.name = profile.name;
+    info.params = profile.params;
+    info.version = profile.version;
+    info.forNewSessions = (id == m_newSessionProfile);
+  }
+
+  for (size_t slot = 0; slot < m_IdMap.SlotCount(); slot++)
+  {
+    Session *session = m_IdMap.GetSlot(slot);
+    if (!session)
+      continue;
+    uint32_t id = session->GetProfileId();
+    ProfileInfo &info = outProfiles[index[isProfile(id) ? id : DefaultProfile]];
+    info.sessions++;
+    if (!IsProfileCurrent(session))
+      info.pending++;
+  }
+}
+
+uint32_t Beacon::FindAuthKey(const char *name)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  for (size_t id = 0; id < m_authKeys.size(); id++)
+  {
+    if (!m_authKeys[id].name.empty() && m_authKeys[id].name == name)
+      return uint32_t(id);
+  }
+  return NoAuthKey;
+}
+
+uint32_t Beacon::SetAuthKey(const char *name, const AuthKey &key)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!LogVerify(*name && key.GetType() != bfd::AuthType::None))
+    return NoAuthKey;
+
+  uint32_t id = FindAuthKey(name);
+  if (id == NoAuthKey)
+  {
+    if (m_authKeys.size() >= MaxAuthKeys)
+      return NoAuthKey;
+    m_authKeys.push_back(NamedAuthKey());
+    m_authKeys.back().name = name;
+    m_authKeys.back().key = key;
+    gLog.Optional(Log::App, "Shard %zu made authentication key %s.", m_shardIndex, name);
+    return uint32_t(m_authKeys.size() - 1);
+  }
+
+  m_authKeys[id].key = key;
+  gLog.Optional(Log::App, "Shard %zu changed authentication key %s.", m_shardIndex, name);
+  for (size_t slot = 0; slot < m_IdMap.SlotCount(); slot++)
+  {
+    Session *session = m_IdMap.GetSlot(slot);
+    if (session && session->GetAuthKeyId() == id)
+      session->RefreshAuthKey();
+  }
+  return id;
+}
+
+bool Beacon::DeleteAuthKey(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!isAuthKey(id))
     return false;
+
+  gLog.Optional(Log::App, "Shard %zu deleted authentication key %s.", m_shardIndex, m_authKeys[id].name.c_str());
+  for (size_t slot = 0; slot < m_IdMap.SlotCount(); slot++)
+  {
+    Session *session = m_IdMap.GetSlot(slot);
+    if (session && session->GetAuthKeyId() == id)
+      session->SetAuthKey(NoAuthKey);
+  }
+  // Cleared last, since the sessions look the key up.
+  m_authKeys[id].name.clear();
+  for (size_t profile = 0; profile < m_profiles.size(); profile++)
+  {
+    if (m_profiles[profile].params.authKey == id)
+      m_profiles[profile].params.authKey = NoAuthKey;
   }
+  return true;
+}
 
-  operation.callback = callback;
-  operation.userdata = userdata;
-  operation.completed = false;
-  if (waitForCompletion)
+const AuthKey* Beacon::GetAuthKey(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!isAuthKey(id))
+    return NULL;
+  return &m_authKeys[id].key;
+}
+
+const char* Beacon::GetAuthKeyName(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  return isAuthKey(id) ? m_authKeys[id].name.c_str() : "none";
+}
+
+void Beacon::GetAuthKeys(vector<AuthKeyInfo> &outKeys)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  outKeys.clear();
+  vector<size_t> index(m_authKeys.size(), SIZE_MAX);
+  for (size_t id = 0; id < m_authKeys.size(); id++)
   {
-    if (!condition.Init())
+    const NamedAuthKey &entry = m_authKeys[id];
+    if (entry.name.empty())
+      continue;
+    index[id] = outKeys.size();
+    outKeys.push_back(AuthKeyInfo());
+    AuthKeyInfo &info = outKeys.back();
+    info.id = uint32_t(id);
+    info.name = entry.name;
+    info.type = entry.key.GetType();
+    info.keyId = entry.key.GetKeyId();
+  }
+
+  for (size_t profile = 0; profile < m_profiles.size(); profile++)
+  {
+    uint32_t id = m_profiles[profile].params.authKey;
+    if (!m_profiles[profile].name.empty() && isAuthKey(id))
+      outKeys[index[id]].profiles++;
+  }
+
+  for (size_t slot = 0; slot < m_IdMap.SlotCount(); slot++)
+  {
+    Session *session = m_IdMap.GetSlot(slot);
+    if (session && isAuthKey(session->GetAuthKeyId()))
+      outKeys[index[session->GetAuthKeyId()]].sessions++;
+  }
+}
+
+/**
+ * Starts, or continues, moving sessions to the settings of their profiles. See
+ * SetProfileParams().
+ */
+void Beacon::startProfileRollout()
+{
+  // Make sure that a whole pass is made, from wherever the cursor is.
+  m_profilePassChanged++;
+
+  if (!m_profileTimer)
+  {
+    m_profileTimer = m_scheduler->MakeTimer("Profile");
+    m_profileTimer->SetCallback(handleProfileTimerCallback, this);
+    m_profileTimer->SetPriority(Timer::Priority::Low);
+  }
+  if (m_profileTimer->IsStopped())
+    m_profileTimer->SetMsTimer(ProfileRolloutMs);
+}
+
+void Beacon::handleProfileTimerCallback(Timer *ATTR_UNUSED(timer), void *userdata)
+{
+  reinterpret_cast<Beacon *>(userdata)->handleProfileTimer();
+}
+
+/**
+ * Gives the next few out of date sessions the settings of their profile. Stops
+ * once a whole pass finds none.
+ */
+void Beacon::handleProfileTimer()
+{
+  size_t slots = m_IdMap.SlotCount();
+  size_t budget = max(size_t(1), size_t(m_profileRate) * ProfileRolloutMs / 1000);
+  size_t changed = 0;
+
+  for (size_t visited = 0; visited < ProfileSweepSlots && changed < budget; visited++)
+  {
+    if (m_profileCursor >= slots)
+    {
+      m_profileCursor = 0;
+      if (m_profilePassChanged == 0)
+      {
+        gLog.Optional(Log::App, "Shard %zu sessions have their profile settings.", m_shardIndex);
+        return;
+      }
+      m_profilePassChanged = 0;
+      if (slots == 0)
+        break;
+    }
+
+    Session *session = m_IdMap.GetSlot(m_profileCursor++);
+    if (!session || IsProfileCurrent(session))
+      continue;
+
+    uint32_t id = session->GetProfileId();
+    if (!isProfile(id))
+      id = DefaultProfile;
+    session->ApplyProfile(id, m_profiles[id].version, m_profiles[id].params);
+    changed++;
+    m_profilePassChanged++;
+  }
+
+  m_profileTimer->SetMsTimer(ProfileRolloutMs);
+}
+
+bool Beacon::GetPublishedSchedulerStats(size_t shard, Scheduler::Stats &outStats)
+{
+  if (shard >= m_primary->m_shards.size())
+    return false;
+
+  Beacon *beacon = m_primary->m_shards[shard];
+  uint32_t *src = reinterpret_cast<uint32_t *>(&beacon->m_schedulerStats);
+  uint32_t *dest = reinterpret_cast<uint32_t *>(&outStats);
+
+  for (uint32_t tries = 1; tries <= 10000; tries++)
+  {
+    uint32_t sequence = atomicLoad(&beacon->m_schedulerStatsSequence);
+    if (sequence == 0)
       return false;
-    operation.waitCondition = &condition;
-    useOperation = &operation;
+    if ((sequence & 1) == 0)
+    {
+      for (size_t index = 0; index < sizeof(outStats) / sizeof(uint32_t); index++)
+        atomicStoreRelaxed(dest + index, atomicLoadRelaxed(src + index));
+      atomicFence();
+      if (atomicLoad(&beacon->m_schedulerStatsSequence) == sequence)
+        return true;
+    }
+    if (tries % 64 == 0)
+      sched_yield();
   }
+  return false;
+}
+
+StatusExportRecord* Beacon::AcquireExportRecord(size_t statusSlot)
+{
+  if (!m_exportShard)
+    return NULL;
+
+  StatusExportRecord *record = m_statusExport->GetRecord(m_shardIndex, statusSlot);
+  if (record)
+    atomicStore(&m_exportShard->sessions, m_exportShard->sessions + 1);
   else
+    atomicStore(&m_exportShard->missing, m_exportShard->missing + 1);
+  return record;
+}
+
+void Beacon::ReleaseExportRecord(StatusExportRecord *record)
+{
+  if (!m_exportShard)
+    return;
+
+  if (record)
   {
-    allocOperation = useOperation = new(std::nothrow) PendingOperation;
-    if (!useOperation)
-      return false;
+    StatusExport::Clear(*record);
+    atomicStore(&m_exportShard->sessions, m_exportShard->sessions - 1);
+  }
+  else
+    atomicStore(&m_exportShard->missing, m_exportShard->missing - 1);
+}
+
+/**
+ * Pins the calling thread, which must be the one that runs this shard's
+ * scheduler, and raises its priority, as configured.
+ */
+void Beacon::applyRealtime()
+{
+  const RealtimeParams &params = m_realtimeParams;
+  int err;
+
+  m_realtimeStatus.cpu = params.cpus.empty() ? -1 : params.cpus[m_shardIndex % params.cpus.size()];
+  m_realtimeStatus.fifoPriority = params.fifoPriority;
+
+  if (m_realtimeStatus.cpu != -1)
+  {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (m_realtimeStatus.cpu < CPU_SETSIZE)
+      CPU_SET(m_realtimeStatus.cpu, &cpus);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err == 0)
+    {
+      m_realtimeStatus.pinned = true;
+      gLog.Optional(Log::App, "Shard %zu pinned to CPU %d.", m_shardIndex, m_realtimeStatus.cpu);
+    }
+    else
+      gLog.ErrnoError(err, FormatShortStr("Failed to pin shard %zu to CPU %d", m_shardIndex, m_realtimeStatus.cpu));
+#else
+    gLog.LogWarn("CPU pinning is not supported on this system. Shard %zu is not pinned.", m_shardIndex);
+#endif
+  }
+
+  if (params.fifoPriority != 0)
+  {
+    struct sched_param schedParam;
+    memset(&schedParam, 0, sizeof(schedParam));
+    schedParam.sched_priority = params.fifoPriority;
+    err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &schedParam);
+    if (err == 0)
+    {
+      m_realtimeStatus.fifo = true;
+      gLog.Optional(Log::App, "Shard %zu running with SCHED_FIFO priority %d.", m_shardIndex, params.fifoPriority);
+    }
+    else
+      gLog.ErrnoError(err, FormatShortStr("Failed to set SCHED_FIFO priority %d for shard %zu", params.fifoPriority, m_shardIndex));
+  }
+}
+
+/**
+ * @return size_t - Bytes held for sessions, their lookup maps, and timers.
+ */
+size_t Beacon::storageBytes()
+{
+  SlabPool::Stats poolStats;
+  Scheduler::Stats schedulerStats;
+
+  m_sessionPool.GetStats(poolStats);
+  m_scheduler->GetStats(schedulerStats);
+  return poolStats.slabBytes + schedulerStats.timerBytes
+         + m_discMap.GetMemoryBytes() + m_IdMap.GetMemoryBytes() + m_sourceMap.GetMemoryBytes();
+}
+
+void Beacon::GetRealtimeStatus(RealtimeStatus &outStatus)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  outStatus = m_realtimeStatus;
+  // Only done by the primary, before the shards start.
+  outStatus.lockMemory = m_primary->m_realtimeParams.lockMemory;
+  outStatus.memoryLocked = m_primary->m_realtimeStatus.memoryLocked;
+  outStatus.sessions = m_IdMap.Size();
+  outStatus.storageBytes = storageBytes();
+}
+
+/**
+ * Opens the packet ring, which replaces the listen sockets for receiving
+ * control packets.
+ *
+ * @return bool - false on failure.
+ */
+bool Beacon::startPacketRing(const list<IpAddr> &listenAddrs)
+{
+  m_ringListenAddrs = listenAddrs;
+  m_packetRing = new PacketRing();
+
+  // Shards share the packets, by flow. Any that reach the wrong shard are
+  // forwarded, as with the listen sockets.
+  int fanoutGroup = m_shardCount > 1 ? int(getpid() & 0xFFFF) : -1;
+  if (!m_packetRing->Open(m_receiveRingFrames, bfd::ListenPort, fanoutGroup))
+  {
+    gLog.LogError("Failed to open packet receive ring. Aborting.");
+    return false;
+  }
+
+  if (!m_scheduler->SetSocketCallback(m_packetRing->GetSocket(), handlePacketRingCallback, this))
+  {
+    gLog.LogError("Failed to set m_scheduler socket processing for packet ring. Aborting.");
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Deletes the scheduler, transmit engine and transmit queue. Call on the
+ * scheduler's thread, after the scheduler has stopped.
+ */
+void Beacon::stopScheduler()
+{
+  if (m_exportTimer)
+  {
+    m_scheduler->FreeTimer(m_exportTimer);
+    m_exportTimer = NULL;
+  }
+  m_exportShard = NULL;
+  // The sockets themselves belong to the callback data.
+  m_echoSockets.clear();
+  if (m_overloadTimer)
+  {
+    m_scheduler->FreeTimer(m_overloadTimer);
+    m_overloadTimer = NULL;
+  }
+  if (m_profileTimer)
+  {
+    m_scheduler->FreeTimer(m_profileTimer);
+    m_profileTimer = NULL;
+  }
+
+  // The engine sends on its own copies of the sockets, so it can go first.
+  TransmitEngine *oldTransmitEngine = m_transmitEngine;
+  m_transmitEngine = NULL;
+  delete oldTransmitEngine;
+
+  TransmitQueue *oldTransmitQueue = m_transmitQueue;
+  m_transmitQueue = NULL;
+  delete oldTransmitQueue;
+
+  Scheduler *oldScheduler;
+  {
+    AutoQuickLock lock(m_paramsLock);
+    atomicStore(&m_shutownRequested, true);
+  }
+
+  // No more operations can be queued. Wait for any that are being queued, and
+  // then run what is left, so that no caller is left waiting. The callbacks
+  // will see that a shutdown was requested.
+  while (atomicLoad(&m_operationPushers) != 0)
+    sched_yield();
+  if (m_scheduler)
+    drainOperations();
+
+  {
+    AutoQuickLock lock(m_paramsLock);
+    oldScheduler = m_scheduler;
+    m_scheduler = NULL;
+  }
+  delete oldScheduler;
+
+  PacketRing *oldPacketRing = m_packetRing;
+  m_packetRing = NULL;
+  delete oldPacketRing;
+}
+
+/**
+ * Creates and starts the additional shards. Each shard creates its scheduler on
+ * its own thread. None of them run until all have started, so that a shard
+ * never forwards a packet to a shard without a scheduler.
+ *
+ * @note call only from the primary before its scheduler runs.
+ *
+ * @return bool - false on failure. Call stopShards() in either case.
+ */
+bool Beacon::startShards(const list<IpAddr> &listenAddrs)
+{
+  // Shards share the key, since their discriminators differ modulo the shard
+  // count. Seeded here, since rand() is not safe on the shard threads. Restored
+  // sessions keep their discriminators, so the allocators continue from where
+  // they were.
+  uint32_t discKey = uint32_t(rand()) ^ (uint32_t(rand()) << 16);
+  // Our echo packets are told from those of peers by this, see handleEchoPacket().
+  // rand() is seeded with the time, so two beacons started together differ
+  // only by the pid.
+  m_echoInstance = (uint32_t(rand()) ^ (uint32_t(rand()) << 16)) ^ uint32_t(getpid());
+  if (m_restore)
+    discKey = m_restore->GetDiscKey();
+
+  m_shards.clear();
+  m_shards.reserve(m_shardCount);
+  m_shards.push_back(this);
+  m_discAllocator.Init(discKey, 0, m_shardCount);
+  m_discAllocator.SetQuarantine(m_discQuarantineMs);
+  if (m_restore)
+    m_discAllocator.Resume(m_restore->GetDiscNextValue(0));
+
+  // Create them all first, since each shard may look up the others.
+  for (size_t index = 1; index < m_shardCount; index++)
+  {
+    Beacon *shard = new Beacon(*this, index);
+    shard->m_shardListenAddrs = &listenAddrs;
+    shard->m_discAllocator.Init(discKey, index, m_shardCount);
+    shard->m_discAllocator.SetQuarantine(m_discQuarantineMs);
+    if (m_restore)
+      shard->m_discAllocator.Resume(m_restore->GetDiscNextValue(index));
+    m_shards.push_back(shard);
+  }
+
+  for (size_t index = 1; index < m_shards.size(); index++)
+  {
+    Beacon *shard = m_shards[index];
+
+    if (pthread_create(&shard->m_shardThread, NULL, shardThreadCallback, shard))
+    {
+      gLog.LogError("Failed to create thread for shard %zu. Aborting.", index);
+      discardShards(index);
+      return false;
+    }
+
+    AutoQuickLock lock(shard->m_paramsLock);
+    while (!shard->m_shardStartupComplete)
+      lock.LockWait(shard->m_shardStartCondition);
+
+    if (!shard->m_shardStartupSuccess)
+    {
+      gLog.LogError("Failed to start shard %zu. Aborting.", index);
+      lock.UnLock();
+      discardShards(index + 1);
+      return false;
+    }
+  }
+
+  for (size_t index = 1; index < m_shards.size(); index++)
+  {
+    Beacon *shard = m_shards[index];
+    AutoQuickLock lock(shard->m_paramsLock);
+    shard->m_shardRunAllowed = true;
+    lock.SignalAndUnlock(shard->m_shardStartCondition);
+  }
+
+  if (m_shardCount > 1)
+    gLog.Optional(Log::App, "Started %zu shards.", m_shardCount);
+
+  return true;
+}
+
+/**
+ * Deletes shards, starting at first, whose threads have not been started.
+ */
+void Beacon::discardShards(size_t first)
+{
+  for (size_t index = first; index < m_shards.size(); index++)
+    delete m_shards[index];
+  m_shards.resize(first);
+}
+
+/**
+ * Stops all the additional shards, and waits for their threads to exit.
+ *
+ * @note call only from the primary.
+ */
+void Beacon::stopShards()
+{
+  // Flag all of them first, so that none will accept packets forwarded from
+  // another, while they are being stopped.
+  for (size_t index = 1; index < m_shards.size(); index++)
+    m_shards[index]->flagShutdown();
+
+  for (size_t index = 1; index < m_shards.size(); index++)
+  {
+    Beacon *shard = m_shards[index];
+    pthread_join(shard->m_shardThread, NULL);
+    collectSavedSessions(*shard);
+    delete shard;
+  }
+
+  m_shards.clear();
+}
+
+/**
+ * Thread for an additional shard.
+ */
+void Beacon::shardThread()
+{
+  bool success;
+  RaiiNullBase<ListenCallbackDataList, closeListenCallbackDataList> callbackData(new ListenCallbackDataList);
+
+  success = UtilsInitThread() && startScheduler(*m_shardListenAddrs, *callbackData);
+  if (success)
+  {
+    restoreSessions();
+    applyRealtime();
+  }
+
+  {
+    AutoQuickLock lock(m_paramsLock);
+    m_shardListenAddrs = NULL;
+    m_shardStartupSuccess = success;
+    m_shardStartupComplete = true;
+    m_shardStartCondition.Signal();
+
+    while (!m_shardRunAllowed && !m_shutownRequested)
+      lock.LockWait(m_shardStartCondition);
+
+    success = success && !m_shutownRequested;
+  }
+
+  if (success && !m_scheduler->Run())
+    gLog.LogError("Failed to start scheduler for shard %zu.", m_shardIndex);
+  else if (success && !m_primary->m_checkpointPath.empty())
+    saveSessions();
+
+  stopScheduler();
+}
+
+/**
+ * Opens the checkpoint file, if there is one, for the shards to restore their
+ * sessions from. The file is deleted, so that it is used only once.
+ *
+ * @note call only from the primary, before startShards().
+ */
+void Beacon::loadCheckpoint()
+{
+  Raii<SessionCheckpoint>::Delete checkpoint(new SessionCheckpoint);
+  const char *path = m_checkpointPath.c_str();
+
+  if (!checkpoint->Open(path))
+    return;
+
+  // The file stays mapped after it is deleted.
+  if (0 != ::unlink(path))
+    gLog.ErrnoError(errno, FormatShortStr("Failed to delete checkpoint file %s", path));
+
+  if (checkpoint->GetShardCount() != m_shardCount)
+  {
+    gLog.Message(Log::Warn, "Checkpoint file %s is for %zu shards, not %zu. Sessions are not restored.",
+                 path, checkpoint->GetShardCount(), m_shardCount);
+    return;
+  }
+
+  if (checkpoint->GetAge() == UINT64_MAX)
+    gLog.Optional(Log::App, "Restoring %zu sessions from %s. The clock has gone back since it was saved.",
+                  checkpoint->GetSessionCount(), path);
+  else
+    gLog.Optional(Log::App, "Restoring %zu sessions from %s, saved %.3f seconds ago.",
+                  checkpoint->GetSessionCount(), path, double(checkpoint->GetAge()) / 1000000);
+
+  m_restore = checkpoint.Detach();
+}
+
+/**
+ * Resumes the sessions in the checkpoint that belong to this shard. A session
+ * whose peer has already timed it out starts over from Down, or, if it is not
+ * active, is dropped, since the peer will start a new one.
+ *
+ * @note call on the shard's thread, after startScheduler(), and before the
+ *       scheduler runs.
+ */
+void Beacon::restoreSessions()
+{
+  const SessionCheckpoint *checkpoint = m_primary->m_restore;
+  if (!checkpoint)
+    return;
+
+  TimeSpec start(TimeSpec::MonoNow());
+  size_t owned = 0, resumed = 0, restarted = 0, dropped = 0, failed = 0, authenticated = 0;
+
+  for (size_t index = 0; index < checkpoint->GetSessionCount(); index++)
+  {
+    if (checkpoint->GetSession(index).localDiscr % m_shardCount == m_shardIndex)
+      owned++;
+  }
+  if (owned == 0)
+    return;
+  reserveSessions(owned);
+
+  for (size_t index = 0; index < checkpoint->GetSessionCount(); index++)
+  {
+    const Session::SavedState &state = checkpoint->GetSession(index);
+
+    if (state.localDiscr % m_shardCount != m_shardIndex)
+      continue;
+
+    // The discriminator must lead packets to the shard that owns the addresses.
+    if (ownerShard(state.remoteAddr, state.localAddr) != this
+        || findInSourceMap(state.remoteAddr, state.localAddr)
+        || m_discMap.Find(state.localDiscr))
+    {
+      failed++;
+      continue;
+    }
+
+    // The auth keys, and the sequence numbers the peer last saw, are not
+    // saved. A session restored without them would send packets the peer
+    // rejects, or accept packets without authentication.
+    if (state.authType != bfd::AuthType::None)
+    {
+      authenticated++;
+      continue;
+    }
+
+    uint64_t detectionTime = state.GetPeerDetectionTime();
+    bool peerTimedOut = detectionTime != 0 && checkpoint->GetAge() >= detectionTime;
+    if (peerTimedOut && !(state.flags & Session::SavedFlags::Active))
+    {
+      dropped++;
+      continue;
+    }
+
+    Session *session = addSession(state.remoteAddr.ToIpAddr(), state.localAddr.ToIpAddr(), state.localDiscr, state.id);
+    if (!session)
+    {
+      failed++;
+      continue;
+    }
+
+    if (!session->Restore(state, peerTimedOut))
+    {
+      m_discMap.Erase(session->GetLocalDiscriminator());
+      m_IdMap.Erase(session->GetId());
+      m_sourceMap.Erase(AddressPairKey(state.remoteAddr, state.localAddr));
+      freeSession(session);
+      failed++;
+      continue;
+    }
+
+    if (peerTimedOut)
+      restarted++;
+    else
+      resumed++;
+  }
+
+  gLog.Optional(Log::App, "Shard %zu restored %zu sessions in %.3f ms. %zu resumed, %zu restarted, %zu dropped, %zu failed.",
+                m_shardIndex, resumed + restarted, (TimeSpec::MonoNow() - start).ToDecimal() * 1000,
+                resumed, restarted, dropped, failed);
+  if (authenticated != 0)
+    gLog.LogWarn("Shard %zu did not restore %zu sessions that use authentication, since auth keys are not saved.",
+                 m_shardIndex, authenticated);
+}
+
+/**
+ * Records the state of this shard's sessions, for the checkpoint file.
+ *
+ * @note call on the shard's thread, after its scheduler has stopped.
+ */
+void Beacon::saveSessions()
+{
+  m_savedSessions.clear();
+  try
+  {
+    m_savedSessions.resize(m_IdMap.Size());
+    size_t count = 0;
+    for (size_t index = 0; index < m_IdMap.SlotCount(); index++)
+    {
+      Session *session = m_IdMap.GetSlot(index);
+      if (session && LogVerify(count < m_savedSessions.size()))
+        session->GetSavedState(m_savedSessions[count++]);
+    }
+    m_savedSessions.resize(count);
+  }
+  catch (std::bad_alloc &)
+  {
+    gLog.LogError("Not enough memory to save %zu sessions for shard %zu.", m_IdMap.Size(), m_shardIndex);
+    m_savedSessions.clear();
+    return;
+  }
+
+  if (m_primary == this)
+  {
+    m_savedDiscNextValues.assign(m_shardCount, 0);
+    m_savedDiscNextValues[0] = m_discAllocator.GetNextValue();
+  }
+  m_sessionsSaved = true;
+}
+
+/**
+ * Adds a stopped shard's saved sessions to those of the primary. If any shard
+ * did not save its sessions, then no checkpoint is written.
+ *
+ * @note call only from the primary, after the shard's thread has exited.
+ */
+void Beacon::collectSavedSessions(const Beacon &shard)
+{
+  if (!m_sessionsSaved)
+    return;
+
+  if (!shard.m_sessionsSaved)
+  {
+    gLog.LogError("Shard %zu did not save its sessions. No checkpoint is written.", shard.m_shardIndex);
+    m_sessionsSaved = false;
+    m_savedSessions.clear();
+    return;
+  }
+
+  try
+  {
+    m_savedSessions.insert(m_savedSessions.end(), shard.m_savedSessions.begin(), shard.m_savedSessions.end());
+  }
+  catch (std::bad_alloc &)
+  {
+    gLog.LogError("Not enough memory to save sessions for shard %zu. No checkpoint is written.", shard.m_shardIndex);
+    m_sessionsSaved = false;
+    m_savedSessions.clear();
+    return;
+  }
+  m_savedDiscNextValues[shard.m_shardIndex] = shard.m_discAllocator.GetNextValue();
+}
+
+/**
+ * Writes the sessions saved by all the shards to the checkpoint file.
+ *
+ * @note call only from the primary, after stopShards().
+ */
+void Beacon::writeCheckpoint()
+{
+  const char *path = m_checkpointPath.c_str();
+  TimeSpec start(TimeSpec::MonoNow());
+
+  if (SessionCheckpoint::Write(path, m_discAllocator.GetKey(), m_savedDiscNextValues, m_savedSessions))
+    gLog.Optional(Log::App, "Saved %zu sessions to %s in %.3f ms.",
+                  m_savedSessions.size(), path, (TimeSpec::MonoNow() - start).ToDecimal() * 1000);
+
+  m_savedSessions.clear();
+  m_sessionsSaved = false;
+}
+
+/**
+ * Marks this shard as shutting down, and wakes it.
+ *
+ * @Note can be called from any thread.
+ */
+void Beacon::flagShutdown()
+{
+  AutoQuickLock lock(m_paramsLock);
+  atomicStore(&m_shutownRequested, true);
+  if (m_scheduler)
+    triggerSelfMessage();
+  lock.SignalAndUnlock(m_shardStartCondition);
+}
+
+void Beacon::SetReceiveBatchSize(size_t batchSize)
+{
+  LogAssert(m_scheduler == NULL);
+
+  if (!LogVerify(batchSize > 0))
+    batchSize = 1;
+  m_receiveBatchSize = min(batchSize, MaxReceiveBatchSize);
+}
+
+void Beacon::SetReceiveBudget(size_t packets)
+{
+  LogAssert(m_scheduler == NULL);
+
+  if (!LogVerify(packets > 0))
+    packets = 1;
+  m_receiveBudget = min(packets, MaxReceiveBudget);
+}
+
+void Beacon::SetDiscriminatorQuarantine(uint32_t quarantineMs)
+{
+  LogAssert(m_scheduler == NULL);
+  m_discQuarantineMs = quarantineMs;
+}
+
+void Beacon::SetCheckpointFile(const char *path)
+{
+  LogAssert(m_scheduler == NULL);
+  m_checkpointPath = path ? path : "";
+}
+
+void Beacon::SetStatusExport(const char *path, size_t maxSessions)
+{
+  LogAssert(m_scheduler == NULL);
+  m_statusExportPath = path ? path : "";
+  m_statusExportSessions = maxSessions;
+}
+
+void Beacon::SetMetrics(const SockAddr &addr)
+{
+  LogAssert(m_scheduler == NULL);
+  m_metricsAddr = addr;
+  m_publishSchedulerStats = addr.IsValid();
+}
+
+void Beacon::SetCapture(const char *path)
+{
+  LogAssert(m_scheduler == NULL);
+  m_capturePath = path ? path : "";
+}
+
+bool Beacon::StartCapture(const char *path, uint64_t limit)
+{
+  Beacon &primary = *m_primary;
+  AutoQuickLock lock(primary.m_captureLock, true);
+
+  if (primary.m_captureOwner && !primary.stopCapture())
+    return false;
+
+  Raii<PacketCapture>::Delete capture(new PacketCapture());
+  if (!capture->Start(path, m_shardCount, PacketCapture::DefaultRingSize, limit))
+    return false;
+
+  // Once this returns, every shard is recording. If it fails, then the beacon
+  // is shutting down, and Run() deletes the capture once the shards stop.
+  primary.m_captureOwner = capture.Detach();
+  return primary.QueueOperation(setCaptureCallback, primary.m_captureOwner, true);
+}
+
+bool Beacon::StopCapture()
+{
+  AutoQuickLock lock(m_primary->m_captureLock, true);
+  return m_primary->stopCapture();
+}
+
+/**
+ * Stops the capture. Call on the primary, with m_captureLock.
+ *
+ * @return bool - false if there was none, or the beacon is shutting down.
+ */
+bool Beacon::stopCapture()
+{
+  if (!m_captureOwner)
+    return false;
+
+  // Once this returns no shard is recording, so the file can be closed. If it
+  // fails, then the beacon is shutting down, and Run() deletes it.
+  if (!QueueOperation(setCaptureCallback, NULL, true))
+    return false;
+  delete m_captureOwner;
+  m_captureOwner = NULL;
+  return true;
+}
+
+/**
+ * Called on each shard's main thread, to start or stop recording.
+ *
+ * @param userdata [in] - The PacketCapture, or NULL to stop.
+ */
+void Beacon::setCaptureCallback(Beacon *beacon, void *userdata)
+{
+  beacon->m_capture = reinterpret_cast<PacketCapture *>(userdata);
+}
+
+bool Beacon::GetCaptureStatus(CaptureStatus &outStatus)
+{
+  AutoQuickLock lock(m_primary->m_captureLock, true);
+  if (!m_primary->m_captureOwner)
+    return false;
+  outStatus.path = m_primary->m_captureOwner->GetPath();
+  m_primary->m_captureOwner->GetStats(outStatus.stats);
+  return true;
+}
+
+void Beacon::SetTransmitBatching(size_t maxDepth, uint32_t window, bool sharedSockets)
+{
+  LogAssert(m_scheduler == NULL);
+
+  m_transmitDepth = maxDepth;
+  m_transmitWindow = window;
+  m_transmitSharedSockets = sharedSockets;
+}
+
+void Beacon::SetTransmitThread(bool useThread)
+{
+  LogAssert(m_scheduler == NULL);
+  m_transmitThread = useThread;
+}
+
+void Beacon::SetIoUringScheduler(bool useIoUring)
+{
+  LogAssert(m_scheduler == NULL);
+  m_ioUringScheduler = useIoUring;
+}
+
+// static
+bool Beacon::IsIoUringSchedulerSupported()
+{
+#ifdef USE_IOURING_SCHEDULER
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Beacon::SetSchedulerClock(Scheduler::ClockSource::Value source)
+{
+  LogAssert(m_scheduler == NULL);
+  m_schedulerClock = source;
+}
+
+void Beacon::SetSchedulerBudget(const Scheduler::Budget &budget)
+{
+  LogAssert(m_scheduler == NULL);
+  m_schedulerBudget = budget;
+}
+
+void Beacon::SetRealtime(const RealtimeParams &params)
+{
+  LogAssert(m_scheduler == NULL);
+  m_realtimeParams = params;
+}
+
+void Beacon::SetEcho(uint32_t receiveInterval, uint32_t controlInterval)
+{
+  LogAssert(m_scheduler == NULL);
+  m_echoReceiveInterval = receiveInterval;
+  m_echoControlInterval = controlInterval;
+}
+
+void Beacon::SetOverload(const OverloadParams &params)
+{
+  LogAssert(m_scheduler == NULL);
+  m_overloadParams = params;
+}
+
+void Beacon::SetProfileRate(uint32_t sessionsPerSecond)
+{
+  LogAssert(m_scheduler == NULL);
+  m_profileRate = max(sessionsPerSecond, uint32_t(1));
+}
+
+void Beacon::SetReceiveRing(size_t frameCount)
+{
+  LogAssert(m_scheduler == NULL);
+  m_receiveRingFrames = min(frameCount, PacketRing::MaxFrameCount);
+}
+
+void Beacon::GetPacketStats(PacketStats &outStats)
+{
+  outStats = m_packetStats;
+  outStats.receiveBudget = m_receiveBudget;
+  if (m_packetRing)
+  {
+    outStats.hasRing = true;
+    m_packetRing->GetStats(outStats.ring);
+  }
+}
+
+void Beacon::ResetPacketStats()
+{
+  m_packetStats.Reset();
+  if (m_packetRing)
+  {
+    // Collects, and so clears, the kernel counts first.
+    PacketRing::Stats unused;
+    m_packetRing->GetStats(unused);
+    m_packetRing->ResetStats();
+  }
+}
+
+// static
+const char* Beacon::DiscardReasonName(DiscardReason::Value reason)
+{
+  switch (reason)
+  {
+  case DiscardReason::BadPort:
+    return "bad_port";
+  case DiscardReason::BadTtl:
+    return "bad_ttl";
+  case DiscardReason::Invalid:
+    return "invalid";
+  case DiscardReason::NotListenAddress:
+    return "not_listen_address";
+  case DiscardReason::UnknownDisc:
+    return "unknown_disc";
+  case DiscardReason::AddressMismatch:
+    return "address_mismatch";
+  case DiscardReason::Unauthorized:
+    return "unauthorized";
+  case DiscardReason::Authentication:
+    return "authentication";
+  case DiscardReason::NoResources:
+    return "no_resources";
+  case DiscardReason::Testing:
+    return "testing";
+  case DiscardReason::Count:
+    break;
+  }
+  return "unknown";
+}
+
+void Beacon::SetShardCount(size_t count)
+{
+  LogAssert(m_scheduler == NULL);
+
+  if (!LogVerify(count > 0))
+    count = 1;
+  m_shardCount = min(count, MaxShardCount);
+}
+
+/**
+ * @return Beacon* - The shard responsible for sessions between the addresses.
+ */
+Beacon* Beacon::ownerShard(const IpAddr &remoteAddr, const IpAddr &localAddr)
+{
+  if (m_shardCount == 1)
+    return this;
+  return ownerShard(AddrKey(remoteAddr), AddrKey(localAddr));
+}
+
+Beacon* Beacon::ownerShard(const AddrKey &remoteAddr, const AddrKey &localAddr)
+{
+  if (m_shardCount == 1)
+    return this;
+  size_t index = HashAddressPair(remoteAddr, localAddr) % m_shardCount;
+  return m_primary->m_shards[index];
+}
+
+/**
+ * @return Beacon* - The shard that created the discriminator. See
+ *         DiscriminatorAllocator.
+ */
+Beacon* Beacon::discriminatorShard(uint32_t disc)
+{
+  if (m_shardCount == 1)
+    return this;
+  return m_primary->m_shards[disc % m_shardCount];
+}
+
+bool Beacon::StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!LogVerify(IsSessionOwner(remoteAddr, localAddr)))
+    return false;
+
+  return startActiveSession(remoteAddr, localAddr, 0);
+}
+
+size_t Beacon::StartActiveSessions(const vector<AddressPair> &pairs, uint32_t spreadUs, vector<uint8_t> &outResults)
+{
+  size_t owned = 0;
+  size_t started = 0;
+
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!LogVerify(outResults.size() == pairs.size()))
+    return 0;
+
+  for (size_t index = 0; index < pairs.size(); index++)
+  {
+    if (IsSessionOwner(pairs[index].remoteAddr, pairs[index].localAddr))
+      owned++;
+  }
+
+  if (owned == 0)
+    return 0;
+
+  reserveSessions(m_IdMap.Size() + owned);
+
+  size_t ownedIndex = 0;
+  for (size_t index = 0; index < pairs.size(); index++)
+  {
+    const AddressPair &pair = pairs[index];
+    if (!IsSessionOwner(pair.remoteAddr, pair.localAddr))
+      continue;
+
+    // A delay of 0 means immediate, so spread sessions start at 1us.
+    uint32_t startDelayUs = 0;
+    if (spreadUs != 0)
+      startDelayUs = 1 + uint32_t(uint64_t(spreadUs) * ownedIndex / owned);
+    ownedIndex++;
+
+    bool result = startActiveSession(pair.remoteAddr, pair.localAddr, startDelayUs);
+    outResults[index] = result ? 1 : 0;
+    if (result)
+      started++;
+  }
+
+  LogOptional(Log::Session, "Started %zu of %zu active sessions.", started, owned);
+  return started;
+}
+
+void Beacon::SyncSessions(const vector<SyncEntry> &entries, uint32_t spreadUs, vector<uint8_t> &outResults, SyncSummary &ioSummary)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!LogVerify(outResults.size() == entries.size()))
+    return;
+
+  SyncSummary before = ioSummary;
+  vector<uint32_t> keepIds;
+  vector<size_t> creates;
+
+  keepIds.reserve(entries.size());
+  for (size_t index = 0; index < entries.size(); index++)
+  {
+    const SyncEntry &entry = entries[index];
+    if (!IsSessionOwner(entry.remoteAddr, entry.localAddr))
+      continue;
+
+    // An entry that fails still keeps the session that it names.
+    Session *session = findInSourceMap(entry.remoteAddr, entry.localAddr);
+    if (session)
+      keepIds.push_back(session->GetId());
+
+    uint32_t profile = entry.profile == NoProfile ? m_newSessionProfile : entry.profile;
+    if (!isProfile(profile))
+    {
+      outResults[index] = SyncResult::Failed;
+      ioSummary.failed++;
+      continue;
+    }
+
+    if (!session)
+    {
+      creates.push_back(index);
+      continue;
+    }
+
+    bool changed = false;
+    if (!session->IsActiveSession())
+    {
+      if (!startActiveSession(entry.remoteAddr, entry.localAddr, 0))
+      {
+        outResults[index] = SyncResult::Failed;
+        ioSummary.failed++;
+        continue;
+      }
+      changed = true;
+    }
+    if (session->GetProfileId() != profile)
+    {
+      SetSessionProfile(session, profile);
+      changed = true;
+    }
+    outResults[index] = changed ? SyncResult::Changed : SyncResult::Unchanged;
+    if (changed)
+      ioSummary.changed++;
+    else
+      ioSummary.unchanged++;
+  }
+
+  // One pass over the sessions finds the active ones that are not wanted. They
+  // are deleted afterwards, since deleting moves sessions in the map.
+  sort(keepIds.begin(), keepIds.end());
+  vector<Session *> deletes;
+  for (size_t slot = 0; slot < m_IdMap.SlotCount(); slot++)
+  {
+    Session *session = m_IdMap.GetSlot(slot);
+    if (session && session->IsActiveSession() && !binary_search(keepIds.begin(), keepIds.end(), session->GetId()))
+      deletes.push_back(session);
+  }
+  for (size_t index = 0; index < deletes.size(); index++)
+    KillSession(deletes[index]);
+  ioSummary.deleted += deletes.size();
+
+  if (!creates.empty())
+  {
+    // Each new session gets its profile's settings from the start.
+    uint32_t newSessionProfile = m_newSessionProfile;
+
+    reserveSessions(m_IdMap.Size() + creates.size());
+    for (size_t createIndex = 0; createIndex < creates.size(); createIndex++)
+    {
+      size_t index = creates[createIndex];
+      const SyncEntry &entry = entries[index];
+
+      // A delay of 0 means immediate, so spread sessions start at 1us.
+      uint32_t startDelayUs = 0;
+      if (spreadUs != 0)
+        startDelayUs = 1 + uint32_t(uint64_t(spreadUs) * createIndex / creates.size());
+
+      m_newSessionProfile = entry.profile == NoProfile ? newSessionProfile : entry.profile;
+      bool result = startActiveSession(entry.remoteAddr, entry.localAddr, startDelayUs);
+      outResults[index] = result ? SyncResult::Created : SyncResult::Failed;
+      if (result)
+        ioSummary.created++;
+      else
+        ioSummary.failed++;
+    }
+    m_newSessionProfile = newSessionProfile;
+  }
+
+  LogOptional(Log::Session, "Shard %zu sync: %zu created, %zu changed, %zu deleted, %zu failed.", m_shardIndex,
+              ioSummary.created - before.created, ioSummary.changed - before.changed,
+              ioSummary.deleted - before.deleted, ioSummary.failed - before.failed);
+}
+
+/**
+ * Grows the session maps so that they can hold count sessions without
+ * rehashing. Failure is harmless, because the maps grow as needed anyway.
+ */
+void Beacon::reserveSessions(size_t count)
+{
+  try
+  {
+    m_discMap.Reserve(count);
+    m_IdMap.Reserve(count);
+    m_sourceMap.Reserve(count);
+  }
+  catch (std::bad_alloc &)
+  {
+    gLog.Optional(Log::Session, "Could not reserve room for %zu sessions.", count);
+  }
+}
+
+/**
+ * Helper for StartActiveSession() and StartActiveSessions().
+ *
+ * @param startDelayUs [in] - See Session::StartActiveSession().
+ */
+bool Beacon::startActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr, uint32_t startDelayUs)
+{
+  Session *session = NULL;
+
+  session = findInSourceMap(remoteAddr, localAddr);
+  if (session)
+  {
+    if (session->IsActiveSession())
+      return true;
+    if (!session->UpgradeToActiveSession())
+    {
+      LogOptional(Log::Session, "Failed to upgrade Session id=%u for %s to %s is to an active session.",
+                  session->GetId(),
+                  localAddr.ToString(),
+                  remoteAddr.ToString()
+                 );
+      return false;
+    }
+
+
+    LogOptional(Log::Session, "Session id=%u for %s to %s is now an active session.",
+                session->GetId(),
+                localAddr.ToString(),
+                remoteAddr.ToString()
+               );
+    return true;
+  }
+  else
+  {
+    session = addSession(remoteAddr, localAddr);
+    if (!session)
+      return false;
+
+    LogOptional(Log::Session, "Manually added new session for %s to %s id=%u.",
+                localAddr.ToString(),
+                remoteAddr.ToString(),
+                session->GetId());
+
+
+    if (!session->StartActiveSession(remoteAddr, localAddr, startDelayUs))
+    {
+      LogOptional(Log::Session, "Failed to start active session id=%u for %s to %s.",
+                  session->GetId(),
+                  localAddr.ToString(),
+                  remoteAddr.ToString()
+                 );
+      return false;
+    }
+
+    LogOptional(Log::Session, "Session id=%u for %s to %s is started as an active session.",
+                session->GetId(),
+                localAddr.ToString(),
+                remoteAddr.ToString()
+               );
+    return true;
+  }
+}
+
+void Beacon::AllowPassiveIP(const IpAddr &addr)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  m_allowedPassiveIP.insert(addr);
+}
+
+void Beacon::BlockPassiveIP(const IpAddr &addr)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  m_allowedPassiveIP.erase(addr);
+}
+
+void Beacon::AllowAllPassiveConnections(bool allow)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  m_allowAnyPassiveIP = allow;
+}
+
+
+void Beacon::RequestShutdown()
+{
+  if (m_primary != this)
+  {
+    m_primary->RequestShutdown();
+    return;
+  }
+
+  gLog.Message(Log::App, "Received shutdown request.");
+
+  // The shards are also stopped by Run(), but this lets them all stop at once.
+  // m_shards does not change while the command processors are running.
+  for (size_t index = 1; index < m_shards.size(); index++)
+    m_shards[index]->flagShutdown();
+
+  AutoQuickLock lock(m_paramsLock);
+  atomicStore(&m_shutownRequested, true);
+  triggerSelfMessage();
+}
+
+bool Beacon::IsShutdownRequested()
+{
+  return atomicLoad(&m_shutownRequested);
+}
+
+Session* Beacon::FindSessionId(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  return m_IdMap.Find(id);
+}
+
+
+Session* Beacon::FindSessionIp(const IpAddr &remoteAddr, const IpAddr &localAddr)
+{
+  LogAssert(m_scheduler->IsMainThread());
+  return findInSourceMap(remoteAddr, localAddr);
+}
+
+/**
+ *
+ * @param remoteAddr [in] - Port ignored
+ * @param localAddr [in] - Port ignored
+ *
+ * @return Session* - NULL on failure
+ */
+Session* Beacon::findInSourceMap(const IpAddr &remoteAddr, const IpAddr &localAddr)
+{
+  return findInSourceMap(AddrKey(remoteAddr), AddrKey(localAddr));
+}
+
+Session* Beacon::findInSourceMap(const AddrKey &remoteAddr, const AddrKey &localAddr)
+{
+  LogAssert(m_scheduler->IsMainThread());
+  return m_sourceMap.Find(AddressPairKey(remoteAddr, localAddr));
+}
+
+
+void Beacon::GetSessionIdList(std::vector<uint32_t> &outList)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  outList.clear();
+  outList.reserve(m_IdMap.Size());
+
+  for (size_t index = 0; index < m_IdMap.SlotCount(); index++)
+  {
+    Session *session = m_IdMap.GetSlot(index);
+    if (session)
+      outList.push_back(session->GetId());
+  }
+}
+
+bool Beacon::GetSessionStatusList(std::vector<SessionStatus> &outList)
+{
+  bool complete = true;
+
+  outList.clear();
+  // m_shards does not change while the command processors are running.
+  if (m_shards.empty())
+    return m_statusTable.Read(outList);
+  for (size_t index = 0; index < m_shards.size(); index++)
+  {
+    if (!m_shards[index]->m_statusTable.Read(outList))
+      complete = false;
+  }
+  return complete;
+}
+
+bool Beacon::VisitSessionStatus(SessionStatusTable::Visitor visitor, void *userdata)
+{
+  bool complete = true;
+
+  // m_shards does not change while the command processors are running.
+  if (m_shards.empty())
+    return m_statusTable.Visit(visitor, userdata);
+  for (size_t index = 0; index < m_shards.size(); index++)
+  {
+    if (!m_shards[index]->m_statusTable.Visit(visitor, userdata))
+      complete = false;
+  }
+  return complete;
+}
+
+bool Beacon::IsSessionStatusComplete()
+{
+  if (m_shards.empty())
+    return m_statusTable.IsComplete();
+  for (size_t index = 0; index < m_shards.size(); index++)
+  {
+    if (!m_shards[index]->m_statusTable.IsComplete())
+      return false;
+  }
+  return true;
+}
+
+void Beacon::KillSession(Session *session)
+{
+
+  if (!LogVerify(session))
+    return;
+
+  LogAssert(m_scheduler->IsMainThread());
+
+  LogVerify(m_discMap.Erase(session->GetLocalDiscriminator()));
+  LogVerify(m_IdMap.Erase(session->GetId()));
+  LogVerify(m_sourceMap.Erase(AddressPairKey(session->GetRemoteKey(), session->GetLocalKey())));
+
+  LogOptional(Log::Session, "Removed session %s to %s id=%d.",
+              session->GetLocalAddress().ToString(),
+              session->GetRemoteAddress().ToString(),
+              session->GetId());
+
+  freeSession(session);
+}
+
+
+
+bool Beacon::QueueOperation(OperationCallback callback, void *userdata, bool waitForCompletion)
+{
+  if (m_primary != this)
+    return m_primary->QueueOperation(callback, userdata, waitForCompletion);
+
+  if (m_shards.size() <= 1)
+    return queueShardOperation(callback, userdata, waitForCompletion);
+
+  // Without waiting, userdata would go to several threads at once, with none of
+  // them able to free it.
+  if (!callback || !LogVerify(waitForCompletion))
+    return false;
+
+  WaitCondition condition(false);
+  if (!condition.Init())
+    return false;
+
+  // Every shard is held open before any of them runs the callback, so that it
+  // runs on all of them or on none. stopScheduler() waits for a shard to be
+  // released, which happens as soon as its operation is pushed, and then runs
+  // the operations that are left.
+  size_t held;
+  for (held = 0; held < m_shards.size(); held++)
+  {
+    Beacon *shard = m_shards[held];
+    atomicFetchAdd(&shard->m_operationPushers, uint32_t(1));
+    if (atomicLoad(&shard->m_shutownRequested))
+    {
+      for (size_t index = 0; index <= held; index++)
+        atomicFetchAdd(&m_shards[index]->m_operationPushers, uint32_t(-1));
+      return false;
+    }
+  }
+
+  for (size_t index = 0; index < m_shards.size(); index++)
+  {
+    Beacon *shard = m_shards[index];
+    PendingOperation operation;
+    operation.callback = callback;
+    operation.userdata = userdata;
+    operation.completed = false;
+    operation.waitCondition = &condition;
+
+    shard->m_operations.Push(&operation);
+    shard->signalOperations();
+    atomicFetchAdd(&shard->m_operationPushers, uint32_t(-1));
+    shard->waitForOperation(&operation);
+  }
+  return true;
+}
+
+/**
+ * Queues a callback for this shard only. See QueueOperation().
+ *
+ * @Note can be called from any thread.
+ */
+bool Beacon::queueShardOperation(OperationCallback callback, void *userdata, bool waitForCompletion)
+{
+  WaitCondition condition(false);
+  PendingOperation operation;
+  PendingOperation *useOperation;
+  RaiiNullBase<PendingOperation, freeOperation> ownedOperation;
+
+
+  if (!callback)
+  {
+    LogAssert(false);
+    return false;
+  }
+
+  operation.callback = callback;
+  operation.userdata = userdata;
+  operation.completed = false;
+  if (waitForCompletion)
+  {
+    if (!condition.Init())
+      return false;
+    operation.waitCondition = &condition;
+    useOperation = &operation;
+  }
+  else
+  {
+    ownedOperation = useOperation = allocOperation();
+    if (!useOperation)
+      return false;
+
+    *useOperation = operation;
+  }
+
+  if (!pushOperation(useOperation))
+    return false;
+
+  // Once it is in m_operations, then the operation is no longer ours to free.
+  ownedOperation.Detach();
+  return true;
+}
+
+// Free PendingOperation items. Each thread takes items from its own list, and
+// refills it by taking all of gFreeOperations at once. Items are freed to
+// gFreeOperations by the main thread that ran them.
+static MpscStack gFreeOperations;
+static pthread_key_t gOperationCacheKey;
+static pthread_once_t gOperationCacheOnce = PTHREAD_ONCE_INIT;
+static bool gOperationCacheKeyValid = false;
+
+void Beacon::makeOperationCacheKey()
+{
+  gOperationCacheKeyValid = (0 == pthread_key_create(&gOperationCacheKey, freeOperationCache));
+}
+
+/**
+ * Called when a thread with a cache exits.
+ */
+void Beacon::freeOperationCache(void *cache)
+{
+  MpscNode *node = reinterpret_cast<MpscNode *>(cache);
+
+  while (node)
+  {
+    MpscNode *next = node->next;
+    delete static_cast<PendingOperation *>(node);
+    node = next;
+  }
+}
+
+/**
+ * Gets an unused operation, from the pool if possible.
+ *
+ * @Note can be called from any thread.
+ *
+ * @return PendingOperation* - NULL on memory failure. Free with freeOperation().
+ */
+Beacon::PendingOperation* Beacon::allocOperation()
+{
+  MpscNode *node;
+
+  pthread_once(&gOperationCacheOnce, makeOperationCacheKey);
+  if (!gOperationCacheKeyValid)
+    return new(std::nothrow) PendingOperation;
+
+  node = reinterpret_cast<MpscNode *>(pthread_getspecific(gOperationCacheKey));
+  if (!node)
+    node = gFreeOperations.TakeAll();
+  if (!node)
+    return new(std::nothrow) PendingOperation;
+
+  if (0 != pthread_setspecific(gOperationCacheKey, node->next))
+  {
+    // Put the rest back, rather than losing them.
+    for (MpscNode *next = node->next; next;)
+    {
+      MpscNode *item = next;
+      next = next->next;
+      gFreeOperations.Push(item);
+    }
+  }
+
+  PendingOperation *operation = static_cast<PendingOperation *>(node);
+  *operation = PendingOperation();
+  return operation;
+}
+
+/**
+ * Returns an operation from allocOperation() to the pool.
+ *
+ * @Note can be called from any thread.
+ */
+void Beacon::freeOperation(PendingOperation *operation)
+{
+  gFreeOperations.Push(operation);
+}
+
+/**
+ * Adds the operation to m_operations, and wakes the main thread if needed. If
+ * the operation has a waitCondition, then waits for it to complete.
+ *
+ * @Note can be called from any thread.
+ *
+ * @return bool - false if the operation was not queued. On success the operation
+ *         belongs to the queue, unless it has a waitCondition.
+ */
+bool Beacon::pushOperation(PendingOperation *operation)
+{
+  // Without a waitCondition, operation may be freed as soon as it is pushed.
+  WaitCondition *waitCondition = operation->waitCondition;
+  bool queued = false;
+
+  // stopScheduler() sets m_shutownRequested, and then waits for
+  // m_operationPushers to be 0. So once we have checked m_shutownRequested, the
+  // scheduler will remain valid until we are done.
+  atomicFetchAdd(&m_operationPushers, uint32_t(1));
+  if (!atomicLoad(&m_shutownRequested))
+  {
+    m_operations.Push(operation);
+    signalOperations();
+    queued = true;
+  }
+  atomicFetchAdd(&m_operationPushers, uint32_t(-1));
+
+  if (queued && waitCondition)
+    waitForOperation(operation);
+
+  return queued;
+}
+
+/**
+ * Waits for this shard's main thread to run an operation that has a
+ * waitCondition.
+ *
+ * @Note can be called from any thread other than this shard's main thread.
+ */
+void Beacon::waitForOperation(PendingOperation *operation)
+{
+  AutoQuickLock lock(m_paramsLock);
+  while (!operation->completed)
+    lock.LockWait(*operation->waitCondition);
+}
+
+/**
+ * Signals the main thread to run the operations, unless it has already been
+ * signaled, and has not yet started running them.
+ *
+ * @Note can be called from any thread, while the scheduler is valid.
+ */
+void Beacon::signalOperations()
+{
+  if (0 == atomicExchange(&m_operationsSignaled, uint32_t(1)))
+    triggerSelfMessage();
+}
+
+bool Beacon::QueueOperationBatch(const OperationBatch &batch, BatchCompleteCallback completeCallback, void *completeUserdata)
+{
+  Raii<BatchCompletion>::Delete completion;
+
+  if (m_primary != this)
+    return m_primary->QueueOperationBatch(batch, completeCallback, completeUserdata);
+
+  if (!LogVerify(completeCallback))
+    return false;
+
+  completion = new(std::nothrow) BatchCompletion;
+  if (!completion.IsValid())
+    return false;
+
+  completion->batch = &batch;
+  completion->callback = completeCallback;
+  completion->userdata = completeUserdata;
+  completion->nextShard = 0;
+
+  if (!queueNextShardBatch(completion))
+    return false;
+
+  // Once it is queued, the completion belongs to the shards.
+  completion.Detach();
+  return true;
+}
+
+/**
+ * Queues the batch on the next shard that has not run it.
+ *
+ * @Note call only on the primary. Can be called from any thread.
+ *
+ * @return bool - false on failure.
+ */
+bool Beacon::queueNextShardBatch(BatchCompletion *completion)
+{
+  Beacon *shard = m_shards.empty() ? this : m_shards[completion->nextShard];
+
+  LogAssert(m_primary == this);
+  completion->nextShard++;
+  return shard->queueShardBatch(completion);
+}
+
+/**
+ * Queues a batch for this shard only. See QueueOperationBatch().
+ *
+ * @Note can be called from any thread.
+ */
+bool Beacon::queueShardBatch(BatchCompletion *completion)
+{
+  RaiiNullBase<PendingOperation, freeOperation> operation(allocOperation());
+
+  if (!operation.IsValid())
+    return false;
+
+  operation->batch = completion;
+
+  if (!pushOperation(operation))
+    return false;
+
+  operation.Detach();
+  return true;
+}
+
+/**
+ * Runs the callbacks in the batch, starting after the last one that was run.
+ *
+ * @Note call only from main thread.
+ *
+ * @param operation [in/out] - A batch operation.
+ * @param deadline [in] - Stop running callbacks after this time, unless a
+ *                 shutdown was requested.
+ *
+ * @return bool - true if the batch is done. false if deadline was reached.
+ */
+bool Beacon::runBatch(PendingOperation *operation, const TimeSpec &deadline)
+{
+  const OperationBatch &batch = *operation->batch->batch;
+
+  while (operation->nextBatchIndex < batch.size())
+  {
+    const BatchOperation &item = batch[operation->nextBatchIndex++];
+
+    try
+    {
+      item.callback(this,  item.userdata);
+    }
+    catch (std::exception &e)
+    {
+      gLog.Message(Log::Error, "Beacon operation failed: %s ", e.what());
+    }
+
+    if (operation->nextBatchIndex < batch.size()
+        && TimeSpec::MonoNow() > deadline
+        && !IsShutdownRequested())
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Called when a shard has finished running the batch. Passes it to the next
+ * shard, or calls the completion callback if this was the last one.
+ *
+ * @Note call only on the primary, from the main thread of the shard that
+ *       finished.
+ */
+void Beacon::advanceBatch(BatchCompletion *completion)
+{
+  size_t shardCount = m_shards.empty() ? 1 : m_shards.size();
+  bool success = true;
+
+  LogAssert(m_primary == this);
+
+  if (completion->nextShard < shardCount)
+  {
+    if (queueNextShardBatch(completion))
+      return;
+    success = false;
+  }
+
+  try
+  {
+    completion->callback(success, completion->userdata);
+  }
+  catch (std::exception &e)
+  {
+    gLog.Message(Log::Error, "Beacon batch completion failed: %s ", e.what());
+  }
+
+  delete completion;
+}
+
+/**
+ * Creates the a listen socket on the bfd listen port.
+ *
+ * @param listenAddr [in] - May be "ANY" (0.0.0.0 or ::)
+ *
+ * outSocket will be empty on failure.
+ *
+ *
+ */
+void Beacon::makeListenSocket(const IpAddr &listenAddr, Socket &outSocket)
+{
+  Socket listenSocket;
+
+  outSocket.Close();
+  // Any socket error will get logged, so we don't need to log them again.
+  listenSocket.SetLogName(FormatShortStr("BFD %s listen socket", listenAddr.ToString()));
+  listenSocket.OpenUDP(listenAddr.Type());
+  if (listenSocket.empty())
+    return;
+
+  if (!listenSocket.SetTTLOrHops(bfd::TTLValue))
+    return;
+
+  if (!listenSocket.SetReceiveTTLOrHops(true))
+    return;
+
+  // Not fatal, without it packets are timed when they are read.
+  listenSocket.SetReceiveTimestamp(true);
+
+  if (!listenSocket.SetReceiveDestinationAddress(true))
+    return;
+
+  if (listenAddr.Type() == Addr::IPv6)
+  {
+    if (!listenSocket.SetIPv6Only(true))
+      return;
+  }
+
+  // Packets are read from the ring instead. Set before binding, so that none
+  // are queued.
+  if (m_receiveRingFrames)
+  {
+    if (!PacketRing::DiscardSocketInput(listenSocket))
+      return;
+  }
+
+  // Each shard has its own listen socket on the same address.
+  if (m_shardCount > 1)
+  {
+    if (!listenSocket.SetSharePort(true))
+      return;
+  }
+
+  if (!listenSocket.Bind(SockAddr(listenAddr, bfd::ListenPort)))
+    return;
+
+  // Take ownership
+  outSocket.Transfer(listenSocket);
+  outSocket.SetLogName(listenSocket.LogName());
+
+  gLog.Optional(Log::App, "Listening for BFD connections on %s", SockAddr(listenAddr, bfd::ListenPort).ToString());
+}
+
+/**
+ * Opens the echo socket for a listen address.
+ *
+ * @return bool - false on failure. Errors are logged.
+ */
+bool Beacon::makeEchoSocket(const IpAddr &listenAddr, Socket &outSocket)
+{
+  Socket echoSocket;
+
+  outSocket.Close();
+  echoSocket.SetLogName(FormatShortStr("BFD %s echo socket", listenAddr.ToString()));
+  if (!echoSocket.OpenUDP(listenAddr.Type()))
+    return false;
+
+  if (!echoSocket.SetTTLOrHops(bfd::TTLValue))
+    return false;
+
+  // Not fatal, without it packets are timed when they are read.
+  echoSocket.SetReceiveTimestamp(true);
+
+  if (!echoSocket.SetReceiveDestinationAddress(true))
+    return false;
+
+  if (listenAddr.Type() == Addr::IPv6)
+  {
+    if (!echoSocket.SetIPv6Only(true))
+      return false;
+  }
+
+  if (m_shardCount > 1)
+  {
+    if (!echoSocket.SetSharePort(true))
+      return false;
+  }
+
+  if (!echoSocket.Bind(SockAddr(listenAddr, bfd::EchoPort)))
+    return false;
+
+  outSocket.Transfer(echoSocket);
+  outSocket.SetLogName(echoSocket.LogName());
+
+  gLog.Optional(Log::App, "Listening for BFD echo packets on %s", SockAddr(listenAddr, bfd::EchoPort).ToString());
+  return true;
+}
+
+int Beacon::GetEchoSocket(const IpAddr &localAddr)
+{
+  int anySocket = -1;
+
+  for (size_t index = 0; index < m_echoSockets.size(); index++)
+  {
+    const IpAddr &addr = m_echoSockets[index].first;
+    if (addr.Type() != localAddr.Type())
+      continue;
+    if (addr == localAddr)
+      return m_echoSockets[index].second;
+    if (addr.IsAny())
+      anySocket = m_echoSockets[index].second;
+  }
+  return anySocket;
+}
+
+void Beacon::handleEchoSocketCallback(int ATTR_UNUSED(socket), void *userdata)
+{
+  ListenCallbackData *data = reinterpret_cast<ListenCallbackData *>(userdata);
+  data->beacon->handleEchoSocket(data->socket);
+}
+
+/**
+ * Called by a scheduler that receives the datagrams itself, for each one from
+ * an echo socket.
+ */
+void Beacon::handleEchoDatagramCallback(int socket, RecvMsg &message, void *userdata)
+{
+  ListenCallbackData *data = reinterpret_cast<ListenCallbackData *>(userdata);
+  Beacon *beacon = data->beacon;
+
+  if (!message.GetData())
+    return;
+
+  TimeSpec realNow(TimeSpec::RealNow());
+  TimeSpec monoNow(TimeSpec::MonoNow());
+  beacon->handleEchoPacket(socket, message.GetData(), message.GetDataSize(),
+                           message.GetSrcKey(), message.GetSrcPort(), message.GetDestKey(),
+                           beacon->getPacketArrival(message.GetReceiveTime(), realNow, monoNow));
+}
+
+/**
+ * Drains the echo socket in batches, with the same budget as a listen socket.
+ */
+void Beacon::handleEchoSocket(Socket &socket)
+{
+  size_t handled = 0;
+
+  while (handled < m_receiveBudget)
+  {
+    size_t count = m_echoPackets.DoRecvMsgBatch(socket);
+
+    if (m_echoPackets.GetLastError() != 0)
+      gLog.ErrnoError(m_echoPackets.GetLastError(), "Error receiving on BFD echo socket");
+
+    if (count == 0)
+      break;
+
+    TimeSpec realNow(TimeSpec::RealNow());
+    TimeSpec monoNow(TimeSpec::MonoNow());
+
+    for (size_t i = 0; i < count; i++)
+    {
+      RecvMsg &recvPacket = m_echoPackets.GetMessage(i);
+      if (!recvPacket.GetData())
+        continue;
+      handleEchoPacket(socket.GetSocket(), recvPacket.GetData(), recvPacket.GetDataSize(),
+                       recvPacket.GetSrcKey(), recvPacket.GetSrcPort(), recvPacket.GetDestKey(),
+                       getPacketArrival(recvPacket.GetReceiveTime(), realNow, monoNow));
+    }
+    handled += count;
+
+    if (count < m_echoPackets.GetBatchSize())
+      break;
+  }
+}
+
+// An echo packet received by one shard, for a session on another.
+struct ForwardedEcho
+{
+  uint8_t data[bfd::MaxPacketSize];
+  size_t dataLength;
+  AddrKey sourceAddr;
+  in_port_t sourcePort;
+  AddrKey destAddr;
+  TimeSpec receiveTime; // Monotonic.
+};
+
+/**
+ * Handles a packet from an echo socket. One of our own echo packets, that a
+ * peer looped back, goes to its session. Any other is a peer's echo packet,
+ * which is sent straight back, if we have a session with that peer that is Up.
+ * Either may belong to another shard, in which case it is forwarded.
+ *
+ * @param socket [in] - The echo socket, for looping a packet back. -1 to use
+ *               the one for destAddr.
+ */
+void Beacon::handleEchoPacket(int socket, const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr,
+                              in_port_t sourcePort, const AddrKey &destAddr, const TimeSpec &receiveTime)
+{
+  const EchoPacket *echo = reinterpret_cast<const EchoPacket *>(data);
+  bool ours = dataLength == sizeof(EchoPacket)
+     && ntohl(echo->magic) == bfd::EchoMagic
+     && ntohl(echo->instance) == GetEchoInstance();
+  Beacon *owner = ours ? discriminatorShard(ntohl(echo->myDisc)) : ownerShard(sourceAddr, destAddr);
+
+  if (owner != this)
+  {
+    ForwardedEcho *forward = new(std::nothrow) ForwardedEcho;
+    if (!forward || dataLength > sizeof(forward->data))
+    {
+      delete forward;
+      m_counters.echoDiscarded++;
+      return;
+    }
+    memcpy(forward->data, data, dataLength);
+    forward->dataLength = dataLength;
+    forward->sourceAddr = sourceAddr;
+    forward->sourcePort = sourcePort;
+    forward->destAddr = destAddr;
+    forward->receiveTime = receiveTime;
+    if (!owner->queueShardOperation(handleForwardedEchoCallback, forward, false))
+    {
+      delete forward;
+      m_counters.echoDiscarded++;
+    }
+    return;
+  }
+
+  if (ours)
+  {
+    // Only the peer of the session may loop it back.
+    Session *session = m_discMap.Find(ntohl(echo->myDisc));
+    if (!session || !(session->GetRemoteAddress() == sourceAddr.ToIpAddr()))
+    {
+      LogOptional(Log::Discard, "Discard echo packet for unknown session from %s.", sourceAddr.ToSockAddr(sourcePort).ToString());
+      m_counters.echoDiscarded++;
+      return;
+    }
+    m_counters.echoReturned++;
+    session->ProcessEchoPacket(ntohl(echo->sequence), receiveTime);
+    return;
+  }
+
+  // Only OpenBFDD echo packets are looped back, since nothing else sends
+  // them to this port. See SetEcho().
+  if (dataLength != sizeof(EchoPacket) || ntohl(echo->magic) != bfd::EchoMagic)
+  {
+    LogOptional(Log::Discard, "Discard echo packet from %s, not from OpenBFDD.", sourceAddr.ToSockAddr(sourcePort).ToString());
+    m_counters.echoDiscarded++;
+    return;
+  }
+
+  // Looping back is only for peers that we have a session with, so that the
+  // socket can not be used to reflect packets at others.
+  Session *session = findInSourceMap(sourceAddr, destAddr);
+  if (!session || session->GetState() != bfd::State::Up)
+  {
+    LogOptional(Log::Discard, "Discard echo packet from %s, without a session that is up.", sourceAddr.ToSockAddr(sourcePort).ToString());
+    m_counters.echoDiscarded++;
+    return;
+  }
+
+  if (socket == -1)
+    socket = GetEchoSocket(destAddr.ToIpAddr());
+  SockAddr target(sourceAddr.ToSockAddr(sourcePort));
+  if (socket == -1
+      || ::sendto(socket, data, dataLength, MSG_NOSIGNAL | MSG_DONTWAIT, &target.GetSockAddr(), target.GetSize()) < 0)
+  {
+    LogOptional(Log::Packet, "Failed to loop back echo packet to %s: %s", target.ToString(), ErrnoToString());
+    m_counters.echoDiscarded++;
+    return;
+  }
+  m_counters.echoReflected++;
+}
+
+/**
+ * Called on the owning shard's main thread for a forwarded echo packet.
+ */
+void Beacon::handleForwardedEchoCallback(Beacon *beacon, void *userdata)
+{
+  Raii<ForwardedEcho>::Delete forward(reinterpret_cast<ForwardedEcho *>(userdata));
+
+  if (beacon->IsShutdownRequested())
+    return;
+  beacon->handleEchoPacket(-1, forward->data, forward->dataLength, forward->sourceAddr, forward->sourcePort,
+                           forward->destAddr, forward->receiveTime);
+}
+
+/**
+ * Called by a scheduler that receives the datagrams itself, for each one from
+ * a listen socket. There is no budget, since the scheduler only hands over as
+ * many as its buffers hold each time.
+ */
+void Beacon::handleListenDatagramCallback(int ATTR_UNUSED(socket), RecvMsg &message, void *userdata)
+{
+  Beacon *beacon = reinterpret_cast<ListenCallbackData *>(userdata)->beacon;
+
+  // Read in this order, as for a batch, so that the delay is never overstated.
+  TimeSpec realNow(TimeSpec::RealNow());
+  TimeSpec monoNow(TimeSpec::MonoNow());
+
+  beacon->m_packetStats.receiveCallbacks++;
+  beacon->handleListenPacket(message, beacon->getPacketArrival(message.GetReceiveTime(), realNow, monoNow));
+}
+
+void Beacon::handleListenSocket(Socket &socket)
+{
+  size_t handled = 0;
+
+  m_packetStats.receiveCallbacks++;
+
+  // Drain the socket in batches, up to the budget.
+  while (true)
+  {
+    if (handled >= m_receiveBudget)
+    {
+      m_packetStats.budgetHits++;
+      break;
+    }
+
+    size_t count = m_packets.DoRecvMsgBatch(socket);
 
-    *useOperation = operation;
-  }
+    if (m_packets.GetLastError() != 0)
+      gLog.ErrnoError(m_packets.GetLastError(), "Error receiving on BFD listen socket");
 
-  {
-    AutoQuickLock lock(m_paramsLock);
+    if (count == 0)
+      break;
 
-    if (m_shutownRequested)
-      return false;
+    // Kernel receive times are on the real time clock. Both clocks are read once
+    // per batch to convert them.
+    TimeSpec realNow(TimeSpec::RealNow());
+    TimeSpec monoNow(TimeSpec::MonoNow());
 
-    try
+    for (size_t i = 0; i < count; i++)
     {
-      m_operations.push_back(useOperation);
+      RecvMsg &recvPacket = m_packets.GetMessage(i);
+      handleListenPacket(recvPacket, getPacketArrival(recvPacket.GetReceiveTime(), realNow, monoNow));
     }
-    catch (std::exception)
+    handled += count;
+
+    if (count < m_packets.GetBatchSize())
+      break;
+  }
+}
+
+void Beacon::handlePacketRingCallback(int ATTR_UNUSED(socket), void *userdata)
+{
+  reinterpret_cast<Beacon *>(userdata)->handlePacketRing();
+}
+
+/**
+ * Handles the datagrams that are ready in the packet ring. Each is handled in
+ * place, and its frame returned to the kernel when the next is read.
+ */
+void Beacon::handlePacketRing()
+{
+  PacketRing::Datagram datagram;
+  TimeSpec realNow, monoNow;
+
+  m_packetStats.receiveCallbacks++;
+
+  for (size_t count = 0; ; count++)
+  {
+    // The same budget as for a listen socket.
+    if (count >= m_receiveBudget)
     {
-      return false;
+      m_packetStats.budgetHits++;
+      break;
     }
 
+    if (!m_packetRing->Next(datagram))
+      break;
 
-    // Once it is in m_operations, then the operation is no longer ours to delete.
-    allocOperation.Detach();
+    // Both clocks are read once per batch, as for a listen socket. Packets keep
+    // arriving while the ring is read, so also when a packet is newer.
+    if (count % m_receiveBatchSize == 0 || realNow < datagram.receiveTime)
+    {
+      realNow = TimeSpec::RealNow();
+      monoNow = TimeSpec::MonoNow();
+    }
 
-    if (waitForCompletion)
+    // The ring receives for all local addresses.
+    if (!isListenAddress(datagram.destAddr))
     {
-      triggerSelfMessage();
-      while (!useOperation->completed)
-        lock.LockWait(condition);
+      m_counters.received++;
+      CountDiscard(DiscardReason::NotListenAddress);
+      LogOptional(Log::Discard, "Discard packet: sent to %s, which is not a listen address.", datagram.destAddr.ToIpAddr().ToString());
+      continue;
     }
+
+    handleReceivedPacket(datagram.data, datagram.dataLength, datagram.sourceAddr, datagram.sourcePort, datagram.destAddr, datagram.ttlOrHops,
+                         getPacketArrival(datagram.receiveTime, realNow, monoNow));
   }
 
-  if (!waitForCompletion)
-    triggerSelfMessage();
+  m_packetRing->Release();
+}
 
-  return true;
+/**
+ * @return bool - true if addr matches one of the addresses given to Run().
+ */
+bool Beacon::isListenAddress(const AddrKey &addr)
+{
+  for (list<IpAddr>::const_iterator it = m_ringListenAddrs.begin(); it != m_ringListenAddrs.end(); ++it)
+  {
+    if (it->IsAny() ? it->Type() == addr.Type() : AddrKey(*it) == addr)
+      return true;
+  }
+  return false;
 }
 
 /**
- * Creates the a listen socket on the bfd listen port.
- *
- * @param listenAddr [in] - May be "ANY" (0.0.0.0 or ::)
- *
- * outSocket will be empty on failure.
+ * Converts the kernel receive time of a packet to the monotonic clock, and
+ * records how long the packet waited to be read.
  *
+ * @param stamp [in] - The kernel receive time, on the real time clock. May be
+ *              empty().
+ * @param realNow [in] - The current real time.
+ * @param monoNow [in] - The current monotonic time, read with realNow.
  *
+ * @return TimeSpec - The monotonic time the packet arrived. monoNow if the
+ *         packet has no receive time, or it is not plausible.
  */
-void Beacon::makeListenSocket(const IpAddr &listenAddr, Socket &outSocket)
+TimeSpec Beacon::getPacketArrival(const TimeSpec &stamp, const TimeSpec &realNow, const TimeSpec &monoNow)
 {
-  Socket listenSocket;
-
-  outSocket.Close();
-  // Any socket error will get logged, so we don't need to log them again.
-  listenSocket.SetLogName(FormatShortStr("BFD %s listen socket", listenAddr.ToString()));
-  listenSocket.OpenUDP(listenAddr.Type());
-  if (listenSocket.empty())
-    return;
-
-  if (!listenSocket.SetTTLOrHops(bfd::TTLValue))
-    return;
-
-  if (!listenSocket.SetReceiveTTLOrHops(true))
-    return;
+  // A larger delay is more likely a step of the real time clock, and would
+  // shorten the detection time by as much.
+  static const int64_t MaxReceiveDelayNs = 1000LL * TimeSpec::NSecPerMs;
 
-  if (!listenSocket.SetReceiveDestinationAddress(true))
-    return;
-
-  if (listenAddr.Type() == Addr::IPv6)
+  if (stamp.empty())
   {
-    if (!listenSocket.SetIPv6Only(true))
-      return;
+    m_packetStats.untimedPackets++;
+    return monoNow;
   }
 
-  if (!listenSocket.Bind(SockAddr(listenAddr, bfd::ListenPort)))
-    return;
-
-  // Take ownership
-  outSocket.Transfer(listenSocket);
-  outSocket.SetLogName(listenSocket.LogName());
+  int64_t delayNs = (realNow - stamp).ToNanoseconds();
+  if (delayNs < 0 || delayNs > MaxReceiveDelayNs)
+  {
+    m_packetStats.untimedPackets++;
+    return monoNow;
+  }
 
-  gLog.Optional(Log::App, "Listening for BFD connections on %s", SockAddr(listenAddr, bfd::ListenPort).ToString());
+  m_packetStats.receiveDelay.Record(uint64_t(delayNs / TimeSpec::NSecPerUs));
+  return monoNow - TimeSpec(TimeSpec::Nanosec, delayNs);
 }
 
-void Beacon::handleListenSocket(Socket &socket)
+/**
+ * Handles a single packet received on a listen socket.
+ *
+ * @param recvPacket [in] - A successfully received packet.
+ * @param receiveTime [in] - Monotonic time that the packet arrived.
+ */
+void Beacon::handleListenPacket(RecvMsg &recvPacket, const TimeSpec &receiveTime)
 {
-  SockAddr sourceAddr;
-  IpAddr destIpAddr, sourceIpAddr;
   uint8_t ttl;
-  BfdPacket packet;
   bool found;
-  Session *session = NULL;
 
-  if (!m_packet.DoRecvMsg(socket))
-  {
-    gLog.ErrnoError(m_packet.GetLastError(), "Error receiving on BFD listen socket");
-    return;
-  }
-
-  sourceAddr = m_packet.GetSrcAddress();
+  const AddrKey &sourceAddr = recvPacket.GetSrcKey();
   if (!LogVerify(sourceAddr.IsValid()))
     return;
-  sourceIpAddr = IpAddr(sourceAddr);
 
-  destIpAddr = m_packet.GetDestAddress();
-  if (!destIpAddr.IsValid())
+  const AddrKey &destAddr = recvPacket.GetDestKey();
+  if (!destAddr.IsValid())
   {
-    gLog.LogError("Could not get destination address for packet from %s.", sourceAddr.ToString());
+    gLog.LogError("Could not get destination address for packet from %s.", recvPacket.GetSrcAddress().ToString());
     return;
   }
 
-  ttl = m_packet.GetTTLorHops(&found);
+  ttl = recvPacket.GetTTLorHops(&found);
   if (!found)
   {
-    gLog.LogError("Could not get ttl for packet from %s.", sourceAddr.ToString());
+    gLog.LogError("Could not get ttl for packet from %s.", recvPacket.GetSrcAddress().ToString());
+    return;
+  }
+
+  handleReceivedPacket(recvPacket.GetData(), recvPacket.GetDataSize(), sourceAddr, recvPacket.GetSrcPort(), destAddr, ttl, receiveTime);
+}
+
+/**
+ * Handles a single received packet, from a listen socket or the packet ring.
+ *
+ * @param data [in] - The UDP payload.
+ * @param dataLength [in] - Length of data.
+ * @param sourceAddr [in] - Where the packet came from.
+ * @param sourcePort [in] - The source port, in host order.
+ * @param destAddr [in] - The local address to which the packet was sent.
+ * @param ttl [in] - The received TTL or hop limit.
+ * @param receiveTime [in] - Monotonic time that the packet arrived.
+ */
+void Beacon::handleReceivedPacket(const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+                                  const AddrKey &destAddr, uint8_t ttl, const TimeSpec &receiveTime)
+{
+  if (m_capture)
+    m_capture->Record(m_shardIndex, data, dataLength, sourceAddr, sourcePort, destAddr, ttl, receiveTime);
+
+  BfdPacketView packet(data, dataLength);
+  if (!screenControlPacket(packet, sourceAddr, sourcePort, destAddr, ttl))
     return;
+
+  // The kernel picks which shard's socket receives the packet, so it may
+  // belong to another shard.
+  if (m_shardCount > 1)
+  {
+    Beacon *owner;
+    uint32_t yourDisc = packet.GetYourDisc();
+    if (yourDisc != 0)
+      owner = discriminatorShard(yourDisc);
+    else
+      owner = ownerShard(sourceAddr, destAddr);
+
+    if (owner != this)
+    {
+      forwardControlPacket(*owner, packet, sourceAddr, sourcePort, destAddr, receiveTime);
+      return;
+    }
   }
 
-  LogOptional(Log::Packet, "Received bfd packet %zu bytes from %s to %s", m_packet.GetDataSize(), sourceAddr.ToString(), destIpAddr.ToString());
+  dispatchControlPacket(packet, sourceAddr, sourcePort, destAddr, receiveTime);
+}
+
+/**
+ * Counts a received packet, and performs the checks that need no session.
+ *
+ * @return bool - false if the packet was discarded.
+ */
+bool Beacon::screenControlPacket(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort,
+                                 const AddrKey &destAddr, uint8_t ttl)
+{
+  LogDeferred(Log::Packet, PacketLogData, formatReceivedPacket, PacketLogData(packet.GetDataLength(), sourceAddr, sourcePort, destAddr));
+  m_counters.received++;
 
   //
   // Check ip specific stuff. See draft-ietf-bfd-v4v6-1hop-11.txt
@@ -473,10 +3366,11 @@ void Beacon::handleListenSocket(Socket &socket)
   // Port
   if (m_strictPorts)
   {
-    if (sourceAddr.Port() < bfd::MinSourcePort) // max port is max value, so no need to check
+    if (sourcePort < bfd::MinSourcePort) // max port is max value, so no need to check
     {
-      LogOptional(Log::Discard, "Discard packet: bad source port %s to %s", sourceAddr.ToString(), destIpAddr.ToString());
-      return;
+      LogDeferred(Log::Discard, PacketLogData, formatBadSourcePort, PacketLogData(0, sourceAddr, sourcePort, destAddr));
+      CountDiscard(DiscardReason::BadPort);
+      return false;
     }
   }
 
@@ -484,99 +3378,260 @@ void Beacon::handleListenSocket(Socket &socket)
   if (ttl != 255)
   {
     gLog.Optional(Log::Discard, "Discard packet: bad ttl/hops %hhu", ttl);
-    return;
+    CountDiscard(DiscardReason::BadTtl);
+    return false;
   }
 
-  if (!Session::InitialProcessControlPacket(m_packet.GetData(), m_packet.GetDataSize(), packet))
+  if (!packet.Validate())
   {
     gLog.Optional(Log::Discard, "Discard packet");
+    CountDiscard(DiscardReason::Invalid);
+    return false;
+  }
+
+  return true;
+}
+
+void Beacon::ReplayPacket(const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+                          const AddrKey &destAddr, uint8_t ttl, const TimeSpec &receiveTime, ReceiveStageTimes &times)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  TimeSpec start(TimeSpec::MonoNow());
+  BfdPacketView packet(data, dataLength);
+  bool passed = screenControlPacket(packet, sourceAddr, sourcePort, destAddr, ttl);
+  TimeSpec screened(TimeSpec::MonoNow());
+
+  times.packets++;
+  times.screenTime += uint64_t((screened - start).ToNanoseconds());
+  if (!passed)
+  {
+    times.screened++;
+    return;
+  }
+
+  Session *session = findPacketSession(packet, sourceAddr, sourcePort, destAddr);
+  TimeSpec found(TimeSpec::MonoNow());
+  times.lookupTime += uint64_t((found - screened).ToNanoseconds());
+  if (!session)
+  {
+    times.unmatched++;
+    return;
+  }
+
+  deliverControlPacket(*session, packet, sourcePort, receiveTime);
+  times.sessionTime += uint64_t((TimeSpec::MonoNow() - found).ToNanoseconds());
+}
+
+/**
+ * Sends the packet to another shard.
+ */
+void Beacon::forwardControlPacket(Beacon &owner, const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort,
+                                  const AddrKey &destAddr, const TimeSpec &receiveTime)
+{
+  ForwardedPacket *forward = new(std::nothrow) ForwardedPacket;
+  if (!forward)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: no memory to forward to shard %zu.", owner.m_shardIndex);
+    CountDiscard(DiscardReason::NoResources);
     return;
   }
 
+  // Only the packet itself is needed, any extra data was already ignored.
+  forward->dataLength = min(packet.GetLength(), sizeof(forward->data));
+  memcpy(forward->data, packet.GetData(), forward->dataLength);
+  forward->sourceAddr = sourceAddr;
+  forward->sourcePort = sourcePort;
+  forward->destAddr = destAddr;
+  forward->receiveTime = receiveTime;
+
+  if (!owner.queueShardOperation(handleForwardedPacketCallback, forward, false))
+  {
+    // Only fails during shutdown, or on low memory.
+    delete forward;
+    gLog.Optional(Log::Discard, "Discard packet: could not forward to shard %zu.", owner.m_shardIndex);
+    CountDiscard(DiscardReason::NoResources);
+  }
+}
+
+/**
+ * Called on the owning shard's main thread for a forwarded packet.
+ */
+void Beacon::handleForwardedPacketCallback(Beacon *beacon, void *userdata)
+{
+  Raii<ForwardedPacket>::Delete forward(reinterpret_cast<ForwardedPacket *>(userdata));
+
+  if (beacon->IsShutdownRequested())
+    return;
+  // Already validated by the receiving shard.
+  BfdPacketView packet(forward->data, forward->dataLength);
+  beacon->dispatchControlPacket(packet, forward->sourceAddr, forward->sourcePort, forward->destAddr, forward->receiveTime);
+}
+
+/**
+ * Finds, or creates, the session for an initially processed control packet, and
+ * passes the packet on.
+ *
+ * @param packet [in] - The packet.
+ * @param sourceAddr [in] - Where the packet came from.
+ * @param sourcePort [in] - The source port, in host order.
+ * @param destAddr [in] - The local address to which the packet was sent.
+ * @param receiveTime [in] - Monotonic time that the packet arrived.
+ */
+void Beacon::dispatchControlPacket(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort,
+                                   const AddrKey &destAddr, const TimeSpec &receiveTime)
+{
+  Session *session = findPacketSession(packet, sourceAddr, sourcePort, destAddr);
+  if (session)
+    deliverControlPacket(*session, packet, sourcePort, receiveTime);
+}
+
+/**
+ * Finds the session for a control packet, or creates a passive one.
+ *
+ * @return Session* - NULL if the packet was discarded.
+ */
+Session* Beacon::findPacketSession(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort, const AddrKey &destAddr)
+{
+  Session *session = NULL;
+  uint32_t yourDisc = packet.GetYourDisc();
+
   // We have a (partially) valid packet ... now find the correct session.
-  if (packet.header.yourDisc != 0)
+  if (yourDisc != 0)
   {
-    DiscMapIt found = m_discMap.find(packet.header.yourDisc);
-    if (found == m_discMap.end())
+    session = m_discMap.Find(yourDisc);
+    if (!session)
     {
-      if (gLog.LogTypeEnabled(Log::DiscardDetail))
-        Session::LogPacketContents(packet, false, true, sourceAddr, destIpAddr);
+      if (gLog.LogTypeEnabledHint(Log::DiscardDetail))
+        logDiscardedPacket(packet, sourceAddr, sourcePort, destAddr);
 
-      gLog.Optional(Log::Discard, "Discard packet: no session found for yourDisc <%u>.", packet.header.yourDisc);
-      return;
+      gLog.Optional(Log::Discard, "Discard packet: no session found for yourDisc <%u>.", yourDisc);
+      CountDiscard(DiscardReason::UnknownDisc);
+      return NULL;
     }
-    session = found->second;
-    if (session->GetRemoteAddress() != sourceIpAddr)
+    if (session->GetRemoteKey() != sourceAddr)
     {
-      if (gLog.LogTypeEnabled(Log::DiscardDetail))
-        Session::LogPacketContents(packet, false, true, sourceAddr, destIpAddr);
+      if (gLog.LogTypeEnabledHint(Log::DiscardDetail))
+        logDiscardedPacket(packet, sourceAddr, sourcePort, destAddr);
 
-      LogOptional(Log::Discard, "Discard packet: mismatched yourDisc <%u> and ip <from %s to %s>.", packet.header.yourDisc, sourceAddr.ToString(), destIpAddr.ToString());
-      return;
+      LogDeferred(Log::Discard, PacketLogData, formatMismatchedDisc, PacketLogData(0, sourceAddr, sourcePort, destAddr, yourDisc));
+      CountDiscard(DiscardReason::AddressMismatch);
+      return NULL;
     }
   }
   else
   {
     // No discriminator
-    session = findInSourceMap(sourceIpAddr, destIpAddr);
+    session = findInSourceMap(sourceAddr, destAddr);
     if (NULL == session)
     {
-      // No session yet .. create one !?
+      // No session yet .. create one !? This is rare, so the addresses are
+      // built only here.
+      IpAddr sourceIpAddr(sourceAddr.ToIpAddr());
+      IpAddr destIpAddr(destAddr.ToIpAddr());
+      SockAddr sourceSockAddr(sourceIpAddr, sourcePort);
+
       if (!m_allowAnyPassiveIP && m_allowedPassiveIP.find(sourceIpAddr) == m_allowedPassiveIP.end())
       {
-        if (gLog.LogTypeEnabled(Log::DiscardDetail))
-          Session::LogPacketContents(packet, false, true, sourceAddr, destIpAddr);
+        if (gLog.LogTypeEnabledHint(Log::DiscardDetail))
+          logDiscardedPacket(packet, sourceAddr, sourcePort, destAddr);
 
-        LogOptional(Log::Discard, "Ignoring unauthorized bfd packets from %s",  sourceAddr.ToString());
-        return;
+        LogDeferred(Log::Discard, PacketLogData, formatUnauthorized, PacketLogData(0, sourceAddr, sourcePort, destAddr));
+        CountDiscard(DiscardReason::Unauthorized);
+        return NULL;
       }
 
       session = addSession(sourceIpAddr, destIpAddr);
       if (!session)
-        return;
-      if (!session->StartPassiveSession(sourceAddr, destIpAddr))
       {
-        gLog.LogError("Failed to add new session for local %s to remote  %s id=%d.", destIpAddr.ToString(), sourceAddr.ToString(), session->GetId());
+        CountDiscard(DiscardReason::NoResources);
+        return NULL;
+      }
+      if (!session->StartPassiveSession(sourceSockAddr, destIpAddr))
+      {
+        gLog.LogError("Failed to add new session for local %s to remote  %s id=%d.", destIpAddr.ToString(), sourceSockAddr.ToString(), session->GetId());
         KillSession(session);
+        CountDiscard(DiscardReason::NoResources);
+        return NULL;
       }
-      LogOptional(Log::Session, "Added new session for local %s to remote  %s id=%d.", destIpAddr.ToString(), sourceAddr.ToString(), session->GetId());
+      LogOptional(Log::Session, "Added new session for local %s to remote  %s id=%d.", destIpAddr.ToString(), sourceSockAddr.ToString(), session->GetId());
     }
   }
 
-  //
-  //  We have a session that can handle the rest.
-  //
-  session->ProcessControlPacket(packet, sourceAddr.Port());
+  return session;
+}
+
+/**
+ * Hands a control packet to the session that can handle the rest.
+ */
+void Beacon::deliverControlPacket(Session &session, const BfdPacketView &packet, in_port_t sourcePort, const TimeSpec &receiveTime)
+{
+  BfdPacket fullPacket;
+  packet.ToPacket(fullPacket);
+  m_packetStats.sessionPackets++;
+  session.ProcessControlPacket(fullPacket, sourcePort, receiveTime);
+}
+
+/**
+ * Logs the contents of a packet that was discarded without reaching a session.
+ */
+void Beacon::logDiscardedPacket(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort, const AddrKey &destAddr)
+{
+  BfdPacket fullPacket;
+  packet.ToPacket(fullPacket);
+  Session::LogPacketContents(fullPacket, false, true, sourceAddr.ToSockAddr(sourcePort), destAddr.ToIpAddr());
 }
 
 /**
- * Adds a session
+ * Adds a session. The caller must start it.
+ *
+ * @param restoreDisc [in] - The discriminator of a session restored from the
+ *                    checkpoint. 0 to allocate one.
+ * @param restoreId [in] - The id of a session restored from the checkpoint. 0
+ *                  for a new one.
  *
  * @return Session* - NULL on failure
  */
-Session* Beacon::addSession(const IpAddr &remoteAddr, const IpAddr &localAddr)
+Session* Beacon::addSession(const IpAddr &remoteAddr, const IpAddr &localAddr, uint32_t restoreDisc, uint32_t restoreId)
 {
-  uint32_t newDisc = makeUniqueDiscriminator();
-  Raii<Session>::Delete session;
+  uint32_t newDisc = restoreDisc ? restoreDisc : m_discAllocator.Allocate(TimeSpec::MonoNow());
+  if (newDisc == 0)
+    return NULL;
+
+  RaiiClassCall<Session, Beacon, &Beacon::freeSession> session(this);
 
   try
   {
-    session = new Session(*m_scheduler, this, newDisc, m_initialSessionParams);
+    void *block = m_sessionPool.Allocate();
+    try
+    {
+      session = new (block) Session(*m_scheduler, this, newDisc, newSessionParams(), restoreId);
+    }
+    catch (...)
+    {
+      m_sessionPool.Free(block);
+      throw;
+    }
 
     if (0 == session->GetId())
       return NULL;
+    session->SetProfile(m_newSessionProfile, m_profiles[m_newSessionProfile].version);
 
-    m_sourceMap[SourceMapKey(remoteAddr, localAddr)] = session;
-    m_discMap[newDisc] = session;
-    m_IdMap[session->GetId()] = session;
+    m_discMap.Insert(newDisc, session);
+    m_IdMap.Insert(session->GetId(), session);
+    // Last, since the session can not be found by its addresses until the
+    // caller starts it. A failed Insert() leaves the index unchanged.
+    m_sourceMap.Insert(AddressPairKey(AddrKey(remoteAddr), AddrKey(localAddr)), session);
   }
   catch (std::exception &e)
   {
     if (session.IsValid())
     {
-      m_sourceMap.erase(SourceMapKey(remoteAddr, localAddr));
-      m_IdMap.erase(session->GetId());
+      m_discMap.Erase(newDisc);
+      m_IdMap.Erase(session->GetId());
     }
+    else
+      m_discAllocator.Release(newDisc, TimeSpec::MonoNow());
 
     gLog.Message(Log::Error, "Add session failed: %s ", e.what());
     return NULL;
@@ -585,6 +3640,32 @@ Session* Beacon::addSession(const IpAddr &remoteAddr, const IpAddr &localAddr)
   return session.Detach();
 }
 
+void Beacon::GetMemoryStats(MemoryStats &outStats)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  SlabPool::Stats poolStats;
+  m_sessionPool.GetStats(poolStats);
+  outStats.sessions = poolStats.inUse;
+  outStats.sessionSize = poolStats.itemSize;
+  outStats.sessionBytes = poolStats.slabBytes;
+  outStats.mapBytes = m_discMap.GetMemoryBytes() + m_IdMap.GetMemoryBytes() + m_sourceMap.GetMemoryBytes();
+}
+
+/**
+ * Destroys a session made by addSession(). The session must already be removed
+ * from the maps.
+ */
+void Beacon::freeSession(Session *session)
+{
+  if (!session)
+    return;
+  uint32_t disc = session->GetLocalDiscriminator();
+  session->~Session();
+  m_sessionPool.Free(session);
+  m_discAllocator.Release(disc, TimeSpec::MonoNow());
+}
+
 /**
  * Call from any thread to trigger handleSelfMessage on main thread.
  *
@@ -607,69 +3688,101 @@ bool Beacon::triggerSelfMessage()
 void Beacon::handleSelfMessage(int sigId)
 {
   (void)sigId;
-  AutoQuickLock lock(m_paramsLock);
+  TimeSpec deadline(TimeSpec::MonoNow() + TimeSpec(TimeSpec::Microsec, OperationTimeSlice));
+  PendingOperation *operation;
 
-  while (!m_operations.empty())
-  {
-    PendingOperation *operation;
-    operation = m_operations.front();
-    m_operations.pop_front();
-    lock.UnLock();
+  // Clear before running any, so that anything queued after this will signal.
+  atomicStore(&m_operationsSignaled, uint32_t(0));
 
-    try
-    {
-      operation->callback(this,  operation->userdata);
-    }
-    catch (std::exception &e)
+  operation = m_currentBatch;
+  m_currentBatch = NULL;
+  while (true)
+  {
+    if (operation && !runOperation(operation, deadline))
     {
-      gLog.Message(Log::Error, "Beacon operation failed: %s ", e.what());
+      signalOperations();
+      return;
     }
 
-    if (!operation->waitCondition)
-      delete operation;
-    else
+    // Leave the rest for later, so that timers and packets are not held up. The
+    // signal ensures that we will be called again.
+    if (TimeSpec::MonoNow() > deadline && !IsShutdownRequested())
     {
-      lock.Lock();
-      operation->completed = true;
-      lock.SignalAndUnlock(*operation->waitCondition);
+      signalOperations();
+      return;
     }
 
-    lock.Lock();
+    operation = static_cast<PendingOperation *>(m_operations.Pop());
+    if (!operation)
+      break;
   }
 
-  if (m_shutownRequested)
-  {
-    lock.UnLock();
+  if (IsShutdownRequested())
     m_scheduler->RequestShutdown();
-  }
 }
 
 /**
- * This creates a "unique" discriminator value. Could be done more methodically to
- * absolutely ensure that we do not re-use a discriminator after a session is
- * removed ... but for now this is probably good enough.
+ * Runs a single queued operation, and frees it, or wakes its waiting thread.
  *
- * @note call only from main thread.
+ * @Note call only from main thread.
  *
- * @return uint32_t
+ * @param deadline [in] - For batches, the time to stop.
+ *
+ * @return bool - false if the operation is a batch that reached deadline. It is
+ *         then saved in m_currentBatch.
  */
-uint32_t Beacon::makeUniqueDiscriminator()
+bool Beacon::runOperation(PendingOperation *operation, const TimeSpec &deadline)
 {
-  uint32_t disc = 0;
-
-  // If there were a huge number of sessions this would be inefficient, or even
-  // hang. But should be ok.
-  while (true)
+  if (operation->batch)
   {
-    disc = rand() % UINT32_MAX;
-
-    if (disc != 0)
+    if (!runBatch(operation, deadline))
     {
-      DiscMapIt it = m_discMap.find(disc);
-      if (it == m_discMap.end())
-        return disc;
+      m_currentBatch = operation;
+      return false;
     }
+
+    m_primary->advanceBatch(operation->batch);
+    freeOperation(operation);
+    return true;
+  }
+
+  try
+  {
+    operation->callback(this,  operation->userdata);
+  }
+  catch (std::exception &e)
+  {
+    gLog.Message(Log::Error, "Beacon operation failed: %s ", e.what());
+  }
+
+  if (!operation->waitCondition)
+    freeOperation(operation);
+  else
+  {
+    AutoQuickLock lock(m_paramsLock);
+    operation->completed = true;
+    lock.SignalAndUnlock(*operation->waitCondition);
   }
+
+  return true;
+}
+
+/**
+ * Runs all remaining operations during shutdown.
+ *
+ * @Note call only from main thread, once no more operations can be queued.
+ */
+void Beacon::drainOperations()
+{
+  PendingOperation *operation = m_currentBatch;
+
+  LogAssert(IsShutdownRequested());
+  m_currentBatch = NULL;
+  if (operation)
+    runOperation(operation, TimeSpec());
+
+  while (NULL != (operation = static_cast<PendingOperation *>(m_operations.Pop())))
+    runOperation(operation, TimeSpec());
 }
 
 void Beacon::SetDefMulti(uint8_t val)
@@ -678,7 +3791,7 @@ void Beacon::SetDefMulti(uint8_t val)
   if (!LogVerify(val != 0)) // v10/4.1
     return;
 
-  m_initialSessionParams.detectMulti = val;
+  newSessionParams().detectMulti = val;
 }
 
 void Beacon::SetDefMinTxInterval(uint32_t val)
@@ -687,23 +3800,51 @@ void Beacon::SetDefMinTxInterval(uint32_t val)
   if (!LogVerify(val != 0)) // v10/4.1
     return;
 
-  m_initialSessionParams.desiredMinTx = val;
+  newSessionParams().desiredMinTx = val;
 }
 
 void Beacon::SetDefMinRxInterval(uint32_t val)
 {
   LogAssert(m_scheduler->IsMainThread());
-  m_initialSessionParams.requiredMinRx = val;
+  newSessionParams().requiredMinRx = val;
 }
 
 void Beacon::SetDefControlPlaneIndependent(bool cpi)
 {
   LogAssert(m_scheduler->IsMainThread());
-  m_initialSessionParams.controlPlaneIndependent = cpi;
+  newSessionParams().controlPlaneIndependent = cpi;
 }
 
 void Beacon::SetDefAdminUpPollWorkaround(bool enable)
 {
   LogAssert(m_scheduler->IsMainThread());
-  m_initialSessionParams.adminUpPollWorkaround = enable;
+  newSessionParams().adminUpPollWorkaround = enable;
+}
+
+void Beacon::SetDefLowPriority(bool lowPriority)
+{
+  LogAssert(m_scheduler->IsMainThread());
+  newSessionParams().lowPriority = lowPriority;
+}
+
+void Beacon::SetDefEchoInterval(uint32_t val)
+{
+  LogAssert(m_scheduler->IsMainThread());
+  newSessionParams().echoInterval = val;
+}
+
+void Beacon::SetDefDemandMode(bool enable)
+{
+  LogAssert(m_scheduler->IsMainThread());
+  newSessionParams().demandMode = enable;
+}
+
+bool Beacon::SetDefAuthKey(uint32_t id)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (id != NoAuthKey && !isAuthKey(id))
+    return false;
+  newSessionParams().authKey = id;
+  return true;
 }
@@ -10,41 +10,709 @@
  */
 #pragma once
 #include "Session.h"
+#include "Scheduler.h"
 #include "threads.h"
-#include "hash_map.h"
 #include "RecvMsg.h"
 #include "SockAddr.h"
-#include <deque>
+#include "TransmitQueue.h"
+#include "TransmitEngine.h"
+#include "PacketRing.h"
+#include "PacketCapture.h"
+#include "MpscQueue.h"
+#include "StatusTable.h"
+#include "SessionEvents.h"
+#include "SourcePortAllocator.h"
+#include "SlabPool.h"
+#include "Histogram.h"
+#include "SessionIndex.h"
+#include "DiscriminatorAllocator.h"
+#include "BfdAuth.h"
+#include <string>
 #include <vector>
+#include <deque>
 #include <set>
 #include <list>
 
-struct sockaddr_in;
+struct sockaddr_in;
+struct ListenCallbackData;
+
+class Socket;
+class BfdPacketView;
+class SessionCheckpoint;
+class StatusExport;
+class MetricsServer;
+struct StatusExportShard;
+struct StatusExportRecord;
+
+/**
+ * The beacon. Sessions may be divided among several shards, each of which is a
+ * Beacon with its own scheduler thread, listen sockets, and sessions. Unless
+ * noted otherwise, methods act only on the shard on which they are called, and
+ * "main thread" means that shard's scheduler thread.
+ */
+class Beacon
+{
+public:
+  Beacon();
+  ~Beacon();
+
+  /**
+   * Start the beacon.
+   *
+   * @param controlPorts [in] - A list of address and port combinations on which
+   *                     to listen for control commands.
+   * @param listenAddrs [in] - A list of address on which to listen for new BDF
+   *                    sessions. 'ANY' is allowed.
+   *
+   *
+   * @return - false on failure
+   */
+  bool Run(const std::list<SockAddr> &controlPorts, const std::list<IpAddr> &listenAddrs);
+
+  /**
+   * Sets the maximum number of packets that are received from a listen socket
+   * with a single system call.
+   *
+   * @note Call only before Run().
+   *
+   * @param batchSize [in] - Must be at least 1.
+   */
+  void SetReceiveBatchSize(size_t batchSize);
+
+  static const size_t DefaultReceiveBatchSize = 32;
+  static const size_t MaxReceiveBatchSize = 1024;
+
+  /**
+   * Sets the maximum number of control packets handled in one receive callback,
+   * so that a flood of packets can not lock out timers and other sockets. The
+   * rest are handled on a later scheduler iteration. Packets from a listen
+   * socket are read in whole batches, so the budget is rounded up to a multiple
+   * of the receive batch size.
+   *
+   * @note Call only before Run().
+   *
+   * @param packets [in] - Must be at least 1.
+   */
+  void SetReceiveBudget(size_t packets);
+
+  static const size_t DefaultReceiveBudget = 128;
+  static const size_t MaxReceiveBudget = 64 * 1024;
+
+  /**
+   * Sets how outgoing control packets are batched. See TransmitQueue.
+   *
+   * @note Call only before Run().
+   *
+   * @param maxDepth [in] - The maximum number of packets queued before sending.
+   *                 1 disables batching.
+   * @param window [in] - The maximum time, in microseconds, a packet is held.
+   * @param sharedSockets [in] - Should sessions with the same local address
+   *                      share one socket.
+   */
+  void SetTransmitBatching(size_t maxDepth, uint32_t window, bool sharedSockets);
+
+  /**
+   * Sets whether periodic control packets are sent by a dedicated thread for
+   * each shard. See TransmitEngine.
+   *
+   * @note Call only before Run().
+   */
+  void SetTransmitThread(bool useThread);
+
+  /**
+   * Sets whether each shard's scheduler uses io_uring, where available. See
+   * IoUringScheduler. If the ring can not be created, the usual scheduler is
+   * used.
+   *
+   * @note Call only before Run().
+   */
+  void SetIoUringScheduler(bool useIoUring);
+
+  /**
+   * @return bool - Can SetIoUringScheduler() be used on this build.
+   */
+  static bool IsIoUringSchedulerSupported();
+
+  /**
+   * Sets the clock that each shard's scheduler uses for its loop time. See
+   * Scheduler::SetClockSource().
+   *
+   * @note Call only before Run().
+   */
+  void SetSchedulerClock(Scheduler::ClockSource::Value source);
+
+  /**
+   * Sets how each shard's scheduler shares its time between packets and low
+   * priority timers, such as session detection timeouts. See
+   * Scheduler::SetBudget().
+   *
+   * @note Call only before Run().
+   */
+  void SetSchedulerBudget(const Scheduler::Budget &budget);
+
+  /**
+   * Sets whether control packets are received through a memory mapped packet
+   * ring, instead of from the listen sockets. See PacketRing.
+   *
+   * @note Call only before Run().
+   *
+   * @param frameCount [in] - The size of each shard's ring. 0 to use the listen
+   *                   sockets.
+   */
+  void SetReceiveRing(size_t frameCount);
+
+  /**
+   * Sets how long the local discriminator of a deleted session is kept out of
+   * use, so that late packets for it are not taken for a new session.
+   *
+   * @note Call only before Run().
+   *
+   * @param quarantineMs [in] - Time in milliseconds.
+   */
+  void SetDiscriminatorQuarantine(uint32_t quarantineMs);
+
+  /**
+   * Sets a checkpoint file, for a graceful restart. When the beacon is stopped
+   * normally, the state of every session is written to the file. When the
+   * beacon is started, sessions in the file are resumed, using the same
+   * discriminators, timers and send ports, and the file is deleted. Peers will
+   * not notice a restart that is shorter than their detection time. Sessions are
+   * only restored with the same shard count.
+   *
+   * @note Call only before Run().
+   *
+   * @param path [in] - The file. NULL or empty for none.
+   */
+  void SetCheckpointFile(const char *path);
+
+  static const size_t DefaultStatusExportSessions = 65536;
+
+  /**
+   * Publishes the status and counters of every session in a memory mapped file,
+   * for local monitoring agents, see StatusExport. The file is created when the
+   * beacon starts, and deleted when it stops. Status is written when it changes,
+   * and counters about once a second.
+   *
+   * @note Call only before Run().
+   *
+   * @param path [in] - The file. NULL or empty for none.
+   * @param maxSessions [in] - Sessions, for all shards, that the file has room
+   *                    for. Sessions beyond a shard's share are not exported.
+   */
+  void SetStatusExport(const char *path, size_t maxSessions);
+
+  /**
+   * Serves Prometheus metrics over HTTP, on a thread of its own. Session
+   * metrics are read from the status export, which is kept in memory if
+   * SetStatusExport() gave no file. Scheduler metrics are published by each
+   * shard about once a second. So a scrape never waits for, or delays, a
+   * shard.
+   *
+   * @note Call only before Run().
+   *
+   * @param addr [in] - The address and port to listen on. Not valid for none.
+   */
+  void SetMetrics(const SockAddr &addr);
+
+  /**
+   * Captures received control packets to a pcap file from when the beacon
+   * starts, as with StartCapture().
+   *
+   * @note Call only before Run().
+   *
+   * @param path [in] - The file. NULL or empty for none.
+   */
+  void SetCapture(const char *path);
+
+  /**
+   * Starts capturing every control packet that the shards receive, before any
+   * checks, to a pcap file, see PacketCapture. Any capture that is running is
+   * stopped first.
+   *
+   * @Note can be called from any thread, other than a shard's main thread, while
+   *       the beacon is running.
+   *
+   * @param path [in] - The file, which is replaced.
+   * @param limit [in] - Packets to write before the capture stops by itself. 0
+   *              for no limit.
+   *
+   * @return bool - false on failure. Errors are logged.
+   */
+  bool StartCapture(const char *path, uint64_t limit);
+
+  /**
+   * Stops the capture, and closes its file.
+   *
+   * @Note can be called from any thread, other than a shard's main thread, while
+   *       the beacon is running.
+   *
+   * @return bool - false if there was no capture, or the beacon is shutting
+   *         down.
+   */
+  bool StopCapture();
+
+  struct CaptureStatus
+  {
+    std::string path;
+    PacketCapture::Stats stats;
+  };
+
+  /**
+   * @Note can be called from any thread while the beacon is running.
+   *
+   * @return bool - false if there is no capture.
+   */
+  bool GetCaptureStatus(CaptureStatus &outStatus);
+
+  /**
+   * Enables the echo function (v10/6.4), in a form that only works between
+   * OpenBFDD beacons. Each shard opens a socket on the echo port of every
+   * listen address. Echo packets in our own format, from the peer of a session
+   * that is Up, are sent straight back, without involving the session. This
+   * stands in for the forwarding plane loopback of RFC 5881, which a userspace
+   * daemon can not use. Sessions that have an echo interval, see
+   * Session::SetEchoInterval(), send their own echo packets to the peer's echo
+   * port, and use them to detect failures once they come back. While they do,
+   * the session's control packets are slowed.
+   *
+   * @note Call only before Run().
+   *
+   * @param receiveInterval [in] - The Required Min Echo RX Interval that
+   *                        sessions send, in microseconds. 0 for no echo.
+   * @param controlInterval [in] - While a session's echo packets are coming
+   *                        back, its control packets are sent, and expected, no
+   *                        more often than this, in microseconds.
+   */
+  void SetEcho(uint32_t receiveInterval, uint32_t controlInterval);
+
+  static const uint32_t DefaultEchoReceiveInterval = 5000;
+  static const uint32_t DefaultEchoControlInterval = 1000000;
+
+  /**
+   * @Note can be called from any thread.
+   *
+   * @return uint32_t - The Required Min Echo RX Interval for sessions. 0 if the
+   *         echo function is not enabled.
+   */
+  uint32_t GetEchoReceiveInterval() { return m_echoReceiveInterval;}
+
+  /**
+   * @Note can be called from any thread.
+   *
+   * @return uint32_t - See SetEcho().
+   */
+  uint32_t GetEchoControlInterval() { return m_echoControlInterval;}
+
+  /**
+   * @Note can be called from any thread.
+   *
+   * @return uint32_t - The instance in the echo packets that sessions send.
+   */
+  uint32_t GetEchoInstance() { return m_primary->m_echoInstance;}
+
+  /**
+   * Gets this shard's echo socket for a local address.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return int - -1 if there is none.
+   */
+  int GetEchoSocket(const IpAddr &localAddr);
+
+  /**
+   * Gets the status export, for readers on other threads.
+   *
+   * @Note can be called from any thread while the beacon is running.
+   *
+   * @return StatusExport* - NULL if there is none.
+   */
+  StatusExport* GetStatusExport() { return m_primary->m_statusExport;}
+
+  /**
+   * Gets the scheduler statistics that a shard last published. See
+   * SetMetrics().
+   *
+   * @Note can be called from any thread while the beacon is running.
+   *
+   * @param shard [in] - The shard index.
+   * @param outStats [out] - The statistics.
+   *
+   * @return bool - false if the shard has not published any, or they kept
+   *         changing.
+   */
+  bool GetPublishedSchedulerStats(size_t shard, Scheduler::Stats &outStats);
+
+  /**
+   * Settings that keep the shard threads from being delayed by other processes
+   * or by page faults. See SetRealtime().
+   */
+  struct RealtimeParams
+  {
+    RealtimeParams() : fifoPriority(0), lockMemory(false), maxSessions(0) { }
+
+    std::vector<int> cpus; // Shard n is pinned to cpus[n % cpus.size()]. Empty for no pinning.
+    int fifoPriority;      // SCHED_FIFO priority for the shard threads. 0 for the normal policy.
+    bool lockMemory;       // Lock all memory, current and future, with mlockall().
+    size_t maxSessions;    // Sessions, for all shards, to allocate room for at startup.
+  };
+
+  /**
+   * Sets the real time settings. Pinning and priority apply only to the threads
+   * that run the shard schedulers. Failures are logged, and the beacon runs
+   * anyway. See GetRealtimeStatus().
+   *
+   * @note Call only before Run().
+   */
+  void SetRealtime(const RealtimeParams &params);
+
+  /**
+   * Whether each real time setting took effect on a shard.
+   */
+  struct RealtimeStatus
+  {
+    int cpu;                // CPU the shard should be pinned to. -1 for none.
+    bool pinned;            // The shard thread is pinned to cpu.
+    int fifoPriority;       // Requested SCHED_FIFO priority. 0 for none.
+    bool fifo;              // The shard thread runs with SCHED_FIFO at fifoPriority.
+    bool lockMemory;        // mlockall() was requested.
+    bool memoryLocked;      // mlockall() succeeded. The same for all shards.
+    size_t reserveSessions; // Sessions this shard was to have room for. 0 for none.
+    bool reserved;          // All of that room was allocated.
+    size_t reservedBytes;   // Storage for sessions, maps and timers, just after startup.
+    size_t sessions;        // Sessions now.
+    size_t storageBytes;    // Storage for sessions, maps and timers now. More than
+                            // reservedBytes if any of them grew.
+  };
+
+  /**
+   * @Note can be called only on the main thread.
+   */
+  void GetRealtimeStatus(RealtimeStatus &outStatus);
+
+  /**
+   * Settings for the overload controller. See SetOverload().
+   */
+  struct OverloadParams
+  {
+    OverloadParams() : enabled(false), latenessUs(10000), busyPercent(90), backoffInterval(1000000), holdMs(10000) { }
+
+    bool enabled;
+    uint32_t latenessUs;      // Overloaded when the 99th percentile timer lateness is above this.
+    uint32_t busyPercent;     // Overloaded when the scheduler is busy at least this much of the time.
+    uint32_t backoffInterval; // Low priority sessions are slowed to at least this, in microseconds.
+    uint32_t holdMs;          // The load must stay below the limits this long, before intervals are restored.
+  };
+
+  /**
+   * Sets the overload controller. Each shard watches its own scheduler. When
+   * timers run late, or the scheduler is busy nearly all of the time, the
+   * shard's low priority sessions are slowed, see Session::SetLowPriority() and
+   * Session::SetBackoff(), and their intervals are restored once the load stays
+   * below the limits for holdMs. Changes are made with poll sequences, a few at
+   * a time, and are logged and counted. See GetOverloadStats().
+   *
+   * @note Call only before Run().
+   */
+  void SetOverload(const OverloadParams &params);
+
+  struct OverloadStats
+  {
+    OverloadStats() : overloaded(false), latenessP99(0), busyPercent(0), overloads(0), recoveries(0), backoffs(0),
+       restores(0), lowPriority(0), backedOff(0) { }
+
+    OverloadParams params;
+    bool overloaded;
+    uint64_t latenessP99;  // Timer lateness, in microseconds, for the last check.
+    uint32_t busyPercent;  // For the last check.
+    uint64_t overloads;    // Times the shard became overloaded.
+    uint64_t recoveries;   // Times the load subsided.
+    uint64_t backoffs;     // Sessions slowed.
+    uint64_t restores;     // Sessions restored.
+    size_t lowPriority;    // Low priority sessions now.
+    size_t backedOff;      // Sessions slowed now.
+  };
+
+  /**
+   * @Note can be called only on the main thread.
+   */
+  void GetOverloadStats(OverloadStats &outStats);
+
+  static const uint32_t DefaultProfile = 0; // Always there, named DefaultProfileName.
+  static const uint32_t NoProfile = UINT32_MAX;
+  static const size_t MaxProfiles = 256; // Including deleted ones.
+  static const size_t MaxProfileNameLength = 32;
+  static const uint32_t DefaultProfileRate = 1000;
+  static const char *DefaultProfileName;
+
+  /**
+   * Sets how many sessions each shard moves to new profile settings every
+   * second. See SetProfileParams().
+   *
+   * @note Call only before Run().
+   */
+  void SetProfileRate(uint32_t sessionsPerSecond);
+
+  /**
+   * @return uint32_t - The id of the profile, or NoProfile.
+   *
+   * @Note can be called only on the main thread.
+   */
+  uint32_t FindProfile(const char *name);
+
+  /**
+   * Makes a new profile, with the settings of DefaultProfile. Each shard has
+   * its own copy of the profiles, and since commands run on every shard in the
+   * same order, ids match across shards.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return uint32_t - The id of the profile, or NoProfile if there are too
+   *         many.
+   */
+  uint32_t MakeProfile(const char *name);
+
+  /**
+   * Deletes a profile. Its sessions move to DefaultProfile, and get its
+   * settings, at the rate of SetProfileRate(). DefaultProfile can not be
+   * deleted. The id is not used again.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return bool - false if there is no such profile.
+   */
+  bool DeleteProfile(uint32_t id);
+
+  /**
+   * @return const Session::InitialParams* - NULL if there is no such profile.
+   *
+   * @Note can be called only on the main thread.
+   */
+  const Session::InitialParams* GetProfileParams(uint32_t id);
+
+  /**
+   * Changes the settings of a profile. This only marks the sessions that use
+   * the profile as out of date. They are then given the new settings a few at
+   * a time, at the rate of SetProfileRate(), so that a change for many
+   * sessions does not start all of their poll sequences at once. Each session
+   * gets all of the profile's settings, replacing any that were set for the
+   * session alone.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return bool - false if there is no such profile.
+   */
+  bool SetProfileParams(uint32_t id, const Session::InitialParams &params);
+
+  /**
+   * Moves a session to a profile. The session gets the profile's settings with
+   * the other out of date sessions, see SetProfileParams().
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return bool - false if there is no such profile.
+   */
+  bool SetSessionProfile(Session *session, uint32_t id);
+
+  /**
+   * Sets the profile that new sessions use. The SetDef...() calls change this
+   * profile's settings for new sessions only, and do not mark its existing
+   * sessions out of date.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return bool - false if there is no such profile.
+   */
+  bool SetNewSessionProfile(uint32_t id);
+
+  /**
+   * @return const char* - The name of the session's profile.
+   *
+   * @Note can be called only on the main thread.
+   */
+  const char* GetSessionProfileName(Session *session);
+
+  /**
+   * @return bool - Does the session have the latest settings of its profile.
+   *
+   * @Note can be called only on the main thread.
+   */
+  bool IsProfileCurrent(Session *session);
+
+  struct ProfileInfo
+  {
+    ProfileInfo() : id(0), version(0), sessions(0), pending(0), forNewSessions(false) { }
+
+    uint32_t id;
+    std::string name;
+    Session::InitialParams params;
+    uint32_t version;  // Raised on each change.
+    size_t sessions;   // Sessions that use the profile.
+    size_t pending;    // Of sessions, those that do not have the latest settings yet.
+    bool forNewSessions;
+  };
+
+  /**
+   * Gets every profile, with this shard's sessions.
+   *
+   * @Note can be called only on the main thread.
+   */
+  void GetProfiles(std::vector<ProfileInfo> &outProfiles);
+
+  static const uint32_t NoAuthKey = UINT32_MAX;
+  static const size_t MaxAuthKeys = 256; // Including deleted ones.
+  static const size_t MaxAuthKeyNameLength = 32;
+
+  /**
+   * @return uint32_t - The id of the authentication key, or NoAuthKey.
+   *
+   * @Note can be called only on the main thread.
+   */
+  uint32_t FindAuthKey(const char *name);
+
+  /**
+   * Makes an authentication key, or changes the one with that name. Sessions
+   * that use a changed key sign their next packets with it at once, so the
+   * peer should be changed at the same time. As for profiles, each shard has
+   * its own copy, and ids match across shards. Keys are not saved in the
+   * checkpoint.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return uint32_t - The id of the key, or NoAuthKey if there are too many.
+   */
+  uint32_t SetAuthKey(const char *name, const AuthKey &key);
+
+  /**
+   * Deletes an authentication key. Its sessions, and profiles, stop using
+   * authentication. The id is not used again.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return bool - false if there is no such key.
+   */
+  bool DeleteAuthKey(uint32_t id);
+
+  /**
+   * @return const AuthKey* - NULL if there is no such key. Stays valid until
+   *         the key is deleted.
+   *
+   * @Note can be called only on the main thread.
+   */
+  const AuthKey* GetAuthKey(uint32_t id);
+
+  /**
+   * @return const char* - The name of the key, or "none" if there is no such
+   *         key.
+   *
+   * @Note can be called only on the main thread.
+   */
+  const char* GetAuthKeyName(uint32_t id);
+
+  struct AuthKeyInfo
+  {
+    AuthKeyInfo() : id(0), type(bfd::AuthType::None), keyId(0), sessions(0), profiles(0) { }
+
+    uint32_t id;
+    std::string name;
+    bfd::AuthType::Value type;
+    uint8_t keyId;
+    size_t sessions;  // This shard's sessions that use the key.
+    size_t profiles;  // Profiles that use the key.
+  };
+
+  /**
+   * Gets every authentication key, without its secret.
+   *
+   * @Note can be called only on the main thread.
+   */
+  void GetAuthKeys(std::vector<AuthKeyInfo> &outKeys);
+
+  /**
+   * Gets the transmit queue used for sessions.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return TransmitQueue* - NULL if the beacon is not running.
+   */
+  TransmitQueue* GetTransmitQueue() { return m_transmitQueue;}
 
-class Socket;
-class Scheduler;
+  /**
+   * Gets the engine that sends periodic control packets for sessions.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return TransmitEngine* - NULL if the beacon is not running, or it is not
+   *         using a transmit thread.
+   */
+  TransmitEngine* GetTransmitEngine() { return m_transmitEngine;}
 
-class Beacon
-{
-public:
-  Beacon();
-  ~Beacon();
+  /**
+   * Gets the scheduler for this shard.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return Scheduler* - NULL if the beacon is not running.
+   */
+  Scheduler* GetScheduler() { return m_scheduler;}
 
   /**
-   * Start the beacon.
+   * Sets the number of shards. Each shard runs its own scheduler thread, with
+   * its own SO_REUSEPORT listen sockets. Sessions are assigned to a shard by
+   * their addresses.
    *
-   * @param controlPorts [in] - A list of address and port combinations on which
-   *                     to listen for control commands.
-   * @param listenAddrs [in] - A list of address on which to listen for new BDF
-   *                    sessions. 'ANY' is allowed.
+   * @note Call only before Run().
+   *
+   * @param count [in] - From 1 to MaxShardCount. 1, the default, runs all
+   *              sessions on the thread that calls Run().
+   */
+  void SetShardCount(size_t count);
+
+  static const size_t MaxShardCount = 64;
+
+  /**
+   * @Note can be called from any thread.
    *
+   * @return size_t - The number of shards.
+   */
+  size_t GetShardCount() { return m_shardCount;}
+
+  /**
+   * @Note can be called from any thread.
    *
-   * @return - false on failure
+   * @return size_t - The index of this shard. 0 for the Beacon on which Run()
+   *         was called.
    */
-  bool Run(const std::list<SockAddr> &controlPorts, const std::list<IpAddr> &listenAddrs);
+  size_t GetShardIndex() { return m_shardIndex;}
+
+  /**
+   * Checks whether this shard is responsible for the session between the given
+   * addresses.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @param remoteAddr [in] - Port ignored
+   * @param localAddr [in] - Port ignored
+   *
+   * @return bool
+   */
+  bool IsSessionOwner(const IpAddr &remoteAddr, const IpAddr &localAddr) { return ownerShard(remoteAddr, localAddr) == this;}
 
   typedef void (*OperationCallback)(Beacon *beacon, void *userdata);
 
+  struct BatchOperation
+  {
+    OperationCallback callback;
+    void *userdata;
+  };
+
+  typedef std::vector<BatchOperation> OperationBatch;
+
+  typedef void (*BatchCompleteCallback)(bool success, void *userdata);
+
+  // Queued operations run for at most this long, in microseconds, before the
+  // scheduler gets to handle pending events. Unless a shutdown is pending.
+  static const uint32_t OperationTimeSlice = 1000;
+
   /**
    * Queue up a shutdown.
    *
@@ -68,6 +736,11 @@ public:
    * BFD activity, so keep it brief. In addition, Check IsShutdownRequested() in
    * your callback and exit as soon as possible if a shutdown was requested.
    *
+   * If there are multiple shards, then the callback is called once for each
+   * shard, on that shard's main thread, with that shard as the beacon, one shard
+   * at a time. It is called for all of the shards or for none of them. With
+   * multiple shards waitForCompletion must be true, since userdata is shared.
+   *
    * @Note can be called from any thread.
    *
    * @param callback [in] - The callback.
@@ -76,10 +749,40 @@ public:
    *                          has been executed?
    *
    * @return bool - false if the operation was not queued because a shutdown had
-   *         already been requested or memory failure.
+   *         already been requested or memory failure. In that case the callback
+   *         was not called for any shard.
    */
   bool QueueOperation(OperationCallback callback, void *userdata, bool waitForCompletion);
 
+  /**
+   * Queues a series of callbacks as a single unit. This is like calling
+   * QueueOperation() for each one, but they are handed to the main thread at
+   * once, and this does not wait for them to run. The callbacks are run in
+   * order. If they take longer than OperationTimeSlice, then the rest are run
+   * after the scheduler has handled any pending events.
+   *
+   * If there are multiple shards, then each shard runs the whole batch, one shard
+   * at a time. The batch is passed from one shard to the next by their main
+   * threads.
+   *
+   * completeCallback is called once all shards have run the batch, on the main
+   * thread of the last shard. success is false if a shard could not run the batch
+   * because a shutdown was requested or memory failure. In that case the
+   * remaining shards are skipped.
+   *
+   * @Note can be called from any thread.
+   *
+   * @param batch [in] - The callbacks. This must remain valid until
+   *              completeCallback is called.
+   * @param completeCallback [in] - Called when the batch is done.
+   * @param completeUserdata [in] - The user data for completeCallback.
+   *
+   * @return bool - false if the batch was not queued because a shutdown had
+   *         already been requested or memory failure. In that case
+   *         completeCallback will not be called.
+   */
+  bool QueueOperationBatch(const OperationBatch &batch, BatchCompleteCallback completeCallback, void *completeUserdata);
+
 
   /**
    * Starts an active session for the given system. If there is already a session
@@ -87,7 +790,8 @@ public:
    *
    * TODO: should change an existing session from passive to active?
    *
-   * @Note can only on the main thread.
+   * @Note can only on the main thread, and only on the shard for which
+   *       IsSessionOwner() is true.
    *
    * @param remoteAddr [in] - remote address.
    * @param localAddr [in]- address on which to receive and send packets. .
@@ -97,6 +801,90 @@ public:
    */
   bool StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr);
 
+  /**
+   * A remote and local address, for StartActiveSessions().
+   */
+  struct AddressPair
+  {
+    IpAddr remoteAddr;
+    IpAddr localAddr;
+  };
+
+  /**
+   * Like StartActiveSession() for each of the pairs that this beacon owns, in
+   * one operation. The session maps are grown once for all of the new sessions,
+   * and the first packet of each new session is spread evenly over spreadUs, so
+   * that a large set does not all transmit at once.
+   *
+   * @Note can only on the main thread.
+   *
+   * @param pairs [in] - The sessions to start. Pairs owned by other shards are
+   *              skipped.
+   * @param spreadUs [in] - Time over which to spread the first packets, in
+   *                 microseconds. 0 to send them immediately.
+   * @param outResults [out] - Must be the same size as pairs. For each pair that
+   *                   this beacon owns, this is set to 1 on success, or 0 on
+   *                   failure. Others are not changed, so that shards can share
+   *                   it.
+   *
+   * @return size_t - The number of pairs that succeeded.
+   */
+  size_t StartActiveSessions(const std::vector<AddressPair> &pairs, uint32_t spreadUs, std::vector<uint8_t> &outResults);
+
+  /**
+   * A session that should exist, for SyncSessions().
+   */
+  struct SyncEntry
+  {
+    IpAddr remoteAddr;
+    IpAddr localAddr;
+    uint32_t profile; // NoProfile for the profile that new sessions use.
+  };
+
+  struct SyncResult
+  {enum Value
+    {NotOwned = 0, Unchanged, Created, Changed, Failed};};
+
+  struct SyncSummary
+  {
+    SyncSummary() : unchanged(0), created(0), changed(0), deleted(0), failed(0) { }
+
+    size_t unchanged;
+    size_t created;
+    size_t changed;  // Moved to another profile, or made active.
+    size_t deleted;
+    size_t failed;
+  };
+
+  /**
+   * Makes this shard's active sessions match the desired list. Each entry is
+   * found in the source map, and each session is visited once, so this takes
+   * time in proportion to the entries plus the sessions. Only the differences
+   * are applied:
+   *
+   * - A missing session is started as with StartActiveSessions(), with its
+   *   first packet spread over spreadUs, and with the settings of its profile.
+   * - A session with another profile is moved to the desired one, see
+   *   SetSessionProfile(). The rollout paces the new settings.
+   * - A passive session that is in the list is made active.
+   * - An active session that is not in the list is deleted. Passive sessions
+   *   that are not in the list are left alone, since the peer made them.
+   *
+   * @Note can only on the main thread.
+   *
+   * @param entries [in] - The complete list of sessions. Entries owned by other
+   *                shards are skipped. An entry with a profile that does not
+   *                exist fails.
+   * @param spreadUs [in] - Time over which to spread the first packets of new
+   *                 sessions, in microseconds.
+   * @param outResults [out] - Must be the same size as entries. For each entry
+   *                   that this beacon owns, this is set to a SyncResult.
+   *                   Others are not changed, so that shards can share it.
+   * @param ioSummary [in/out] - This shard's counts are added, so that shards
+   *                  can share it.
+   */
+  void SyncSessions(const std::vector<SyncEntry> &entries, uint32_t spreadUs, std::vector<uint8_t> &outResults, SyncSummary &ioSummary);
+
   /**
    * Allows us to accept connections from the given ip address.
    *
@@ -159,6 +947,92 @@ public:
    */
   void GetSessionIdList(std::vector<uint32_t> &outList);
 
+  /**
+   * Gets the table to which this shard's sessions publish their status.
+   *
+   * @Note can be called from any thread.
+   *
+   * @return SessionStatusTable* - Never NULL.
+   */
+  SessionStatusTable* GetStatusTable() { return &m_statusTable;}
+
+  /**
+   * Gets the status export record for a session, by the session's slot in the
+   * status table. Counts the session as exported, or as missing if there is no
+   * room for it. Release it with ReleaseExportRecord().
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return StatusExportRecord* - NULL if there is no status export, or no
+   *         room.
+   */
+  StatusExportRecord* AcquireExportRecord(size_t statusSlot);
+
+  /**
+   * Marks a record from AcquireExportRecord() as unused.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @param record [in] - May be NULL.
+   */
+  void ReleaseExportRecord(StatusExportRecord *record);
+
+  /**
+   * Adds the published status of every session on every shard to outList.
+   * This reads the status tables directly, so it never waits for the
+   * schedulers.
+   *
+   * @Note can be called from any thread while the command processors are
+   *       running, but only on the primary.
+   *
+   * @throw - yes
+   *
+   * @param outList [out] - Cleared first.
+   *
+   * @return bool - false if the status of some sessions is not published, so
+   *         outList is incomplete. See SessionStatusTable::Allocate().
+   */
+  bool GetSessionStatusList(std::vector<SessionStatus> &outList);
+
+  /**
+   * Like GetSessionStatusList(), but calls visitor for each session as it is
+   * read, rather than gathering them.
+   *
+   * @Note can be called from any thread while the command processors are
+   *       running, but only on the primary.
+   *
+   * @throw - Only if visitor throws.
+   *
+   * @return bool - false if the status of some sessions is not published.
+   */
+  bool VisitSessionStatus(SessionStatusTable::Visitor visitor, void *userdata);
+
+  /**
+   * @Note can be called from any thread while the command processors are
+   *       running, but only on the primary.
+   *
+   * @return bool - false if the status of some sessions is not published.
+   */
+  bool IsSessionStatusComplete();
+
+  /**
+   * Gets the hub through which sessions on all shards publish change events.
+   *
+   * @Note can be called from any thread.
+   *
+   * @return SessionEventHub* - Never NULL.
+   */
+  SessionEventHub* GetEventHub() { return &m_primary->m_eventHub;}
+
+  /**
+   * Gets the source ports used by sessions on all shards.
+   *
+   * @Note can be called from any thread.
+   *
+   * @return SourcePortAllocator* - Never NULL.
+   */
+  SourcePortAllocator* GetPortAllocator() { return &m_primary->m_portAllocator;}
+
   /**
    * Will delete the session.
    *
@@ -168,6 +1042,162 @@ public:
    */
   void KillSession(Session *session);
 
+  /**
+   * Memory used for the sessions of this beacon. Does not include timers,
+   * which are held by the scheduler. See Scheduler::Stats.
+   */
+  struct MemoryStats
+  {
+    size_t sessions;      // Sessions in use.
+    size_t sessionSize;   // Bytes of storage for each session.
+    size_t sessionBytes;  // Bytes held for sessions, used or not.
+    size_t mapBytes;      // Estimated bytes for the session lookup maps.
+  };
+
+  /**
+   * @Note can be called only on the main thread.
+   */
+  void GetMemoryStats(MemoryStats &outStats);
+
+  /**
+   * Counts of control packets that reached a session on this beacon.
+   */
+  struct PacketStats
+  {
+    PacketStats() { Reset();}
+    void Reset() { sessionPackets = 0; fastPathPackets = 0; untimedPackets = 0; receiveCallbacks = 0; budgetHits = 0; receiveBudget = 0; receiveDelay.Reset(); ring.Reset(); hasRing = false;}
+
+    uint64_t sessionPackets;  // Packets passed to a session.
+    uint64_t fastPathPackets; // Of those, packets that only restarted the detection timer.
+    uint64_t untimedPackets;  // Packets read without a usable kernel receive time.
+    uint64_t receiveCallbacks; // Callbacks for a listen socket or ring.
+    uint64_t budgetHits;      // Of those, callbacks that stopped at the receive budget, with packets possibly left.
+    size_t receiveBudget;     // See SetReceiveBudget(). Filled in by GetPacketStats().
+    Histogram receiveDelay;   // Microseconds from kernel arrival until the packet was read.
+    bool hasRing;             // Packets are received through a PacketRing.
+    PacketRing::Stats ring;   // Only if hasRing.
+  };
+
+  /**
+   * @Note can be called only on the main thread.
+   */
+  void GetPacketStats(PacketStats &outStats);
+
+  /**
+   * @Note can be called only on the main thread.
+   */
+  void ResetPacketStats();
+
+  /**
+   * Time spent in each stage of the receive path, by ReplayPacket(). Times are
+   * in nanoseconds.
+   */
+  struct ReceiveStageTimes
+  {
+    ReceiveStageTimes() { Reset();}
+    void Reset() { packets = 0; screened = 0; unmatched = 0; screenTime = 0; lookupTime = 0; sessionTime = 0;}
+
+    uint64_t packets;
+    uint64_t screened;    // Of packets, those discarded by the port and TTL checks, or by validation.
+    uint64_t unmatched;   // Of packets, those discarded because there was no session for them.
+    uint64_t screenTime;  // Port and TTL checks, and validation.
+    uint64_t lookupTime;  // Finding, or creating, the session.
+    uint64_t sessionTime; // Session::ProcessControlPacket().
+  };
+
+  /**
+   * Handles a control packet as if this shard had received it, and times each
+   * stage. For replaying captures, see bfdd-replay. The packet is not captured,
+   * and not passed to another shard.
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @param receiveTime [in] - Monotonic time that the packet arrived.
+   * @param times [in/out] - The times are added to these.
+   */
+  void ReplayPacket(const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+                    const AddrKey &destAddr, uint8_t ttl, const TimeSpec &receiveTime, ReceiveStageTimes &times);
+
+  /**
+   * Called by a session when a packet takes the steady state path.
+   *
+   * @Note can be called only on the main thread.
+   */
+  void CountFastPathPacket() { m_packetStats.fastPathPackets++;}
+
+  /**
+   * Reasons that a received control packet is discarded.
+   */
+  struct DiscardReason
+  {
+    enum Value
+    {
+      BadPort,          // Source port below bfd::MinSourcePort, with strict ports.
+      BadTtl,           // TTL or hop limit was not 255.
+      Invalid,          // Failed validation.
+      NotListenAddress, // Not sent to a listen address. Packet ring only.
+      UnknownDisc,      // No session has our discriminator.
+      AddressMismatch,  // The session for our discriminator has another remote address.
+      Unauthorized,     // No session, and passive sessions are not allowed from the source.
+      Authentication,   // Authentication does not match the session.
+      NoResources,      // Could not forward to another shard, or create a session.
+      Testing,          // Dropped on purpose, for testing.
+      Count
+    };
+  };
+
+  /**
+   * @return const char* - A short name for the reason, for output.
+   */
+  static const char* DiscardReasonName(DiscardReason::Value reason);
+
+  /**
+   * Counts of control packets, and of events in the sessions, on this beacon.
+   * Each shard keeps its own, which are written only by its main thread, and
+   * kept away from the data used by other threads, so that counting is a plain
+   * increment.
+   */
+  struct PacketCounters
+  {
+    PacketCounters() { Reset();}
+    void Reset()
+    {
+      received = 0; sent = 0; stateChanges = 0; pollSequences = 0; memset(discards, 0, sizeof(discards));
+      echoSent = 0; echoReturned = 0; echoReflected = 0; echoDiscarded = 0;
+    }
+
+    uint64_t received;      // Control packets read by this shard, including those forwarded to another.
+    uint64_t sent;          // Control packets sent by sessions, not counting any transmit engine.
+    uint64_t stateChanges;  // Session state changes.
+    uint64_t pollSequences; // Poll sequences started by sessions.
+    uint64_t discards[DiscardReason::Count];
+    uint64_t echoSent;      // Echo packets sent by sessions.
+    uint64_t echoReturned;  // Our echo packets that came back, for a session on this shard.
+    uint64_t echoReflected; // Echo packets from peers that were looped back.
+    uint64_t echoDiscarded; // Echo packets that were neither.
+  };
+
+  /**
+   * @Note can be called only on the main thread.
+   */
+  void GetPacketCounters(PacketCounters &outCounters) { outCounters = m_counters;}
+
+  /**
+   * @Note can be called only on the main thread.
+   */
+  void ResetPacketCounters() { m_counters.Reset();}
+
+  /**
+   * Called by sessions to update the counters.
+   *
+   * @Note can be called only on the main thread.
+   */
+  void CountDiscard(DiscardReason::Value reason) { m_counters.discards[reason]++;}
+  void CountSent() { m_counters.sent++;}
+  void CountStateChange() { m_counters.stateChanges++;}
+  void CountPollSequence() { m_counters.pollSequences++;}
+  void CountEchoSent() { m_counters.echoSent++;}
+
   /**
    * Sets the DectectMulti for future sessions.
    *
@@ -206,77 +1236,299 @@ public:
    */
   void SetDefAdminUpPollWorkaround(bool enable);
 
+  /**
+   * Sets whether future sessions are low priority. See
+   * Session::SetLowPriority().
+   *
+   * @Note can be called only on the main thread.
+   */
+  void SetDefLowPriority(bool lowPriority);
+
+  /**
+   * Sets the Desired Min Echo TX Interval for future sessions. See
+   * Session::SetEchoInterval().
+   *
+   * @Note can be called only on the main thread.
+   */
+  void SetDefEchoInterval(uint32_t val);
+
+  /**
+   * Sets whether future sessions ask for Demand mode. See
+   * Session::SetDemandMode().
+   *
+   * @Note can be called only on the main thread.
+   */
+  void SetDefDemandMode(bool enable);
+
+  /**
+   * Sets the authentication key for future sessions. See
+   * Session::SetAuthKey().
+   *
+   * @Note can be called only on the main thread.
+   *
+   * @return bool - false if there is no such key.
+   */
+  bool SetDefAuthKey(uint32_t id);
+
 private:
+  static const size_t SessionSlabSize = 64; // Sessions allocated at a time.
+  // Padding keeps the data written by the main thread, such as m_counters, off
+  // the cache lines that other threads write. Usual size, it need not be exact.
+  static const size_t CacheLineSize = 64;
+  static const uint32_t ExportRefreshMs = 1000; // All exported counters are rewritten this often.
+  static const uint32_t ExportRefreshSteps = 10; // Passes over the sessions, for each refresh.
+  static const uint32_t OverloadCheckMs = 250; // How often the overload controller looks at the load.
+  static const size_t OverloadSweepSlots = 4096; // Sessions looked at, for each check.
+  static const size_t OverloadSweepChanges = 256; // Sessions slowed or restored, for each check.
+  static const uint32_t ProfileRolloutMs = 100; // How often out of date sessions are given profile settings.
+  static const size_t ProfileSweepSlots = 4096; // Sessions looked at, each time.
+
+  struct NamedAuthKey
+  {
+    std::string name;  // Empty once deleted.
+    AuthKey key;
+  };
+
+  struct Profile
+  {
+    Profile(const char *profileName = "") : name(profileName), params(), version(1) { }
+
+    std::string name;  // Empty once deleted.
+    Session::InitialParams params;
+    uint32_t version;  // Raised on each change. Never 0, see Session::SetProfile().
+  };
+
+  Beacon(Beacon &primary, size_t shardIndex);
+
+  bool startScheduler(const std::list<IpAddr> &listenAddrs, std::list<ListenCallbackData *> &outCallbackData);
+  void stopScheduler();
+  bool startShards(const std::list<IpAddr> &listenAddrs);
+  void stopShards();
+  void loadCheckpoint();
+  void restoreSessions();
+  void saveSessions();
+  void collectSavedSessions(const Beacon &shard);
+  void writeCheckpoint();
+  void reserveStorage();
+  bool createStatusExport();
+  void startExportRefresh();
+  static void handleExportTimerCallback(Timer *timer, void *userdata);
+  void handleExportTimer();
+  void publishSchedulerStats();
+  void startOverloadControl();
+  static void handleOverloadTimerCallback(Timer *timer, void *userdata);
+  void handleOverloadTimer();
+  void sweepBackoff();
+  Session::InitialParams& newSessionParams() { return m_profiles[m_newSessionProfile].params;}
+  bool isProfile(uint32_t id) { return id < m_profiles.size() && !m_profiles[id].name.empty();}
+  bool isAuthKey(uint32_t id) { return id < m_authKeys.size() && !m_authKeys[id].name.empty();}
+  void startProfileRollout();
+  static void handleProfileTimerCallback(Timer *timer, void *userdata);
+  void handleProfileTimer();
+  void applyRealtime();
+  size_t storageBytes();
+  void discardShards(size_t first);
+  static void* shardThreadCallback(void *arg) { reinterpret_cast<Beacon *>(arg)->shardThread(); return NULL;}
+  void shardThread();
+  void flagShutdown();
+  bool queueShardOperation(OperationCallback callback, void *userdata, bool waitForCompletion);
+  Beacon* ownerShard(const IpAddr &remoteAddr, const IpAddr &localAddr);
+  Beacon* ownerShard(const AddrKey &remoteAddr, const AddrKey &localAddr);
+  Beacon* discriminatorShard(uint32_t disc);
 
   void makeListenSocket(const IpAddr &listenAddr, Socket &outSocket);
   static void handleListenSocketCallback(int socket, void *userdata);
+  static void handleListenDatagramCallback(int socket, RecvMsg &message, void *userdata);
   void handleListenSocket(Socket &socket);
+  void handleListenPacket(RecvMsg &recvPacket, const TimeSpec &receiveTime);
+  bool startPacketRing(const std::list<IpAddr> &listenAddrs);
+  static void handlePacketRingCallback(int socket, void *userdata);
+  void handlePacketRing();
+  bool isListenAddress(const AddrKey &addr);
+  bool makeEchoSocket(const IpAddr &listenAddr, Socket &outSocket);
+  static void handleEchoSocketCallback(int socket, void *userdata);
+  static void handleEchoDatagramCallback(int socket, RecvMsg &message, void *userdata);
+  void handleEchoSocket(Socket &socket);
+  void handleEchoPacket(int socket, const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+                        const AddrKey &destAddr, const TimeSpec &receiveTime);
+  static void handleForwardedEchoCallback(Beacon *beacon, void *userdata);
+  void handleReceivedPacket(const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+                            const AddrKey &destAddr, uint8_t ttl, const TimeSpec &receiveTime);
+  bool screenControlPacket(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort,
+                           const AddrKey &destAddr, uint8_t ttl);
+  void dispatchControlPacket(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort,
+                             const AddrKey &destAddr, const TimeSpec &receiveTime);
+  Session* findPacketSession(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort, const AddrKey &destAddr);
+  void deliverControlPacket(Session &session, const BfdPacketView &packet, in_port_t sourcePort, const TimeSpec &receiveTime);
+  static void setCaptureCallback(Beacon *beacon, void *userdata);
+  bool stopCapture();
+  void forwardControlPacket(Beacon &owner, const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort,
+                            const AddrKey &destAddr, const TimeSpec &receiveTime);
+  TimeSpec getPacketArrival(const TimeSpec &stamp, const TimeSpec &realNow, const TimeSpec &monoNow);
+  static void logDiscardedPacket(const BfdPacketView &packet, const AddrKey &sourceAddr, in_port_t sourcePort, const AddrKey &destAddr);
+  static void handleForwardedPacketCallback(Beacon *beacon, void *userdata);
 
   static void handleSelfMessageCallback(int sigId, void *userdata) { reinterpret_cast<Beacon *>(userdata)->handleSelfMessage(sigId);}
   void handleSelfMessage(int sigId);
-  uint32_t makeUniqueDiscriminator();
   bool triggerSelfMessage();
 
-  Session* addSession(const IpAddr &remoteAddr, const IpAddr &localAddr);
+  Session* addSession(const IpAddr &remoteAddr, const IpAddr &localAddr, uint32_t restoreDisc = 0, uint32_t restoreId = 0);
+  bool startActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr, uint32_t startDelayUs);
+  void reserveSessions(size_t count);
+  void freeSession(Session *session);
 
   Session* findInSourceMap(const IpAddr &remoteAddr, const IpAddr &localAddr);
+  Session* findInSourceMap(const AddrKey &remoteAddr, const AddrKey &localAddr);
 
 private:
-  struct  SourceMapKey
+  typedef  FlatIndex<Session, DiscIndexTraits<Session> > DiscMap;
+  typedef  FlatIndex<Session, AddressIndexTraits<Session> > SourceMap;
+  typedef  FlatIndex<Session, IdIndexTraits<Session> > IdMap;
+
+  // Passed from shard to shard as each runs the batch.
+  struct BatchCompletion
   {
-    SourceMapKey(IpAddr remoteAddr, IpAddr localAddr) :  remoteAddr(remoteAddr), localAddr(localAddr) { }
-    IpAddr remoteAddr;
-    IpAddr localAddr;
-    bool operator==(const SourceMapKey &other) const { return remoteAddr == other.remoteAddr &&  localAddr == other.localAddr;}
-    struct hasher
-    {size_t operator ()(const SourceMapKey &me) const { return me.remoteAddr.hash() + me.localAddr.hash();}
-    };
+    const OperationBatch *batch;
+    BatchCompleteCallback callback;
+    void *userdata;
+    size_t nextShard;
   };
 
-  typedef  hash_map<uint32_t, class Session *>::Type DiscMap;
-  typedef  DiscMap::iterator DiscMapIt;
-  typedef  hash_map<SourceMapKey, class Session *, SourceMapKey::hasher>::Type SourceMap;
-  typedef  SourceMap::iterator SourceMapIt;
-  typedef  hash_map<uint32_t, class Session *>::Type IdMap;
-  typedef  IdMap::iterator IdMapIt;
-
-  // Used to queue up operation
-  struct PendingOperation
+  // Used to queue up operation. Allocated with allocOperation(), unless it has
+  // a waitCondition.
+  struct PendingOperation : public MpscNode
   {
-    inline PendingOperation() : callback(NULL) { }
+    inline PendingOperation() : callback(NULL), userdata(NULL), completed(false), waitCondition(NULL),
+       batch(NULL), nextBatchIndex(0) { }
     OperationCallback callback;
     void *userdata;
     bool completed;
     class WaitCondition *waitCondition; // lock with m_paramsLock
+    BatchCompletion *batch;  // If not NULL, then the batch is run instead of callback.
+    size_t nextBatchIndex;
   };
 
-  typedef std::deque<Beacon::PendingOperation *> OperationQueue;
+  static PendingOperation* allocOperation();
+  static void freeOperation(PendingOperation *operation);
+  static void freeOperationCache(void *cache);
+  static void makeOperationCacheKey();
+  bool pushOperation(PendingOperation *operation);
+  void waitForOperation(PendingOperation *operation);
+  void signalOperations();
+  bool runOperation(PendingOperation *operation, const TimeSpec &deadline);
+  void drainOperations();
+  bool queueNextShardBatch(BatchCompletion *completion);
+  bool queueShardBatch(BatchCompletion *completion);
+  bool runBatch(PendingOperation *operation, const TimeSpec &deadline);
+  void advanceBatch(BatchCompletion *completion);
 
 
   // All items in this block are used only in the Scheduler thread, so no
   // locking needed
   //
   Scheduler *m_scheduler; // This is only valid after Run() is called.
-  RecvMsg m_packet;
+  RecvMsgBatch m_packets;
+  TransmitQueue *m_transmitQueue; // This is only valid after Run() is called.
+  TransmitEngine *m_transmitEngine; // Only when m_transmitThread, after Run() is called.
+  PacketRing *m_packetRing; // Only when m_receiveRingFrames, after Run() is called.
+  std::list<IpAddr> m_ringListenAddrs; // Packets from m_packetRing must be sent to one of these.
+  RecvMsgBatch m_echoPackets;
+  std::vector<std::pair<IpAddr, int> > m_echoSockets; // Listen address and echo socket.
 
   DiscMap m_discMap; // Your Discriminator -> Session
   IdMap m_IdMap; // Human readable session id -> Session
   SourceMap m_sourceMap; // ip/ip -> Session
+  SlabPool m_sessionPool; // Storage for the sessions in the maps.
+  DiscriminatorAllocator m_discAllocator;
+  PacketStats m_packetStats;
+  PacketCounters m_counters;
   std::set<IpAddr, IpAddr::LessClass> m_allowedPassiveIP;
   bool m_allowAnyPassiveIP;
   bool m_strictPorts; // Should incoming ports be limited as described in draft-ietf-bfd-v4v6-1hop-11.txt
-  Session::InitialParams m_initialSessionParams;
+  std::vector<Profile> m_profiles; // Index is the profile id. DefaultProfile is the first.
+  uint32_t m_newSessionProfile; // See SetNewSessionProfile().
+  std::deque<NamedAuthKey> m_authKeys; // Index is the key id. A deque, since sessions point at the keys.
+  PendingOperation *m_currentBatch; // A batch that ran out of time, and is not in m_operations.
 
   // These items are set at startup, so no locking is needed.
   int m_selfSignalId;
+  size_t m_receiveBatchSize;
+  size_t m_receiveBudget;
+  size_t m_transmitDepth;
+  uint32_t m_transmitWindow;
+  bool m_transmitSharedSockets;
+  bool m_transmitThread;
+  bool m_ioUringScheduler;
+  Scheduler::ClockSource::Value m_schedulerClock;
+  Scheduler::Budget m_schedulerBudget;
+  RealtimeParams m_realtimeParams;
+  RealtimeStatus m_realtimeStatus; // Only used on the shard's thread, except memoryLocked.
+  size_t m_receiveRingFrames;
+  uint32_t m_discQuarantineMs;
+  Beacon *m_primary; // The beacon on which Run() was called. May be this.
+  size_t m_shardIndex;
+  size_t m_shardCount;
+  std::vector<Beacon *> m_shards; // Only used on the primary. The primary is at index 0.
+  const std::list<IpAddr> *m_shardListenAddrs; // Only valid during shard startup.
+  pthread_t m_shardThread; // Not used on the primary.
+  std::string m_checkpointPath; // Only used on the primary.
+  SessionCheckpoint *m_restore; // Only on the primary, while the shards start.
+  std::vector<Session::SavedState> m_savedSessions; // Filled when the scheduler stops. All shards on the primary.
+  std::vector<uint32_t> m_savedDiscNextValues; // Only used on the primary.
+  bool m_sessionsSaved; // on the primary, all shards' sessions are in m_savedSessions.
+  std::string m_statusExportPath; // Only used on the primary.
+  size_t m_statusExportSessions; // Only used on the primary.
+  StatusExport *m_statusExport; // Owned by the primary. Shards write their own part.
+  StatusExportShard *m_exportShard; // This shard's totals, if there is an export.
+  Timer *m_exportTimer; // Refreshes exported counters.
+  size_t m_exportStep; // Of ExportRefreshSteps, the next part of m_IdMap to refresh.
+  SockAddr m_metricsAddr; // Only used on the primary.
+  bool m_publishSchedulerStats; // Publish m_schedulerStats, for the metrics server.
+  OverloadParams m_overloadParams;
+  OverloadStats m_overloadStats; // Counters, and the last check.
+  Timer *m_overloadTimer; // Only when m_overloadParams.enabled.
+  Histogram m_overloadLateness; // All timer lateness, at the last check.
+  uint64_t m_overloadBusyTime; // Total iteration time, at the last check.
+  TimeSpec m_overloadCheckTime; // Loop time of the last check.
+  TimeSpec m_overloadQuietTime; // When the load went below the limits.
+  size_t m_overloadCursor; // Next m_IdMap slot to sweep.
+  size_t m_overloadSweepChanged; // Sessions changed since the sweep was at slot 0.
+  bool m_overloadSweeping; // Sessions may not match the overload state.
+  uint32_t m_echoReceiveInterval; // 0 for no echo.
+  uint32_t m_echoControlInterval;
+  uint32_t m_echoInstance; // Only used on the primary.
+  uint32_t m_profileRate; // See SetProfileRate().
+  Timer *m_profileTimer; // Runs while sessions are out of date with their profile.
+  size_t m_profileCursor; // Next m_IdMap slot to look at.
+  size_t m_profilePassChanged; // Sessions changed since the cursor was at slot 0.
+  std::string m_capturePath; // Only used on the primary, see SetCapture().
+  PacketCapture *m_capture; // This shard's view. Only changed on the main thread.
+  PacketCapture *m_captureOwner; // Only on the primary, with m_captureLock.
+  QuickLock m_captureLock; // Only used on the primary. Serializes starting and stopping captures.
+
+  char m_threadPadding[CacheLineSize];
 
   // m_paramsLock locks the parameters that can be adjusted externally. All items
   // in this block are protected by this lock.
   //
   QuickLock m_paramsLock;
-  bool m_shutownRequested;
-  OperationQueue m_operations;
-
+  bool m_shutownRequested; // Changed only with the lock, but may be read atomically without it.
+  bool m_shardStartupComplete; // Shard has finished creating its scheduler.
+  bool m_shardStartupSuccess;
+  bool m_shardRunAllowed; // All shards have started, so the shard may run.
+  WaitCondition m_shardStartCondition;
 
+  // These are used from any thread without locking.
+  //
+  MpscQueue m_operations;
+  uint32_t m_operationsSignaled; // 1 after the main thread is signaled to run m_operations.
+  uint32_t m_operationPushers; // Threads that are in pushOperation().
+  SessionStatusTable m_statusTable; // Written only by the main thread. See SessionStatusTable.
+  SessionEventHub m_eventHub; // Only used on the primary.
+  SourcePortAllocator m_portAllocator; // Only used on the primary.
+  uint32_t m_schedulerStatsSequence; // Odd while m_schedulerStats is written. 0 if never.
+  Scheduler::Stats m_schedulerStats; // Written only by the main thread. See GetPublishedSchedulerStats().
 
+  // Keeps the above away from whatever is allocated after this shard.
+  char m_endPadding[CacheLineSize];
 };
@@ -12,6 +12,39 @@
 
 using namespace std;
 
+static const uint64_t MaxCpu = 1023;
+
+/**
+ * Parses a list of CPUs, such as "0,2,4-7".
+ *
+ * @return bool - false if the list is not valid.
+ */
+static bool parseCpuList(const char *str, vector<int> &outCpus)
+{
+  const char *next = str;
+  uint64_t first, last;
+
+  outCpus.clear();
+  if (!str || !*str)
+    return false;
+
+  while (*next)
+  {
+    if (!PartialStringToInt(next, first, &next) || first > MaxCpu)
+      return false;
+    last = first;
+    if (*next == '-' && (!PartialStringToInt(next + 1, last, &next) || last < first || last > MaxCpu))
+      return false;
+    for (uint64_t cpu = first; cpu <= last; cpu++)
+      outCpus.push_back(int(cpu));
+    if (*next == ',')
+      next++;
+    else if (*next)
+      return false;
+  }
+  return true;
+}
+
 int main(int argc, char *argv[])
 {
   bool ret;
@@ -22,6 +55,18 @@ int main(int argc, char *argv[])
   list<SockAddr> controlPorts;
   list<IpAddr> listenAddrs;
   const char *valueString;
+  uint64_t transmitDepth = TransmitQueue::DefaultMaxDepth;
+  uint64_t transmitWindow = TransmitQueue::DefaultWindow;
+  bool sharedTransmit = false;
+  uint64_t asyncLogRingSize = 0;
+  Scheduler::Budget schedulerBudget;
+  Beacon::RealtimeParams realtime;
+  Beacon::OverloadParams overload;
+  uint32_t echoReceiveInterval = 0;
+  uint32_t echoControlInterval = Beacon::DefaultEchoControlInterval;
+  uint32_t profileRate = Beacon::DefaultProfileRate;
+  const char *statusExportPath = NULL;
+  uint64_t statusExportSessions = Beacon::DefaultStatusExportSessions;
 
 #ifdef BFD_DEBUG
   tee = true;
@@ -91,6 +136,322 @@ int main(int argc, char *argv[])
 
       listenAddrs.push_back(addrVal);
     }
+    else if (CheckArg("--recvbatch", argv[argIndex], &valueString))
+    {
+      uint64_t batchSize;
+
+      if (!valueString || !StringToInt(valueString, batchSize)
+          || batchSize < 1 || batchSize > Beacon::MaxReceiveBatchSize)
+      {
+        fprintf(stderr, "--recvbatch must be followed by an '=' and a number from 1 to %zu.\n", Beacon::MaxReceiveBatchSize);
+        exit(1);
+      }
+
+      app.SetReceiveBatchSize(size_t(batchSize));
+    }
+    else if (CheckArg("--rxbudget", argv[argIndex], &valueString))
+    {
+      uint64_t budget;
+
+      if (!valueString || !StringToInt(valueString, budget)
+          || budget < 1 || budget > Beacon::MaxReceiveBudget)
+      {
+        fprintf(stderr, "--rxbudget must be followed by an '=' and a number from 1 to %zu.\n", Beacon::MaxReceiveBudget);
+        exit(1);
+      }
+
+      app.SetReceiveBudget(size_t(budget));
+    }
+    else if (CheckArg("--lowtimers", argv[argIndex], &valueString))
+    {
+      uint64_t lowTimers;
+
+      if (!valueString || !StringToInt(valueString, lowTimers) || lowTimers > 1024)
+      {
+        fprintf(stderr, "--lowtimers must be followed by an '=' and a number from 0 to 1024.\n");
+        exit(1);
+      }
+      schedulerBudget.lowTimersPerIteration = uint32_t(lowTimers);
+    }
+    else if (CheckArg("--lowdeadline", argv[argIndex], &valueString))
+    {
+      uint64_t deadline;
+
+      if (!valueString || !StringToInt(valueString, deadline) || deadline > 10000000)
+      {
+        fprintf(stderr, "--lowdeadline must be followed by an '=' and a number of microseconds from 0 to 10000000.\n");
+        exit(1);
+      }
+      schedulerBudget.lowTimerDeadline = uint32_t(deadline);
+    }
+    else if (CheckArg("--txdepth", argv[argIndex], &valueString))
+    {
+      if (!valueString || !StringToInt(valueString, transmitDepth)
+          || transmitDepth < 1 || transmitDepth > TransmitQueue::MaxMaxDepth)
+      {
+        fprintf(stderr, "--txdepth must be followed by an '=' and a number from 1 to %zu.\n", TransmitQueue::MaxMaxDepth);
+        exit(1);
+      }
+    }
+    else if (CheckArg("--txwindow", argv[argIndex], &valueString))
+    {
+      if (!valueString || !StringToInt(valueString, transmitWindow) || transmitWindow > 1000000)
+      {
+        fprintf(stderr, "--txwindow must be followed by an '=' and a number of microseconds from 0 to 1000000.\n");
+        exit(1);
+      }
+    }
+    else if (0 == strcmp("--sharedtx", argv[argIndex]))
+    {
+      sharedTransmit = true;
+    }
+    else if (0 == strcmp("--txthread", argv[argIndex]))
+    {
+      app.SetTransmitThread(true);
+    }
+    else if (CheckArg("--clock", argv[argIndex], &valueString))
+    {
+      if (valueString && 0 == strcmp(valueString, "precise"))
+        app.SetSchedulerClock(Scheduler::ClockSource::Precise);
+      else if (valueString && 0 == strcmp(valueString, "coarse"))
+        app.SetSchedulerClock(Scheduler::ClockSource::Coarse);
+      else
+      {
+        fprintf(stderr, "--clock must be followed by an '=' and 'precise' or 'coarse'.\n");
+        exit(1);
+      }
+    }
+    else if (0 == strcmp("--uring", argv[argIndex]))
+    {
+      if (!Beacon::IsIoUringSchedulerSupported())
+      {
+        fprintf(stderr, "--uring is not supported on this system.\n");
+        exit(1);
+      }
+      app.SetIoUringScheduler(true);
+    }
+    else if (CheckArg("--rxring", argv[argIndex], &valueString))
+    {
+      uint64_t frameCount = PacketRing::DefaultFrameCount;
+
+      if (valueString && (!StringToInt(valueString, frameCount)
+                          || frameCount < 1 || frameCount > PacketRing::MaxFrameCount))
+      {
+        fprintf(stderr, "--rxring may be followed by an '=' and a number of frames from 1 to %zu.\n", PacketRing::MaxFrameCount);
+        exit(1);
+      }
+
+      if (!PacketRing::IsSupported())
+      {
+        fprintf(stderr, "--rxring is not supported on this system.\n");
+        exit(1);
+      }
+
+      app.SetReceiveRing(size_t(frameCount));
+    }
+    else if (CheckArg("--shards", argv[argIndex], &valueString))
+    {
+      uint64_t shardCount;
+
+      if (!valueString || !StringToInt(valueString, shardCount)
+          || shardCount < 1 || shardCount > Beacon::MaxShardCount)
+      {
+        fprintf(stderr, "--shards must be followed by an '=' and a number from 1 to %zu.\n", Beacon::MaxShardCount);
+        exit(1);
+      }
+
+      app.SetShardCount(size_t(shardCount));
+    }
+    else if (CheckArg("--discquarantine", argv[argIndex], &valueString))
+    {
+      uint64_t quarantine;
+
+      if (!valueString || !StringToInt(valueString, quarantine) || quarantine > 3600000)
+      {
+        fprintf(stderr, "--discquarantine must be followed by an '=' and a number of milliseconds from 0 to 3600000.\n");
+        exit(1);
+      }
+
+      app.SetDiscriminatorQuarantine(uint32_t(quarantine));
+    }
+    else if (CheckArg("--cpus", argv[argIndex], &valueString))
+    {
+      if (!parseCpuList(valueString, realtime.cpus))
+      {
+        fprintf(stderr, "--cpus must be followed by an '=' and a list of CPUs from 0 to %u, such as 0,2,4-7.\n", unsigned(MaxCpu));
+        exit(1);
+      }
+    }
+    else if (CheckArg("--fifo", argv[argIndex], &valueString))
+    {
+      uint64_t priority = 10;
+
+      if (valueString && (!StringToInt(valueString, priority) || priority < 1 || priority > 99))
+      {
+        fprintf(stderr, "--fifo may be followed by an '=' and a priority from 1 to 99.\n");
+        exit(1);
+      }
+      realtime.fifoPriority = int(priority);
+    }
+    else if (0 == strcmp("--mlock", argv[argIndex]))
+    {
+      realtime.lockMemory = true;
+    }
+    else if (CheckArg("--maxsessions", argv[argIndex], &valueString))
+    {
+      uint64_t maxSessions;
+
+      if (!valueString || !StringToInt(valueString, maxSessions) || maxSessions > 10000000)
+      {
+        fprintf(stderr, "--maxsessions must be followed by an '=' and a number from 0 to 10000000.\n");
+        exit(1);
+      }
+      realtime.maxSessions = size_t(maxSessions);
+    }
+    else if (CheckArg("--checkpoint", argv[argIndex], &valueString))
+    {
+      if (!valueString || !*valueString)
+      {
+        fprintf(stderr, "--checkpoint must be followed by an '=' and a file name.\n");
+        exit(1);
+      }
+
+      app.SetCheckpointFile(valueString);
+    }
+    else if (CheckArg("--statusexport", argv[argIndex], &valueString))
+    {
+      if (!valueString || !*valueString)
+      {
+        fprintf(stderr, "--statusexport must be followed by an '=' and a file name.\n");
+        exit(1);
+      }
+      statusExportPath = valueString;
+    }
+    else if (CheckArg("--metrics", argv[argIndex], &valueString))
+    {
+      SockAddr addrVal;
+
+      if (!valueString || !addrVal.FromString(valueString) || !addrVal.HasPort())
+      {
+        fprintf(stderr, "--metrics must be followed by an '=' and an ip address with a port.\n");
+        exit(1);
+      }
+      app.SetMetrics(addrVal);
+    }
+    else if (CheckArg("--capture", argv[argIndex], &valueString))
+    {
+      if (!valueString || !*valueString)
+      {
+        fprintf(stderr, "--capture must be followed by an '=' and a file name.\n");
+        exit(1);
+      }
+
+      app.SetCapture(valueString);
+    }
+    else if (CheckArg("--statusexportsize", argv[argIndex], &valueString))
+    {
+      if (!valueString || !StringToInt(valueString, statusExportSessions)
+          || statusExportSessions < 1 || statusExportSessions > 10000000)
+      {
+        fprintf(stderr, "--statusexportsize must be followed by an '=' and a number from 1 to 10000000.\n");
+        exit(1);
+      }
+    }
+    else if (CheckArg("--echo", argv[argIndex], &valueString))
+    {
+      uint64_t interval = Beacon::DefaultEchoReceiveInterval;
+
+      if (valueString && (!StringToInt(valueString, interval) || interval < 1 || interval > 10000000))
+      {
+        fprintf(stderr, "--echo may be followed by an '=' and an interval in microseconds from 1 to 10000000.\n");
+        exit(1);
+      }
+      echoReceiveInterval = uint32_t(interval);
+    }
+    else if (CheckArg("--echocontrol", argv[argIndex], &valueString))
+    {
+      uint64_t interval;
+
+      if (!valueString || !StringToInt(valueString, interval) || interval < 1 || interval > 60000)
+      {
+        fprintf(stderr, "--echocontrol must be followed by an '=' and a time in milliseconds from 1 to 60000.\n");
+        exit(1);
+      }
+      echoControlInterval = uint32_t(interval * 1000);
+    }
+    else if (CheckArg("--profilerate", argv[argIndex], &valueString))
+    {
+      uint64_t rate;
+
+      if (!valueString || !StringToInt(valueString, rate) || rate < 1 || rate > 1000000)
+      {
+        fprintf(stderr, "--profilerate must be followed by an '=' and a number of sessions per second from 1 to 1000000.\n");
+        exit(1);
+      }
+      profileRate = uint32_t(rate);
+    }
+    else if (0 == strcmp("--overload", argv[argIndex]))
+    {
+      overload.enabled = true;
+    }
+    else if (CheckArg("--overloadlateness", argv[argIndex], &valueString))
+    {
+      uint64_t lateness;
+
+      if (!valueString || !StringToInt(valueString, lateness) || lateness < 1 || lateness > 60000)
+      {
+        fprintf(stderr, "--overloadlateness must be followed by an '=' and a time in milliseconds from 1 to 60000.\n");
+        exit(1);
+      }
+      overload.enabled = true;
+      overload.latenessUs = uint32_t(lateness * 1000);
+    }
+    else if (CheckArg("--overloadbusy", argv[argIndex], &valueString))
+    {
+      uint64_t percent;
+
+      if (!valueString || !StringToInt(valueString, percent) || percent < 1 || percent > 100)
+      {
+        fprintf(stderr, "--overloadbusy must be followed by an '=' and a percentage from 1 to 100.\n");
+        exit(1);
+      }
+      overload.enabled = true;
+      overload.busyPercent = uint32_t(percent);
+    }
+    else if (CheckArg("--overloadhold", argv[argIndex], &valueString))
+    {
+      uint64_t hold;
+
+      if (!valueString || !StringToInt(valueString, hold) || hold > 3600000)
+      {
+        fprintf(stderr, "--overloadhold must be followed by an '=' and a time in milliseconds from 0 to 3600000.\n");
+        exit(1);
+      }
+      overload.enabled = true;
+      overload.holdMs = uint32_t(hold);
+    }
+    else if (CheckArg("--backoffinterval", argv[argIndex], &valueString))
+    {
+      uint64_t interval;
+
+      if (!valueString || !StringToInt(valueString, interval) || interval < 1 || interval > 60000)
+      {
+        fprintf(stderr, "--backoffinterval must be followed by an '=' and a time in milliseconds from 1 to 60000.\n");
+        exit(1);
+      }
+      overload.enabled = true;
+      overload.backoffInterval = uint32_t(interval * 1000);
+    }
+    else if (CheckArg("--asynclog", argv[argIndex], &valueString))
+    {
+      asyncLogRingSize = Logger::DefaultAsyncRingSize;
+      if (valueString && (!StringToInt(valueString, asyncLogRingSize)
+                          || asyncLogRingSize < 1 || asyncLogRingSize > Logger::MaxAsyncRingSize))
+      {
+        fprintf(stderr, "--asynclog may be followed by an '=' and a number of messages from 1 to %zu.\n", Logger::MaxAsyncRingSize);
+        exit(1);
+      }
+    }
     else
     {
       fprintf(stderr, "Unrecognized %s command line option %s.\n", BeaconAppName, argv[argIndex]);
@@ -137,9 +498,17 @@ int main(int argc, char *argv[])
 
   // Setup logging first
   //  gLog.SetLogLevel(Log::Detail);
-  gLog.LogToSyslog("bfdd-beacon", tee);
+  gLog.LogToSyslog("bfdd-beacon", tee, size_t(asyncLogRingSize));
   gLog.Message(Log::App, "Started %d", getpid());
 
+  app.SetTransmitBatching(size_t(transmitDepth), uint32_t(transmitWindow), sharedTransmit);
+  app.SetSchedulerBudget(schedulerBudget);
+  app.SetRealtime(realtime);
+  app.SetOverload(overload);
+  app.SetEcho(echoReceiveInterval, echoControlInterval);
+  app.SetProfileRate(profileRate);
+  app.SetStatusExport(statusExportPath, size_t(statusExportSessions));
+
   ret = app.Run(controlPorts, listenAddrs);
 
   gLog.Message(Log::App, "Shutdown %d", getpid());
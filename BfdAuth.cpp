@@ -0,0 +1,239 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "BfdAuth.h"
+#include <string.h>
+
+namespace
+{
+
+inline uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n));}
+
+inline uint32_t loadLE(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);}
+inline uint32_t loadBE(const uint8_t *p) { return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];}
+inline void storeLE(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;}
+inline void storeBE(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;}
+
+const uint32_t md5K[64] =
+{
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+const int md5Shift[4][4] = { { 7, 12, 17, 22}, { 5, 9, 14, 20}, { 4, 11, 16, 23}, { 6, 10, 15, 21}};
+
+// One step of MD5, with the registers rotated by the caller's loop.
+#define MD5_STEP(f, g, i) \
+  { \
+    uint32_t sum = a + (f) + md5K[i] + m[g]; \
+    a = d; \
+    d = c; \
+    c = b; \
+    b = b + rotl(sum, md5Shift[(i) >> 4][(i) & 3]); \
+  }
+
+/**
+ * A single MD5 compression, from the initial state. Each round has a loop of
+ * its own, so that the compiler can unroll them.
+ */
+void md5Block(const uint32_t *m, uint8_t *outDigest)
+{
+  const uint32_t init[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  uint32_t a = init[0], b = init[1], c = init[2], d = init[3];
+
+  for (int i = 0; i < 16; i++)
+    MD5_STEP(d ^ (b & (c ^ d)), i, i);
+  for (int i = 16; i < 32; i++)
+    MD5_STEP(c ^ (d & (b ^ c)), (5 * i + 1) & 15, i);
+  for (int i = 32; i < 48; i++)
+    MD5_STEP(b ^ c ^ d, (3 * i + 5) & 15, i);
+  for (int i = 48; i < 64; i++)
+    MD5_STEP(c ^ (b | ~d), (7 * i) & 15, i);
+
+  storeLE(outDigest, init[0] + a);
+  storeLE(outDigest + 4, init[1] + b);
+  storeLE(outDigest + 8, init[2] + c);
+  storeLE(outDigest + 12, init[3] + d);
+}
+
+// One step of SHA1, with the registers rotated by the caller's loop.
+#define SHA1_STEP(f, k, i) \
+  { \
+    uint32_t temp = rotl(a, 5) + (f) + e + (k) + w[i]; \
+    e = d; \
+    d = c; \
+    c = rotl(b, 30); \
+    b = a; \
+    a = temp; \
+  }
+
+/**
+ * A single SHA1 compression, from the initial state. Each round has a loop of
+ * its own, as for MD5.
+ */
+void sha1Block(const uint32_t *m, uint8_t *outDigest)
+{
+  const uint32_t init[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  uint32_t w[80];
+  uint32_t a = init[0], b = init[1], c = init[2], d = init[3], e = init[4];
+
+  for (int i = 0; i < 16; i++)
+    w[i] = m[i];
+  for (int i = 16; i < 80; i++)
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  for (int i = 0; i < 20; i++)
+    SHA1_STEP(d ^ (b & (c ^ d)), 0x5a827999, i);
+  for (int i = 20; i < 40; i++)
+    SHA1_STEP(b ^ c ^ d, 0x6ed9eba1, i);
+  for (int i = 40; i < 60; i++)
+    SHA1_STEP((b & c) | (d & (b | c)), 0x8f1bbcdc, i);
+  for (int i = 60; i < 80; i++)
+    SHA1_STEP(b ^ c ^ d, 0xca62c1d6, i);
+
+  storeBE(outDigest, init[0] + a);
+  storeBE(outDigest + 4, init[1] + b);
+  storeBE(outDigest + 8, init[2] + c);
+  storeBE(outDigest + 12, init[3] + d);
+  storeBE(outDigest + 16, init[4] + e);
+}
+
+}  // namespace
+
+AuthKey::AuthKey() :
+   m_type(bfd::AuthType::None),
+   m_keyId(0),
+   m_authLength(0),
+   m_packetLength(bfd::BasePacketSize),
+   m_digestLength(0)
+{
+  memset(m_block, 0, sizeof(m_block));
+}
+
+bool AuthKey::Set(bfd::AuthType::Value type, uint8_t keyId, const uint8_t *secret, size_t secretLength)
+{
+  uint8_t digestLength;
+
+  if (type == bfd::AuthType::MD5 || type == bfd::AuthType::MeticulousMD5)
+    digestLength = 16;
+  else if (type == bfd::AuthType::SHA1 || type == bfd::AuthType::MeticulousSHA1)
+    digestLength = 20;
+  else
+    return false;
+
+  if (secretLength == 0 || secretLength > digestLength)
+    return false;
+
+  m_type = type;
+  m_keyId = keyId;
+  m_digestLength = digestLength;
+  m_authLength = uint8_t(DigestOffset - bfd::BasePacketSize + digestLength);
+  m_packetLength = uint8_t(DigestOffset + digestLength);
+
+  // The tail of the block: the secret, zero padded, in place of the digest,
+  // then the hash padding and the length of the packet in bits.
+  uint8_t block[64];
+  memset(block, 0, sizeof(block));
+  memcpy(block + DigestOffset, secret, secretLength);
+  block[m_packetLength] = 0x80;
+  uint64_t bits = uint64_t(m_packetLength) * 8;
+  for (int i = 0; i < 8; i++)
+  {
+    if (isSha1())
+      block[63 - i] = uint8_t(bits >> (8 * i));
+    else
+      block[56 + i] = uint8_t(bits >> (8 * i));
+  }
+
+  for (size_t i = 0; i < 16; i++)
+    m_block[i] = isSha1() ? loadBE(block + 4 * i) : loadLE(block + 4 * i);
+  return true;
+}
+
+void AuthKey::digest(const BfdPacket &packet, uint8_t *outDigest) const
+{
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(&packet);
+  uint32_t block[16];
+
+  memcpy(block + PrefixWords, m_block + PrefixWords, sizeof(block) - PrefixWords * 4);
+  if (isSha1())
+  {
+    for (size_t i = 0; i < PrefixWords; i++)
+      block[i] = loadBE(data + 4 * i);
+    sha1Block(block, outDigest);
+  }
+  else
+  {
+    for (size_t i = 0; i < PrefixWords; i++)
+      block[i] = loadLE(data + 4 * i);
+    md5Block(block, outDigest);
+  }
+}
+
+void AuthKey::Sign(BfdPacket &ioPacket, uint32_t sequence) const
+{
+  ioPacket.header.SetAuth(true);
+  ioPacket.header.length = m_packetLength;
+  ioPacket.auth.type = uint8_t(m_type);
+  ioPacket.auth.len = m_authLength;
+  ioPacket.auth.data[0] = m_keyId;
+  ioPacket.auth.data[1] = 0;
+  storeBE(ioPacket.auth.data + 2, sequence);
+  digest(ioPacket, ioPacket.auth.data + 6);
+}
+
+bool AuthKey::Verify(const BfdPacket &packet, uint32_t &outSequence) const
+{
+  if (packet.header.length != m_packetLength
+      || packet.auth.type != uint8_t(m_type)
+      || packet.auth.len != m_authLength
+      || packet.auth.data[0] != m_keyId)
+    return false;
+
+  uint8_t expected[20];
+  digest(packet, expected);
+
+  // Compare all of it, so that the time taken does not depend on where it differs.
+  uint8_t diff = 0;
+  for (size_t i = 0; i < m_digestLength; i++)
+    diff |= expected[i] ^ packet.auth.data[6 + i];
+  if (diff != 0)
+    return false;
+
+  outSequence = loadBE(packet.auth.data + 2);
+  return true;
+}
+
+bool AuthKey::StringToType(const char *str, bfd::AuthType::Value &outType)
+{
+  static const struct
+  {
+    const char *name;
+    bfd::AuthType::Value type;
+  } types[] =
+  {
+    { "md5", bfd::AuthType::MD5},
+    { "meticulous-md5", bfd::AuthType::MeticulousMD5},
+    { "sha1", bfd::AuthType::SHA1},
+    { "meticulous-sha1", bfd::AuthType::MeticulousSHA1},
+  };
+
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+  {
+    if (0 == strcmp(str, types[i].name))
+    {
+      outType = types[i].type;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,103 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Keyed MD5 and Keyed SHA1 authentication of control packets, and the
+   Meticulous variants, per RFC 5880 section 6.7.
+
+ */
+#pragma once
+
+#include "bfd.h"
+#include <string>
+
+/**
+ * A single authentication key, with everything that does not change from packet
+ * to packet worked out in advance.
+ *
+ * An authenticated packet is at most 52 bytes, so that the data that is hashed,
+ * with the hash padding, always fits in one 64 byte block. The last 20 or 16
+ * bytes of that block (the key, the padding and the bit length) are the same
+ * for every packet, and are kept as message words in the order the hash uses.
+ * Signing or checking a packet then only converts the first 32 bytes (the
+ * header, and the fixed part of the auth section) and runs a single
+ * compression.
+ *
+ * Packets are in network order.
+ */
+class AuthKey
+{
+public:
+  static const size_t MaxSecretLength = 20;  // SHA1. MD5 allows 16.
+
+  AuthKey();
+
+  /**
+   * Sets the key.
+   *
+   * @param type [in] - MD5, MeticulousMD5, SHA1 or MeticulousSHA1.
+   * @param keyId [in] - The Auth Key ID sent in each packet.
+   * @param secret [in] - The shared secret.
+   * @param secretLength [in] - 1 to 16 for MD5, 1 to 20 for SHA1.
+   *
+   * @return bool - false if the type or length is not valid. The key is not changed.
+   */
+  bool Set(bfd::AuthType::Value type, uint8_t keyId, const uint8_t *secret, size_t secretLength);
+
+  bfd::AuthType::Value GetType() const { return m_type;}
+  uint8_t GetKeyId() const { return m_keyId;}
+
+  /**
+   * @return bool - true for the Meticulous types, which change the sequence
+   *         number on every packet.
+   */
+  bool IsMeticulous() const { return m_type == bfd::AuthType::MeticulousMD5 || m_type == bfd::AuthType::MeticulousSHA1;}
+
+  /**
+   * @return uint8_t - The length of the packet, with the auth section.
+   */
+  uint8_t GetPacketLength() const { return m_packetLength;}
+
+  /**
+   * Fills in the auth section of the packet, and its length and A bit.
+   *
+   * @param ioPacket [in/out] - The header should be complete.
+   * @param sequence [in] - The sequence number, in host order.
+   */
+  void Sign(BfdPacket &ioPacket, uint32_t sequence) const;
+
+  /**
+   * Checks the length, type, key id and digest of a received packet. The
+   * sequence number is not checked, since that depends on the session.
+   *
+   * @param packet [in] - The packet.
+   * @param outSequence [out] - The sequence number, in host order, on success.
+   *
+   * @return bool - false if it does not match.
+   */
+  bool Verify(const BfdPacket &packet, uint32_t &outSequence) const;
+
+  /**
+   * Parses an auth type name, as used by the control commands.
+   *
+   * @return bool - false if it is not a type that can be used for a key.
+   */
+  static bool StringToType(const char *str, bfd::AuthType::Value &outType);
+
+private:
+  static const size_t DigestOffset = bfd::BasePacketSize + 8; // Type, Len, Key ID, Reserved and Sequence Number.
+  static const size_t PrefixWords = DigestOffset / 4;
+
+  bool isSha1() const { return m_type == bfd::AuthType::SHA1 || m_type == bfd::AuthType::MeticulousSHA1;}
+  void digest(const BfdPacket &packet, uint8_t *outDigest) const;
+
+  bfd::AuthType::Value m_type;
+  uint8_t m_keyId;
+  uint8_t m_authLength;
+  uint8_t m_packetLength;
+  uint8_t m_digestLength;
+  uint32_t m_block[16];  // Message words, of which the first PrefixWords are filled per packet.
+};
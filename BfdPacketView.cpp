@@ -0,0 +1,99 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "BfdPacketView.h"
+#include "utils.h"
+
+using namespace std;
+
+const uint32_t BfdPacketView::FastLeadMask;
+const uint32_t BfdPacketView::FastLeadValue;
+const uint32_t BfdPacketView::DetectMultMask;
+const uint32_t BfdPacketView::StateInitOrUpBit;
+
+/**
+ * The full checks, for packets that are not the common case. Logs the reason
+ * for any failure.
+ */
+bool BfdPacketView::validateSlow() const
+{
+  if (m_dataLength < bfd::BasePacketSize)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: too small %zu", m_dataLength);
+    return false;
+  }
+
+  uint8_t version = GetVersion();
+  if (version != 0 && version != 1)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: bad version %hhu", version);
+    return false;
+  }
+
+  uint8_t length = m_data[3];
+  if (GetAuth())
+  {
+    if (length < bfd::BasePacketSize + bfd::AuthHeaderSize)
+    {
+      gLog.Optional(Log::Discard, "Discard packet: length too small to include auth %hhu", length);
+      return false;
+    }
+  }
+  else if (length < bfd::BasePacketSize)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: length too small %hhu", length);
+    return false;
+  }
+
+  // Auth data is read in place, so it must be in the buffer.
+  if (length > m_dataLength)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: length larger than data %hhu", length);
+    return false;
+  }
+
+  if (GetDetectMult() == 0)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: detectMult is 0.");
+    return false;
+  }
+
+  if (m_data[1] & 0x01)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: Multipoint bit is set.");
+    return false;
+  }
+
+  // Can check for 0 without byte order concerns.
+  if (readRawWord(4) == 0)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: Source Discriminator is 0.");
+    return false;
+  }
+
+  // Can check for 0 without byte order concerns.
+  if (readRawWord(8) == 0 && GetState() != bfd::State::Down && GetState() != bfd::State::AdminDown)
+  {
+    gLog.Optional(Log::Discard, "Discard packet: No destination discriminator and state is %s.", bfd::StateName(GetState()));
+    return false;
+  }
+
+  // packet is good as far as we can tell without a session.
+  return true;
+}
+
+void BfdPacketView::ToPacket(BfdPacket &outPacket) const
+{
+  BfdPacketHeader &header = outPacket.header;
+
+  memcpy(&outPacket, m_data, min(m_dataLength, sizeof(outPacket)));
+
+  header.myDisc               = ntohl(header.myDisc);
+  header.yourDisc             = ntohl(header.yourDisc);
+  header.txDesiredMinInt      = ntohl(header.txDesiredMinInt);
+  header.rxRequiredMinInt     = ntohl(header.rxRequiredMinInt);
+  header.rxRequiredMinEchoInt = ntohl(header.rxRequiredMinEchoInt);
+}
@@ -0,0 +1,100 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Read only access to a received control packet, in place.
+
+ */
+#pragma once
+
+#include "bfd.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+/**
+ * Reads the fields of a received control packet directly from the receive
+ * buffer. Nothing is copied, and each field is converted to host order only
+ * when it is read, so that packets which are discarded early cost little.
+ *
+ * The buffer must remain valid, and unchanged, while the view is used.
+ */
+class BfdPacketView
+{
+public:
+  /**
+   * @param data [in] - The received UDP payload.
+   * @param dataLength [in] - Length of data.
+   */
+  BfdPacketView(const uint8_t *data, size_t dataLength) : m_data(data), m_dataLength(dataLength) { }
+
+  /**
+   * Performs the checks from v10/6.7.6 that do not need a session. On failure
+   * the reason is logged.
+   *
+   * @return bool - false if the packet should be discarded.
+   */
+  bool Validate() const
+  {
+    // The common packet, with no auth, is checked with a single branch.
+    if (m_dataLength == bfd::BasePacketSize)
+    {
+      uint32_t lead = readWord(0);
+      bool good = ((lead & FastLeadMask) == FastLeadValue)
+                  & ((lead & DetectMultMask) != 0)
+                  & (readRawWord(4) != 0)
+                  & ((readRawWord(8) != 0) | ((lead & StateInitOrUpBit) == 0));
+      if (good)
+        return true;
+    }
+
+    return validateSlow();
+  }
+
+  /**
+   * @return size_t - The length of the packet, as given by its length field.
+   *         Only valid after Validate() succeeds.
+   */
+  size_t GetLength() const { return m_data[3];}
+
+  const uint8_t* GetData() const { return m_data;}
+  size_t GetDataLength() const { return m_dataLength;}
+
+  uint8_t GetVersion() const { return (m_data[0] & 0xE0) >> 5;}
+  bfd::State::Value GetState() const { return bfd::State::Value((m_data[1] >> 6) & 0x03);}
+  bool GetAuth() const { return (m_data[1] & 0x04);}
+  uint8_t GetDetectMult() const { return m_data[2];}
+  uint32_t GetMyDisc() const { return readWord(4);}
+  uint32_t GetYourDisc() const { return readWord(8);}
+
+  /**
+   * Copies the packet to outPacket, with all fields in host order, as expected
+   * by Session::ProcessControlPacket().
+   */
+  void ToPacket(BfdPacket &outPacket) const;
+
+private:
+  // First word, in host order: version, auth and multipoint bits, and length.
+  static const uint32_t FastLeadMask = 0xE00500FF;
+  static const uint32_t FastLeadValue = (uint32_t(bfd::Version) << 29) | bfd::BasePacketSize;
+  static const uint32_t DetectMultMask = 0x0000FF00;
+  // State Init or Up. Without a "your discriminator" the state must be Down or
+  // AdminDown.
+  static const uint32_t StateInitOrUpBit = 0x00800000;
+
+  uint32_t readRawWord(size_t offset) const
+  {
+    uint32_t value;
+    memcpy(&value, m_data + offset, sizeof(value));
+    return value;
+  }
+
+  uint32_t readWord(size_t offset) const { return ntohl(readRawWord(offset));}
+
+  bool validateSlow() const;
+
+  const uint8_t *m_data;
+  size_t m_dataLength;
+};
@@ -7,10 +7,24 @@
 #include "CommandProcessor.h"
 #include "utils.h"
 #include "Beacon.h"
+#include "Scheduler.h"
+#include "StatusRecord.h"
+#include "ControlFrame.h"
+#include "ReplyArena.h"
+#include "SessionEvents.h"
+#include "SelectScheduler.h"
+#include "KeventScheduler.h"
+#include "EpollScheduler.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <deque>
+#include <fstream>
+#include <algorithm>
 
 using namespace std;
 
@@ -21,14 +35,52 @@ class CommandProcessorImp : public CommandProcessor
 protected:
   Beacon *m_beacon; // never null, never changes
 
+  /**
+   * A control connection. See handleClientSocket().
+   */
+  struct Client
+  {
+    Client(CommandProcessorImp *inOwner) : owner(inOwner), inCommand(MaxCommandSize, 0),
+       output(inOwner->m_replyPool), framed(false), handledMessage(false), reading(false), paused(false),
+       timer(NULL), frameTag(0), frameHeader(NULL), json(false)
+    { }
+    CommandProcessorImp *owner;
+    Socket socket;
+    RecvMsg inCommand;
+    string input;       // Framed requests received, but not yet handled.
+    ReplyArena output;  // Replies that have not been sent.
+    TimeSpec lastProgress; // Last time data was received or sent.
+    bool framed;        // Started with MagicFramedNumber. See ControlFrame.h
+    bool handledMessage; // For unframed, the connection closes once the reply is sent.
+    bool reading;       // The socket callback is set.
+    bool paused;        // Framed requests wait until more of the output is sent.
+    Timer *timer;       // Retries sending, and closes idle connections.
+    uint32_t frameTag;  // Tag of the request being handled.
+    char *frameHeader;  // The open Data frame in output, or NULL.
+    Raii<SessionEventQueue>::Delete queue; // Only for subscribers.
+    bool json;          // Subscriber format.
+
+    size_t Unsent() const { return output.Size();}
+  };
+
   //
   // These are only accessed from thread.
   //
   Socket m_listenSocket;
-  Socket m_replySocket;
-  RecvMsg m_inCommand;
+  Raii<Scheduler>::Delete m_scheduler;
+  Timer *m_stopTimer; // Checks m_stopListeningRequested.
+  ReplyArena::Pool m_replyPool;  // Before m_clients, which use it.
+  vector<Client *> m_clients;
+  Client *m_client; // The client whose command is being handled. Replies go here.
+  size_t m_subscriberCount;
+  FileDescriptor m_wakeRead;  // Signaled by the subscriber queues.
+  FileDescriptor m_wakeWrite;
   vector<char> m_inReplyBuffer;  // only use  messageReply and friends.
   string m_inCommandLogStr;
+  vector<const char *> m_inCommands; // Start of each command in the message.
+  vector<char> m_frameCommands;  // The framed request being handled.
+  string m_streamBuffer; // only use streamReply and friends.
+  bool m_streamFailed; // The current streamed reply could not be sent.
 
 
   //
@@ -48,14 +100,21 @@ public:
   CommandProcessorImp(Beacon &beacon) :  CommandProcessor(beacon),
      m_beacon(&beacon),
      m_listenSocket(),
-     m_replySocket(),
-     m_inCommand(MaxCommandSize, 0),
+     m_stopTimer(NULL),
+     m_replyPool(MaxSpareReplyChunks),
+     m_client(NULL),
+     m_subscriberCount(0),
      m_inReplyBuffer(MaxReplyLineSize + 1),
+     m_streamFailed(false),
      m_mainLock(true),
      m_isThreadRunning(false),
      m_threadInitComplete(false),
      m_threadStartupSuccess(true),
-     m_stopListeningRequested(false)
+     m_stopListeningRequested(false),
+     m_inBatch(false),
+     m_batchLock(true),
+     m_batchComplete(false),
+     m_batchSuccess(false)
   {
     m_inCommandLogStr.reserve(MaxCommandSize);  // could end up needing more, but this is a good start.
   }
@@ -157,10 +216,10 @@ protected:
 
     // do Stuff
     if (initSuccess)
-    {
-      while (processMessage())
-      {}
-    }
+      m_scheduler->Run();
+
+    closeAllClients();
+    cleanupListening();
 
     lock.Lock();
     m_isThreadRunning = false;
@@ -170,6 +229,18 @@ protected:
   }
 
 
+  static const size_t MaxClients = 64;
+  static const size_t MaxSubscribers = 16;
+  static const size_t MaxSubscriberPending = 64 * 1024;  // Stop formatting events when more is unsent.
+  static const size_t MaxClientBacklog = 1024 * 1024;  // Framed requests wait when more is unsent.
+  static const size_t MaxSpareReplyChunks = 16;  // Output chunks kept for reuse.
+  static const size_t SendIovCount = 16;  // Output chunks passed to each sendmsg().
+  static const uint32_t IdleTimeoutMs = 10000;  // Close connections that send nothing for this long.
+  static const uint32_t SendRetryMs = 10;  // Poll for room to send. The scheduler only reports reads.
+  static const uint32_t SendStallTimeoutMs = 60000;  // Close connections that read nothing for this long.
+  static const uint32_t StopPollMs = 250;
+  static const uint32_t DefConnectSpreadUs = 1000000;  // Slow transmit interval, while not Up.
+
   /**
    *
    * Call only from listen thread.
@@ -200,1748 +271,4456 @@ protected:
     if (!m_listenSocket.Bind(m_address))
       return false;
 
-    if (!m_listenSocket.Listen(3))
+    if (!m_listenSocket.Listen(16))
+      return false;
+
+    // Connections are handled on this thread with a scheduler of our own, so
+    // that no client has to wait for another.
+#ifdef USE_KEVENT_SCHEDULER
+    m_scheduler = new KeventScheduler();
+#elif defined(USE_EPOLL_SCHEDULER)
+    m_scheduler = new EpollScheduler();
+#else
+    m_scheduler = new SelectScheduler();
+#endif
+
+    if (!initWakePipe())
+      return false;
+
+    if (!m_scheduler->SetSocketCallback(m_listenSocket, handleListenSocketCallback, this))
       return false;
 
+    if (!m_scheduler->SetSocketCallback(m_wakeRead, handleWakeCallback, this))
+      return false;
+
+    m_stopTimer = m_scheduler->MakeTimer("Control stop");
+    m_stopTimer->SetCallback(handleStopTimerCallback, this);
+    m_stopTimer->SetPriority(Timer::Priority::Low);
+    m_stopTimer->SetMsTimer(StopPollMs);
+
+    m_clients.reserve(MaxClients);
+
     gLog.Optional(Log::App, "Listening for commands on %s", m_address.ToString());
 
     return true;
   }
 
-  struct Result
+  /**
+   * Undoes initListening(). Call after closeAllClients().
+   *
+   * Call only from listen thread.
+   */
+  void cleanupListening()
   {
-    enum Type
+    if (m_scheduler.IsValid())
     {
-      Success,
-      Timeout,
-      Error,
-      StopListening   // requested shutdown
-    };
-  };
+      m_scheduler->FreeTimer(m_stopTimer);
+      m_stopTimer = NULL;
+      m_scheduler.Dispose();
+    }
+    m_listenSocket.Close();
+    m_wakeRead.Dispose();
+    m_wakeWrite.Dispose();
+  }
 
   /**
-   * Waits for the socket to have read data.
+   * Creates the pipe used by the subscriber queues to wake the listen thread.
    *
-   * @param fd
-   * @param pollTimeInMs - poll time for m_stopListeningRequested in milliseconds.
-   * @param maxWaitInMs - The maximum time to wait in milliseconds. May be rounded
-   *                    to the nearest pollTimeInMs.
+   * Call only from listen thread.
    *
-   * @return Result - Success, GaveUp, Error or StopListening
+   * @return bool - false on failure.
    */
-  Result::Type waitForSocketRead(int fd, uint32_t pollTimeInMs, uint32_t maxWaitInMs = 0)
+  bool initWakePipe()
   {
-    int result;
-    int waits = 0;
-    fd_set waitOn;
-    TimeSpec maxTime;
+    int fdPipe[2];
+    int flags;
 
-    if (maxWaitInMs)
-      maxTime = TimeSpec::MonoNow() + TimeSpec(TimeSpec::Millisec, maxWaitInMs);
-
-    while (!isStopListeningRequested())
+    if (pipe(fdPipe) != 0)
     {
-      if (maxWaitInMs)
-      {
-        if (TimeSpec::MonoNow() > maxTime)
-        {
-          gLog.Optional(Log::Command, "Waiting timed out after %d polls.", waits);
-          return Result::Timeout;
-        }
-      }
-
-      struct timeval waitTime;
+      gLog.ErrnoError(errno, "Unable to create pipe for session events");
+      return false;
+    }
 
-      // setup fd_set and wait time
-      waitTime.tv_sec = pollTimeInMs / 1000;
-      waitTime.tv_usec = (pollTimeInMs % 1000) * 1000;
+    m_wakeRead = fdPipe[0];
+    m_wakeWrite = fdPipe[1];
 
-      FD_ZERO(&waitOn);
-      FD_SET(fd, &waitOn);
-      result = select(fd + 1, &waitOn, NULL, NULL, &waitTime);
-      if (result < 0)
-      {
-        if (errno != EINTR)
-        {
-          gLog.ErrnoError(errno,  "socket wait: ");
-          return Result::Error;
-        }
-      }
-      else if (result > 0)
-      {
-        LogAssert(result == 1);
-        return Result::Success;
-      }
+    flags = fcntl(m_wakeRead, F_GETFL);
+    if (-1 == fcntl(m_wakeRead, F_SETFL, flags | O_NONBLOCK))
+    {
+      gLog.LogError("Failed to set event read pipe to non-blocking.");
+      return false;
+    }
+    flags = fcntl(m_wakeWrite, F_GETFL);
+    if (-1 == fcntl(m_wakeWrite, F_SETFL, flags | O_NONBLOCK))
+    {
+      gLog.LogError("Failed to set event write pipe to non-blocking.");
+      return false;
+    }
+    return true;
+  }
 
-      waits++;
+  static void handleStopTimerCallback(Timer *ATTR_UNUSED(timer), void *userdata)
+  {
+    CommandProcessorImp *me = reinterpret_cast<CommandProcessorImp *>(userdata);
 
-      //gLog.Optional(Log::Debug, "Still waiting %d\n", waits);
-    }
-    return Result::StopListening;
+    if (me->isStopListeningRequested())
+      me->m_scheduler->RequestShutdown();
+    else
+      me->m_stopTimer->SetMsTimer(StopPollMs);
   }
 
-  /**
-   * Helper for processMessage.
-   *
-   * @param me
-   */
-  static void closeSyncReplySocket(CommandProcessorImp *me)
+  static void handleListenSocketCallback(int ATTR_UNUSED(socket), void *userdata)
   {
-    if (me)
-      me->m_replySocket.Close();
+    reinterpret_cast<CommandProcessorImp *>(userdata)->acceptClient();
   }
 
   /**
-   *
-   * Process the next command.
-   * This can return false because m_stopListeningRequested was set to true, or
-   * because the "Stop" command was executed, or due to a fatal error that will
-   * not allow listening to continue.
+   * Accepts a new connection on m_listenSocket.
    *
    * Call only from listen thread.
-   *
-   * @throw - yes
-   *
-   * @return bool - false if listening should stop.
    */
-  bool processMessage()
+  void acceptClient()
   {
-
-    Result::Type waitResult;
     Socket connectedSocket;
-    RaiiNullBase<CommandProcessorImp, closeSyncReplySocket> syncConnectedSocket(this);
-
-
-    // Since we have a non-blocking socket, we must wait for a connection
-    waitResult = waitForSocketRead(m_listenSocket, 320);
-    if (waitResult != Result::Success)
-      return false;
 
-    // accept a connection
     if (!m_listenSocket.Accept(connectedSocket))
     {
       // We do not quit on error?
-      return true;
+      return;
     }
-    connectedSocket.SetLogName(FormatShortStr("Command connection to %s",  connectedSocket.GetAddress().ToString()));
-    m_replySocket = connectedSocket; // note connectedSocket still 'owns' the socket.
-    m_replySocket.SetLogName(connectedSocket.LogName());
-
-    // Got a connection for the command. Now wait for a command. Since we are
-    // non-blocking, we use select again.
-    waitResult = waitForSocketRead(connectedSocket, 200, 10000);
-    if (waitResult != Result::Success)
-      return true;  // failure here does not cause full shutdown.
 
-    // Should be ready with a command
-    while (true)
+    if (m_clients.size() >= MaxClients)
     {
-      if (isStopListeningRequested())
-        return false;
+      gLog.Message(Log::Command, "Too many control connections. Refused connection from %s.", connectedSocket.GetAddress().ToString());
+      return;
+    }
 
-      if (!m_inCommand.DoRecv(connectedSocket, MSG_DONTWAIT))
-      {
-        // Errors
-        if (m_inCommand.GetLastError() == EAGAIN)
-          gLog.Optional(Log::Command, "Incomplete message ... waiting."); // Must not have the full message. Wait for it?
-        else if (m_inCommand.GetLastError() == EINTR)
-          gLog.Optional(Log::Command, "Interrupted message ... trying again.");
-        else if (m_inCommand.GetLastError() == ECONNRESET)
-        {
-          gLog.Message(Log::Command, "Communication connection reset.");
-          return true;
-        }
-      }
-      else if (m_inCommand.GetDataSize() == 0)
-      {
-        gLog.LogError("Empty communication message.");
-        return true;
-      }
-      else
-      {
-        // Got a message
-        gLog.Optional(Log::Command, "Message size %zu.", m_inCommand.GetDataSize());
-        try
-        {
-          dispatchMessage((char *)m_inCommand.GetData(),  m_inCommand.GetDataSize());
-        }
-        catch (std::exception &e)
-        {
-          messageReplyF("Unable to complete request. Exception: %s\n", e.what());
-        }
-        return true;
-      }
+    Client *client = new Client(this);
+    client->socket.SetLogName(FormatShortStr("Command connection to %s",  connectedSocket.GetAddress().ToString()));
+    client->socket.Transfer(connectedSocket);
+    client->lastProgress = TimeSpec::MonoNow();
+    m_clients.push_back(client); // Reserved, so will not throw.
+
+    client->timer = m_scheduler->MakeTimer("Control connection");
+    client->timer->SetCallback(handleClientTimerCallback, client);
+    client->timer->SetPriority(Timer::Priority::Low);
+
+    if (!client->socket.SetBlocking(false) || !setReading(client, true))
+    {
+      closeClient(client);
+      return;
     }
-    return true;
+    updateClientTimer(client);
+  }
+
+  static void handleClientSocketCallback(int ATTR_UNUSED(socket), void *userdata)
+  {
+    Client *client = reinterpret_cast<Client *>(userdata);
+    client->owner->handleClientSocket(client);
   }
 
   /**
-   * Checks the validity of the message, and handles it.
+   * The first message decides the kind of connection. An unframed message is
+   * handled, and the connection closed once the reply is sent. A framed
+   * connection handles requests until the control closes it. A subscriber is
+   * only read to find when it closes.
    *
    * Call only from listen thread.
-   *
-   * @param message
-   * @param message_size
-   *
    */
-  void dispatchMessage(const char *message, size_t message_size)
+  void handleClientSocket(Client *client)
   {
-    const char *pos, *end;
-    const char *messageEnd = message + message_size - 1;
-    int paramCount = 0;
+    if (client->framed || client->queue)
+    {
+      readClientStream(client);
+      return;
+    }
 
-    if (message_size < sizeof(uint32_t))
+    if (!client->inCommand.DoRecv(client->socket, MSG_DONTWAIT))
     {
-      gLog.Optional(Log::Command, "Communication message too short. Ignoring.");
+      int error = client->inCommand.GetLastError();
+      if (error == EAGAIN || error == EINTR)
+        return;
+      if (error == ECONNRESET)
+        gLog.Message(Log::Command, "Communication connection reset.");
+      closeClient(client);
       return;
     }
 
-    if (ntohl(*(uint32_t *)message) != MagicMessageNumber)
+    const char *message = (const char *)client->inCommand.GetData();
+    size_t size = client->inCommand.GetDataSize();
+    if (size == 0)
     {
-      gLog.Optional(Log::Command, "Message invalid. No magic number. Ignoring.");
+      gLog.LogError("Empty communication message.");
+      closeClient(client);
       return;
     }
 
-    pos = message + sizeof(uint32_t);
+    gLog.Optional(Log::Command, "Message size %zu.", size);
+    client->lastProgress = TimeSpec::MonoNow();
 
-    // Verify the message
-    bool log = gLog.LogTypeEnabled(Log::Command);
-    m_inCommandLogStr.clear();
-    while (true)
+    if (size >= sizeof(uint32_t) && ntohl(*(uint32_t *)message) == MagicFramedNumber)
     {
-      end = pos;
-      for (; end <= messageEnd && *end != '\0'; end++)
-      {}
-      if (end > messageEnd)
+      gLog.Optional(Log::Command, "Framed connection started.");
+      client->framed = true;
+      client->input.assign(message + sizeof(uint32_t), size - sizeof(uint32_t));
+      if (!handleFrames(client))
       {
-        gLog.Optional(Log::Command, "Message invalid. No terminator. Ignoring.");
+        closeClient(client);
         return;
       }
-      if (end == pos)
-      {
-        if (pos !=  messageEnd)
-        {
-          gLog.Optional(Log::Command, "Message invalid. Terminator came before the end.");
-          return;
-        }
-        break;
-      }
-      else
-      {
-        paramCount++;
-        if (paramCount != 1)
-          m_inCommandLogStr.push_back(' ');
-        m_inCommandLogStr.append(pos);
-      }
-
-      pos = end + 1;
-    }
-
-    if (paramCount == 0)
-    {
-      gLog.Message(Log::Command, "Empty message received.");
+      sendClientOutput(client);
       return;
     }
 
-    if (log)
-      gLog.Optional(Log::Command, "Message %d <%s>\n", paramCount, m_inCommandLogStr.c_str());
-
+    client->handledMessage = true;
+    runMessage(client, message, size, false);
 
-
-    // We have a valid message
-    handleMessage(message + sizeof(uint32_t), paramCount);
+    // Only a subscriber has anything more to read.
+    if (!client->queue)
+      setReading(client, false);
+    sendClientOutput(client);
   }
 
   /**
-   * Handles a received message
+   * Reads from a framed or subscriber connection.
    *
    * Call only from listen thread.
-   *
-   * @param replySocket
-   * @param message - The message itself.
-   * @param paramCount - The number of post message parameters.
    */
-  void handleMessage(const char *message, int paramCount)
+  void readClientStream(Client *client)
   {
-    (void)paramCount;
+    char buffer[16 * 1024];
 
-    if (0 == strcasecmp(message, "stop"))
-    {
-      handle_Stop();
-    }
-    else if (0 == strcasecmp(message, "version"))
-    {
-      handle_Version();
-    }
-    else if (0 == strcasecmp(message, "connect"))
+    ssize_t result = ::recv(client->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (result < 0)
     {
-      handle_Connect(message);
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return;
+      gLog.Optional(Log::Command, "Control connection error: %s", ErrnoToString());
+      closeClient(client);
+      return;
     }
-    else if (0 == strcasecmp(message, "allow"))
+
+    if (result == 0)
     {
-      handle_Allow(message);
+      gLog.Optional(Log::Command, "Control connection closed.");
+      if (client->queue)
+      {
+        closeClient(client);
+        return;
+      }
+      // The control may still be reading replies, so finish them.
+      client->handledMessage = true;
+      setReading(client, false);
     }
-    else if (0 == strcasecmp(message, "block"))
+    else
     {
-      handle_Block(message);
+      client->lastProgress = TimeSpec::MonoNow();
+      // Subscribers do not send anything after the command, so it is discarded.
+      if (client->queue)
+        return;
+      client->input.append(buffer, size_t(result));
     }
-    else if (0 == strcasecmp(message, "status"))
+
+    if (!handleFrames(client))
     {
-      handle_Status(message);
+      closeClient(client);
+      return;
     }
-    else if (0 == strcasecmp(message, "log"))
+    sendClientOutput(client);
+  }
+
+  /**
+   * Handles each complete request in client->input. Stops early, and pauses
+   * reading, if the replies are backing up. sendClientOutput() resumes once
+   * they have been sent.
+   *
+   * Call only from listen thread.
+   *
+   * @return bool - false if the connection should be closed.
+   */
+  bool handleFrames(Client *client)
+  {
+    ControlFrameHeader header;
+    size_t pos = 0;
+
+    while (client->input.size() - pos >= sizeof(header))
     {
-      handle_Log(message);
+      if (client->Unsent() >= MaxClientBacklog)
+      {
+        client->paused = true;
+        setReading(client, false);
+        break;
+      }
+
+      memcpy(&header, client->input.data() + pos, sizeof(header));
+      uint32_t length = ntohl(header.length);
+      if (header.type != ControlFrameType::Request || length > MaxControlRequestSize)
+      {
+        gLog.Optional(Log::Command, "Framed request invalid. Closing connection.");
+        return false;
+      }
+      if (client->input.size() - pos - sizeof(header) < length)
+        break;
+
+      pos += sizeof(header);
+      m_frameCommands.assign(client->input.begin() + pos, client->input.begin() + pos + length);
+      pos += length;
+      client->frameTag = ntohl(header.tag);
+
+      if (m_frameCommands.empty())
+        gLog.Optional(Log::Command, "Empty framed request.");
+      else
+        runMessage(client, &m_frameCommands.front(), m_frameCommands.size(), true);
+
+      addFrame(client, ControlFrameType::End, NULL, 0);
     }
-    else if (0 == strcasecmp(message, "session"))
+
+    client->input.erase(0, pos);
+    return true;
+  }
+
+  /**
+   * Handles a message, or framed request, with replies going to the client.
+   *
+   * Call only from listen thread.
+   */
+  void runMessage(Client *client, const char *message, size_t size, bool framedRequest)
+  {
+    m_client = client;
+    try
     {
-      handle_Session(message);
+      if (framedRequest)
+        dispatchCommands(message, size);
+      else
+        dispatchMessage(message, size);
     }
-#ifdef BFD_DEBUG
-    else if (0 == strcasecmp(message, "test"))
+    catch (std::exception &e)
     {
-      handle_Test(message);
+      messageReplyF("Unable to complete request. Exception: %s\n", e.what());
     }
-#endif
+    m_client = NULL;
+  }
+
+  /**
+   * Adds a reply frame for the client's current request. Consecutive Data is
+   * merged into one frame, until some is sent.
+   */
+  void addFrame(Client *client, ControlFrameType::Value type, const char *data, size_t length)
+  {
+    if (type == ControlFrameType::Data && client->frameHeader)
+      growFrame(client, length);
     else
     {
-      messageReplyF("Unknown command <%s>\n", message);
+      // The header is kept in one piece, so that it can be changed in place.
+      ControlFrameHeader header;
+      memset(&header, 0, sizeof(header));
+      header.length = htonl(uint32_t(length));
+      header.tag = htonl(client->frameTag);
+      header.type = uint8_t(type);
+      char *buffer = client->output.Reserve(sizeof(header));
+      memcpy(buffer, &header, sizeof(header));
+      client->output.Commit(sizeof(header));
+      client->frameHeader = (type == ControlFrameType::Data) ? buffer : NULL;
     }
+    client->output.Append(data, length);
   }
 
-  typedef intptr_t(CommandProcessorImp::*BeaconCallback)(Beacon *beacon, void *userdata);
-
-  struct BeaconCallbackData
+  /**
+   * Adds to the length of the open Data frame.
+   */
+  void growFrame(Client *client, size_t length)
   {
-    CommandProcessorImp *me;
-    void *userdata;
-    BeaconCallback callback;
-    bool wasShuttingDown;
-    intptr_t result;
-    bool exceptionThrown;
-  };
+    ControlFrameHeader *header = reinterpret_cast<ControlFrameHeader *>(client->frameHeader);
+    header->length = htonl(uint32_t(ntohl(header->length) + length));
+  }
 
-  static void handleBeaconCallback(Beacon *beacon, void *userdata)
+  /**
+   * Sends as much of the output as the socket will take, with each sendmsg()
+   * taking up to SendIovCount chunks.
+   *
+   * @return bool - false on a fatal error.
+   */
+  bool writeClientOutput(Client *client)
   {
-    BeaconCallbackData *data = (BeaconCallbackData *)userdata;
+    struct iovec iov[SendIovCount];
 
-    if (beacon->IsShutdownRequested())
+    while (client->Unsent() != 0)
     {
-      data->wasShuttingDown = true;
-      return;
-    }
+      struct msghdr message;
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = iov;
+      message.msg_iovlen = client->output.GetIov(iov, countof(iov));
 
-    try
-    {
-      data->result = (data->me->*(data->callback))(beacon, data->userdata);
-    }
-    catch (std::exception &e)  // catch all exceptions .. is this too broad?
-    {
-      data->exceptionThrown = true;
-      gLog.Message(Log::Error, "Beacon callback failed due to exception: %s", e.what());
+      size_t offered = 0;
+      for (size_t i = 0; i < size_t(message.msg_iovlen); i++)
+        offered += iov[i].iov_len;
+
+      bool sent = client->socket.SendMsgStream(&message, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+      size_t remain = 0;
+      for (size_t i = 0; i < size_t(message.msg_iovlen); i++)
+        remain += message.msg_iov[i].iov_len;
+
+      if (remain != offered)
+      {
+        client->lastProgress = TimeSpec::MonoNow();
+        client->output.Consume(offered - remain);
+        // The open Data frame may have been sent, so it can not grow.
+        client->frameHeader = NULL;
+      }
+      if (!sent)
+        return !client->socket.LastErrorWasSendFatal();
+      if (remain != 0)
+        break;
     }
+    return true;
   }
 
   /**
-   * Queues a beacon callback. Does not return until operation is completed.
-   * Will respond using messageReply if the operation can not start due to a
-   * pending shutdown.
+   * Sends as much output as the socket will take without blocking, and then
+   * decides what the connection does next.
    *
-   * @param userdata
+   * Call only from listen thread.
    *
-   * @return bool - false on failure to run the callback.
+   * @return bool - false if the client was closed.
    */
-  bool doBeaconOperation(BeaconCallback callback, void *userdata, intptr_t *result = NULL)
+  bool sendClientOutput(Client *client)
   {
-    BeaconCallbackData data;
-    data.me = this;
-    data.userdata = userdata;
-    data.callback = callback;
-    data.wasShuttingDown = false;
-    data.result = 0;
-    data.exceptionThrown = false;
-
-    if (!m_beacon->QueueOperation(handleBeaconCallback, &data, true /* waitForCompletion*/))
+    while (true)
     {
-      messageReply("Unable to complete request (beacon is shutting down or low memory).\n");
-      return false;
-    }
+      if (client->queue && client->Unsent() < MaxSubscriberPending)
+        addSubscriberEvents(client);
 
-    if (data.exceptionThrown)
-    {
-      messageReply("Unable to complete request because an exception was thrown. Likely out of memory.\n");
-      return false;
+      if (!writeClientOutput(client))
+      {
+        closeClient(client);
+        return false;
+      }
+
+      if (!client->paused || client->Unsent() >= MaxClientBacklog / 2)
+        break;
+
+      // Handle the requests that were waiting, and send their replies.
+      client->paused = false;
+      if (!handleFrames(client))
+      {
+        closeClient(client);
+        return false;
+      }
+      if (!client->paused && !client->handledMessage)
+        setReading(client, true);
     }
 
-    if (data.wasShuttingDown)
+    if (client->handledMessage && !client->queue && !client->paused && client->Unsent() == 0)
     {
-      messageReply("Unable to complete request because the beacon is shutting down.\n");
+      closeClient(client);
       return false;
     }
 
-    if (result)
-      *result = data.result;
-
+    updateClientTimer(client);
     return true;
   }
 
-
   /**
-   * Holds enough info to locate a session, or marks for "All" sessions.
-   *
+   * While there is output, the timer polls for room to send. Otherwise it closes
+   * the connection if nothing arrives.
    */
-  struct SessionID
+  void updateClientTimer(Client *client)
   {
-    SessionID() : allSessions(false), whichId(0), whichRemoteAddr(), whichLocalAddr() { }
-    void Clear() { allSessions = false; whichId = 0; whichRemoteAddr.clear(); whichLocalAddr.clear();}
-    bool IsValid() const { return allSessions || whichId != 0 || HasIpAddresses();}
-    bool HasIpAddresses() const { return  whichRemoteAddr.IsValid() && whichLocalAddr.IsValid();}
-    void SetAddress(bool local, const IpAddr &addr) { if (local)
-        whichLocalAddr = addr;
-      else
-        whichRemoteAddr = addr;}
-
-    bool allSessions;
-    uint32_t whichId;
-    IpAddr whichRemoteAddr;
-    IpAddr whichLocalAddr;
-  };
+    if (client->Unsent() != 0)
+      client->timer->SetMsTimer(SendRetryMs);
+    else if (client->queue)
+      client->timer->Stop();
+    else
+      client->timer->SetMsTimer(IdleTimeoutMs);
+  }
 
-  /**
-   * Converts a set of parameters to a local/remote ip address pair.
-   *
-   * @param inOutParam [in/out] - The first parameter to examine. On success this
-   *                   will point to the last parameter used. On failure it will
-   *                   remain unchanged.
-   * @param sessionId [out] - Cleared on input. On success will have ip address
-   *                  (sessionId.HasIpAddresses() will be true).
-   * @param errorMsg [out] - On error it will contain a message.
-   *
-   * @return bool - false if the string could not be converted.
-   */
-  bool paramToIpPair(const char **inOutParam, SessionID &sessionId, string &errorMsg)
+  static void handleClientTimerCallback(Timer *ATTR_UNUSED(timer), void *userdata)
   {
-    const char *command = *inOutParam;
-    const char *str = *inOutParam;
-    bool local;
-    SessionID temp;
-    IpAddr addrVal;
-
-    sessionId.Clear();
+    Client *client = reinterpret_cast<Client *>(userdata);
+    client->owner->handleClientTimer(client);
+  }
 
-    if (0 == strcmp(str,  "remote"))
-      local = false;
-    else if (0 == strcmp(str,  "local"))
-      local = true;
-    else
+  void handleClientTimer(Client *client)
+  {
+    if (client->Unsent() == 0)
     {
-      errorMsg = FormatBigStr("Error: Unknown <%s> should be 'remote' or 'local'.", str);
-      return false;
+      gLog.Optional(Log::Command, "Control connection idle. Closing.");
+      closeClient(client);
+      return;
     }
 
-    str = getNextParam(str);
-    if (!str)
+    if (TimeSpec::MonoNow() > client->lastProgress + TimeSpec(TimeSpec::Millisec, SendStallTimeoutMs))
     {
-      errorMsg = FormatBigStr("Error: '%s' should be followed by an Pv4 or IPv6 address.", command);
-      return false;
+      gLog.Message(Log::Command, "Control connection is not reading replies. Closing.");
+      closeClient(client);
+      return;
     }
 
-    if (!addrVal.FromString(str))
-    {
-      errorMsg = FormatBigStr("Error: <%s> is not an IPv4 or IPv6 address.", str);
-      return false;
-    }
+    sendClientOutput(client);
+  }
 
-    temp.SetAddress(local, addrVal);
+  bool setReading(Client *client, bool reading)
+  {
+    if (client->reading == reading)
+      return true;
 
-    str = getNextParam(str);
-    if (!str)
+    if (reading)
     {
-      errorMsg = FormatBigStr("Error: '%s' not found.", local ? "remote" : "local");
-      return false;
+      if (!m_scheduler->SetSocketCallback(client->socket, handleClientSocketCallback, client))
+        return false;
     }
+    else
+      m_scheduler->RemoveSocketCallback(client->socket);
+    client->reading = reading;
+    return true;
+  }
 
-    local = !local;
-    if (0 != strcmp(str,  local ? "local" : "remote"))
+  /**
+   * Call only from listen thread.
+   */
+  void closeClient(Client *client)
+  {
+    if (client->queue)
     {
-      errorMsg = FormatBigStr("Error: unknown <%s>. '%s' ip must be followed by '%s'.", str, command, local ? "local" : "remote");
-      return false;
+      m_beacon->GetEventHub()->Unsubscribe(client->queue);
+      m_subscriberCount--;
     }
+    setReading(client, false);
+    m_scheduler->FreeTimer(client->timer);
 
-    command = str;
-    str = getNextParam(str);
-    if (!str)
-    {
-      errorMsg = FormatBigStr("Error: '%s' should be followed by an ip address.", command);
-      return false;
-    }
+    vector<Client *>::iterator found = std::find(m_clients.begin(), m_clients.end(), client);
+    if (LogVerify(found != m_clients.end()))
+      m_clients.erase(found);
+    delete client;
+  }
 
-    if (!addrVal.FromString(str))
+  /**
+   * Makes a last attempt to send replies, such as to "stop", and then closes
+   * every connection.
+   *
+   * Call only from listen thread.
+   */
+  void closeAllClients()
+  {
+    while (!m_clients.empty())
     {
-      errorMsg = FormatBigStr("Error: <%s> is not an IPv4 or IPv6 address.", str);
-      return false;
+      Client *client = m_clients.back();
+      writeClientOutput(client);
+      closeClient(client);
     }
+  }
 
-    temp.SetAddress(local, addrVal);
+  static void handleWakeCallback(int ATTR_UNUSED(socket), void *userdata)
+  {
+    reinterpret_cast<CommandProcessorImp *>(userdata)->sendAllSubscribers();
+  }
 
-    if (temp.whichLocalAddr.Type() != temp.whichRemoteAddr.Type())
+  /**
+   * Sends queued events to each subscriber.
+   *
+   * Call only from listen thread.
+   */
+  void sendAllSubscribers()
+  {
+    char buffer[64];
+    while (::read(m_wakeRead, buffer, sizeof(buffer)) > 0)
+    {}
+
+    // Backwards, since sending may close the client.
+    for (size_t index = m_clients.size(); index > 0; index--)
     {
-      errorMsg = FormatBigStr("Error: can not mix IPv4 and IPv6 addresses.");
-      return false;
+      if (index <= m_clients.size() && m_clients[index - 1]->queue)
+        sendClientOutput(m_clients[index - 1]);
     }
-
-    sessionId = temp;
-    *inOutParam = str;
-    return true;
   }
 
   /**
-   *
-   * Converts a parameter (or set of parameters) to an id or ip address, or "all".
-   * On failure sessionId is cleared.
-   *
-   * @param inOutParam [in/out] - The first parameters to examine. On parameters this
-   *                   will point to the last parameter used. On failure it will
-   *                   remain unchanged.
-   * @param sessionId [out]
-   * @param errorMsg [out] - On error it will contain a message.
-   *
-   * @return bool - false if the string could not be converted.
+   * Formats queued events for the subscriber.
    */
-  bool paramToIdOrIp(const char **inOutParam, SessionID &sessionId, string &errorMsg)
+  void addSubscriberEvents(Client *client)
   {
-    int64_t val;
-    const char *str = *inOutParam;
-
-    sessionId.Clear();
+    SessionEvent event;
+    bool drained = false;
 
-    if (0 == strcmp(str,  "all"))
+    while (client->Unsent() < MaxSubscriberPending)
     {
-      sessionId.allSessions = true;
-      return true;
+      if (!client->queue->Pop(event))
+      {
+        drained = true;
+        break;
+      }
+      formatEvent(client, event);
     }
 
-    if (0 == strcmp(str,  "remote") || 0 == strcmp(str,  "local"))
-      return paramToIpPair(inOutParam, sessionId, errorMsg);
-
-    // must be an id
-    if (StringToInt(str, val) && val != 0)
+    // Lost events are newer than any that were queued, so report them after.
+    if (drained)
     {
-      sessionId.whichId = (uint32_t)val;
-      return true;
+      uint32_t lost = client->queue->TakeLostCount();
+      if (lost)
+      {
+        if (client->json)
+          appendEventF(client, "{\"event\":\"lost\",\"count\":%u}\n", lost);
+        else
+          appendEventF(client, "Lost %u events.\n", lost);
+      }
     }
+  }
 
-    errorMsg = FormatBigStr("Unknown <%s>.", str);
+  void formatEvent(Client *client, const SessionEvent &event)
+  {
+    const SessionStatus &status = event.status;
+    const char *local = status.GetLocalAddress().ToString();
+    const char *remote = status.GetRemoteAddress().ToString();
 
-    return false;
+    if (client->json)
+    {
+      long sec = long(event.time.tv_sec);
+      long ms = long(event.time.tv_nsec / 1000000L);
+
+      if (event.type == SessionEvent::Type::State)
+        appendEventF(client, "{\"event\":\"state\",\"time\":%ld.%03ld,\"id\":%u,\"local\":\"%s\",\"remote\":\"%s\","
+                     "\"oldState\":\"%s\",\"state\":\"%s\",\"diag\":%u,\"remoteState\":\"%s\",\"remoteDiag\":%u}\n",
+                     sec, ms, status.id, local, remote,
+                     bfd::StateName(event.oldState),
+                     bfd::StateName(status.localState),
+                     unsigned(status.localDiag),
+                     bfd::StateName(status.remoteState),
+                     unsigned(status.remoteDiag));
+      else if (event.type == SessionEvent::Type::Parameters)
+        appendEventF(client, "{\"event\":\"parameters\",\"time\":%ld.%03ld,\"id\":%u,\"local\":\"%s\",\"remote\":\"%s\","
+                     "\"txInterval\":%u,\"rxTimeout\":%" PRIu64 "}\n",
+                     sec, ms, status.id, local, remote,
+                     status.transmitInterval,
+                     status.detectionTime);
+      else
+        appendEventF(client, "{\"event\":\"removed\",\"time\":%ld.%03ld,\"id\":%u,\"local\":\"%s\",\"remote\":\"%s\"}\n",
+                     sec, ms, status.id, local, remote);
+    }
+    else
+    {
+      if (event.type == SessionEvent::Type::State)
+        appendEventF(client, "State id=%u local=%s remote=%s %s -> %s <%s> remote=%s <%s>\n",
+                     status.id, local, remote,
+                     bfd::StateName(event.oldState),
+                     bfd::StateName(status.localState),
+                     bfd::DiagString(status.localDiag),
+                     bfd::StateName(status.remoteState),
+                     bfd::DiagString(status.remoteDiag));
+      else if (event.type == SessionEvent::Type::Parameters)
+        appendEventF(client, "Parameters id=%u local=%s remote=%s CurrentTxInterval=%u us CurrentRxTimeout=%" PRIu64 " us\n",
+                     status.id, local, remote,
+                     status.transmitInterval,
+                     status.detectionTime);
+      else
+        appendEventF(client, "Removed id=%u local=%s remote=%s\n", status.id, local, remote);
+    }
   }
 
+  void appendEventF(Client *client, const char *format, ...) ATTR_FORMAT(printf, 3, 4)
+  {
+    va_list args;
+    va_start(args, format);
+    client->output.AppendV(MaxReplyLineSize, format, args);
+    va_end(args);
+  }
 
   /**
+   * Checks the validity of the message, and handles it.
    *
-   * Call only from callback thread.
-   * Finds the session for the id or ip.
-   * Only one will be used.
+   * Call only from listen thread.
    *
-   * @param beacon
-   * @param sessionId [in] - The session to find. Fails if allSessions.
+   * @param message
+   * @param message_size
    *
-   * @return Session* - NULL if there is no such session. Or sessionId is "all"
    */
-  Session* findSession(Beacon *beacon, const SessionID &sessionId)
+  void dispatchMessage(const char *message, size_t message_size)
   {
-    if (!beacon)
-      return NULL;
-
-    if (!sessionId.IsValid() || sessionId.allSessions)
-      return NULL;
+    if (message_size < sizeof(uint32_t))
+    {
+      gLog.Optional(Log::Command, "Communication message too short. Ignoring.");
+      return;
+    }
 
-    if (sessionId.whichId != 0)
-      return beacon->FindSessionId(sessionId.whichId);
-    if (sessionId.HasIpAddresses())
-      return beacon->FindSessionIp(sessionId.whichRemoteAddr, sessionId.whichLocalAddr);
+    if (ntohl(*(uint32_t *)message) != MagicMessageNumber)
+    {
+      gLog.Optional(Log::Command, "Message invalid. No magic number. Ignoring.");
+      return;
+    }
 
-    return NULL;
+    dispatchCommands(message + sizeof(uint32_t), message_size - sizeof(uint32_t));
   }
 
-
   /**
+   * Checks the validity of the commands in a message, and handles them.
    *
-   * Clears and fill the vector with all the sessions as described by sessionId.
-   *
-   * @param outList
+   * Call only from listen thread.
    *
-   * @return - false if sessionId is invalid, or does not represent an live
-   *         session. true if there are no sessions, but sessionId is all. true
-   *         if sessions found
+   * @param commands [in] - The message, after the magic number.
+   * @param size [in] - Length of commands.
    */
-  bool findSessionIdList(Beacon *beacon, const SessionID &sessionId, std::vector<uint32_t> &outList)
+  void dispatchCommands(const char *commands, size_t size)
   {
+    const char *pos, *end, *messageEnd;
+    int paramCount = 0;
+    bool isAuthCommand = false;
 
-    if (!sessionId.IsValid())
-      return false;
-
-    if (sessionId.allSessions)
+    if (size == 0)
     {
-      beacon->GetSessionIdList(outList);
-      return true;
+      gLog.Optional(Log::Command, "Message invalid. No terminator. Ignoring.");
+      return;
     }
-    outList.clear();
-
-    Session *session = findSession(beacon, sessionId);
-    if (!session)
-      return false;
-
-    outList.push_back(session->GetId());
-    return true;
-  }
 
+    pos = commands;
+    messageEnd = commands + size - 1;
 
-  /**
-   * Sends reply message complaining that the given session could not be located.
-   *
-   * @param sessionId [in] - The session to find. Fails if allSessions.
-   */
-  void reportNoSuchSession(const SessionID &sessionId)
-  {
-    if (sessionId.whichId != 0)
-      messageReplyF("No session with id=%u.\n", sessionId.whichId);
-    else if (sessionId.HasIpAddresses())
-      messageReplyF("No session with local ip=%s and remote ip=%s.\n", sessionId.whichLocalAddr.ToString(), sessionId.whichRemoteAddr.ToString());
-    else
-      messageReply("Unknown session specifier.\n");
-  }
-
-
-  void handle_Stop()
-  {
-    m_beacon->RequestShutdown();
-    messageReply("stopping\n");
-  }
-
-  void handle_Version()
-  {
-    messageReplyF("%s v%s\n", BeaconAppName, SofwareVesrion);
-  }
-
-  /**
-   * "log" command.
-   * Format 'log' 'level' name - to set logging level
-   * Format 'log' type ['yes'|'no'] - enable/disable specific logging.
-   *
-   */
-  void handle_Log(const char *message)
-  {
-    const char *itemString;
-    static const char *itemValues = "'level', 'type' or 'timing'";
-
-    itemString = getNextParam(message);
-    if (!itemString)
-    {
-      messageReplyF("Must specify: %s.\n", itemValues);
-      return;
-    }
-
-    if (0 == strcmp(itemString, "level"))
+    // Verify the message. It holds one or more commands, each of which is a
+    // series of parameters followed by an empty one.
+    bool log = gLog.LogTypeEnabled(Log::Command);
+    m_inCommandLogStr.clear();
+    m_inCommands.clear();
+    while (true)
     {
-      Log::Level level;
-      const char *levelString = getNextParam(itemString);
-      if (!levelString)
+      end = pos;
+      for (; end <= messageEnd && *end != '\0'; end++)
+      {}
+      if (end > messageEnd)
       {
-        messageReply("Must specify a level name or 'list'.\n");
+        gLog.Optional(Log::Command, "Message invalid. No terminator. Ignoring.");
         return;
       }
-
-      if (0 == strcmp("list", levelString))
+      if (end == pos)
       {
-        string str;
-
-        str.reserve(Log::LevelCount * 10);
-
-        for (int index = 0; index < Log::LevelCount; index++)
+        if (paramCount == 0)
         {
-          if (!str.empty())
-            str += ", ";
-          str += gLog.LogLevelToString(Log::Level(index));
+          if (m_inCommands.empty())
+          {
+            gLog.Message(Log::Command, "Empty message received.");
+            return;
+          }
+          gLog.Optional(Log::Command, "Message invalid. Terminator came before the end.");
+          return;
         }
-        messageReplyF("Available log levels: %s\n",  str.c_str());
-        return;
-      }
-
-      level = gLog.StringToLogLevel(levelString);
-      if (level == Log::LevelCount)
-      {
-        messageReplyF("Unknown level: %s.\n", levelString);
-        return;
-      }
-
 
-      gLog.SetLogLevel(level);
-      messageReplyF("Log level set to %s.\n", levelString);
-      return;
-    }
-    else if (0 == strcmp(itemString, "type"))
-    {
-      Log::Type type;
-      bool enable, wasEnabled;
-      const char *paramString = getNextParam(itemString);
-      if (!paramString)
-      {
-        messageReply("'type' must be followed by 'list' or a log type.\n");
-        return;
+        paramCount = 0;
+        if (pos ==  messageEnd)
+          break;
       }
-
-      if (0 == strcmp("list", paramString))
+      else
       {
-        string str;
-        str.reserve(Log::TypeCount * 30);
-
-        for (type = Log::Type(0); type < Log::TypeCount; type = Log::Type(type + 1))
+        if (paramCount == 0)
         {
-          const char *desc = gLog.LogTypeDescription(type);
-          if (*desc != '\0')
-            str += FormatMediumStr("    %s - %s\n", gLog.LogTypeToString(Log::Type(type)), desc);
-          else
-            str += FormatMediumStr("    %s\n", gLog.LogTypeToString(Log::Type(type)));
+          if (!m_inCommands.empty())
+            m_inCommandLogStr.append("; ");
+          m_inCommands.push_back(pos);
+          isAuthCommand = (0 == strcasecmp(pos, "auth"));
         }
-        messageReplyF("Available log types:\n%s",  str.c_str());
-        return;
-      }
-
-      type = gLog.StringToLogType(paramString);
-      if (type == Log::TypeCount)
-      {
-        messageReplyF("Unknown log type: %s.\n", paramString);
-        return;
-      }
-
-      const char *actionString = getNextParam(paramString);
-      if (!actionString)
-      {
-        messageReply("Must specify 'yes' or 'no'.\n");
-        return;
-      }
-
-      if (0 == strcmp("yes", actionString))
-        enable = true;
-      else if (0 == strcmp("no", actionString))
-        enable = false;
-      else
-      {
-        messageReply("Must specify 'yes' or 'no'.\n");
-        return;
+        else
+          m_inCommandLogStr.push_back(' ');
+        paramCount++;
+        // The secret of 'auth name set type keyid secret' is not logged.
+        if (isAuthCommand && paramCount == 6)
+          m_inCommandLogStr.append("<secret>");
+        else
+          m_inCommandLogStr.append(pos);
       }
 
-      wasEnabled = gLog.LogTypeEnabled(type);
-      gLog.EnableLogType(type, enable);
-
-      messageReplyF("Log type %s set to %s, was %s\n", paramString, enable ? "yes" : "no", wasEnabled ? "yes" : "no");
-      return;
+      pos = end + 1;
     }
-    else if (0 == strcmp(itemString, "timing"))
-    {
-      bool enable;
-
-      const char *actionString = getNextParam(itemString);
-      if (!actionString)
-      {
-        messageReply("Must specify 'yes' or 'no'.\n");
-        return;
-      }
 
-      if (0 == strcmp("yes", actionString))
-        enable = true;
-      else if (0 == strcmp("no", actionString))
-        enable = false;
-      else
-      {
-        messageReply("Must specify 'yes' or 'no'.\n");
-        return;
-      }
+    if (log)
+      gLog.Optional(Log::Command, "Message %zu <%s>\n", m_inCommands.size(), m_inCommandLogStr.c_str());
 
-      gLog.SetExtendedTimeInfo(enable ? Logger::TimeInfo::Mono : Logger::TimeInfo::None);
-      messageReplyF("Extended time logging %s.\n", enable ? "enabled" : "disabled");
-      return;
-    }
+    // We have a valid message
+    if (m_inCommands.size() == 1)
+      handleMessage(m_inCommands.front(), paramCount);
     else
-    {
-      messageReplyF("'log' must be followed by one of %s. Unknown <%s>\n", itemValues, itemString);
-    }
+      handleBatch(m_inCommands);
   }
 
   /**
-   * "connect" command.
-   * Format 'connect' ip.
-   * Starts an 'active' session with the given ip.
+   * Handles a message with more than one command. Commands that change sessions
+   * or settings are queued, and handed to the beacon together, so that there is
+   * only one round trip to the scheduler for all of them. Other commands wait for
+   * the queued ones to finish, and then run as usual. Replies are sent in command
+   * order.
+   *
+   * Call only from listen thread.
+   *
+   * @param commands [in] - The start of each command.
    */
-  void handle_Connect(const char *message)
+  void handleBatch(const vector<const char *> &commands)
   {
-    SessionID address;
-    const char *addressString;
-    intptr_t result;
-    string error;
+    RaiiNullBase<CommandProcessorImp, endBatch> batchRunning(this);
 
-    addressString = getNextParam(message);
-    if (!addressString)
+    m_inBatch = true;
+    for (size_t index = 0; index < commands.size(); index++)
     {
-      messageReply("Must supply 'local ip remote ip' address pair.\n");
-      return;
-    }
+      if (!isBatchCommand(commands[index]))
+        flushBatch();
 
-    if (!paramToIpPair(&addressString, address, error))
-    {
-      messageReplyF("'connect' must be followed by an ip pair. %s\n", error.c_str());
-      return;
+      m_batch.push_back(BatchItem());
+      handleMessage(commands[index], 0);
     }
 
-    if (doBeaconOperation(&CommandProcessorImp::doHandleConnect, &address, &result))
-    {
-      if (result)
-        messageReplyF("Opened connection from local %s to remote %s\n", address.whichLocalAddr.ToString(), address.whichRemoteAddr.ToString());
-      else
-        messageReplyF("Failed to open connection from local %s to remote %s\n", address.whichLocalAddr.ToString(), address.whichRemoteAddr.ToString());
-    }
+    flushBatch();
   }
 
-  intptr_t doHandleConnect(Beacon *beacon, void *userdata)
+  /**
+   * Can the command be queued as part of a batch. These must use
+   * doBatchableOperation(), rather than doBeaconOperation().
+   */
+  static bool isBatchCommand(const char *command)
   {
-    SessionID *addr = reinterpret_cast<SessionID *>(userdata);
-
-    if (!LogVerify(addr->HasIpAddresses()))
-      return 0;
-
-    return beacon->StartActiveSession(addr->whichRemoteAddr, addr->whichLocalAddr);
+    return (0 == strcasecmp(command, "connect")
+            || 0 == strcasecmp(command, "allow")
+            || 0 == strcasecmp(command, "block")
+            || 0 == strcasecmp(command, "session"));
   }
 
   /**
-   * "allow" command.
-   * Format 'allow' ip
+   * Helper for handleBatch.
    */
-  void handle_Allow(const char *message)
+  static void endBatch(CommandProcessorImp *me)
   {
-    IpAddr address;
-    const char *addressString;
-
-    addressString = getNextParam(message);
-    if (!addressString)
-    {
-      messageReply("Must supply ip address.\n");
-      return;
-    }
-
-    if (!address.FromString(addressString))
-    {
-      messageReplyF("Invalid IPv4 or IPv6 address <%s>.\n", addressString);
+    if (!me)
       return;
-    }
-
-    if (doBeaconOperation(&CommandProcessorImp::doHandleAllow, &address))
-      messageReplyF("Allowing connections from %s\n", address.ToString());
-  }
-
-  intptr_t doHandleAllow(Beacon *beacon, void *userdata)
-  {
-    IpAddr *addr = reinterpret_cast<IpAddr *>(userdata);
-    beacon->AllowPassiveIP(*addr);
-    return 0;
+    me->clearBatch();
+    me->m_inBatch = false;
   }
 
-
   /**
-   * "block" command.
-   * Format 'block' ip
+   * Handles a received message
+   *
+   * Call only from listen thread.
+   *
+   * @param replySocket
+   * @param message - The message itself.
+   * @param paramCount - The number of post message parameters.
    */
-  void handle_Block(const char *message)
+  void handleMessage(const char *message, int paramCount)
   {
-    IpAddr address;
-    const char *addressString;
+    (void)paramCount;
 
-    addressString = getNextParam(message);
-    if (!addressString)
+    if (0 == strcasecmp(message, "stop"))
     {
-      messageReply("Must supply an IPv4 or IPv6 address.\n");
-      return;
+      handle_Stop();
     }
-
-    if (!address.FromString(addressString))
+    else if (0 == strcasecmp(message, "version"))
     {
-      messageReplyF("Invalid IPv4 or IPv6 address <%s>.\n", addressString);
-      return;
+      handle_Version();
+    }
+    else if (0 == strcasecmp(message, "connect"))
+    {
+      handle_Connect(message);
+    }
+    else if (0 == strcasecmp(message, "allow"))
+    {
+      handle_Allow(message);
+    }
+    else if (0 == strcasecmp(message, "block"))
+    {
+      handle_Block(message);
+    }
+    else if (0 == strcasecmp(message, "status"))
+    {
+      handle_Status(message);
+    }
+    else if (0 == strcasecmp(message, "log"))
+    {
+      handle_Log(message);
+    }
+    else if (0 == strcasecmp(message, "session"))
+    {
+      handle_Session(message);
+    }
+    else if (0 == strcasecmp(message, "stats"))
+    {
+      handle_Stats(message);
+    }
+    else if (0 == strcasecmp(message, "profile"))
+    {
+      handle_Profile(message);
+    }
+    else if (0 == strcasecmp(message, "auth"))
+    {
+      handle_Auth(message);
+    }
+    else if (0 == strcasecmp(message, "subscribe"))
+    {
+      handle_Subscribe(message);
+    }
+    else if (0 == strcasecmp(message, "capture"))
+    {
+      handle_Capture(message);
+    }
+    else if (0 == strcasecmp(message, "sync"))
+    {
+      handle_Sync(message);
+    }
+#ifdef BFD_DEBUG
+    else if (0 == strcasecmp(message, "test"))
+    {
+      handle_Test(message);
+    }
+#endif
+    else
+    {
+      messageReplyF("Unknown command <%s>\n", message);
     }
-
-    if (doBeaconOperation(&CommandProcessorImp::doHandleBlock, &address))
-      messageReplyF("Blocking connections from %s. This will not terminate any ongoing session.\n", address.ToString());
-  }
-
-  intptr_t doHandleBlock(Beacon *beacon, void *userdata)
-  {
-    IpAddr *addr = reinterpret_cast<IpAddr *>(userdata);
-    beacon->BlockPassiveIP(*addr);
-    return 0;
   }
 
-  struct StatusInfo
+  typedef intptr_t(CommandProcessorImp::*BeaconCallback)(Beacon *beacon, void *userdata);
+
+  struct BeaconCallbackData
   {
-    uint32_t id;
-    uint32_t localDisc;
-    uint32_t remoteDisc;
-    IpAddr remoteAddress;
-    IpAddr localAddress;
-    bool isActiveSession; //active or passive role.
-    Session::ExtendedStateInfo extState;
+    CommandProcessorImp *me;
+    void *userdata;
+    BeaconCallback callback;
+    bool wasShuttingDown;
+    intptr_t result;
+    bool exceptionThrown;
   };
 
-  void fillSessionInfo(Session *session, StatusInfo &outInfo, int level)
+  static void handleBeaconCallback(Beacon *beacon, void *userdata)
   {
-    outInfo.id = session->GetId();
-    outInfo.remoteAddress =  session->GetRemoteAddress();
-    outInfo.localAddress = session->GetLocalAddress();
-    if (level >= 1)
+    BeaconCallbackData *data = (BeaconCallbackData *)userdata;
+
+    if (beacon->IsShutdownRequested())
     {
-      outInfo.isActiveSession = session->IsActiveSession();
-      outInfo.localDisc = session->GetLocalDiscriminator();
-      outInfo.remoteDisc = session->GetRemoteDiscriminator();
+      data->wasShuttingDown = true;
+      return;
     }
 
-    if (level == 0)
-      outInfo.extState.localState = session->GetState();
-    else
-      session->GetExtendedState(outInfo.extState);
+    // With multiple shards this is called once for each shard, so the results
+    // are combined. Callbacks should return non-zero if any shard succeeded.
+    try
+    {
+      data->result |= (data->me->*(data->callback))(beacon, data->userdata);
+    }
+    catch (std::exception &e)  // catch all exceptions .. is this too broad?
+    {
+      data->exceptionThrown = true;
+      gLog.Message(Log::Error, "Beacon callback failed due to exception: %s", e.what());
+    }
   }
 
-
   /**
-   * prints the stats info for a session.
+   * Queues a beacon callback. Does not return until operation is completed.
+   * Will respond using messageReply if the operation can not start due to a
+   * pending shutdown.
    *
-   * @param info
-   * @param level
-   * @param brief [in]- use codes instead of descriptive text.
-   * @param compact [in]- true to print all info on one line.
+   * @param userdata
+   *
+   * @return bool - false on failure to run the callback.
    */
-  void printStatusInfo(StatusInfo &info, int level, bool brief, bool compact)
+  bool doBeaconOperation(BeaconCallback callback, void *userdata, intptr_t *result = NULL)
   {
-    const char *sep = compact ? "" : "\n ";
-    bool useCommas = !brief;
+    BeaconCallbackData data;
+    data.me = this;
+    data.userdata = userdata;
+    data.callback = callback;
+    data.wasShuttingDown = false;
+    data.result = 0;
+    data.exceptionThrown = false;
 
-    if (level < 1)
-    {
-      // Always brief and compact
-      messageReplyF(" id=%u %slocal=%s %sremote=%s %sstate=%s\n",
-                    info.id,
-                    sep,
-                    info.localAddress.ToString(),
-                    sep,
-                    info.remoteAddress.ToString(),
-                    sep,
-                    bfd::StateName(info.extState.localState));
-    }
-    else if (level == 1)
+    if (!m_beacon->QueueOperation(handleBeaconCallback, &data, true /* waitForCompletion*/))
     {
-      messageReplyF(" id=%u %slocal=%s %s %sremote=%s %sstate=%s%s %s\n",
-                    info.id,
-                    sep,
-                    info.localAddress.ToString(),
-                    info.isActiveSession ? "(a)" : "(p)",
-                    sep,
-                    info.remoteAddress.ToString(),
-                    sep,
-                    bfd::StateName(info.extState.localState),
-                    info.extState.isHoldingState ? "<Forced>" : "",
-                    info.extState.isSuspended ? "<Suspended>" : ""
-                   );
+      messageReply("Unable to complete request (beacon is shutting down or low memory).\n");
+      return false;
     }
-    else if (level >= 2)
-    {
 
-      messageReplyF(" id=%u %slocal=%s %s %sremote=%s %sLocalState=%s<%s%s%s> %sRemoteState=%s<%s> %sLocalId=%u %sRemoteId=%u %s",
-                    info.id,
-                    sep,
-                    info.localAddress.ToString(),
-                    info.isActiveSession ? (brief ? "(a)" : "(active)") : (brief ? "(p)" : "(passive)"),
-                    sep,
-                    info.remoteAddress.ToString(),
-                    sep,
-                    bfd::StateName(info.extState.localState),
-                    info.extState.isHoldingState ? "Forced: " : "",
-                    info.extState.isSuspended ? "Suspended: " : "",
-                    brief ? ByteToString((uint8_t)info.extState.localDiag) : bfd::DiagString(info.extState.localDiag),
-                    sep,
-                    bfd::StateName(info.extState.remoteState),
-                    brief ? ByteToString((uint8_t)info.extState.remoteDiag) : bfd::DiagString(info.extState.remoteDiag),
-                    sep,
-                    info.localDisc,
-                    sep,
-                    info.remoteDisc,
-                    level > 2 ? sep : "\n"
-                   );
-    }
+    if (!checkBeaconCallbackData(data))
+      return false;
 
-    if (level >= 3)
+    if (result)
+      *result = data.result;
+
+    return true;
+  }
+
+  /**
+   * Will respond using messageReply if the callback failed.
+   *
+   * @return bool - false if the callback failed.
+   */
+  bool checkBeaconCallbackData(const BeaconCallbackData &data)
+  {
+    if (data.exceptionThrown)
     {
-      // Already added all level 2 stuff
-      messageReplyF("Time=%s %sCurrentTxInterval=%s us %sCurrentRxTimeout=%s us %s",
-                    makeTimeString(level, info.extState.uptimeList).c_str(),
-                    sep,
-                    FormatInteger(info.extState.transmitInterval, useCommas),
-                    sep,
-                    FormatInteger(info.extState.detectionTime, useCommas),
-                    level > 2 ? sep : "\n"
-                   );
+      messageReply("Unable to complete request because an exception was thrown. Likely out of memory.\n");
+      return false;
     }
 
-    if (level >= 4)
+    if (data.wasShuttingDown)
     {
-      // Already added all level 3 stuff
-      messageReplyF("LocalDetectMulti=%hhu "
-                    "%sLocalDesiredMinTx=%s us %s%s"
-                    "%sLocalRequiredMinRx=%s us %s"
-                    "%sRemoteDetectMulti=%hhu "
-                    "%sRemoteDesiredMinTx=%s us "
-                    "%sRemoteRequiredMinRx=%s us "
-                    "%s",
-                    info.extState.detectMult,
-                    sep,
-                    FormatInteger(info.extState.useDesiredMinTxInterval, useCommas),
-                    (info.extState.desiredMinTxInterval == info.extState.useDesiredMinTxInterval)
-                    ? "" : FormatShortStr("(pending %s us) ", FormatInteger(info.extState.desiredMinTxInterval, useCommas)),
-                    (info.extState.desiredMinTxInterval == info.extState.defaultDesiredMinTxInterval)
-                    ? "" : FormatShortStr("(def %s us) ", FormatInteger(info.extState.defaultDesiredMinTxInterval, useCommas)),
-                    sep,
-                    FormatInteger(info.extState.useRequiredMinRxInterval, useCommas),
-                    (info.extState.requiredMinRxInterval == info.extState.useRequiredMinRxInterval)
-                    ? "" : FormatShortStr("(pending %s us) ", FormatInteger(info.extState.requiredMinRxInterval, useCommas)),
-                    sep,
-                    info.extState.remoteDetectMult,
-                    sep,
-                    FormatInteger(info.extState.remoteDesiredMinTxInterval, useCommas),
-                    sep,
-                    FormatInteger(info.extState.remoteMinRxInterval, useCommas),
-                    "\n"
-                   );
+      messageReply("Unable to complete request because the beacon is shutting down.\n");
+      return false;
     }
+
+    return true;
   }
 
+  /**
+   * Called with the result of a batchable operation.
+   */
+  typedef void (CommandProcessorImp::*ReplyCallback)(void *userdata, intptr_t result);
 
   /**
-   * Helper for printStatusInfo.
-   *
-   * @param level
-   * @param uptimeList
-   *
-   * @return const char*
+   * Base for the data of a batchable operation, so that the batch can own it.
    */
-  string makeTimeString(int level, list<Session::UptimeInfo> &uptimeList)
+  struct CommandData
   {
-    string str;
-
-    if (!LogVerify(uptimeList.size() != 0))
-      return str;
+    virtual ~CommandData() { }
+  };
 
-    str.reserve(35 * (level > 3 ? uptimeList.size() : 1));
+  template <typename T> struct CommandValue : public CommandData
+  {
+    T value;
+  };
 
-    // Always add most recent time.
-    addTimeString(str, uptimeList.front());
+  struct BatchItem
+  {
+    BatchItem() : reply(NULL), data(NULL) { }
+    string output;  // Replies made before the operation ran.
+    ReplyCallback reply;  // NULL if there is no operation.
+    CommandData *data;  // Owned by the item. Freed by clearBatch().
+    BeaconCallbackData operation;
+  };
 
-    if (level <= 3 || uptimeList.size() < 2)
-      return str;
+  //
+  // These are only accessed from thread, while handling a batch.
+  //
+  bool m_inBatch;
+  deque<BatchItem> m_batch; // Deque, so that items do not move when added.
+  Beacon::OperationBatch m_operationBatch;
 
-    list<Session::UptimeInfo>::iterator it = uptimeList.begin();
-    for (it++; it != uptimeList.end(); it++)
-      addTimeString(str, *it);
-    return str;
-  }
+  //
+  // These are protected by m_batchLock
+  //
+  QuickLock m_batchLock;
+  WaitCondition m_batchCondition;
+  bool m_batchComplete;
+  bool m_batchSuccess;
 
   /**
-   *  Helper for makeTimeString. Adds single time info.
-   *
-   * @param level
-   * @param outStr [in/out] - adjusted to point to null terminator.
-   * @param outStrSize [in/out] - adjusted to reflect remaining buffer.
-   * @param uptimeList
+   * Runs the operation, and calls reply with the result. When handling a batch,
+   * the operation is queued, and is run, and replied to, with the rest of the
+   * batch. The reply is not called if the operation fails.
    *
-   * @return bool - false if out of space. Always null terminates.
+   * @param callback [in] - The operation.
+   * @param reply [in] - Called with userdata and the result of the operation.
+   * @param data [in] - This takes ownership. Must have been allocated with new.
+   * @param userdata [in] - Passed to callback and reply. Usually points into
+   *                 data.
    */
-  static void addTimeString(string &strout, Session::UptimeInfo &uptime)
+  void doBatchableOperation(BeaconCallback callback, ReplyCallback reply, CommandData *data, void *userdata)
   {
-    TimeSpec elapsed;
-    char buf[25];
+    Raii<CommandData>::Delete ownedData(data);
 
-    strout.append(bfd::StateName(uptime.state));
-    if (uptime.forced)
-      strout.append("/F(");
-    else
-      strout.append("(");
+    if (!m_inBatch)
+    {
+      intptr_t result;
+      if (doBeaconOperation(callback, userdata, &result))
+        (this->*reply)(userdata, result);
+      return;
+    }
 
-    elapsed = uptime.endTime - uptime.startTime;
+    BatchItem &item = m_batch.back();
+    item.reply = reply;
+    item.data = ownedData.Detach();
+    item.operation.me = this;
+    item.operation.userdata = userdata;
+    item.operation.callback = callback;
+    item.operation.wasShuttingDown = false;
+    item.operation.result = 0;
+    item.operation.exceptionThrown = false;
+  }
 
-    snprintf(buf, sizeof(buf), "%02u:%02u:%06.3f) ",
-             uint32_t(elapsed.tv_sec / 3600),
-             uint32_t(elapsed.tv_sec / 60),
-             double(elapsed.tv_sec % 60) + double(elapsed.tv_nsec) / 1000000000L);
+  static void handleBatchComplete(bool success, void *userdata)
+  {
+    CommandProcessorImp *me = reinterpret_cast<CommandProcessorImp *>(userdata);
+    AutoQuickLock lock(me->m_batchLock, true);
 
-    strout.append(buf);
+    me->m_batchSuccess = success;
+    me->m_batchComplete = true;
+    lock.SignalAndUnlock(me->m_batchCondition);
   }
 
-  struct SingleStatusCallbackInfo
+  /**
+   * Hands all the queued operations to the beacon, waits for them, and then sends
+   * all the replies for the batch.
+   *
+   * Call only from listen thread.
+   */
+  void flushBatch()
   {
-    int level;
-    SessionID sessionId;
-    StatusInfo info;
+    bool success = true;
+
+    if (m_batch.empty())
+      return;
+
+    m_operationBatch.clear();
+    for (deque<BatchItem>::iterator it = m_batch.begin(); it != m_batch.end(); it++)
+    {
+      if (it->reply)
+      {
+        Beacon::BatchOperation operation = { handleBeaconCallback, &it->operation};
+        m_operationBatch.push_back(operation);
+      }
+    }
+
+    if (!m_operationBatch.empty())
+    {
+      AutoQuickLock lock(m_batchLock, true);
+
+      m_batchComplete = false;
+      m_batchSuccess = false;
+      if (m_beacon->QueueOperationBatch(m_operationBatch, handleBatchComplete, this))
+      {
+        while (!m_batchComplete)
+          lock.LockWait(m_batchCondition);
+        success = m_batchSuccess;
+      }
+      else
+        success = false;
+    }
+
+    // Replies were held in the items, so send them now.
+    m_inBatch = false;
+    for (deque<BatchItem>::iterator it = m_batch.begin(); it != m_batch.end(); it++)
+    {
+      if (!it->output.empty())
+        doMessageReply(it->output.data(), it->output.length());
+
+      if (!it->reply)
+        continue;
+
+      if (!success)
+        messageReply("Unable to complete request (beacon is shutting down or low memory).\n");
+      else if (checkBeaconCallbackData(it->operation))
+        (this->*(it->reply))(it->operation.userdata, it->operation.result);
+    }
+    m_inBatch = true;
+
+    clearBatch();
+  }
+
+  void clearBatch()
+  {
+    for (deque<BatchItem>::iterator it = m_batch.begin(); it != m_batch.end(); it++)
+      delete it->data;
+    m_batch.clear();
+    m_operationBatch.clear();
+  }
+
+
+  /**
+   * Holds enough info to locate a session, or marks for "All" sessions.
+   *
+   */
+  struct SessionID
+  {
+    SessionID() : allSessions(false), whichId(0), whichRemoteAddr(), whichLocalAddr() { }
+    void Clear() { allSessions = false; whichId = 0; whichRemoteAddr.clear(); whichLocalAddr.clear();}
+    bool IsValid() const { return allSessions || whichId != 0 || HasIpAddresses();}
+    bool HasIpAddresses() const { return  whichRemoteAddr.IsValid() && whichLocalAddr.IsValid();}
+    void SetAddress(bool local, const IpAddr &addr) { if (local)
+        whichLocalAddr = addr;
+      else
+        whichRemoteAddr = addr;}
+
+    bool allSessions;
+    uint32_t whichId;
+    IpAddr whichRemoteAddr;
+    IpAddr whichLocalAddr;
   };
 
+  /**
+   * Converts a set of parameters to a local/remote ip address pair.
+   *
+   * @param inOutParam [in/out] - The first parameter to examine. On success this
+   *                   will point to the last parameter used. On failure it will
+   *                   remain unchanged.
+   * @param sessionId [out] - Cleared on input. On success will have ip address
+   *                  (sessionId.HasIpAddresses() will be true).
+   * @param errorMsg [out] - On error it will contain a message.
+   *
+   * @return bool - false if the string could not be converted.
+   */
+  bool paramToIpPair(const char **inOutParam, SessionID &sessionId, string &errorMsg)
+  {
+    const char *command = *inOutParam;
+    const char *str = *inOutParam;
+    bool local;
+    SessionID temp;
+    IpAddr addrVal;
+
+    sessionId.Clear();
+
+    if (0 == strcmp(str,  "remote"))
+      local = false;
+    else if (0 == strcmp(str,  "local"))
+      local = true;
+    else
+    {
+      errorMsg = FormatBigStr("Error: Unknown <%s> should be 'remote' or 'local'.", str);
+      return false;
+    }
+
+    str = getNextParam(str);
+    if (!str)
+    {
+      errorMsg = FormatBigStr("Error: '%s' should be followed by an Pv4 or IPv6 address.", command);
+      return false;
+    }
+
+    if (!addrVal.FromString(str))
+    {
+      errorMsg = FormatBigStr("Error: <%s> is not an IPv4 or IPv6 address.", str);
+      return false;
+    }
+
+    temp.SetAddress(local, addrVal);
+
+    str = getNextParam(str);
+    if (!str)
+    {
+      errorMsg = FormatBigStr("Error: '%s' not found.", local ? "remote" : "local");
+      return false;
+    }
+
+    local = !local;
+    if (0 != strcmp(str,  local ? "local" : "remote"))
+    {
+      errorMsg = FormatBigStr("Error: unknown <%s>. '%s' ip must be followed by '%s'.", str, command, local ? "local" : "remote");
+      return false;
+    }
+
+    command = str;
+    str = getNextParam(str);
+    if (!str)
+    {
+      errorMsg = FormatBigStr("Error: '%s' should be followed by an ip address.", command);
+      return false;
+    }
+
+    if (!addrVal.FromString(str))
+    {
+      errorMsg = FormatBigStr("Error: <%s> is not an IPv4 or IPv6 address.", str);
+      return false;
+    }
+
+    temp.SetAddress(local, addrVal);
+
+    if (temp.whichLocalAddr.Type() != temp.whichRemoteAddr.Type())
+    {
+      errorMsg = FormatBigStr("Error: can not mix IPv4 and IPv6 addresses.");
+      return false;
+    }
+
+    sessionId = temp;
+    *inOutParam = str;
+    return true;
+  }
 
   /**
-   * @return intptr_t - false if the session can not be located.
+   *
+   * Converts a parameter (or set of parameters) to an id or ip address, or "all".
+   * On failure sessionId is cleared.
+   *
+   * @param inOutParam [in/out] - The first parameters to examine. On parameters this
+   *                   will point to the last parameter used. On failure it will
+   *                   remain unchanged.
+   * @param sessionId [out]
+   * @param errorMsg [out] - On error it will contain a message.
+   *
+   * @return bool - false if the string could not be converted.
    */
-  intptr_t doHandleSingleStatus(Beacon *beacon, void *userdata)
+  bool paramToIdOrIp(const char **inOutParam, SessionID &sessionId, string &errorMsg)
   {
-    SingleStatusCallbackInfo *opInfo = reinterpret_cast<SingleStatusCallbackInfo *>(userdata);
-    Session *session = findSession(beacon, opInfo->sessionId);
+    int64_t val;
+    const char *str = *inOutParam;
+
+    sessionId.Clear();
+
+    if (0 == strcmp(str,  "all"))
+    {
+      sessionId.allSessions = true;
+      return true;
+    }
+
+    if (0 == strcmp(str,  "remote") || 0 == strcmp(str,  "local"))
+      return paramToIpPair(inOutParam, sessionId, errorMsg);
+
+    // must be an id
+    if (StringToInt(str, val) && val != 0)
+    {
+      sessionId.whichId = (uint32_t)val;
+      return true;
+    }
+
+    errorMsg = FormatBigStr("Unknown <%s>.", str);
+
+    return false;
+  }
+
+
+  /**
+   *
+   * Call only from callback thread.
+   * Finds the session for the id or ip.
+   * Only one will be used.
+   *
+   * @param beacon
+   * @param sessionId [in] - The session to find. Fails if allSessions.
+   *
+   * @return Session* - NULL if there is no such session. Or sessionId is "all"
+   */
+  Session* findSession(Beacon *beacon, const SessionID &sessionId)
+  {
+    if (!beacon)
+      return NULL;
+
+    if (!sessionId.IsValid() || sessionId.allSessions)
+      return NULL;
+
+    if (sessionId.whichId != 0)
+      return beacon->FindSessionId(sessionId.whichId);
+    if (sessionId.HasIpAddresses())
+      return beacon->FindSessionIp(sessionId.whichRemoteAddr, sessionId.whichLocalAddr);
+
+    return NULL;
+  }
+
+
+  /**
+   *
+   * Clears and fill the vector with all the sessions as described by sessionId.
+   *
+   * @param outList
+   *
+   * @return - false if sessionId is invalid, or does not represent an live
+   *         session. true if there are no sessions, but sessionId is all. true
+   *         if sessions found
+   */
+  bool findSessionIdList(Beacon *beacon, const SessionID &sessionId, std::vector<uint32_t> &outList)
+  {
+
+    if (!sessionId.IsValid())
+      return false;
+
+    if (sessionId.allSessions)
+    {
+      beacon->GetSessionIdList(outList);
+      return true;
+    }
+    outList.clear();
+
+    Session *session = findSession(beacon, sessionId);
     if (!session)
-      return 0;
-    fillSessionInfo(session, opInfo->info, opInfo->level);
-    return 1;
+      return false;
+
+    outList.push_back(session->GetId());
+    return true;
+  }
+
+
+  /**
+   * Sends reply message complaining that the given session could not be located.
+   *
+   * @param sessionId [in] - The session to find. Fails if allSessions.
+   */
+  void reportNoSuchSession(const SessionID &sessionId)
+  {
+    if (sessionId.whichId != 0)
+      messageReplyF("No session with id=%u.\n", sessionId.whichId);
+    else if (sessionId.HasIpAddresses())
+      messageReplyF("No session with local ip=%s and remote ip=%s.\n", sessionId.whichLocalAddr.ToString(), sessionId.whichRemoteAddr.ToString());
+    else
+      messageReply("Unknown session specifier.\n");
+  }
+
+
+  void handle_Stop()
+  {
+    m_beacon->RequestShutdown();
+    messageReply("stopping\n");
+  }
+
+  void handle_Version()
+  {
+    messageReplyF("%s v%s\n", BeaconAppName, SofwareVesrion);
+  }
+
+  /**
+   * "log" command.
+   * Format 'log' 'level' name - to set logging level
+   * Format 'log' type ['yes'|'no'] - enable/disable specific logging.
+   *
+   */
+  void handle_Log(const char *message)
+  {
+    const char *itemString;
+    static const char *itemValues = "'level', 'type' or 'timing'";
+
+    itemString = getNextParam(message);
+    if (!itemString)
+    {
+      messageReplyF("Must specify: %s.\n", itemValues);
+      return;
+    }
+
+    if (0 == strcmp(itemString, "level"))
+    {
+      Log::Level level;
+      const char *levelString = getNextParam(itemString);
+      if (!levelString)
+      {
+        messageReply("Must specify a level name or 'list'.\n");
+        return;
+      }
+
+      if (0 == strcmp("list", levelString))
+      {
+        string str;
+
+        str.reserve(Log::LevelCount * 10);
+
+        for (int index = 0; index < Log::LevelCount; index++)
+        {
+          if (!str.empty())
+            str += ", ";
+          str += gLog.LogLevelToString(Log::Level(index));
+        }
+        messageReplyF("Available log levels: %s\n",  str.c_str());
+        return;
+      }
+
+      level = gLog.StringToLogLevel(levelString);
+      if (level == Log::LevelCount)
+      {
+        messageReplyF("Unknown level: %s.\n", levelString);
+        return;
+      }
+
+
+      gLog.SetLogLevel(level);
+      messageReplyF("Log level set to %s.\n", levelString);
+      return;
+    }
+    else if (0 == strcmp(itemString, "type"))
+    {
+      Log::Type type;
+      bool enable, wasEnabled;
+      const char *paramString = getNextParam(itemString);
+      if (!paramString)
+      {
+        messageReply("'type' must be followed by 'list' or a log type.\n");
+        return;
+      }
+
+      if (0 == strcmp("list", paramString))
+      {
+        string str;
+        str.reserve(Log::TypeCount * 30);
+
+        for (type = Log::Type(0); type < Log::TypeCount; type = Log::Type(type + 1))
+        {
+          const char *desc = gLog.LogTypeDescription(type);
+          if (*desc != '\0')
+            str += FormatMediumStr("    %s - %s\n", gLog.LogTypeToString(Log::Type(type)), desc);
+          else
+            str += FormatMediumStr("    %s\n", gLog.LogTypeToString(Log::Type(type)));
+        }
+        messageReplyF("Available log types:\n%s",  str.c_str());
+        return;
+      }
+
+      type = gLog.StringToLogType(paramString);
+      if (type == Log::TypeCount)
+      {
+        messageReplyF("Unknown log type: %s.\n", paramString);
+        return;
+      }
+
+      const char *actionString = getNextParam(paramString);
+      if (!actionString)
+      {
+        messageReply("Must specify 'yes' or 'no'.\n");
+        return;
+      }
+
+      if (0 == strcmp("yes", actionString))
+        enable = true;
+      else if (0 == strcmp("no", actionString))
+        enable = false;
+      else
+      {
+        messageReply("Must specify 'yes' or 'no'.\n");
+        return;
+      }
+
+      wasEnabled = gLog.LogTypeEnabled(type);
+      gLog.EnableLogType(type, enable);
+
+      messageReplyF("Log type %s set to %s, was %s\n", paramString, enable ? "yes" : "no", wasEnabled ? "yes" : "no");
+      return;
+    }
+    else if (0 == strcmp(itemString, "timing"))
+    {
+      bool enable;
+
+      const char *actionString = getNextParam(itemString);
+      if (!actionString)
+      {
+        messageReply("Must specify 'yes' or 'no'.\n");
+        return;
+      }
+
+      if (0 == strcmp("yes", actionString))
+        enable = true;
+      else if (0 == strcmp("no", actionString))
+        enable = false;
+      else
+      {
+        messageReply("Must specify 'yes' or 'no'.\n");
+        return;
+      }
+
+      gLog.SetExtendedTimeInfo(enable ? Logger::TimeInfo::Mono : Logger::TimeInfo::None);
+      messageReplyF("Extended time logging %s.\n", enable ? "enabled" : "disabled");
+      return;
+    }
+    else
+    {
+      messageReplyF("'log' must be followed by one of %s. Unknown <%s>\n", itemValues, itemString);
+    }
+  }
+
+  /**
+   * Data for a "connect" of more than one session.
+   */
+  struct BulkConnect
+  {
+    vector<Beacon::AddressPair> pairs;
+    uint32_t spreadUs;
+    vector<uint8_t> results; // Set by the shard that owns each pair.
+  };
+
+  /**
+   * "connect" command.
+   * Format 'connect' [spread <value> <unit>] ip-pair [ip-pair ...]
+   * Format 'connect' [spread <value> <unit>] file <path>
+   * Starts an 'active' session with each of the ip pairs. A single pair is
+   * started immediately, unless 'spread' is given.
+   */
+  void handle_Connect(const char *message)
+  {
+    const char *param;
+    uint32_t spreadUs = 0;
+    bool hasSpread = false;
+    string error;
+
+    param = getNextParam(message);
+    if (!param)
+    {
+      messageReply("Must supply 'local ip remote ip' address pair.\n");
+      return;
+    }
+
+    if (0 == strcmp(param, "spread"))
+    {
+      param = getNextParam(param);
+      if (!parseTimeValue(param, spreadUs, "'connect spread' value must be an integer followed by time unit : <%s>.\n"))
+        return;
+      hasSpread = true;
+      param = getNextParam(getNextParam(param));
+      if (!param)
+      {
+        messageReply("'connect spread' must be followed by address pairs, or 'file'.\n");
+        return;
+      }
+    }
+
+    Raii<CommandValue<BulkConnect> >::Delete bulk(new CommandValue<BulkConnect>);
+    vector<Beacon::AddressPair> &pairs = bulk->value.pairs;
+
+    if (0 == strcmp(param, "file"))
+    {
+      param = getNextParam(param);
+      if (!param)
+      {
+        messageReply("'connect file' must be followed by a file path.\n");
+        return;
+      }
+      if (getNextParam(param))
+      {
+        messageReplyF("Unexpected <%s> after 'connect file' path.\n", getNextParam(param));
+        return;
+      }
+      if (!readIpPairFile(param, pairs))
+        return;
+      if (pairs.empty())
+      {
+        messageReplyF("No address pairs found in <%s>.\n", param);
+        return;
+      }
+      // Without a spread, a big file would send all its first packets at once.
+      if (!hasSpread)
+        spreadUs = DefConnectSpreadUs;
+    }
+    else
+    {
+      for (; param; param = getNextParam(param))
+      {
+        SessionID address;
+        if (!paramToIpPair(&param, address, error))
+        {
+          messageReplyF("'connect' must be followed by ip pairs. %s\n", error.c_str());
+          return;
+        }
+        Beacon::AddressPair pair = { address.whichRemoteAddr, address.whichLocalAddr};
+        pairs.push_back(pair);
+      }
+
+      if (pairs.size() == 1 && !hasSpread)
+      {
+        Raii<CommandValue<SessionID> >::Delete data(new CommandValue<SessionID>);
+        SessionID &address = data->value;
+        address.SetAddress(false, pairs[0].remoteAddr);
+        address.SetAddress(true, pairs[0].localAddr);
+        doBatchableOperation(&CommandProcessorImp::doHandleConnect, &CommandProcessorImp::replyConnect, data.Detach(), &address);
+        return;
+      }
+    }
+
+    bulk->value.spreadUs = spreadUs;
+    bulk->value.results.resize(pairs.size(), 0);
+    BulkConnect &value = bulk->value;
+    doBatchableOperation(&CommandProcessorImp::doHandleBulkConnect, &CommandProcessorImp::replyBulkConnect, bulk.Detach(), &value);
+  }
+
+  /**
+   * Reads ip pairs for 'connect file', one per line, in the same form as the
+   * command. Blank lines, and anything after a '#', are ignored.
+   *
+   * @return bool - false on failure. A reply has been sent.
+   */
+  bool readIpPairFile(const char *path, vector<Beacon::AddressPair> &outPairs)
+  {
+    ifstream file(path);
+    string line;
+    vector<char> params;
+    string error;
+
+    if (!file.is_open())
+    {
+      messageReplyF("Failed to open file <%s> : %s\n", path, ErrnoToString());
+      return false;
+    }
+
+    for (int lineNumber = 1; getline(file, line); lineNumber++)
+    {
+      if (!lineToParams(line, params))
+        continue;
+
+      const char *param = &params.front();
+      SessionID address;
+      if (!paramToIpPair(&param, address, error))
+      {
+        messageReplyF("Line %d of <%s>: %s\n", lineNumber, path, error.c_str());
+        return false;
+      }
+      if (getNextParam(param))
+      {
+        messageReplyF("Line %d of <%s>: Unexpected <%s> after the ip pair.\n", lineNumber, path, getNextParam(param));
+        return false;
+      }
+
+      Beacon::AddressPair pair = { address.whichRemoteAddr, address.whichLocalAddr};
+      outPairs.push_back(pair);
+    }
+
+    if (file.bad())
+    {
+      messageReplyF("Failed to read file <%s> : %s\n", path, ErrnoToString());
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Builds the same double null terminated list as a command, from a line of a
+   * file. Anything after a '#' is ignored.
+   *
+   * @return bool - false if the line has no parameters.
+   */
+  static bool lineToParams(string &line, vector<char> &outParams)
+  {
+    size_t comment = line.find('#');
+    if (comment != string::npos)
+      line.erase(comment);
+
+    outParams.clear();
+    for (size_t pos = 0; pos < line.size(); pos++)
+    {
+      if (isspace((unsigned char)line[pos]))
+      {
+        if (!outParams.empty() && outParams.back() != '\0')
+          outParams.push_back('\0');
+      }
+      else
+        outParams.push_back(line[pos]);
+    }
+    if (outParams.empty())
+      return false;
+    if (outParams.back() != '\0')
+      outParams.push_back('\0');
+    outParams.push_back('\0');
+    return true;
+  }
+
+  intptr_t doHandleBulkConnect(Beacon *beacon, void *userdata)
+  {
+    BulkConnect *bulk = reinterpret_cast<BulkConnect *>(userdata);
+
+    beacon->StartActiveSessions(bulk->pairs, bulk->spreadUs, bulk->results);
+    // Success of each pair is in results.
+    return 1;
+  }
+
+  void replyBulkConnect(void *userdata, intptr_t ATTR_UNUSED(result))
+  {
+    BulkConnect *bulk = reinterpret_cast<BulkConnect *>(userdata);
+    size_t opened = 0;
+
+    for (size_t index = 0; index < bulk->pairs.size(); index++)
+    {
+      if (bulk->results[index])
+        opened++;
+      else
+        messageReplyF("Failed to open connection from local %s to remote %s\n", bulk->pairs[index].localAddr.ToString(), bulk->pairs[index].remoteAddr.ToString());
+    }
+
+    messageReplyF("Opened %zu of %zu connections.\n", opened, bulk->pairs.size());
+  }
+
+  void replyConnect(void *userdata, intptr_t result)
+  {
+    SessionID *address = reinterpret_cast<SessionID *>(userdata);
+
+    if (result)
+      messageReplyF("Opened connection from local %s to remote %s\n", address->whichLocalAddr.ToString(), address->whichRemoteAddr.ToString());
+    else
+      messageReplyF("Failed to open connection from local %s to remote %s\n", address->whichLocalAddr.ToString(), address->whichRemoteAddr.ToString());
+  }
+
+  intptr_t doHandleConnect(Beacon *beacon, void *userdata)
+  {
+    SessionID *addr = reinterpret_cast<SessionID *>(userdata);
+
+    if (!LogVerify(addr->HasIpAddresses()))
+      return 0;
+
+    if (!beacon->IsSessionOwner(addr->whichRemoteAddr, addr->whichLocalAddr))
+      return 0;
+
+    return beacon->StartActiveSession(addr->whichRemoteAddr, addr->whichLocalAddr);
+  }
+
+  /**
+   * Data for a "sync".
+   */
+  struct SyncCommand
+  {
+    vector<Beacon::SyncEntry> entries;
+    vector<uint32_t> nameIndex; // For each entry, into profileNames, or UINT32_MAX for none.
+    vector<string> profileNames;
+    vector<uint32_t> profileIds; // For each of profileNames.
+    uint32_t spreadUs;
+    vector<uint8_t> results; // Set by the shard that owns each entry.
+    Beacon::SyncSummary summary;
+  };
+
+  /**
+   * "sync" command.
+   * Format 'sync' [spread <value> <unit>] file <path>
+   * Format 'sync' [spread <value> <unit>] ip-pair ['profile' name] [ip-pair ...]
+   * Makes the active sessions match the list. See Beacon::SyncSessions().
+   */
+  void handle_Sync(const char *message)
+  {
+    Raii<CommandValue<SyncCommand> >::Delete data(new CommandValue<SyncCommand>);
+    SyncCommand &sync = data->value;
+    const char *param;
+    string error;
+
+    sync.spreadUs = DefConnectSpreadUs;
+    param = getNextParam(message);
+    if (param && 0 == strcmp(param, "spread"))
+    {
+      param = getNextParam(param);
+      if (!parseTimeValue(param, sync.spreadUs, "'sync spread' value must be an integer followed by time unit : <%s>.\n"))
+        return;
+      param = getNextParam(getNextParam(param));
+    }
+
+    if (!param)
+    {
+      messageReply("'sync' must be followed by address pairs, or 'file'.\n");
+      return;
+    }
+
+    if (0 == strcmp(param, "file"))
+    {
+      param = getNextParam(param);
+      if (!param)
+      {
+        messageReply("'sync file' must be followed by a file path.\n");
+        return;
+      }
+      if (getNextParam(param))
+      {
+        messageReplyF("Unexpected <%s> after 'sync file' path.\n", getNextParam(param));
+        return;
+      }
+      if (!readSyncFile(param, sync))
+        return;
+      // An empty file is more likely a mistake than a wish to delete everything.
+      if (sync.entries.empty())
+      {
+        messageReplyF("No address pairs found in <%s>.\n", param);
+        return;
+      }
+    }
+    else
+    {
+      for (; param; param = getNextParam(param))
+      {
+        if (!parseSyncEntry(&param, sync, error))
+        {
+          messageReplyF("'sync' must be followed by ip pairs. %s\n", error.c_str());
+          return;
+        }
+      }
+    }
+
+    intptr_t result;
+    if (!doBeaconOperation(&CommandProcessorImp::doHandleSyncProfiles, &sync, &result))
+      return;
+    for (size_t index = 0; index < sync.profileNames.size(); index++)
+    {
+      if (sync.profileIds[index] == Beacon::NoProfile)
+      {
+        messageReplyF("No profile named <%s>.\n", sync.profileNames[index].c_str());
+        return;
+      }
+    }
+    for (size_t index = 0; index < sync.entries.size(); index++)
+    {
+      if (sync.nameIndex[index] != UINT32_MAX)
+        sync.entries[index].profile = sync.profileIds[sync.nameIndex[index]];
+    }
+
+    sync.results.resize(sync.entries.size(), Beacon::SyncResult::NotOwned);
+    if (!doBeaconOperation(&CommandProcessorImp::doHandleSync, &sync, &result))
+      return;
+
+    for (size_t index = 0; index < sync.entries.size(); index++)
+    {
+      if (sync.results[index] == Beacon::SyncResult::Failed)
+        messageReplyF("Failed to sync connection from local %s to remote %s\n", sync.entries[index].localAddr.ToString(), sync.entries[index].remoteAddr.ToString());
+    }
+
+    const Beacon::SyncSummary &summary = sync.summary;
+    messageReplyF("Synced %zu sessions: created=%zu changed=%zu deleted=%zu unchanged=%zu failed=%zu\n",
+                  sync.entries.size(), summary.created, summary.changed, summary.deleted, summary.unchanged, summary.failed);
+  }
+
+  /**
+   * Parses an ip pair, and an optional 'profile' name, for "sync".
+   *
+   * @param inOutParam [in/out] - On success, points to the last parameter used.
+   *
+   * @return bool - false on failure, with errorMsg set.
+   */
+  bool parseSyncEntry(const char **inOutParam, SyncCommand &sync, string &errorMsg)
+  {
+    SessionID address;
+    const char *param = *inOutParam;
+
+    if (!paramToIpPair(&param, address, errorMsg))
+      return false;
+
+    Beacon::SyncEntry entry = { address.whichRemoteAddr, address.whichLocalAddr, Beacon::NoProfile};
+    uint32_t nameIndex = UINT32_MAX;
+    const char *next = getNextParam(param);
+    if (next && 0 == strcmp(next, "profile"))
+    {
+      const char *name = getNextParam(next);
+      if (!name || !isValidProfileName(name))
+      {
+        errorMsg = "'profile' must be followed by a profile name.";
+        return false;
+      }
+      vector<string>::iterator found = find(sync.profileNames.begin(), sync.profileNames.end(), name);
+      nameIndex = uint32_t(found - sync.profileNames.begin());
+      if (found == sync.profileNames.end())
+        sync.profileNames.push_back(name);
+      param = name;
+    }
+
+    sync.entries.push_back(entry);
+    sync.nameIndex.push_back(nameIndex);
+    *inOutParam = param;
+    return true;
+  }
+
+  /**
+   * Reads the sessions for 'sync file', one per line, in the same form as the
+   * command. Blank lines, and anything after a '#', are ignored.
+   *
+   * @return bool - false on failure. A reply has been sent.
+   */
+  bool readSyncFile(const char *path, SyncCommand &sync)
+  {
+    ifstream file(path);
+    string line;
+    vector<char> params;
+    string error;
+
+    if (!file.is_open())
+    {
+      messageReplyF("Failed to open file <%s> : %s\n", path, ErrnoToString());
+      return false;
+    }
+
+    for (int lineNumber = 1; getline(file, line); lineNumber++)
+    {
+      if (!lineToParams(line, params))
+        continue;
+
+      const char *param = &params.front();
+      if (!parseSyncEntry(&param, sync, error))
+      {
+        messageReplyF("Line %d of <%s>: %s\n", lineNumber, path, error.c_str());
+        return false;
+      }
+      if (getNextParam(param))
+      {
+        messageReplyF("Line %d of <%s>: Unexpected <%s> after the session.\n", lineNumber, path, getNextParam(param));
+        return false;
+      }
+    }
+
+    if (file.bad())
+    {
+      messageReplyF("Failed to read file <%s> : %s\n", path, ErrnoToString());
+      return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * Profile ids are the same on every shard, so each one gives the same ids.
+   */
+  intptr_t doHandleSyncProfiles(Beacon *beacon, void *userdata)
+  {
+    SyncCommand *sync = reinterpret_cast<SyncCommand *>(userdata);
+
+    sync->profileIds.resize(sync->profileNames.size());
+    for (size_t index = 0; index < sync->profileNames.size(); index++)
+      sync->profileIds[index] = beacon->FindProfile(sync->profileNames[index].c_str());
+    return 1;
+  }
+
+  intptr_t doHandleSync(Beacon *beacon, void *userdata)
+  {
+    SyncCommand *sync = reinterpret_cast<SyncCommand *>(userdata);
+
+    beacon->SyncSessions(sync->entries, sync->spreadUs, sync->results, sync->summary);
+    return 1;
+  }
+
+  /**
+   * "allow" command.
+   * Format 'allow' ip
+   */
+  void handle_Allow(const char *message)
+  {
+    Raii<CommandValue<IpAddr> >::Delete data(new CommandValue<IpAddr>);
+    IpAddr &address = data->value;
+    const char *addressString;
+
+    addressString = getNextParam(message);
+    if (!addressString)
+    {
+      messageReply("Must supply ip address.\n");
+      return;
+    }
+
+    if (!address.FromString(addressString))
+    {
+      messageReplyF("Invalid IPv4 or IPv6 address <%s>.\n", addressString);
+      return;
+    }
+
+    doBatchableOperation(&CommandProcessorImp::doHandleAllow, &CommandProcessorImp::replyAllow, data.Detach(), &address);
+  }
+
+  void replyAllow(void *userdata, intptr_t ATTR_UNUSED(result))
+  {
+    messageReplyF("Allowing connections from %s\n", reinterpret_cast<IpAddr *>(userdata)->ToString());
+  }
+
+  intptr_t doHandleAllow(Beacon *beacon, void *userdata)
+  {
+    IpAddr *addr = reinterpret_cast<IpAddr *>(userdata);
+    beacon->AllowPassiveIP(*addr);
+    return 0;
+  }
+
+
+  /**
+   * "block" command.
+   * Format 'block' ip
+   */
+  void handle_Block(const char *message)
+  {
+    Raii<CommandValue<IpAddr> >::Delete data(new CommandValue<IpAddr>);
+    IpAddr &address = data->value;
+    const char *addressString;
+
+    addressString = getNextParam(message);
+    if (!addressString)
+    {
+      messageReply("Must supply an IPv4 or IPv6 address.\n");
+      return;
+    }
+
+    if (!address.FromString(addressString))
+    {
+      messageReplyF("Invalid IPv4 or IPv6 address <%s>.\n", addressString);
+      return;
+    }
+
+    doBatchableOperation(&CommandProcessorImp::doHandleBlock, &CommandProcessorImp::replyBlock, data.Detach(), &address);
+  }
+
+  void replyBlock(void *userdata, intptr_t ATTR_UNUSED(result))
+  {
+    messageReplyF("Blocking connections from %s. This will not terminate any ongoing session.\n", reinterpret_cast<IpAddr *>(userdata)->ToString());
+  }
+
+  intptr_t doHandleBlock(Beacon *beacon, void *userdata)
+  {
+    IpAddr *addr = reinterpret_cast<IpAddr *>(userdata);
+    beacon->BlockPassiveIP(*addr);
+    return 0;
+  }
+
+  struct StatusInfo
+  {
+    uint32_t id;
+    uint32_t localDisc;
+    uint32_t remoteDisc;
+    IpAddr remoteAddress;
+    IpAddr localAddress;
+    bool isActiveSession; //active or passive role.
+    Session::ExtendedStateInfo extState;
+    std::string profile; // Only for level 4.
+    bool isProfileCurrent;
+    std::string authKey; // Only for level 4.
+  };
+
+  void fillSessionInfo(Beacon *beacon, Session *session, StatusInfo &outInfo, int level)
+  {
+    outInfo.id = session->GetId();
+    outInfo.remoteAddress =  session->GetRemoteAddress();
+    outInfo.localAddress = session->GetLocalAddress();
+    if (level >= 1)
+    {
+      outInfo.isActiveSession = session->IsActiveSession();
+      outInfo.localDisc = session->GetLocalDiscriminator();
+      outInfo.remoteDisc = session->GetRemoteDiscriminator();
+    }
+
+    if (level == 0)
+      outInfo.extState.localState = session->GetState();
+    else
+      session->GetExtendedState(outInfo.extState);
+
+    if (level >= 4)
+    {
+      outInfo.profile = beacon->GetSessionProfileName(session);
+      outInfo.isProfileCurrent = beacon->IsProfileCurrent(session);
+      outInfo.authKey = beacon->GetAuthKeyName(session->GetAuthKeyId());
+    }
+  }
+
+  /**
+   * Fills outInfo from published status. Only the items used up to
+   * MaxPublishedStatusLevel are filled.
+   */
+  void fillPublishedInfo(const SessionStatus &status, StatusInfo &outInfo)
+  {
+    outInfo.id = status.id;
+    outInfo.remoteAddress = status.GetRemoteAddress();
+    outInfo.localAddress = status.GetLocalAddress();
+    outInfo.isActiveSession = status.isActiveSession;
+    outInfo.localDisc = status.localDisc;
+    outInfo.remoteDisc = status.remoteDisc;
+    outInfo.extState.localState = status.localState;
+    outInfo.extState.localDiag = status.localDiag;
+    outInfo.extState.remoteState = status.remoteState;
+    outInfo.extState.remoteDiag = status.remoteDiag;
+    outInfo.extState.transmitInterval = status.transmitInterval;
+    outInfo.extState.detectionTime = status.detectionTime;
+    outInfo.extState.isHoldingState = status.isHoldingState;
+    outInfo.extState.isSuspended = status.isSuspended;
+    outInfo.extState.uptimeList.clear();
+    if (status.hasUptime)
+    {
+      Session::UptimeInfo uptime;
+      uptime.state = status.uptimeState;
+      uptime.forced = status.uptimeForced;
+      uptime.startTime = status.uptimeStart;
+      uptime.endTime = TimeSpec::MonoNow();
+      outInfo.extState.uptimeList.push_front(uptime);
+    }
+  }
+
+  // Above this level "status all" needs the full transition history, which is
+  // not published.
+  static const int MaxPublishedStatusLevel = 3;
+
+
+  /**
+   * prints the stats info for a session.
+   *
+   * @param info
+   * @param level
+   * @param brief [in]- use codes instead of descriptive text.
+   * @param compact [in]- true to print all info on one line.
+   */
+  void printStatusInfo(StatusInfo &info, int level, bool brief, bool compact)
+  {
+    const char *sep = compact ? "" : "\n ";
+    bool useCommas = !brief;
+
+    if (level < 1)
+    {
+      // Always brief and compact
+      messageReplyF(" id=%u %slocal=%s %sremote=%s %sstate=%s\n",
+                    info.id,
+                    sep,
+                    info.localAddress.ToString(),
+                    sep,
+                    info.remoteAddress.ToString(),
+                    sep,
+                    bfd::StateName(info.extState.localState));
+    }
+    else if (level == 1)
+    {
+      messageReplyF(" id=%u %slocal=%s %s %sremote=%s %sstate=%s%s %s\n",
+                    info.id,
+                    sep,
+                    info.localAddress.ToString(),
+                    info.isActiveSession ? "(a)" : "(p)",
+                    sep,
+                    info.remoteAddress.ToString(),
+                    sep,
+                    bfd::StateName(info.extState.localState),
+                    info.extState.isHoldingState ? "<Forced>" : "",
+                    info.extState.isSuspended ? "<Suspended>" : ""
+                   );
+    }
+    else if (level >= 2)
+    {
+
+      messageReplyF(" id=%u %slocal=%s %s %sremote=%s %sLocalState=%s<%s%s%s> %sRemoteState=%s<%s> %sLocalId=%u %sRemoteId=%u %s",
+                    info.id,
+                    sep,
+                    info.localAddress.ToString(),
+                    info.isActiveSession ? (brief ? "(a)" : "(active)") : (brief ? "(p)" : "(passive)"),
+                    sep,
+                    info.remoteAddress.ToString(),
+                    sep,
+                    bfd::StateName(info.extState.localState),
+                    info.extState.isHoldingState ? "Forced: " : "",
+                    info.extState.isSuspended ? "Suspended: " : "",
+                    brief ? ByteToString((uint8_t)info.extState.localDiag) : bfd::DiagString(info.extState.localDiag),
+                    sep,
+                    bfd::StateName(info.extState.remoteState),
+                    brief ? ByteToString((uint8_t)info.extState.remoteDiag) : bfd::DiagString(info.extState.remoteDiag),
+                    sep,
+                    info.localDisc,
+                    sep,
+                    info.remoteDisc,
+                    level > 2 ? sep : "\n"
+                   );
+    }
+
+    if (level >= 3)
+    {
+      // Already added all level 2 stuff
+      messageReplyF("Time=%s %sCurrentTxInterval=%s us %sCurrentRxTimeout=%s us %s",
+                    makeTimeString(level, info.extState.uptimeList),
+                    sep,
+                    FormatInteger(info.extState.transmitInterval, useCommas),
+                    sep,
+                    FormatInteger(info.extState.detectionTime, useCommas),
+                    level > 2 ? sep : "\n"
+                   );
+    }
+
+    if (level >= 4)
+    {
+      // Already added all level 3 stuff
+      messageReplyF("LocalDetectMulti=%hhu "
+                    "%sLocalDesiredMinTx=%s us %s%s"
+                    "%sLocalRequiredMinRx=%s us %s"
+                    "%sRemoteDetectMulti=%hhu "
+                    "%sRemoteDesiredMinTx=%s us "
+                    "%sRemoteRequiredMinRx=%s us "
+                    "%s",
+                    info.extState.detectMult,
+                    sep,
+                    FormatInteger(info.extState.useDesiredMinTxInterval, useCommas),
+                    (info.extState.desiredMinTxInterval == info.extState.useDesiredMinTxInterval)
+                    ? "" : FormatShortStr("(pending %s us) ", FormatInteger(info.extState.desiredMinTxInterval, useCommas)),
+                    (info.extState.desiredMinTxInterval == info.extState.defaultDesiredMinTxInterval)
+                    ? "" : FormatShortStr("(def %s us) ", FormatInteger(info.extState.defaultDesiredMinTxInterval, useCommas)),
+                    sep,
+                    FormatInteger(info.extState.useRequiredMinRxInterval, useCommas),
+                    (info.extState.requiredMinRxInterval == info.extState.useRequiredMinRxInterval)
+                    ? "" : FormatShortStr("(pending %s us) ", FormatInteger(info.extState.requiredMinRxInterval, useCommas)),
+                    sep,
+                    info.extState.remoteDetectMult,
+                    sep,
+                    FormatInteger(info.extState.remoteDesiredMinTxInterval, useCommas),
+                    sep,
+                    FormatInteger(info.extState.remoteMinRxInterval, useCommas),
+                    "\n"
+                   );
+
+      Session::Counters &counters = info.extState.counters;
+      messageReplyF(" Received=%s %sSent=%s %sDiscarded=%s %sStateChanges=%s %sPollSequences=%s\n",
+                    FormatInteger(counters.received, useCommas),
+                    sep,
+                    FormatInteger(counters.sent, useCommas),
+                    sep,
+                    FormatInteger(counters.discarded, useCommas),
+                    sep,
+                    FormatInteger(counters.stateChanges, useCommas),
+                    sep,
+                    FormatInteger(counters.pollSequences, useCommas)
+                   );
+      if (info.extState.isLowPriority)
+        messageReplyF(" Priority=low %sBackoff=%s\n", sep,
+                      info.extState.backoffInterval ? FormatShortStr("%s us", FormatInteger(info.extState.backoffInterval, useCommas)) : "none");
+      if (info.extState.desiredMinEchoTxInterval != 0 || info.extState.remoteMinEchoRxInterval != 0)
+        messageReplyF(" Echo=%s %sLocalDesiredMinEchoTx=%s us %sRemoteRequiredMinEchoRx=%s us %sEchoSent=%s %sEchoReceived=%s\n",
+                      info.extState.isEchoUnanswered ? "unanswered" : !info.extState.isEchoActive ? "inactive" : info.extState.isEchoConfirmed ? "active" : "starting",
+                      sep,
+                      FormatInteger(info.extState.desiredMinEchoTxInterval, useCommas),
+                      sep,
+                      FormatInteger(info.extState.remoteMinEchoRxInterval, useCommas),
+                      sep,
+                      FormatInteger(counters.echoSent, useCommas),
+                      sep,
+                      FormatInteger(counters.echoReceived, useCommas));
+      if (info.extState.demandMode || info.extState.isRemoteDemandActive)
+        messageReplyF(" Demand=%s %sRemoteDemand=%s\n",
+                      info.extState.isDemandActive ? "active" : (info.extState.demandMode ? "inactive" : "off"),
+                      sep,
+                      info.extState.isRemoteDemandActive ? "active" : "inactive");
+      if (info.profile != Beacon::DefaultProfileName || !info.isProfileCurrent)
+        messageReplyF(" Profile=%s%s\n", info.profile.c_str(), info.isProfileCurrent ? "" : " (updating)");
+      if (info.extState.authType != bfd::AuthType::None)
+        messageReplyF(" Auth=%s %sAuthKey=%s\n", bfd::AuthTypeName(info.extState.authType), sep, info.authKey.c_str());
+    }
+  }
+
+
+  /**
+   * Helper for printStatusInfo.
+   *
+   * @param level
+   * @param uptimeList
+   *
+   * @return const char* - In the big tls buffer, so use it before the next
+   *         FormatBigStr() or similar call.
+   */
+  const char* makeTimeString(int level, const Session::UptimeHistory &uptimeList)
+  {
+    char *buf;
+    size_t bufSize = GetBigTLSBuffer(&buf);
+    if (bufSize == 0)
+      return "";
+    buf[0] = '\0';
+
+    if (!LogVerify(uptimeList.size() != 0))
+      return buf;
+
+    // Always add most recent time.
+    size_t count = (level > 3) ? uptimeList.size() : 1;
+    size_t length = 0;
+    for (size_t index = 0; index < count; index++)
+      length += addTimeString(buf + length, bufSize - length, uptimeList[index]);
+    return buf;
+  }
+
+  /**
+   *  Helper for makeTimeString. Adds single time info.
+   *
+   * @param outStr [out] - Always null terminated.
+   * @param outStrSize [in] - The space at outStr.
+   * @param uptime
+   *
+   * @return size_t - The length added. Less than outStrSize.
+   */
+  static size_t addTimeString(char *outStr, size_t outStrSize, const Session::UptimeInfo &uptime)
+  {
+    TimeSpec elapsed = uptime.endTime - uptime.startTime;
+
+    int length = snprintf(outStr, outStrSize, "%s%s(%02u:%02u:%06.3f) ",
+                          bfd::StateName(uptime.state),
+                          uptime.forced ? "/F" : "",
+                          uint32_t(elapsed.tv_sec / 3600),
+                          uint32_t(elapsed.tv_sec / 60),
+                          double(elapsed.tv_sec % 60) + double(elapsed.tv_nsec) / 1000000000L);
+    if (length < 0)
+      return 0;
+    return std::min(size_t(length), outStrSize - 1);
+  }
+
+  struct SingleStatusCallbackInfo
+  {
+    int level;
+    SessionID sessionId;
+    StatusInfo info;
+  };
+
+
+  /**
+   * @return intptr_t - false if the session can not be located.
+   */
+  intptr_t doHandleSingleStatus(Beacon *beacon, void *userdata)
+  {
+    SingleStatusCallbackInfo *opInfo = reinterpret_cast<SingleStatusCallbackInfo *>(userdata);
+    Session *session = findSession(beacon, opInfo->sessionId);
+    if (!session)
+      return 0;
+    fillSessionInfo(beacon, session, opInfo->info, opInfo->level);
+    return 1;
+  }
+
+  struct MultiStatusCallbackInfo
+  {
+    int level;
+    vector<StatusInfo> infoList;
+  };
+
+
+  intptr_t doHandleMultiStatus(Beacon *beacon, void *userdata)
+  {
+    vector<uint32_t>::iterator idIt;
+    vector<uint32_t> ids;
+    MultiStatusCallbackInfo *opInfo = reinterpret_cast<MultiStatusCallbackInfo *>(userdata);
+    vector<StatusInfo> *infoList = &opInfo->infoList;
+    StatusInfo info;
+    Session *session;
+
+    // This stops each scheduler while it copies every session, so handle_Status
+    // uses it only when the published status is not enough.
+
+    // Called for each shard, so add to the list.
+    beacon->GetSessionIdList(ids);
+    infoList->reserve(infoList->size() + ids.size());
+    for (idIt = ids.begin(); idIt != ids.end(); idIt++)
+    {
+      session = beacon->FindSessionId(*idIt);
+      if (!session)
+      {
+        LogAssertFalse("No matching session for Id.");
+        continue;
+      }
+      fillSessionInfo(beacon, session, info, opInfo->level);
+      infoList->push_back(info);
+    }
+    return 0;
+  }
+
+  /**
+   * Fills info.infoList from the published session status, without stopping
+   * the schedulers.
+   *
+   * @return bool - false if the published status can not be used.
+   */
+  bool getPublishedStatus(MultiStatusCallbackInfo &info)
+  {
+    vector<SessionStatus> statusList;
+    vector<SessionStatus>::iterator it;
+
+    if (info.level > MaxPublishedStatusLevel)
+      return false;
+
+    if (!m_beacon->GetSessionStatusList(statusList))
+    {
+      gLog.Optional(Log::Command, "Published status incomplete, gathering from the schedulers.");
+      return false;
+    }
+
+    info.infoList.resize(statusList.size());
+    for (size_t index = 0; index < statusList.size(); index++)
+      fillPublishedInfo(statusList[index], info.infoList[index]);
+    return true;
+  }
+
+  struct StatusFormat
+  {
+    enum Value
+    {
+      Text,
+      Json,   // One JSON object per line.
+      Binary  // StatusRecord.h
+    };
+  };
+
+  struct StatusStreamInfo
+  {
+    CommandProcessorImp *processor;
+    StatusFormat::Value format;
+    uint32_t count;
+    TimeSpec now;
+  };
+
+  /**
+   * Converts status gathered on the scheduler to published form. info must
+   * have been filled at MaxPublishedStatusLevel.
+   */
+  static void statusInfoToPublished(StatusInfo &info, SessionStatus &outStatus)
+  {
+    outStatus.Clear();
+    outStatus.id = info.id;
+    outStatus.localDisc = info.localDisc;
+    outStatus.remoteDisc = info.remoteDisc;
+    outStatus.SetRemoteAddress(info.remoteAddress);
+    outStatus.SetLocalAddress(info.localAddress);
+    outStatus.isActiveSession = info.isActiveSession;
+    outStatus.isHoldingState = info.extState.isHoldingState;
+    outStatus.isSuspended = info.extState.isSuspended;
+    outStatus.localState = info.extState.localState;
+    outStatus.localDiag = info.extState.localDiag;
+    outStatus.remoteState = info.extState.remoteState;
+    outStatus.remoteDiag = info.extState.remoteDiag;
+    outStatus.transmitInterval = info.extState.transmitInterval;
+    outStatus.detectionTime = info.extState.detectionTime;
+    if (!info.extState.uptimeList.empty())
+    {
+      Session::UptimeInfo &uptime = info.extState.uptimeList.front();
+      outStatus.hasUptime = true;
+      outStatus.uptimeState = uptime.state;
+      outStatus.uptimeForced = uptime.forced;
+      outStatus.uptimeStart = uptime.startTime;
+    }
+  }
+
+  /**
+   * Copies the address for a StatusSessionRecord.
+   *
+   * @return uint8_t - The family, 4 or 6.
+   */
+  static uint8_t copyRecordAddress(uint8_t *outAddr, const SessionStatus::Address &addr)
+  {
+    if (addr.sa.sa_family == AF_INET6)
+    {
+      memcpy(outAddr, &addr.in6.sin6_addr, 16);
+      return 6;
+    }
+    memcpy(outAddr, &addr.in4.sin_addr, 4);
+    return 4;
+  }
+
+  static uint64_t uptimeMs(const SessionStatus &status, const TimeSpec &now)
+  {
+    if (!status.hasUptime)
+      return 0;
+    TimeSpec elapsed = now - TimeSpec(status.uptimeStart);
+    if (elapsed.IsNegative())
+      return 0;
+    return uint64_t(elapsed.tv_sec) * 1000 + uint64_t(elapsed.tv_nsec) / 1000000;
+  }
+
+  /**
+   * Adds a single session to a machine readable status reply.
+   */
+  static void streamSessionStatus(const SessionStatus &status, void *userdata)
+  {
+    StatusStreamInfo *stream = reinterpret_cast<StatusStreamInfo *>(userdata);
+    CommandProcessorImp *me = stream->processor;
+    uint64_t uptime = uptimeMs(status, stream->now);
+
+    stream->count++;
+
+    if (stream->format == StatusFormat::Binary)
+    {
+      StatusSessionRecord record;
+      uint8_t flags = 0;
+
+      memset(&record, 0, sizeof(record));
+      record.header.length = htons(sizeof(record));
+      record.header.type = StatusRecordType::Session;
+      record.header.version = StatusRecordVersion;
+      record.id = htonl(status.id);
+      record.localDisc = htonl(status.localDisc);
+      record.remoteDisc = htonl(status.remoteDisc);
+      record.localState = uint8_t(status.localState);
+      record.localDiag = uint8_t(status.localDiag);
+      record.remoteState = uint8_t(status.remoteState);
+      record.remoteDiag = uint8_t(status.remoteDiag);
+      if (status.isActiveSession)
+        flags |= StatusSessionRecord::Flag::Active;
+      if (status.isHoldingState)
+        flags |= StatusSessionRecord::Flag::HoldingState;
+      if (status.isSuspended)
+        flags |= StatusSessionRecord::Flag::Suspended;
+      if (status.hasUptime)
+      {
+        flags |= StatusSessionRecord::Flag::HasUptime;
+        if (status.uptimeForced)
+          flags |= StatusSessionRecord::Flag::UptimeForced;
+        record.uptimeState = uint8_t(status.uptimeState);
+      }
+      record.flags = flags;
+      record.localFamily = copyRecordAddress(record.localAddr, status.localAddress);
+      record.remoteFamily = copyRecordAddress(record.remoteAddr, status.remoteAddress);
+      record.transmitInterval = htonl(status.transmitInterval);
+      record.detectionTimeHi = htonl(uint32_t(status.detectionTime >> 32));
+      record.detectionTimeLo = htonl(uint32_t(status.detectionTime));
+      record.uptimeMsHi = htonl(uint32_t(uptime >> 32));
+      record.uptimeMsLo = htonl(uint32_t(uptime));
+      me->streamReply(&record, sizeof(record));
+    }
+    else
+    {
+      me->streamReplyF("{\"id\":%u,\"local\":\"%s\",\"remote\":\"%s\",\"active\":%s,"
+                       "\"state\":\"%s\",\"diag\":%u,\"remoteState\":\"%s\",\"remoteDiag\":%u,"
+                       "\"localId\":%u,\"remoteId\":%u,\"forced\":%s,\"suspended\":%s,"
+                       "\"txInterval\":%u,\"rxTimeout\":%" PRIu64 ",\"uptimeState\":\"%s\",\"uptimeMs\":%" PRIu64 "}\n",
+                       status.id,
+                       status.GetLocalAddress().ToString(),
+                       status.GetRemoteAddress().ToString(),
+                       status.isActiveSession ? "true" : "false",
+                       bfd::StateName(status.localState),
+                       unsigned(status.localDiag),
+                       bfd::StateName(status.remoteState),
+                       unsigned(status.remoteDiag),
+                       status.localDisc,
+                       status.remoteDisc,
+                       status.isHoldingState ? "true" : "false",
+                       status.isSuspended ? "true" : "false",
+                       status.transmitInterval,
+                       status.detectionTime,
+                       status.hasUptime ? bfd::StateName(status.uptimeState) : "",
+                       uptime);
+    }
+  }
+
+  /**
+   * Ends a machine readable status reply.
+   */
+  void streamStatusEnd(StatusStreamInfo &stream)
+  {
+    if (stream.format == StatusFormat::Binary)
+    {
+      StatusEndRecord record;
+      memset(&record, 0, sizeof(record));
+      record.header.length = htons(sizeof(record));
+      record.header.type = StatusRecordType::End;
+      record.header.version = StatusRecordVersion;
+      record.sessionCount = htonl(stream.count);
+      streamReply(&record, sizeof(record));
+    }
+    else
+      streamReplyF("{\"sessions\":%u}\n", stream.count);
+  }
+
+  /**
+   * Sends status in a machine readable format. For all sessions this reads
+   * the published status as it is sent, so nothing is gathered first, and the
+   * schedulers are not stopped.
+   *
+   * Errors are replied as text.
+   */
+  void streamStatus(const SessionID &sessionId, StatusFormat::Value format)
+  {
+    StatusStreamInfo stream;
+    SessionStatus status;
+
+    stream.processor = this;
+    stream.format = format;
+    stream.count = 0;
+
+    if (sessionId.allSessions && m_beacon->IsSessionStatusComplete())
+    {
+      beginStreamReply();
+      stream.now = TimeSpec::MonoNow();
+      m_beacon->VisitSessionStatus(streamSessionStatus, &stream);
+    }
+    else if (sessionId.allSessions)
+    {
+      MultiStatusCallbackInfo info;
+      info.level = MaxPublishedStatusLevel;
+
+      gLog.Optional(Log::Command, "Published status incomplete, gathering from the schedulers.");
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleMultiStatus, &info))
+        return;
+      beginStreamReply();
+      stream.now = TimeSpec::MonoNow();
+      for (vector<StatusInfo>::iterator it = info.infoList.begin(); it != info.infoList.end(); it++)
+      {
+        statusInfoToPublished(*it, status);
+        streamSessionStatus(status, &stream);
+      }
+    }
+    else
+    {
+      intptr_t result;
+      SingleStatusCallbackInfo info;
+      info.level = MaxPublishedStatusLevel;
+      info.sessionId = sessionId;
+
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleSingleStatus, &info, &result))
+        return;
+      if (!result)
+      {
+        reportNoSuchSession(info.sessionId);
+        return;
+      }
+      beginStreamReply();
+      stream.now = TimeSpec::MonoNow();
+      statusInfoToPublished(info.info, status);
+      streamSessionStatus(status, &stream);
+    }
+
+    streamStatusEnd(stream);
+    endStreamReply();
+  }
+
+  void handle_Status(const char *message)
+  {
+    const char *whichString, *nextString;
+    int level = 1;
+    bool brief = false;
+    bool compact = false;
+    StatusFormat::Value format = StatusFormat::Text;
+    SessionID sessionId;
+
+    whichString = getNextParam(message);
+    if (!whichString)
+    {
+      sessionId.allSessions = true;
+      compact = true;
+    }
+    else
+    {
+      string error;
+
+      if (!paramToIdOrIp(&whichString, sessionId, error))
+      {
+        messageReplyF("Must supply 'all', session id or 'remote ip local ip' before other settings. %s\n", error.c_str());
+        return;
+      }
+
+      nextString = getNextParam(whichString);
+
+      while (nextString)
+      {
+        if (0 == strcmp("brief",  nextString))
+          brief = true;
+        else if (0 == strcmp("compact",  nextString))
+          compact = true;
+        else if (0 == strcmp("nocompact",  nextString))
+          compact = false;
+        else if (0 == strcmp("json",  nextString))
+          format = StatusFormat::Json;
+        else if (0 == strcmp("binary",  nextString))
+          format = StatusFormat::Binary;
+        else if (0 == strcmp("level",  nextString))
+        {
+          int64_t val;
+          nextString = getNextParam(nextString);
+          if (!nextString)
+          {
+            messageReplyF("level must be followed by an integer.\n");
+            return;
+          }
+          if (!StringToInt(nextString, val))
+          {
+            messageReplyF("level value must be an integer : <%s>.\n", nextString);
+            return;
+          }
+          level = (int)val;
+        }
+        else
+        {
+          messageReplyF("Unrecognized  status setting <%s>.\n", nextString);
+          return;
+        }
+        nextString = getNextParam(nextString);
+      }
+    }
+
+    if (format != StatusFormat::Text)
+    {
+      streamStatus(sessionId, format);
+      return;
+    }
+
+    if (sessionId.allSessions)
+    {
+      MultiStatusCallbackInfo info;
+      info.level = level;
+
+      if (getPublishedStatus(info) || doBeaconOperation(&CommandProcessorImp::doHandleMultiStatus, &info))
+      {
+        vector<StatusInfo>::iterator it;
+        messageReplyF("There are %zu sessions:\n", info.infoList.size());
+        for (it = info.infoList.begin(); it != info.infoList.end(); it++)
+        {
+          if (!compact && it != info.infoList.begin())
+          {
+            messageReplyF("\nSession %u\n", it->id);
+          }
+          else
+            messageReplyF("Session %u\n", it->id);
+          printStatusInfo(*it, level, brief, compact);
+        }
+      }
+    }
+    else
+    {
+      intptr_t result;
+      SingleStatusCallbackInfo info;
+      info.level = level;
+      info.sessionId = sessionId;
+
+      if (doBeaconOperation(&CommandProcessorImp::doHandleSingleStatus, &info, &result))
+      {
+        if (result)
+        {
+          printStatusInfo(info.info, level, brief, compact);
+        }
+        else
+        {
+          reportNoSuchSession(info.sessionId);
+          return;
+        }
+      }
+    }
+  }
+
+
+  struct SessionCallbackInfo
+  {
+    enum Action
+    {
+      State,
+      Kill,
+      Reset,
+      Suspend,
+      Resume,
+      Poll,
+      SetMulti,
+      SetMinTx,
+      SetMinRx,
+      SetCPI,
+      SetAdminUpPoll,
+      SetPriority,
+      SetEcho,
+      SetDemand,
+      SetProfile,
+      SetAuth
+    };
+
+    SessionID sessionId;
+    bool defSetting; // if true then sessionId is not used
+    Action action;
+    bfd::State::Value state;
+    uint32_t setValue;
+    std::string profile; // For SetProfile
+    std::string authKey; // For SetAuth. "none" for no authentication.
+  };
+
+  // doHandleSession() result when SessionCallbackInfo::profile does not exist.
+  static const intptr_t NoSuchProfile = -1;
+  // Result when SessionCallbackInfo::authKey does not exist.
+  static const intptr_t NoSuchAuthKey = -2;
+
+  /**
+   * For SetAuth, sets info.setValue to the shard's id for info.authKey.
+   *
+   * @return bool - false if there is no such key.
+   */
+  static bool resolveAuthKey(Beacon *beacon, SessionCallbackInfo &info)
+  {
+    if (info.action != SessionCallbackInfo::SetAuth)
+      return true;
+    if (info.authKey == "none")
+      info.setValue = Beacon::NoAuthKey;
+    else
+      info.setValue = beacon->FindAuthKey(info.authKey.c_str());
+    return info.setValue != Beacon::NoAuthKey || info.authKey == "none";
+  }
+
+  /**
+   * Changes the item in params that a "session set" would change.
+   *
+   * @return bool - false for an item that is not a session setting.
+   */
+  static bool applySessionSetting(const SessionCallbackInfo &info, Session::InitialParams &params)
+  {
+    if (info.action == SessionCallbackInfo::SetMulti)
+      params.detectMulti = uint8_t(info.setValue);
+    else if (info.action == SessionCallbackInfo::SetMinTx)
+      params.desiredMinTx = info.setValue;
+    else if (info.action == SessionCallbackInfo::SetMinRx)
+      params.requiredMinRx = info.setValue;
+    else if (info.action == SessionCallbackInfo::SetCPI)
+      params.controlPlaneIndependent = bool(info.setValue);
+    else if (info.action == SessionCallbackInfo::SetAdminUpPoll)
+      params.adminUpPollWorkaround = bool(info.setValue);
+    else if (info.action == SessionCallbackInfo::SetPriority)
+      params.lowPriority = bool(info.setValue);
+    else if (info.action == SessionCallbackInfo::SetEcho)
+      params.echoInterval = info.setValue;
+    else if (info.action == SessionCallbackInfo::SetDemand)
+      params.demandMode = bool(info.setValue);
+    else if (info.action == SessionCallbackInfo::SetAuth)
+      params.authKey = info.setValue; // See resolveAuthKey().
+    else
+      return false;
+    return true;
+  }
+
+  /**
+   *
+   *
+   * @param beacon
+   * @param userdata
+   *
+   * @return intptr_t - false if the session can not be located.
+   */
+  intptr_t doHandleSession(Beacon *beacon, void *userdata)
+  {
+    vector<uint32_t> ids;
+    vector<uint32_t>::iterator idIt;
+    SessionCallbackInfo *info = reinterpret_cast<SessionCallbackInfo *>(userdata);
+
+    if (!resolveAuthKey(beacon, *info))
+      return NoSuchAuthKey;
+
+    if (info->defSetting)
+    {
+      // Default settings .. we do not need a session.
+      if (info->action == SessionCallbackInfo::SetMulti)
+        beacon->SetDefMulti(uint8_t(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetMinTx)
+        beacon->SetDefMinTxInterval(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetMinRx)
+        beacon->SetDefMinRxInterval(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetCPI)
+        beacon->SetDefControlPlaneIndependent(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetAdminUpPoll)
+        beacon->SetDefAdminUpPollWorkaround(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetPriority)
+        beacon->SetDefLowPriority(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetEcho)
+        beacon->SetDefEchoInterval(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetDemand)
+        beacon->SetDefDemandMode(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetAuth)
+        beacon->SetDefAuthKey(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetProfile)
+      {
+        if (!beacon->SetNewSessionProfile(beacon->FindProfile(info->profile.c_str())))
+          return NoSuchProfile;
+      }
+      else
+      {
+        LogAssertFalse("Incorrect default action in doHandleSession");
+      }
+      return 1;
+    }
+
+
+    if (!findSessionIdList(beacon, info->sessionId, ids))
+      return 0;
+
+    uint32_t profileId = Beacon::NoProfile;
+    if (info->action == SessionCallbackInfo::SetProfile)
+    {
+      profileId = beacon->FindProfile(info->profile.c_str());
+      if (profileId == Beacon::NoProfile)
+        return NoSuchProfile;
+    }
+
+    for (idIt = ids.begin(); idIt != ids.end(); idIt++)
+    {
+      Session *session = beacon->FindSessionId(*idIt);
+      if (!session)
+      {
+        LogAssertFalse("No matching session for Id.");
+        continue;
+      }
+
+      if (info->action == SessionCallbackInfo::State)
+      {
+        if (info->state == bfd::State::Down)
+          session->ForceDown(bfd::Diag::Value(info->setValue));
+        else if (info->state == bfd::State::AdminDown)
+          session->ForceAdminDown(bfd::Diag::Value(info->setValue));
+        else if (info->state == bfd::State::Up)
+          session->AllowStateChanges();
+        else
+        {
+          LogAssertFalse("Incorrect state in doHandleSession");
+        }
+      }
+      else if (info->action == SessionCallbackInfo::Kill)
+      {
+        beacon->KillSession(session);
+        session = NULL; // warning session now invalid
+      }
+      else if (info->action == SessionCallbackInfo::Reset)
+      {
+        bool active = session->IsActiveSession();
+        IpAddr remoteAddr = session->GetRemoteAddress();
+        IpAddr localAddr = session->GetLocalAddress();
+
+        beacon->KillSession(session);
+        session = NULL; // warning session now invalid
+        gLog.Optional(Log::SessionDetail, "Reset session id=%u for local %s to remote %s.", *idIt, localAddr.ToString(), remoteAddr.ToString());
+        if (active)
+          beacon->StartActiveSession(remoteAddr, localAddr);
+      }
+      else if (info->action == SessionCallbackInfo::Suspend)
+        session->SetSuspend(true);
+      else if (info->action == SessionCallbackInfo::Resume)
+        session->SetSuspend(false);
+      else if (info->action == SessionCallbackInfo::Poll)
+      {
+        if (!session->RequestPoll())
+          gLog.Optional(Log::Command, "Session id=%u is not Up, so not polled.", *idIt);
+      }
+      else if (info->action == SessionCallbackInfo::SetMulti)
+        session->SetMulti(uint8_t(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetMinTx)
+        session->SetMinTxInterval(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetMinRx)
+        session->SetMinRxInterval(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetCPI)
+        session->SetControlPlaneIndependent(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetAdminUpPoll)
+        session->SetAdminUpPollWorkaround(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetPriority)
+        session->SetLowPriority(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetEcho)
+        session->SetEchoInterval(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetDemand)
+        session->SetDemandMode(bool(info->setValue));
+      else if (info->action == SessionCallbackInfo::SetAuth)
+        session->SetAuthKey(info->setValue);
+      else if (info->action == SessionCallbackInfo::SetProfile)
+        beacon->SetSessionProfile(session, profileId);
+      else
+      {
+        LogAssertFalse("Incorrect action in doHandleSession");
+      }
+    }
+
+    return 1;
+  }
+
+  /**
+   * Parses two message parameters that represent a time value.
+   * Will put up an error message if no time specifier is found.
+   *
+   * @param valueString - The message parameter for the integer part of the time.
+   * @param outTime - The result in microseconds.
+   * @param notIntReply - The message used if value is not an int. Use %s for the
+   *                    value that was given.
+   *
+   * @return bool - false on failure.
+   */
+  bool parseTimeValue(const char *valueString, uint32_t &outMicroTime, const char *notIntReply)
+  {
+    int64_t value;
+    const char *unitString;
+    static const char *unitvalues = "'s', 'ms' or 'us'";
+
+    if (!valueString)
+    {
+      messageReplyF(notIntReply, "none");
+      return false;
+    }
+
+
+    if (!StringToInt(valueString, value))
+    {
+      messageReplyF(notIntReply, valueString);
+      return false;
+    }
+
+    if (value < 0)
+    {
+      messageReply("Negative values not allowed\n");
+      return false;
+    }
+
+    unitString = getNextParam(valueString);
+    if (!unitString)
+    {
+      messageReplyF("Must supply a unit after the value %s: %s\n", valueString, unitvalues);
+      return false;
+    }
+    if (0 == strcmp(unitString,  "s"))
+    {
+      if (value > UINT32_MAX / 1000000U)
+      {
+        messageReplyF("Value <%s> seconds is too large to be converted to microseconds.\n", valueString);
+        return false;
+      }
+      outMicroTime = (uint32_t)(value * 1000000U);
+      return true;
+    }
+    else if (0 == strcmp(unitString,  "ms"))
+    {
+      if (value > UINT32_MAX / 1000U)
+      {
+        messageReplyF("Value <%s> milliseconds is too large to be converted to microseconds.\n", valueString);
+        return false;
+      }
+      outMicroTime = (uint32_t)(value * 1000U);
+      return true;
+    }
+    else if (0 == strcmp(unitString,  "us"))
+    {
+      if (value > UINT32_MAX)
+      {
+        messageReplyF("Value <%s> microseconds is too large.\n", valueString);
+        return false;
+      }
+      outMicroTime = (uint32_t)(value);
+      return true;
+    }
+
+    messageReplyF("Unknown unit <%s>. Use: %s\n", unitString, unitvalues);
+    return false;
+  }
+
+
+
+  /**
+   * Helper for handle_Session when action is "set"
+   *
+   * @param setting
+   * @param info [out] - filled on success.
+   *
+   * @return bool - false on parse failure.
+   */
+  bool getSessionSetParams(const char *setting, SessionCallbackInfo &info)
+  {
+    static const char *commands = "'mintx', 'minrx', 'multi', 'cpi', 'admin_up_poll', 'priority', 'echo', 'demand', 'auth' or 'profile'";
+    const char *valueString;
+
+    if (!setting)
+    {
+      messageReplyF("Must supply item to set: %s.\n", commands);
+      return false;
+    }
+
+    else if (0 == strcmp(setting, "mintx"))
+    {
+      info.action = SessionCallbackInfo::SetMinTx;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply value for 'set mintx'.\n");
+        return false;
+      }
+      if (!parseTimeValue(valueString, info.setValue, "'set mintx' value must be an integer followed by time unit : <%s>.\n"))
+        return false;
+
+      if (info.setValue == 0)
+      {
+        messageReply("'set mintx' value can not be 0.\n");
+        return false;
+      }
+      messageReplyF("Attempting to set mintx to %s us.\n", FormatInteger(info.setValue));
+      return true;
+    }
+    else if (0 == strcmp(setting, "minrx"))
+    {
+      info.action = SessionCallbackInfo::SetMinRx;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply value for 'set minrx'.\n");
+        return false;
+      }
+      if (!parseTimeValue(valueString, info.setValue, "'set minrx' value must be an integer followed by time unit : <%s>.\n"))
+        return false;
+      messageReplyF("Attempting to set minrx to %s us.\n", FormatInteger(info.setValue));
+      return true;
+    }
+    else if (0 == strcmp(setting, "multi"))
+    {
+      int64_t val64;
+
+      info.action = SessionCallbackInfo::SetMulti;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply value for 'set multi'.\n");
+        return false;
+      }
+      if (!StringToInt(valueString, val64))
+      {
+        messageReply("Must supply an non-zero integer value for 'set multi'.\n");
+        return false;
+      }
+
+      if (val64 > UINT8_MAX)
+      {
+        messageReply("Value for 'set multi is too large..\n");
+      }
+      else if (val64 == 0)
+      {
+        messageReply("'set multi' value can not be 0.\n");
+        return false;
+      }
+      info.setValue = uint32_t(val64);
+      messageReplyF("Attempting to set multi to %u.\n", info.setValue);
+      return true;
+    }
+    else if (0 == strcmp(setting, "cpi"))
+    {
+      info.action = SessionCallbackInfo::SetCPI;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply 'yes' or 'no' for 'set cpi'.\n");
+        return false;
+      }
+      if (0 == strcmp(valueString,  "yes"))
+        info.setValue = true;
+      else if (0 == strcmp(valueString,  "no"))
+        info.setValue = false;
+      else
+      {
+        messageReplyF("Must supply 'yes' or 'no' for 'set cpi'. Unknown value <%s>.\n", valueString);
+        return false;
+      }
+      messageReplyF("Attempting to set control plane independent (C) bit to %s.\n", valueString);
+      return true;
+    }
+    else if (0 == strcmp(setting, "admin_up_poll"))
+    {
+      info.action = SessionCallbackInfo::SetAdminUpPoll;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply 'yes' or 'no' for 'set admin_up_poll'.\n");
+        return false;
+      }
+      if (0 == strcmp(valueString,  "yes"))
+        info.setValue = true;
+      else if (0 == strcmp(valueString,  "no"))
+        info.setValue = false;
+      else
+      {
+        messageReplyF("Must supply 'yes' or 'no' for 'set admin_up_poll'. Unknown value <%s>.\n", valueString);
+        return false;
+      }
+      messageReplyF("Attempting to %s admin_up_poll workaround.\n", info.setValue ? "enable" : "disable");
+      return true;
+    }
+    else if (0 == strcmp(setting, "priority"))
+    {
+      info.action = SessionCallbackInfo::SetPriority;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply 'low' or 'normal' for 'set priority'.\n");
+        return false;
+      }
+      if (0 == strcmp(valueString,  "low"))
+        info.setValue = true;
+      else if (0 == strcmp(valueString,  "normal"))
+        info.setValue = false;
+      else
+      {
+        messageReplyF("Must supply 'low' or 'normal' for 'set priority'. Unknown value <%s>.\n", valueString);
+        return false;
+      }
+      messageReplyF("Attempting to set priority to %s.\n", valueString);
+      return true;
+    }
+    else if (0 == strcmp(setting, "echo"))
+    {
+      info.action = SessionCallbackInfo::SetEcho;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply value for 'set echo'.\n");
+        return false;
+      }
+      if (!parseTimeValue(valueString, info.setValue, "'set echo' value must be an integer followed by time unit : <%s>.\n"))
+        return false;
+      if (info.setValue == 0)
+        messageReply("Attempting to disable echo.\n");
+      else
+        messageReplyF("Attempting to set echo to %s us.\n", FormatInteger(info.setValue));
+      return true;
+    }
+    else if (0 == strcmp(setting, "demand"))
+    {
+      info.action = SessionCallbackInfo::SetDemand;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply 'yes' or 'no' for 'set demand'.\n");
+        return false;
+      }
+      if (0 == strcmp(valueString,  "yes"))
+        info.setValue = true;
+      else if (0 == strcmp(valueString,  "no"))
+        info.setValue = false;
+      else
+      {
+        messageReplyF("Must supply 'yes' or 'no' for 'set demand'. Unknown value <%s>.\n", valueString);
+        return false;
+      }
+      messageReplyF("Attempting to %s demand mode.\n", info.setValue ? "enable" : "disable");
+      return true;
+    }
+    else if (0 == strcmp(setting, "profile"))
+    {
+      info.action = SessionCallbackInfo::SetProfile;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply profile name for 'set profile'.\n");
+        return false;
+      }
+      info.profile = valueString;
+      messageReplyF("Attempting to set profile to %s.\n", valueString);
+      return true;
+    }
+    else if (0 == strcmp(setting, "auth"))
+    {
+      info.action = SessionCallbackInfo::SetAuth;
+      valueString = getNextParam(setting);
+      if (!valueString)
+      {
+        messageReply("Must supply key name, or 'none', for 'set auth'.\n");
+        return false;
+      }
+      info.authKey = valueString;
+      if (info.authKey == "none")
+        messageReply("Attempting to disable authentication.\n");
+      else
+        messageReplyF("Attempting to set authentication key to %s.\n", valueString);
+      return true;
+    }
+    else
+    {
+      messageReplyF("Unrecognized item to set <%s> use %s.\n", setting, commands);
+      return false;
+    }
+  }
+
+  /**
+   * Helper for handle_Session when action is "state"
+   *
+   * @param setting
+   * @param info [out] - filled on success.
+   *
+   * @return bool - false on parse failure.
+   */
+  bool getSessionStateParams(const char *setting, SessionCallbackInfo &info)
+  {
+    static const char *commands = "'up', 'admin', or 'down'";
+
+    info.action = SessionCallbackInfo::State;
+
+    if (!setting)
+    {
+      messageReplyF("Must supply state: %s.\n", commands);
+      return false;
+    }
+
+    if (0 == strcmp(setting, "up"))
+    {
+      info.state = bfd::State::Up;
+      info.setValue = bfd::Diag::None;
+    }
+    else if (0 == strcmp(setting, "down"))
+    {
+      info.state = bfd::State::Down;
+      info.setValue = bfd::Diag::PathDown;
+    }
+    else if (0 == strcmp(setting, "admin"))
+    {
+      info.state = bfd::State::AdminDown;
+      info.setValue = bfd::Diag::AdminDown;
+    }
+    else
+    {
+      messageReplyF("Unrecognized state <%s> use %s.\n", setting, commands);
+      return false;
+    }
+
+
+    // Get diagnostic
+    const char *diagString =  getNextParam(setting);
+    if (diagString)
+    {
+      int64_t value;
+
+      if (info.state == bfd::State::Up)
+      {
+        messageReply("State up can not have diagnostic value.\n");
+        return false;
+      }
+
+      if (!StringToInt(diagString, value))
+      {
+        messageReplyF("Unrecognized diagnostic value. Must be integer <%s>.\n", diagString);
+        return false;
+      }
+
+      if (value < 0 || value > bfd::Diag::MaxDiagnostic)
+      {
+        messageReplyF("Diagnostic value. Must be integer between 0 and %u.\n", uint32_t(bfd::Diag::MaxDiagnostic));
+        return false;
+      }
+
+      info.setValue = uint32_t(value);
+    }
+
+    return true;
+  }
+
+  /**
+   * "session" command.
+   * Format 'session' ip/id/all (state ['admin'|'down'|'up'])|reset|stop|kill
+   */
+  void handle_Session(const char *message)
+  {
+    const char *whichString, *actionString;
+    const char *idOptions = "'all', 'new', session id or 'remote ip local ip'";
+    Raii<CommandValue<SessionCallbackInfo> >::Delete data(new CommandValue<SessionCallbackInfo>);
+    SessionCallbackInfo &info = data->value;
+    bool isSetting = false;
+
+    whichString = getNextParam(message);
+    if (!whichString)
+    {
+      messageReplyF("Must supply %s.\n", idOptions);
+      return;
+    }
+
+    if (0 == strcmp(whichString, "new"))
+    {
+      info.defSetting = true;
+    }
+    else
+    {
+      string error;
+      info.defSetting = false;
+      if (!paramToIdOrIp(&whichString, info.sessionId, error))
+      {
+        messageReplyF("Must supply %s before other settings. %s\n", idOptions,  error.c_str());
+        return;
+      }
+    }
+
+    static const char *actions = "'state', 'set', 'kill', 'reset', 'suspend', 'resume' or 'poll'";
+
+    actionString = getNextParam(whichString);
+    if (!actionString)
+    {
+      messageReplyF("Must supply session action: %s.\n", actions);
+      return;
+    }
+
+    if (0 == strcmp(actionString, "state"))
+    {
+      if (!getSessionStateParams(getNextParam(actionString), info))
+        return;
+      messageReplyF("Attempting to put session(s) into %s state with diagnostic <%s>.\n",
+                    bfd::StateName(info.state),
+                    bfd::DiagString(bfd::Diag::Value(info.setValue)));
+    }
+    else if (0 == strcmp(actionString, "reset"))
+    {
+      info.action = SessionCallbackInfo::Reset;
+      messageReplyF("Attempting to %s session(s).\n", actionString);
+    }
+    else if (0 == strcmp(actionString, "suspend"))
+    {
+      info.action = SessionCallbackInfo::Suspend;
+      messageReplyF("Attempting to %s session(s).\n", actionString);
+    }
+    else if (0 == strcmp(actionString, "resume"))
+    {
+      info.action = SessionCallbackInfo::Resume;
+      messageReplyF("Attempting to %s session(s).\n", actionString);
+    }
+    else if (0 == strcmp(actionString, "poll"))
+    {
+      info.action = SessionCallbackInfo::Poll;
+      messageReplyF("Attempting to %s session(s).\n", actionString);
+    }
+    else if (0 == strcmp(actionString, "kill"))
+    {
+      info.action = SessionCallbackInfo::Kill;
+      messageReplyF("Attempting to %s session(s).\n", actionString);
+    }
+    else if (0 == strcmp(actionString, "set"))
+    {
+      isSetting = true;
+      if (!getSessionSetParams(getNextParam(actionString), info))
+        return;
+    }
+    else
+    {
+      messageReplyF("Unrecognized session action <%s> use: %s.\n", actionString, actions);
+      return;
+    }
+
+    if (info.defSetting && !isSetting)
+    {
+      messageReply("'new' can only be used with 'set'.\n");
+      return;
+    }
+
+    doBatchableOperation(&CommandProcessorImp::doHandleSession, &CommandProcessorImp::replySession, data.Detach(), &info);
+  }
+
+  void replySession(void *userdata, intptr_t result)
+  {
+    SessionCallbackInfo *info = reinterpret_cast<SessionCallbackInfo *>(userdata);
+    if (result == NoSuchProfile)
+      messageReplyF("No profile named <%s>.\n", info->profile.c_str());
+    else if (result == NoSuchAuthKey)
+      messageReplyF("No authentication key named <%s>.\n", info->authKey.c_str());
+    else if (!result)
+      reportNoSuchSession(info->sessionId);
   }
 
-  struct MultiStatusCallbackInfo
+  struct ProfileCallbackInfo
   {
-    int level;
-    vector<StatusInfo> infoList;
+    ProfileCallbackInfo() : remove(false), created(false) { }
+
+    std::string name;
+    bool remove;
+    SessionCallbackInfo setting; // Unless remove.
+    bool created;
+    std::vector<Beacon::ProfileInfo> profiles; // For the list.
+    std::vector<Beacon::AuthKeyInfo> authKeys; // For the list, to name the keys.
   };
 
-
-  intptr_t doHandleMultiStatus(Beacon *beacon, void *userdata)
+  /**
+   * Changes, or deletes, a profile on each shard.
+   *
+   * @return intptr_t - false if the profile does not exist, or can not be made.
+   */
+  intptr_t doHandleProfileSet(Beacon *beacon, void *userdata)
   {
-    vector<uint32_t>::iterator idIt;
-    vector<uint32_t> ids;
-    MultiStatusCallbackInfo *opInfo = reinterpret_cast<MultiStatusCallbackInfo *>(userdata);
-    vector<StatusInfo> *infoList = &opInfo->infoList;
-    StatusInfo info;
-    Session *session;
+    ProfileCallbackInfo *info = reinterpret_cast<ProfileCallbackInfo *>(userdata);
+    uint32_t id = beacon->FindProfile(info->name.c_str());
 
-    beacon->GetSessionIdList(ids);
-    infoList->clear();
-    infoList->reserve(ids.size());
-    for (idIt = ids.begin(); idIt != ids.end(); idIt++)
+    if (info->remove)
+      return beacon->DeleteProfile(id);
+
+    if (!resolveAuthKey(beacon, info->setting))
+      return NoSuchAuthKey;
+
+    if (id == Beacon::NoProfile)
     {
-      session = beacon->FindSessionId(*idIt);
-      if (!session)
-      {
-        LogAssertFalse("No matching session for Id.");
-        continue;
-      }
-      fillSessionInfo(session, info, opInfo->level);
-      infoList->push_back(info);
+      id = beacon->MakeProfile(info->name.c_str());
+      if (id == Beacon::NoProfile)
+        return 0;
+      info->created = true;
     }
-    return 0;
+
+    Session::InitialParams params = *beacon->GetProfileParams(id);
+    applySessionSetting(info->setting, params);
+    return beacon->SetProfileParams(id, params);
   }
 
-  void handle_Status(const char *message)
+  /**
+   * Adds up the profiles of each shard. Every shard has the same profiles, in
+   * the same order.
+   */
+  intptr_t doHandleProfileList(Beacon *beacon, void *userdata)
   {
-    const char *whichString, *nextString;
-    int level = 1;
-    bool brief = false;
-    bool compact = false;
-    SessionID sessionId;
+    ProfileCallbackInfo *info = reinterpret_cast<ProfileCallbackInfo *>(userdata);
+    vector<Beacon::ProfileInfo> profiles;
 
-    whichString = getNextParam(message);
-    if (!whichString)
+    beacon->GetProfiles(profiles);
+    if (info->profiles.empty())
     {
-      sessionId.allSessions = true;
-      compact = true;
+      info->profiles = profiles;
+      beacon->GetAuthKeys(info->authKeys);
+      return 1;
     }
-    else
+    if (!LogVerify(profiles.size() == info->profiles.size()))
+      return 0;
+    for (size_t index = 0; index < profiles.size(); index++)
     {
-      string error;
+      info->profiles[index].sessions += profiles[index].sessions;
+      info->profiles[index].pending += profiles[index].pending;
+    }
+    return 1;
+  }
 
-      if (!paramToIdOrIp(&whichString, sessionId, error))
-      {
-        messageReplyF("Must supply 'all', session id or 'remote ip local ip' before other settings. %s\n", error.c_str());
-        return;
-      }
+  static bool isValidName(const char *name, size_t maxLength)
+  {
+    size_t length = strlen(name);
+    if (length == 0 || length > maxLength || 0 == strcmp(name, "list"))
+      return false;
+    for (const char *next = name; *next; next++)
+    {
+      if (!isalnum(*next) && *next != '-' && *next != '_' && *next != '.')
+        return false;
+    }
+    return true;
+  }
 
-      nextString = getNextParam(whichString);
+  static bool isValidProfileName(const char *name)
+  {
+    return isValidName(name, Beacon::MaxProfileNameLength);
+  }
 
-      while (nextString)
+  /**
+   * "profile" command.
+   * Format 'profile' ['list' | name ('set' item value | 'delete')]
+   */
+  void handle_Profile(const char *message)
+  {
+    Raii<CommandValue<ProfileCallbackInfo> >::Delete data(new CommandValue<ProfileCallbackInfo>);
+    ProfileCallbackInfo &info = data->value;
+    const char *nameString, *actionString;
+    intptr_t result;
+
+    nameString = getNextParam(message);
+    if (!nameString || 0 == strcmp(nameString, "list"))
+    {
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleProfileList, &info, &result) || !result)
+        return;
+      for (size_t index = 0; index < info.profiles.size(); index++)
       {
-        if (0 == strcmp("brief",  nextString))
-          brief = true;
-        else if (0 == strcmp("compact",  nextString))
-          compact = true;
-        else if (0 == strcmp("nocompact",  nextString))
-          compact = false;
-        else if (0 == strcmp("level",  nextString))
-        {
-          int64_t val;
-          nextString = getNextParam(nextString);
-          if (!nextString)
-          {
-            messageReplyF("level must be followed by an integer.\n");
-            return;
-          }
-          if (!StringToInt(nextString, val))
-          {
-            messageReplyF("level value must be an integer : <%s>.\n", nextString);
-            return;
-          }
-          level = (int)val;
-        }
-        else
+        const Beacon::ProfileInfo &profile = info.profiles[index];
+        const Session::InitialParams &params = profile.params;
+        messageReplyF("Profile %s%s: sessions=%s updating=%s\n", profile.name.c_str(),
+                      profile.forNewSessions ? " (new sessions)" : "",
+                      FormatInteger(profile.sessions), FormatInteger(profile.pending));
+        const char *authKey = "none";
+        for (size_t key = 0; key < info.authKeys.size(); key++)
         {
-          messageReplyF("Unrecognized  status setting <%s>.\n", nextString);
-          return;
+          if (info.authKeys[key].id == params.authKey)
+            authKey = info.authKeys[key].name.c_str();
         }
-        nextString = getNextParam(nextString);
+        messageReplyF(" multi=%u mintx=%s us minrx=%s us cpi=%s admin_up_poll=%s priority=%s echo=%s us demand=%s auth=%s\n",
+                      uint32_t(params.detectMulti),
+                      FormatInteger(params.desiredMinTx),
+                      FormatInteger(params.requiredMinRx),
+                      params.controlPlaneIndependent ? "yes" : "no",
+                      params.adminUpPollWorkaround ? "yes" : "no",
+                      params.lowPriority ? "low" : "normal",
+                      FormatInteger(params.echoInterval),
+                      params.demandMode ? "yes" : "no",
+                      authKey);
       }
+      return;
     }
 
-    if (sessionId.allSessions)
+    if (!isValidProfileName(nameString))
     {
-      MultiStatusCallbackInfo info;
-      info.level = level;
+      messageReplyF("Profile name <%s> must be 1 to %zu letters, digits, '-', '_' or '.', and not 'list'.\n",
+                    nameString, Beacon::MaxProfileNameLength);
+      return;
+    }
+    info.name = nameString;
 
-      if (doBeaconOperation(&CommandProcessorImp::doHandleMultiStatus, &info))
+    actionString = getNextParam(nameString);
+    if (actionString && 0 == strcmp(actionString, "delete"))
+    {
+      if (info.name == Beacon::DefaultProfileName)
       {
-        vector<StatusInfo>::iterator it;
-        messageReplyF("There are %zu sessions:\n", info.infoList.size());
-        for (it = info.infoList.begin(); it != info.infoList.end(); it++)
-        {
-          if (!compact && it != info.infoList.begin())
-          {
-            messageReplyF("\nSession %u\n", it->id);
-          }
-          else
-            messageReplyF("Session %u\n", it->id);
-          printStatusInfo(*it, level, brief, compact);
-        }
+        messageReplyF("Profile %s can not be deleted.\n", Beacon::DefaultProfileName);
+        return;
       }
+      info.remove = true;
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleProfileSet, &info, &result))
+        return;
+      if (result)
+        messageReplyF("Deleted profile %s. Its sessions are moving to profile %s.\n", nameString, Beacon::DefaultProfileName);
+      else
+        messageReplyF("No profile named <%s>.\n", nameString);
+      return;
     }
-    else
+
+    if (!actionString || 0 != strcmp(actionString, "set"))
     {
-      intptr_t result;
-      SingleStatusCallbackInfo info;
-      info.level = level;
-      info.sessionId = sessionId;
+      messageReply("Must supply 'set' or 'delete' after the profile name.\n");
+      return;
+    }
 
-      if (doBeaconOperation(&CommandProcessorImp::doHandleSingleStatus, &info, &result))
-      {
-        if (result)
-        {
-          printStatusInfo(info.info, level, brief, compact);
-        }
-        else
-        {
-          reportNoSuchSession(info.sessionId);
-          return;
-        }
-      }
+    if (!getSessionSetParams(getNextParam(actionString), info.setting))
+      return;
+    if (info.setting.action == SessionCallbackInfo::SetProfile)
+    {
+      messageReply("A profile has no 'profile' setting.\n");
+      return;
     }
-  }
 
+    if (!doBeaconOperation(&CommandProcessorImp::doHandleProfileSet, &info, &result))
+      return;
+    if (result == NoSuchAuthKey)
+      messageReplyF("No authentication key named <%s>.\n", info.setting.authKey.c_str());
+    else if (!result)
+      messageReplyF("Unable to make profile %s. There can be up to %zu.\n", nameString, Beacon::MaxProfiles);
+    else if (info.created)
+      messageReplyF("Made profile %s.\n", nameString);
+  }
 
-  struct SessionCallbackInfo
+  struct AuthCallbackInfo
   {
-    enum Action
-    {
-      State,
-      Kill,
-      Reset,
-      Suspend,
-      Resume,
-      SetMulti,
-      SetMinTx,
-      SetMinRx,
-      SetCPI,
-      SetAdminUpPoll
-    };
+    AuthCallbackInfo() : remove(false), created(false) { }
 
-    SessionID sessionId;
-    bool defSetting; // if true then sessionId is not used
-    Action action;
-    bfd::State::Value state;
-    uint32_t setValue;
+    std::string name;
+    bool remove;
+    AuthKey key; // Unless remove.
+    bool created;
+    std::vector<Beacon::AuthKeyInfo> keys; // For the list.
   };
 
   /**
+   * Makes, changes, or deletes, an authentication key on each shard.
    *
-   *
-   * @param beacon
-   * @param userdata
-   *
-   * @return intptr_t - false if the session can not be located.
+   * @return intptr_t - false if the key does not exist, or can not be made.
    */
-  intptr_t doHandleSession(Beacon *beacon, void *userdata)
+  intptr_t doHandleAuthSet(Beacon *beacon, void *userdata)
   {
-    vector<uint32_t> ids;
-    vector<uint32_t>::iterator idIt;
-    SessionCallbackInfo *info = reinterpret_cast<SessionCallbackInfo *>(userdata);
-
-    if (info->defSetting)
-    {
-      // Default settings .. we do not need a session.
-      if (info->action == SessionCallbackInfo::SetMulti)
-        beacon->SetDefMulti(uint8_t(info->setValue));
-      else if (info->action == SessionCallbackInfo::SetMinTx)
-        beacon->SetDefMinTxInterval(info->setValue);
-      else if (info->action == SessionCallbackInfo::SetMinRx)
-        beacon->SetDefMinRxInterval(info->setValue);
-      else if (info->action == SessionCallbackInfo::SetCPI)
-        beacon->SetDefControlPlaneIndependent(bool(info->setValue));
-      else if (info->action == SessionCallbackInfo::SetAdminUpPoll)
-        beacon->SetDefAdminUpPollWorkaround(bool(info->setValue));
-      else
-      {
-        LogAssertFalse("Incorrect default action in doHandleSession");
-      }
-      return 1;
-    }
-
-
-    if (!findSessionIdList(beacon, info->sessionId, ids))
-      return 0;
-
-    for (idIt = ids.begin(); idIt != ids.end(); idIt++)
-    {
-      Session *session = beacon->FindSessionId(*idIt);
-      if (!session)
-      {
-        LogAssertFalse("No matching session for Id.");
-        continue;
-      }
+    AuthCallbackInfo *info = reinterpret_cast<AuthCallbackInfo *>(userdata);
+    uint32_t id = beacon->FindAuthKey(info->name.c_str());
 
-      if (info->action == SessionCallbackInfo::State)
-      {
-        if (info->state == bfd::State::Down)
-          session->ForceDown(bfd::Diag::Value(info->setValue));
-        else if (info->state == bfd::State::AdminDown)
-          session->ForceAdminDown(bfd::Diag::Value(info->setValue));
-        else if (info->state == bfd::State::Up)
-          session->AllowStateChanges();
-        else
-        {
-          LogAssertFalse("Incorrect state in doHandleSession");
-        }
-      }
-      else if (info->action == SessionCallbackInfo::Kill)
-      {
-        beacon->KillSession(session);
-        session = NULL; // warning session now invalid
-      }
-      else if (info->action == SessionCallbackInfo::Reset)
-      {
-        bool active = session->IsActiveSession();
-        IpAddr remoteAddr = session->GetRemoteAddress();
-        IpAddr localAddr = session->GetLocalAddress();
+    if (info->remove)
+      return beacon->DeleteAuthKey(id);
 
-        beacon->KillSession(session);
-        session = NULL; // warning session now invalid
-        gLog.Optional(Log::SessionDetail, "Reset session id=%u for local %s to remote %s.", *idIt, localAddr.ToString(), remoteAddr.ToString());
-        if (active)
-          beacon->StartActiveSession(remoteAddr, localAddr);
-      }
-      else if (info->action == SessionCallbackInfo::Suspend)
-        session->SetSuspend(true);
-      else if (info->action == SessionCallbackInfo::Resume)
-        session->SetSuspend(false);
-      else if (info->action == SessionCallbackInfo::SetMulti)
-        session->SetMulti(uint8_t(info->setValue));
-      else if (info->action == SessionCallbackInfo::SetMinTx)
-        session->SetMinTxInterval(info->setValue);
-      else if (info->action == SessionCallbackInfo::SetMinRx)
-        session->SetMinRxInterval(info->setValue);
-      else if (info->action == SessionCallbackInfo::SetCPI)
-        session->SetControlPlaneIndependent(bool(info->setValue));
-      else if (info->action == SessionCallbackInfo::SetAdminUpPoll)
-        session->SetAdminUpPollWorkaround(bool(info->setValue));
-      else
-      {
-        LogAssertFalse("Incorrect action in doHandleSession");
-      }
-    }
+    info->created = (id == Beacon::NoAuthKey);
+    return beacon->SetAuthKey(info->name.c_str(), info->key) != Beacon::NoAuthKey;
+  }
+
+  /**
+   * Adds up the keys of each shard. Every shard has the same keys, in the same
+   * order.
+   */
+  intptr_t doHandleAuthList(Beacon *beacon, void *userdata)
+  {
+    AuthCallbackInfo *info = reinterpret_cast<AuthCallbackInfo *>(userdata);
+    vector<Beacon::AuthKeyInfo> keys;
 
+    beacon->GetAuthKeys(keys);
+    if (info->keys.empty())
+    {
+      info->keys = keys;
+      return 1;
+    }
+    if (!LogVerify(keys.size() == info->keys.size()))
+      return 0;
+    for (size_t index = 0; index < keys.size(); index++)
+      info->keys[index].sessions += keys[index].sessions;
     return 1;
   }
 
   /**
-   * Parses two message parameters that represent a time value.
-   * Will put up an error message if no time specifier is found.
-   *
-   * @param valueString - The message parameter for the integer part of the time.
-   * @param outTime - The result in microseconds.
-   * @param notIntReply - The message used if value is not an int. Use %s for the
-   *                    value that was given.
+   * Parses a key secret, either as text, or as hex digits after '0x'.
    *
-   * @return bool - false on failure.
+   * @return bool - false if it is not valid. There is no reply.
    */
-  bool parseTimeValue(const char *valueString, uint32_t &outMicroTime, const char *notIntReply)
+  static bool parseAuthSecret(const char *str, std::vector<uint8_t> &outSecret)
   {
-    int64_t value;
-    const char *unitString;
-    static const char *unitvalues = "'s', 'ms' or 'us'";
-
-    if (!valueString)
+    outSecret.clear();
+    if (0 != strncmp(str, "0x", 2))
     {
-      messageReplyF(notIntReply, "none");
-      return false;
+      outSecret.assign(str, str + strlen(str));
+      return true;
     }
 
-
-    if (!StringToInt(valueString, value))
-    {
-      messageReplyF(notIntReply, valueString);
+    const char *digits = str + 2;
+    size_t length = strlen(digits);
+    if (length == 0 || length % 2 != 0)
       return false;
+    for (size_t index = 0; index < length; index += 2)
+    {
+      if (!isxdigit(digits[index]) || !isxdigit(digits[index + 1]))
+        return false;
+      char byte[3] = { digits[index], digits[index + 1], '\0'};
+      outSecret.push_back(uint8_t(strtoul(byte, NULL, 16)));
     }
+    return true;
+  }
 
-    if (value < 0)
+  /**
+   * "auth" command.
+   * Format 'auth' ['list' | name ('set' type keyid secret | 'delete')]
+   */
+  void handle_Auth(const char *message)
+  {
+    Raii<CommandValue<AuthCallbackInfo> >::Delete data(new CommandValue<AuthCallbackInfo>);
+    AuthCallbackInfo &info = data->value;
+    const char *nameString, *actionString;
+    intptr_t result;
+
+    nameString = getNextParam(message);
+    if (!nameString || 0 == strcmp(nameString, "list"))
     {
-      messageReply("Negative values not allowed\n");
-      return false;
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleAuthList, &info, &result) || !result)
+        return;
+      if (info.keys.empty())
+        messageReply("No authentication keys.\n");
+      for (size_t index = 0; index < info.keys.size(); index++)
+      {
+        const Beacon::AuthKeyInfo &key = info.keys[index];
+        messageReplyF("Auth key %s: type=%s keyid=%u sessions=%s profiles=%s\n", key.name.c_str(),
+                      bfd::AuthTypeName(key.type), uint32_t(key.keyId),
+                      FormatInteger(key.sessions), FormatInteger(key.profiles));
+      }
+      return;
     }
 
-    unitString = getNextParam(valueString);
-    if (!unitString)
+    if (!isValidName(nameString, Beacon::MaxAuthKeyNameLength) || 0 == strcmp(nameString, "none"))
     {
-      messageReplyF("Must supply a unit after the value %s: %s\n", valueString, unitvalues);
-      return false;
+      messageReplyF("Key name <%s> must be 1 to %zu letters, digits, '-', '_' or '.', and not 'list' or 'none'.\n",
+                    nameString, Beacon::MaxAuthKeyNameLength);
+      return;
     }
-    if (0 == strcmp(unitString,  "s"))
+    info.name = nameString;
+
+    actionString = getNextParam(nameString);
+    if (actionString && 0 == strcmp(actionString, "delete"))
     {
-      if (value > UINT32_MAX / 1000000U)
+      // A key that is in use would leave its sessions without authentication,
+      // so that their peers drop them.
+      AuthCallbackInfo list;
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleAuthList, &list, &result) || !result)
+        return;
+      for (size_t index = 0; index < list.keys.size(); index++)
       {
-        messageReplyF("Value <%s> seconds is too large to be converted to microseconds.\n", valueString);
-        return false;
+        const Beacon::AuthKeyInfo &key = list.keys[index];
+        if (key.name == info.name && (key.sessions != 0 || key.profiles != 0))
+        {
+          messageReplyF("Key %s is used by %s sessions and %s profiles. Set them to another key, or 'none', first.\n",
+                        nameString, FormatInteger(key.sessions), FormatInteger(key.profiles));
+          return;
+        }
       }
-      outMicroTime = (uint32_t)(value * 1000000U);
-      return true;
+
+      info.remove = true;
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleAuthSet, &info, &result))
+        return;
+      if (result)
+        messageReplyF("Deleted authentication key %s.\n", nameString);
+      else
+        messageReplyF("No authentication key named <%s>.\n", nameString);
+      return;
     }
-    else if (0 == strcmp(unitString,  "ms"))
+
+    if (!actionString || 0 != strcmp(actionString, "set"))
     {
-      if (value > UINT32_MAX / 1000U)
-      {
-        messageReplyF("Value <%s> milliseconds is too large to be converted to microseconds.\n", valueString);
-        return false;
-      }
-      outMicroTime = (uint32_t)(value * 1000U);
-      return true;
+      messageReply("Must supply 'set' or 'delete' after the key name.\n");
+      return;
     }
-    else if (0 == strcmp(unitString,  "us"))
+
+    const char *typeString = getNextParam(actionString);
+    const char *keyIdString = typeString ? getNextParam(typeString) : NULL;
+    const char *secretString = keyIdString ? getNextParam(keyIdString) : NULL;
+    if (!secretString)
     {
-      if (value > UINT32_MAX)
-      {
-        messageReplyF("Value <%s> microseconds is too large.\n", valueString);
-        return false;
-      }
-      outMicroTime = (uint32_t)(value);
-      return true;
+      messageReply("Must supply a type, key id and secret for 'auth set'.\n");
+      return;
     }
 
-    messageReplyF("Unknown unit <%s>. Use: %s\n", unitString, unitvalues);
-    return false;
-  }
+    bfd::AuthType::Value type;
+    if (!AuthKey::StringToType(typeString, type))
+    {
+      messageReplyF("Unknown key type <%s>. Use 'md5', 'meticulous-md5', 'sha1' or 'meticulous-sha1'.\n", typeString);
+      return;
+    }
+
+    uint64_t keyId;
+    if (!StringToInt(keyIdString, keyId) || keyId > 255)
+    {
+      messageReplyF("Key id <%s> must be 0 to 255.\n", keyIdString);
+      return;
+    }
 
+    std::vector<uint8_t> secret;
+    if (!parseAuthSecret(secretString, secret) || secret.empty() || !info.key.Set(type, uint8_t(keyId), &secret.front(), secret.size()))
+    {
+      messageReplyF("The secret must be 1 to %u bytes, as text, or as hex digits after '0x'.\n",
+                    (type == bfd::AuthType::MD5 || type == bfd::AuthType::MeticulousMD5) ? 16 : 20);
+      return;
+    }
 
+    if (!doBeaconOperation(&CommandProcessorImp::doHandleAuthSet, &info, &result))
+      return;
+    if (!result)
+      messageReplyF("Unable to make authentication key %s. There can be up to %zu.\n", nameString, Beacon::MaxAuthKeys);
+    else if (info.created)
+      messageReplyF("Made authentication key %s.\n", nameString);
+    else
+      messageReplyF("Changed authentication key %s. Its sessions now use it.\n", nameString);
+  }
 
   /**
-   * Helper for handle_Session when action is "set"
-   *
-   * @param setting
-   * @param info [out] - filled on success.
-   *
-   * @return bool - false on parse failure.
+   * "capture" command.
+   * Format 'capture' ['status' | 'start' file ['limit' packets] | 'stop']
    */
-  bool getSessionSetParams(const char *setting, SessionCallbackInfo &info)
+  void handle_Capture(const char *message)
   {
-    static const char *commands = "'mintx', 'minrx', 'multi', 'cpi' or 'admin_up_poll'";
-    const char *valueString;
-
-    if (!setting)
-    {
-      messageReplyF("Must supply item to set: %s.\n", commands);
-      return false;
-    }
+    const char *actionString = getNextParam(message);
 
-    else if (0 == strcmp(setting, "mintx"))
+    if (!actionString || 0 == strcmp(actionString, "status"))
     {
-      info.action = SessionCallbackInfo::SetMinTx;
-      valueString = getNextParam(setting);
-      if (!valueString)
-      {
-        messageReply("Must supply value for 'set mintx'.\n");
-        return false;
-      }
-      if (!parseTimeValue(valueString, info.setValue, "'set mintx' value must be an integer followed by time unit : <%s>.\n"))
-        return false;
-
-      if (info.setValue == 0)
+      Beacon::CaptureStatus status;
+      if (!m_beacon->GetCaptureStatus(status))
       {
-        messageReply("'set mintx' value can not be 0.\n");
-        return false;
+        messageReply("No capture running.\n");
+        return;
       }
-      messageReplyF("Attempting to set mintx to %s us.\n", FormatInteger(info.setValue));
-      return true;
+      messageReplyF("Capture %s: written=%s dropped=%s limit=%s%s\n", status.path.c_str(),
+                    FormatInteger(status.stats.written), FormatInteger(status.stats.dropped),
+                    status.stats.limit ? FormatInteger(status.stats.limit) : "none",
+                    status.stats.full ? " (stopped writing)" : "");
+      return;
     }
-    else if (0 == strcmp(setting, "minrx"))
+
+    if (0 == strcmp(actionString, "stop"))
     {
-      info.action = SessionCallbackInfo::SetMinRx;
-      valueString = getNextParam(setting);
-      if (!valueString)
+      Beacon::CaptureStatus status;
+      bool running = m_beacon->GetCaptureStatus(status);
+      if (!m_beacon->StopCapture())
       {
-        messageReply("Must supply value for 'set minrx'.\n");
-        return false;
+        messageReply("No capture running.\n");
+        return;
       }
-      if (!parseTimeValue(valueString, info.setValue, "'set minrx' value must be an integer followed by time unit : <%s>.\n"))
-        return false;
-      messageReplyF("Attempting to set minrx to %s us.\n", FormatInteger(info.setValue));
-      return true;
+      if (running)
+        messageReplyF("Stopped capture %s.\n", status.path.c_str());
+      else
+        messageReply("Stopped capture.\n");
+      return;
     }
-    else if (0 == strcmp(setting, "multi"))
+
+    if (0 != strcmp(actionString, "start"))
     {
-      int64_t val64;
+      messageReplyF("Unknown capture action <%s>. Must be 'status', 'start' or 'stop'.\n", actionString);
+      return;
+    }
 
-      info.action = SessionCallbackInfo::SetMulti;
-      valueString = getNextParam(setting);
-      if (!valueString)
-      {
-        messageReply("Must supply value for 'set multi'.\n");
-        return false;
-      }
-      if (!StringToInt(valueString, val64))
-      {
-        messageReply("Must supply an non-zero integer value for 'set multi'.\n");
-        return false;
-      }
+    const char *pathString = getNextParam(actionString);
+    if (!pathString)
+    {
+      messageReply("Must supply a file name after 'capture start'.\n");
+      return;
+    }
 
-      if (val64 > UINT8_MAX)
-      {
-        messageReply("Value for 'set multi is too large..\n");
-      }
-      else if (val64 == 0)
+    uint64_t limit = 0;
+    const char *limitString = getNextParam(pathString);
+    if (limitString)
+    {
+      const char *valueString = getNextParam(limitString);
+      if (0 != strcmp(limitString, "limit") || !valueString || !StringToInt(valueString, limit))
       {
-        messageReply("'set multi' value can not be 0.\n");
-        return false;
+        messageReply("Only 'limit' and a number of packets may follow the file name.\n");
+        return;
       }
-      info.setValue = uint32_t(val64);
-      messageReplyF("Attempting to set multi to %u.\n", info.setValue);
-      return true;
     }
-    else if (0 == strcmp(setting, "cpi"))
+
+    if (!m_beacon->StartCapture(pathString, limit))
     {
-      info.action = SessionCallbackInfo::SetCPI;
-      valueString = getNextParam(setting);
-      if (!valueString)
-      {
-        messageReply("Must supply 'yes' or 'no' for 'set cpi'.\n");
-        return false;
-      }
-      if (0 == strcmp(valueString,  "yes"))
-        info.setValue = true;
-      else if (0 == strcmp(valueString,  "no"))
-        info.setValue = false;
-      else
-      {
-        messageReplyF("Must supply 'yes' or 'no' for 'set cpi'. Unknown value <%s>.\n", valueString);
-        return false;
-      }
-      messageReplyF("Attempting to set control plane independent (C) bit to %s.\n", valueString);
-      return true;
+      messageReplyF("Failed to start capture to %s.\n", pathString);
+      return;
     }
-    else if (0 == strcmp(setting, "admin_up_poll"))
+    messageReplyF("Capturing received packets to %s.\n", pathString);
+  }
+
+  struct StatsCallbackInfo
+  {
+    StatsCallbackInfo() :
+       reset(false),
+       transmitDepth(0),
+       transmitWindow(0),
+       transmitSharedSockets(false),
+       engineShards(0),
+       schedulerDatagrams(false),
+       engineSent(0),
+       shards(0)
     {
-      info.action = SessionCallbackInfo::SetAdminUpPoll;
-      valueString = getNextParam(setting);
-      if (!valueString)
-      {
-        messageReply("Must supply 'yes' or 'no' for 'set admin_up_poll'.\n");
-        return false;
-      }
-      if (0 == strcmp(valueString,  "yes"))
-        info.setValue = true;
-      else if (0 == strcmp(valueString,  "no"))
-        info.setValue = false;
-      else
-      {
-        messageReplyF("Must supply 'yes' or 'no' for 'set admin_up_poll'. Unknown value <%s>.\n", valueString);
-        return false;
-      }
-      messageReplyF("Attempting to %s admin_up_poll workaround.\n", info.setValue ? "enable" : "disable");
-      return true;
+      memset(&transmit, 0, sizeof(transmit));
+      memset(&memory, 0, sizeof(memory));
     }
-    else
+
+    bool reset;
+    TransmitQueue::Stats transmit;
+    size_t transmitDepth;
+    uint32_t transmitWindow;
+    bool transmitSharedSockets;
+    TransmitEngine::Stats engine;
+    size_t engineShards; // Shards with a transmit engine.
+    Scheduler::Stats scheduler;
+    bool schedulerDatagrams; // See Scheduler::HandlesDatagrams().
+    Beacon::MemoryStats memory;
+    Beacon::PacketStats packets;
+    Beacon::PacketCounters counters;
+    uint64_t engineSent;
+    size_t shards;
+    std::vector<std::pair<size_t, Beacon::RealtimeStatus> > realtime; // Shard index and status.
+    std::vector<std::pair<size_t, Beacon::OverloadStats> > overload; // Shard index and stats.
+  };
+
+  /**
+   * Adds the stats from each shard's transmit queue.
+   */
+  intptr_t doHandleTransmitStats(Beacon *beacon, void *userdata)
+  {
+    StatsCallbackInfo *info = reinterpret_cast<StatsCallbackInfo *>(userdata);
+    TransmitQueue *queue = beacon->GetTransmitQueue();
+    TransmitQueue::Stats stats;
+    if (!queue)
+      return 0;
+
+    queue->GetStats(stats);
+    info->transmit.queued += stats.queued;
+    info->transmit.sent += stats.sent;
+    info->transmit.failed += stats.failed;
+    info->transmit.discarded += stats.discarded;
+    info->transmit.flushes += stats.flushes;
+    info->transmit.fullFlushes += stats.fullFlushes;
+    info->transmit.sendCalls += stats.sendCalls;
+    info->transmit.maxDepth = max(info->transmit.maxDepth, stats.maxDepth);
+    info->transmit.lastDepth = max(info->transmit.lastDepth, stats.lastDepth);
+    info->transmit.totalDelay += stats.totalDelay;
+    info->transmit.maxDelay = max(info->transmit.maxDelay, stats.maxDelay);
+    info->shards++;
+
+    info->transmitDepth = queue->GetMaxDepth();
+    info->transmitWindow = queue->GetWindow();
+    info->transmitSharedSockets = queue->UseSharedSockets();
+    if (info->reset)
+      queue->ResetStats();
+
+    TransmitEngine *engine = beacon->GetTransmitEngine();
+    if (engine)
     {
-      messageReplyF("Unrecognized item to set <%s> use %s.\n", setting, commands);
-      return false;
+      TransmitEngine::Stats engineStats;
+      engine->GetStats(engineStats);
+      info->engine.updates += engineStats.updates;
+      info->engine.sent += engineStats.sent;
+      info->engine.failed += engineStats.failed;
+      info->engine.sendCalls += engineStats.sendCalls;
+      info->engine.wakeups += engineStats.wakeups;
+      info->engine.activeSlots += engineStats.activeSlots;
+      info->engine.lateness.Merge(engineStats.lateness);
+      info->engineShards++;
+      if (info->reset)
+        engine->ResetStats();
     }
+    return 1;
+  }
+
+  /**
+   * Combines the stats from each shard's scheduler.
+   */
+  intptr_t doHandleSchedulerStats(Beacon *beacon, void *userdata)
+  {
+    StatsCallbackInfo *info = reinterpret_cast<StatsCallbackInfo *>(userdata);
+    Scheduler *scheduler = beacon->GetScheduler();
+    Scheduler::Stats stats;
+    if (!scheduler)
+      return 0;
+
+    scheduler->GetStats(stats);
+    info->scheduler.iterations += stats.iterations;
+    info->scheduler.lowStarvedIterations += stats.lowStarvedIterations;
+    info->scheduler.timerLateness[Timer::Priority::Low].Merge(stats.timerLateness[Timer::Priority::Low]);
+    info->scheduler.timerLateness[Timer::Priority::Hi].Merge(stats.timerLateness[Timer::Priority::Hi]);
+    info->scheduler.iterationTime.Merge(stats.iterationTime);
+    info->scheduler.callbacksPerIteration.Merge(stats.callbacksPerIteration);
+    info->scheduler.lowStarvation.Merge(stats.lowStarvation);
+    info->scheduler.clockSource = stats.clockSource;
+    info->scheduler.clockResolution = max(info->scheduler.clockResolution, stats.clockResolution);
+    info->scheduler.clockReads += stats.clockReads;
+    info->scheduler.clockLag.Merge(stats.clockLag);
+    info->scheduler.budget = stats.budget;
+    info->scheduler.lowBudgetTimers += stats.lowBudgetTimers;
+    info->scheduler.lowBudgetExhausted += stats.lowBudgetExhausted;
+    info->scheduler.lowDeadlineTimers += stats.lowDeadlineTimers;
+    info->scheduler.datagramsReceived += stats.datagramsReceived;
+    info->scheduler.datagramsSent += stats.datagramsSent;
+    info->scheduler.datagramSendFailures += stats.datagramSendFailures;
+    info->scheduler.receiveBufferShortages += stats.receiveBufferShortages;
+    info->schedulerDatagrams = info->schedulerDatagrams || scheduler->HandlesDatagrams();
+    info->shards++;
+
+    if (info->reset)
+      scheduler->ResetStats();
+    return 1;
+  }
+
+  /**
+   * Adds the session memory of each shard. Timers are in the scheduler stats.
+   */
+  intptr_t doHandleMemoryStats(Beacon *beacon, void *userdata)
+  {
+    StatsCallbackInfo *info = reinterpret_cast<StatsCallbackInfo *>(userdata);
+    Scheduler *scheduler = beacon->GetScheduler();
+    Beacon::MemoryStats memory;
+    Scheduler::Stats stats;
+    if (!scheduler)
+      return 0;
+
+    beacon->GetMemoryStats(memory);
+    info->memory.sessions += memory.sessions;
+    info->memory.sessionSize = memory.sessionSize;
+    info->memory.sessionBytes += memory.sessionBytes;
+    info->memory.mapBytes += memory.mapBytes;
+
+    scheduler->GetStats(stats);
+    info->scheduler.timers += stats.timers;
+    info->scheduler.timerSize = stats.timerSize;
+    info->scheduler.timerBytes += stats.timerBytes;
+    info->shards++;
+    return 1;
+  }
+
+  /**
+   * Gathers the real time status of each shard.
+   */
+  intptr_t doHandleRealtimeStats(Beacon *beacon, void *userdata)
+  {
+    StatsCallbackInfo *info = reinterpret_cast<StatsCallbackInfo *>(userdata);
+    Beacon::RealtimeStatus status;
+    if (!beacon->GetScheduler())
+      return 0;
+
+    beacon->GetRealtimeStatus(status);
+    info->realtime.push_back(std::make_pair(beacon->GetShardIndex(), status));
+    info->shards++;
+    return 1;
   }
 
   /**
-   * Helper for handle_Session when action is "state"
-   *
-   * @param setting
-   * @param info [out] - filled on success.
-   *
-   * @return bool - false on parse failure.
+   * Gathers the overload controller stats of each shard.
    */
-  bool getSessionStateParams(const char *setting, SessionCallbackInfo &info)
+  intptr_t doHandleOverloadStats(Beacon *beacon, void *userdata)
   {
-    static const char *commands = "'up', 'admin', or 'down'";
+    StatsCallbackInfo *info = reinterpret_cast<StatsCallbackInfo *>(userdata);
+    Beacon::OverloadStats stats;
+    if (!beacon->GetScheduler())
+      return 0;
 
-    info.action = SessionCallbackInfo::State;
+    beacon->GetOverloadStats(stats);
+    info->overload.push_back(std::make_pair(beacon->GetShardIndex(), stats));
+    info->shards++;
+    return 1;
+  }
 
-    if (!setting)
-    {
-      messageReplyF("Must supply state: %s.\n", commands);
-      return false;
-    }
+  /**
+   * Adds the session packet counts of each shard.
+   */
+  intptr_t doHandlePacketStats(Beacon *beacon, void *userdata)
+  {
+    StatsCallbackInfo *info = reinterpret_cast<StatsCallbackInfo *>(userdata);
+    Beacon::PacketStats packets;
+    if (!beacon->GetScheduler())
+      return 0;
 
-    if (0 == strcmp(setting, "up"))
-    {
-      info.state = bfd::State::Up;
-      info.setValue = bfd::Diag::None;
-    }
-    else if (0 == strcmp(setting, "down"))
-    {
-      info.state = bfd::State::Down;
-      info.setValue = bfd::Diag::PathDown;
-    }
-    else if (0 == strcmp(setting, "admin"))
-    {
-      info.state = bfd::State::AdminDown;
-      info.setValue = bfd::Diag::AdminDown;
-    }
-    else
+    beacon->GetPacketStats(packets);
+    info->packets.sessionPackets += packets.sessionPackets;
+    info->packets.fastPathPackets += packets.fastPathPackets;
+    info->packets.untimedPackets += packets.untimedPackets;
+    info->packets.receiveCallbacks += packets.receiveCallbacks;
+    info->packets.budgetHits += packets.budgetHits;
+    info->packets.receiveBudget = packets.receiveBudget;
+    info->packets.receiveDelay.Merge(packets.receiveDelay);
+    if (packets.hasRing)
     {
-      messageReplyF("Unrecognized state <%s> use %s.\n", setting, commands);
-      return false;
+      info->packets.hasRing = true;
+      info->packets.ring.received += packets.ring.received;
+      info->packets.ring.ignored += packets.ring.ignored;
+      info->packets.ring.dropped += packets.ring.dropped;
     }
+    info->shards++;
 
+    if (info->reset)
+      beacon->ResetPacketStats();
+    return 1;
+  }
 
-    // Get diagnostic
-    const char *diagString =  getNextParam(setting);
-    if (diagString)
-    {
-      int64_t value;
-
-      if (info.state == bfd::State::Up)
-      {
-        messageReply("State up can not have diagnostic value.\n");
-        return false;
-      }
-
-      if (!StringToInt(diagString, value))
-      {
-        messageReplyF("Unrecognized diagnostic value. Must be integer <%s>.\n", diagString);
-        return false;
-      }
-
-      if (value < 0 || value > bfd::Diag::MaxDiagnostic)
-      {
-        messageReplyF("Diagnostic value. Must be integer between 0 and %u.\n", uint32_t(bfd::Diag::MaxDiagnostic));
-        return false;
-      }
+  /**
+   * Adds the packet counters of each shard.
+   */
+  intptr_t doHandleCounterStats(Beacon *beacon, void *userdata)
+  {
+    StatsCallbackInfo *info = reinterpret_cast<StatsCallbackInfo *>(userdata);
+    Beacon::PacketCounters counters;
+    if (!beacon->GetScheduler())
+      return 0;
 
-      info.setValue = uint32_t(value);
+    beacon->GetPacketCounters(counters);
+    info->counters.received += counters.received;
+    info->counters.sent += counters.sent;
+    info->counters.stateChanges += counters.stateChanges;
+    info->counters.pollSequences += counters.pollSequences;
+    info->counters.echoSent += counters.echoSent;
+    info->counters.echoReturned += counters.echoReturned;
+    info->counters.echoReflected += counters.echoReflected;
+    info->counters.echoDiscarded += counters.echoDiscarded;
+    for (size_t reason = 0; reason < Beacon::DiscardReason::Count; reason++)
+      info->counters.discards[reason] += counters.discards[reason];
+
+    // Periodic packets sent by the transmit thread are counted there.
+    TransmitEngine *engine = beacon->GetTransmitEngine();
+    if (engine)
+    {
+      TransmitEngine::Stats engineStats;
+      engine->GetStats(engineStats);
+      info->engineSent += engineStats.sent;
     }
+    info->shards++;
 
-    return true;
+    if (info->reset)
+      beacon->ResetPacketCounters();
+    return 1;
   }
 
   /**
-   * "session" command.
-   * Format 'session' ip/id/all (state ['admin'|'down'|'up'])|reset|stop|kill
+   * "stats" command.
+   * Format 'stats' (transmit | scheduler | memory | packets | counters | realtime | overload) [reset]
    */
-  void handle_Session(const char *message)
+  void handle_Stats(const char *message)
   {
-    const char *whichString, *actionString;
-    const char *idOptions = "'all', 'new', session id or 'remote ip local ip'";
-    SessionCallbackInfo info;
+    const char *itemString, *actionString;
+    StatsCallbackInfo info;
     intptr_t result;
-    bool isSetting = false;
 
-    whichString = getNextParam(message);
-    if (!whichString)
+    itemString = getNextParam(message);
+    if (!itemString)
     {
-      messageReplyF("Must supply %s.\n", idOptions);
+      messageReply("Must supply 'transmit', 'scheduler', 'memory', 'packets', 'counters', 'realtime' or 'overload'.\n");
       return;
     }
 
-    if (0 == strcmp(whichString, "new"))
+    actionString = getNextParam(itemString);
+    if (actionString)
     {
-      info.defSetting = true;
-    }
-    else
-    {
-      string error;
-      info.defSetting = false;
-      if (!paramToIdOrIp(&whichString, info.sessionId, error))
+      if (0 != strcmp(actionString, "reset"))
       {
-        messageReplyF("Must supply %s before other settings. %s\n", idOptions,  error.c_str());
+        messageReplyF("Unknown stats action <%s>. Only 'reset' is supported.\n", actionString);
         return;
       }
+      info.reset = true;
     }
 
-    static const char *actions = "'state', 'set', 'kill', 'reset', 'suspend' or 'resume'";
-
-    actionString = getNextParam(whichString);
-    if (!actionString)
+    if (0 == strcmp(itemString, "transmit"))
     {
-      messageReplyF("Must supply session action: %s.\n", actions);
-      return;
-    }
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleTransmitStats, &info, &result))
+        return;
+      if (!result)
+      {
+        messageReply("Transmit queue is not available.\n");
+        return;
+      }
 
-    if (0 == strcmp(actionString, "state"))
+      TransmitQueue::Stats &stats = info.transmit;
+      messageReplyF("Transmit queue: depth=%zu window=%" PRIu32 "us sockets=%s shards=%zu\n",
+                    info.transmitDepth, info.transmitWindow, info.transmitSharedSockets ? "shared" : "session", info.shards);
+      messageReplyF(" queued=%" PRIu64 " sent=%" PRIu64 " failed=%" PRIu64 " discarded=%" PRIu64 "\n",
+                    stats.queued, stats.sent, stats.failed, stats.discarded);
+      messageReplyF(" flushes=%" PRIu64 " full_flushes=%" PRIu64 " send_calls=%" PRIu64 "\n",
+                    stats.flushes, stats.fullFlushes, stats.sendCalls);
+      messageReplyF(" last_depth=%zu max_depth=%zu avg_depth=%.2f\n",
+                    stats.lastDepth, stats.maxDepth,
+                    stats.flushes ? double(stats.queued - stats.discarded) / double(stats.flushes) : 0.0);
+      messageReplyF(" avg_delay=%.1fus max_delay=%" PRIu64 "us\n",
+                    stats.flushes ? double(stats.totalDelay) / double(stats.flushes) : 0.0,
+                    stats.maxDelay);
+      if (info.engineShards != 0)
+      {
+        char buf[256];
+        TransmitEngine::Stats &engine = info.engine;
+        messageReplyF("Transmit thread: shards=%zu active_sessions=%zu updates=%" PRIu64 " wakeups=%" PRIu64 "\n",
+                      info.engineShards, engine.activeSlots, engine.updates, engine.wakeups);
+        messageReplyF(" sent=%" PRIu64 " failed=%" PRIu64 " send_calls=%" PRIu64 "\n",
+                      engine.sent, engine.failed, engine.sendCalls);
+        messageReplyF(" late_us %s\n", engine.lateness.Summary(buf, sizeof(buf)));
+      }
+      if (info.reset)
+        messageReply("Transmit stats reset.\n");
+    }
+    else if (0 == strcmp(itemString, "scheduler"))
     {
-      if (!getSessionStateParams(getNextParam(actionString), info))
+      char buf[256];
+
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleSchedulerStats, &info, &result))
         return;
-      messageReplyF("Attempting to put session(s) into %s state with diagnostic <%s>.\n",
-                    bfd::StateName(info.state),
-                    bfd::DiagString(bfd::Diag::Value(info.setValue)));
+      if (!result)
+      {
+        messageReply("Scheduler is not available.\n");
+        return;
+      }
+
+      Scheduler::Stats &stats = info.scheduler;
+      messageReplyF("Scheduler: shards=%zu iterations=%" PRIu64 " low_starved_iterations=%" PRIu64 "\n",
+                    info.shards, stats.iterations, stats.lowStarvedIterations);
+      messageReplyF(" timer_late_hi_us %s\n", stats.timerLateness[Timer::Priority::Hi].Summary(buf, sizeof(buf)));
+      messageReplyF(" timer_late_low_us %s\n", stats.timerLateness[Timer::Priority::Low].Summary(buf, sizeof(buf)));
+      messageReplyF(" iteration_us %s\n", stats.iterationTime.Summary(buf, sizeof(buf)));
+      messageReplyF(" callbacks_per_iteration %s\n", stats.callbacksPerIteration.Summary(buf, sizeof(buf)));
+      messageReplyF(" low_starvation_iterations %s\n", stats.lowStarvation.Summary(buf, sizeof(buf)));
+      messageReplyF(" clock=%s clock_resolution_ns=%" PRIu64 " clock_reads=%" PRIu64 " clock_reads_per_iteration=%.2f\n",
+                    stats.clockSource == Scheduler::ClockSource::Coarse ? "coarse" : "precise",
+                    stats.clockResolution, stats.clockReads,
+                    stats.iterations ? double(stats.clockReads) / double(stats.iterations) : 0.0);
+      if (stats.clockSource == Scheduler::ClockSource::Coarse)
+        messageReplyF(" clock_lag_us %s\n", stats.clockLag.Summary(buf, sizeof(buf)));
+      messageReplyF(" low_timers_per_iteration=%u low_deadline_us=%u low_budget_timers=%" PRIu64 " low_budget_exhausted=%" PRIu64 " low_deadline_timers=%" PRIu64 "\n",
+                    stats.budget.lowTimersPerIteration, stats.budget.lowTimerDeadline,
+                    stats.lowBudgetTimers, stats.lowBudgetExhausted, stats.lowDeadlineTimers);
+      if (info.schedulerDatagrams)
+        messageReplyF(" datagrams_received=%" PRIu64 " datagrams_sent=%" PRIu64 " datagram_send_failures=%" PRIu64 " receive_buffer_shortages=%" PRIu64 "\n",
+                      stats.datagramsReceived, stats.datagramsSent, stats.datagramSendFailures, stats.receiveBufferShortages);
+      if (info.reset)
+        messageReply("Scheduler stats reset.\n");
     }
-    else if (0 == strcmp(actionString, "reset"))
+    else if (0 == strcmp(itemString, "memory"))
     {
-      info.action = SessionCallbackInfo::Reset;
-      messageReplyF("Attempting to %s session(s).\n", actionString);
+      if (info.reset)
+      {
+        messageReply("Memory stats can not be reset.\n");
+        return;
+      }
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleMemoryStats, &info, &result))
+        return;
+      if (!result)
+      {
+        messageReply("Scheduler is not available.\n");
+        return;
+      }
+
+      Beacon::MemoryStats &memory = info.memory;
+      Scheduler::Stats &stats = info.scheduler;
+      size_t total = memory.sessionBytes + memory.mapBytes + stats.timerBytes;
+      messageReplyF("Memory: shards=%zu sessions=%zu timers=%zu\n", info.shards, memory.sessions, stats.timers);
+      messageReplyF(" session_size=%zu session_bytes=%zu map_bytes=%zu\n", memory.sessionSize, memory.sessionBytes, memory.mapBytes);
+      messageReplyF(" timer_size=%zu timer_bytes=%zu\n", stats.timerSize, stats.timerBytes);
+      messageReplyF(" total_bytes=%zu bytes_per_session=%zu\n", total, memory.sessions ? total / memory.sessions : size_t(0));
     }
-    else if (0 == strcmp(actionString, "suspend"))
+    else if (0 == strcmp(itemString, "packets"))
     {
-      info.action = SessionCallbackInfo::Suspend;
-      messageReplyF("Attempting to %s session(s).\n", actionString);
+      if (!doBeaconOperation(&CommandProcessorImp::doHandlePacketStats, &info, &result))
+        return;
+      if (!result)
+      {
+        messageReply("Scheduler is not available.\n");
+        return;
+      }
+
+      char buf[256];
+      Beacon::PacketStats &packets = info.packets;
+      messageReplyF("Packets: shards=%zu session_packets=%" PRIu64 " fast_path=%" PRIu64 " fast_path_percent=%.1f\n",
+                    info.shards, packets.sessionPackets, packets.fastPathPackets,
+                    packets.sessionPackets ? double(packets.fastPathPackets) * 100.0 / double(packets.sessionPackets) : 0.0);
+      messageReplyF(" untimed=%" PRIu64 "\n", packets.untimedPackets);
+      messageReplyF(" receive_budget=%zu receive_callbacks=%" PRIu64 " budget_hits=%" PRIu64 "\n",
+                    packets.receiveBudget, packets.receiveCallbacks, packets.budgetHits);
+      messageReplyF(" receive_delay_us %s\n", packets.receiveDelay.Summary(buf, sizeof(buf)));
+      if (packets.hasRing)
+        messageReplyF(" ring_received=%" PRIu64 " ring_ignored=%" PRIu64 " ring_dropped=%" PRIu64 "\n",
+                      packets.ring.received, packets.ring.ignored, packets.ring.dropped);
+      if (info.reset)
+        messageReply("Packet stats reset.\n");
     }
-    else if (0 == strcmp(actionString, "resume"))
+    else if (0 == strcmp(itemString, "counters"))
     {
-      info.action = SessionCallbackInfo::Resume;
-      messageReplyF("Attempting to %s session(s).\n", actionString);
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleCounterStats, &info, &result))
+        return;
+      if (!result)
+      {
+        messageReply("Scheduler is not available.\n");
+        return;
+      }
+
+      Beacon::PacketCounters &counters = info.counters;
+      uint64_t discarded = 0;
+      for (size_t reason = 0; reason < Beacon::DiscardReason::Count; reason++)
+        discarded += counters.discards[reason];
+
+      messageReplyF("Counters: shards=%zu received=%" PRIu64 " discarded=%" PRIu64 " sent=%" PRIu64 " sent_by_thread=%" PRIu64 "\n",
+                    info.shards, counters.received, discarded, counters.sent, info.engineSent);
+      messageReplyF(" state_changes=%" PRIu64 " poll_sequences=%" PRIu64 "\n", counters.stateChanges, counters.pollSequences);
+      messageReplyF(" echo_sent=%" PRIu64 " echo_returned=%" PRIu64 " echo_reflected=%" PRIu64 " echo_discarded=%" PRIu64 "\n",
+                    counters.echoSent, counters.echoReturned, counters.echoReflected, counters.echoDiscarded);
+      messageReply(" discards:");
+      for (size_t reason = 0; reason < Beacon::DiscardReason::Count; reason++)
+        messageReplyF(" %s=%" PRIu64, Beacon::DiscardReasonName(Beacon::DiscardReason::Value(reason)), counters.discards[reason]);
+      messageReply("\n");
+      if (info.reset)
+        messageReply("Counters reset. Session counters are not reset.\n");
     }
-    else if (0 == strcmp(actionString, "kill"))
+    else if (0 == strcmp(itemString, "realtime"))
     {
-      info.action = SessionCallbackInfo::Kill;
-      messageReplyF("Attempting to %s session(s).\n", actionString);
+      if (info.reset)
+      {
+        messageReply("Realtime stats can not be reset.\n");
+        return;
+      }
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleRealtimeStats, &info, &result))
+        return;
+      if (!result || info.realtime.empty())
+      {
+        messageReply("Scheduler is not available.\n");
+        return;
+      }
+
+      const Beacon::RealtimeStatus &first = info.realtime.front().second;
+      messageReplyF("Realtime: shards=%zu mlock=%s\n", info.shards,
+                    first.lockMemory ? (first.memoryLocked ? "yes" : "failed") : "no");
+      for (size_t index = 0; index < info.realtime.size(); index++)
+      {
+        const Beacon::RealtimeStatus &status = info.realtime[index].second;
+        messageReplyF(" shard=%zu", info.realtime[index].first);
+        if (status.cpu == -1)
+          messageReply(" cpu=none");
+        else
+          messageReplyF(" cpu=%d pinned=%s", status.cpu, status.pinned ? "yes" : "failed");
+        if (status.fifoPriority == 0)
+          messageReply(" fifo=none");
+        else
+          messageReplyF(" fifo=%d fifo_set=%s", status.fifoPriority, status.fifo ? "yes" : "failed");
+        if (status.reserveSessions == 0)
+          messageReply(" reserved=none");
+        else
+          messageReplyF(" reserved=%zu reserved_ok=%s", status.reserveSessions, status.reserved ? "yes" : "failed");
+        messageReplyF(" sessions=%zu reserved_bytes=%zu storage_bytes=%zu grown=%s\n",
+                      status.sessions, status.reservedBytes, status.storageBytes,
+                      status.reserveSessions != 0 && status.storageBytes > status.reservedBytes ? "yes" : "no");
+      }
     }
-    else if (0 == strcmp(actionString, "set"))
+    else if (0 == strcmp(itemString, "overload"))
     {
-      isSetting = true;
-      if (!getSessionSetParams(getNextParam(actionString), info))
+      if (info.reset)
+      {
+        messageReply("Overload stats can not be reset.\n");
+        return;
+      }
+      if (!doBeaconOperation(&CommandProcessorImp::doHandleOverloadStats, &info, &result))
+        return;
+      if (!result || info.overload.empty())
+      {
+        messageReply("Scheduler is not available.\n");
+        return;
+      }
+
+      const Beacon::OverloadStats &first = info.overload.front().second;
+      if (!first.params.enabled)
+      {
+        messageReply("Overload control is not enabled.\n");
         return;
+      }
+      messageReplyF("Overload: shards=%zu lateness_limit=%s us busy_limit=%u%% backoff=%s us hold=%u ms\n",
+                    info.shards, FormatInteger(first.params.latenessUs), first.params.busyPercent,
+                    FormatInteger(first.params.backoffInterval), first.params.holdMs);
+      for (size_t index = 0; index < info.overload.size(); index++)
+      {
+        const Beacon::OverloadStats &stats = info.overload[index].second;
+        messageReplyF(" shard=%zu overloaded=%s lateness_p99=%s us busy=%u%% overloads=%" PRIu64 " recoveries=%" PRIu64
+                      " backoffs=%" PRIu64 " restores=%" PRIu64 " low_priority=%zu backed_off=%zu\n",
+                      info.overload[index].first, stats.overloaded ? "yes" : "no", FormatInteger(stats.latenessP99),
+                      stats.busyPercent, stats.overloads, stats.recoveries, stats.backoffs, stats.restores,
+                      stats.lowPriority, stats.backedOff);
+      }
     }
     else
-    {
-      messageReplyF("Unrecognized session action <%s> use: %s.\n", actionString, actions);
-      return;
-    }
+      messageReplyF("Unknown stats item <%s>.\n", itemString);
+  }
 
-    if (info.defSetting && !isSetting)
+  /**
+   * "subscribe" command.
+   * Format 'subscribe' ['json'] ['params']
+   * Keeps the connection open, and sends a line for each session state change.
+   * With 'params', changes to the transmit interval and detection time are also
+   * sent.
+   */
+  void handle_Subscribe(const char *message)
+  {
+    const char *param;
+    int types = SessionEvent::Type::State | SessionEvent::Type::Removed;
+    bool json = false;
+
+    if (m_inBatch || m_client->framed)
     {
-      messageReply("'new' can only be used with 'set'.\n");
+      messageReply("'subscribe' must be the only command, and can not be used on a framed connection.\n");
       return;
     }
 
-    if (doBeaconOperation(&CommandProcessorImp::doHandleSession, &info, &result))
+    for (param = getNextParam(message); param; param = getNextParam(param))
     {
-      if (!result)
+      if (0 == strcmp("json", param))
+        json = true;
+      else if (0 == strcmp("params", param))
+        types |= SessionEvent::Type::Parameters;
+      else
       {
-        reportNoSuchSession(info.sessionId);
+        messageReplyF("Unknown subscribe setting <%s>. Use 'json' or 'params'.\n", param);
         return;
       }
     }
+
+    if (m_subscriberCount >= MaxSubscribers)
+    {
+      messageReplyF("Too many subscribers. The limit is %zu.\n", MaxSubscribers);
+      return;
+    }
+
+    Raii<SessionEventQueue>::Delete queue(new SessionEventQueue(SessionEventQueue::DefaultCapacity, types, m_wakeWrite));
+    if (!m_beacon->GetEventHub()->Subscribe(queue))
+    {
+      messageReply("Unable to subscribe. Low memory.\n");
+      return;
+    }
+
+    if (json)
+      messageReply("{\"event\":\"subscribed\"}\n");
+    else
+      messageReply("Subscribed to session events.\n");
+
+    // The connection stays open for events. See sendClientOutput().
+    m_client->queue = queue.Detach();
+    m_client->json = json;
+    m_subscriberCount++;
   }
 
   intptr_t doHandleConsumeBeacon(Beacon *ATTR_UNUSED(beacon), void *userdata)
@@ -2049,11 +4828,84 @@ protected:
 
   /**
    * Sends message back to control. Message must be verified for length.
+   *
+   * @return bool - false if the message could not be sent.
+   */
+  bool doMessageReply(const char *reply, size_t length)
+  {
+    // While handling a batch, replies are held until the operations have run.
+    if (m_inBatch && !m_batch.empty())
+    {
+      m_batch.back().output.append(reply, length);
+      return true;
+    }
+
+    // The reply is held by the client, and sent by sendClientOutput() as the
+    // socket allows, so a slow reader does not hold up other clients.
+    if (!m_client)
+      return false;
+    if (m_client->framed)
+      addFrame(m_client, ControlFrameType::Data, reply, length);
+    else
+      m_client->output.Append(reply, length);
+    return true;
+  }
+
+  static const size_t StreamFlushSize = 16 * 1024;
+
+  /**
+   * Adds data to a reply that may be large, or binary. The data is added to the
+   * reply in large blocks, without formatting it all first. Call
+   * beginStreamReply() first, and endStreamReply() when done.
+   */
+  void streamReply(const void *data, size_t length)
+  {
+    if (m_streamFailed)
+      return;
+    m_streamBuffer.append(reinterpret_cast<const char *>(data), length);
+    if (m_streamBuffer.size() >= StreamFlushSize)
+      flushStreamReply();
+  }
+
+  void beginStreamReply()
+  {
+    m_streamBuffer.clear();
+    m_streamBuffer.reserve(StreamFlushSize + MaxReplyLineSize);
+    m_streamFailed = false;
+  }
+
+  /**
+   * @return bool - false if some of the reply could not be sent.
+   */
+  bool endStreamReply()
+  {
+    flushStreamReply();
+    return !m_streamFailed;
+  }
+
+  void flushStreamReply()
+  {
+    if (!m_streamFailed && !m_streamBuffer.empty()
+        && !doMessageReply(m_streamBuffer.data(), m_streamBuffer.size()))
+    {
+      gLog.Optional(Log::Command, "Failed to send reply. Remaining reply discarded.");
+      m_streamFailed = true;
+    }
+    m_streamBuffer.clear();
+  }
+
+  /**
+   * Formatted reply, using streamReply().
    */
-  void doMessageReply(const char *reply, size_t length)
+  void streamReplyF(const char *format, ...) ATTR_FORMAT(printf, 2, 3)
   {
-    // TODO timeout? Check for shutdown?
-    m_replySocket.Send(reply, length);
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(&m_inReplyBuffer.front(), m_inReplyBuffer.size(), format, args);
+    va_end(args);
+    if (length < 0)
+      return;
+    streamReply(&m_inReplyBuffer.front(), min(size_t(length), m_inReplyBuffer.size() - 1));
   }
 
 
@@ -2082,9 +4934,35 @@ protected:
   {
     va_list args;
     va_start(args, format);
-    vsnprintf(&m_inReplyBuffer.front(), m_inReplyBuffer.size(), format, args);
+    if (m_client && !(m_inBatch && !m_batch.empty()))
+      clientReplyV(m_client, format, args);
+    else
+    {
+      vsnprintf(&m_inReplyBuffer.front(), m_inReplyBuffer.size(), format, args);
+      messageReply(&m_inReplyBuffer.front());
+    }
     va_end(args);
-    messageReply(&m_inReplyBuffer.front());
+  }
+
+  /**
+   * Formats a reply straight into the client's output, as doMessageReply()
+   * would add it.
+   */
+  void clientReplyV(Client *client, const char *format, va_list args)
+  {
+    if (client->framed && !client->frameHeader)
+      addFrame(client, ControlFrameType::Data, NULL, 0);
+
+    int length = client->output.AppendV(MaxReplyLineSize, format, args);
+    if (length < 0)
+      return;
+    if (size_t(length) > MaxReplyLineSize)
+    {
+      gLog.Message(Log::Command, "Warning. Truncating message reply from %d to %zu.", length, MaxReplyLineSize);
+      length = int(MaxReplyLineSize);
+    }
+    if (client->frameHeader)
+      growFrame(client, size_t(length));
   }
 
   /**
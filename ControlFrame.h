@@ -0,0 +1,45 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Framing for control connections that carry more than one message.
+
+   A framed connection starts with MagicFramedNumber, instead of
+   MagicMessageNumber. After that, the control sends any number of Request
+   frames, without waiting for replies. Each holds the same commands as an
+   unframed message, but without the magic number. The beacon handles them in
+   order, and answers each with zero or more Data frames, holding the reply
+   text, followed by an End frame. Reply frames carry the tag of the request.
+   The control closes the connection when it is done.
+
+ */
+#pragma once
+
+#include "common.h"
+
+struct ControlFrameType
+{
+  enum Value
+  {
+    Request = 1,  // control->beacon. Payload is the commands.
+    Data = 2,     // beacon->control. Payload is part of the reply.
+    End = 3,      // beacon->control. No payload. The reply is complete.
+  };
+};
+
+// All values are in network order.
+#pragma pack(push, 1)
+struct ControlFrameHeader
+{
+  uint32_t length;  // Length of the payload that follows.
+  uint32_t tag;     // Chosen by the control for a Request. Copied to the replies.
+  uint8_t type;     // ControlFrameType
+  uint8_t reserved[3];
+};
+#pragma pack(pop)
+
+// Largest Request payload. Reply frames may be larger.
+const size_t MaxControlRequestSize = MaxCommandSize - sizeof(uint32_t);
@@ -0,0 +1,112 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "DiscriminatorAllocator.h"
+#include "utils.h"
+
+using namespace std;
+
+const uint32_t DiscriminatorAllocator::DefaultQuarantineMs;
+
+DiscriminatorAllocator::DiscriminatorAllocator() :
+   m_key(0),
+   m_shardIndex(0),
+   m_shardCount(1),
+   m_valueCount(0),
+   m_valueMask(0),
+   m_valueShift(0),
+   m_nextValue(0),
+   m_quarantineMs(DefaultQuarantineMs)
+{
+}
+
+void DiscriminatorAllocator::Init(uint32_t key, size_t shardIndex, size_t shardCount)
+{
+  if (!LogVerify(shardCount > 0 && shardIndex < shardCount))
+  {
+    shardIndex = 0;
+    shardCount = 1;
+  }
+
+  m_key = key;
+  m_shardIndex = uint32_t(shardIndex);
+  m_shardCount = uint32_t(shardCount);
+  m_nextValue = 0;
+  m_released.clear();
+
+  // Discriminator is (value + 1) * shardCount + shardIndex, which is never 0,
+  // and must fit in 32 bits.
+  m_valueCount = (UINT32_MAX - m_shardIndex) / m_shardCount;
+
+  uint32_t bits = 1;
+  while (bits < 32 && (uint32_t(1) << bits) < m_valueCount)
+    bits++;
+  m_valueMask = bits == 32 ? UINT32_MAX : (uint32_t(1) << bits) - 1;
+  m_valueShift = (bits + 1) / 2;
+}
+
+uint32_t DiscriminatorAllocator::Allocate(const TimeSpec &now)
+{
+  uint32_t value;
+
+  if (!LogVerify(m_valueCount != 0))
+    return 0;
+
+  if (!m_released.empty())
+  {
+    const Released &oldest = m_released.front();
+    if (now - oldest.releaseTime >= TimeSpec(TimeSpec::Millisec, m_quarantineMs))
+    {
+      uint32_t disc = oldest.disc;
+      m_released.pop_front();
+      return disc;
+    }
+  }
+
+  if (m_nextValue == m_valueCount)
+  {
+    gLog.LogError("No discriminators available. %zu are in quarantine.", m_released.size());
+    return 0;
+  }
+
+  value = permute(m_nextValue++);
+  return (value + 1) * m_shardCount + m_shardIndex;
+}
+
+void DiscriminatorAllocator::Resume(uint32_t nextValue)
+{
+  if (!LogVerify(nextValue <= m_valueCount))
+    return;
+  m_nextValue = max(m_nextValue, nextValue);
+}
+
+void DiscriminatorAllocator::Release(uint32_t disc, const TimeSpec &now)
+{
+  if (!LogVerify(disc != 0 && disc % m_shardCount == m_shardIndex))
+    return;
+  m_released.push_back(Released(disc, now));
+}
+
+/**
+ * A keyed bijection on [0, m_valueCount). Each step is reversible within the
+ * bits of m_valueMask, so the whole is a bijection on [0, m_valueMask]. Results
+ * outside the range are permuted again ("cycle walking"), which keeps it a
+ * bijection on the range. Since m_valueMask is less than twice m_valueCount,
+ * this takes less than two rounds on average.
+ */
+uint32_t DiscriminatorAllocator::permute(uint32_t value) const
+{
+  do
+  {
+    value = (value ^ m_key) & m_valueMask;
+    value = (value * 0x9e3779b1) & m_valueMask;
+    value ^= value >> m_valueShift;
+    value = (value * 0x85ebca6b) & m_valueMask;
+    value ^= value >> m_valueShift;
+  } while (value >= m_valueCount);
+
+  return value;
+}
@@ -0,0 +1,117 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Hands out local discriminators for sessions.
+
+ */
+#pragma once
+
+#include "TimeSpec.h"
+#include <deque>
+
+/**
+ * Allocates unique, non-zero local discriminators in constant time, without
+ * looking at the sessions that already exist.
+ *
+ * Each shard has its own allocator. Its discriminators are all equal to the
+ * shard index, modulo the shard count, so that a packet can be routed to the
+ * shard by its "your discriminator" alone.
+ *
+ * New values come from a keyed permutation of a counter, so they are unique,
+ * but hard to guess. Released values are held for a quarantine period before
+ * they are reused, so that late packets for a deleted session do not match a
+ * new one. Released values are reused, oldest first, once the quarantine has
+ * passed, so that the counter is only used when the number of sessions grows.
+ *
+ * Not thread safe.
+ */
+class DiscriminatorAllocator
+{
+public:
+  static const uint32_t DefaultQuarantineMs = 60000;
+
+  DiscriminatorAllocator();
+
+  /**
+   * Sets the discriminators that will be handed out. Must be called before
+   * Allocate().
+   *
+   * @param key [in] - Random value that selects the order of discriminators.
+   * @param shardIndex [in] - Every discriminator is shardIndex modulo shardCount.
+   * @param shardCount [in] - At least 1.
+   */
+  void Init(uint32_t key, size_t shardIndex, size_t shardCount);
+
+  /**
+   * Sets how long after Release() a discriminator may not be reused. Applies to
+   * discriminators that are already released.
+   */
+  void SetQuarantine(uint32_t quarantineMs) { m_quarantineMs = quarantineMs;}
+
+  /**
+   * Gets a discriminator that is not in use, and was not released during the
+   * quarantine.
+   *
+   * @param now [in] - The current monotonic time.
+   *
+   * @return uint32_t - The discriminator. 0 if none are available.
+   */
+  uint32_t Allocate(const TimeSpec &now);
+
+  /**
+   * Returns a discriminator from Allocate(), for reuse after the quarantine.
+   *
+   * @param now [in] - The current monotonic time.
+   */
+  void Release(uint32_t disc, const TimeSpec &now);
+
+  /**
+   * @return uint32_t - The key from Init().
+   */
+  uint32_t GetKey() const { return m_key;}
+
+  /**
+   * @return uint32_t - How far the counter for new values has gone. With the
+   *         Init() values, this is all that is needed to go on after a restart
+   *         without handing out a discriminator that is still in use. See
+   *         Resume().
+   */
+  uint32_t GetNextValue() const { return m_nextValue;}
+
+  /**
+   * Continues from GetNextValue() of an allocator that had the same Init()
+   * values, such as in a previous process. Discriminators that it had released,
+   * but not yet reused, are not carried over, so they are never handed out
+   * again.
+   */
+  void Resume(uint32_t nextValue);
+
+  /**
+   * @return size_t - The number of released discriminators waiting for reuse.
+   */
+  size_t GetReleasedCount() const { return m_released.size();}
+
+private:
+  struct Released
+  {
+    Released(uint32_t disc, const TimeSpec &releaseTime) : disc(disc), releaseTime(releaseTime) { }
+    uint32_t disc;
+    TimeSpec releaseTime;
+  };
+
+  uint32_t permute(uint32_t value) const;
+
+  uint32_t m_key;
+  uint32_t m_shardIndex;
+  uint32_t m_shardCount;
+  uint32_t m_valueCount; // Number of discriminators for this shard.
+  uint32_t m_valueMask;  // Smallest 2^n - 1 that is at least m_valueCount - 1.
+  uint32_t m_valueShift; // Half the bits in m_valueMask, for mixing.
+  uint32_t m_nextValue;  // Counter for values that have never been used.
+  uint32_t m_quarantineMs;
+  std::deque<Released> m_released; // In the order released.
+};
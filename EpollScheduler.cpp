@@ -0,0 +1,147 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "config.h"
+#ifdef USE_EPOLL_SCHEDULER
+
+#include "common.h"
+#include "EpollScheduler.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+EpollScheduler::EpollScheduler() : SchedulerBase(),
+   m_totalEvents(0),
+   m_foundEvents(0),
+   m_nextCheckEvent(0),
+   m_events(m_totalEvents + 1)
+{
+  m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll < 0)
+    gLog.Message(Log::Critical, "Failed to create Scheduler epoll. Can not proceed.");
+}
+
+EpollScheduler::~EpollScheduler()
+{
+  if (m_epoll >= 0)
+    ::close(m_epoll);
+}
+
+
+bool EpollScheduler::waitForEvents(const struct timespec &timeout)
+{
+  int msTimeout;
+
+  m_nextCheckEvent = 0;
+
+  // epoll_wait only has millisecond resolution. Round up, so that we do not
+  // spin waking up just before a timer is due.
+  if (timeout.tv_sec >= (INT32_MAX / 1000) - 1)
+    msTimeout = INT32_MAX;
+  else
+    msTimeout = int(timeout.tv_sec * 1000 + (timeout.tv_nsec + TimeSpec::NSecPerMs - 1) / TimeSpec::NSecPerMs);
+
+  m_foundEvents = ::epoll_wait(m_epoll, &m_events.front(), m_events.size(), msTimeout);
+  if (m_foundEvents < 0)
+  {
+    m_foundEvents = 0;
+    if (errno != EINTR)
+      gLog.LogError("epoll_wait failed: %s", ErrnoToString());
+  }
+  else if (m_foundEvents == 0)
+  {
+    if (timeout.tv_nsec != 0 || timeout.tv_sec != 0)
+      gLog.Optional(Log::TimerDetail, "epoll timeout");
+  }
+  else
+    gLog.Optional(Log::TimerDetail, "epoll received %d events", m_foundEvents);
+
+  return m_foundEvents > 0;
+}
+
+int EpollScheduler::getNextSocketEvent()
+{
+  if (!LogVerify(m_foundEvents <= int(m_events.size())))
+    m_foundEvents = m_events.size();
+
+  for (; m_nextCheckEvent < m_foundEvents; m_nextCheckEvent++)
+  {
+    // EPOLLERR and EPOLLHUP are always reported. Pass them on as read events,
+    // so that the callback sees the error on its next read.
+    if (m_events[m_nextCheckEvent].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+      return m_events[m_nextCheckEvent++].data.fd;
+    else
+    {
+      // We should only have socket read events
+      gLog.LogError("Unexpected epoll event on %d got result of %x",
+                    m_events[m_nextCheckEvent].data.fd,
+                    m_events[m_nextCheckEvent].events);
+    }
+  }
+
+  return -1;
+}
+
+bool EpollScheduler::watchSocket(int fd)
+{
+  struct epoll_event change;
+
+  if (!LogVerify(m_epoll != -1))
+    return false;
+
+  memset(&change, 0, sizeof(change));
+  change.events = EPOLLIN;
+  change.data.fd = fd;
+  if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &change) < 0)
+  {
+    gLog.ErrnoError(errno, "Failed to add socket to epoll");
+    return false;
+  }
+
+  m_totalEvents++;
+  resizeEvents();
+
+  return true;
+}
+
+void EpollScheduler::unWatchSocket(int fd)
+{
+  struct epoll_event change;
+
+  LogAssert(m_epoll != -1);
+
+  // Non-NULL event for pre 2.6.9 kernels.
+  memset(&change, 0, sizeof(change));
+  if (::epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, &change) < 0)
+    gLog.ErrnoError(errno, "Failed to remove socket from epoll");
+  else
+  {
+    if (m_totalEvents > 0)
+      m_totalEvents--;
+    resizeEvents();
+  }
+}
+
+/**
+ * resizes m_events.
+ *
+ * @throw - May throw.
+ *
+ */
+void EpollScheduler::resizeEvents()
+{
+  // Can not resize if we may be using it.
+  if (m_totalEvents < m_foundEvents)
+    return;
+
+  m_events.resize(m_totalEvents + 1);
+}
+
+
+#endif  // USE_EPOLL_SCHEDULER
@@ -0,0 +1,54 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+  Scheduler implementation for system with epoll (Linux).
+
+ */
+#pragma once
+
+#include "config.h"
+
+#ifdef USE_EPOLL_SCHEDULER
+
+#include "SchedulerBase.h"
+#include <sys/epoll.h>
+#include <vector>
+
+class EpollScheduler : public SchedulerBase
+{
+
+public:
+  /**
+   * Constructor
+   * The thread that calls this is considered the "main thread". See
+   * Scheduler::IsMainThread().
+   */
+  EpollScheduler();
+  virtual ~EpollScheduler();
+
+protected:
+
+  /** Overrides from  SchedulerBase  */
+  virtual bool watchSocket(int fd);
+  virtual void unWatchSocket(int fd);
+  virtual bool waitForEvents(const struct timespec &timeout);
+  virtual int getNextSocketEvent();
+
+
+private:
+
+  void resizeEvents();
+
+  int m_totalEvents;
+  int m_epoll;
+  int m_foundEvents; // from last waitForEvents()
+  int m_nextCheckEvent;  // for getNextSocketEvent
+  std::vector<struct epoll_event> m_events; // from last waitForEvents()
+};
+
+
+#endif  // USE_EPOLL_SCHEDULER
@@ -0,0 +1,241 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Open addressing hash index of pointers.
+
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <new>
+
+/**
+ * A hash table of item pointers, stored in a single array, using Robin Hood
+ * linear probing. Each slot holds only the 32 bit hash and the pointer, so a
+ * lookup usually touches one or two cache lines of the table, plus the item that
+ * matches. Keys are not stored. They are compared through the item, so the
+ * item's key must not change while it is in the index.
+ *
+ * Traits must provide:
+ *   typedef ... Key;
+ *   static const bool UniqueHash; // true if different keys never share a hash.
+ *   static uint32_t Hash(const Key &key);
+ *   static bool Matches(T *item, const Key &key);
+ *
+ * With UniqueHash the item is not read to compare keys, which saves a cache
+ * miss for each lookup.
+ *
+ * Not thread safe.
+ */
+template<typename T, typename Traits> class FlatIndex
+{
+public:
+  typedef typename Traits::Key Key;
+
+  FlatIndex() : m_slots(NULL), m_mask(0), m_size(0) { }
+  ~FlatIndex() { delete [] m_slots;}
+
+  /**
+   * @return T* - The item with the key, or NULL.
+   */
+  T* Find(const Key &key) const
+  {
+    size_t index = findIndex(key, Traits::Hash(key));
+    return index == NotFound ? NULL : m_slots[index].item;
+  }
+
+  /**
+   * Adds the item, replacing any item with the same key.
+   *
+   * @throw - std::bad_alloc
+   *
+   * @param key [in] - Must be the key of item, by the time of the next Find().
+   * @param item [in] - May not be NULL. Not owned.
+   */
+  void Insert(const Key &key, T *item)
+  {
+    uint32_t hash = Traits::Hash(key);
+    size_t index = findIndex(key, hash);
+    if (index != NotFound)
+    {
+      m_slots[index].item = item;
+      return;
+    }
+
+    if (m_size + 1 > capacity())
+      resize(max(MinSlots, (m_mask + 1) * 2));
+    place(hash, item);
+    m_size++;
+  }
+
+  /**
+   * Removes the item with the key.
+   *
+   * @return bool - false if there was none.
+   */
+  bool Erase(const Key &key)
+  {
+    size_t index = findIndex(key, Traits::Hash(key));
+    if (index == NotFound)
+      return false;
+
+    // Shift the following items back, so that no tombstone is needed.
+    size_t next = (index + 1) & m_mask;
+    while (m_slots[next].item && distance(next) != 0)
+    {
+      m_slots[index] = m_slots[next];
+      index = next;
+      next = (next + 1) & m_mask;
+    }
+    m_slots[index].item = NULL;
+    m_size--;
+    return true;
+  }
+
+  /**
+   * Grows the table so that it can hold count items without growing again.
+   *
+   * @throw - std::bad_alloc
+   */
+  void Reserve(size_t count)
+  {
+    size_t slots = MinSlots;
+    while (slots / 2 < count)
+      slots *= 2;
+    if (slots > m_mask + 1)
+      resize(slots);
+  }
+
+  size_t Size() const { return m_size;}
+
+  /**
+   * @return size_t - Bytes used by the table.
+   */
+  size_t GetMemoryBytes() const { return m_slots ? (m_mask + 1) * sizeof(Slot) : 0;}
+
+  /**
+   * For visiting every item. Items are in no particular order.
+   *
+   * @return size_t - The number of slots. Use with GetSlot().
+   */
+  size_t SlotCount() const { return m_slots ? m_mask + 1 : 0;}
+
+  /**
+   * @param index [in] - Less than SlotCount().
+   *
+   * @return T* - The item in the slot, or NULL if it is empty.
+   */
+  T* GetSlot(size_t index) const { return m_slots[index].item;}
+
+private:
+  static const size_t MinSlots = 16; // Must be a power of two.
+  static const size_t NotFound = size_t(-1);
+
+  struct Slot
+  {
+    uint32_t hash;
+    T *item; // NULL for an empty slot.
+  };
+
+  static size_t max(size_t a, size_t b) { return a > b ? a : b;}
+
+  /**
+   * Maximum items before growing. Probes stay short at much higher loads, but
+   * lookups of keys that are not in cache suffer from each extra probe, since a
+   * mispredicted end of probe stalls the loads that follow. At half full most
+   * lookups take a single probe.
+   */
+  size_t capacity() const { return m_slots ? (m_mask + 1) / 2 : 0;}
+
+  /**
+   * @return size_t - How far the item in the slot is from its preferred slot.
+   */
+  size_t distance(size_t index) const { return (index - (m_slots[index].hash & m_mask)) & m_mask;}
+
+  size_t findIndex(const Key &key, uint32_t hash) const
+  {
+    if (!m_slots)
+      return NotFound;
+
+    size_t index = hash & m_mask;
+    for (size_t dist = 0;; dist++)
+    {
+      const Slot &slot = m_slots[index];
+      // Once we pass items that are closer to home than we would be, the key
+      // can not be further along.
+      if (!slot.item || distance(index) < dist)
+        return NotFound;
+      if (slot.hash == hash && (Traits::UniqueHash || Traits::Matches(slot.item, key)))
+        return index;
+      index = (index + 1) & m_mask;
+    }
+  }
+
+  /**
+   * Adds an item that is not in the table. There must be room.
+   */
+  void place(uint32_t hash, T *item)
+  {
+    Slot carry = { hash, item};
+    size_t index = hash & m_mask;
+
+    for (size_t dist = 0;; dist++)
+    {
+      Slot &slot = m_slots[index];
+      if (!slot.item)
+      {
+        slot = carry;
+        return;
+      }
+
+      // Take the place of an item that is closer to its home, and carry it on.
+      size_t slotDist = distance(index);
+      if (slotDist < dist)
+      {
+        Slot temp = slot;
+        slot = carry;
+        carry = temp;
+        dist = slotDist;
+      }
+      index = (index + 1) & m_mask;
+    }
+  }
+
+  /**
+   * @throw - std::bad_alloc
+   *
+   * @param slots [in] - Power of two. Must hold m_size.
+   */
+  void resize(size_t slots)
+  {
+    Slot *oldSlots = m_slots;
+    size_t oldCount = SlotCount();
+
+    m_slots = new Slot[slots];
+    memset(m_slots, 0, slots * sizeof(Slot));
+    m_mask = slots - 1;
+
+    for (size_t index = 0; index < oldCount; index++)
+    {
+      if (oldSlots[index].item)
+        place(oldSlots[index].hash, oldSlots[index].item);
+    }
+    delete [] oldSlots;
+  }
+
+  FlatIndex(const FlatIndex &src); // never use this.
+  FlatIndex& operator=(const FlatIndex &src); // never use this.
+
+  Slot *m_slots;
+  size_t m_mask; // Slot count - 1
+  size_t m_size;
+};
+
+template<typename T, typename Traits> const size_t FlatIndex<T, Traits>::MinSlots;
+template<typename T, typename Traits> const size_t FlatIndex<T, Traits>::NotFound;
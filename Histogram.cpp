@@ -0,0 +1,112 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "Histogram.h"
+#include <string.h>
+
+const size_t Histogram::SubBucketBits;
+const size_t Histogram::SubBucketCount;
+const size_t Histogram::BucketCount;
+
+void Histogram::Reset()
+{
+  memset(m_buckets, 0, sizeof(m_buckets));
+  m_count = 0;
+  m_sum = 0;
+  m_min = UINT64_MAX;
+  m_max = 0;
+}
+
+void Histogram::Merge(const Histogram &other)
+{
+  for (size_t index = 0; index < BucketCount; index++)
+    m_buckets[index] += other.m_buckets[index];
+  m_count += other.m_count;
+  m_sum += other.m_sum;
+  if (other.m_max > m_max)
+    m_max = other.m_max;
+  if (other.m_min < m_min)
+    m_min = other.m_min;
+}
+
+bool Histogram::Subtract(const Histogram &earlier)
+{
+  if (earlier.m_count > m_count)
+    return false;
+  for (size_t index = 0; index < BucketCount; index++)
+  {
+    if (earlier.m_buckets[index] > m_buckets[index])
+      return false;
+  }
+
+  for (size_t index = 0; index < BucketCount; index++)
+    m_buckets[index] -= earlier.m_buckets[index];
+  m_count -= earlier.m_count;
+  m_sum -= earlier.m_sum;
+  return true;
+}
+
+uint64_t Histogram::Percentile(double percent) const
+{
+  if (m_count == 0)
+    return 0;
+
+  if (percent < 0)
+    percent = 0;
+  else if (percent > 100)
+    percent = 100;
+
+  uint64_t target = uint64_t(double(m_count) * percent / 100.0 + 0.5);
+  if (target == 0)
+    target = 1;
+
+  uint64_t seen = 0;
+  for (size_t index = 0; index < BucketCount; index++)
+  {
+    seen += m_buckets[index];
+    if (seen >= target)
+    {
+      uint64_t bound = bucketUpperBound(index);
+      return bound < m_max ? bound : m_max;
+    }
+  }
+
+  return m_max;
+}
+
+const char* Histogram::Summary(char *outBuf, size_t bufSize) const
+{
+  snprintf(outBuf, bufSize, "count=%" PRIu64 " min=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64
+           " p99=%" PRIu64 " p99.9=%" PRIu64 " max=%" PRIu64 " mean=%.2f",
+           Count(), Min(), Percentile(50), Percentile(90), Percentile(99), Percentile(99.9),
+           Max(), Mean());
+  return outBuf;
+}
+
+/**
+ * Values below SubBucketCount each have their own bucket. Larger values use
+ * their highest bit to pick a group, and the next SubBucketBits bits to pick the
+ * bucket within the group.
+ */
+size_t Histogram::bucketIndex(uint64_t value)
+{
+  if (value < SubBucketCount)
+    return size_t(value);
+
+  size_t highBit = 63 - size_t(__builtin_clzll(value));
+  size_t shift = highBit - SubBucketBits;
+  return (shift + 1) * SubBucketCount + size_t((value >> shift) & (SubBucketCount - 1));
+}
+
+uint64_t Histogram::bucketUpperBound(size_t index)
+{
+  if (index < SubBucketCount)
+    return index;
+
+  size_t shift = index / SubBucketCount - 1;
+  uint64_t lower = uint64_t(SubBucketCount + index % SubBucketCount) << shift;
+  return lower + ((uint64_t(1) << shift) - 1);
+}
@@ -0,0 +1,120 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Fixed size, log-linear histogram for latency measurements.
+
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Records unsigned values into log-linear buckets, in the style of HDR
+ * histograms. Values below SubBucketCount are exact. Above that each power of
+ * two is split into SubBucketCount buckets, so that results are accurate to
+ * within 1/SubBucketCount (12.5%). Recording is constant time, and never
+ * allocates.
+ *
+ * Not thread safe.
+ */
+class Histogram
+{
+public:
+  static const size_t SubBucketBits = 3;
+  static const size_t SubBucketCount = 1 << SubBucketBits;
+  static const size_t BucketCount = (64 - SubBucketBits + 1) * SubBucketCount;
+
+  Histogram() { Reset();}
+
+  /**
+   * Adds a single value.
+   */
+  void Record(uint64_t value)
+  {
+    m_buckets[bucketIndex(value)]++;
+    m_count++;
+    m_sum += value;
+    if (value > m_max)
+      m_max = value;
+    if (value < m_min)
+      m_min = value;
+  }
+
+  /**
+   * Removes all values.
+   */
+  void Reset();
+
+  /**
+   * Adds all the values from another histogram.
+   */
+  void Merge(const Histogram &other);
+
+  /**
+   * Removes the values in an earlier copy of this histogram, leaving those
+   * recorded since. Min() and Max() are not changed, so they may include older
+   * values.
+   *
+   * @return bool - false, with nothing changed, if earlier is not an earlier
+   *         copy, such as after Reset().
+   */
+  bool Subtract(const Histogram &earlier);
+
+  uint64_t Count() const { return m_count;}
+
+  /**
+   * @return uint64_t - The total of the recorded values.
+   */
+  uint64_t Sum() const { return m_sum;}
+
+  /**
+   * @return uint64_t - The smallest value recorded, or 0 if there are none.
+   */
+  uint64_t Min() const { return m_count ? m_min : 0;}
+
+  /**
+   * @return uint64_t - The largest value recorded, or 0 if there are none.
+   */
+  uint64_t Max() const { return m_max;}
+
+  /**
+   * @return double - The mean of the recorded values, or 0 if there are none.
+   */
+  double Mean() const { return m_count ? double(m_sum) / double(m_count) : 0;}
+
+  /**
+   * Gets the value below which the given percent of recorded values fall. The
+   * result is the upper bound of the bucket, but never more than Max().
+   *
+   * @param percent [in] - 0 to 100.
+   *
+   * @return uint64_t - 0 if there are no values.
+   */
+  uint64_t Percentile(double percent) const;
+
+  /**
+   * Formats a short summary, such as "count=10 min=1 p50=3 p90=7 p99=9
+   * p99.9=9 max=9 mean=3.50".
+   *
+   * @param outBuf [out] - Where to put the summary.
+   * @param bufSize [in] - The size of outBuf.
+   *
+   * @return const char* - outBuf.
+   */
+  const char* Summary(char *outBuf, size_t bufSize) const;
+
+private:
+  static size_t bucketIndex(uint64_t value);
+  static uint64_t bucketUpperBound(size_t index);
+
+  uint64_t m_buckets[BucketCount];
+  uint64_t m_count;
+  uint64_t m_sum;
+  uint64_t m_min;
+  uint64_t m_max;
+};
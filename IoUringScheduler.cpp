@@ -0,0 +1,1027 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "config.h"
+#ifdef USE_IOURING_SCHEDULER
+
+#include "common.h"
+#include "IoUringScheduler.h"
+#include "utils.h"
+#include "Atomic.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+const unsigned IoUringScheduler::RingEntries;
+const unsigned IoUringScheduler::DatagramBuffers;
+const size_t IoUringScheduler::MaxSendSize;
+const uint32_t IoUringScheduler::MaxGeneration;
+const uint64_t IoUringScheduler::RemoveUserData;
+const uint64_t IoUringScheduler::ProbeUserData;
+const uint64_t IoUringScheduler::SendUserData;
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *params)
+{
+  return int(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int ioUringEnter(int ring, unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg, size_t argSize)
+{
+  return int(::syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, arg, argSize));
+}
+
+static int ioUringRegister(int ring, unsigned opcode, void *arg, unsigned argCount)
+{
+  return int(::syscall(__NR_io_uring_register, ring, opcode, arg, argCount));
+}
+
+
+IoUringScheduler::IoUringScheduler() : SchedulerBase(),
+   m_ring(-1),
+   m_sqRing(MAP_FAILED),
+   m_sqRingSize(0),
+   m_cqRing(MAP_FAILED),
+   m_cqRingSize(0),
+   m_sqes(NULL),
+   m_sqesSize(0),
+   m_sqEntries(0),
+   m_sqHead(NULL),
+   m_sqTail(NULL),
+   m_sqFlags(NULL),
+   m_sqMask(0),
+   m_cqHead(NULL),
+   m_cqTail(NULL),
+   m_cqMask(0),
+   m_cqes(NULL),
+   m_toSubmit(0),
+   m_nextGeneration(1),
+   m_nextReady(0),
+   m_handlesDatagrams(false),
+   m_nextGroup(0),
+   m_sendsInFlight(0),
+   m_datagramsReceived(0),
+   m_datagramsSent(0),
+   m_datagramSendFailures(0),
+   m_receiveBufferShortages(0)
+{
+  if (!openRing())
+    closeRing();
+  else
+    m_handlesDatagrams = probeDatagrams();
+}
+
+IoUringScheduler::~IoUringScheduler()
+{
+  if (m_ring != -1)
+    drain();
+  closeRing();
+
+  // The kernel may still be using the memory if drain() gave up, so it is
+  // left alone then.
+  if (!m_retired.empty() || m_sendsInFlight != 0)
+  {
+    gLog.LogWarn("io_uring requests did not finish. Leaving their memory.");
+    return;
+  }
+
+  for (vector<SendSlot *>::iterator it = m_sendSlots.begin(); it != m_sendSlots.end(); ++it)
+    delete *it;
+}
+
+/**
+ * Creates the ring, and maps it.
+ *
+ * @return bool - false on failure. Call closeRing() to clean up.
+ */
+bool IoUringScheduler::openRing()
+{
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  // Room for a poll completion from every watched socket, the removes, and
+  // bursts of datagrams and sends.
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = RingEntries * 4;
+
+  m_ring = ioUringSetup(RingEntries, &params);
+  if (m_ring < 0)
+  {
+    m_ring = -1;
+    gLog.LogWarn("Failed to create io_uring: %s", ErrnoToString());
+    return false;
+  }
+
+  // The timeout is passed to io_uring_enter(), so the wait and the submit are
+  // one call.
+  if (!(params.features & IORING_FEAT_EXT_ARG))
+  {
+    gLog.LogWarn("io_uring does not support wait timeouts on this kernel.");
+    return false;
+  }
+
+  m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_sqRing = ::mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+  if (m_sqRing == MAP_FAILED)
+  {
+    gLog.ErrnoError(errno, "Failed to map io_uring submission ring");
+    return false;
+  }
+
+  m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  m_cqRing = ::mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING);
+  if (m_cqRing == MAP_FAILED)
+  {
+    gLog.ErrnoError(errno, "Failed to map io_uring completion ring");
+    return false;
+  }
+
+  m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = ::mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+  {
+    gLog.ErrnoError(errno, "Failed to map io_uring submission entries");
+    return false;
+  }
+  m_sqes = reinterpret_cast<struct io_uring_sqe *>(sqes);
+
+  uint8_t *sq = reinterpret_cast<uint8_t *>(m_sqRing);
+  m_sqEntries = params.sq_entries;
+  m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  m_sqFlags = reinterpret_cast<unsigned *>(sq + params.sq_off.flags);
+  m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+
+  // Each slot of the array always names the entry with the same index.
+  unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  for (unsigned index = 0; index < m_sqEntries; index++)
+    array[index] = index;
+
+  uint8_t *cq = reinterpret_cast<uint8_t *>(m_cqRing);
+  m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  m_cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  return true;
+}
+
+void IoUringScheduler::closeRing()
+{
+  if (m_sqes)
+    ::munmap(m_sqes, m_sqesSize);
+  m_sqes = NULL;
+  if (m_cqRing != MAP_FAILED)
+    ::munmap(m_cqRing, m_cqRingSize);
+  m_cqRing = MAP_FAILED;
+  if (m_sqRing != MAP_FAILED)
+    ::munmap(m_sqRing, m_sqRingSize);
+  m_sqRing = MAP_FAILED;
+  if (m_ring != -1)
+    ::close(m_ring);
+  m_ring = -1;
+}
+
+/**
+ * Checks that the kernel can receive datagrams into provided buffers, with a
+ * multishot recvmsg request (Linux 6.0). A request is queued for a socket that
+ * never gets any data, and canceled. If it was accepted, it ends as canceled.
+ *
+ * @return bool - true if datagrams can be received and sent.
+ */
+bool IoUringScheduler::probeDatagrams()
+{
+  bool supported = false;
+  bool finished = false;
+  int error = 0;
+
+  int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    gLog.ErrnoError(errno, "Failed to open io_uring probe socket");
+    return false;
+  }
+
+  DatagramSocket *datagrams = openDatagramSocket(16, 0);
+  if (!datagrams)
+    error = errno;
+  else if (queueReceive(fd, ProbeUserData, *datagrams))
+  {
+    queueCancel(ProbeUserData);
+
+    struct timespec timeout = { 1, 0};
+    for (int waits = 0; waits < 2 && !finished; waits++)
+    {
+      enter(1, &timeout);
+
+      unsigned head = *m_cqHead;
+      unsigned tail = atomicLoad(m_cqTail);
+      for (; head != tail; head++)
+      {
+        const struct io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+        if (cqe.user_data == ProbeUserData && !(cqe.flags & IORING_CQE_F_MORE))
+        {
+          finished = true;
+          supported = (cqe.res == -ECANCELED);
+          error = -cqe.res;
+        }
+      }
+      atomicStore(m_cqHead, head);
+    }
+  }
+
+  if (datagrams)
+    closeDatagramSocket(datagrams);
+  ::close(fd);
+
+  if (!supported)
+    gLog.LogWarn("io_uring can not receive datagrams on this kernel (%s). Sockets will be polled.",
+                 error ? SystemErrorToString(error) : "no reply");
+  return supported;
+}
+
+/**
+ * Stops all requests that use the receive buffers or send slots, and waits for
+ * the kernel to finish with them, so that they can be freed.
+ */
+void IoUringScheduler::drain()
+{
+  vector<int> datagramSockets;
+
+  try
+  {
+    for (WatchMap::iterator it = m_watched.begin(); it != m_watched.end(); ++it)
+    {
+      if (it->second.datagrams)
+        datagramSockets.push_back(it->first);
+    }
+  }
+  catch (std::exception &)
+  {
+  }
+
+  for (vector<int>::iterator it = datagramSockets.begin(); it != datagramSockets.end(); ++it)
+    unWatchSocket(*it);
+
+  struct timespec timeout = { 0, 100 * TimeSpec::NSecPerMs};
+  for (int waits = 0; waits < 10 && (!m_retired.empty() || m_sendsInFlight != 0); waits++)
+  {
+    enter(1, &timeout);
+    reapCompletions();
+  }
+}
+
+bool IoUringScheduler::HandlesDatagrams()
+{
+  return m_handlesDatagrams;
+}
+
+bool IoUringScheduler::waitForEvents(const struct timespec &timeout)
+{
+  finishReady();
+  m_ready.clear();
+  m_nextReady = 0;
+
+  if (!LogVerify(m_ring != -1))
+    return false;
+
+  bool overflow = (atomicLoad(m_sqFlags) & IORING_SQ_CQ_OVERFLOW) != 0;
+
+  if (timeout.tv_sec == 0 && timeout.tv_nsec == 0)
+  {
+    // Only a check. The kernel fills the completion ring without being asked.
+    if (m_toSubmit != 0 || overflow)
+      enter(0, NULL);
+  }
+  else if (hasCompletions())
+  {
+    if (m_toSubmit != 0 || overflow)
+      enter(0, NULL);
+  }
+  else
+  {
+    struct timespec deadline, now;
+    bool haveDeadline = GetMonolithicTime(deadline);
+    if (haveDeadline)
+      timespecAddMicro(deadline, uint64_t(timeout.tv_sec) * 1000000 + uint64_t(timeout.tv_nsec) / 1000);
+
+    enter(1, &timeout);
+    reapCompletions();
+
+    // Completed sends and cancels wake the wait too, but leave nothing to do.
+    // Keep waiting for the rest of the timeout, rather than have the caller
+    // go round its loop for nothing.
+    while (m_ready.empty() && haveDeadline && GetMonolithicTime(now))
+    {
+      struct timespec remaining = timespecSubtract(deadline, now);
+      if (timespecIsNegative(remaining) || isTimespecEmpty(remaining))
+        break;
+      if (!enter(1, &remaining))
+        break;
+      reapCompletions();
+    }
+  }
+
+  reapCompletions();
+
+  if (m_ready.empty())
+  {
+    if (timeout.tv_nsec != 0 || timeout.tv_sec != 0)
+      gLog.Optional(Log::TimerDetail, "io_uring timeout");
+  }
+  else
+    gLog.Optional(Log::TimerDetail, "io_uring received %zu events", m_ready.size());
+
+  return !m_ready.empty();
+}
+
+int IoUringScheduler::getNextSocketEvent()
+{
+  while (m_nextReady < m_ready.size())
+  {
+    ReadyEvent &event = m_ready[m_nextReady++];
+
+    // A callback may have removed the socket since.
+    WatchMap::iterator found = m_watched.find(event.fd);
+    if (found != m_watched.end() && found->second.generation == event.generation)
+      return event.fd;
+  }
+
+  return -1;
+}
+
+void IoUringScheduler::deliverDatagram(int fd, Scheduler::DatagramCallback callback, void *userdata)
+{
+  if (!LogVerify(m_nextReady != 0) || !LogVerify(m_ready[m_nextReady - 1].fd == fd))
+    return;
+
+  ReadyEvent event = m_ready[m_nextReady - 1];
+  WatchMap::iterator found = m_watched.find(fd);
+  if (!LogVerify(found != m_watched.end()) || !LogVerify(found->second.datagrams) || !LogVerify(event.buffer >= 0))
+    return;
+
+  // The buffer holds the io_uring_recvmsg_out, the source address and the
+  // control messages, each with the room given in header, and then the data.
+  DatagramSocket &datagrams = *found->second.datagrams;
+  uint8_t *buffer = &datagrams.buffers[size_t(event.buffer) * datagrams.bufferSize];
+  const struct io_uring_recvmsg_out *out = reinterpret_cast<const struct io_uring_recvmsg_out *>(buffer);
+  size_t nameOffset = sizeof(*out);
+  size_t controlOffset = nameOffset + datagrams.header.msg_namelen;
+  size_t dataOffset = controlOffset + datagrams.header.msg_controllen;
+
+  m_datagramsReceived++;
+
+  if (event.length >= dataOffset)
+  {
+    struct msghdr message;
+    struct iovec iov;
+    size_t dataLength = min(size_t(out->payloadlen), event.length - dataOffset);
+
+    iov.iov_base = buffer + dataOffset;
+    iov.iov_len = dataLength;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = buffer + nameOffset;
+    message.msg_namelen = min(socklen_t(out->namelen), datagrams.header.msg_namelen);
+    message.msg_control = buffer + controlOffset;
+    message.msg_controllen = min(size_t(out->controllen), size_t(datagrams.header.msg_controllen));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_flags = int(out->flags);
+
+    if (m_message.ParseReceived(message, dataLength))
+      callback(fd, m_message, userdata);
+    else
+      gLog.ErrnoError(m_message.GetLastError(), "Error parsing datagram from io_uring");
+  }
+  else
+    gLog.LogError("io_uring datagram for socket %d is too short: %u bytes.", fd, event.length);
+
+  // The callback may have removed the socket. Then the buffer is no longer ours
+  // to give back.
+  found = m_watched.find(fd);
+  if (found != m_watched.end() && found->second.generation == event.generation)
+    provideBuffer(*found->second.datagrams, unsigned(event.buffer));
+}
+
+bool IoUringScheduler::watchSocket(int fd)
+{
+  if (!LogVerify(m_ring != -1))
+    return false;
+
+  WatchMap::iterator found = m_watched.find(fd);
+  if (!LogVerify(found == m_watched.end()))
+    return false;
+
+  WatchInfo info;
+  info.generation = m_nextGeneration;
+  info.armed = true;
+  info.datagrams = NULL;
+  m_nextGeneration = (m_nextGeneration == MaxGeneration) ? 1 : m_nextGeneration + 1;
+
+  if (!queuePoll(fd, info.generation))
+    return false;
+
+  m_watched[fd] = info;
+  return true;
+}
+
+bool IoUringScheduler::watchDatagramSocket(int fd, size_t maxDataSize, size_t controlSize)
+{
+  if (!LogVerify(m_ring != -1) || !LogVerify(m_handlesDatagrams))
+    return false;
+
+  WatchMap::iterator found = m_watched.find(fd);
+  if (!LogVerify(found == m_watched.end()))
+    return false;
+
+  DatagramSocket *datagrams = openDatagramSocket(maxDataSize, controlSize);
+  if (!datagrams)
+  {
+    gLog.ErrnoError(errno, "Failed to register io_uring receive buffers");
+    return false;
+  }
+
+  WatchInfo info;
+  info.generation = m_nextGeneration;
+  info.armed = true;
+  info.datagrams = datagrams;
+  m_nextGeneration = (m_nextGeneration == MaxGeneration) ? 1 : m_nextGeneration + 1;
+
+  if (!queueReceive(fd, makeUserData(fd, info.generation), *datagrams))
+  {
+    closeDatagramSocket(datagrams);
+    return false;
+  }
+
+  m_watched[fd] = info;
+  return true;
+}
+
+void IoUringScheduler::unWatchSocket(int fd)
+{
+  LogAssert(m_ring != -1);
+
+  WatchMap::iterator found = m_watched.find(fd);
+  if (found == m_watched.end())
+    return;
+
+  // Any completion that is already on its way is ignored, since the socket is
+  // no longer in m_watched.
+  uint64_t userData = makeUserData(fd, found->second.generation);
+  DatagramSocket *datagrams = found->second.datagrams;
+  bool armed = found->second.armed;
+  if (armed)
+    queueCancel(userData);
+  m_watched.erase(found);
+
+  if (!datagrams)
+    return;
+
+  // The kernel may write to the buffers until the receive request ends. See
+  // releaseRetired().
+  if (!armed)
+  {
+    closeDatagramSocket(datagrams);
+    return;
+  }
+  try
+  {
+    m_retired[userData] = datagrams;
+  }
+  catch (std::bad_alloc &)
+  {
+    gLog.LogError("Out of memory removing socket %d from io_uring. Leaving its buffers.", fd);
+  }
+}
+
+/**
+ * Gets a free submission entry, submitting the queued ones if the ring is full.
+ * Call commitSqe() once it is filled in.
+ *
+ * @return struct io_uring_sqe* - The cleared entry. NULL on failure.
+ */
+struct io_uring_sqe* IoUringScheduler::getSqe()
+{
+  unsigned tail = *m_sqTail;
+
+  if (tail - atomicLoad(m_sqHead) >= m_sqEntries)
+  {
+    enter(0, NULL);
+    if (tail - atomicLoad(m_sqHead) >= m_sqEntries)
+    {
+      gLog.LogError("io_uring submission ring is full.");
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqe = &m_sqes[tail & m_sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+ * Queues the entry from getSqe(). It is submitted with the next wait.
+ */
+void IoUringScheduler::commitSqe()
+{
+  atomicStore(m_sqTail, *m_sqTail + 1);
+  m_toSubmit++;
+}
+
+/**
+ * Queues a poll for input on the socket.
+ *
+ * @return bool - false on failure.
+ */
+bool IoUringScheduler::queuePoll(int fd, uint32_t generation)
+{
+  struct io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = makeUserData(fd, generation);
+
+  commitSqe();
+  return true;
+}
+
+/**
+ * Queues a multishot receive on the socket, into the socket's buffers. It
+ * completes once for each datagram, until it runs out of buffers, fails, or is
+ * canceled.
+ *
+ * @return bool - false on failure.
+ */
+bool IoUringScheduler::queueReceive(int fd, uint64_t userData, DatagramSocket &datagrams)
+{
+  struct io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = uint64_t(uintptr_t(&datagrams.header));
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = datagrams.group;
+  sqe->user_data = userData;
+
+  commitSqe();
+  return true;
+}
+
+/**
+ * Queues the cancel of the poll or receive that was queued with the user data.
+ */
+void IoUringScheduler::queueCancel(uint64_t userData)
+{
+  struct io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+  {
+    gLog.LogError("Could not remove socket %d from io_uring.", int(uint32_t(userData)));
+    return;
+  }
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = userData;
+  sqe->user_data = RemoveUserData;
+
+  commitSqe();
+}
+
+/**
+ * Called before each wait, for the events from the last one, which were
+ * handled by now. Queues a new poll for each polled socket that is still
+ * watched. Gives back the buffers of any datagrams that were not delivered, and
+ * queues the receive again for the datagram sockets whose receive ended.
+ */
+void IoUringScheduler::finishReady()
+{
+  for (size_t index = 0; index < m_ready.size(); index++)
+  {
+    ReadyEvent &event = m_ready[index];
+    WatchMap::iterator found = m_watched.find(event.fd);
+    if (found == m_watched.end() || found->second.generation != event.generation)
+      continue;
+
+    if (found->second.datagrams)
+    {
+      // The ones that were delivered were given back by deliverDatagram().
+      if (index >= m_nextReady)
+        provideBuffer(*found->second.datagrams, unsigned(event.buffer));
+    }
+    else if (!found->second.armed)
+      found->second.armed = queuePoll(event.fd, event.generation);
+  }
+
+  for (vector<ReadyEvent>::iterator it = m_rearm.begin(); it != m_rearm.end(); ++it)
+  {
+    WatchMap::iterator found = m_watched.find(it->fd);
+    if (found == m_watched.end() || found->second.generation != it->generation || found->second.armed)
+      continue;
+    found->second.armed = queueReceive(it->fd, makeUserData(it->fd, it->generation), *found->second.datagrams);
+  }
+  m_rearm.clear();
+}
+
+/**
+ * Creates and registers a buffer ring for a datagram socket, with all of its
+ * buffers in the ring.
+ *
+ * @param maxDataSize [in] - The largest datagram.
+ * @param controlSize [in] - Room for control messages.
+ *
+ * @return DatagramSocket* - NULL on failure, with errno set. Free with
+ *         closeDatagramSocket().
+ */
+IoUringScheduler::DatagramSocket* IoUringScheduler::openDatagramSocket(size_t maxDataSize, size_t controlSize)
+{
+  uint16_t group;
+
+  if (!m_freeGroups.empty())
+  {
+    group = m_freeGroups.back();
+    m_freeGroups.pop_back();
+  }
+  else if (m_nextGroup == UINT16_MAX)
+  {
+    errno = ENOSPC;
+    return NULL;
+  }
+  else
+    group = m_nextGroup++;
+
+  Raii<DatagramSocket>::Delete datagrams(new DatagramSocket);
+  controlSize = (controlSize + 7) & ~size_t(7);
+  datagrams->group = group;
+  datagrams->bufferSize = (sizeof(struct io_uring_recvmsg_out) + sizeof(sockaddr_storage) + controlSize + maxDataSize + 15) & ~size_t(15);
+  datagrams->buffers.resize(DatagramBuffers * datagrams->bufferSize);
+  memset(&datagrams->header, 0, sizeof(datagrams->header));
+  datagrams->header.msg_namelen = sizeof(sockaddr_storage);
+  datagrams->header.msg_controllen = controlSize;
+
+  size_t pageSize = size_t(::sysconf(_SC_PAGESIZE));
+  datagrams->bufferRingSize = (DatagramBuffers * sizeof(struct io_uring_buf) + pageSize - 1) & ~(pageSize - 1);
+  void *ring = ::mmap(NULL, datagrams->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+  {
+    int error = errno;
+    m_freeGroups.push_back(group);
+    errno = error;
+    return NULL;
+  }
+  datagrams->bufferRing = reinterpret_cast<struct io_uring_buf *>(ring);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = uint64_t(uintptr_t(ring));
+  reg.ring_entries = DatagramBuffers;
+  reg.bgid = group;
+  if (ioUringRegister(m_ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    int error = errno;
+    ::munmap(ring, datagrams->bufferRingSize);
+    m_freeGroups.push_back(group);
+    errno = error;
+    return NULL;
+  }
+
+  for (unsigned buffer = 0; buffer < DatagramBuffers; buffer++)
+    provideBuffer(*datagrams, buffer);
+
+  return datagrams.Detach();
+}
+
+/**
+ * Unregisters and frees a buffer ring from openDatagramSocket(). The kernel
+ * must be done with it.
+ */
+void IoUringScheduler::closeDatagramSocket(DatagramSocket *datagrams)
+{
+  if (!datagrams)
+    return;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = datagrams->group;
+  if (m_ring != -1 && ioUringRegister(m_ring, IORING_UNREGISTER_PBUF_RING, &reg, 1) < 0)
+    gLog.ErrnoError(errno, "Failed to unregister io_uring receive buffers");
+
+  ::munmap(datagrams->bufferRing, datagrams->bufferRingSize);
+  try
+  {
+    m_freeGroups.push_back(datagrams->group);
+  }
+  catch (std::bad_alloc &)
+  {
+    // The group id is simply not used again.
+  }
+  delete datagrams;
+}
+
+/**
+ * Puts a buffer back in the ring, for the kernel to receive into.
+ */
+void IoUringScheduler::provideBuffer(DatagramSocket &datagrams, unsigned buffer)
+{
+  // The entries are used through io_uring_buf, rather than io_uring_buf_ring,
+  // whose flexible array is not at the start in C++. The tail of the ring is
+  // the resv field of the first entry, so the fields are set one by one.
+  struct io_uring_buf *ring = datagrams.bufferRing;
+  uint16_t tail = ring[0].resv;
+
+  struct io_uring_buf &entry = ring[tail & (DatagramBuffers - 1)];
+  entry.addr = uint64_t(uintptr_t(&datagrams.buffers[size_t(buffer) * datagrams.bufferSize]));
+  entry.len = uint32_t(datagrams.bufferSize);
+  entry.bid = uint16_t(buffer);
+
+  atomicStore(&ring[0].resv, uint16_t(tail + 1));
+}
+
+/**
+ * Frees the buffers of a removed datagram socket, once its receive request has
+ * ended.
+ */
+void IoUringScheduler::releaseRetired(uint64_t userData)
+{
+  RetiredMap::iterator found = m_retired.find(userData);
+  if (found == m_retired.end())
+    return;
+  closeDatagramSocket(found->second);
+  m_retired.erase(found);
+}
+
+bool IoUringScheduler::QueueDatagram(int socket, const void *data, size_t dataLength, const struct sockaddr *address, socklen_t addressLength)
+{
+  LogAssert(IsMainThread());
+
+  if (!m_handlesDatagrams)
+    return false;
+  if (!LogVerify(socket != -1) || !LogVerify(dataLength <= MaxSendSize) || !LogVerify(addressLength <= sizeof(sockaddr_storage)))
+    return false;
+
+  if (m_freeSendSlots.empty())
+  {
+    // The free list always has room for every slot, so that finishSend() can
+    // not fail.
+    SendSlot *slot = NULL;
+    try
+    {
+      slot = new SendSlot;
+      m_freeSendSlots.reserve(m_sendSlots.size() + 1);
+      m_sendSlots.push_back(slot);
+    }
+    catch (std::bad_alloc &)
+    {
+      delete slot;
+      gLog.LogError("Out of memory for io_uring send.");
+      return false;
+    }
+    m_freeSendSlots.push_back(uint32_t(m_sendSlots.size() - 1));
+  }
+
+  struct io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+
+  uint32_t index = m_freeSendSlots.back();
+  m_freeSendSlots.pop_back();
+
+  SendSlot &slot = *m_sendSlots[index];
+  memcpy(slot.data, data, dataLength);
+  memcpy(&slot.address, address, addressLength);
+  slot.iov.iov_base = slot.data;
+  slot.iov.iov_len = dataLength;
+  memset(&slot.header, 0, sizeof(slot.header));
+  slot.header.msg_name = &slot.address;
+  slot.header.msg_namelen = addressLength;
+  slot.header.msg_iov = &slot.iov;
+  slot.header.msg_iovlen = 1;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = socket;
+  sqe->addr = uint64_t(uintptr_t(&slot.header));
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = SendUserData | index;
+
+  commitSqe();
+  m_sendsInFlight++;
+  return true;
+}
+
+void IoUringScheduler::FlushDatagrams()
+{
+  LogAssert(IsMainThread());
+
+  if (m_ring != -1 && m_toSubmit != 0)
+    enter(0, NULL);
+}
+
+/**
+ * Handles the completion of a send from QueueDatagram().
+ */
+void IoUringScheduler::finishSend(uint32_t slot, int result)
+{
+  if (!LogVerify(slot < m_sendSlots.size()))
+    return;
+
+  if (result < 0)
+  {
+    m_datagramSendFailures++;
+    gLog.Optional(Log::Packet, "Error sending datagram with io_uring: %s", SystemErrorToString(-result));
+  }
+  else
+    m_datagramsSent++;
+
+  m_freeSendSlots.push_back(slot);
+  m_sendsInFlight--;
+}
+
+void IoUringScheduler::GetStats(Scheduler::Stats &outStats)
+{
+  SchedulerBase::GetStats(outStats);
+  outStats.datagramsReceived = m_datagramsReceived;
+  outStats.datagramsSent = m_datagramsSent;
+  outStats.datagramSendFailures = m_datagramSendFailures;
+  outStats.receiveBufferShortages = m_receiveBufferShortages;
+}
+
+void IoUringScheduler::ResetStats()
+{
+  SchedulerBase::ResetStats();
+  m_datagramsReceived = 0;
+  m_datagramsSent = 0;
+  m_datagramSendFailures = 0;
+  m_receiveBufferShortages = 0;
+}
+
+/**
+ * Submits the queued entries, and optionally waits for completions.
+ *
+ * @param minComplete [in] - 0 to only submit. Otherwise wait for this many
+ *                    completions.
+ * @param timeout [in] - The longest time to wait. Ignored if minComplete is 0.
+ *
+ * @return bool - false on failure.
+ */
+bool IoUringScheduler::enter(unsigned minComplete, const struct timespec *timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec kernelTimeout;
+  unsigned flags = 0;
+  const void *argPtr = NULL;
+  size_t argSize = 0;
+
+  if (minComplete != 0)
+  {
+    kernelTimeout.tv_sec = timeout->tv_sec;
+    kernelTimeout.tv_nsec = timeout->tv_nsec;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = uint64_t(uintptr_t(&kernelTimeout));
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    argPtr = &arg;
+    argSize = sizeof(arg);
+  }
+  else if (atomicLoad(m_sqFlags) & IORING_SQ_CQ_OVERFLOW)
+  {
+    // Completions that did not fit in the ring are only moved to it when asked.
+    flags = IORING_ENTER_GETEVENTS;
+  }
+
+  int result = ioUringEnter(m_ring, m_toSubmit, minComplete, flags, argPtr, argSize);
+  if (result < 0)
+  {
+    // ETIME is the timeout. EBUSY means completions must be reaped first.
+    if (errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+      gLog.LogError("io_uring_enter failed: %s", ErrnoToString());
+    return errno == ETIME || errno == EINTR;
+  }
+
+  // Any submitted entries are counted, even if the wait then ended early.
+  m_toSubmit -= min(unsigned(result), m_toSubmit);
+  return true;
+}
+
+bool IoUringScheduler::hasCompletions()
+{
+  return atomicLoad(m_cqTail) != *m_cqHead;
+}
+
+/**
+ * Handles the completions in the ring. Polls and received datagrams go to
+ * m_ready.
+ */
+void IoUringScheduler::reapCompletions()
+{
+  unsigned head = *m_cqHead;
+  unsigned tail = atomicLoad(m_cqTail);
+
+  for (; head != tail; head++)
+  {
+    const struct io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+    if (cqe.user_data == RemoveUserData || cqe.user_data == ProbeUserData)
+      continue;
+
+    if (cqe.user_data & SendUserData)
+    {
+      finishSend(uint32_t(cqe.user_data & ~SendUserData), cqe.res);
+      continue;
+    }
+
+    int fd = int(uint32_t(cqe.user_data));
+    uint32_t generation = uint32_t(cqe.user_data >> 32);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+    WatchMap::iterator found = m_watched.find(fd);
+    if (found == m_watched.end() || found->second.generation != generation)
+    {
+      // The last completion for a removed datagram socket means that the kernel
+      // is done with its buffers.
+      if (!more)
+        releaseRetired(cqe.user_data);
+      continue;
+    }
+    if (!more)
+      found->second.armed = false;
+
+    ReadyEvent event;
+    event.fd = fd;
+    event.generation = generation;
+    event.buffer = -1;
+    event.length = 0;
+
+    if (found->second.datagrams)
+    {
+      // A receive that ended, for example because the buffers ran out, is
+      // queued again by finishReady().
+      if (!more && (cqe.res >= 0 || cqe.res == -ENOBUFS))
+      {
+        try
+        {
+          m_rearm.push_back(event);
+        }
+        catch (std::exception &)
+        {
+          found->second.armed = queueReceive(fd, cqe.user_data, *found->second.datagrams);
+        }
+      }
+
+      if (cqe.res == -ENOBUFS)
+      {
+        m_receiveBufferShortages++;
+        continue;
+      }
+      if (cqe.res < 0)
+      {
+        // Not queued again, since it would most likely just fail again.
+        gLog.LogError("io_uring receive failed for socket %d: %s", fd, SystemErrorToString(-cqe.res));
+        continue;
+      }
+      if (!LogVerify(cqe.flags & IORING_CQE_F_BUFFER))
+        continue;
+      event.buffer = int(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      event.length = uint32_t(cqe.res);
+    }
+    else if (cqe.res < 0)
+    {
+      // Not polled again, since it would most likely just fail again.
+      gLog.LogError("io_uring poll failed for socket %d: %s", fd, SystemErrorToString(-cqe.res));
+      continue;
+    }
+
+    // Errors and hang ups are passed on as read events, as with epoll, so that
+    // the callback sees the error on its next read.
+    try
+    {
+      m_ready.push_back(event);
+    }
+    catch (std::exception &)
+    {
+      // Not lost, the buffer is given back, or the socket is polled again.
+      if (event.buffer != -1)
+        provideBuffer(*found->second.datagrams, unsigned(event.buffer));
+      else
+        found->second.armed = queuePoll(fd, generation);
+    }
+  }
+
+  atomicStore(m_cqHead, head);
+}
+
+
+#endif  // USE_IOURING_SCHEDULER
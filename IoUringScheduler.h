@@ -0,0 +1,200 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+  Scheduler implementation using io_uring (Linux).
+
+ */
+#pragma once
+
+#include "config.h"
+
+#ifdef USE_IOURING_SCHEDULER
+
+#include "SchedulerBase.h"
+#include "RecvMsg.h"
+#include "hash_map.h"
+#include <linux/io_uring.h>
+#include <map>
+#include <vector>
+
+/**
+ * Receives, sends, and waits for socket events with an io_uring, rather than
+ * epoll.
+ *
+ * Datagram sockets, see SetDatagramCallback(), are received by completion.
+ * Each has a multishot recvmsg request on the ring, and its own ring of
+ * provided buffers, so the kernel places each datagram, with its address and
+ * control messages, in a free buffer, and posts a completion for it. The
+ * scheduler hands the datagram to the callback, and gives the buffer back. No
+ * system call is made per datagram, or per batch. If the buffers run out, the
+ * rest of the datagrams wait in the socket, until the request is queued again
+ * on the next wait.
+ *
+ * Datagrams given to QueueDatagram() are copied to a send slot, and queued as
+ * sendmsg requests.
+ *
+ * Other sockets, such as signal channels, have a one shot poll request on the
+ * ring. After a socket is reported, its poll is queued again, so that a socket
+ * with data left after its callback is reported again, as with level triggered
+ * epoll.
+ *
+ * All queued requests, including the sends, and adding and removing sockets,
+ * are submitted by the same io_uring_enter() call that waits for events, with
+ * the timeout for the next timer. So each pass through the event loop is a
+ * single system call. When there is nothing to submit, and the scheduler only
+ * checks for events, the completion ring is read without any system call.
+ *
+ * Use IsReady() after construction, since the kernel may not support io_uring,
+ * or it may not be allowed. Receiving and sending datagrams needs Linux 6.0 or
+ * later. On earlier kernels HandlesDatagrams() is false, and all sockets are
+ * polled.
+ */
+class IoUringScheduler : public SchedulerBase
+{
+
+public:
+  /**
+   * Constructor
+   * The thread that calls this is considered the "main thread". See
+   * Scheduler::IsMainThread().
+   */
+  IoUringScheduler();
+  virtual ~IoUringScheduler();
+
+  /**
+   * @return bool - false if the ring could not be created. The scheduler must
+   *         then not be used.
+   */
+  bool IsReady() const { return m_ring != -1;}
+
+  /** Overrides from  Scheduler  */
+  virtual bool HandlesDatagrams();
+  virtual bool QueueDatagram(int socket, const void *data, size_t dataLength, const struct sockaddr *address, socklen_t addressLength);
+  virtual void FlushDatagrams();
+  virtual void GetStats(Scheduler::Stats &outStats);
+  virtual void ResetStats();
+
+protected:
+
+  /** Overrides from  SchedulerBase  */
+  virtual bool watchSocket(int fd);
+  virtual bool watchDatagramSocket(int fd, size_t maxDataSize, size_t controlSize);
+  virtual void unWatchSocket(int fd);
+  virtual bool waitForEvents(const struct timespec &timeout);
+  virtual int getNextSocketEvent();
+  virtual void deliverDatagram(int fd, Scheduler::DatagramCallback callback, void *userdata);
+
+
+private:
+  static const unsigned RingEntries = 1024;
+  static const unsigned DatagramBuffers = 256; // For each datagram socket. Must be a power of 2.
+  static const size_t MaxSendSize = 2048; // Largest datagram for QueueDatagram().
+  static const uint32_t MaxGeneration = 0x7FFFFFFF; // So that SendUserData is not set.
+  static const uint64_t RemoveUserData = UINT64_MAX; // Completions of cancels.
+  static const uint64_t ProbeUserData = UINT64_MAX - 1; // See probeDatagrams().
+  static const uint64_t SendUserData = uint64_t(1) << 63; // Or'ed with the send slot index.
+
+  /**
+   * The receive state for a socket added with watchDatagramSocket().
+   */
+  struct DatagramSocket
+  {
+    uint16_t group;   // Buffer group id, for the buffer ring.
+    struct io_uring_buf *bufferRing;  // DatagramBuffers entries, shared with the kernel.
+    size_t bufferRingSize;
+    std::vector<uint8_t> buffers;  // DatagramBuffers of bufferSize each.
+    size_t bufferSize;
+    struct msghdr header;  // Only the name and control sizes, for the kernel.
+  };
+  typedef std::map<uint64_t, DatagramSocket *> RetiredMap;
+
+  struct WatchInfo
+  {
+    uint32_t generation; // Tells completions for an earlier socket with the same fd apart.
+    bool armed;          // A poll or receive request is queued or in the kernel.
+    DatagramSocket *datagrams; // NULL for a polled socket.
+  };
+  typedef hash_map<int, WatchInfo>::Type WatchMap;
+
+  struct ReadyEvent
+  {
+    int fd;
+    uint32_t generation;
+    int buffer;       // For a datagram socket, the buffer holding it. -1 for a poll.
+    uint32_t length;  // Bytes used in the buffer.
+  };
+
+  struct SendSlot
+  {
+    struct msghdr header;
+    struct iovec iov;
+    sockaddr_storage address;
+    uint8_t data[MaxSendSize];
+  };
+
+  bool openRing();
+  void closeRing();
+  bool probeDatagrams();
+  void drain();
+  struct io_uring_sqe* getSqe();
+  void commitSqe();
+  bool queuePoll(int fd, uint32_t generation);
+  bool queueReceive(int fd, uint64_t userData, DatagramSocket &datagrams);
+  void queueCancel(uint64_t userData);
+  void finishReady();
+  DatagramSocket* openDatagramSocket(size_t maxDataSize, size_t controlSize);
+  void closeDatagramSocket(DatagramSocket *datagrams);
+  void provideBuffer(DatagramSocket &datagrams, unsigned buffer);
+  void releaseRetired(uint64_t userData);
+  void finishSend(uint32_t slot, int result);
+  bool enter(unsigned minComplete, const struct timespec *timeout);
+  bool hasCompletions();
+  void reapCompletions();
+  static uint64_t makeUserData(int fd, uint32_t generation) { return (uint64_t(generation) << 32) | uint32_t(fd);}
+
+  int m_ring;
+  void *m_sqRing;
+  size_t m_sqRingSize;
+  void *m_cqRing;
+  size_t m_cqRingSize;
+  struct io_uring_sqe *m_sqes;
+  size_t m_sqesSize;
+  unsigned m_sqEntries;
+  unsigned *m_sqHead;  // Written by the kernel.
+  unsigned *m_sqTail;
+  unsigned *m_sqFlags; // Written by the kernel.
+  unsigned m_sqMask;
+  unsigned *m_cqHead;
+  unsigned *m_cqTail;  // Written by the kernel.
+  unsigned m_cqMask;
+  struct io_uring_cqe *m_cqes;
+  unsigned m_toSubmit; // Queued requests that the kernel has not yet taken.
+
+  WatchMap m_watched;
+  uint32_t m_nextGeneration;
+  std::vector<ReadyEvent> m_ready; // From the last waitForEvents().
+  size_t m_nextReady;  // for getNextSocketEvent
+  std::vector<ReadyEvent> m_rearm; // Datagram sockets whose receive request ended.
+  RetiredMap m_retired; // Removed datagram sockets, until their request ends.
+
+  bool m_handlesDatagrams; // See probeDatagrams().
+  std::vector<uint16_t> m_freeGroups;
+  uint16_t m_nextGroup;
+  RecvMsg m_message; // Passed to the datagram callbacks.
+
+  std::vector<SendSlot *> m_sendSlots;
+  std::vector<uint32_t> m_freeSendSlots;
+  size_t m_sendsInFlight;
+
+  uint64_t m_datagramsReceived;
+  uint64_t m_datagramsSent;
+  uint64_t m_datagramSendFailures;
+  uint64_t m_receiveBufferShortages;
+};
+
+
+#endif  // USE_IOURING_SCHEDULER
@@ -9,6 +9,7 @@
 #include "common.h"
 #include "KeventScheduler.h"
 #include "utils.h"
+#include <algorithm>
 #include <errno.h>
 
 using namespace std;
@@ -34,13 +35,41 @@ bool KeventScheduler::waitForEvents(const struct timespec &timeout)
 {
   m_nextCheckEvent = 0;
 
-  m_foundEvents = ::kevent(m_kqueue, NULL, 0, &m_events.front(), m_events.size(), &timeout);
+  // There must be room for an error result for each change, or the kernel
+  // stops at the first failed change.
+  resizeEvents();
+
+  m_foundEvents = ::kevent(m_kqueue,
+                           m_changes.empty() ? NULL : &m_changes.front(), int(m_changes.size()),
+                           &m_events.front(), int(m_events.size()), &timeout);
   if (m_foundEvents < 0)
   {
     m_foundEvents = 0;
     gLog.LogError("kevent failed: %s", ErrnoToString());
   }
-  else if (m_foundEvents == 0)
+  else
+  {
+    // Failed changes come back as results with EV_ERROR. Remove those, so that
+    // only socket events remain.
+    int kept = 0;
+    for (int i = 0; i < m_foundEvents; i++)
+    {
+      if (m_events[i].flags & EV_ERROR)
+        handleChangeError(m_events[i]);
+      else
+      {
+        if (kept != i)
+          m_events[kept] = m_events[i];
+        kept++;
+      }
+    }
+    m_foundEvents = kept;
+  }
+
+  // The changes are applied before waiting, so even if the wait failed.
+  m_changes.clear();
+
+  if (m_foundEvents == 0)
   {
     if (timeout.tv_nsec != 0 || timeout.tv_sec != 0)
       gLog.Optional(Log::TimerDetail, "kevent timeout");
@@ -59,7 +88,7 @@ int KeventScheduler::getNextSocketEvent()
 
   for (; m_nextCheckEvent < m_foundEvents; m_nextCheckEvent++)
   {
-    // TODO check for EV_ERROR in flags?
+    // EV_ERROR results were removed by waitForEvents().
     if (m_events[m_nextCheckEvent].filter == EVFILT_READ)
     {
       // We have a socket event
@@ -77,56 +106,95 @@ int KeventScheduler::getNextSocketEvent()
   return -1;
 }
 
+/**
+ * The socket is added to the kqueue by the next waitForEvents(). So this only
+ * fails if there is no kqueue. A failure to add the socket is logged then.
+ */
 bool KeventScheduler::watchSocket(int fd)
 {
-  struct kevent change;
-
   if (!LogVerify(m_kqueue != -1))
     return false;
 
-  EV_SET(&change, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-  if (kevent(m_kqueue, &change, 1, NULL, 0, NULL) < 0)
-  {
-    gLog.ErrnoError(errno, "Failed to add socket to kqueue");
-    return false;
-  }
-
+  queueChange(fd, ChangeType::Add);
   m_totalEvents++;
-  resizeEvents();
 
   return true;
 }
 
 void KeventScheduler::unWatchSocket(int fd)
+{
+  LogAssert(m_kqueue != -1);
+
+  queueChange(fd, ChangeType::Delete);
+  if (m_totalEvents > 0)
+    m_totalEvents--;
+}
+
+/**
+ * Adds a change to m_changes, for the next waitForEvents().
+ *
+ * @throw - May throw.
+ */
+void KeventScheduler::queueChange(int fd, ChangeType::Value type)
 {
   struct kevent change;
 
-  LogAssert(m_kqueue != -1);
+  if (type == ChangeType::Add)
+    EV_SET(&change, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, reinterpret_cast<void *>(uintptr_t(type)));
+  else
+    EV_SET(&change, fd, EVFILT_READ, EV_DELETE, 0, 0, reinterpret_cast<void *>(uintptr_t(type)));
+  m_changes.push_back(change);
+}
 
-  EV_SET(&change, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-  if (kevent(m_kqueue, &change, 1, NULL, 0, NULL) < 0)
-    gLog.ErrnoError(errno, "Failed to remove socket to kqueue");
+/**
+ * Logs a change that the kernel rejected.
+ */
+void KeventScheduler::handleChangeError(const struct kevent &result)
+{
+  int error = int(result.data);
+
+  if (uintptr_t(result.udata) == uintptr_t(ChangeType::Delete))
+  {
+    // A socket that is closed right after it is removed is taken out of the
+    // kqueue by the close, before the delete is passed in.
+    if (error == ENOENT || error == EBADF)
+      return;
+    gLog.ErrnoError(error, FormatShortStr("Failed to remove socket %d from kqueue", int(result.ident)));
+  }
   else
   {
-    if (m_totalEvents > 0)
-      m_totalEvents--;
-    resizeEvents();
+    // Likewise, a socket that was added and removed before the changes were
+    // passed in may be closed already.
+    if (error == EBADF)
+    {
+      for (size_t i = 0; i < m_changes.size(); i++)
+      {
+        if (m_changes[i].ident == result.ident && uintptr_t(m_changes[i].udata) == uintptr_t(ChangeType::Delete))
+          return;
+      }
+    }
+    gLog.ErrnoError(error, FormatShortStr("Failed to add socket %d to kqueue", int(result.ident)));
   }
 }
 
 /**
- * resizes m_events.
+ * Grows m_events so that it can hold an event for every socket, and a result
+ * for every change. It grows by at least double, so that adding many sockets
+ * does not reallocate for each one. It does not shrink.
+ *
+ * Growing keeps the events, so it is safe while they are being handled.
  *
  * @throw - May throw.
  *
  */
 void KeventScheduler::resizeEvents()
 {
-  // Can not resize if we may be using it.
-  if (m_totalEvents < m_foundEvents)
+  size_t needed = max(size_t(m_totalEvents) + 1, m_changes.size());
+
+  if (needed <= m_events.size())
     return;
 
-  m_events.resize(m_totalEvents + 1);
+  m_events.resize(max(needed, m_events.size() * 2));
 }
 
 
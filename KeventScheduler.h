@@ -18,6 +18,15 @@
 #include <sys/event.h>
 #include <vector>
 
+/**
+ * Waits for socket events with kqueue.
+ *
+ * Adding and removing sockets does not call kevent() right away. The changes
+ * are kept in a changelist, which is passed to the kernel with the kevent()
+ * call of the next waitForEvents(). So creating many sessions at once costs no
+ * extra system calls. Changes that fail are reported back by that call, with
+ * EV_ERROR, and logged.
+ */
 class KeventScheduler : public SchedulerBase
 {
 
@@ -41,6 +50,19 @@ protected:
 
 private:
 
+  // Set as the udata of each change, so that an EV_ERROR result can be matched
+  // to the kind of change.
+  struct ChangeType
+  {
+    enum Value
+    {
+      Add = 1,
+      Delete
+    };
+  };
+
+  void queueChange(int fd, ChangeType::Value type);
+  void handleChangeError(const struct kevent &result);
   void resizeEvents();
 
   int m_totalEvents;
@@ -48,6 +70,7 @@ private:
   int m_foundEvents; // from last waitForEvents()
   int m_nextCheckEvent;  // for getNextSocketEvent
   std::vector<struct kevent> m_events; // from last waitForEvents()
+  std::vector<struct kevent> m_changes; // Passed to the kernel by the next waitForEvents()
 };
 
 
@@ -7,12 +7,60 @@
 #include "Logger.h"
 #include "LogException.h"
 #include "compat.h"
+#include "Atomic.h"
+#include <pthread.h>
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <new>
 
 const size_t Logger::MaxMessageLen;
+const size_t Logger::DefaultAsyncRingSize;
+const size_t Logger::MaxAsyncRingSize;
+const size_t Logger::MaxDeferredDataSize;
+
+/**
+ * A formatted message waiting for the writer thread.
+ */
+struct Logger::AsyncRecord
+{
+  const TypeInfo *typeInfo;
+  DeferredFormatter formatter; // If not NULL, then message holds the data for it.
+  uint64_t sequence;
+  TimeInfo::Type timeType;
+  struct timespec extendedTime;
+  time_t now;
+  char message[MaxMessageLen];
+};
+
+/**
+ * A single producer, single consumer ring. Only the owning thread changes
+ * tail and dropped. Only the writer thread changes head.
+ */
+struct Logger::AsyncRing
+{
+  AsyncRing(size_t ringSize) :
+     records(new(std::nothrow) AsyncRecord[ringSize])
+     , size(ringSize)
+     , head(0)
+     , tail(0)
+     , dropped(0)
+     , reportedDropped(0)
+     , closed(false)
+  {
+  }
+
+  ~AsyncRing() { delete[] records;}
+
+  AsyncRecord *records;
+  size_t size;
+  size_t head;  // Atomic. Count of records written out.
+  size_t tail;  // Atomic. Count of records queued.
+  uint64_t dropped; // Atomic. Messages dropped because the ring was full.
+  uint64_t reportedDropped; // Writer thread only.
+  bool closed; // Atomic. The owning thread has exited.
+};
 
 
 // We use our own simple auto lock, since the real one uses logging ... which
@@ -93,6 +141,14 @@ Logger:: Logger() :
    , m_logFile(NULL)
    , m_useSyslog(false)
    , m_extendedTimeInfo(TimeInfo::None)
+   , m_printTypeNames(false)
+   , m_enabledTypes(0)
+   , m_asyncRunning(false)
+   , m_asyncRingSize(DefaultAsyncRingSize)
+   , m_asyncStop(false)
+   , m_asyncWriterSleeping(false)
+   , m_asyncSequence(0)
+   , m_asyncDropped(0)
 {
 
   if (pthread_rwlock_init(&m_settingsLock, NULL))
@@ -101,6 +157,14 @@ Logger:: Logger() :
     exit(1);
   }
 
+  if (pthread_mutex_init(&m_asyncLock, NULL)
+      || pthread_cond_init(&m_asyncCondition, NULL)
+      || pthread_key_create(&m_asyncKey, handleAsyncThreadExit))
+  {
+    fprintf(stderr,  "Failed to initialize asynchronous logging\n");
+    exit(1);
+  }
+
   // Create the levels and types. Yes, this may leak a little if a memory
   // exception is thrown.
   m_levelsMap = new LevelInfo[m_levelCount];
@@ -130,6 +194,15 @@ Logger:: Logger() :
 
 Logger::~Logger()
 {
+  stopAsync();
+
+  pthread_key_delete(m_asyncKey);
+  for (size_t i = 0; i < m_asyncRings.size(); ++i)
+    delete m_asyncRings[i];
+  m_asyncRings.clear();
+  pthread_cond_destroy(&m_asyncCondition);
+  pthread_mutex_destroy(&m_asyncLock);
+
   closeLogFile();
   closeSyslog();
 
@@ -167,21 +240,28 @@ void Logger::setLevelTypes(Log::Level level, bool value)
   memset(m_levelsMap[level].types, value ? 1 : 0, sizeof(bool) * m_typeCount);
 }
 
-void Logger::LogToSyslog(const char *ident, bool teeLogToStderr)
+void Logger::LogToSyslog(const char *ident, bool teeLogToStderr, size_t asyncRingSize)
 {
-  LogAutoLock lock(&m_settingsLock, LogAutoLock::Write);
+  // Anything already queued goes out with the old settings.
+  stopAsync();
 
-  int opt = LOG_NDELAY;
+  {
+    LogAutoLock lock(&m_settingsLock, LogAutoLock::Write);
 
-  if (teeLogToStderr)
-    opt |= LOG_PERROR;
+    int opt = LOG_NDELAY;
 
-  closeLogFile();
-  closeSyslog();
+    if (teeLogToStderr)
+      opt |= LOG_PERROR;
+
+    closeLogFile();
+    closeSyslog();
+
+    openlog(ident, opt, LOG_DAEMON);
+    m_useSyslog = true;
+    m_ident = ident;
+  }
 
-  openlog(ident, opt, LOG_DAEMON);
-  m_useSyslog = true;
-  m_ident = ident;
+  startAsync(asyncRingSize);
 }
 
 /**
@@ -196,14 +276,19 @@ void Logger::closeSyslog()
 
 }
 
+bool Logger::LogToFile(const char *logFilePath, size_t asyncRingSize)
+{
+  // Anything already queued goes out with the old settings.
+  stopAsync();
+  bool result = setLogFile(logFilePath);
+  startAsync(asyncRingSize);
+  return result;
+}
+
 /**
- * All logging goes to the file. Stops syslog logging.
- *
- * @param logFilePath [in] - The path of the file to log to.
- *
- * @return bool - false if failed to open file.
+ * Implements LogToFile().
  */
-bool Logger::LogToFile(const char *logFilePath)
+bool Logger::setLogFile(const char *logFilePath)
 {
   FILE *newFile;
   LogAutoLock lock(&m_settingsLock, LogAutoLock::Write);
@@ -255,6 +340,22 @@ void Logger::SetLogLevel(Log::Level level)
   // Set all log types.
   for (size_t index = 0; index < m_typeCount; index++)
     m_types[index].enabled = isTypeInLevel((Log::Type)index, level);
+  updateEnabledTypes();
+}
+
+/**
+ * Updates m_enabledTypes from m_types. Must hold write lock to call.
+ */
+void Logger::updateEnabledTypes()
+{
+  uint32_t enabledTypes = 0;
+
+  for (size_t index = 0; index < m_typeCount && index < 32; index++)
+  {
+    if (m_types[index].enabled)
+      enabledTypes |= uint32_t(1) << index;
+  }
+  m_enabledTypes = enabledTypes;
 }
 
 
@@ -383,6 +484,7 @@ void Logger::EnableLogType(Log::Type type, bool enable)
     return;
 
   m_types[type].enabled = enable;
+  updateEnabledTypes();
 }
 
 bool Logger::LogTypeEnabled(Log::Type type)
@@ -427,6 +529,37 @@ void Logger::OptionalVa(Log::Type type, const char *format, va_list args)
 }
 
 
+void Logger::Deferred(Log::Type type, DeferredFormatter formatter, const void *data, size_t dataSize)
+{
+  LogAutoLock lock(&m_settingsLock, LogAutoLock::Read);
+
+  if (!isLogTypeValid(type) || dataSize > MaxDeferredDataSize)
+    return;
+
+  const TypeInfo *typeInfo = &m_types[type];
+  if (!typeInfo->enabled)
+    return;
+
+  if (m_asyncRunning && !typeInfo->throws)
+  {
+    AsyncRing *ring;
+    AsyncRecord *record = reserveAsyncRecord(&ring);
+    if (record)
+    {
+      memcpy(record->message, data, dataSize);
+      record->formatter = formatter;
+      commitAsyncRecord(ring, record, typeInfo);
+      return;
+    }
+    if (ring)
+      return; // Dropped
+  }
+
+  char message[MaxMessageLen];
+  formatter(message, sizeof(message), data);
+  logFormattedMsg(typeInfo, message);
+}
+
 void Logger::Message(Log::Type type, const char *format, ...)
 {
   LogAutoLock lock(&m_settingsLock, LogAutoLock::Read);
@@ -452,39 +585,75 @@ void Logger::MessageVa(Log::Type type, const char *format, va_list args)
 
 
 /**
+ * Gets the time for the extended time info.
  *
- * Do the actual message format and output.
+ * @param type [in] - The type of time.
+ * @param outTime [out] - Set to 0 if type is None, or on failure.
+ */
+static void getExtendedTime(Logger::TimeInfo::Type type, struct timespec &outTime)
+{
+  int result = -1;
+
+  if (type == Logger::TimeInfo::Real)
+    result = clock_gettime(CLOCK_REALTIME, &outTime);
+  else if (type == Logger::TimeInfo::Mono)
+    result = clock_gettime(CLOCK_MONOTONIC, &outTime);
+
+  if (0 > result)
+    outTime.tv_sec = outTime.tv_nsec = 0;
+}
+
+/**
+ *
+ * Do the actual message format and output, or queue it for the writer thread.
  * Must hold at least a read lock.
  *
  */
 void Logger::logMsg(const TypeInfo *typeInfo, const char *format, va_list args)
 {
+  if (m_asyncRunning && !typeInfo->throws)
+  {
+    if (queueAsyncMsg(typeInfo, format, args))
+      return;
+  }
+
   char message[MaxMessageLen];
-  char timeStr[64];
 
   vsnprintf(message, sizeof(message), format, args);
+  logFormattedMsg(typeInfo, message);
+}
+
+/**
+ * Outputs a formatted message synchronously, or throws.
+ * Must hold at least a read lock.
+ */
+void Logger::logFormattedMsg(const TypeInfo *typeInfo, const char *message)
+{
+  struct timespec extendedTime;
 
   if (typeInfo->throws)
     throw (LogException(message));
 
-  if (m_extendedTimeInfo == TimeInfo::Real)
-  {
-    struct timespec extendedNow;
-
-    if (0 > clock_gettime(CLOCK_REALTIME, &extendedNow))
-      extendedNow.tv_sec = extendedNow.tv_nsec = 0;
-
-    snprintf(timeStr, sizeof(timeStr), "[%jd:%09ld]", (intmax_t)extendedNow.tv_sec, extendedNow.tv_nsec);
-  }
-  else if (m_extendedTimeInfo == TimeInfo::Mono)
-  {
-    struct timespec extendedNow;
+  getExtendedTime(m_extendedTimeInfo, extendedTime);
+  writeMsg(typeInfo, message, m_extendedTimeInfo, extendedTime, (time_t)time(NULL));
+}
 
-    if (0 > clock_gettime(CLOCK_MONOTONIC, &extendedNow))
-      extendedNow.tv_sec = extendedNow.tv_nsec = 0;
+/**
+ * Does the output for a formatted message.
+ * Must hold at least a read lock.
+ *
+ * @param typeInfo [in] - The type of the message.
+ * @param message [in] - The formatted message.
+ * @param timeType [in] - The extended time info to use.
+ * @param extendedTime [in] - The extended time, if timeType is not None.
+ * @param now [in] - The time of the message.
+ */
+void Logger::writeMsg(const TypeInfo *typeInfo, const char *message, TimeInfo::Type timeType, const struct timespec &extendedTime, time_t now)
+{
+  char timeStr[64];
 
-    snprintf(timeStr, sizeof(timeStr), "[%jd:%09ld]", (intmax_t)extendedNow.tv_sec, extendedNow.tv_nsec);
-  }
+  if (timeType == TimeInfo::Real || timeType == TimeInfo::Mono)
+    snprintf(timeStr, sizeof(timeStr), "[%jd:%09ld]", (intmax_t)extendedTime.tv_sec, extendedTime.tv_nsec);
   else
     timeStr[0] = '\0';
 
@@ -510,8 +679,6 @@ void Logger::logMsg(const TypeInfo *typeInfo, const char *format, va_list args)
 
   if (m_logFile)
   {
-    time_t now = (time_t)time(NULL);
-
     fprintf(m_logFile, "[%u] %s[%d]%s%s%s: %s\n", (unsigned int)now,
             m_ident.c_str(), (int)getpid(),
             timeStr,
@@ -549,6 +716,332 @@ void Logger::logMsg(const TypeInfo *typeInfo, const char *format, va_list args)
 
 }
 
+/**
+ * Starts the writer thread, if it is not already running.
+ *
+ * @param ringSize [in] - The size of rings for threads that do not yet have
+ *                 one. 0 to do nothing.
+ */
+void Logger::startAsync(size_t ringSize)
+{
+  if (ringSize == 0)
+    return;
+
+  LogAutoLock lock(&m_settingsLock, LogAutoLock::Write);
+
+  if (ringSize > MaxAsyncRingSize)
+    ringSize = MaxAsyncRingSize;
+  m_asyncRingSize = ringSize;
+
+  if (m_asyncRunning)
+    return;
+
+  // The writer thread is not running, so no need for m_asyncLock.
+  m_asyncStop = false;
+  if (pthread_create(&m_asyncThread, NULL, asyncWriterCallback, this))
+  {
+    fprintf(stderr,  "Failed to start asynchronous log thread. Logging synchronously.\n");
+    return;
+  }
+  m_asyncRunning = true;
+}
+
+/**
+ * Stops the writer thread, if it is running, after all queued messages have
+ * been written. Must not hold the settings lock.
+ */
+void Logger::stopAsync()
+{
+  {
+    // Once this is clear, with the write lock, no thread can be queueing a message.
+    LogAutoLock lock(&m_settingsLock, LogAutoLock::Write);
+    if (!m_asyncRunning)
+      return;
+    m_asyncRunning = false;
+  }
+
+  pthread_mutex_lock(&m_asyncLock);
+  m_asyncStop = true;
+  pthread_cond_signal(&m_asyncCondition);
+  pthread_mutex_unlock(&m_asyncLock);
+
+  if (pthread_join(m_asyncThread, NULL))
+    fprintf(stderr,  "Failed to join asynchronous log thread\n");
+}
+
+/**
+ * Gets the ring for the calling thread, creating it if needed.
+ *
+ * @return Logger::AsyncRing* - NULL on failure.
+ */
+Logger::AsyncRing* Logger::getAsyncRing()
+{
+  AsyncRing *ring = reinterpret_cast<AsyncRing *>(pthread_getspecific(m_asyncKey));
+  if (ring)
+    return ring;
+
+  ring = new(std::nothrow) AsyncRing(m_asyncRingSize);
+  if (!ring)
+    return NULL;
+  if (!ring->records)
+  {
+    delete ring;
+    return NULL;
+  }
+
+  bool added = true;
+  pthread_mutex_lock(&m_asyncLock);
+  try
+  {
+    m_asyncRings.push_back(ring);
+  }
+  catch (std::exception &)
+  {
+    added = false;
+  }
+  pthread_mutex_unlock(&m_asyncLock);
+
+  if (!added || pthread_setspecific(m_asyncKey, ring))
+  {
+    if (added)
+    {
+      // Let the writer thread free it.
+      atomicStore(&ring->closed, true);
+    }
+    else
+      delete ring;
+    return NULL;
+  }
+
+  return ring;
+}
+
+/**
+ * Formats message into the calling thread's ring. Must hold at least a read
+ * lock.
+ *
+ * The message itself is formatted here, since arguments may not be valid
+ * after the call returns. The decoration and I/O are left for the writer
+ * thread.
+ *
+ * @return bool - false if the message could not be queued, and should be
+ *         logged synchronously. A message dropped because the ring was full
+ *         counts as queued.
+ */
+bool Logger::queueAsyncMsg(const TypeInfo *typeInfo, const char *format, va_list args)
+{
+  AsyncRing *ring;
+  AsyncRecord *record = reserveAsyncRecord(&ring);
+  if (!record)
+    return ring != NULL;
+
+  vsnprintf(record->message, sizeof(record->message), format, args);
+  record->formatter = NULL;
+  commitAsyncRecord(ring, record, typeInfo);
+  return true;
+}
+
+/**
+ * Gets the next free record in the calling thread's ring. If the ring is full
+ * the message is counted as dropped. Must hold at least a read lock.
+ *
+ * @param outRing [out] - Set to the ring, or NULL if there is no ring.
+ *
+ * @return Logger::AsyncRecord* - NULL if there is no record available. The
+ *         caller must fill in the message and formatter, then call
+ *         commitAsyncRecord().
+ */
+Logger::AsyncRecord* Logger::reserveAsyncRecord(AsyncRing **outRing)
+{
+  AsyncRing *ring = getAsyncRing();
+  *outRing = ring;
+  if (!ring)
+    return NULL;
+
+  // Only this thread changes tail.
+  size_t tail = ring->tail;
+  if (tail - atomicLoad(&ring->head) >= ring->size)
+  {
+    atomicStore(&ring->dropped, ring->dropped + 1);
+    return NULL;
+  }
+
+  return &ring->records[tail % ring->size];
+}
+
+/**
+ * Makes a record from reserveAsyncRecord() available to the writer thread.
+ * Must hold at least a read lock.
+ */
+void Logger::commitAsyncRecord(AsyncRing *ring, AsyncRecord *record, const TypeInfo *typeInfo)
+{
+  record->typeInfo = typeInfo;
+  record->timeType = m_extendedTimeInfo;
+  getExtendedTime(m_extendedTimeInfo, record->extendedTime);
+  record->now = (time_t)time(NULL);
+  record->sequence = atomicFetchAdd(&m_asyncSequence, uint64_t(1));
+  atomicStore(&ring->tail, ring->tail + 1);
+
+  if (atomicLoad(&m_asyncWriterSleeping))
+  {
+    pthread_mutex_lock(&m_asyncLock);
+    pthread_cond_signal(&m_asyncCondition);
+    pthread_mutex_unlock(&m_asyncLock);
+  }
+}
+
+/**
+ * Called when a thread with a ring exits.
+ */
+void Logger::handleAsyncThreadExit(void *ring)
+{
+  atomicStore(&reinterpret_cast<AsyncRing *>(ring)->closed, true);
+}
+
+/**
+ * Must hold m_asyncLock.
+ *
+ * @return bool - true if there are no queued messages.
+ */
+bool Logger::asyncRingsEmpty()
+{
+  for (size_t i = 0; i < m_asyncRings.size(); ++i)
+  {
+    AsyncRing *ring = m_asyncRings[i];
+    if (ring->head != atomicLoad(&ring->tail) || ring->reportedDropped != atomicLoad(&ring->dropped))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Writes out all queued messages, in the order they were queued. Also reports
+ * dropped messages, and frees the rings of threads that have exited. Called
+ * only on the writer thread.
+ *
+ * @return size_t - The number of messages written.
+ */
+size_t Logger::drainAsync()
+{
+  size_t written = 0;
+
+  // Lock order is always settings lock, then m_asyncLock.
+  LogAutoLock lock(&m_settingsLock, LogAutoLock::Read);
+  pthread_mutex_lock(&m_asyncLock);
+
+  while (true)
+  {
+    AsyncRing *next = NULL;
+    uint64_t nextSequence = 0;
+
+    for (size_t i = 0; i < m_asyncRings.size(); ++i)
+    {
+      AsyncRing *ring = m_asyncRings[i];
+      if (ring->head == atomicLoad(&ring->tail))
+        continue;
+      uint64_t sequence = ring->records[ring->head % ring->size].sequence;
+      if (!next || sequence < nextSequence)
+      {
+        next = ring;
+        nextSequence = sequence;
+      }
+    }
+
+    if (!next)
+      break;
+
+    const AsyncRecord &record = next->records[next->head % next->size];
+    if (record.formatter)
+    {
+      // Copy, since the data may not be aligned for its type in the record.
+      uint64_t data[MaxDeferredDataSize / sizeof(uint64_t)];
+      char message[MaxMessageLen];
+
+      memcpy(data, record.message, sizeof(data));
+      record.formatter(message, sizeof(message), data);
+      writeMsg(record.typeInfo, message, record.timeType, record.extendedTime, record.now);
+    }
+    else
+      writeMsg(record.typeInfo, record.message, record.timeType, record.extendedTime, record.now);
+    atomicStore(&next->head, next->head + 1);
+    written++;
+  }
+
+  for (size_t i = 0; i < m_asyncRings.size(); ++i)
+  {
+    AsyncRing *ring = m_asyncRings[i];
+    uint64_t dropped = atomicLoad(&ring->dropped);
+    if (dropped != ring->reportedDropped)
+    {
+      char message[MaxMessageLen];
+      struct timespec extendedTime;
+
+      snprintf(message, sizeof(message), "Dropped %" PRIu64 " log messages because the asynchronous log queue was full.", dropped - ring->reportedDropped);
+      getExtendedTime(m_extendedTimeInfo, extendedTime);
+      writeMsg(&m_types[Log::Warn], message, m_extendedTimeInfo, extendedTime, (time_t)time(NULL));
+      atomicFetchAdd(&m_asyncDropped, dropped - ring->reportedDropped);
+      ring->reportedDropped = dropped;
+    }
+
+    if (atomicLoad(&ring->closed) && ring->head == atomicLoad(&ring->tail))
+    {
+      m_asyncRings.erase(m_asyncRings.begin() + i);
+      delete ring;
+      --i;
+    }
+  }
+
+  pthread_mutex_unlock(&m_asyncLock);
+  return written;
+}
+
+/**
+ * The writer thread.
+ */
+void Logger::asyncWriter()
+{
+  while (true)
+  {
+    if (drainAsync() != 0)
+      continue;
+
+    pthread_mutex_lock(&m_asyncLock);
+    if (m_asyncStop)
+    {
+      pthread_mutex_unlock(&m_asyncLock);
+      break;
+    }
+
+    // Producers only signal when we are sleeping. Since they signal with
+    // m_asyncLock held, checking after setting the flag prevents lost wakeups.
+    atomicStore(&m_asyncWriterSleeping, true);
+    if (asyncRingsEmpty() && !m_asyncStop)
+    {
+      // Wake periodically regardless, to catch drops from a full ring.
+      struct timespec deadline;
+      if (0 > clock_gettime(CLOCK_REALTIME, &deadline))
+        deadline.tv_sec = deadline.tv_nsec = 0;
+      deadline.tv_nsec += 100000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&m_asyncCondition, &m_asyncLock, &deadline);
+    }
+    atomicStore(&m_asyncWriterSleeping, false);
+    pthread_mutex_unlock(&m_asyncLock);
+  }
+
+  // Anything queued before m_asyncRunning was cleared.
+  drainAsync();
+}
+
+uint64_t Logger::GetAsyncDropCount()
+{
+  return atomicLoad(&m_asyncDropped);
+}
+
 /**
  * Always logs message.
  * If using syslog then this uses the LOG_WARNING level.
@@ -599,6 +1092,9 @@ void Logger::Fatal(const char *format, ...)
 {
   Log::Type type = Log::Critical;
 
+  // Make sure that queued messages, and this one, are written before exiting.
+  stopAsync();
+
   LogAutoLock lock(&m_settingsLock, LogAutoLock::Read);
   va_list args;
   va_start(args, format);
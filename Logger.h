@@ -5,7 +5,9 @@
 ***************************************************************/
 #pragma once
 #include <string>
+#include <vector>
 #include <stdio.h>
+#include <time.h>
 #include <cstdarg>
 #include "LogTypes.h"
 
@@ -22,6 +24,11 @@
  *
  * It is thread safe, as long as only one is created. Only create one subclass
  * per process.
+ *
+ * Logging may be asynchronous (see LogToSyslog() and LogToFile()). In that case
+ * each thread formats the message into its own single producer ring, and a
+ * writer thread does the remaining formatting and all of the I/O. When a ring
+ * is full messages are dropped, and the number dropped is logged later.
  */
 class Logger
 {
@@ -42,6 +49,20 @@ public:
 
   static const size_t MaxMessageLen  = 1024;
 
+  static const size_t DefaultAsyncRingSize = 256;
+  static const size_t MaxAsyncRingSize = 65536;
+  static const size_t MaxDeferredDataSize = 512;
+
+  /**
+   * Formats the data passed to Deferred(). This is called only if the message
+   * is logged, and may be called on the log writer thread.
+   *
+   * @param outBuf [out] - Where to put the message.
+   * @param bufSize [in] - The size of outBuf.
+   * @param data [in] - A copy of the data passed to Deferred().
+   */
+  typedef void (*DeferredFormatter)(char *outBuf, size_t bufSize, const void *data);
+
   /**
    *  Create a logger. Uses stderr for logging by default.
    *  May throw on memory error.
@@ -58,18 +79,30 @@ public:
    *
    * @param ident [in] - The name to use for syslogging.
    * @param teeLogToStderr [in] - Should all logging also be sent to stdout?
+   * @param asyncRingSize [in] - If not 0, then logging is asynchronous, with a
+   *                      ring of this many messages for each thread. 0 logs
+   *                      synchronously on the calling thread.
    */
-  void LogToSyslog(const char *ident, bool teeLogToStderr);
+  void LogToSyslog(const char *ident, bool teeLogToStderr, size_t asyncRingSize = 0);
 
 
   /**
    * All logging goes to the file. Stops syslog logging.
    *
    * @param logFilePath [in] - The path of the file to log to.
+   * @param asyncRingSize [in] - See LogToSyslog().
    *
    * @return bool - false if failed to open file.
    */
-  bool LogToFile(const char *logFilePath);
+  bool LogToFile(const char *logFilePath, size_t asyncRingSize = 0);
+
+  /**
+   * Gets the number of messages that have been dropped, and reported, because
+   * an asynchronous logging ring was full.
+   *
+   * @return uint64_t
+   */
+  uint64_t GetAsyncDropCount();
 
   /**
    * Sets the level for Optional() logging.
@@ -95,6 +128,20 @@ public:
    */
   bool LogTypeEnabled(Log::Type type);
 
+  /**
+   * Like LogTypeEnabled(), but does not lock, so it can be inlined. It may
+   * briefly give a stale result while the type is being changed on another
+   * thread, so use it only to skip work when logging is off.
+   *
+   * @param type
+   *
+   * @return bool - false if the type is disabled.
+   */
+  bool LogTypeEnabledHint(Log::Type type) const
+  {
+    return size_t(type) >= 32 || ((m_enabledTypes >> unsigned(type)) & 1);
+  }
+
   /**
    *
    * Enables/disables throwing a LogException() for the given log type.
@@ -244,6 +291,19 @@ public:
    */
   void OptionalVa(Log::Type type, const char* format, va_list args);
 
+  /**
+   * Optionally logs a message, like Optional(), but the message is formatted
+   * by formatter only when it is written out. With asynchronous logging that
+   * is on the log writer thread, so the arguments are captured by copying
+   * data. See LogDeferred() in common.h.
+   *
+   * @param type
+   * @param formatter [in] - Called to format the message.
+   * @param data [in] - Must be trivially copyable.
+   * @param dataSize [in] - Must be no more than MaxDeferredDataSize.
+   */
+  void Deferred(Log::Type type, DeferredFormatter formatter, const void *data, size_t dataSize);
+
 
   /**
    * Always logs message.
@@ -313,14 +373,32 @@ protected:
   void setLevelTypes(Log::Level level, bool value);
 
 private:
+  struct AsyncRecord;
+  struct AsyncRing;
 
   void closeSyslog();
   void closeLogFile();
+  bool setLogFile(const char *logFilePath);
   bool isTypeInLevel(Log::Type type, Log::Level level);
   void logMsg(const TypeInfo *typeInfo, const char *format, va_list args);
+  void logFormattedMsg(const TypeInfo *typeInfo, const char *message);
+  void writeMsg(const TypeInfo *typeInfo, const char *message, TimeInfo::Type timeType, const struct timespec &extendedTime, time_t now);
   bool isLogTypeValid(Log::Type type);
   bool isLogLevelValid(Log::Level level);
 
+  void startAsync(size_t ringSize);
+  void stopAsync();
+  bool queueAsyncMsg(const TypeInfo *typeInfo, const char *format, va_list args);
+  AsyncRecord* reserveAsyncRecord(AsyncRing **outRing);
+  void commitAsyncRecord(AsyncRing *ring, AsyncRecord *record, const TypeInfo *typeInfo);
+  void updateEnabledTypes();
+  AsyncRing* getAsyncRing();
+  static void* asyncWriterCallback(void *arg) { reinterpret_cast<Logger *>(arg)->asyncWriter(); return NULL;}
+  void asyncWriter();
+  size_t drainAsync();
+  bool asyncRingsEmpty();
+  static void handleAsyncThreadExit(void *ring);
+
   //
   // All these are protected by m_settingsLock
   //
@@ -331,5 +409,20 @@ private:
   std::string m_ident; // Used with syslog
   TimeInfo::Type m_extendedTimeInfo;
   bool m_printTypeNames; // Add the type names to the log
+  volatile uint32_t m_enabledTypes; // Bit for each enabled type. Read without lock.
+  bool m_asyncRunning; // Is the writer thread running.
+  size_t m_asyncRingSize; // Size for newly created rings.
 
+  //
+  // Asynchronous logging. These are protected by m_asyncLock, except as noted.
+  //
+  pthread_mutex_t m_asyncLock;
+  pthread_cond_t m_asyncCondition;
+  pthread_key_t m_asyncKey; // The ring for each thread. Not locked.
+  std::vector<AsyncRing *> m_asyncRings;
+  pthread_t m_asyncThread;
+  bool m_asyncStop; // Tells the writer thread to drain and exit.
+  bool m_asyncWriterSleeping; // Atomic. Producers signal m_asyncCondition only when set.
+  uint64_t m_asyncSequence; // Atomic. Keeps messages from different threads in order.
+  uint64_t m_asyncDropped; // Atomic. Total dropped messages reported.
 };
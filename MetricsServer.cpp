@@ -0,0 +1,405 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "MetricsServer.h"
+#include "Beacon.h"
+#include "StatusExport.h"
+#include "Atomic.h"
+#include "utils.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <vector>
+
+using namespace std;
+
+#ifdef MSG_NOSIGNAL
+static const int SendFlags = MSG_NOSIGNAL;
+#else
+static const int SendFlags = 0;
+#endif
+
+MetricsServer::MetricsServer(Beacon &beacon) :
+   m_beacon(&beacon),
+   m_listenSocket(),
+   m_threadStarted(false),
+   m_stopRequested(0),
+   m_sendFailed(false)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+  Stop();
+}
+
+bool MetricsServer::Start(const SockAddr &addr)
+{
+  if (!LogVerify(!m_threadStarted))
+    return false;
+
+  m_listenSocket.SetLogName(FormatShortStr("Metrics listen socket on %s", addr.ToString()));
+
+  if (!m_listenSocket.OpenTCP(addr.Type())
+      || !m_listenSocket.SetBlocking(false)
+      || !m_listenSocket.SetReusePort(true)
+      || !m_listenSocket.Bind(addr)
+      || !m_listenSocket.Listen(16))
+  {
+    gLog.LogError("Failed to listen for metrics scrapes on %s.", addr.ToString());
+    m_listenSocket.Close();
+    return false;
+  }
+
+  atomicStore(&m_stopRequested, uint32_t(0));
+  if (pthread_create(&m_thread, NULL, threadCallback, this))
+  {
+    gLog.LogError("Failed to create metrics thread.");
+    m_listenSocket.Close();
+    return false;
+  }
+
+  m_threadStarted = true;
+  gLog.Optional(Log::App, "Serving metrics on %s", addr.ToString());
+  return true;
+}
+
+void MetricsServer::Stop()
+{
+  if (!m_threadStarted)
+    return;
+
+  atomicStore(&m_stopRequested, uint32_t(1));
+  pthread_join(m_thread, NULL);
+  m_threadStarted = false;
+  m_listenSocket.Close();
+}
+
+/**
+ * The thread. Waits for connections, checking for Stop() every StopPollMs.
+ */
+void MetricsServer::serve()
+{
+  if (!UtilsInitThread())
+  {
+    gLog.Message(Log::Error,  "Failed to initialize metrics thread. TLS memory failure.");
+    return;
+  }
+
+  while (!atomicLoad(&m_stopRequested))
+  {
+    struct pollfd pollInfo;
+    pollInfo.fd = m_listenSocket;
+    pollInfo.events = POLLIN;
+    pollInfo.revents = 0;
+
+    if (::poll(&pollInfo, 1, int(StopPollMs)) <= 0)
+      continue;
+
+    Socket socket;
+    if (!m_listenSocket.Accept(socket))
+      continue;
+    socket.SetLogName(FormatShortStr("Metrics connection to %s", socket.GetAddress().ToString()));
+    handleConnection(socket);
+  }
+}
+
+void MetricsServer::handleConnection(Socket &socket)
+{
+  struct timeval timeout;
+  timeout.tv_sec = IoTimeoutMs / 1000;
+  timeout.tv_usec = (IoTimeoutMs % 1000) * 1000;
+
+  if (!socket.SetBlocking(true)
+      || 0 != setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+      || 0 != setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+    return;
+
+  string path;
+  if (!readRequest(socket, path))
+  {
+    const char *reply = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
+    sendAll(socket, reply, strlen(reply));
+    return;
+  }
+
+  if (path != "/metrics" && path != "/")
+  {
+    const char *reply = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+       "Metrics are at /metrics\n";
+    sendAll(socket, reply, strlen(reply));
+    return;
+  }
+
+  writeMetrics(socket);
+}
+
+/**
+ * Reads the request headers, which are ignored, except for the path.
+ *
+ * @return bool - false if it is not a GET request.
+ */
+bool MetricsServer::readRequest(Socket &socket, std::string &outPath)
+{
+  char buffer[MaxRequestSize];
+  size_t used = 0;
+
+  while (true)
+  {
+    ssize_t received = ::recv(socket, buffer + used, sizeof(buffer) - 1 - used, 0);
+    if (received <= 0)
+    {
+      if (received < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    used += size_t(received);
+    buffer[used] = '\0';
+    if (strstr(buffer, "\r\n\r\n") || strstr(buffer, "\n\n"))
+      break;
+    if (used == sizeof(buffer) - 1)
+      return false;
+  }
+
+  if (0 != strncmp(buffer, "GET ", 4))
+    return false;
+
+  const char *path = buffer + 4;
+  const char *pathEnd = strpbrk(path, " ?\r\n");
+  if (!pathEnd)
+    return false;
+  outPath.assign(path, pathEnd);
+  return true;
+}
+
+bool MetricsServer::sendAll(Socket &socket, const char *data, size_t length)
+{
+  while (length)
+  {
+    ssize_t sent = ::send(socket, data, length, SendFlags);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += sent;
+    length -= size_t(sent);
+  }
+  return true;
+}
+
+/**
+ * Sends m_output once it is large, or if force is set. After a failure, the
+ * rest of the reply is discarded.
+ */
+bool MetricsServer::flush(Socket &socket, bool force)
+{
+  if (m_output.size() < FlushSize && !force)
+    return !m_sendFailed;
+
+  if (!m_sendFailed && !sendAll(socket, m_output.data(), m_output.size()))
+    m_sendFailed = true;
+  m_output.clear();
+  return !m_sendFailed;
+}
+
+void MetricsServer::append(const char *format, ...)
+{
+  char buffer[512];
+  va_list args;
+
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  if (length > 0)
+    m_output.append(buffer, min(size_t(length), sizeof(buffer) - 1));
+}
+
+void MetricsServer::writeMetrics(Socket &socket)
+{
+  m_sendFailed = false;
+  m_output.clear();
+  m_output.reserve(FlushSize + 1024);
+
+  append("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+
+  writeSessionMetrics(socket);
+  writeSchedulerMetrics(socket);
+  flush(socket, true);
+
+  // Do not hold a large buffer between scrapes.
+  string().swap(m_output);
+}
+
+static const char* exportAddressString(const uint8_t *addr, uint8_t family, char *outBuffer, size_t bufferSize)
+{
+  if (!inet_ntop(family == 6 ? AF_INET6 : AF_INET, addr, outBuffer, socklen_t(bufferSize)))
+    return "";
+  return outBuffer;
+}
+
+void MetricsServer::writeSessionMetrics(Socket &socket)
+{
+  StatusExport *statusExport = m_beacon->GetStatusExport();
+  if (!statusExport)
+    return;
+
+  // Copy the records first, so that every metric of a session comes from the
+  // same copy, and so that the labels are formatted once.
+  vector<StatusExportRecord> records;
+  vector<string> labels;
+  char localAddr[INET6_ADDRSTRLEN];
+  char remoteAddr[INET6_ADDRSTRLEN];
+  size_t shardCount = statusExport->GetShardCount();
+
+  for (size_t shard = 0; shard < shardCount; shard++)
+  {
+    for (size_t index = 0; index < statusExport->GetRecordsPerShard(); index++)
+    {
+      StatusExportRecord record;
+      if (!StatusExport::Read(*statusExport->GetRecord(shard, index), record) || record.id == 0)
+        continue;
+      records.push_back(record);
+      labels.push_back(FormatShortStr("id=\"%u\",local=\"%s\",remote=\"%s\"", record.id,
+                                      exportAddressString(record.localAddr, record.localFamily, localAddr, sizeof(localAddr)),
+                                      exportAddressString(record.remoteAddr, record.remoteFamily, remoteAddr, sizeof(remoteAddr))));
+    }
+  }
+
+  append("# HELP bfd_export_sessions Sessions with metrics.\n# TYPE bfd_export_sessions gauge\n");
+  for (size_t shard = 0; shard < shardCount; shard++)
+    append("bfd_export_sessions{shard=\"%zu\"} %" PRIu64 "\n", shard, atomicLoad(&statusExport->GetShard(shard)->sessions));
+  append("# HELP bfd_export_missing_sessions Sessions without metrics, for lack of room. See --statusexportsize.\n"
+         "# TYPE bfd_export_missing_sessions gauge\n");
+  for (size_t shard = 0; shard < shardCount; shard++)
+    append("bfd_export_missing_sessions{shard=\"%zu\"} %" PRIu64 "\n", shard, atomicLoad(&statusExport->GetShard(shard)->missing));
+
+  uint64_t now = uint64_t(TimeSpec::MonoNow().ToNanoseconds());
+  struct Gauge
+  {
+    const char *name;
+    const char *help;
+    const char *type;
+  };
+  static const Gauge gauges[] =
+  {
+    { "bfd_session_state", "Local state: 0 AdminDown, 1 Down, 2 Init, 3 Up.", "gauge"},
+    { "bfd_session_up", "1 if the local state is Up.", "gauge"},
+    { "bfd_session_diag", "Local diagnostic code.", "gauge"},
+    { "bfd_session_remote_state", "State reported by the remote system.", "gauge"},
+    { "bfd_session_transmit_interval_seconds", "Current transmit interval.", "gauge"},
+    { "bfd_session_detection_time_seconds", "Current detection time.", "gauge"},
+    { "bfd_session_state_duration_seconds", "Time in the current state.", "gauge"},
+    { "bfd_session_received_packets_total", "Control packets received.", "counter"},
+    { "bfd_session_sent_packets_total", "Control packets sent.", "counter"},
+    { "bfd_session_discarded_packets_total", "Received control packets that were discarded.", "counter"},
+    { "bfd_session_state_changes_total", "Changes of the local state.", "counter"},
+    { "bfd_session_poll_sequences_total", "Poll sequences started.", "counter"},
+  };
+
+  for (size_t gauge = 0; gauge < countof(gauges); gauge++)
+  {
+    append("# HELP %s %s\n# TYPE %s %s\n", gauges[gauge].name, gauges[gauge].help, gauges[gauge].name, gauges[gauge].type);
+    for (size_t index = 0; index < records.size(); index++)
+    {
+      const StatusExportRecord &record = records[index];
+      const char *name = gauges[gauge].name;
+      const char *label = labels[index].c_str();
+
+      switch (gauge)
+      {
+      case 0: append("%s{%s} %u\n", name, label, unsigned(record.localState)); break;
+      case 1: append("%s{%s} %u\n", name, label, record.localState == bfd::State::Up ? 1u : 0u); break;
+      case 2: append("%s{%s} %u\n", name, label, unsigned(record.localDiag)); break;
+      case 3: append("%s{%s} %u\n", name, label, unsigned(record.remoteState)); break;
+      case 4: append("%s{%s} %.6f\n", name, label, double(record.transmitInterval) / 1e6); break;
+      case 5: append("%s{%s} %.6f\n", name, label, double(record.detectionTime) / 1e6); break;
+      case 6:
+        if ((record.flags & StatusExportRecord::Flag::HasUptime) && now > record.lastChange)
+          append("%s{%s} %.3f\n", name, label, double(now - record.lastChange) / 1e9);
+        break;
+      case 7: append("%s{%s} %" PRIu64 "\n", name, label, record.received); break;
+      case 8: append("%s{%s} %" PRIu64 "\n", name, label, record.sent); break;
+      case 9: append("%s{%s} %" PRIu64 "\n", name, label, record.discarded); break;
+      case 10: append("%s{%s} %" PRIu64 "\n", name, label, record.stateChanges); break;
+      case 11: append("%s{%s} %" PRIu64 "\n", name, label, record.pollSequences); break;
+      }
+      if (!flush(socket, false))
+        return;
+    }
+  }
+}
+
+/**
+ * Adds the samples of a summary. Histograms from the scheduler are in
+ * microseconds, and scale converts them.
+ */
+void MetricsServer::writeSummary(const char *name, const char *labels, const Histogram &histogram, double scale)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0};
+
+  for (size_t index = 0; index < countof(quantiles); index++)
+  {
+    append("%s{%s,quantile=\"%g\"} %g\n", name, labels, quantiles[index],
+           double(histogram.Percentile(quantiles[index] * 100)) * scale);
+  }
+  append("%s_sum{%s} %g\n", name, labels, double(histogram.Sum()) * scale);
+  append("%s_count{%s} %" PRIu64 "\n", name, labels, histogram.Count());
+}
+
+void MetricsServer::writeSchedulerMetrics(Socket &socket)
+{
+  vector<Scheduler::Stats> stats(m_beacon->GetShardCount());
+  vector<bool> valid(stats.size());
+
+  for (size_t shard = 0; shard < stats.size(); shard++)
+    valid[shard] = m_beacon->GetPublishedSchedulerStats(shard, stats[shard]);
+
+  append("# HELP bfd_scheduler_iterations_total Times through the event loop.\n"
+         "# TYPE bfd_scheduler_iterations_total counter\n");
+  for (size_t shard = 0; shard < stats.size(); shard++)
+  {
+    if (valid[shard])
+      append("bfd_scheduler_iterations_total{shard=\"%zu\"} %" PRIu64 "\n", shard, stats[shard].iterations);
+  }
+
+  append("# HELP bfd_scheduler_timer_lateness_seconds How late timers expired.\n"
+         "# TYPE bfd_scheduler_timer_lateness_seconds summary\n");
+  for (size_t shard = 0; shard < stats.size(); shard++)
+  {
+    if (!valid[shard])
+      continue;
+    writeSummary("bfd_scheduler_timer_lateness_seconds", FormatShortStr("shard=\"%zu\",priority=\"low\"", shard),
+                 stats[shard].timerLateness[Timer::Priority::Low], 1e-6);
+    writeSummary("bfd_scheduler_timer_lateness_seconds", FormatShortStr("shard=\"%zu\",priority=\"hi\"", shard),
+                 stats[shard].timerLateness[Timer::Priority::Hi], 1e-6);
+  }
+
+  append("# HELP bfd_scheduler_iteration_seconds Time handling timers and events in one loop iteration.\n"
+         "# TYPE bfd_scheduler_iteration_seconds summary\n");
+  for (size_t shard = 0; shard < stats.size(); shard++)
+  {
+    if (valid[shard])
+      writeSummary("bfd_scheduler_iteration_seconds", FormatShortStr("shard=\"%zu\"", shard), stats[shard].iterationTime, 1e-6);
+  }
+
+  append("# HELP bfd_scheduler_low_starvation_iterations Iterations that each low priority timer waited after expiring.\n"
+         "# TYPE bfd_scheduler_low_starvation_iterations summary\n");
+  for (size_t shard = 0; shard < stats.size(); shard++)
+  {
+    if (valid[shard])
+      writeSummary("bfd_scheduler_low_starvation_iterations", FormatShortStr("shard=\"%zu\"", shard), stats[shard].lowStarvation, 1);
+  }
+
+  flush(socket, false);
+}
@@ -0,0 +1,76 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Prometheus metrics over HTTP. See Beacon::SetMetrics().
+
+ */
+#pragma once
+
+#include "SockAddr.h"
+#include "Socket.h"
+#include "threads.h"
+#include <string>
+
+class Beacon;
+class Histogram;
+
+/**
+ * Serves GET /metrics in the Prometheus text format, on a thread of its own.
+ * Everything is read without involving the shard threads: sessions from the
+ * status export, and scheduler statistics from what each shard publishes. See
+ * Beacon::SetMetrics().
+ *
+ * Scrapes are handled one at a time, since a scraper is expected to connect
+ * every few seconds at most. A connection that stalls is closed after
+ * IoTimeoutMs.
+ */
+class MetricsServer
+{
+public:
+  MetricsServer(Beacon &beacon);
+  ~MetricsServer();
+
+  /**
+   * Starts listening on a thread of its own. Errors are logged.
+   *
+   * @param addr [in] - Address and port to listen on.
+   *
+   * @return bool - false on failure.
+   */
+  bool Start(const SockAddr &addr);
+
+  /**
+   * Stops listening, and waits for the thread to exit.
+   */
+  void Stop();
+
+private:
+  static const uint32_t StopPollMs = 250;
+  static const uint32_t IoTimeoutMs = 5000;
+  static const size_t MaxRequestSize = 8192;
+  static const size_t FlushSize = 64 * 1024;
+
+  static void* threadCallback(void *arg) { reinterpret_cast<MetricsServer *>(arg)->serve(); return NULL;}
+  void serve();
+  void handleConnection(Socket &socket);
+  bool readRequest(Socket &socket, std::string &outPath);
+  bool sendAll(Socket &socket, const char *data, size_t length);
+  bool flush(Socket &socket, bool force);
+  void append(const char *format, ...) ATTR_FORMAT(printf, 2, 3);
+  void writeMetrics(Socket &socket);
+  void writeSessionMetrics(Socket &socket);
+  void writeSchedulerMetrics(Socket &socket);
+  void writeSummary(const char *name, const char *labels, const Histogram &histogram, double scale);
+
+  Beacon *m_beacon;
+  Socket m_listenSocket;
+  pthread_t m_thread;
+  bool m_threadStarted;
+  uint32_t m_stopRequested;
+  std::string m_output; // Only used on the thread.
+  bool m_sendFailed; // The current reply could not be sent.
+};
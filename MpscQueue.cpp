@@ -0,0 +1,75 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "MpscQueue.h"
+#include "Atomic.h"
+
+MpscQueue::MpscQueue() : m_head(&m_stub), m_tail(&m_stub)
+{
+}
+
+void MpscQueue::Push(MpscNode *node)
+{
+  atomicStore(&node->next, (MpscNode *)NULL);
+  MpscNode *prev = atomicExchange(&m_head, node);
+  // Between the exchange and this store, the consumer can not see node, or any
+  // later items.
+  atomicStore(&prev->next, node);
+}
+
+MpscNode* MpscQueue::Pop()
+{
+  MpscNode *tail = m_tail;
+  MpscNode *next = atomicLoad(&tail->next);
+
+  if (tail == &m_stub)
+  {
+    if (!next)
+      return NULL;
+    m_tail = next;
+    tail = next;
+    next = atomicLoad(&next->next);
+  }
+
+  if (next)
+  {
+    m_tail = next;
+    return tail;
+  }
+
+  // tail is the last item, unless a push is in progress.
+  if (tail != atomicLoad(&m_head))
+    return NULL;
+
+  // Put the stub back, so that tail can be removed.
+  Push(&m_stub);
+  next = atomicLoad(&tail->next);
+  if (next)
+  {
+    m_tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+void MpscStack::Push(MpscNode *node)
+{
+  MpscNode *head;
+
+  do
+  {
+    head = atomicLoad(&m_head);
+    node->next = head;
+  } while (!atomicCompareExchange(&m_head, head, node));
+}
+
+MpscNode* MpscStack::TakeAll()
+{
+  if (!atomicLoad(&m_head))
+    return NULL;
+  return atomicExchange(&m_head, (MpscNode *)NULL);
+}
@@ -0,0 +1,92 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Lock free, intrusive queue to pass items from any thread to a single thread.
+
+ */
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Base for items that can be placed in an MpscQueue or MpscStack. An item can be
+ * in only one at a time.
+ */
+struct MpscNode
+{
+  MpscNode() : next(NULL) { }
+  MpscNode *next;  // Only accessed atomically while in a queue or stack.
+};
+
+/**
+ * Multiple producer, single consumer queue. Based on Dmitry Vyukov's intrusive
+ * MPSC queue. Push() uses a single atomic exchange, and never waits. The queue
+ * does not own the items.
+ */
+class MpscQueue
+{
+public:
+  MpscQueue();
+
+  /**
+   * Adds the item to the end of the queue.
+   *
+   * @Note can be called from any thread.
+   */
+  void Push(MpscNode *node);
+
+  /**
+   * Removes the item from the front of the queue.
+   *
+   * @Note call only from the consumer thread.
+   *
+   * @return MpscNode* - NULL if the queue is empty. May also be NULL if a
+   *         Push() on another thread is part way done. Producers should wake the
+   *         consumer after Push() returns, so that it will try again.
+   */
+  MpscNode* Pop();
+
+private:
+  MpscQueue(const MpscQueue &src); // never use this.
+  MpscQueue & operator=(const MpscQueue &src);
+
+  MpscNode *m_head; // Most recently pushed. Changed by producers.
+  MpscNode *m_tail; // Next to pop. Consumer only.
+  MpscNode m_stub;
+};
+
+/**
+ * Lock free stack, where items can be pushed by any thread, but are only ever
+ * removed all at once. Since single items are never popped, there is no ABA
+ * problem.
+ */
+class MpscStack
+{
+public:
+  MpscStack() : m_head(NULL) { }
+
+  /**
+   * @Note can be called from any thread.
+   */
+  void Push(MpscNode *node);
+
+  /**
+   * Removes all the items.
+   *
+   * @Note can be called from any thread.
+   *
+   * @return MpscNode* - The most recently pushed item, linked to the rest by
+   *         next. NULL if empty.
+   */
+  MpscNode* TakeAll();
+
+private:
+  MpscStack(const MpscStack &src); // never use this.
+  MpscStack & operator=(const MpscStack &src);
+
+  MpscNode *m_head;
+};
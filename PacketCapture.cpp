@@ -0,0 +1,555 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "PacketCapture.h"
+#include "bfd.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+const size_t CapturedPacket::MaxDataLength;
+const size_t PacketCapture::DefaultRingSize;
+const size_t PacketCapture::MaxRingSize;
+
+// pcap file format, see https://wiki.wireshark.org/Development/LibpcapFileFormat
+static const uint32_t PcapMagicMicro = 0xa1b2c3d4;
+static const uint32_t PcapMagicNano = 0xa1b23c4d;
+static const uint32_t PcapSnapLength = 65535;
+static const uint32_t LinkTypeEthernet = 1;
+static const uint32_t LinkTypeRaw = 101;
+static const uint32_t LinkTypeLinuxSll = 113;
+static const uint32_t LinkTypeIPv4 = 228;
+static const uint32_t LinkTypeIPv6 = 229;
+static const uint32_t LinkTypeLinuxSll2 = 276;
+static const size_t IPv4HeaderSize = 20;
+static const size_t IPv6HeaderSize = 40;
+static const size_t UdpHeaderSize = 8;
+static const size_t MaxRecordSize = 256 * 1024; // Larger records mean a corrupt file.
+
+struct PcapFileHeader
+{
+  uint32_t magic;
+  uint16_t versionMajor;
+  uint16_t versionMinor;
+  int32_t thisZone;
+  uint32_t sigFigs;
+  uint32_t snapLength;
+  uint32_t linkType;
+};
+
+struct PcapRecordHeader
+{
+  uint32_t seconds;
+  uint32_t fraction; // Microseconds or nanoseconds, depending on the magic.
+  uint32_t captureLength;
+  uint32_t length;
+};
+
+static void put16(uint8_t *dest, uint16_t value)
+{
+  value = htons(value);
+  memcpy(dest, &value, sizeof(value));
+}
+
+static uint16_t get16(const uint8_t *src)
+{
+  uint16_t value;
+  memcpy(&value, src, sizeof(value));
+  return ntohs(value);
+}
+
+/**
+ * The internet checksum sum of data, before it is folded.
+ */
+static uint32_t checksumAdd(uint32_t sum, const uint8_t *data, size_t length)
+{
+  for (size_t index = 0; index + 1 < length; index += 2)
+    sum += (uint32_t(data[index]) << 8) | data[index + 1];
+  if (length & 1)
+    sum += uint32_t(data[length - 1]) << 8;
+  return sum;
+}
+
+static uint16_t checksumFold(uint32_t sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return uint16_t(~sum);
+}
+
+PacketCapture::PacketCapture() :
+   m_file(NULL),
+   m_writeBuffer(NULL),
+   m_limit(0),
+   m_threadStarted(false),
+   m_stopRequested(0),
+   m_full(false),
+   m_written(0),
+   m_writeDropped(0)
+{
+}
+
+PacketCapture::~PacketCapture()
+{
+  Stop();
+}
+
+bool PacketCapture::Start(const char *path, size_t shardCount, size_t ringSize, uint64_t limit)
+{
+  if (!LogVerify(!m_threadStarted && shardCount != 0 && ringSize != 0))
+    return false;
+
+  for (size_t index = 0; index < shardCount; index++)
+  {
+    Ring *ring = new(std::nothrow) Ring;
+    if (ring)
+    {
+      m_rings.push_back(ring);
+      ring->packets = new(std::nothrow) CapturedPacket[ringSize];
+      ring->size = ringSize;
+    }
+    if (!ring || !ring->packets)
+    {
+      gLog.LogError("Not enough memory for a capture ring of %zu packets.", ringSize);
+      clear();
+      return false;
+    }
+  }
+
+  m_file = ::fopen(path, "wb");
+  if (!m_file)
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to create capture file %s", path));
+    clear();
+    return false;
+  }
+  m_writeBuffer = new(std::nothrow) char[WriteBufferSize];
+  if (m_writeBuffer)
+    setvbuf(m_file, m_writeBuffer, _IOFBF, WriteBufferSize);
+
+  PcapFileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = PcapMagicNano;
+  header.versionMajor = 2;
+  header.versionMinor = 4;
+  header.snapLength = PcapSnapLength;
+  header.linkType = LinkTypeRaw;
+  if (1 != fwrite(&header, sizeof(header), 1, m_file) || 0 != fflush(m_file))
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to write capture file %s", path));
+    clear();
+    return false;
+  }
+
+  m_path = path;
+  m_limit = limit;
+  m_written = 0;
+  m_writeDropped = 0;
+  m_full = false;
+  m_realOffset = TimeSpec::RealNow() - TimeSpec::MonoNow();
+
+  atomicStore(&m_stopRequested, uint32_t(0));
+  if (pthread_create(&m_thread, NULL, threadCallback, this))
+  {
+    gLog.LogError("Failed to create capture thread.");
+    clear();
+    return false;
+  }
+  m_threadStarted = true;
+  gLog.Optional(Log::App, "Capturing received control packets to %s.", path);
+  return true;
+}
+
+void PacketCapture::Stop()
+{
+  if (!m_threadStarted)
+    return;
+
+  atomicStore(&m_stopRequested, uint32_t(1));
+  pthread_join(m_thread, NULL);
+  m_threadStarted = false;
+
+  Stats stats;
+  GetStats(stats);
+  gLog.Optional(Log::App, "Stopped capturing to %s. Wrote %" PRIu64 " packets, dropped %" PRIu64 ".",
+                m_path.c_str(), stats.written, stats.dropped);
+  clear();
+}
+
+/**
+ * Closes the file, and frees the rings.
+ */
+void PacketCapture::clear()
+{
+  if (m_file)
+  {
+    if (0 != fclose(m_file))
+      gLog.ErrnoError(errno, FormatShortStr("Failed to close capture file %s", m_path.c_str()));
+    m_file = NULL;
+  }
+  delete[] m_writeBuffer;
+  m_writeBuffer = NULL;
+  for (size_t index = 0; index < m_rings.size(); index++)
+    delete m_rings[index];
+  m_rings.clear();
+}
+
+void PacketCapture::GetStats(Stats &outStats)
+{
+  outStats.written = atomicLoad(&m_written);
+  outStats.dropped = atomicLoad(&m_writeDropped);
+  for (size_t index = 0; index < m_rings.size(); index++)
+    outStats.dropped += atomicLoad(&m_rings[index]->dropped);
+  outStats.limit = m_limit;
+  outStats.full = atomicLoad(&m_full);
+}
+
+void PacketCapture::fill(CapturedPacket &packet, const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+                         const AddrKey &destAddr, uint8_t ttl, const TimeSpec &receiveTime)
+{
+  packet.receiveTime = receiveTime + m_realOffset;
+  packet.sourceAddr = sourceAddr;
+  packet.destAddr = destAddr;
+  packet.sourcePort = sourcePort;
+  packet.destPort = bfd::ListenPort;
+  packet.ttlOrHops = ttl;
+  packet.dataLength = uint16_t(min(dataLength, size_t(UINT16_MAX)));
+  packet.captureLength = uint16_t(min(dataLength, CapturedPacket::MaxDataLength));
+  memcpy(packet.data, data, packet.captureLength);
+}
+
+void PacketCapture::writerThread()
+{
+  if (!UtilsInitThread())
+    return;
+
+  while (!atomicLoad(&m_stopRequested))
+  {
+    if (writeQueued() == 0)
+    {
+      // Readers of the file see whole records while it is quiet.
+      fflush(m_file);
+      MilliSleep(WritePollMs);
+    }
+  }
+
+  // The shards no longer queue anything.
+  writeQueued();
+  fflush(m_file);
+}
+
+/**
+ * Writes the packets that are queued in all rings, oldest first.
+ *
+ * @return size_t - The number of packets taken from the rings.
+ */
+size_t PacketCapture::writeQueued()
+{
+  vector<size_t> tails(m_rings.size());
+  size_t taken = 0;
+
+  for (size_t index = 0; index < m_rings.size(); index++)
+    tails[index] = atomicLoad(&m_rings[index]->tail);
+
+  while (true)
+  {
+    // There are few shards, so a scan is as good as a heap.
+    Ring *oldest = NULL;
+    for (size_t index = 0; index < m_rings.size(); index++)
+    {
+      Ring *ring = m_rings[index];
+      if (ring->head == tails[index])
+        continue;
+      if (!oldest || ring->packets[ring->head % ring->size].receiveTime < oldest->packets[oldest->head % oldest->size].receiveTime)
+        oldest = ring;
+    }
+    if (!oldest)
+      return taken;
+
+    if (!atomicLoad(&m_full))
+    {
+      if (writePacket(oldest->packets[oldest->head % oldest->size]))
+      {
+        uint64_t written = m_written + 1;
+        atomicStore(&m_written, written);
+        if (m_limit != 0 && written >= m_limit)
+        {
+          gLog.Optional(Log::App, "Capture to %s reached its limit of %" PRIu64 " packets.", m_path.c_str(), m_limit);
+          atomicStore(&m_full, true);
+        }
+      }
+      else
+      {
+        gLog.ErrnoError(errno, FormatShortStr("Failed to write capture file %s. Capture stopped", m_path.c_str()));
+        atomicStore(&m_writeDropped, m_writeDropped + 1);
+        atomicStore(&m_full, true);
+      }
+    }
+    atomicStore(&oldest->head, oldest->head + 1);
+    taken++;
+  }
+}
+
+/**
+ * Writes a packet as an IP datagram.
+ *
+ * @return bool - false if the file could not be written.
+ */
+bool PacketCapture::writePacket(const CapturedPacket &packet)
+{
+  uint8_t buffer[sizeof(PcapRecordHeader) + IPv6HeaderSize + UdpHeaderSize + CapturedPacket::MaxDataLength];
+  bool ipv6 = packet.destAddr.Type() == Addr::IPv6;
+  size_t ipHeaderSize = ipv6 ? IPv6HeaderSize : IPv4HeaderSize;
+  uint8_t *ip = buffer + sizeof(PcapRecordHeader);
+  uint8_t *udp = ip + ipHeaderSize;
+  size_t udpLength = UdpHeaderSize + packet.dataLength;
+
+  memset(ip, 0, ipHeaderSize + UdpHeaderSize);
+  if (ipv6)
+  {
+    ip[0] = 0x60;
+    put16(ip + 4, uint16_t(udpLength));
+    ip[6] = IPPROTO_UDP;
+    ip[7] = packet.ttlOrHops;
+    memcpy(ip + 8, packet.sourceAddr.GetBytes(), 16);
+    memcpy(ip + 24, packet.destAddr.GetBytes(), 16);
+  }
+  else
+  {
+    ip[0] = 0x45;
+    put16(ip + 2, uint16_t(IPv4HeaderSize + udpLength));
+    put16(ip + 6, 0x4000); // Don't fragment
+    ip[8] = packet.ttlOrHops;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, packet.sourceAddr.GetBytes() + 12, 4);
+    memcpy(ip + 16, packet.destAddr.GetBytes() + 12, 4);
+    put16(ip + 10, checksumFold(checksumAdd(0, ip, IPv4HeaderSize)));
+  }
+
+  put16(udp, packet.sourcePort);
+  put16(udp + 2, packet.destPort);
+  put16(udp + 4, uint16_t(udpLength));
+  memcpy(udp + UdpHeaderSize, packet.data, packet.captureLength);
+
+  // Optional for IPv4. For IPv6 it can only be made for the whole datagram.
+  if (ipv6 && packet.captureLength == packet.dataLength)
+  {
+    uint8_t pseudo[8] = { 0, 0, 0, 0, 0, 0, 0, IPPROTO_UDP};
+    put16(pseudo + 2, uint16_t(udpLength));
+    uint32_t sum = checksumAdd(0, ip + 8, 32);
+    sum = checksumAdd(sum, pseudo, sizeof(pseudo));
+    sum = checksumAdd(sum, udp, udpLength);
+    uint16_t checksum = checksumFold(sum);
+    put16(udp + 6, checksum ? checksum : 0xFFFF);
+  }
+
+  PcapRecordHeader record;
+  record.seconds = uint32_t(packet.receiveTime.tv_sec);
+  record.fraction = uint32_t(packet.receiveTime.tv_nsec);
+  record.captureLength = uint32_t(ipHeaderSize + UdpHeaderSize + packet.captureLength);
+  record.length = uint32_t(ipHeaderSize + udpLength);
+  memcpy(buffer, &record, sizeof(record));
+
+  return 1 == fwrite(buffer, sizeof(record) + record.captureLength, 1, m_file);
+}
+
+CaptureReader::CaptureReader() :
+   m_file(NULL),
+   m_swapped(false),
+   m_nanoseconds(false),
+   m_linkType(0),
+   m_skipped(0),
+   m_truncated(false)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+  Close();
+}
+
+bool CaptureReader::Open(const char *path, string &outError)
+{
+  PcapFileHeader header;
+
+  Close();
+
+  m_file = ::fopen(path, "rb");
+  if (!m_file)
+  {
+    outError = SystemErrorToString(errno);
+    return false;
+  }
+
+  if (1 != fread(&header, sizeof(header), 1, m_file))
+  {
+    outError = "file is too short";
+    Close();
+    return false;
+  }
+
+  m_swapped = false;
+  if (header.magic == __builtin_bswap32(PcapMagicMicro) || header.magic == __builtin_bswap32(PcapMagicNano))
+  {
+    m_swapped = true;
+    header.magic = __builtin_bswap32(header.magic);
+  }
+  if (header.magic != PcapMagicMicro && header.magic != PcapMagicNano)
+  {
+    outError = "not a pcap file";
+    Close();
+    return false;
+  }
+  m_nanoseconds = header.magic == PcapMagicNano;
+
+  m_linkType = swap(header.linkType) & 0xFFFF;
+  if (m_linkType != LinkTypeRaw && m_linkType != LinkTypeIPv4 && m_linkType != LinkTypeIPv6
+      && m_linkType != LinkTypeEthernet && m_linkType != LinkTypeLinuxSll && m_linkType != LinkTypeLinuxSll2)
+  {
+    outError = FormatShortStr("unsupported link type %u", m_linkType);
+    Close();
+    return false;
+  }
+
+  m_skipped = 0;
+  m_truncated = false;
+  return true;
+}
+
+void CaptureReader::Close()
+{
+  if (m_file)
+    fclose(m_file);
+  m_file = NULL;
+}
+
+bool CaptureReader::Next(CapturedPacket &outPacket)
+{
+  PcapRecordHeader record;
+
+  if (!m_file)
+    return false;
+
+  while (true)
+  {
+    size_t got = fread(&record, 1, sizeof(record), m_file);
+    if (got != sizeof(record))
+    {
+      m_truncated = got != 0;
+      return false;
+    }
+
+    size_t length = swap(record.captureLength);
+    if (length > MaxRecordSize)
+    {
+      m_truncated = true;
+      return false;
+    }
+    m_record.resize(max(length, size_t(1)));
+    if (length && 1 != fread(&m_record.front(), length, 1, m_file))
+    {
+      m_truncated = true;
+      return false;
+    }
+
+    outPacket.receiveTime.tv_sec = time_t(swap(record.seconds));
+    outPacket.receiveTime.tv_nsec = long(swap(record.fraction)) * (m_nanoseconds ? 1 : 1000);
+
+    // Find the IP header.
+    const uint8_t *data = &m_record.front();
+    size_t offset = 0;
+    uint16_t protocol = 0;
+    if (m_linkType == LinkTypeEthernet)
+    {
+      offset = 14;
+      protocol = length >= offset ? get16(data + 12) : 0;
+      // VLAN tags
+      while ((protocol == 0x8100 || protocol == 0x88a8) && length >= offset + 4)
+      {
+        protocol = get16(data + offset + 2);
+        offset += 4;
+      }
+    }
+    else if (m_linkType == LinkTypeLinuxSll)
+    {
+      offset = 16;
+      protocol = length >= offset ? get16(data + 14) : 0;
+    }
+    else if (m_linkType == LinkTypeLinuxSll2)
+    {
+      offset = 20;
+      protocol = length >= offset ? get16(data) : 0;
+    }
+    bool ipLink = m_linkType == LinkTypeRaw || m_linkType == LinkTypeIPv4 || m_linkType == LinkTypeIPv6;
+
+    if (length >= offset
+        && (ipLink || protocol == 0x0800 || protocol == 0x86dd)
+        && parseIp(data + offset, length - offset, outPacket))
+      return true;
+    m_skipped++;
+  }
+}
+
+/**
+ * Gets the UDP datagram from an IP packet.
+ *
+ * @return bool - false if the packet is not an unfragmented UDP datagram.
+ */
+bool CaptureReader::parseIp(const uint8_t *data, size_t length, CapturedPacket &outPacket)
+{
+  const uint8_t *udp;
+  size_t available;
+
+  if (length < 1)
+    return false;
+
+  if ((data[0] >> 4) == 4)
+  {
+    size_t headerSize = size_t(data[0] & 0x0F) * 4;
+    if (headerSize < IPv4HeaderSize || length < headerSize + UdpHeaderSize || data[9] != IPPROTO_UDP)
+      return false;
+    // More fragments, or not the first.
+    if ((get16(data + 6) & 0x3FFF) != 0)
+      return false;
+    in_addr addr;
+    memcpy(&addr, data + 12, 4);
+    outPacket.sourceAddr.SetIPv4(addr);
+    memcpy(&addr, data + 16, 4);
+    outPacket.destAddr.SetIPv4(addr);
+    outPacket.ttlOrHops = data[8];
+    udp = data + headerSize;
+    available = length - headerSize;
+  }
+  else if ((data[0] >> 4) == 6)
+  {
+    // Extension headers are not followed, as BFD does not use them.
+    if (length < IPv6HeaderSize + UdpHeaderSize || data[6] != IPPROTO_UDP)
+      return false;
+    in6_addr addr;
+    memcpy(&addr, data + 8, 16);
+    outPacket.sourceAddr.SetIPv6(addr, 0);
+    memcpy(&addr, data + 24, 16);
+    outPacket.destAddr.SetIPv6(addr, 0);
+    outPacket.ttlOrHops = data[7];
+    udp = data + IPv6HeaderSize;
+    available = length - IPv6HeaderSize;
+  }
+  else
+    return false;
+
+  size_t udpLength = get16(udp + 4);
+  if (udpLength < UdpHeaderSize)
+    return false;
+  outPacket.sourcePort = get16(udp);
+  outPacket.destPort = get16(udp + 2);
+  outPacket.dataLength = uint16_t(udpLength - UdpHeaderSize);
+  outPacket.captureLength = uint16_t(min(min(available - UdpHeaderSize, size_t(outPacket.dataLength)), CapturedPacket::MaxDataLength));
+  memcpy(outPacket.data, udp + UdpHeaderSize, outPacket.captureLength);
+  return true;
+}
@@ -0,0 +1,222 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Capture of received control packets to a pcap file, and reading them back.
+   See Beacon::StartCapture() and bfdd-replay.
+
+ */
+#pragma once
+
+#include "AddrKey.h"
+#include "Atomic.h"
+#include "TimeSpec.h"
+#include "threads.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/**
+ * A received control packet, as the receive path sees it.
+ */
+struct CapturedPacket
+{
+  // Longer datagrams are cut, as they would be discarded anyway.
+  static const size_t MaxDataLength = 512;
+
+  TimeSpec receiveTime;  // Real time clock.
+  AddrKey sourceAddr;
+  AddrKey destAddr;
+  in_port_t sourcePort;  // Host order.
+  in_port_t destPort;    // Host order.
+  uint8_t ttlOrHops;
+  uint16_t captureLength; // Bytes of data. May be less than dataLength.
+  uint16_t dataLength;    // Length of the UDP payload, as received.
+  uint8_t data[MaxDataLength];
+};
+
+/**
+ * Writes received control packets to a pcap file, on a thread of its own.
+ *
+ * Each packet is written as an IP and UDP datagram (LINKTYPE_RAW), built from
+ * the addresses, ports and TTL or hop limit that the receive path got from
+ * RecvMsg or the packet ring, with the kernel receive time at nanosecond
+ * resolution. The file can be read by tcpdump and wireshark, as well as by
+ * bfdd-replay.
+ *
+ * Each shard copies its packets into a ring of its own, with no lock and no
+ * system call. The writer thread merges the rings in time order, and does all
+ * of the formatting and I/O. A packet that finds its ring full is dropped, and
+ * counted.
+ */
+class PacketCapture
+{
+public:
+  static const size_t DefaultRingSize = 8192;
+  static const size_t MaxRingSize = 1024 * 1024;
+
+  struct Stats
+  {
+    Stats() : written(0), dropped(0), limit(0), full(false) { }
+
+    uint64_t written;  // Packets written to the file.
+    uint64_t dropped;  // Packets lost because a ring was full, or the file could not be written.
+    uint64_t limit;    // Packets to write before stopping. 0 for no limit.
+    bool full;         // The limit was reached, or the file could not be written.
+  };
+
+  PacketCapture();
+  ~PacketCapture();
+
+  /**
+   * Creates the file, and starts the writer thread. Errors are logged.
+   *
+   * @param path [in] - The file, which is replaced.
+   * @param shardCount [in] - Each shard has its own ring.
+   * @param ringSize [in] - Packets that each ring holds.
+   * @param limit [in] - Packets to write before capture stops. 0 for no limit.
+   *
+   * @return bool - false on failure.
+   */
+  bool Start(const char *path, size_t shardCount, size_t ringSize, uint64_t limit);
+
+  /**
+   * Writes out the packets that are queued, then stops the writer thread and
+   * closes the file. No shard may call Record() once this has started.
+   */
+  void Stop();
+
+  const std::string& GetPath() const { return m_path;}
+
+  /**
+   * @Note can be called from any thread.
+   */
+  void GetStats(Stats &outStats);
+
+  /**
+   * Queues a received packet.
+   *
+   * @Note call only from the shard's main thread.
+   *
+   * @param shard [in] - The shard that received the packet.
+   * @param receiveTime [in] - Monotonic time that the packet arrived.
+   */
+  void Record(size_t shard, const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+              const AddrKey &destAddr, uint8_t ttl, const TimeSpec &receiveTime)
+  {
+    if (atomicLoadRelaxed(&m_full))
+      return;
+
+    Ring &ring = *m_rings[shard];
+    // Only this thread changes tail.
+    size_t tail = ring.tail;
+    if (tail - atomicLoad(&ring.head) >= ring.size)
+    {
+      atomicStore(&ring.dropped, ring.dropped + 1);
+      return;
+    }
+    fill(ring.packets[tail % ring.size], data, dataLength, sourceAddr, sourcePort, destAddr, ttl, receiveTime);
+    atomicStore(&ring.tail, tail + 1);
+  }
+
+private:
+  static const uint32_t WritePollMs = 10;
+  static const size_t WriteBufferSize = 1024 * 1024;
+
+  /**
+   * A single producer, single consumer ring. Only the shard changes tail and
+   * dropped. Only the writer thread changes head.
+   */
+  struct Ring
+  {
+    Ring() : packets(NULL), size(0), head(0), tail(0), dropped(0) { }
+    ~Ring() { delete[] packets;}
+
+    CapturedPacket *packets;
+    size_t size;
+    size_t head;  // Atomic. Packets written out, or discarded.
+    size_t tail;  // Atomic. Packets queued.
+    uint64_t dropped; // Atomic.
+  };
+
+  /**
+   * Copies a packet, converting the receive time to the real time clock as it
+   * was when the capture started.
+   */
+  void fill(CapturedPacket &packet, const uint8_t *data, size_t dataLength, const AddrKey &sourceAddr, in_port_t sourcePort,
+            const AddrKey &destAddr, uint8_t ttl, const TimeSpec &receiveTime);
+
+  static void* threadCallback(void *arg) { reinterpret_cast<PacketCapture *>(arg)->writerThread(); return NULL;}
+  void writerThread();
+  size_t writeQueued();
+  bool writePacket(const CapturedPacket &packet);
+  void clear();
+
+  std::string m_path;
+  FILE *m_file;
+  char *m_writeBuffer;
+  std::vector<Ring *> m_rings;
+  TimeSpec m_realOffset; // Real time less monotonic time, when the capture started.
+  uint64_t m_limit;
+  pthread_t m_thread;
+  bool m_threadStarted;
+  uint32_t m_stopRequested; // Atomic.
+  bool m_full; // Atomic. Nothing more will be written.
+  uint64_t m_written; // Atomic. Only changed by the writer thread.
+  uint64_t m_writeDropped; // Atomic. Only changed by the writer thread.
+};
+
+/**
+ * Reads a pcap file, as written by PacketCapture, or by tcpdump with a raw IP,
+ * ethernet, or Linux cooked link layer. Datagrams that are not UDP over IPv4 or
+ * IPv6, or are fragmented, are skipped.
+ */
+class CaptureReader
+{
+public:
+  CaptureReader();
+  ~CaptureReader();
+
+  /**
+   * @param outError [out] - Why it failed.
+   *
+   * @return bool - false on failure.
+   */
+  bool Open(const char *path, std::string &outError);
+
+  void Close();
+
+  /**
+   * Reads the next UDP datagram.
+   *
+   * @param outPacket [out] - The packet. receiveTime is from the file.
+   *
+   * @return bool - false at the end of the file, or if it is cut short.
+   */
+  bool Next(CapturedPacket &outPacket);
+
+  /**
+   * @return uint64_t - Records that were not UDP datagrams.
+   */
+  uint64_t GetSkipped() const { return m_skipped;}
+
+  /**
+   * @return bool - true if the file ended part way through a record.
+   */
+  bool IsTruncated() const { return m_truncated;}
+
+private:
+  bool parseIp(const uint8_t *data, size_t length, CapturedPacket &outPacket);
+  uint32_t swap(uint32_t value) const { return m_swapped ? __builtin_bswap32(value) : value;}
+
+  FILE *m_file;
+  bool m_swapped;     // The file is in the other byte order.
+  bool m_nanoseconds; // The file has nanosecond times.
+  uint32_t m_linkType;
+  uint64_t m_skipped;
+  bool m_truncated;
+  std::vector<uint8_t> m_record;
+};
@@ -0,0 +1,441 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "PacketRing.h"
+#include "Atomic.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#  include <sys/mman.h>
+#  include <arpa/inet.h>
+#  include <net/ethernet.h>
+#  include <linux/filter.h>
+#  include <linux/if_packet.h>
+#  if defined(PACKET_VERSION) && defined(PACKET_RX_RING) && defined(SO_ATTACH_FILTER)
+#    define PACKET_RING_SUPPORTED
+#  endif
+#endif
+
+using namespace std;
+
+const size_t PacketRing::DefaultFrameCount;
+const size_t PacketRing::MaxFrameCount;
+
+PacketRing::PacketRing() :
+   m_socket(-1),
+   m_ring(NULL),
+   m_ringSize(0),
+   m_frameSize(0),
+   m_frameCount(0),
+   m_nextFrame(0),
+   m_heldFrame(NULL),
+   m_port(0)
+{
+}
+
+PacketRing::~PacketRing()
+{
+  Close();
+}
+
+#ifdef PACKET_RING_SUPPORTED
+
+// Enough for the frame header, and the IP and UDP headers of any control
+// packet, even with IP options.
+static const size_t RingFrameSize = 512;
+
+static inline uint16_t readShort(const uint8_t *data)
+{
+  return uint16_t((data[0] << 8) | data[1]);
+}
+
+/**
+ * Adds data, as 16 bit big endian words, to a one's complement sum.
+ */
+static uint32_t checksumAdd(uint32_t sum, const uint8_t *data, size_t length)
+{
+  for (; length > 1; data += 2, length -= 2)
+    sum += readShort(data);
+  if (length)
+    sum += uint32_t(data[0]) << 8;
+  return sum;
+}
+
+/**
+ * @return bool - true if the UDP checksum, with the pseudo header, is correct.
+ */
+static bool checksumIsValid(const uint8_t *source, const uint8_t *dest, size_t addrLength,
+                            const uint8_t *udp, size_t udpLength)
+{
+  uint32_t sum = IPPROTO_UDP + uint32_t(udpLength);
+  sum = checksumAdd(sum, source, addrLength);
+  sum = checksumAdd(sum, dest, addrLength);
+  sum = checksumAdd(sum, udp, udpLength);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return sum == 0xFFFF;
+}
+
+bool PacketRing::IsSupported()
+{
+  return true;
+}
+
+bool PacketRing::Open(size_t frameCount, uint16_t port, int fanoutGroup)
+{
+  Close();
+
+  if (!LogVerify(frameCount > 0))
+    frameCount = DefaultFrameCount;
+  frameCount = min(frameCount, MaxFrameCount);
+
+  // Protocol 0 receives nothing until bind(), after the filter is set.
+  int sock = ::socket(AF_PACKET, SOCK_DGRAM, 0);
+  if (sock == -1)
+  {
+    gLog.ErrnoError(errno, "Failed to create packet socket for receive ring");
+    return false;
+  }
+  m_socket = sock;
+  m_port = port;
+
+  // Offsets are from the start of the IP header, since this is a SOCK_DGRAM
+  // packet socket. Only unfragmented UDP to the port, that was sent to this
+  // host, is accepted.
+  struct sock_filter program[] =
+  {
+    /*  0 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+    /*  1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, 15),
+    /*  2 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_AD_OFF + SKF_AD_PROTOCOL)),
+    /*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 8, 0),
+    /*  4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 12),
+    // IPv4
+    /*  5 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+    /*  6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 10),
+    /*  7 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+    /*  8 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3FFF, 8, 0),
+    /*  9 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+    /* 10 */ BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+    /* 11 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 4, 5),
+    // IPv6, with UDP as the next header.
+    /* 12 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+    /* 13 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 3),
+    /* 14 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 42),
+    /* 15 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+    /* 16 */ BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    /* 17 */ BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog filter;
+  filter.len = sizeof(program) / sizeof(program[0]);
+  filter.filter = program;
+  if (0 != ::setsockopt(m_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)))
+  {
+    gLog.ErrnoError(errno, "Failed to set filter on packet socket");
+    Close();
+    return false;
+  }
+
+  int version = TPACKET_V2;
+  if (0 != ::setsockopt(m_socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)))
+  {
+    gLog.ErrnoError(errno, "Failed to set TPACKET_V2 on packet socket");
+    Close();
+    return false;
+  }
+
+  // One page blocks, so the kernel does not need large contiguous allocations.
+  size_t blockSize = max(size_t(::getpagesize()), RingFrameSize);
+  size_t framesPerBlock = blockSize / RingFrameSize;
+  size_t blockCount = (frameCount + framesPerBlock - 1) / framesPerBlock;
+
+  struct tpacket_req request;
+  memset(&request, 0, sizeof(request));
+  request.tp_block_size = unsigned(blockSize);
+  request.tp_block_nr = unsigned(blockCount);
+  request.tp_frame_size = unsigned(RingFrameSize);
+  request.tp_frame_nr = unsigned(blockCount * framesPerBlock);
+  if (0 != ::setsockopt(m_socket, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)))
+  {
+    gLog.ErrnoError(errno, "Failed to create packet receive ring");
+    Close();
+    return false;
+  }
+
+  size_t ringSize = blockSize * blockCount;
+  void *ring = ::mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_socket, 0);
+  if (ring == MAP_FAILED)
+  {
+    gLog.ErrnoError(errno, "Failed to map packet receive ring");
+    Close();
+    return false;
+  }
+  m_ring = reinterpret_cast<uint8_t *>(ring);
+  m_ringSize = ringSize;
+  m_frameSize = RingFrameSize;
+  m_frameCount = request.tp_frame_nr;
+  m_nextFrame = 0;
+
+  struct sockaddr_ll address;
+  memset(&address, 0, sizeof(address));
+  address.sll_family = AF_PACKET;
+  address.sll_protocol = htons(ETH_P_ALL);
+  address.sll_ifindex = 0; // All interfaces.
+  if (0 != ::bind(m_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)))
+  {
+    gLog.ErrnoError(errno, "Failed to bind packet socket");
+    Close();
+    return false;
+  }
+
+  if (fanoutGroup >= 0)
+  {
+#ifdef PACKET_FANOUT
+    int fanout = (fanoutGroup & 0xFFFF) | (PACKET_FANOUT_HASH << 16);
+    if (0 != ::setsockopt(m_socket, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)))
+    {
+      gLog.ErrnoError(errno, "Failed to join packet fanout group");
+      Close();
+      return false;
+    }
+#else
+    gLog.LogError("Packet fanout is not supported on this system.");
+    Close();
+    return false;
+#endif
+  }
+
+  m_stats.Reset();
+  gLog.Optional(Log::App, "Receiving BFD packets for port %hu through a %zu frame ring.", port, m_frameCount);
+  return true;
+}
+
+void PacketRing::Close()
+{
+  m_heldFrame = NULL;
+  if (m_ring)
+  {
+    ::munmap(m_ring, m_ringSize);
+    m_ring = NULL;
+    m_ringSize = 0;
+  }
+  m_frameCount = 0;
+  m_nextFrame = 0;
+  if (m_socket != -1)
+  {
+    ::close(m_socket);
+    m_socket = -1;
+  }
+}
+
+bool PacketRing::Next(Datagram &outDatagram)
+{
+  Release();
+
+  // Frames that can not be used are returned immediately, so this stops after
+  // at most one pass of the ring.
+  for (size_t checked = 0; checked < m_frameCount; checked++)
+  {
+    uint8_t *frame = frameAt(m_nextFrame);
+    tpacket2_hdr *header = reinterpret_cast<tpacket2_hdr *>(frame);
+    if (!(atomicLoad(&header->tp_status) & TP_STATUS_USER))
+      return false;
+
+    if (++m_nextFrame == m_frameCount)
+      m_nextFrame = 0;
+
+    if (parseFrame(frame, outDatagram))
+    {
+      m_heldFrame = frame;
+      m_stats.received++;
+      return true;
+    }
+
+    m_stats.ignored++;
+    atomicStore(&header->tp_status, uint32_t(TP_STATUS_KERNEL));
+  }
+
+  return false;
+}
+
+void PacketRing::Release()
+{
+  if (!m_heldFrame)
+    return;
+  tpacket2_hdr *header = reinterpret_cast<tpacket2_hdr *>(m_heldFrame);
+  atomicStore(&header->tp_status, uint32_t(TP_STATUS_KERNEL));
+  m_heldFrame = NULL;
+}
+
+void PacketRing::GetStats(Stats &outStats)
+{
+  // Reading the kernel statistics resets them.
+  if (m_socket != -1)
+  {
+    struct tpacket_stats kernelStats;
+    socklen_t length = sizeof(kernelStats);
+    if (0 == ::getsockopt(m_socket, SOL_PACKET, PACKET_STATISTICS, &kernelStats, &length))
+      m_stats.dropped += kernelStats.tp_drops;
+  }
+  outStats = m_stats;
+}
+
+/**
+ * Reads the IP and UDP headers of a frame that the kernel has filled.
+ *
+ * @return bool - false if the frame does not hold a valid datagram for the port.
+ */
+bool PacketRing::parseFrame(uint8_t *frame, Datagram &outDatagram)
+{
+  const tpacket2_hdr *header = reinterpret_cast<const tpacket2_hdr *>(frame);
+  const sockaddr_ll *link = reinterpret_cast<const sockaddr_ll *>(frame + TPACKET_ALIGN(sizeof(tpacket2_hdr)));
+  uint32_t status = header->tp_status;
+  size_t length = header->tp_snaplen;
+  const uint8_t *ip = frame + header->tp_net;
+  const uint8_t *udp;
+  size_t udpLength;
+
+  if (header->tp_snaplen < header->tp_len || header->tp_net + length > m_frameSize)
+    return false;
+
+  // The kernel has either checked the checksum, or the packet was never on a
+  // wire.
+  bool checksumKnown = false;
+#ifdef TP_STATUS_CSUMNOTREADY
+  checksumKnown = checksumKnown || (status & TP_STATUS_CSUMNOTREADY);
+#endif
+#ifdef TP_STATUS_CSUM_VALID
+  checksumKnown = checksumKnown || (status & TP_STATUS_CSUM_VALID);
+#endif
+
+  if (length < 1)
+    return false;
+  uint8_t version = ip[0] >> 4;
+  if (version == 4)
+  {
+    size_t ipLength = (ip[0] & 0x0F) * 4;
+    if (length < 20 || ipLength < 20 || length < ipLength + 8)
+      return false;
+    size_t totalLength = readShort(ip + 2);
+    if (totalLength < ipLength + 8 || totalLength > length)
+      return false;
+    if ((readShort(ip + 6) & 0x3FFF) != 0 || ip[9] != IPPROTO_UDP)
+      return false;
+
+    udp = ip + ipLength;
+    udpLength = readShort(udp + 4);
+    if (udpLength < 8 || udpLength > totalLength - ipLength || readShort(udp + 2) != m_port)
+      return false;
+    // A 0 checksum means none was sent.
+    if (!checksumKnown && readShort(udp + 6) != 0 && !checksumIsValid(ip + 12, ip + 16, 4, udp, udpLength))
+      return false;
+
+    in_addr source, dest;
+    memcpy(&source, ip + 12, sizeof(source));
+    memcpy(&dest, ip + 16, sizeof(dest));
+    outDatagram.sourceAddr.SetIPv4(source);
+    outDatagram.destAddr.SetIPv4(dest);
+    outDatagram.ttlOrHops = ip[8];
+  }
+  else if (version == 6)
+  {
+    if (length < 40 + 8)
+      return false;
+    size_t payloadLength = readShort(ip + 4);
+    if (40 + payloadLength > length || ip[6] != IPPROTO_UDP)
+      return false;
+
+    udp = ip + 40;
+    udpLength = readShort(udp + 4);
+    if (udpLength < 8 || udpLength > payloadLength || readShort(udp + 2) != m_port)
+      return false;
+    // The checksum is required for IPv6.
+    if (!checksumKnown && (readShort(udp + 6) == 0 || !checksumIsValid(ip + 8, ip + 24, 16, udp, udpLength)))
+      return false;
+
+    in6_addr source, dest;
+    memcpy(&source, ip + 8, sizeof(source));
+    memcpy(&dest, ip + 24, sizeof(dest));
+    outDatagram.sourceAddr.SetIPv6(source, AddrKey::ScopeIdIfLinkLocal(source, link->sll_ifindex));
+    outDatagram.destAddr.SetIPv6(dest, AddrKey::ScopeIdIfLinkLocal(dest, link->sll_ifindex));
+    outDatagram.ttlOrHops = ip[7];
+  }
+  else
+    return false;
+
+  outDatagram.sourcePort = readShort(udp);
+  outDatagram.data = udp + 8;
+  outDatagram.dataLength = udpLength - 8;
+  if (header->tp_sec == 0)
+    outDatagram.receiveTime = TimeSpec();
+  else
+    outDatagram.receiveTime = TimeSpec(time_t(header->tp_sec), long(header->tp_nsec));
+  return true;
+}
+
+bool PacketRing::DiscardSocketInput(int socket)
+{
+  struct sock_filter program[] =
+  {
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog filter;
+  filter.len = sizeof(program) / sizeof(program[0]);
+  filter.filter = program;
+  if (0 != ::setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)))
+  {
+    gLog.ErrnoError(errno, "Failed to set discard filter on socket");
+    return false;
+  }
+  return true;
+}
+
+#else  // PACKET_RING_SUPPORTED
+
+bool PacketRing::IsSupported()
+{
+  return false;
+}
+
+bool PacketRing::Open(size_t ATTR_UNUSED(frameCount), uint16_t ATTR_UNUSED(port), int ATTR_UNUSED(fanoutGroup))
+{
+  gLog.LogError("Packet receive rings are not supported on this system.");
+  return false;
+}
+
+void PacketRing::Close()
+{
+}
+
+bool PacketRing::Next(Datagram &ATTR_UNUSED(outDatagram))
+{
+  return false;
+}
+
+void PacketRing::Release()
+{
+}
+
+void PacketRing::GetStats(Stats &outStats)
+{
+  outStats = m_stats;
+}
+
+bool PacketRing::parseFrame(uint8_t *ATTR_UNUSED(frame), Datagram &ATTR_UNUSED(outDatagram))
+{
+  return false;
+}
+
+bool PacketRing::DiscardSocketInput(int ATTR_UNUSED(socket))
+{
+  gLog.LogError("Discarding socket input is not supported on this system.");
+  return false;
+}
+
+#endif  // PACKET_RING_SUPPORTED
@@ -0,0 +1,143 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Receives UDP datagrams for a port through a memory mapped packet ring.
+
+ */
+#pragma once
+
+#include "AddrKey.h"
+#include "TimeSpec.h"
+
+/**
+ * Receives the UDP datagrams for one port, on all interfaces, through a
+ * PACKET_MMAP receive ring (Linux only). The kernel copies each matching packet
+ * once, into memory shared with the process, so datagrams are read without any
+ * system call, and without a further copy.
+ *
+ * A classic BPF filter on the packet socket passes only unfragmented IPv4, and
+ * IPv6 without extension headers, to the port. The addresses and TTL or hop
+ * limit are read from the IP header, rather than from control messages.
+ *
+ * The packets still reach the UDP socket that is bound to the port, which is
+ * needed so that the kernel does not reject them. Use DiscardSocketInput() on
+ * that socket, so that the packets are not queued to it as well.
+ *
+ * Rings opened with the same fanout group share the packets, with all packets
+ * of a flow going to the same ring.
+ *
+ * All calls must be made on the same thread.
+ */
+class PacketRing
+{
+public:
+  static const size_t DefaultFrameCount = 4096;
+  static const size_t MaxFrameCount = 1024 * 1024;
+
+  /**
+   * A datagram in the ring. The data is valid only until the next call to
+   * Next() or Release().
+   */
+  struct Datagram
+  {
+    const uint8_t *data; // UDP payload.
+    size_t dataLength;
+    AddrKey sourceAddr;
+    in_port_t sourcePort; // Host order.
+    AddrKey destAddr;
+    uint8_t ttlOrHops;
+    TimeSpec receiveTime; // Real time clock. empty() if not available.
+  };
+
+  struct Stats
+  {
+    Stats() { Reset();}
+    void Reset() { received = 0; ignored = 0; dropped = 0;}
+
+    uint64_t received; // Datagrams returned by Next().
+    uint64_t ignored;  // Frames that were truncated, malformed, or failed the checksum.
+    uint64_t dropped;  // Packets the kernel dropped because the ring was full.
+  };
+
+  PacketRing();
+  ~PacketRing();
+
+  /**
+   * @return bool - false if packet rings can not be used on this system.
+   */
+  static bool IsSupported();
+
+  /**
+   * Creates the packet socket and maps its ring. This usually requires
+   * CAP_NET_RAW. Errors are logged.
+   *
+   * @param frameCount [in] - Number of frames in the ring. Rounded up to fill the
+   *                   last block.
+   * @param port [in] - The UDP destination port.
+   * @param fanoutGroup [in] - Rings with the same group share packets. -1 for
+   *                    none.
+   *
+   * @return bool - false on failure.
+   */
+  bool Open(size_t frameCount, uint16_t port, int fanoutGroup);
+
+  /**
+   * Closes the socket, and unmaps the ring.
+   */
+  void Close();
+
+  /**
+   * @return int - The packet socket, for the scheduler. It is readable when a
+   *         frame is ready. -1 if not open.
+   */
+  int GetSocket() const { return m_socket;}
+
+  /**
+   * Releases the previous datagram, if any, and gets the next one.
+   *
+   * @param outDatagram [out] - The datagram, on success.
+   *
+   * @return bool - false if no datagram is ready.
+   */
+  bool Next(Datagram &outDatagram);
+
+  /**
+   * Returns the frame of the datagram from the last Next() to the kernel.
+   */
+  void Release();
+
+  /**
+   * Gets the counts since the ring was opened, or since ResetStats().
+   */
+  void GetStats(Stats &outStats);
+
+  void ResetStats() { m_stats.Reset();}
+
+  /**
+   * Makes a socket discard all incoming data, with a BPF filter, so that
+   * datagrams that are read through a ring are not also queued to it.
+   *
+   * @param socket [in] - The socket.
+   *
+   * @return bool - false on failure. Errors are logged.
+   */
+  static bool DiscardSocketInput(int socket);
+
+private:
+  bool parseFrame(uint8_t *frame, Datagram &outDatagram);
+  uint8_t* frameAt(size_t index) { return m_ring + index * m_frameSize;}
+
+  int m_socket;
+  uint8_t *m_ring;
+  size_t m_ringSize;
+  size_t m_frameSize;
+  size_t m_frameCount;
+  size_t m_nextFrame;
+  uint8_t *m_heldFrame; // Frame returned by the last Next(), or NULL.
+  uint16_t m_port;
+  Stats m_stats;
+};
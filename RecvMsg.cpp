@@ -7,6 +7,7 @@
 #include "RecvMsg.h"
 #include "Socket.h"
 #include <errno.h>
+#include <string.h>
 
 using namespace std;
 
@@ -35,9 +36,12 @@ RecvMsg::RecvMsg(size_t bufferSize, size_t controlSize) :
 void RecvMsg::clear()
 {
   m_dataBufferValidSize = 0;
-  m_sourceAddress.clear();
-  m_destAddress.clear();
+  m_data = m_dataBuffer.val;
+  m_sourceKey.clear();
+  m_sourcePort = 0;
+  m_destKey.clear();
   m_ttlOrHops = -1;
+  m_receiveTime.clear();
   m_error = 0;
 }
 
@@ -49,9 +53,15 @@ void RecvMsg::AllocBuffers(size_t bufferSize, size_t controlSize)
   m_dataBuffer = new uint8_t[bufferSize];
   m_dataBufferSize = bufferSize;
   m_dataBufferValidSize = 0;
+  m_data = m_dataBuffer.val;
 }
 
 bool RecvMsg::DoRecvMsg(const Socket &socket)
+{
+  return DoRecvMsg(socket, 0);
+}
+
+bool RecvMsg::DoRecvMsg(const Socket &socket, int flags)
 {
 
   if (m_dataBufferSize == 0)
@@ -63,11 +73,33 @@ bool RecvMsg::DoRecvMsg(const Socket &socket)
   clear();
 
   struct iovec msgiov;
+  sockaddr_storage msgaddr;
+  struct msghdr message;
+  prepareMessage(message, msgiov, msgaddr);
+
+  // Get packet
+  ssize_t msgLength = recvmsg(socket, &message, flags);
+  if (msgLength < 0)
+  {
+    m_error = errno;
+    return false;
+  }
+
+  return parseMessage(message, msgLength);
+}
+
+/**
+ * Sets up message to receive into our buffers.
+ *
+ * @param message [out] - The header to fill.
+ * @param msgiov [out] - Storage for the iovec. Must outlive message.
+ * @param msgaddr [out] - Storage for the source address. Must outlive message.
+ */
+void RecvMsg::prepareMessage(struct msghdr &message, struct iovec &msgiov, sockaddr_storage &msgaddr)
+{
   msgiov.iov_base = m_dataBuffer.val;
   msgiov.iov_len =  m_dataBufferSize;
 
-  sockaddr_storage msgaddr;
-  struct msghdr message;
   message.msg_name = &msgaddr;
   message.msg_namelen = sizeof(msgaddr);
   message.msg_iov = &msgiov;
@@ -75,25 +107,27 @@ bool RecvMsg::DoRecvMsg(const Socket &socket)
   message.msg_control = m_controlBuffer;
   message.msg_controllen = m_controlBufferSize;
   message.msg_flags = 0;
+}
 
-  // Get packet
-  ssize_t msgLength = recvmsg(socket, &message, 0);
-  if (msgLength < 0)
-  {
-    m_error = errno;
-    return false;
-  }
-
+/**
+ * Fills in the results from a message received using prepareMessage().
+ *
+ * @param message [in] - The received message.
+ * @param msgLength [in] - The length of the received data.
+ *
+ * @return bool - false on failure.
+ */
+bool RecvMsg::parseMessage(const struct msghdr &message, ssize_t msgLength)
+{
 
-  m_sourceAddress = SockAddr(reinterpret_cast<sockaddr *>(message.msg_name), message.msg_namelen);
-  if (!m_sourceAddress.IsValid())
+  if (!m_sourceKey.Set(reinterpret_cast<sockaddr *>(message.msg_name), message.msg_namelen, &m_sourcePort))
   {
     m_error = EILSEQ; //??
     return false;
   }
 
   // Walk control messages, and see what we can see.
-  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(const_cast<msghdr *>(&message), cmsg))
   {
     // It appears that  some systems use IP_TTL and some use IP_RECVTTL to
     // return the ttl. Specifically, FreeBSD uses IP_RECVTTL and Debian uses
@@ -116,24 +150,51 @@ bool RecvMsg::DoRecvMsg(const Socket &socket)
     else if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR)
     {
       if (LogVerify(cmsg->cmsg_len >= CMSG_LEN(sizeof(in_addr))))
-        m_destAddress = IpAddr(reinterpret_cast<in_addr *>(CMSG_DATA(cmsg)));
+      {
+        in_addr addr;
+        memcpy(&addr, CMSG_DATA(cmsg), sizeof(addr));
+        m_destKey.SetIPv4(addr);
+      }
     }
 #endif
 #ifdef IP_PKTINFO
     else if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
     {
       if (LogVerify(cmsg->cmsg_len >= CMSG_LEN(sizeof(in_pktinfo))))
-        m_destAddress = IpAddr(&reinterpret_cast<in_pktinfo *>(CMSG_DATA(cmsg))->ipi_addr);
+      {
+        in_pktinfo info;
+        memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+        m_destKey.SetIPv4(info.ipi_addr);
+      }
     }
 #endif
     else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
     {
       if (LogVerify(cmsg->cmsg_len >= CMSG_LEN(sizeof(in6_pktinfo))))
       {
-        in6_pktinfo *info = reinterpret_cast<in6_pktinfo *>(CMSG_DATA(cmsg));
-        m_destAddress = IpAddr(&info->ipi6_addr);
-        if (info->ipi6_ifindex != 0)
-          m_destAddress.SetScopIdIfLinkLocal(info->ipi6_ifindex);
+        in6_pktinfo info;
+        memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+        m_destKey.SetIPv6(info.ipi6_addr, AddrKey::ScopeIdIfLinkLocal(info.ipi6_addr, info.ipi6_ifindex));
+      }
+    }
+#ifdef SCM_TIMESTAMPNS
+    else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      if (LogVerify(cmsg->cmsg_len >= CMSG_LEN(sizeof(timespec))))
+      {
+        timespec stamp;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        m_receiveTime = stamp;
+      }
+    }
+#endif
+    else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP)
+    {
+      if (LogVerify(cmsg->cmsg_len >= CMSG_LEN(sizeof(timeval))))
+      {
+        timeval stamp;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        m_receiveTime = TimeSpec(stamp);
       }
     }
   }
@@ -142,6 +203,20 @@ bool RecvMsg::DoRecvMsg(const Socket &socket)
   return true;
 }
 
+bool RecvMsg::ParseReceived(const struct msghdr &message, size_t msgLength)
+{
+  clear();
+
+  if (!LogVerify(message.msg_iovlen == 1))
+  {
+    m_error = EINVAL;
+    return false;
+  }
+
+  m_data = reinterpret_cast<uint8_t *>(message.msg_iov[0].iov_base);
+  return parseMessage(message, ssize_t(msgLength));
+}
+
 bool RecvMsg::DoRecv(const Socket &socket, int flags)
 {
 
@@ -178,3 +253,120 @@ uint8_t RecvMsg::GetTTLorHops(bool *success)
     *success = true;
   return (uint8_t)m_ttlOrHops;
 }
+
+
+
+RecvMsgBatch::RecvMsgBatch() :
+   m_error(0)
+{
+}
+
+RecvMsgBatch::~RecvMsgBatch()
+{
+  freeMessages();
+}
+
+void RecvMsgBatch::freeMessages()
+{
+  for (size_t i = 0; i < m_messages.size(); i++)
+    delete m_messages[i];
+  m_messages.clear();
+}
+
+void RecvMsgBatch::AllocBuffers(size_t batchSize, size_t bufferSize, size_t controlSize)
+{
+  if (!LogVerify(batchSize > 0))
+    batchSize = 1;
+
+  freeMessages();
+  m_messages.reserve(batchSize);
+  for (size_t i = 0; i < batchSize; i++)
+  {
+    Raii<RecvMsg>::Delete message(new RecvMsg(bufferSize, controlSize));
+    m_messages.push_back(message);
+    message.Detach();
+  }
+
+#ifdef HAVE_RECVMMSG
+  m_headers = new uint8_t[sizeof(struct mmsghdr) * batchSize];
+#else
+  m_headers = new uint8_t[sizeof(struct msghdr) * batchSize];
+#endif
+  m_addresses = new uint8_t[sizeof(sockaddr_storage) * batchSize];
+  m_iovecs = new uint8_t[sizeof(struct iovec) * batchSize];
+}
+
+size_t RecvMsgBatch::DoRecvMsgBatch(const Socket &socket)
+{
+  size_t batchSize = m_messages.size();
+  size_t received = 0;
+
+  m_error = 0;
+  if (batchSize == 0)
+  {
+    m_error = EINVAL;
+    return 0;
+  }
+
+  sockaddr_storage *addresses = reinterpret_cast<sockaddr_storage *>(m_addresses.val);
+  struct iovec *iovecs = reinterpret_cast<struct iovec *>(m_iovecs.val);
+
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr *headers = reinterpret_cast<struct mmsghdr *>(m_headers.val);
+
+  for (size_t i = 0; i < batchSize; i++)
+  {
+    m_messages[i]->clear();
+    m_messages[i]->prepareMessage(headers[i].msg_hdr, iovecs[i], addresses[i]);
+    headers[i].msg_len = 0;
+  }
+
+  int result = ::recvmmsg(socket, headers, (unsigned int)batchSize, MSG_DONTWAIT, NULL);
+  if (result < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      m_error = errno;
+    return 0;
+  }
+
+  // Compact, so that the successfully parsed messages come first.
+  for (size_t i = 0; i < size_t(result); i++)
+  {
+    RecvMsg *message = m_messages[i];
+    if (!message->parseMessage(headers[i].msg_hdr, headers[i].msg_len))
+    {
+      m_error = message->GetLastError();
+      continue;
+    }
+    if (i != received)
+      std::swap(m_messages[i], m_messages[received]);
+    received++;
+  }
+#else
+  struct msghdr *headers = reinterpret_cast<struct msghdr *>(m_headers.val);
+
+  for (size_t i = 0; i < batchSize; i++)
+  {
+    RecvMsg *message = m_messages[received];
+
+    message->clear();
+    message->prepareMessage(headers[received], iovecs[received], addresses[received]);
+
+    ssize_t msgLength = ::recvmsg(socket, &headers[received], MSG_DONTWAIT);
+    if (msgLength < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        m_error = errno;
+      break;
+    }
+    if (!message->parseMessage(headers[received], msgLength))
+    {
+      m_error = message->GetLastError();
+      continue;
+    }
+    received++;
+  }
+#endif
+
+  return received;
+}
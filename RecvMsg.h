@@ -5,10 +5,13 @@
 ***************************************************************/
 #pragma once
 
-#include "SockAddr.h"
+#include "AddrKey.h"
 #include "SmartPointer.h"
+#include "TimeSpec.h"
+#include <vector>
 
 class Socket;
+struct msghdr;
 
 /**
  * A container for recv or recvmsg results.
@@ -62,6 +65,16 @@ public:
    */
   bool DoRecvMsg(const Socket &socket);
 
+  /**
+   * Same as DoRecvMsg(), but with flags for recvmsg. For example, MSG_DONTWAIT.
+   *
+   * @param socket
+   * @param flags - Flags for recvmsg.
+   *
+   * @return bool - false on failure.
+   */
+  bool DoRecvMsg(const Socket &socket, int flags);
+
   /**
    * Call recv for the given socket. Call GetLastError() on failure to get the
    * errno.
@@ -73,6 +86,21 @@ public:
    */
   bool DoRecv(const Socket &socket, int flags);
 
+  /**
+   * Fills in the results from a datagram that was received elsewhere, for
+   * example by the scheduler, see Scheduler::SetDatagramCallback(). No buffers
+   * need to be allocated. GetData() then points into the received message, so
+   * it is only valid as long as that is.
+   *
+   * @param message [in] - The received message. msg_name, msg_control and
+   *                msg_iov[0] are the received source address, control
+   *                messages and data.
+   * @param msgLength [in] - The length of the received data.
+   *
+   * @return bool - false on failure. Call GetLastError() to get the error.
+   */
+  bool ParseReceived(const struct msghdr &message, size_t msgLength);
+
   /**
    * @return - The error from the last DoRecvMsg call. 0 if it succeeded.
    */
@@ -90,18 +118,45 @@ public:
   uint8_t GetTTLorHops(bool *success = NULL);
 
   /**
-   * Gets the destination address.
+   * Gets the destination address. This builds an IpAddr, use GetDestKey() where
+   * possible.
    *
    * @return IpAddr - IsValid() will return false on failure.
    */
-  const IpAddr& GetDestAddress() { return m_destAddress;}
+  IpAddr GetDestAddress() { return m_destKey.ToIpAddr();}
 
   /**
-   * The source address.
+   * The source address. This builds a SockAddr, use GetSrcKey() and
+   * GetSrcPort() where possible.
    *
    * @return SockAddr - IsValid() will return true on failure.
    */
-  const SockAddr& GetSrcAddress() { return m_sourceAddress;}
+  SockAddr GetSrcAddress() { return m_sourceKey.ToSockAddr(m_sourcePort);}
+
+  /**
+   * @return AddrKey - The destination address. IsValid() will return false on
+   *         failure.
+   */
+  const AddrKey& GetDestKey() { return m_destKey;}
+
+  /**
+   * @return AddrKey - The source address, without the port.
+   */
+  const AddrKey& GetSrcKey() { return m_sourceKey;}
+
+  /**
+   * @return in_port_t - The source port, in host order.
+   */
+  in_port_t GetSrcPort() { return m_sourcePort;}
+
+  /**
+   * The time that the kernel received the packet. Only available when enabled
+   * with Socket::SetReceiveTimestamp().
+   *
+   * @return TimeSpec - The arrival time, on the real time clock. empty() if the
+   *         packet did not include a time.
+   */
+  const TimeSpec& GetReceiveTime() { return m_receiveTime;}
 
   /**
    * Gets the data from the last DoRecvMsg(), if successful.
@@ -110,7 +165,7 @@ public:
    * @return - Data from the last DoRecvMsg(), if successful. NULL if DoRecvMsg
    *         was never called, or it failed.
    */
-  uint8_t* GetData() { return m_dataBufferValidSize ? m_dataBuffer.val : NULL;}
+  uint8_t* GetData() { return m_dataBufferValidSize ? m_data : NULL;}
 
   /**
    * Gets the size of the data from the last DoRecvMsg(), if successful.
@@ -122,15 +177,94 @@ public:
   size_t GetDataSize() { return m_dataBufferValidSize;}
 
 private:
+  friend class RecvMsgBatch;
   void clear();
+  void prepareMessage(struct msghdr &message, struct iovec &msgiov, sockaddr_storage &msgaddr);
+  bool parseMessage(const struct msghdr &message, ssize_t msgLength);
 private:
   Raii<uint8_t>::DeleteArray m_controlBuffer; // Not using vector, because we do not want initialization.
   size_t m_controlBufferSize;
   Raii<uint8_t>::DeleteArray m_dataBuffer; // Not using vector, because we do not want initialization.
   size_t m_dataBufferSize;
   size_t m_dataBufferValidSize;  // Only valid after successful DoRecvMsg
-  SockAddr m_sourceAddress;
-  IpAddr m_destAddress;
+  uint8_t *m_data; // m_dataBuffer, or the data given to ParseReceived().
+  AddrKey m_sourceKey;
+  in_port_t m_sourcePort;
+  AddrKey m_destKey;
   int16_t m_ttlOrHops; // -1 for invalid
+  TimeSpec m_receiveTime; // empty() for none
+  int m_error;
+};
+
+
+/**
+ * Receives up to a fixed number of datagrams with a single call, using
+ * recvmmsg() where available, and looping recvmsg() otherwise.
+ *
+ * Each result is a RecvMsg, so callers can handle them the same way as the
+ * result of RecvMsg::DoRecvMsg().
+ */
+class RecvMsgBatch
+{
+public:
+  /**
+   * Creates an empty batch.
+   *
+   * Must call AllocBuffers() before calling DoRecvMsgBatch().
+   */
+  RecvMsgBatch();
+  ~RecvMsgBatch();
+
+  /**
+   * Allocates storage for batchSize messages. Discards any previous results.
+   *
+   * @throw - yes
+   *
+   * @param batchSize [in] - The maximum number of datagrams to receive per
+   *                  call. Must be at least 1.
+   * @param bufferSize [in] - See RecvMsg::AllocBuffers().
+   * @param controlSize [in] - See RecvMsg::AllocBuffers().
+   */
+  void AllocBuffers(size_t batchSize, size_t bufferSize, size_t controlSize);
+
+  /**
+   * Receives as many datagrams as are available, up to GetBatchSize(),
+   * without blocking.
+   *
+   * @param socket
+   *
+   * @return size_t - The number of messages received. Zero if there was nothing
+   *         to receive or on failure. Call GetLastError() to see which.
+   */
+  size_t DoRecvMsgBatch(const Socket &socket);
+
+  /**
+   * @return - The error from the last DoRecvMsgBatch() call. 0 if it succeeded,
+   *         or if there was simply no more data.
+   */
+  int GetLastError() { return m_error;}
+
+  /**
+   * @return size_t - The number of messages allocated.
+   */
+  size_t GetBatchSize() const { return m_messages.size();}
+
+  /**
+   * Gets a result from the last DoRecvMsgBatch()
+   *
+   * @param index [in] - Must be less than the value returned by
+   *              DoRecvMsgBatch().
+   *
+   * @return RecvMsg&
+   */
+  RecvMsg& GetMessage(size_t index) { return *m_messages[index];}
+
+private:
+  void freeMessages();
+
+  std::vector<RecvMsg *> m_messages;
+  Raii<uint8_t>::DeleteArray m_headers; // recvmmsg headers, as raw storage
+  Raii<uint8_t>::DeleteArray m_addresses; // sockaddr_storage for each message
+  Raii<uint8_t>::DeleteArray m_iovecs;   // iovec for each message
   int m_error;
 };
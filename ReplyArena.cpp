@@ -0,0 +1,164 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "ReplyArena.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+struct ReplyArena::Pool::Chunk
+{
+  Chunk *next;
+  size_t begin;  // First unconsumed byte.
+  size_t end;    // One past the last committed byte.
+  char data[ChunkSize];
+};
+
+ReplyArena::Pool::Pool(size_t maxFree) :
+   m_free(NULL),
+   m_freeCount(0),
+   m_maxFree(maxFree)
+{
+}
+
+ReplyArena::Pool::~Pool()
+{
+  while (m_free)
+  {
+    Chunk *next = m_free->next;
+    delete m_free;
+    m_free = next;
+  }
+}
+
+ReplyArena::Pool::Chunk* ReplyArena::Pool::get()
+{
+  Chunk *chunk = m_free;
+  if (chunk)
+  {
+    m_free = chunk->next;
+    m_freeCount--;
+  }
+  else
+    chunk = new Chunk;
+
+  chunk->next = NULL;
+  chunk->begin = 0;
+  chunk->end = 0;
+  return chunk;
+}
+
+void ReplyArena::Pool::put(Chunk *chunk)
+{
+  if (m_freeCount >= m_maxFree)
+  {
+    delete chunk;
+    return;
+  }
+  chunk->next = m_free;
+  m_free = chunk;
+  m_freeCount++;
+}
+
+ReplyArena::ReplyArena(Pool &pool) :
+   m_pool(pool),
+   m_head(NULL),
+   m_tail(NULL),
+   m_size(0)
+{
+}
+
+ReplyArena::~ReplyArena()
+{
+  while (m_head)
+  {
+    Pool::Chunk *next = m_head->next;
+    m_pool.put(m_head);
+    m_head = next;
+  }
+}
+
+char* ReplyArena::Reserve(size_t length)
+{
+  LogAssert(length <= ChunkSize);
+  if (!m_tail || ChunkSize - m_tail->end < length)
+  {
+    Pool::Chunk *chunk = m_pool.get();
+    if (m_tail)
+      m_tail->next = chunk;
+    else
+      m_head = chunk;
+    m_tail = chunk;
+  }
+  return m_tail->data + m_tail->end;
+}
+
+void ReplyArena::Commit(size_t length)
+{
+  LogAssert(m_tail && ChunkSize - m_tail->end >= length);
+  m_tail->end += length;
+  m_size += length;
+}
+
+void ReplyArena::Append(const char *data, size_t length)
+{
+  while (length != 0)
+  {
+    size_t room = m_tail ? ChunkSize - m_tail->end : 0;
+    if (room == 0)
+      room = ChunkSize;
+    size_t part = (length < room) ? length : room;
+    memcpy(Reserve(part), data, part);
+    Commit(part);
+    data += part;
+    length -= part;
+  }
+}
+
+int ReplyArena::AppendV(size_t maxLength, const char *format, va_list args)
+{
+  char *buffer = Reserve(maxLength + 1);
+  int length = vsnprintf(buffer, maxLength + 1, format, args);
+  if (length >= 0)
+    Commit(std::min(size_t(length), maxLength));
+  return length;
+}
+
+size_t ReplyArena::GetIov(struct iovec *iov, size_t maxCount) const
+{
+  size_t count = 0;
+  for (Pool::Chunk *chunk = m_head; chunk && count < maxCount; chunk = chunk->next)
+  {
+    if (chunk->end == chunk->begin)
+      continue;
+    iov[count].iov_base = chunk->data + chunk->begin;
+    iov[count].iov_len = chunk->end - chunk->begin;
+    count++;
+  }
+  return count;
+}
+
+void ReplyArena::Consume(size_t length)
+{
+  LogAssert(length <= m_size);
+  m_size -= length;
+  while (m_head)
+  {
+    size_t used = m_head->end - m_head->begin;
+    if (length < used)
+    {
+      m_head->begin += length;
+      break;
+    }
+    length -= used;
+    Pool::Chunk *next = m_head->next;
+    m_pool.put(m_head);
+    m_head = next;
+  }
+  if (!m_head)
+    m_tail = NULL;
+}
@@ -0,0 +1,129 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Output buffering for control connections. See CommandProcessor.
+
+ */
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+
+struct iovec;
+
+/**
+ * Output for one connection, held as a list of fixed size chunks.
+ *
+ * Replies are formatted straight into the last chunk, rather than into a
+ * buffer that is then copied. Chunks never move, so a pointer into them (such
+ * as the header of an open reply frame) stays good until that data is
+ * consumed. The unsent chunks are handed to sendmsg() as an iovec array, so a
+ * large reply goes out in a few system calls and sent data is never moved.
+ *
+ * Emptied chunks go back to the Pool that the arena was made with, so that
+ * steady traffic does not touch the heap.
+ *
+ * Not thread safe.
+ */
+class ReplyArena
+{
+public:
+  static const size_t ChunkSize = 64 * 1024;
+
+  /**
+   * Spare chunks that are shared by all of the arenas on one thread.
+   */
+  class Pool
+  {
+  public:
+    /**
+     * @param maxFree [in] - Spare chunks to keep. More are freed.
+     */
+    Pool(size_t maxFree);
+    ~Pool();
+
+  private:
+    friend class ReplyArena;
+    struct Chunk;
+
+    Chunk* get();
+    void put(Chunk *chunk);
+
+    Chunk *m_free;
+    size_t m_freeCount;
+    size_t m_maxFree;
+  };
+
+  ReplyArena(Pool &pool);
+  ~ReplyArena();
+
+  /**
+   * @return size_t - Bytes that have not been consumed.
+   */
+  size_t Size() const { return m_size;}
+
+  /**
+   * Gets contiguous space at the end. Call Commit() with the amount used.
+   *
+   * @throw - yes, on low memory.
+   *
+   * @param length [in] - At most ChunkSize.
+   *
+   * @return char* - Space for at least length bytes.
+   */
+  char* Reserve(size_t length);
+
+  /**
+   * Adds length bytes, written since the last Reserve(), to the end.
+   */
+  void Commit(size_t length);
+
+  /**
+   * Copies data to the end. It may be split across chunks.
+   *
+   * @throw - yes, on low memory.
+   */
+  void Append(const char *data, size_t length);
+
+  /**
+   * Formats to the end, cutting it to maxLength, like vsnprintf().
+   *
+   * @throw - yes, on low memory.
+   *
+   * @param maxLength [in] - Less than ChunkSize.
+   *
+   * @return int - As for vsnprintf(), the length before it was cut. Negative on
+   *         a format error, in which case nothing is added.
+   */
+  int AppendV(size_t maxLength, const char *format, va_list args);
+
+  /**
+   * Fills iov with the unconsumed data, in order.
+   *
+   * @return size_t - The number of entries used.
+   */
+  size_t GetIov(struct iovec *iov, size_t maxCount) const;
+
+  /**
+   * Removes length bytes from the start.
+   */
+  void Consume(size_t length);
+
+  /**
+   * Removes everything.
+   */
+  void Clear() { Consume(m_size);}
+
+private:
+  ReplyArena(const ReplyArena &);
+  ReplyArena& operator=(const ReplyArena &);
+
+  Pool &m_pool;
+  Pool::Chunk *m_head;
+  Pool::Chunk *m_tail;
+  size_t m_size;
+};
@@ -10,6 +10,11 @@
  */
 #pragma once
 
+#include "Histogram.h"
+#include "TimeSpec.h"
+#include <sys/socket.h>
+
+class RecvMsg;
 
 
 /**
@@ -140,6 +145,22 @@ protected:
   virtual ~Timer() { };
 };
 
+/**
+ * Room for a timer inside the object that uses it, see
+ * Scheduler::MakeTimerAt(). Timers that expire often are kept next to the
+ * rest of their owner's state that way, rather than in the scheduler's pool.
+ */
+struct TimerStorage
+{
+  static const size_t Size = 128;
+  union
+  {
+    uint64_t alignInteger;
+    void *alignPointer;
+    char bytes[Size];
+  } data;
+};
+
 
 /**
  * A single thread based scheduler.
@@ -197,6 +218,64 @@ public:
    */
   virtual void RemoveSocketCallback(int socket) = 0;
 
+  /**
+   * Does this scheduler receive and send datagrams itself, as they complete,
+   * rather than only reporting that a socket is ready? If so,
+   * SetDatagramCallback() and QueueDatagram() can be used.
+   *
+   * @return bool
+   */
+  virtual bool HandlesDatagrams() = 0;
+
+  typedef void (*DatagramCallback)(int socket, RecvMsg &message, void *userdata);
+
+  /**
+   * Like SetSocketCallback(), but the scheduler receives the datagrams on the
+   * socket, and calls the callback with each one. The call will occur on the
+   * main thread. Use RemoveSocketCallback() to stop.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   *
+   * @param socket [in] - The datagram socket to receive on.
+   * @param maxDataSize [in] - The largest datagram. Longer ones are truncated.
+   * @param controlSize [in] - The size of the buffer for receiving control
+   *                    messages, as for RecvMsg::AllocBuffers().
+   * @param callback [in] - The callback. The message, and its data, are only
+   *                 valid during the call.
+   * @param userdata [in] - passed back to callback.
+   *
+   * @return bool - false on failure, or if HandlesDatagrams() is false.
+   */
+  virtual bool SetDatagramCallback(int socket, size_t maxDataSize, size_t controlSize, DatagramCallback callback, void *userdata) = 0;
+
+  /**
+   * Queues a datagram to be sent on the socket. The data is copied. Queued
+   * datagrams are sent with the next wait for events, so any number of them
+   * take no extra system call. Send errors are counted in Stats.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   *
+   * @param socket [in] - The socket to send on. Must remain open until the
+   *               next wait for events, or FlushDatagrams().
+   * @param data [in] - The datagram.
+   * @param dataLength [in]
+   * @param address [in] - The destination.
+   * @param addressLength [in]
+   *
+   * @return bool - false if it could not be queued, or if HandlesDatagrams() is
+   *         false.
+   */
+  virtual bool QueueDatagram(int socket, const void *data, size_t dataLength, const struct sockaddr *address, socklen_t addressLength) = 0;
+
+  /**
+   * Hands the datagrams queued with QueueDatagram() to the kernel now, rather
+   * than with the next wait for events. Call before closing a socket that may
+   * have queued datagrams.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   */
+  virtual void FlushDatagrams() = 0;
+
   typedef void (*SignalCallback)(int sigId, void *userdata);
 
   /**
@@ -265,6 +344,29 @@ public:
    */
   virtual Timer* MakeTimer(const char *name) = 0;
 
+  /**
+   * Like MakeTimer(), but the name is "<staticName id>". The name is only
+   * formatted if it is logged, so this is cheaper when many timers are made.
+   *
+   * @param staticName [in] - Not copied. Must remain valid for the life of the
+   *                   timer, such as a string literal.
+   * @param id [in] - Added to the name.
+   *
+   * @return Timer* - Never NULL.
+   */
+  virtual Timer* MakeTimer(const char *staticName, uint32_t id) = 0;
+
+  /**
+   * Like MakeTimer(staticName, id), but the timer is made in storage, rather
+   * than in the scheduler's pool. It must still be freed with FreeTimer(),
+   * before storage goes away.
+   *
+   * @param storage [in] - Must not hold a timer already.
+   *
+   * @return Timer* - Never NULL. Points into storage.
+   */
+  virtual Timer* MakeTimerAt(TimerStorage &storage, const char *staticName, uint32_t id) = 0;
+
   /**
    * Call when completely done with a timer.
    *
@@ -274,6 +376,140 @@ public:
    */
   virtual void FreeTimer(Timer *timer) = 0;
 
+  /**
+   * Allocates room for count timers, so that making, and scheduling, up to that
+   * many does not allocate memory.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   *
+   * @throw - std::bad_alloc
+   *
+   * @param count [in] - Timers from MakeTimer().
+   * @param embeddedCount [in] - Timers from MakeTimerAt(), which only need room
+   *                      to be scheduled.
+   */
+  virtual void ReserveTimers(size_t count, size_t embeddedCount = 0) = 0;
+
+  /**
+   * Clocks that the scheduler can use for its loop time. See LoopTime().
+   */
+  struct ClockSource
+  {
+    enum Value
+    {
+      Precise, // CLOCK_MONOTONIC
+      Coarse   // CLOCK_MONOTONIC_COARSE. Cheaper, but only as exact as the kernel tick.
+    };
+  };
+
+  /**
+   * Sets the clock for the loop time. The default is ClockSource::Precise.
+   *
+   * With ClockSource::Coarse, timers may expire up to one kernel tick late,
+   * but never early, since timers are still started from the precise clock.
+   *
+   * @note Call only on main thread, before Run().
+   *
+   * @return bool - false if the clock is not available on this system.
+   */
+  virtual bool SetClockSource(ClockSource::Value source) = 0;
+
+  /**
+   * Gets the monotonic time that the scheduler is using to expire timers. It is
+   * read once at the start of each loop iteration, and again after each socket
+   * or signal callback, so it may be behind the true time by the time spent in
+   * the current callback. Use it where that is good enough, such as for
+   * statistics, and TimeSpec::MonoNow() where a time must not be early.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   */
+  virtual const TimeSpec& LoopTime() = 0;
+
+  /**
+   * Reads the clock for LoopTime() again. Call after work that may have taken
+   * a long time.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   *
+   * @return const TimeSpec& - The new loop time.
+   */
+  virtual const TimeSpec& RefreshLoopTime() = 0;
+
+  static const uint32_t DefaultLowTimersPerIteration = 8;
+  static const uint32_t DefaultLowTimerDeadline = 10000;
+
+  /**
+   * Limits on how the event loop shares its time between events and low
+   * priority timers, when it is busy. See SetBudget().
+   *
+   * High priority timers always run first. Without events, one expired low
+   * priority timer runs in each iteration, as always.
+   */
+  struct Budget
+  {
+    Budget() : lowTimersPerIteration(DefaultLowTimersPerIteration), lowTimerDeadline(DefaultLowTimerDeadline) { }
+
+    uint32_t lowTimersPerIteration; // Expired low priority timers that may run in an iteration that had events. 0 for none.
+    uint32_t lowTimerDeadline;  // Microseconds. Low priority timers that are this late run before events, with no limit. 0 for none.
+  };
+
+  /**
+   * Sets the budget for the event loop.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   */
+  virtual void SetBudget(const Budget &budget) = 0;
+
+  /**
+   * Measurements of how well the scheduler is keeping up. Times are in
+   * microseconds.
+   */
+  struct Stats
+  {
+    Stats() : iterations(0), lowStarvedIterations(0), timers(0), timerSize(0), timerBytes(0),
+       clockSource(ClockSource::Precise), clockResolution(0), clockReads(0),
+       lowBudgetTimers(0), lowBudgetExhausted(0), lowDeadlineTimers(0),
+       datagramsReceived(0), datagramsSent(0), datagramSendFailures(0), receiveBufferShortages(0) { }
+
+    uint64_t iterations;  // Times through the event loop.
+    uint64_t lowStarvedIterations;  // Iterations where an expired low priority timer waited for events.
+    Histogram timerLateness[2];  // How late timers expired, indexed by Timer::Priority::Value.
+    Histogram iterationTime;  // Time handling timers and events in one iteration. Excludes waiting.
+    Histogram callbacksPerIteration;  // Socket and signal callbacks, for iterations with events.
+    Histogram lowStarvation;  // Iterations that each low priority timer waited after expiring.
+    size_t timers;  // Timers in use. Not affected by ResetStats().
+    size_t timerSize;  // Bytes of storage for each timer.
+    size_t timerBytes;  // Bytes of storage held for pooled timers, used or not. Not those from MakeTimerAt().
+    ClockSource::Value clockSource;  // Not affected by ResetStats().
+    uint64_t clockResolution;  // Nanoseconds, as reported for clockSource. Not affected by ResetStats().
+    uint64_t clockReads;  // Reads of the loop time clock.
+    Histogram clockLag;  // For ClockSource::Coarse, how far the loop time was behind the precise clock, sampled.
+    Budget budget;  // Not affected by ResetStats().
+    uint64_t lowBudgetTimers;  // Low priority timers run in iterations with events, within budget.lowTimersPerIteration.
+    uint64_t lowBudgetExhausted;  // Iterations with events that used all of budget.lowTimersPerIteration.
+    uint64_t lowDeadlineTimers;  // Low priority timers run before events, because they passed budget.lowTimerDeadline.
+    uint64_t datagramsReceived;  // By the scheduler, see HandlesDatagrams().
+    uint64_t datagramsSent;  // Sent by the scheduler, see QueueDatagram().
+    uint64_t datagramSendFailures;  // Queued with QueueDatagram(), but not sent.
+    uint64_t receiveBufferShortages;  // Times that receiving stopped until a buffer was free.
+  };
+
+  /**
+   * Copies the current statistics.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   *
+   * @param outStats [out] - The statistics.
+   */
+  virtual void GetStats(Scheduler::Stats &outStats) = 0;
+
+  /**
+   * Resets all statistics.
+   *
+   * @note Call only on main thread. See IsMainThread().
+   */
+  virtual void ResetStats() = 0;
+
 protected:
 
   /**
@@ -9,11 +9,21 @@
 #include "SmartPointer.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <new>
+#ifdef USE_EVENTFD_SIGNALS
+#include <sys/eventfd.h>
+#endif
 
 using namespace std;
 
+const size_t SchedulerBase::TimerSlabSize;
+const uint64_t SchedulerBase::ClockLagSampleInterval;
+const uint32_t Scheduler::DefaultLowTimersPerIteration;
+const uint32_t Scheduler::DefaultLowTimerDeadline;
+
 
 /**
  * A timer class for use with SchedulerBase
@@ -21,41 +31,67 @@ using namespace std;
  */
 class TimerImpl : public Timer
 {
+#ifdef USE_TIMER_HEAP
+  friend class TimerHeap;
+  typedef TimerHeap timer_queue;
+#else
+  typedef SchedulerBase::timer_set timer_queue;
+#endif
 
 private:
   SchedulerBase *m_scheduler;
-  SchedulerBase::timer_set *m_activeTimers;  // Use only from main thread. The active timer list that this is part of when active.
+  // Use only from main thread. The active timer list that this is part of when
+  // active. For the heap this is an array indexed by priority.
+  timer_queue *m_activeTimers;
+#ifdef USE_TIMER_HEAP
+  size_t m_heapIndex;  // Position in m_activeTimers[m_priority], maintained by TimerHeap.
+#endif
   Timer::Callback m_callback;
   void *m_userdata;
   TimeSpec m_expireTime;
   TimeSpec m_startTime;  // only valid when not stopped.
   bool m_stopped;
-  char *m_name;  // for logging
+  bool m_embedded;  // Made by MakeTimerAt(), so not in the pool.
+  char *m_name;  // for logging. Made by Name() if NULL.
+  const char *m_staticName;  // Not owned. Used by Name() along with m_nameId.
+  uint32_t m_nameId;
   Timer::Priority::Value m_priority;
 
 public:
-  TimerImpl(SchedulerBase &scheduler, SchedulerBase::timer_set *timerSet, const char *name) : Timer(),
+  /**
+   * @param name [in] - Copied. May be NULL.
+   * @param staticName [in] - Only used if name is NULL. Not copied. May be NULL.
+   * @param nameId [in] - Used with staticName.
+   */
+  TimerImpl(SchedulerBase &scheduler, timer_queue *timerSet, const char *name, const char *staticName, uint32_t nameId,
+            bool embedded) : Timer(),
      m_scheduler(&scheduler),
      m_activeTimers(timerSet),
+#ifdef USE_TIMER_HEAP
+     m_heapIndex(TimerHeap::NotInHeap),
+#endif
      m_callback(NULL),
      m_userdata(NULL),
      m_stopped(true),
+     m_embedded(embedded),
      m_name(NULL),
+     m_staticName(staticName),
+     m_nameId(nameId),
      m_priority(Timer::Priority::Hi)
   {
     if (name)
-      m_name = strdup(name);
-    else
     {
-      char *tempName = (char *)malloc(32);
-      snprintf(tempName, 32, "%p", this);
-      m_name = tempName;
+      m_name = strdup(name);
+      if (!m_name)
+        throw std::bad_alloc();
     }
 
     m_expireTime.tv_sec = 0;
     m_expireTime.tv_nsec = 0;
   };
 
+  bool IsEmbedded() const { return m_embedded;}
+
   ~TimerImpl()
   {
     // This will remove it from the active list.
@@ -78,16 +114,20 @@ public:
     LogAssert(m_scheduler->IsMainThread());
 
     if (m_stopped)
-      LogOptional(Log::TimerDetail, "Stopping ignored on stopped timer %s", m_name);
+      LogOptional(Log::TimerDetail, "Stopping ignored on stopped timer %s", Name());
     else
     {
       // Remove us from active timers list. (Must remove before changing timer.)
+#ifdef USE_TIMER_HEAP
+      activeQueue().Remove(this);
+#else
       SchedulerBase::timer_set_it found = SchedulerBase::TimeSetFindExact(*m_activeTimers, this);
       if (found != m_activeTimers->end())
         m_activeTimers->erase(found);
+#endif
 
       m_stopped = true;
-      LogOptional(Log::TimerDetail, "Stopping timer %s. (%zu timers)", m_name, m_activeTimers->size());
+      LogOptional(Log::TimerDetail, "Stopping timer %s. (%zu timers)", Name(), activeQueue().size());
     }
   }
 
@@ -134,6 +174,24 @@ public:
   void SetPriority(Timer::Priority::Value pri)
   {
     LogAssert(m_scheduler->IsMainThread());
+#ifdef USE_TIMER_HEAP
+    // Each priority has its own heap, so an active timer must move.
+    if (pri != m_priority && m_heapIndex != TimerHeap::NotInHeap)
+    {
+      activeQueue().Remove(this);
+      m_priority = pri;
+      try
+      {
+        activeQueue().Insert(this);
+      }
+      catch (std::exception &e)
+      {
+        m_stopped = true;
+        gLog.Message(Log::Error, "Failed to move timer: %s.", e.what());
+      }
+      return;
+    }
+#endif
     m_priority = pri;
   }
 
@@ -166,17 +224,30 @@ public:
 
     Stop();
 
-    LogOptional(Log::TimerDetail, "Expired timer %s calling callback", m_name);
+    LogOptional(Log::TimerDetail, "Expired timer %s calling callback", Name());
     m_callback(this, m_userdata);
   }
 
   /**
-   * Gets the name
+   * Gets the name. Unless a name was copied when the timer was made, it is
+   * formatted on first use, so that timers that are never logged do not need
+   * it.
    *
-   * @return const char*
+   * @return const char* - Never NULL.
    */
   const char* Name()
   {
+    if (!m_name)
+    {
+      char name[64];
+      if (m_staticName)
+        snprintf(name, sizeof(name), "<%s %" PRIu32 ">", m_staticName, m_nameId);
+      else
+        snprintf(name, sizeof(name), "%p", this);
+      m_name = strdup(name);
+      if (!m_name)
+        return "<timer>";
+    }
     return  m_name;
   }
 
@@ -204,13 +275,13 @@ private:
 
     if (!expireChange && !startChange)
     {
-      LogOptional(Log::TimerDetail, "Timer %s no change.  %" PRIu64 "  microseconds. Expires:%jd:%09ld", m_name, micro, (intmax_t)expireTime.tv_sec, expireTime.tv_nsec);
+      LogOptional(Log::TimerDetail, "Timer %s no change.  %" PRIu64 "  microseconds. Expires:%jd:%09ld", Name(), micro, (intmax_t)expireTime.tv_sec, expireTime.tv_nsec);
       return true;
     }
 
     LogOptional(Log::TimerDetail, "%s timer %s for %" PRIu64 " microseconds from %jd:%09ld. Expires:%jd:%09ld",
                 m_stopped ? "Starting" : startChange ? "Resetting" : "Advancing",
-                m_name,
+                Name(),
                 micro,
                 (intmax_t)startTime.tv_sec,
                 startTime.tv_nsec,
@@ -226,6 +297,24 @@ private:
 
     if (expireChange)
     {
+#ifdef USE_TIMER_HEAP
+      m_expireTime = expireTime;
+      if (m_heapIndex != TimerHeap::NotInHeap)
+        activeQueue().Update(this);
+      else
+      {
+        try
+        {
+          activeQueue().Insert(this);
+        }
+        catch (std::exception &e)
+        {
+          m_stopped = true;
+          gLog.Message(Log::Error, "Failed to add timer: %s.", e.what());
+          return false;
+        }
+      }
+#else
       SchedulerBase::timer_set_it found = SchedulerBase::TimeSetFindExact(*m_activeTimers, this);
       if (found != m_activeTimers->end())
       {
@@ -252,6 +341,7 @@ private:
           return false;
         }
       }
+#endif  // USE_TIMER_HEAP
     }
 
     //LogOptional(Log::Temp, "Timer %s after change %zu items",m_name, m_activeTimers->size());
@@ -259,6 +349,19 @@ private:
   }
 
 
+  /**
+   * @return timer_queue& - The queue that holds this timer when active.
+   */
+  timer_queue& activeQueue()
+  {
+#ifdef USE_TIMER_HEAP
+    return m_activeTimers[m_priority];
+#else
+    return *m_activeTimers;
+#endif
+  }
+
+#ifndef USE_TIMER_HEAP
   /**
    * Checks if the timer item is still in proper order.
    *
@@ -288,17 +391,144 @@ private:
     }
     return true;
   }
+#endif  // !USE_TIMER_HEAP
 };
 
+// Fails to compile if TimerImpl outgrows TimerStorage, see MakeTimerAt().
+typedef char TimerFitsStorage[sizeof(TimerImpl) <= TimerStorage::Size ? 1 : -1];
+
+
+#ifdef USE_TIMER_HEAP
+
+/**
+ * @return bool - true if lhs expires before rhs.
+ */
+static inline bool timerHeapLess(const TimerImpl *lhs, const TimerImpl *rhs)
+{
+  return (0 > timespecCompare(lhs->GetExpireTime(), rhs->GetExpireTime()));
+}
+
+void TimerHeap::Insert(TimerImpl *timer)
+{
+  LogAssert(timer->m_heapIndex == NotInHeap);
+
+  // Grow geometrically, so that allocation only happens when the number of
+  // active timers reaches a new high.
+  if (m_items.size() == m_items.capacity())
+    m_items.reserve(m_items.empty() ? 64 : m_items.size() * 2);
+  m_items.push_back(timer);
+  timer->m_heapIndex = m_items.size() - 1;
+  siftUp(timer->m_heapIndex);
+}
+
+void TimerHeap::Remove(TimerImpl *timer)
+{
+  size_t pos = timer->m_heapIndex;
+
+  if (pos == NotInHeap)
+    return;
+  if (!LogVerify(pos < m_items.size() && m_items[pos] == timer))
+    return;
+
+  timer->m_heapIndex = NotInHeap;
+
+  TimerImpl *last = m_items.back();
+  m_items.pop_back();
+  if (pos == m_items.size())
+    return;
+
+  // Move the last item into the hole, and restore the heap from there.
+  place(pos, last);
+  if (pos > 0 && timerHeapLess(last, m_items[(pos - 1) / 4]))
+    siftUp(pos);
+  else
+    siftDown(pos);
+}
+
+void TimerHeap::Update(TimerImpl *timer)
+{
+  size_t pos = timer->m_heapIndex;
+
+  if (!LogVerify(pos < m_items.size() && m_items[pos] == timer))
+    return;
+
+  if (pos > 0 && timerHeapLess(timer, m_items[(pos - 1) / 4]))
+    siftUp(pos);
+  else
+    siftDown(pos);
+}
+
+void TimerHeap::place(size_t pos, TimerImpl *timer)
+{
+  m_items[pos] = timer;
+  timer->m_heapIndex = pos;
+}
+
+void TimerHeap::siftUp(size_t pos)
+{
+  TimerImpl *timer = m_items[pos];
+
+  while (pos > 0)
+  {
+    size_t parent = (pos - 1) / 4;
+    if (!timerHeapLess(timer, m_items[parent]))
+      break;
+    place(pos, m_items[parent]);
+    pos = parent;
+  }
+  place(pos, timer);
+}
+
+void TimerHeap::siftDown(size_t pos)
+{
+  TimerImpl *timer = m_items[pos];
+  size_t count = m_items.size();
+
+  while (true)
+  {
+    size_t first = pos * 4 + 1;
+    if (first >= count)
+      break;
+
+    // Find the earliest of up to 4 children
+    size_t last = std::min(first + 4, count);
+    size_t best = first;
+    for (size_t child = first + 1; child < last; child++)
+    {
+      if (timerHeapLess(m_items[child], m_items[best]))
+        best = child;
+    }
+
+    if (!timerHeapLess(m_items[best], timer))
+      break;
+    place(pos, m_items[best]);
+    pos = best;
+  }
+  place(pos, timer);
+}
+
+#endif  // USE_TIMER_HEAP
+
 
 
 SchedulerBase::SchedulerBase() : Scheduler(),
    m_isStarted(false),
    m_wantsShutdown(false),
+#ifndef USE_TIMER_HEAP
    m_activeTimers(compareTimers),
-   m_timerCount(0)
+#endif
+   m_timerCount(0),
+   m_timerPool(sizeof(TimerImpl), TimerSlabSize),
+   m_embeddedTimerCount(0),
+   m_lowStarvedCount(0),
+   m_clockId(CLOCK_MONOTONIC)
 {
+  struct timespec resolution;
+
   m_mainThread = pthread_self();
+  if (0 == clock_getres(m_clockId, &resolution))
+    m_stats.clockResolution = uint64_t(resolution.tv_sec) * TimeSpec::NSecPerSec + uint64_t(resolution.tv_nsec);
+  m_loopTime = TimeSpec::MonoNow();
 }
 
 SchedulerBase::~SchedulerBase()
@@ -306,7 +536,9 @@ SchedulerBase::~SchedulerBase()
   for (SignalItemHashMap::iterator sig = m_signals.begin(); sig != m_signals.end(); sig++)
   {
     ::close(sig->second.fdRead);
-    ::close(sig->second.fdWrite);
+    // With an eventfd both ends are the same descriptor.
+    if (sig->second.fdWrite != sig->second.fdRead)
+      ::close(sig->second.fdWrite);
   }
 }
 
@@ -337,6 +569,10 @@ bool SchedulerBase::Run()
     gLog.Optional(Log::TimerDetail, "checking events (%u)", iter);
     gotEvents = waitForEvents(timeout);
 
+    TimeSpec iterationStart(RefreshLoopTime());
+    uint64_t callbacks = 0;
+    m_stats.iterations++;
+
     // By default the next event check is immediately.
     timeout = immediate;
 
@@ -347,6 +583,24 @@ bool SchedulerBase::Run()
     { //nothing
     }
 
+    if (m_wantsShutdown)
+      break;
+
+    //
+    // Low priority timers that are past the deadline are handled like high
+    // priority ones, so no amount of events can hold them back for long.
+    //
+    if (m_stats.budget.lowTimerDeadline != 0)
+    {
+      TimeSpec cutoff = m_loopTime - TimeSpec(TimeSpec::Microsec, m_stats.budget.lowTimerDeadline);
+      Timer::Priority::Value priority;
+      while (!m_wantsShutdown && expireTimer(Timer::Priority::Low, cutoff, &priority))
+      {
+        if (priority == Timer::Priority::Low)
+          m_stats.lowDeadlineTimers++;
+      }
+    }
+
     if (m_wantsShutdown)
       break;
 
@@ -369,14 +623,24 @@ bool SchedulerBase::Run()
 
         if (m_sockets.end() != (foundSocket = m_sockets.find(socketId)))
         {
-          if (LogVerify(foundSocket->second.callback != NULL))
+          if (foundSocket->second.datagramCallback != NULL)
+          {
+            callbacks++;
+            deliverDatagram(socketId, foundSocket->second.datagramCallback, foundSocket->second.userdata);
+            RefreshLoopTime();
+          }
+          else if (LogVerify(foundSocket->second.callback != NULL))
+          {
+            callbacks++;
             foundSocket->second.callback(socketId, foundSocket->second.userdata);
+            RefreshLoopTime();
+          }
         }
         else if (m_signals.end() != (foundSignal = m_signals.find(socketId)))
         {
           if (LogVerify(foundSignal->second.callback != NULL))
           {
-            // 'Drain' the pipe.
+            // 'Drain' the pipe. An eventfd is reset by a single read.
             char drain[128];
             int result;
             size_t reads = 0;
@@ -389,7 +653,9 @@ bool SchedulerBase::Run()
             else if (result == 0)
               gLog.LogError("Signaling pipe write end for %d closed", socketId);
 
+            callbacks++;
             foundSignal->second.callback(foundSignal->second.fdWrite, foundSignal->second.userdata);
+            RefreshLoopTime();
           }
         }
         else
@@ -403,17 +669,51 @@ bool SchedulerBase::Run()
 
       if (m_wantsShutdown)
         break;
+
+      m_stats.callbacksPerIteration.Record(callbacks);
     }
 
     //
-    //  Handle a low priority timer if there are no events.
-    //  TODO: starvation is a potential problem for low priority timers.
+    //  Handle a low priority timer if there are no events. Otherwise handle up
+    //  to the budget, so that a steady stream of events does not starve them.
+    //  Starvation is measured in m_stats.lowStarvation.
     //
-    if (!gotEvents && !expireTimer(Timer::Priority::Low))
+    if (!gotEvents)
     {
-      // No events and no more timers, so we are ready to sleep again.
-      timeout = getNextTimerTimeout();
+      if (!expireTimer(Timer::Priority::Low))
+      {
+        // No events and no more timers, so we are ready to sleep again.
+        timeout = getNextTimerTimeout();
+      }
     }
+    else
+    {
+      // High priority timers that came due while handling events also run here,
+      // in order, but do not count against the budget.
+      uint32_t lowTimers = 0;
+      Timer::Priority::Value priority;
+      while (lowTimers < m_stats.budget.lowTimersPerIteration
+             && !m_wantsShutdown
+             && expireTimer(Timer::Priority::Low, m_loopTime, &priority))
+      {
+        if (priority == Timer::Priority::Low)
+          lowTimers++;
+      }
+      m_stats.lowBudgetTimers += lowTimers;
+
+      if (m_wantsShutdown)
+        break;
+
+      if (lowTimerExpired(m_loopTime))
+      {
+        m_stats.lowBudgetExhausted++;
+        m_lowStarvedCount++;
+        m_stats.lowStarvedIterations++;
+      }
+    }
+
+    int64_t iterationNs = (RefreshLoopTime() - iterationStart).ToNanoseconds();
+    m_stats.iterationTime.Record(iterationNs > 0 ? uint64_t(iterationNs / TimeSpec::NSecPerUs) : 0);
 
     if (m_wantsShutdown)
       break;
@@ -435,19 +735,32 @@ TimeSpec SchedulerBase::getNextTimerTimeout()
   //
   //  Calculate next scheduled timer time.
   //
+#ifdef USE_TIMER_HEAP
+  const TimerImpl *first = m_activeTimers[Timer::Priority::Hi].Top();
+  const TimerImpl *firstLow = m_activeTimers[Timer::Priority::Low].Top();
+  if (!first || (firstLow && timerHeapLess(firstLow, first)))
+    first = firstLow;
+  if (!first)
+#else
   if (m_activeTimers.empty())
+#endif
   {
     // Just for laughs ... and because we do not run on low power machines, wake up
     // every few seconds.
     return TimeSpec(3, 0);
   }
 
-  TimeSpec now(TimeSpec::MonoNow());
+  // Timers that ran since the last read may have taken a while.
+  TimeSpec now(RefreshLoopTime());
 
   if (now.empty())
     return TimeSpec(TimeSpec::Millisec, 200); // 200 ms?
 
+#ifdef USE_TIMER_HEAP
+  TimeSpec result = first->GetExpireTime() - now;
+#else
   TimeSpec result = (*m_activeTimers.begin())->GetExpireTime() - now;
+#endif
   if (result.IsNegative())
     return TimeSpec();
   return result;
@@ -462,26 +775,63 @@ TimeSpec SchedulerBase::getNextTimerTimeout()
  */
 bool SchedulerBase::expireTimer(Timer::Priority::Value minPri)
 {
-  TimeSpec now(TimeSpec::MonoNow());
+  // The loop time, so that expiring many timers does not read the clock for
+  // each. Timers that come due meanwhile are expired on the next iteration.
+  return expireTimer(minPri, m_loopTime, NULL);
+}
 
-  if (now.empty())
+/**
+ *
+ * Helper for Run().
+ * Expires the next timer with priority of minPri or higher, if it expired at or
+ * before cutoff.
+ *
+ * @param outPriority [out] - The priority of the timer that was expired. May be
+ *                    NULL.
+ *
+ * @return - false if there are no more such timers.
+ */
+bool SchedulerBase::expireTimer(Timer::Priority::Value minPri, const TimeSpec &cutoff, Timer::Priority::Value *outPriority)
+{
+  const TimeSpec &now = m_loopTime;
+
+  if (now.empty() || cutoff.empty())
     return false;
 
+#ifdef USE_TIMER_HEAP
+  // Hi priority timers are always eligible. Low priority only if minPri allows,
+  // and then the earliest of the two goes first.
+  TimerImpl *timer = m_activeTimers[Timer::Priority::Hi].Top();
+  if (minPri <= Timer::Priority::Low)
+  {
+    TimerImpl *lowTimer = m_activeTimers[Timer::Priority::Low].Top();
+    if (!timer || (lowTimer && timerHeapLess(lowTimer, timer)))
+      timer = lowTimer;
+  }
+
+  if (!timer || 0 < timespecCompare(timer->GetExpireTime(), cutoff))
+    return false;  // non-expired timer ... we are done!
+
+  recordTimerLateness(timer, now);
+  if (outPriority)
+    *outPriority = timer->GetPriority();
+
+  // Expire the timer, which will run the action.
+  timer->ExpireTimer();
+  return true;
+#else
   for (timer_set_it nextTimer = m_activeTimers.begin(); nextTimer != m_activeTimers.end(); nextTimer++)
   {
     TimerImpl *timer = *nextTimer;
 
-    if (0 < timespecCompare(timer->GetExpireTime(), now))
+    if (0 < timespecCompare(timer->GetExpireTime(), cutoff))
       return false;  // non-expired timer ... we are done!
 
     if (timer->GetPriority() >= minPri)
     {
-#ifdef BFD_TEST_TIMERS
-      TimeSpec dif = now -  timer->GetExpireTime();
-      gLog.Optional(Log::Temp, "Timer %s is off by %.4f ms",
-                    timer->Name(),
-                    timespecToSeconds(dif) * 1000.0);
-#endif
+      recordTimerLateness(timer, now);
+      if (outPriority)
+        *outPriority = timer->GetPriority();
 
       // Expire the timer, which will run the action.
       // Note that the action could also modify the m_activeTimers list.
@@ -491,6 +841,140 @@ bool SchedulerBase::expireTimer(Timer::Priority::Value minPri)
   }
 
   return false;
+#endif  // USE_TIMER_HEAP
+}
+
+/**
+ * Helper for Run().
+ *
+ * @return bool - true if a low priority timer has expired.
+ */
+bool SchedulerBase::lowTimerExpired(const TimeSpec &now)
+{
+#ifdef USE_TIMER_HEAP
+  TimerImpl *timer = m_activeTimers[Timer::Priority::Low].Top();
+  return timer && 0 >= timespecCompare(timer->GetExpireTime(), now);
+#else
+  for (timer_set_it nextTimer = m_activeTimers.begin(); nextTimer != m_activeTimers.end(); nextTimer++)
+  {
+    if (0 < timespecCompare((*nextTimer)->GetExpireTime(), now))
+      return false;
+    if ((*nextTimer)->GetPriority() == Timer::Priority::Low)
+      return true;
+  }
+  return false;
+#endif
+}
+
+/**
+ * Helper for expireTimer(). Records how late the timer is, just before it is
+ * expired.
+ */
+void SchedulerBase::recordTimerLateness(TimerImpl *timer, const TimeSpec &now)
+{
+  TimeSpec dif = now -  timer->GetExpireTime();
+  int64_t difNs = dif.ToNanoseconds();
+  Timer::Priority::Value priority = timer->GetPriority();
+
+  m_stats.timerLateness[priority].Record(difNs > 0 ? uint64_t(difNs / TimeSpec::NSecPerUs) : 0);
+  if (priority == Timer::Priority::Low)
+  {
+    m_stats.lowStarvation.Record(m_lowStarvedCount);
+    m_lowStarvedCount = 0;
+  }
+
+#ifdef BFD_TEST_TIMERS
+  gLog.Optional(Log::Temp, "Timer %s is off by %.4f ms",
+                timer->Name(),
+                timespecToSeconds(dif) * 1000.0);
+#endif
+}
+
+void SchedulerBase::GetStats(Scheduler::Stats &outStats)
+{
+  LogAssert(IsMainThread());
+  outStats = m_stats;
+
+  SlabPool::Stats timerStats;
+  m_timerPool.GetStats(timerStats);
+  outStats.timers = timerStats.inUse + m_embeddedTimerCount;
+  outStats.timerSize = timerStats.itemSize;
+  outStats.timerBytes = timerStats.slabBytes;
+}
+
+void SchedulerBase::ResetStats()
+{
+  LogAssert(IsMainThread());
+  Scheduler::ClockSource::Value clockSource = m_stats.clockSource;
+  uint64_t clockResolution = m_stats.clockResolution;
+  Scheduler::Budget budget = m_stats.budget;
+  m_stats = Scheduler::Stats();
+  m_stats.clockSource = clockSource;
+  m_stats.clockResolution = clockResolution;
+  m_stats.budget = budget;
+  m_lowStarvedCount = 0;
+}
+
+bool SchedulerBase::SetClockSource(ClockSource::Value source)
+{
+  LogAssert(IsMainThread());
+  LogAssert(!m_isStarted);
+
+  clockid_t clockId;
+  struct timespec resolution;
+
+  if (source == ClockSource::Precise)
+    clockId = CLOCK_MONOTONIC;
+  else
+  {
+#ifdef CLOCK_MONOTONIC_COARSE
+    clockId = CLOCK_MONOTONIC_COARSE;
+#else
+    return false;
+#endif
+  }
+
+  if (0 != clock_getres(clockId, &resolution))
+    return false;
+
+  m_clockId = clockId;
+  m_stats.clockSource = source;
+  m_stats.clockResolution = uint64_t(resolution.tv_sec) * TimeSpec::NSecPerSec + uint64_t(resolution.tv_nsec);
+  RefreshLoopTime();
+  return true;
+}
+
+void SchedulerBase::SetBudget(const Budget &budget)
+{
+  LogAssert(IsMainThread());
+  m_stats.budget = budget;
+}
+
+const TimeSpec& SchedulerBase::LoopTime()
+{
+  LogAssert(IsMainThread());
+  return m_loopTime;
+}
+
+const TimeSpec& SchedulerBase::RefreshLoopTime()
+{
+  TimeSpec now;
+
+  if (0 != clock_gettime(m_clockId, &now))
+  {
+    gLog.Optional(Log::Critical, "clock_gettime failed for the scheduler clock.%s", ErrnoToString());
+    now = TimeSpec::MonoNow();
+  }
+  m_stats.clockReads++;
+
+  if (m_stats.clockSource == ClockSource::Coarse && m_stats.clockReads % ClockLagSampleInterval == 0)
+  {
+    int64_t lagNs = (TimeSpec::MonoNow() - now).ToNanoseconds();
+    m_stats.clockLag.Record(lagNs > 0 ? uint64_t(lagNs / TimeSpec::NSecPerUs) : 0);
+  }
+
+  m_loopTime = now;
+  return m_loopTime;
 }
 
 bool SchedulerBase::IsMainThread()
@@ -512,6 +996,37 @@ bool SchedulerBase::SetSocketCallback(int socket, Scheduler::SocketCallback call
   schedulerSocketItem item;
 
   item.callback = callback;
+  item.datagramCallback = NULL;
+  item.userdata = userdata;
+  item.socket = socket;
+
+  m_sockets[socket] = item;
+
+  return true;
+}
+
+bool SchedulerBase::HandlesDatagrams()
+{
+  return false;
+}
+
+bool SchedulerBase::SetDatagramCallback(int socket, size_t maxDataSize, size_t controlSize, Scheduler::DatagramCallback callback, void *userdata)
+{
+  LogAssert(IsMainThread());
+
+  if (!HandlesDatagrams())
+    return false;
+
+  if (!LogVerify(callback) || !LogVerify(socket != -1))
+    return false;
+
+  if (!watchDatagramSocket(socket, maxDataSize, controlSize))
+    return false;
+
+  schedulerSocketItem item;
+
+  item.callback = NULL;
+  item.datagramCallback = callback;
   item.userdata = userdata;
   item.socket = socket;
 
@@ -520,6 +1035,26 @@ bool SchedulerBase::SetSocketCallback(int socket, Scheduler::SocketCallback call
   return true;
 }
 
+bool SchedulerBase::QueueDatagram(int ATTR_UNUSED(socket), const void *ATTR_UNUSED(data), size_t ATTR_UNUSED(dataLength),
+                                  const struct sockaddr *ATTR_UNUSED(address), socklen_t ATTR_UNUSED(addressLength))
+{
+  return false;
+}
+
+void SchedulerBase::FlushDatagrams()
+{
+}
+
+bool SchedulerBase::watchDatagramSocket(int ATTR_UNUSED(fd), size_t ATTR_UNUSED(maxDataSize), size_t ATTR_UNUSED(controlSize))
+{
+  return false;
+}
+
+void SchedulerBase::deliverDatagram(int ATTR_UNUSED(fd), Scheduler::DatagramCallback ATTR_UNUSED(callback), void *ATTR_UNUSED(userdata))
+{
+  LogAssert(false);
+}
+
 void SchedulerBase::RemoveSocketCallback(int socket)
 {
   LogAssert(IsMainThread());
@@ -550,6 +1085,31 @@ bool SchedulerBase::CreateSignalChannel(int *outSigId, SignalCallback callback,
 
   *outSigId = -1;
 
+  schedulerSignalItem item;
+
+  item.callback = callback;
+  item.userdata = userdata;
+
+#ifdef USE_EVENTFD_SIGNALS
+  // An eventfd is a single descriptor, and a counter, rather than a buffer that
+  // can fill.
+  FileDescriptor eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  if (!eventFd.IsValid())
+  {
+    gLog.ErrnoError(errno, "Unable to create eventfd for signaling");
+    return false;
+  }
+
+  if (!watchSocket(eventFd))
+    return false;
+
+  item.fdWrite = eventFd;
+  item.fdRead = eventFd;
+
+  m_signals[item.fdRead] = item;
+
+  eventFd.Detach();
+#else
   // Create a set of pipes
   int fdPipe[2];
   int flags;
@@ -582,10 +1142,6 @@ bool SchedulerBase::CreateSignalChannel(int *outSigId, SignalCallback callback,
   if (!watchSocket(pipeRead))
     return false;
 
-  schedulerSignalItem item;
-
-  item.callback = callback;
-  item.userdata = userdata;
   item.fdWrite = pipeWrite;
   item.fdRead = pipeRead;
 
@@ -593,6 +1149,7 @@ bool SchedulerBase::CreateSignalChannel(int *outSigId, SignalCallback callback,
 
   pipeWrite.Detach();
   pipeRead.Detach();
+#endif
 
   *outSigId = item.fdWrite;
 
@@ -603,9 +1160,13 @@ bool SchedulerBase::CreateSignalChannel(int *outSigId, SignalCallback callback,
 
 bool SchedulerBase::Signal(int sigId)
 {
+#ifdef USE_EVENTFD_SIGNALS
+  uint64_t sig = 1;
+#else
   char sig = 'x';
+#endif
 
-  if (1 != ::write(sigId, &sig, 1))
+  if (sizeof(sig) != ::write(sigId, &sig, sizeof(sig)))
   {
     gLog.LogError("Failed to signal on pipe %d: %s", sigId, ErrnoToString());
     return false;
@@ -630,7 +1191,8 @@ void SchedulerBase::RemoveSignalChannel(int sigId)
       m_signals.erase(sig);
       unWatchSocket(readPipe);
       ::close(readPipe);
-      ::close(writePipe);
+      if (writePipe != readPipe)
+        ::close(writePipe);
       return;
     }
   }
@@ -647,8 +1209,64 @@ void SchedulerBase::RequestShutdown()
 
 Timer* SchedulerBase::MakeTimer(const char *name)
 {
+  return makeTimer(name, NULL, 0);
+}
+
+Timer* SchedulerBase::MakeTimer(const char *staticName, uint32_t id)
+{
+  return makeTimer(NULL, staticName, id);
+}
+
+Timer* SchedulerBase::MakeTimerAt(TimerStorage &storage, const char *staticName, uint32_t id)
+{
+  // Without a copied name, this can not throw.
+#ifdef USE_TIMER_HEAP
+  TimerImpl *timer = new (storage.data.bytes) TimerImpl(*this, m_activeTimers, NULL, staticName, id, true);
+#else
+  TimerImpl *timer = new (storage.data.bytes) TimerImpl(*this, &m_activeTimers, NULL, staticName, id, true);
+#endif
   m_timerCount++;
-  return new TimerImpl(*this, &m_activeTimers, name);
+  m_embeddedTimerCount++;
+  return timer;
+}
+
+void SchedulerBase::ReserveTimers(size_t count, size_t embeddedCount /*0*/)
+{
+  LogAssert(IsMainThread());
+  m_timerPool.Reserve(count);
+#ifdef USE_TIMER_HEAP
+  // Any of them may be at either priority.
+  m_activeTimers[Timer::Priority::Low].Reserve(count + embeddedCount);
+  m_activeTimers[Timer::Priority::Hi].Reserve(count + embeddedCount);
+#endif
+}
+
+/**
+ * Constructs a timer in m_timerPool. See TimerImpl::TimerImpl().
+ *
+ * @throw - std::bad_alloc
+ */
+Timer* SchedulerBase::makeTimer(const char *name, const char *staticName, uint32_t nameId)
+{
+  void *block = m_timerPool.Allocate();
+  TimerImpl *timer;
+
+  try
+  {
+#ifdef USE_TIMER_HEAP
+    timer = new (block) TimerImpl(*this, m_activeTimers, name, staticName, nameId, false);
+#else
+    timer = new (block) TimerImpl(*this, &m_activeTimers, name, staticName, nameId, false);
+#endif
+  }
+  catch (...)
+  {
+    m_timerPool.Free(block);
+    throw;
+  }
+
+  m_timerCount++;
+  return timer;
 }
 
 /**
@@ -661,13 +1279,19 @@ void SchedulerBase::FreeTimer(Timer *timer)
   if (timer)
   {
     TimerImpl *theTimer = static_cast<TimerImpl *>(timer);
+    bool embedded = theTimer->IsEmbedded();
 
     m_timerCount--;
-    delete theTimer;
+    theTimer->~TimerImpl();
+    if (embedded)
+      m_embeddedTimerCount--;
+    else
+      m_timerPool.Free(theTimer);
   }
 
 }
 
+#ifndef USE_TIMER_HEAP
 // Return true if lhs should be before rhs.
 bool SchedulerBase::compareTimers(const TimerImpl *lhs, const TimerImpl *rhs)
 {
@@ -710,3 +1334,4 @@ SchedulerBase::timer_set_it SchedulerBase::TimeSetFindExact(SchedulerBase::timer
   }
   return timerSet.end();
 }
+#endif  // !USE_TIMER_HEAP
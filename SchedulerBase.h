@@ -10,20 +10,84 @@
  */
 #pragma once
 
+#include "config.h"
 #include "Scheduler.h"
 #include "TimeSpec.h"
 #include "hash_map.h"
+#include "SlabPool.h"
 #include <set>
+#include <vector>
 
 struct timespec;
 
 class TimerImpl;
 
+#ifdef USE_TIMER_HEAP
+/**
+ * A 4-ary min heap of active timers, ordered by expire time.
+ *
+ * Each TimerImpl stores its own position in the heap, so removing, or changing
+ * the expire time of, an active timer needs no search and no allocation. Only
+ * Insert() may allocate, when the heap grows beyond its previous maximum.
+ *
+ * @note Use only from the main thread. See Scheduler::IsMainThread().
+ */
+class TimerHeap
+{
+public:
+  static const size_t NotInHeap = size_t(-1);
+
+  TimerHeap() { }
+
+  /**
+   * Adds a timer that is not already in the heap.
+   *
+   * @throw - May throw if the heap needs to grow.
+   */
+  void Insert(TimerImpl *timer);
+
+  /**
+   * Removes a timer. Ignored if the timer is not in the heap.
+   */
+  void Remove(TimerImpl *timer);
+
+  /**
+   * Call after the expire time of a timer that is in the heap has changed.
+   */
+  void Update(TimerImpl *timer);
+
+  /**
+   * @return TimerImpl* - The timer that expires first, or NULL if empty.
+   */
+  TimerImpl* Top() const { return m_items.empty() ? NULL : m_items.front();}
+
+  bool empty() const { return m_items.empty();}
+  size_t size() const { return m_items.size();}
+
+  /**
+   * Makes room for count timers, so that Insert() does not allocate until there
+   * are more than that.
+   *
+   * @throw - std::bad_alloc
+   */
+  void Reserve(size_t count) { m_items.reserve(count);}
+
+private:
+  void siftUp(size_t pos);
+  void siftDown(size_t pos);
+  void place(size_t pos, TimerImpl *timer);
+
+  std::vector<TimerImpl *> m_items;
+};
+#endif  // USE_TIMER_HEAP
+
 class SchedulerBase : public Scheduler
 {
 public:
+#ifndef USE_TIMER_HEAP
   typedef  std::multiset<TimerImpl *, bool (*)(const TimerImpl *, const TimerImpl *)> timer_set;
   typedef  timer_set::iterator timer_set_it;
+#endif
 
 public:
   virtual ~SchedulerBase();
@@ -33,15 +97,30 @@ public:
   virtual bool IsMainThread();
   virtual bool SetSocketCallback(int socket, Scheduler::SocketCallback callback, void *userdata);
   virtual void RemoveSocketCallback(int socket);
+  virtual bool HandlesDatagrams();
+  virtual bool SetDatagramCallback(int socket, size_t maxDataSize, size_t controlSize, DatagramCallback callback, void *userdata);
+  virtual bool QueueDatagram(int socket, const void *data, size_t dataLength, const struct sockaddr *address, socklen_t addressLength);
+  virtual void FlushDatagrams();
   virtual bool CreateSignalChannel(int *outSigId, SignalCallback callback, void *userdata);
   virtual bool Signal(int sigId);
   virtual void RemoveSignalChannel(int sigId);
   virtual void RequestShutdown();
   virtual Timer* MakeTimer(const char *name);
+  virtual Timer* MakeTimer(const char *staticName, uint32_t id);
+  virtual Timer* MakeTimerAt(TimerStorage &storage, const char *staticName, uint32_t id);
   virtual void FreeTimer(Timer *timer);
+  virtual void ReserveTimers(size_t count, size_t embeddedCount = 0);
+  virtual void GetStats(Scheduler::Stats &outStats);
+  virtual void ResetStats();
+  virtual bool SetClockSource(ClockSource::Value source);
+  virtual const TimeSpec& LoopTime();
+  virtual const TimeSpec& RefreshLoopTime();
+  virtual void SetBudget(const Budget &budget);
 
+#ifndef USE_TIMER_HEAP
   /** Other public functions */
   static timer_set_it TimeSetFindExact(timer_set &timerSet, TimerImpl *target);
+#endif
 
 
 protected:
@@ -75,6 +154,34 @@ protected:
    */
   virtual void unWatchSocket(int fd) = 0;
 
+  /**
+   * Called to add a datagram socket, which the scheduler receives on itself.
+   * Only for schedulers where HandlesDatagrams() is true. The socket is
+   * removed with unWatchSocket().
+   *
+   * @note Called only on main thread. See Scheduler::IsMainThread().
+   *
+   * @param fd
+   * @param maxDataSize [in] - See SetDatagramCallback().
+   * @param controlSize [in] - See SetDatagramCallback().
+   *
+   * @return bool - false on failure
+   */
+  virtual bool watchDatagramSocket(int fd, size_t maxDataSize, size_t controlSize);
+
+  /**
+   * For a socket added with watchDatagramSocket(), each socket returned by
+   * getNextSocketEvent() is a single received datagram. This is then called
+   * to pass that datagram to the callback.
+   *
+   * @note Called only on main thread. See Scheduler::IsMainThread().
+   *
+   * @param fd [in] - The socket just returned by getNextSocketEvent().
+   * @param callback [in]
+   * @param userdata [in]
+   */
+  virtual void deliverDatagram(int fd, Scheduler::DatagramCallback callback, void *userdata);
+
 
   /**
    * Called to wait for events.
@@ -101,10 +208,18 @@ protected:
   virtual int getNextSocketEvent() = 0;
 
 private:
+  static const size_t TimerSlabSize = 256; // Timers allocated at a time.
+  static const uint64_t ClockLagSampleInterval = 64; // Coarse clock reads per precise read, for Stats::clockLag.
 
+  Timer* makeTimer(const char *name, const char *staticName, uint32_t nameId);
   TimeSpec getNextTimerTimeout();
   bool expireTimer(Timer::Priority::Value minPri);
+  bool expireTimer(Timer::Priority::Value minPri, const TimeSpec &cutoff, Timer::Priority::Value *outPriority);
+  bool lowTimerExpired(const TimeSpec &now);
+  void recordTimerLateness(TimerImpl *timer, const TimeSpec &now);
+#ifndef USE_TIMER_HEAP
   static bool compareTimers(const TimerImpl *lhs, const TimerImpl *rhs);
+#endif
 
   pthread_t m_mainThread; // This is the thread under which Run was called.
                           //
@@ -116,7 +231,7 @@ private:
   {
     Scheduler::SignalCallback callback;
     void *userdata;
-    int fdWrite;  // write end of pipe  (also the signalId)
+    int fdWrite;  // write end of pipe  (also the signalId). Same as fdRead for an eventfd.
     int fdRead; // read end of pipe
   };
 
@@ -125,6 +240,7 @@ private:
   struct schedulerSocketItem
   {
     Scheduler::SocketCallback callback;
+    Scheduler::DatagramCallback datagramCallback; // Instead of callback, see SetDatagramCallback().
     void *userdata;
     int socket;
   };
@@ -135,6 +251,16 @@ private:
   SignalItemHashMap m_signals;
 
   bool m_wantsShutdown;
+#ifdef USE_TIMER_HEAP
+  TimerHeap m_activeTimers[2];  // One heap for each Timer::Priority::Value
+#else
   timer_set m_activeTimers;
+#endif
   int m_timerCount;   // only used for debugging
+  SlabPool m_timerPool; // Storage for the TimerImpl that are not embedded.
+  size_t m_embeddedTimerCount; // Made by MakeTimerAt().
+  Scheduler::Stats m_stats;
+  uint64_t m_lowStarvedCount; // Iterations the first expired low priority timer has waited.
+  clockid_t m_clockId; // For m_stats.clockSource.
+  TimeSpec m_loopTime;
 };
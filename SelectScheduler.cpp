@@ -4,7 +4,7 @@
 * Distributed under the FreeBSD License - see LICENSE
 ***************************************************************/
 #include "config.h"
-#ifndef USE_KEVENT_SCHEDULER
+#if !defined(USE_KEVENT_SCHEDULER) && !defined(USE_EPOLL_SCHEDULER)
 
 #include "common.h"
 #include "SelectScheduler.h"
@@ -133,4 +133,4 @@ void SelectScheduler::resizeFoundSockets()
   m_foundSockets.resize(m_watchSockets.size());
 }
 
-#endif  // !USE_KEVENT_SCHEDULER
+#endif  // !USE_KEVENT_SCHEDULER && !USE_EPOLL_SCHEDULER
@@ -5,14 +5,14 @@
 ***************************************************************/
 /**
 
-  Scheduler implementation for system with select, but without kevent..
+  Scheduler implementation for system with select, but without kevent or epoll.
 
  */
 #pragma once
 
 #include "config.h"
 
-#ifndef USE_KEVENT_SCHEDULER
+#if !defined(USE_KEVENT_SCHEDULER) && !defined(USE_EPOLL_SCHEDULER)
 
 #include "SchedulerBase.h"
 #include <vector>
@@ -51,4 +51,4 @@ private:
 };
 
 
-#endif  // !USE_KEVENT_SCHEDULER
+#endif  // !USE_KEVENT_SCHEDULER && !USE_EPOLL_SCHEDULER
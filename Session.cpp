@@ -8,6 +8,9 @@
 #include "utils.h"
 #include "Beacon.h"
 #include "Scheduler.h"
+#include "BfdPacketView.h"
+#include "BfdAuth.h"
+#include "StatusExport.h"
 #include <errno.h>
 #include <sys/socket.h>
 #include <string.h>
@@ -22,8 +25,8 @@ static int gDropFinalPercent = 60;
 static int gDropFinalPercent = 0;
 #endif
 
-static const size_t MaxUptimeCount = 4; // number of states to keep track of for logging.
 
+QuickLock Session::m_nextIdLock(true);
 uint32_t Session::m_nextId = 1;
 
 Session::InitialParams::InitialParams() :
@@ -31,20 +34,27 @@ Session::InitialParams::InitialParams() :
    desiredMinTx(bfd::BaseMinTxInterval),
    requiredMinRx(1000000),
    controlPlaneIndependent(false),
-   adminUpPollWorkaround(true)
+   adminUpPollWorkaround(true),
+   lowPriority(false),
+   echoInterval(0),
+   demandMode(false),
+   authKey(Beacon::NoAuthKey)
 {
 }
 
 // Note that the inclusion of the Beacon pointer is bad design and sheer
 // laziness. This should really be an event sink or callback.
-Session::Session(Scheduler &scheduler, Beacon *beacon, uint32_t descriminator, const InitialParams &params) :
+Session::Session(Scheduler &scheduler, Beacon *beacon, uint32_t descriminator, const InitialParams &params, uint32_t id) :
    m_beacon(beacon),
    m_scheduler(&scheduler),
    m_remoteAddr(),
    m_remoteSourcePort(0),
    m_localAddr(),
+   m_remoteKey(),
+   m_localKey(),
    m_sendPort(0),
    m_isActive(false),
+   m_sharedSendSocket(-1),
    m_sessionState(bfd::State::Down),
    m_remoteSessionState(bfd::State::Down),
    m_localDiscr(descriminator),
@@ -53,13 +63,16 @@ Session::Session(Scheduler &scheduler, Beacon *beacon, uint32_t descriminator, c
    m_desiredMinTxInterval(bfd::BaseMinTxInterval), // Since we start "down" this must be 1s see v10/6.8.3
    m_requiredMinRxInterval(params.requiredMinRx),
    m_remoteMinRxInterval(1),
-   m_demandMode(false),  // We get to choose this.
+   m_demandMode(params.demandMode),
    m_remoteDemandMode(false),
    m_detectMult(params.detectMulti),
    m_authType(bfd::AuthType::None), // ??
    m_rcvAuthSeq(0),
    m_xmitAuthSeq(rand() % UINT32_MAX),
    m_authSeqKnown(false),
+   m_authKey(NULL),
+   m_authKeyId(Beacon::NoAuthKey),
+   m_txSigned(false),
    m_pollState(PollState::None),
    m_pollReceived(false),
    m_remoteDetectMult(0),
@@ -72,31 +85,68 @@ Session::Session(Scheduler &scheduler, Beacon *beacon, uint32_t descriminator, c
    m_immediateControlPacket(false),
    m_controlPlaneIndependent(params.controlPlaneIndependent),
    m_adminUpPollWorkaround(params.adminUpPollWorkaround),
+   m_lowPriority(params.lowPriority),
+   m_profileId(0),
+   m_profileVersion(0),
+   m_backoffInterval(0),
+   m_backoffMinRx(0),
+   m_desiredMinEchoTxInterval(params.echoInterval),
+   m_remoteMinEchoRxInterval(0),
+   m_echoActive(false),
+   m_echoConfirmed(false),
+   m_echoUnanswered(false),
+   m_echoInterval(0),
+   m_echoSequence(0),
+   m_lastEchoTime(),
+   m_hasLastRxHeader(false),
+   m_engineSlot(TransmitEngine::NoSlot),
+   m_engineActive(false),
+   m_engineInterval(0),
    m_forcedState(false),
    m_wantsPollForNewDesiredMinTxInterval(false),
    _useDesiredMinTxInterval(bfd::BaseMinTxInterval),  // Since we start "down" this must be 1s see v10/6.8.3
    m_defaultDesiredMinTxInterval(params.desiredMinTx),  // this will not take effect until we are up ... see m_useDesiredMinTxInterva
    m_wantsPollForNewRequiredMinRxInterval(false),
    _useRequiredMinRxInterval(m_requiredMinRxInterval),
+   m_statusTable(NULL),
+   m_statusSlot(SessionStatusTable::NoSlot),
+   m_exportRecord(NULL),
    m_receiveTimeoutTimer(this),
-   m_transmitNextTimer(this)
+   m_transmitNextTimer(this),
+   m_echoTimer(this)
 {
   LogAssert(m_scheduler->IsMainThread());
 
-  if (m_nextId == 0)
+  m_authKey = m_beacon ? m_beacon->GetAuthKey(params.authKey) : NULL;
+  if (m_authKey)
   {
-    // This is unlikely, since we can handle 4 billion sessions.
-    gLog.LogError("Maximum session count exceeded, refusing new sessions.");
+    m_authKeyId = params.authKey;
+    m_authType = m_authKey->GetType();
+  }
+  buildTxPacket(m_txPacket);
+
+  {
+    // If an exception is thrown below, the id is simply skipped.
+    AutoQuickLock lock(m_nextIdLock);
+    if (id != 0)
+    {
+      // A restored session keeps its id, and new ones come after it.
+      m_id = id;
+      if (m_nextId != 0 && id >= m_nextId)
+        m_nextId = id + 1;
+    }
+    else if (m_nextId == 0)
+    {
+      // This is unlikely, since we can handle 4 billion sessions.
+      gLog.LogError("Maximum session count exceeded, refusing new sessions.");
+    }
+    else
+      m_id = m_nextId++;
   }
-  else
-    m_id = m_nextId;
 
-  // It may be more efficient to wait until we need these?
-  char name[32];
-  snprintf(name, sizeof(name), "<Rcv %u>", m_id);
-  m_receiveTimeoutTimer = m_scheduler->MakeTimer(name);
-  snprintf(name, sizeof(name), "<Tx %u>", m_id);
-  m_transmitNextTimer = m_scheduler->MakeTimer(name);
+  // These are made in place, so that expiring them stays within the session.
+  m_receiveTimeoutTimer = m_scheduler->MakeTimerAt(m_receiveTimerStorage, "Rcv", m_id);
+  m_transmitNextTimer = m_scheduler->MakeTimerAt(m_transmitTimerStorage, "Tx", m_id);
 
   m_receiveTimeoutTimer->SetCallback(handleReceiveTimeoutTimerCallback,  this);
   m_receiveTimeoutTimer->SetPriority(Timer::Priority::Low);
@@ -105,13 +155,41 @@ Session::Session(Scheduler &scheduler, Beacon *beacon, uint32_t descriminator, c
 
   logSessionTransition();
 
-  // Update this only at the end, in case an exception is thrown.
-  m_nextId++;
+  // Status is not published until the session is started.
+  m_status.Clear();
+  if (m_beacon && m_id != 0)
+  {
+    m_statusTable = m_beacon->GetStatusTable();
+    m_statusSlot = m_statusTable->Allocate();
+    m_exportRecord = m_beacon->AcquireExportRecord(m_statusSlot);
+  }
 }
 
 Session::~Session()
 {
   LogAssert(m_scheduler->IsMainThread());
+
+  if (m_statusTable)
+  {
+    m_statusTable->Free(m_statusSlot);
+    m_beacon->ReleaseExportRecord(m_exportRecord);
+  }
+  if (m_status.id != 0)
+    publishEvent(SessionEvent::Type::Removed, m_sessionState);
+
+  // The engine sends on its own copy of the socket, so it is safe to free the
+  // slot without waiting.
+  TransmitEngine *engine = m_beacon ? m_beacon->GetTransmitEngine() : NULL;
+  if (engine)
+    engine->FreeSlot(m_engineSlot);
+
+  // Do not leave packets queued for a socket that is about to close.
+  TransmitQueue *queue = m_beacon ? m_beacon->GetTransmitQueue() : NULL;
+  if (queue && !m_sendSocket.empty())
+    queue->Discard(m_sendSocket);
+
+  if (m_beacon && !m_sendSocket.empty())
+    m_beacon->GetPortAllocator()->Release(m_localAddr, m_sendPort);
 }
 
 
@@ -141,13 +219,16 @@ bool Session::StartPassiveSession(const SockAddr &remoteAddr, const IpAddr &loca
   m_remoteSourcePort = remoteAddr.Port();
 
   m_localAddr = localAddr;
+  m_remoteKey.Set(m_remoteAddr);
+  m_localKey.Set(m_localAddr);
   m_isActive = false;
+  publishStatus();
   return true;
 }
 
 
 
-bool Session::StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr)
+bool Session::StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr, uint32_t startDelayUs)
 {
   LogAssert(m_scheduler->IsMainThread());
 
@@ -164,13 +245,175 @@ bool Session::StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAd
   m_remoteSourcePort = 0;
 
   m_localAddr = localAddr;
+  m_remoteKey.Set(m_remoteAddr);
+  m_localKey.Set(m_localAddr);
   m_isActive = true;
 
   // Start the timers now, and begin sending connection packets.
   // We set m_immediateControlPacket because this is a new connection, and there
-  // is no point in waiting.
-  m_immediateControlPacket = true;
-  scheduleTransmit();
+  // is no point in waiting. When many sessions start together, the caller can
+  // delay the first packet instead, so that they do not all send at once.
+  if (startDelayUs == 0)
+  {
+    m_immediateControlPacket = true;
+    scheduleTransmit();
+  }
+  else
+    m_transmitNextTimer->SetMicroTimer(startDelayUs);
+  publishStatus();
+  return true;
+}
+
+uint64_t Session::SavedState::GetPeerDetectionTime() const
+{
+  // The peer uses our multiplier, and the slower of our transmit interval and
+  // its receive interval. See v10/6.8.4.
+  if (remoteMinRxInterval == 0)
+    return 0;
+  return detectMult * uint64_t(max(useDesiredMinTxInterval, remoteMinRxInterval));
+}
+
+void Session::GetSavedState(SavedState &outState)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  outState.remoteAddr = m_remoteKey;
+  outState.localAddr = m_localKey;
+  outState.id = m_id;
+  outState.localDiscr = m_localDiscr;
+  outState.remoteDiscr = m_remoteDiscr;
+  outState.desiredMinTxInterval = m_desiredMinTxInterval;
+  outState.useDesiredMinTxInterval = getUseDesiredMinTxInterval();
+  outState.defaultDesiredMinTxInterval = m_defaultDesiredMinTxInterval;
+  outState.requiredMinRxInterval = m_requiredMinRxInterval;
+  if (intervalFloor())
+  {
+    // A backoff, or an echo function, is not restored, so the restored session
+    // polls its way back to the configured intervals.
+    if (m_sessionState == bfd::State::Up)
+      outState.desiredMinTxInterval = m_defaultDesiredMinTxInterval;
+    outState.requiredMinRxInterval = m_backoffMinRx;
+  }
+  outState.useRequiredMinRxInterval = getUseRequiredMinRxInterval();
+  outState.remoteMinRxInterval = m_remoteMinRxInterval;
+  outState.remoteDesiredMinTxInterval = m_remoteDesiredMinTxInterval;
+  outState.remoteSourcePort = m_remoteSourcePort;
+  outState.sendPort = m_sendPort;
+  outState.state = uint8_t(m_sessionState);
+  outState.remoteState = uint8_t(m_remoteSessionState);
+  outState.localDiag = uint8_t(m_localDiag);
+  outState.remoteDiag = uint8_t(m_remoteDiag);
+  outState.detectMult = m_detectMult;
+  outState.remoteDetectMult = m_remoteDetectMult;
+  outState.flags = 0;
+  if (m_isActive)
+    outState.flags |= SavedFlags::Active;
+  if (m_controlPlaneIndependent)
+    outState.flags |= SavedFlags::ControlPlaneIndependent;
+  if (m_adminUpPollWorkaround)
+    outState.flags |= SavedFlags::AdminUpPollWorkaround;
+  if (m_isSuspended)
+    outState.flags |= SavedFlags::Suspended;
+  if (m_forcedState)
+    outState.flags |= SavedFlags::HoldingState;
+  if (m_lowPriority)
+    outState.flags |= SavedFlags::LowPriority;
+  if (m_demandMode)
+    outState.flags |= SavedFlags::DemandMode;
+  outState.authType = uint8_t(m_authType);
+}
+
+bool Session::Restore(const SavedState &state, bool peerTimedOut)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  // This should only be called once, on a new session.
+  if (!LogVerify(!m_remoteAddr.IsValid()))
+    return false;
+  if (!LogVerify(state.localDiscr == m_localDiscr && state.id == m_id))
+    return false;
+
+  IpAddr remoteAddr(state.remoteAddr.ToIpAddr());
+  IpAddr localAddr(state.localAddr.ToIpAddr());
+  if (!remoteAddr.IsValid() || !localAddr.IsValid() || localAddr.IsAny()
+      || state.detectMult == 0
+      || state.state > bfd::State::Up || state.remoteState > bfd::State::Up
+      || state.localDiag > bfd::Diag::MaxDiagnostic || state.remoteDiag > bfd::Diag::MaxDiagnostic)
+  {
+    gLog.LogError("Saved state for session id=%u is not valid.", m_id);
+    return false;
+  }
+  // Keys are not saved, so this would come back without authentication.
+  if (!LogVerify(state.authType == bfd::AuthType::None))
+    return false;
+
+  m_remoteAddr = remoteAddr;
+  m_localAddr = localAddr;
+  m_remoteKey = state.remoteAddr;
+  m_localKey = state.localAddr;
+  m_remoteSourcePort = state.remoteSourcePort;
+  // ensureSendSocket() asks for the same port again.
+  m_sendPort = state.sendPort;
+  m_isActive = (state.flags & SavedFlags::Active) != 0;
+  m_controlPlaneIndependent = (state.flags & SavedFlags::ControlPlaneIndependent) != 0;
+  m_adminUpPollWorkaround = (state.flags & SavedFlags::AdminUpPollWorkaround) != 0;
+  m_isSuspended = (state.flags & SavedFlags::Suspended) != 0;
+  m_forcedState = (state.flags & SavedFlags::HoldingState) != 0;
+  m_lowPriority = (state.flags & SavedFlags::LowPriority) != 0;
+  m_demandMode = (state.flags & SavedFlags::DemandMode) != 0;
+  m_detectMult = state.detectMult;
+  m_requiredMinRxInterval = state.requiredMinRxInterval;
+  m_defaultDesiredMinTxInterval = state.defaultDesiredMinTxInterval;
+
+  if (!peerTimedOut)
+  {
+    m_sessionState = bfd::State::Value(state.state);
+    m_remoteSessionState = bfd::State::Value(state.remoteState);
+    m_localDiag = bfd::Diag::Value(state.localDiag);
+    m_remoteDiag = bfd::Diag::Value(state.remoteDiag);
+    m_remoteDiscr = state.remoteDiscr;
+    m_desiredMinTxInterval = state.desiredMinTxInterval;
+    setUseDesiredMinTxInterval(state.useDesiredMinTxInterval);
+    setUseRequiredMinRxInterval(state.useRequiredMinRxInterval);
+    m_remoteMinRxInterval = state.remoteMinRxInterval;
+    m_remoteDesiredMinTxInterval = state.remoteDesiredMinTxInterval;
+    m_remoteDetectMult = state.remoteDetectMult;
+  }
+  else
+  {
+    // Start over, as a new session would. A held state is kept.
+    if (m_forcedState)
+    {
+      m_sessionState = bfd::State::Value(state.state);
+      m_localDiag = bfd::Diag::Value(state.localDiag);
+    }
+    setUseRequiredMinRxInterval(m_requiredMinRxInterval);
+  }
+
+  buildTxPacket(m_txPacket);
+  logSessionTransition();
+
+  // A poll may have been underway when the old process stopped. If the saved
+  // intervals were still waiting for one, then start a new one.
+  if (m_sessionState == bfd::State::Up
+      && (getUseDesiredMinTxInterval() != m_desiredMinTxInterval
+          || getUseRequiredMinRxInterval() != m_requiredMinRxInterval))
+    transitionPollState(PollState::Requested);
+
+  // The peer sends nothing in Demand mode, so check that it is still there.
+  if (isLocalDemandModeActive())
+    transitionPollState(PollState::Requested);
+
+  // Let the peer know that we are still here as soon as possible, and give it a
+  // full detection time to answer. A passive session that never heard from its
+  // peer waits for it, as before.
+  if (m_isActive || m_remoteDiscr != 0)
+  {
+    m_immediateControlPacket = true;
+    scheduleTransmit();
+  }
+  reScheduleReceiveTimeout();
+  publishStatus();
   return true;
 }
 
@@ -190,6 +433,7 @@ bool Session::UpgradeToActiveSession()
 
   // Start the timers now, and begin sending connection packets
   scheduleTransmit();
+  publishStatus();
   return true;
 }
 
@@ -216,81 +460,26 @@ bool Session::IsActiveSession()
 // static
 bool Session::InitialProcessControlPacket(const uint8_t *data, size_t dataLength, BfdPacket &outPacket)
 {
-  BfdPacketHeader &header = outPacket.header;
-
-  if (dataLength < bfd::BasePacketSize)
-  {
-    gLog.Optional(Log::Discard, "Discard packet: too small %zu", dataLength);
-    return false;
-  }
-
-  memcpy(&outPacket, data, min(dataLength, sizeof(outPacket)));
-
-  // the early stuff can be checked without worrying about byte order, since they
-  // are parsed as bytes.
-  if (header.GetVersion() != 0 && header.GetVersion() != 1)
-  {
-    gLog.Optional(Log::Discard, "Discard packet: bad version %hhu", header.GetVersion());
-    return false;
-  }
-
-  if (header.GetAuth())
-  {
-    if (header.length < bfd::BasePacketSize + bfd::AuthHeaderSize)
-    {
-      gLog.Optional(Log::Discard, "Discard packet: length too small to include auth %hhu", header.length);
-      return false;
-    }
-  }
-  else if (header.length < bfd::BasePacketSize)
-  {
-    gLog.Optional(Log::Discard, "Discard packet: length too small %hhu", header.length);
-    return false;
-  }
-  else if (header.length > dataLength)
-  {
-    gLog.Optional(Log::Discard, "Discard packet: length larger than data %hhu", header.length);
-    return false;
-  }
+  BfdPacketView view(data, dataLength);
 
-  if (header.detectMult == 0)
-  {
-    gLog.Optional(Log::Discard, "Discard packet: detectMult is 0.");
-    return false;
-  }
-
-  if (header.GetMultipoint())
-  {
-    gLog.Optional(Log::Discard, "Discard packet: Multipoint bit is set.");
-    return false;
-  }
-
-  // Can check for 0 without byte order concerns.
-  if (header.myDisc == 0)
-  {
-    gLog.Optional(Log::Discard, "Discard packet: Source Discriminator is 0.");
-    return false;
-  }
-
-  // Can check for 0 without byte order concerns.
-  if (header.yourDisc == 0 && header.GetState() != bfd::State::Down && header.GetState() != bfd::State::AdminDown)
-  {
-    gLog.Optional(Log::Discard, "Discard packet: No destination discriminator and state is %s.", bfd::StateName(header.GetState()));
+  if (!view.Validate())
     return false;
-  }
-
-  // Now we need to worry about byte order
-  header.myDisc               = ntohl(header.myDisc);
-  header.yourDisc             = ntohl(header.yourDisc);
-  header.txDesiredMinInt      = ntohl(header.txDesiredMinInt);
-  header.rxRequiredMinInt     = ntohl(header.rxRequiredMinInt);
-  header.rxRequiredMinEchoInt = ntohl(header.rxRequiredMinEchoInt);
-
-  // packet is good as far as we can tell without a session.
+  view.ToPacket(outPacket);
   return true;
 }
 
-bool Session::ProcessControlPacket(const BfdPacket &packet, in_port_t port)
+/**
+ * Counts a packet that the session discards, both for the session and the
+ * beacon.
+ */
+static inline void countDiscard(Beacon *beacon, Session::Counters &counters, Beacon::DiscardReason::Value reason)
+{
+  counters.discarded++;
+  if (beacon)
+    beacon->CountDiscard(reason);
+}
+
+bool Session::ProcessControlPacket(const BfdPacket &packet, in_port_t port, const TimeSpec &receiveTime)
 {
   // Assumes that the first few checks have been done.
   const BfdPacketHeader &header = packet.header;
@@ -301,12 +490,31 @@ bool Session::ProcessControlPacket(const BfdPacket &packet, in_port_t port)
 
   logPacketContents(packet, false, true, m_remoteAddr, port, m_localAddr, 0);
 
+  m_counters.received++;
+
+  // Sessions without authentication pay only for this test. Their packets with
+  // the A bit are discarded below.
+  uint32_t authSequence = 0;
+  if (m_authKey && !verifyAuth(packet, authSequence))
+    return false;
+
+  if (isSteadyStatePacket(header, port))
+  {
+    if (m_authKey)
+      acceptAuthSequence(authSequence);
+    if (m_beacon)
+      m_beacon->CountFastPathPacket();
+    scheduleReceiveTimeout(receiveTime);
+    return true;
+  }
+
   if (gDropFinalPercent != 0)
   {
     // For testing only
     if (header.GetFinal() && rand() % 100 < gDropFinalPercent)
     {
       gLog.Optional(Log::Discard, "Discard packet: TESTING final bit set.");
+      countDiscard(m_beacon, m_counters, Beacon::DiscardReason::Testing);
       return false;
     }
   }
@@ -315,56 +523,41 @@ bool Session::ProcessControlPacket(const BfdPacket &packet, in_port_t port)
   if (header.yourDisc != 0 && header.yourDisc != m_localDiscr)
   {
     gLog.Optional(Log::Discard, "Discard packet: Source Discriminator is does not match our discriminator.");
+    countDiscard(m_beacon, m_counters, Beacon::DiscardReason::UnknownDisc);
     return false;
   }
 
-  if (header.GetAuth())
+  // Packets for a session with authentication were checked by verifyAuth().
+  if (header.GetAuth() && !m_authKey)
   {
-    if (packet.auth.GetAuthType() == bfd::AuthType::None)
-    {
-      gLog.Optional(Log::Discard, "Discard packet: Auth bit set but type is None.");
-      return false;
-    }
-    // We need to do authentication
-    gLog.LogWarn("Authentication requested, but we do not handle it currently.");
-    gLog.Optional(Log::Discard, "Discard packet: Auth bit set and we do not handle it.");
+    gLog.Optional(Log::Discard, "Discard packet: Auth bit set, but session is not using authentication.");
+    countDiscard(m_beacon, m_counters, Beacon::DiscardReason::Authentication);
     return false;
   }
-  else
-  {
-    if (m_authType != bfd::AuthType::None)
-    {
-      gLog.Optional(Log::Discard, "Discard packet: Auth bit clear, but session is using authentication.");
-      return false;
-    }
-  }
-
-
-  if (header.GetDemand())
-  {
-    {
-      gLog.Optional(Log::Error, "Discard packet: We do not support demand mode for remote host.");
-      return false;
-    }
-  }
 
 
   //
   // looks like packet can not be discarded after this point
   //
 
+  // Only an accepted packet moves the replay window on.
+  if (m_authKey)
+    acceptAuthSequence(authSequence);
+
   m_remoteDesiredMinTxInterval = header.txDesiredMinInt;
   m_remoteDetectMult = header.detectMult;
-  m_remoteDiscr = header.myDisc;
+  if (m_remoteDiscr != header.myDisc)
+    setRemoteDiscr(header.myDisc);
+  bool remoteStateChanged = m_remoteSessionState != header.GetState();
+  bool echoChanged = remoteStateChanged || m_remoteMinEchoRxInterval != header.rxRequiredMinEchoInt;
   m_remoteSessionState = header.GetState();
   m_remoteDemandMode = header.GetDemand();
   m_remoteMinRxInterval = header.rxRequiredMinInt;
   m_remoteDiag = header.GetDiag();
-
-  if (header.rxRequiredMinEchoInt == 0)
-  {
-    // We do not handle echo anyway, but if we did, then we would stop.
-  }
+  // 0 stops our echo function. See v10/6.8.9
+  m_remoteMinEchoRxInterval = header.rxRequiredMinEchoInt;
+  if (echoChanged)
+    updateEcho();
 
   if (header.GetFinal())
   {
@@ -409,19 +602,14 @@ bool Session::ProcessControlPacket(const BfdPacket &packet, in_port_t port)
     }
   }
 
-  // TODO if we wanted to go into demand mode, this is where it would happen
+  // Our Demand bit depends on both states. v10/6.8.7
+  if (remoteStateChanged)
+    updateDemand();
 
-  if (isRemoteDemandModeActive())
-  {
-    // Cease periodic control packets.
-    LogVerifyFalse("We do not currently support demand mode");
-    m_transmitNextTimer->Stop();
-  }
-  else if (m_transmitNextTimer->IsStopped())
-  {
-    // Start the timer.
+  // The remote Demand mode stops periodic control packets, other than those of
+  // a poll sequence. v10/6.8.7
+  if (isRemoteDemandModeActive() || !isTransmitting())
     scheduleTransmit();
-  }
 
   if (header.GetPoll())
   {
@@ -455,11 +643,116 @@ bool Session::ProcessControlPacket(const BfdPacket &packet, in_port_t port)
   }
 
   // Packet received ... update Detection time timer
-  scheduleReceiveTimeout();
+  scheduleReceiveTimeout(receiveTime);
+
+  publishStatus();
+
+  m_lastRxHeader = header;
+  m_hasLastRxHeader = true;
+  return true;
+}
+
+/**
+ * Checks the authentication of a packet for a session that uses it. v10/6.7.3
+ * The sequence number that we expect is not moved on, see
+ * acceptAuthSequence(), since the packet may still be discarded.
+ *
+ * @param packet [in] - Host order packet.
+ * @param outSequence [out] - The packet's sequence number, if it passes.
+ *
+ * @return bool - false if the packet was discarded.
+ */
+bool Session::verifyAuth(const BfdPacket &packet, uint32_t &outSequence)
+{
+  const BfdPacketHeader &header = packet.header;
+
+  if (!header.GetAuth())
+  {
+    gLog.Optional(Log::Discard, "Discard packet: Auth bit clear, but session is using authentication.");
+    countDiscard(m_beacon, m_counters, Beacon::DiscardReason::Authentication);
+    return false;
+  }
+
+  // The digest covers the packet as it was sent.
+  BfdPacket wire = packet;
+  wire.header.myDisc = htonl(header.myDisc);
+  wire.header.yourDisc = htonl(header.yourDisc);
+  wire.header.txDesiredMinInt = htonl(header.txDesiredMinInt);
+  wire.header.rxRequiredMinInt = htonl(header.rxRequiredMinInt);
+  wire.header.rxRequiredMinEchoInt = htonl(header.rxRequiredMinEchoInt);
+
+  uint32_t sequence;
+  if (!m_authKey->Verify(wire, sequence))
+  {
+    gLog.Optional(Log::Discard, "Discard packet: Authentication does not match the session's key.");
+    countDiscard(m_beacon, m_counters, Beacon::DiscardReason::Authentication);
+    return false;
+  }
+
+  if (m_authSeqKnown)
+  {
+    // Measured from m_rcvAuthSeq, so that the window works across the wrap.
+    uint32_t ahead = sequence - m_rcvAuthSeq;
+    uint32_t minAhead = m_authKey->IsMeticulous() ? 1 : 0;
+    if (ahead < minAhead || ahead > 3 * uint32_t(header.detectMult))
+    {
+      gLog.Optional(Log::Discard, "Discard packet: Authentication sequence number %u is out of range.", sequence);
+      countDiscard(m_beacon, m_counters, Beacon::DiscardReason::Authentication);
+      return false;
+    }
+  }
 
+  outSequence = sequence;
   return true;
 }
 
+/**
+ * Gives m_txPacket a digest for its current header, if the session uses
+ * authentication. The Meticulous types take a new sequence number, and so a new
+ * digest, for every packet. Otherwise the digest is only worked out again when
+ * the header changes. v10/6.7.3
+ */
+void Session::signTxPacket()
+{
+  if (!m_authKey)
+    return;
+
+  if (m_authKey->IsMeticulous())
+    m_xmitAuthSeq++;
+  else if (m_txSigned && 0 == memcmp(&m_signedHeader, &m_txPacket.header, sizeof(m_signedHeader)))
+    return;
+
+  m_authKey->Sign(m_txPacket, m_xmitAuthSeq);
+  m_signedHeader = m_txPacket.header;
+  m_txSigned = true;
+}
+
+/**
+ * Checks whether processing the packet would change nothing but the detection
+ * timer. This is the case for an Up session that is not polling, or timing out,
+ * when the packet is the same as the last one, and has no poll or final bit. The
+ * full processing of such a packet sets every value to what it already is.
+ *
+ * @param header [in] - Host order header.
+ * @param port [in] - The source port.
+ */
+bool Session::isSteadyStatePacket(const BfdPacketHeader &header, in_port_t port)
+{
+  if (!m_hasLastRxHeader)
+    return false;
+
+  // Roughly in order of the most likely to differ.
+  return 0 == memcmp(&header, &m_lastRxHeader, sizeof(header))
+         && m_sessionState == bfd::State::Up
+         && m_pollState == PollState::None
+         && m_timeoutStatus == TimeoutStatus::None
+         && !header.GetPoll()
+         && !header.GetFinal()
+         && !m_immediateControlPacket
+         && port == m_remoteSourcePort
+         && isTransmitting();
+}
+
 /**
  * Gets the time between receiving remote control packets that should be
  * considered a "timeout".
@@ -476,23 +769,50 @@ uint64_t Session::getDetectionTimeout()
 }
 
 /**
- * Schedule the next received timeout based on the current settings.
+ * Restarts the detection time, after a packet is received.
+ *
+ * Packets usually arrive well before the detection time, and each one only
+ * pushes the deadline further out. So rather than moving the timer for every
+ * packet, the time is recorded, and the timer is left to expire. When it does,
+ * handleReceiveTimeoutTimer() checks the recorded time, and sets the timer again
+ * if the session has not really timed out. The timer is only moved here when the
+ * new deadline is sooner, which happens when the detection time shrinks.
+ *
+ * The detection time starts when the packet arrived, rather than when it was
+ * processed, so that a busy scheduler does not stretch it.
  *
+ * @param receiveTime [in] - Monotonic time that the packet arrived.
  */
-void  Session::scheduleReceiveTimeout()
+void  Session::scheduleReceiveTimeout(const TimeSpec &receiveTime)
 {
-  // Reset received timer (if any) using UpdateMicroTimer()
-  if (!LogVerify(!m_demandMode))
+  if (isLocalDemandModeActive())
   {
-    // We currently never set demand mode
+    // Only a poll sequence, which is answered by now if it is not Polling,
+    // runs the detection time. v10/6.8.4
+    if (m_pollState != PollState::Polling)
+      m_receiveTimeoutTimer->Stop();
     return;
   }
 
   uint64_t timeout = getDetectionTimeout();
   if (timeout == 0)
+  {
     m_receiveTimeoutTimer->Stop();
-  else
-    m_receiveTimeoutTimer->SetMicroTimer(timeout);
+    return;
+  }
+
+  TimeSpec now(TimeSpec::MonoNow());
+  TimeSpec arrival(receiveTime);
+  if (arrival.empty() || now < arrival)
+    arrival = now;
+  // Packets forwarded from another shard may be handled out of order.
+  if (arrival < m_lastReceiveTime)
+    arrival = m_lastReceiveTime;
+  m_lastReceiveTime = arrival;
+
+  if (m_receiveTimeoutTimer->IsStopped()
+      || arrival + TimeSpec(TimeSpec::Microsec, timeout) < m_receiveTimerDeadline)
+    armReceiveTimer(arrival, timeout, now);
 }
 
 /**
@@ -500,18 +820,64 @@ void  Session::scheduleReceiveTimeout()
  */
 void  Session::reScheduleReceiveTimeout()
 {
-  // Reset received timer (if any) using UpdateMicroTimer()
-  if (!LogVerify(!m_demandMode))
+  uint64_t timeout = getDetectionTimeout();
+  if (timeout == 0)
   {
-    // We currently never set demand mode
+    m_receiveTimeoutTimer->Stop();
     return;
   }
 
-  uint64_t timeout = getDetectionTimeout();
-  if (timeout == 0)
-    m_receiveTimeoutTimer->Stop();
+  TimeSpec now(TimeSpec::MonoNow());
+
+  if (isLocalDemandModeActive())
+  {
+    // The detection time runs from the start of a poll sequence. v10/6.8.4
+    if (m_pollState != PollState::Polling)
+      m_receiveTimeoutTimer->Stop();
+    else if (m_receiveTimeoutTimer->IsStopped())
+      armReceiveTimer(now, timeout, now);
+    else
+      armReceiveTimer(m_receiveTimerStart, timeout, now);
+    return;
+  }
+
+  if (m_receiveTimeoutTimer->IsStopped())
+  {
+    m_lastReceiveTime = now;
+    armReceiveTimer(now, timeout, now);
+  }
+  else if (m_timeoutStatus == TimeoutStatus::None)
+  {
+    // A longer detection time is handled when the timer expires.
+    if (m_lastReceiveTime + TimeSpec(TimeSpec::Microsec, timeout) < m_receiveTimerDeadline)
+      armReceiveTimer(m_lastReceiveTime, timeout, now);
+  }
   else
-    m_receiveTimeoutTimer->UpdateMicroTimer(timeout);
+  {
+    // While timed out, the timer is not measuring a detection time, so it
+    // changes relative to the time it was set.
+    armReceiveTimer(m_receiveTimerStart, timeout, now);
+  }
+}
+
+/**
+ * Sets m_receiveTimeoutTimer to expire micro microseconds after start, and
+ * records the deadline.
+ *
+ * @param start [in] - Start of the timed period. Not after now.
+ * @param micro [in] - Length of the period.
+ * @param now [in] - The current time.
+ */
+void Session::armReceiveTimer(const TimeSpec &start, uint64_t micro, const TimeSpec &now)
+{
+  TimeSpec deadline = start + TimeSpec(TimeSpec::Microsec, micro);
+
+  m_receiveTimerStart = start;
+  m_receiveTimerDeadline = deadline;
+  if (deadline <= now)
+    m_receiveTimeoutTimer->SetMicroTimer(0);
+  else
+    m_receiveTimeoutTimer->SetMicroTimer(uint64_t((deadline - now).ToNanoseconds() / TimeSpec::NSecPerUs));
 }
 
 
@@ -521,6 +887,38 @@ bool Session::isRemoteDemandModeActive()
   return (m_remoteDemandMode && m_sessionState == bfd::State::Up && m_remoteSessionState == bfd::State::Up);
 }
 
+/**
+ * Is our Demand bit set. The remote system should then not be sending periodic
+ * packets. v10/6.8.7
+ */
+bool Session::isLocalDemandModeActive()
+{
+  return (m_demandMode && m_sessionState == bfd::State::Up && m_remoteSessionState == bfd::State::Up);
+}
+
+/**
+ * Updates the Demand bit in our packets, and the detection timer, when anything
+ * that they depend on changes. See SetDemandMode().
+ */
+void Session::updateDemand()
+{
+  bool active = isLocalDemandModeActive();
+
+  if (active == m_txPacket.header.GetDemand())
+    return;
+
+  gLog.Optional(Log::Session, "(id=%u) Demand mode %s.", m_id, active ? "started" : "stopped");
+  m_txPacket.header.SetDemand(active);
+  refreshTransmitEngine();
+
+  // The remote system may not be sending periodic packets, so a poll makes sure
+  // that it learns of the change. It also verifies the session on the way into
+  // Demand mode.
+  if (m_sessionState == bfd::State::Up)
+    transitionPollState(PollState::Requested, true);
+  reScheduleReceiveTimeout();
+}
+
 /**
  * Use this to change m_sessionState. Handles the timing of control packets.
  *
@@ -543,26 +941,38 @@ bool Session::isRemoteDemandModeActive()
  */
 void Session::setSessionState(bfd::State::Value newState, bfd::Diag::Value diag, SetValueFlags::Flag flags /*SetValueFlags::None*/)
 {
+  bfd::State::Value oldState = m_sessionState;
+
   if (m_forcedState)
   {
     LogOptional(Log::SessionDetail, "(id=%u) Session held at %s no transition to %s", m_id, bfd::StateName(m_sessionState),  bfd::StateName(newState));
     return;
   }
 
-  m_localDiag = diag;
+  setLocalDiag(diag);
 
   if (m_sessionState != newState)
   {
     LogOptional(Log::Session, "(id=%u) Session transition from %s to %s", m_id, bfd::StateName(m_sessionState),  bfd::StateName(newState));
     m_sessionState = newState;
+    m_txPacket.header.SetState(newState);
+    refreshTransmitEngine();
+
+    m_counters.stateChanges++;
+    if (m_beacon)
+      m_beacon->CountStateChange();
 
     logSessionTransition();
 
+    // Echo packets are only sent while Up. v10/6.8.9
+    updateEcho();
+    updateDemand();
+
     if (newState == bfd::State::Up)
     {
       // Since we are up, we can change to our real DesiredMinTxInterval
-      if (m_desiredMinTxInterval != m_defaultDesiredMinTxInterval)
-        setDesiredMinTxInterval(m_defaultDesiredMinTxInterval, (flags & SetValueFlags::PreventTxReschedule));
+      if (m_desiredMinTxInterval != backedOffMinTx(m_defaultDesiredMinTxInterval))
+        setDesiredMinTxInterval(backedOffMinTx(m_defaultDesiredMinTxInterval), (flags & SetValueFlags::PreventTxReschedule));
     }
     else
     {
@@ -590,6 +1000,10 @@ void Session::setSessionState(bfd::State::Value newState, bfd::Diag::Value diag,
     if ((flags & SetValueFlags::PreventTxReschedule) != SetValueFlags::PreventTxReschedule)
       scheduleTransmit(); // schedule immediate transmit.
   }
+
+  if (oldState != m_sessionState)
+    publishEvent(SessionEvent::Type::State, oldState);
+  publishStatus();
 }
 
 /**
@@ -599,7 +1013,8 @@ void Session::setSessionState(bfd::State::Value newState, bfd::Diag::Value diag,
 void Session::logSessionTransition()
 {
   UptimeInfo *last = NULL;
-  TimeSpec now(TimeSpec::MonoNow());
+  // Only shown to users, so the loop time is close enough.
+  TimeSpec now(m_scheduler->LoopTime());
 
   // We only log state change when we are fully up.
   // The state machine does not allow up->init transition, so we must have been
@@ -641,18 +1056,137 @@ void Session::logSessionTransition()
   uptime.startTime = now;
   uptime.forced = false;  // currently not using this.
 
-  try
+  m_uptimeList.push_front(uptime);
+}
+
+/**
+ * Publishes the current status to m_statusTable, if it has changed. This is
+ * cheap when nothing has changed, so it is called after anything that might
+ * change the status.
+ */
+void Session::publishStatus()
+{
+  if (!m_remoteAddr.IsValid())
+    return;
+
+  SessionStatus status;
+  fillStatus(status);
+
+  if (0 == memcmp(&status, &m_status, sizeof(status)))
+    return;
+
+  bool parametersChanged = (m_status.id != 0
+                            && (status.transmitInterval != m_status.transmitInterval
+                                || status.detectionTime != m_status.detectionTime));
+
+  m_status = status;
+  if (m_statusSlot != SessionStatusTable::NoSlot)
+    m_statusTable->Write(m_statusSlot, status);
+  ExportStatus();
+  if (parametersChanged)
+    publishEvent(SessionEvent::Type::Parameters, m_sessionState);
+}
+
+void Session::fillStatus(SessionStatus &outStatus)
+{
+  outStatus.Clear();
+  outStatus.id = m_id;
+  outStatus.localDisc = m_localDiscr;
+  outStatus.remoteDisc = m_remoteDiscr;
+  outStatus.SetRemoteAddress(m_remoteAddr);
+  outStatus.SetLocalAddress(m_localAddr);
+  outStatus.isActiveSession = m_isActive;
+  outStatus.isHoldingState = m_forcedState;
+  outStatus.isSuspended = m_isSuspended;
+  outStatus.localState = m_sessionState;
+  outStatus.localDiag = m_localDiag;
+  outStatus.remoteState = m_remoteSessionState;
+  outStatus.remoteDiag = m_remoteDiag;
+  outStatus.transmitInterval = getBaseTransmitTime();
+  outStatus.detectionTime = getDetectionTimeout();
+  if (!m_uptimeList.empty())
   {
-    m_uptimeList.push_front(uptime);
+    const UptimeInfo &uptime = m_uptimeList.front();
+    outStatus.hasUptime = true;
+    outStatus.uptimeState = uptime.state;
+    outStatus.uptimeForced = uptime.forced;
+    outStatus.uptimeStart = uptime.startTime;
   }
-  catch  (std::exception)
+}
+
+static uint8_t copyExportAddress(uint8_t *outAddr, const SessionStatus::Address &addr)
+{
+  if (addr.sa.sa_family == AF_INET6)
   {
-    // TODO - could mark the whole thing as "invalid"?
-    m_uptimeList.clear();
+    memcpy(outAddr, &addr.in6.sin6_addr, 16);
+    return 6;
   }
+  memcpy(outAddr, &addr.in4.sin_addr, 4);
+  return 4;
+}
 
-  if (m_uptimeList.size() > MaxUptimeCount)
-    m_uptimeList.pop_back();
+void Session::ExportStatus()
+{
+  // Nothing is exported until the status is first published.
+  if (!m_exportRecord || m_status.id == 0)
+    return;
+
+  StatusExportRecord record;
+  memset(&record, 0, sizeof(record));
+  record.id = m_status.id;
+  record.localDisc = m_status.localDisc;
+  record.remoteDisc = m_status.remoteDisc;
+  record.localFamily = copyExportAddress(record.localAddr, m_status.localAddress);
+  record.remoteFamily = copyExportAddress(record.remoteAddr, m_status.remoteAddress);
+  record.localState = uint8_t(m_status.localState);
+  record.localDiag = uint8_t(m_status.localDiag);
+  record.remoteState = uint8_t(m_status.remoteState);
+  record.remoteDiag = uint8_t(m_status.remoteDiag);
+  if (m_status.isActiveSession)
+    record.flags |= StatusExportRecord::Flag::Active;
+  if (m_status.isHoldingState)
+    record.flags |= StatusExportRecord::Flag::HoldingState;
+  if (m_status.isSuspended)
+    record.flags |= StatusExportRecord::Flag::Suspended;
+  if (m_status.hasUptime)
+  {
+    record.flags |= StatusExportRecord::Flag::HasUptime;
+    record.lastChange = uint64_t(TimeSpec(m_status.uptimeStart).ToNanoseconds());
+  }
+  if (m_status.uptimeForced)
+    record.flags |= StatusExportRecord::Flag::UptimeForced;
+  record.transmitInterval = m_status.transmitInterval;
+  record.detectionTime = m_status.detectionTime;
+  record.updateTime = uint64_t(m_scheduler->LoopTime().ToNanoseconds());
+  Counters counters;
+  GetCounters(counters);
+  record.received = counters.received;
+  record.sent = counters.sent;
+  record.discarded = counters.discarded;
+  record.stateChanges = counters.stateChanges;
+  record.pollSequences = counters.pollSequences;
+  StatusExport::Write(*m_exportRecord, record);
+}
+
+/**
+ * Passes a change to any subscribers. See SessionEventHub.
+ */
+void Session::publishEvent(SessionEvent::Type::Value type, bfd::State::Value oldState)
+{
+  SessionEventHub *hub = m_beacon ? m_beacon->GetEventHub() : NULL;
+
+  if (!hub || !hub->HasSubscribers(type) || !m_remoteAddr.IsValid())
+    return;
+
+  SessionEvent event;
+  event.type = type;
+  event.oldState = oldState;
+  event.time = TimeSpec::RealNow();
+  if (type == SessionEvent::Type::Removed)
+    event.status = m_status;
+  else
+    fillStatus(event.status);
+  hub->Publish(event);
 }
 
 
@@ -711,6 +1245,7 @@ bool Session::transitionPollState(PollState::Value nextState, bool allowAmbiguou
       // If we are not transmitting (perhaps m_remoteMinRxInterval == 0) then we need
       // to now to make polling happen. Note that this will still wait until the
       // "next" transmit, even though that might not be required in all cases.
+      // The transmit engine can not poll, so it must also hand transmits back.
       if (m_transmitNextTimer->IsStopped())
         scheduleTransmit();
 
@@ -730,6 +1265,12 @@ bool Session::transitionPollState(PollState::Value nextState, bool allowAmbiguou
     if (m_pollState == PollState::Requested || m_pollState == PollState::None)
     {
       m_pollState = PollState::Polling;
+      m_counters.pollSequences++;
+      if (m_beacon)
+        m_beacon->CountPollSequence();
+      // In Demand mode the remote system must answer within the detection time.
+      if (isLocalDemandModeActive())
+        reScheduleReceiveTimeout();
       return true;
     }
     return false;
@@ -757,7 +1298,7 @@ bool Session::transitionPollState(PollState::Value nextState, bool allowAmbiguou
       }
 
       // If we are only sending packets as part of a poll then we can stop now.
-      if (!m_transmitNextTimer->IsStopped() && getBaseTransmitTime() == 0)
+      if (isTransmitting() && getBaseTransmitTime() == 0)
         scheduleTransmit();
 
       return true;
@@ -785,6 +1326,7 @@ void Session::scheduleTransmit()
   if (m_immediateControlPacket)
   {
     // On certain changes we need to send an immediate packet
+    takeBackTransmit();
     m_transmitNextTimer->SetMicroTimer(0);
     return;
   }
@@ -792,7 +1334,7 @@ void Session::scheduleTransmit()
 
   if (!m_isActive && m_remoteDiscr == 0)
   {
-    m_transmitNextTimer->Stop();
+    stopTransmit();
     return; // Passive session.
   }
 
@@ -805,7 +1347,7 @@ void Session::scheduleTransmit()
     // If we are not polling, then no packets get sent.
     if (!sendPoll)
     {
-      m_transmitNextTimer->Stop();
+      stopTransmit();
       return;
     }
     else
@@ -819,17 +1361,146 @@ void Session::scheduleTransmit()
     }
   }
 
-  // Apply jitter
-  transmitInterval = uint64_t(transmitInterval * (0.75 + 0.25 * double(rand()) / RAND_MAX));
+  // Apply jitter
+  transmitInterval = uint64_t(transmitInterval * (0.75 + 0.25 * double(rand()) / RAND_MAX));
+
+  // Limits on jitter
+  if (m_detectMult == 1)
+  {
+    if (transmitInterval > uint64_t(0.90 * transmitInterval))
+      transmitInterval = uint64_t(0.90 * transmitInterval);
+  }
+
+  if (canUseTransmitEngine() && handOffTransmit(getBaseTransmitTime(), transmitInterval))
+  {
+    m_transmitNextTimer->Stop();
+    return;
+  }
+
+  if (m_engineActive)
+  {
+    // We do not know when the engine last sent, so send now, rather than risk a
+    // gap of nearly two intervals.
+    takeBackTransmit();
+    m_transmitNextTimer->SetMicroTimer(0);
+    return;
+  }
+
+  m_transmitNextTimer->UpdateMicroTimer(transmitInterval);
+}
+
+/**
+ * @return bool - Is either the transmit timer, or the transmit engine, sending
+ *         periodic packets.
+ */
+bool Session::isTransmitting()
+{
+  return m_engineActive || !m_transmitNextTimer->IsStopped();
+}
+
+/**
+ * Can the transmit engine send our packets. It only sends the same packet at a
+ * fixed interval, so anything that needs a poll or final, or a change in
+ * timing, must be sent by the session.
+ */
+bool Session::canUseTransmitEngine()
+{
+  return m_beacon && m_beacon->GetTransmitEngine()
+         && !m_immediateControlPacket
+         && !m_pollReceived
+         && (m_pollState == PollState::None || m_pollState == PollState::Completed)
+         && !m_isSuspended
+         && m_timeoutStatus != TimeoutStatus::TxSuspeded
+         && (!m_authKey || !m_authKey->IsMeticulous())
+         && getBaseTransmitTime() != 0;
+}
+
+/**
+ * Has the transmit engine send our periodic packets, or updates the packet it
+ * is sending.
+ *
+ * @param interval [in] - The base interval, before jitter.
+ * @param firstDelay [in] - Time until the next packet, with jitter. Only used if
+ *                   the engine was not already sending at this interval.
+ *
+ * @return bool - false if the engine can not be used.
+ */
+bool Session::handOffTransmit(uint32_t interval, uint64_t firstDelay)
+{
+  TransmitEngine *engine = m_beacon ? m_beacon->GetTransmitEngine() : NULL;
+  if (!engine)
+    return false;
+
+  if (m_engineSlot == TransmitEngine::NoSlot)
+  {
+    m_engineSlot = engine->AllocateSlot();
+    if (m_engineSlot == TransmitEngine::NoSlot)
+      return false;
+  }
+
+  if (!ensureSendSocket())
+    return false;
 
-  // Limits on jitter
-  if (m_detectMult == 1)
+  BfdPacket image = m_txPacket;
+  image.header.SetPoll(false);
+  image.header.SetFinal(false);
+
+  if (m_engineActive && interval == m_engineInterval
+      && 0 == memcmp(&image.header, &m_engineImage, sizeof(m_engineImage)))
+    return true;
+
+  // Only the keyed types get here, so the sequence number does not change.
+  if (m_authKey)
+    m_authKey->Sign(image, m_xmitAuthSeq);
+
+  int sendSocket = (m_sharedSendSocket != -1) ? m_sharedSendSocket : int(m_sendSocket);
+  if (!engine->Update(m_engineSlot, sendSocket, &image, image.header.length, SockAddr(m_remoteAddr, bfd::ListenPort),
+                      interval, m_detectMult, firstDelay))
   {
-    if (transmitInterval > uint64_t(0.90 * transmitInterval))
-      transmitInterval = uint64_t(0.90 * transmitInterval);
+    m_engineActive = false;
+    return false;
   }
 
-  m_transmitNextTimer->UpdateMicroTimer(transmitInterval);
+  gLog.Optional(Log::Packet, "Transmit engine sending for session %u every %u us.", m_id, interval);
+  m_engineActive = true;
+  m_engineInterval = interval;
+  m_engineImage = image.header;
+  return true;
+}
+
+/**
+ * Stops the transmit engine sending our packets. Does not change the transmit
+ * timer.
+ */
+void Session::takeBackTransmit()
+{
+  if (!m_engineActive)
+    return;
+
+  TransmitEngine *engine = m_beacon ? m_beacon->GetTransmitEngine() : NULL;
+  if (engine)
+    engine->Pause(m_engineSlot);
+  m_engineActive = false;
+}
+
+/**
+ * Call when m_txPacket changes, so that the transmit engine, if it is sending,
+ * sends the new packet. The engine's packet is only signed again when its
+ * header changes.
+ */
+void Session::refreshTransmitEngine()
+{
+  if (m_engineActive)
+    handOffTransmit(m_engineInterval, m_engineInterval);
+}
+
+/**
+ * Stops sending periodic packets.
+ */
+void Session::stopTransmit()
+{
+  takeBackTransmit();
+  m_transmitNextTimer->Stop();
 }
 
 /**
@@ -846,7 +1517,6 @@ uint32_t Session::getBaseTransmitTime()
   if (m_remoteMinRxInterval == 0)
     return 0; // no periodic
 
-  // Note, we do not handle this anyway.
   if (isRemoteDemandModeActive())
     return 0; // no periodic
 
@@ -855,38 +1525,73 @@ uint32_t Session::getBaseTransmitTime()
 
 
 /**
- * Sends a control packet. Does not update timers.
- * @note Must be called from main thread.
+ * Fills outPacket with a control packet, in network order, for the current
+ * state. Poll and final are not set.
  *
+ * @param outPacket [out] - The packet.
  */
-void Session::sendControlPacket()
+void Session::buildTxPacket(BfdPacket &outPacket)
 {
-  bool poll;
-
-  poll = (!m_pollReceived && (m_pollState == PollState::Requested || m_pollState == PollState::Polling));
-
-  BfdPacket packet = BfdPacket();
-  BfdPacketHeader &header = packet.header;
+  outPacket = BfdPacket();
+  BfdPacketHeader &header = outPacket.header;
 
   header.SetVersion(bfd::Version);
-  header.length = sizeof(header);
+  // The auth section is filled in as each packet is sent, see signTxPacket().
+  header.length = m_authKey ? m_authKey->GetPacketLength() : sizeof(header);
 
   header.SetDiag(m_localDiag);
   header.SetState(m_sessionState);
-  header.SetPoll(poll);
-  header.SetFinal(m_pollReceived);
   header.SetControlPlaneIndependent(m_controlPlaneIndependent);
+  header.SetDemand(isLocalDemandModeActive());
   // The next few are always false, so we could skip setting them. Included for
   // completeness.
-  header.SetAuth(false);  // never for now.
-  header.SetDemand(false);  // never for now.
-  header.SetMultipoint(false),  // never
-     header.detectMult = m_detectMult;
+  header.SetAuth(m_authKey != NULL);
+  header.SetMultipoint(false);  // never
+  header.detectMult = m_detectMult;
   header.myDisc = htonl(m_localDiscr);
   header.yourDisc = htonl(m_remoteDiscr);
   header.txDesiredMinInt = htonl(m_desiredMinTxInterval);
   header.rxRequiredMinInt = htonl(m_requiredMinRxInterval);
-  header.rxRequiredMinEchoInt = htonl(0);  // no echo allowed for this system.
+  header.rxRequiredMinEchoInt = htonl(m_beacon ? m_beacon->GetEchoReceiveInterval() : 0);  // 0 for no echo.
+}
+
+void Session::setLocalDiag(bfd::Diag::Value diag)
+{
+  m_localDiag = diag;
+  m_txPacket.header.SetDiag(diag);
+  refreshTransmitEngine();
+}
+
+void Session::setRemoteDiscr(uint32_t disc)
+{
+  m_remoteDiscr = disc;
+  m_txPacket.header.yourDisc = htonl(disc);
+  refreshTransmitEngine();
+}
+
+/**
+ * Sends a control packet. Does not update timers.
+ * @note Must be called from main thread.
+ *
+ */
+void Session::sendControlPacket()
+{
+  bool poll;
+
+  poll = (!m_pollReceived && (m_pollState == PollState::Requested || m_pollState == PollState::Polling));
+
+  m_txPacket.header.SetPoll(poll);
+  m_txPacket.header.SetFinal(m_pollReceived);
+
+#ifdef BFD_DEBUG
+  {
+    BfdPacket check;
+    buildTxPacket(check);
+    check.header.SetPoll(poll);
+    check.header.SetFinal(m_pollReceived);
+    LogAssert(0 == memcmp(&check.header, &m_txPacket.header, sizeof(check.header)));
+  }
+#endif
 
   // Since we will have tried to send a poll response, we are done unless we get another.
   m_pollReceived = false;
@@ -894,11 +1599,10 @@ void Session::sendControlPacket()
   // Since we are attempting to send the packet, we have fulfilled m_immediateControlPacket
   m_immediateControlPacket = false;
 
-  if (!ensureSendSocket())
+  signTxPacket();
+  if (!send(m_txPacket))
     return;
 
-  send(packet);
-
   if (poll)
     transitionPollState(PollState::Polling);
 }
@@ -909,24 +1613,43 @@ void Session::sendControlPacket()
  * @note Must be called from main thread.
  *
  * @param packet
+ *
+ * @return bool - false if there is no send socket. A packet that is not sent
+ *         because the session is suspended, or that fails to send, still
+ *         returns true.
  */
-void Session::send(const BfdPacket &packet)
+bool Session::send(const BfdPacket &packet)
 {
   if (!ensureSendSocket())
-    return;
+    return false;
 
   if (m_isSuspended)
   {
     gLog.Optional(Log::Packet, "Not sending packet for suspended session %u.", m_id);
-    return;
+    return true;
   }
 
   logPacketContents(packet, true, false, m_remoteAddr, 0, m_localAddr, m_sendPort);
 
-  if (m_sendSocket.SendTo(&packet, packet.header.length,
-                          SockAddr(m_remoteAddr, bfd::ListenPort),
-                          MSG_NOSIGNAL))
+  TransmitQueue *queue = m_beacon ? m_beacon->GetTransmitQueue() : NULL;
+  if (queue)
+  {
+    int sendSocket = (m_sharedSendSocket != -1) ? m_sharedSendSocket : int(m_sendSocket);
+    if (!queue->Queue(sendSocket, &packet, packet.header.length, SockAddr(m_remoteAddr, bfd::ListenPort)))
+      return true;
+    gLog.Optional(Log::Packet, "Queued control packet for session %u.", m_id);
+  }
+  else if (m_sendSocket.SendTo(&packet, packet.header.length,
+                               SockAddr(m_remoteAddr, bfd::ListenPort),
+                               MSG_NOSIGNAL))
     gLog.Optional(Log::Packet, "Sent control packet for session %u.", m_id);
+  else
+    return true;
+
+  m_counters.sent++;
+  if (m_beacon)
+    m_beacon->CountSent();
+  return true;
 }
 
 /**
@@ -937,11 +1660,10 @@ void Session::send(const BfdPacket &packet)
  */
 bool Session::ensureSendSocket()
 {
-  uint16_t startPort;
   Socket sendSocket;
   SockAddr sendAddr;
 
-  if (!m_sendSocket.empty())
+  if (!m_sendSocket.empty() || m_sharedSendSocket != -1)
     return true;
 
   m_sendSocket.SetExpectedVerbosity(Log::Warn);
@@ -951,6 +1673,13 @@ bool Session::ensureSendSocket()
   if (!LogVerify(!m_localAddr.IsAny()))
     return false;
 
+  TransmitQueue *queue = m_beacon ? m_beacon->GetTransmitQueue() : NULL;
+  if (queue && queue->UseSharedSockets())
+  {
+    m_sharedSendSocket = queue->GetSharedSocket(m_localAddr, m_sendPort);
+    return m_sharedSendSocket != -1;
+  }
+
   char tmp[255];
   sendSocket.SetLogName(FormatStr(tmp, sizeof(tmp), "Session %d sock", m_id));
 
@@ -961,45 +1690,13 @@ bool Session::ensureSendSocket()
   if (!sendSocket.SetTTLOrHops(bfd::TTLValue))
     return false;
 
-  /* Find an available port in the proper range */
-  if (m_sendPort != 0)
-    startPort = m_sendPort;
-  else
-    startPort = bfd::MinSourcePort + rand() % (bfd::MaxSourcePort - bfd::MinSourcePort);
-
-  sendAddr = SockAddr(m_localAddr, startPort);
-
-  // We need the socket to be quiet so we do not get warnings for each port tried.
-  RaiiObjCallVar<bool, Socket, bool, &Socket::SetQuiet> m_socketQuiet(&sendSocket);
-  m_socketQuiet = sendSocket.SetQuiet(true);
-
-  while (!sendSocket.Bind(sendAddr))
-  {
-    switch (sendSocket.GetLastError())
-    {
-    default:
-      gLog.LogError("Unable to open socket for session %" PRIu32 " %s : (%d) %s",
-                    m_id, sendAddr.ToString(false),
-                    sendSocket.GetLastError(), SystemErrorToString(sendSocket.GetLastError()));
-      return false;
-      break;
-    case EAGAIN:
-    case EADDRINUSE:
-      // Fall through and keep looking
-      break;
-    }
-    if (sendAddr.Port() == bfd::MaxSourcePort)
-      sendAddr.SetPort(bfd::MinSourcePort);
-    else
-      sendAddr.SetPort(sendAddr.Port() + 1);
-
-    if (sendAddr.Port() == startPort)
-    {
-      gLog.LogError("Cant find valid send port.");
-      return false;
-    }
-  }
-  m_socketQuiet.Dispose(); // Allow log messages again
+  // Find an available port in the proper range.
+  if (!LogVerify(m_beacon))
+    return false;
+  in_port_t port = m_beacon->GetPortAllocator()->Bind(sendSocket, m_localAddr, m_sendPort);
+  if (port == 0)
+    return false;
+  sendAddr = SockAddr(m_localAddr, port);
 
   if (m_sendPort != 0 && sendAddr.Port() != m_sendPort)
   {
@@ -1025,17 +1722,34 @@ bool Session::ensureSendSocket()
  */
 void Session::handleReceiveTimeoutTimer(Timer *ATTR_UNUSED(timer))
 {
-  // We have timed out.
+  TimeSpec now(TimeSpec::MonoNow());
 
   // Check that we are still using timeouts.
   if (!LogVerify(getDetectionTimeout() != 0))
     return;
 
+  // Packets received since the timer was set do not move it, so check whether
+  // we have really timed out. See scheduleReceiveTimeout(). In Demand mode the
+  // timer measures a poll sequence, which packets do not extend.
+  if (m_timeoutStatus == TimeoutStatus::None && !isLocalDemandModeActive())
+  {
+    TimeSpec deadline = m_lastReceiveTime + TimeSpec(TimeSpec::Microsec, getDetectionTimeout());
+    if (now < deadline)
+    {
+      armReceiveTimer(m_lastReceiveTime, getDetectionTimeout(), now);
+      return;
+    }
+  }
+
+  // We have timed out.
+
   gLog.Optional(Log::Session, "Session (id=%u) detection timeout.", m_id);
 
   // Set RemoteMinRxInterval as recommended in v10/6.8.18
   m_remoteMinRxInterval = 1;
-  m_remoteDiscr = 0;  // v10/6.8.1 bfd.RemoteDiscr
+  // The peer may have restarted, with a new sequence number. v10/6.8.1
+  m_authSeqKnown = false;
+  setRemoteDiscr(0);  // v10/6.8.1 bfd.RemoteDiscr
 
   if (m_sessionState == bfd::State::Up || m_sessionState == bfd::State::Init)
   {
@@ -1046,6 +1760,7 @@ void Session::handleReceiveTimeoutTimer(Timer *ATTR_UNUSED(timer))
     if (m_pollState == PollState::Completed)
       transitionPollState(PollState::None);
   }
+  publishStatus();
 
   if (m_timeoutStatus == TimeoutStatus::None)
   {
@@ -1054,7 +1769,7 @@ void Session::handleReceiveTimeoutTimer(Timer *ATTR_UNUSED(timer))
 
     uint64_t initialTimeout = getDetectionTimeout() * (m_destroyAfterTimeouts - 1);
     gLog.Optional(Log::SessionDetail, "Session (id=%u) setting initial timeout based on local system timeout multiplier.", m_id);
-    m_receiveTimeoutTimer->SetMicroTimer(initialTimeout);
+    armReceiveTimer(now, initialTimeout, now);
   }
   else if (m_timeoutStatus == TimeoutStatus::TimedOut)
   {
@@ -1071,6 +1786,8 @@ void Session::handleReceiveTimeoutTimer(Timer *ATTR_UNUSED(timer))
     // worse, the JUNOS8.5S4 that we are testing on actually waits 2 detection times
     // before setting its RemoteDiscr to 0 (in violation of the draft spec.)
     m_timeoutStatus = TimeoutStatus::TxSuspeded;
+    if (m_engineActive)
+      scheduleTransmit();
 
     // Since we do not know which the remote system is actually using
     // getUseDesiredMinTxInterval() or m_desiredMinTxInterval.
@@ -1084,7 +1801,7 @@ void Session::handleReceiveTimeoutTimer(Timer *ATTR_UNUSED(timer))
 
 
     gLog.Optional(Log::SessionDetail, "Session (id=%u) setting deadly timeout based on remote system Detection interval.", m_id);
-    m_receiveTimeoutTimer->SetMicroTimer(remoteDeadlyTimeout);
+    armReceiveTimer(now, remoteDeadlyTimeout, now);
   }
   else if (m_timeoutStatus == TimeoutStatus::TxSuspeded)
   {
@@ -1147,10 +1864,36 @@ void Session::GetExtendedState(ExtendedStateInfo &outState)
 
   outState.isHoldingState = m_forcedState;
   outState.isSuspended = m_isSuspended;
-
-  outState.uptimeList.assign(m_uptimeList.begin(), m_uptimeList.end());
+  outState.isLowPriority = m_lowPriority;
+  outState.backoffInterval = m_backoffInterval;
+  outState.desiredMinEchoTxInterval = m_desiredMinEchoTxInterval;
+  outState.remoteMinEchoRxInterval = m_remoteMinEchoRxInterval;
+  outState.isEchoActive = m_echoActive;
+  outState.isEchoConfirmed = m_echoConfirmed;
+  outState.isEchoUnanswered = m_echoUnanswered;
+  outState.demandMode = m_demandMode;
+  outState.isDemandActive = isLocalDemandModeActive();
+  outState.isRemoteDemandActive = isRemoteDemandModeActive();
+  outState.authType = m_authType;
+  outState.authKey = m_authKeyId;
+
+  outState.uptimeList = m_uptimeList;
   if (!outState.uptimeList.empty())
     outState.uptimeList.front().endTime = TimeSpec::MonoNow();
+
+  GetCounters(outState.counters);
+}
+
+void Session::GetCounters(Counters &outCounters)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  outCounters = m_counters;
+
+  // Packets sent by the engine are counted there.
+  TransmitEngine *engine = m_beacon ? m_beacon->GetTransmitEngine() : NULL;
+  if (engine && m_engineSlot != TransmitEngine::NoSlot)
+    outCounters.sent += engine->GetSlotSent(m_engineSlot);
 }
 
 uint32_t Session::GetLocalDiscriminator()
@@ -1192,9 +1935,10 @@ void Session::forceState(bfd::State::Value state, bfd::Diag::Value diag)
 
   if (m_sessionState == state)
   {
-    m_localDiag = diag;
+    setLocalDiag(diag);
     gLog.Optional(Log::Session, "(id=%u) Holding %s session already in %s state.", m_id, name, name);
     m_forcedState = true;
+    publishStatus();
     return;
   }
 
@@ -1204,6 +1948,7 @@ void Session::forceState(bfd::State::Value state, bfd::Diag::Value diag)
   m_forcedState = false;  // so that we do not block ourselves.
   setSessionState(state, diag);
   m_forcedState = true;
+  publishStatus();
 }
 
 void Session::AllowStateChanges()
@@ -1232,6 +1977,7 @@ void Session::AllowStateChanges()
     m_immediateControlPacket = true;
     scheduleTransmit();
   }
+  publishStatus();
 }
 
 
@@ -1240,8 +1986,11 @@ void Session::SetSuspend(bool suspend)
   bool wasSuspened = m_isSuspended;
 
   m_isSuspended = suspend;
+  if (m_isSuspended && m_engineActive)
+    scheduleTransmit();
 
   gLog.Optional(Log::Session, "(id=%u) set from %s to %s.", m_id, wasSuspened ? "suspended" : "responsive", m_isSuspended ? "suspended" : "responsive");
+  publishStatus();
 }
 
 /**
@@ -1258,7 +2007,7 @@ void Session::SetSuspend(bool suspend)
  */
 void Session::logPacketContents(const BfdPacket &packet, bool outPacket, bool inHostOrder, const IpAddr &remoteAddr, in_port_t remotePort, const IpAddr &localAddr, in_port_t localPort)
 {
-  if (gLog.LogTypeEnabled(Log::PacketContents))
+  if (gLog.LogTypeEnabledHint(Log::PacketContents))
   {
     // Not super efficient ... but we are logging packet contents, so this is a
     // debug situation
@@ -1272,7 +2021,7 @@ void Session::logPacketContents(const BfdPacket &packet, bool outPacket, bool in
 
 void Session::LogPacketContents(const BfdPacket &packet, bool outPacket, bool inHostOrder, const SockAddr &remoteAddr, const IpAddr &localAddr)
 {
-  if (gLog.LogTypeEnabled(Log::PacketContents))
+  if (gLog.LogTypeEnabledHint(Log::PacketContents))
     doLogPacketContents(packet, outPacket, inHostOrder, remoteAddr, SockAddr(localAddr));
 }
 
@@ -1330,8 +2079,10 @@ void Session::SetMulti(uint8_t val)
   if (m_detectMult != val)
   {
     m_detectMult = val;
+    m_txPacket.header.detectMult = val;
     m_immediateControlPacket = true;
     scheduleTransmit();
+    publishStatus();
   }
 }
 
@@ -1342,13 +2093,17 @@ void Session::SetMinTxInterval(uint32_t val)
   m_defaultDesiredMinTxInterval = val;
 
   // Try to change this now .... may cause a packet reschedule.
-  setDesiredMinTxInterval(m_defaultDesiredMinTxInterval);
+  setDesiredMinTxInterval(backedOffMinTx(m_defaultDesiredMinTxInterval));
+  publishStatus();
 }
 
 void Session::SetMinRxInterval(uint32_t val)
 {
   LogAssert(m_scheduler->IsMainThread());
-  setRequiredMinRxInterval(val);
+  if (intervalFloor())
+    m_backoffMinRx = val;
+  setRequiredMinRxInterval(backedOffMinRx(val));
+  publishStatus();
 }
 
 void Session::SetControlPlaneIndependent(bool cpi)
@@ -1359,6 +2114,7 @@ void Session::SetControlPlaneIndependent(bool cpi)
   if (m_controlPlaneIndependent != cpi)
   {
     m_controlPlaneIndependent = cpi;
+    m_txPacket.header.SetControlPlaneIndependent(cpi);
     m_immediateControlPacket = true;
     scheduleTransmit();
   }
@@ -1380,6 +2136,303 @@ void Session::SetAdminUpPollWorkaround(bool enable)
   m_adminUpPollWorkaround = enable;
 }
 
+void Session::SetLowPriority(bool lowPriority)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (m_lowPriority == lowPriority)
+    return;
+
+  gLog.Optional(Log::Session, "Session (id=%u) change priority to %s.", m_id, lowPriority ? "low" : "normal");
+  m_lowPriority = lowPriority;
+  if (!lowPriority)
+    SetBackoff(0);
+}
+
+void Session::SetBackoff(uint32_t interval)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (m_backoffInterval == interval)
+    return;
+
+  gLog.Optional(Log::Session, "(id=%u) Interval backoff change from %u to %u.", m_id, m_backoffInterval, interval);
+  setIntervalFloor(interval, m_echoConfirmed);
+}
+
+void Session::SetDemandMode(bool enable)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (m_demandMode == enable)
+    return;
+
+  gLog.Optional(Log::Session, "Session (id=%u) change demand mode to %s.", m_id, enable ? "enabled" : "disabled");
+  m_demandMode = enable;
+  updateDemand();
+  publishStatus();
+}
+
+bool Session::RequestPoll()
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (m_sessionState != bfd::State::Up)
+    return false;
+
+  if (m_pollState != PollState::Polling)
+    transitionPollState(PollState::Requested, true);
+  return true;
+}
+
+void Session::ApplyProfile(uint32_t profileId, uint32_t version, const InitialParams &params)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  gLog.Optional(Log::Session, "Session (id=%u) apply profile %u version %u.", m_id, profileId, version);
+  SetProfile(profileId, version);
+
+  SetMulti(params.detectMulti);
+  if (m_defaultDesiredMinTxInterval != params.desiredMinTx)
+    SetMinTxInterval(params.desiredMinTx);
+  if ((intervalFloor() ? m_backoffMinRx : m_requiredMinRxInterval) != params.requiredMinRx)
+    SetMinRxInterval(params.requiredMinRx);
+  SetControlPlaneIndependent(params.controlPlaneIndependent);
+  if (m_adminUpPollWorkaround != params.adminUpPollWorkaround)
+    SetAdminUpPollWorkaround(params.adminUpPollWorkaround);
+  SetLowPriority(params.lowPriority);
+  SetEchoInterval(params.echoInterval);
+  SetDemandMode(params.demandMode);
+  SetAuthKey(params.authKey);
+}
+
+void Session::SetAuthKey(uint32_t keyId)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  const AuthKey *key = m_beacon ? m_beacon->GetAuthKey(keyId) : NULL;
+  if (!key)
+    keyId = Beacon::NoAuthKey;
+  if (keyId == m_authKeyId)
+    return;
+
+  gLog.Optional(Log::Session, "Session (id=%u) change authentication key to %u.", m_id, keyId);
+  m_authKeyId = keyId;
+  m_authKey = key;
+  // The peer may well start over with the new key.
+  m_authSeqKnown = false;
+  RefreshAuthKey();
+}
+
+void Session::RefreshAuthKey()
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  m_authType = m_authKey ? m_authKey->GetType() : bfd::AuthType::None;
+  m_txPacket.header.SetAuth(m_authKey != NULL);
+  m_txPacket.header.length = m_authKey ? m_authKey->GetPacketLength() : sizeof(m_txPacket.header);
+  if (!m_authKey)
+    memset(&m_txPacket.auth, 0, sizeof(m_txPacket.auth));
+  m_txSigned = false;
+
+  // A packet that matches the last one would skip the auth checks.
+  m_hasLastRxHeader = false;
+
+  // The engine's header may be unchanged, but it needs the new digest, or it
+  // may no longer be able to send for us at all.
+  memset(&m_engineImage, 0, sizeof(m_engineImage));
+  if (isTransmitting())
+    scheduleTransmit();
+}
+
+void Session::SetEchoInterval(uint32_t val)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (m_desiredMinEchoTxInterval == val)
+    return;
+
+  gLog.Optional(Log::Session, "(id=%u) DesiredMinEchoTxInterval change from %u to %u.", m_id, m_desiredMinEchoTxInterval, val);
+  m_desiredMinEchoTxInterval = val;
+  updateEcho();
+  publishStatus();
+}
+
+/**
+ * Starts or stops the echo function, when anything that it depends on changes.
+ * See SetEchoInterval().
+ */
+void Session::updateEcho()
+{
+  // A peer that did not loop back our echo packets gets another chance the
+  // next time the session comes Up.
+  if (m_sessionState != bfd::State::Up)
+    m_echoUnanswered = false;
+
+  // The peer only loops echo packets back once it is Up too.
+  bool active = m_sessionState == bfd::State::Up
+     && m_remoteSessionState == bfd::State::Up
+     && m_desiredMinEchoTxInterval != 0
+     && m_remoteMinEchoRxInterval != 0
+     && !m_echoUnanswered
+     && m_beacon && m_beacon->GetEchoSocket(m_localAddr) != -1;
+
+  // The peer may only be sent echo packets as often as it allows. v10/6.8.9
+  m_echoInterval = max(m_desiredMinEchoTxInterval, m_remoteMinEchoRxInterval);
+
+  if (active == m_echoActive)
+    return;
+
+  m_echoActive = active;
+  if (active)
+  {
+    if (!m_echoTimer)
+    {
+      m_echoTimer = m_scheduler->MakeTimer("Echo", m_id);
+      m_echoTimer->SetCallback(handleEchoTimerCallback,  this);
+      m_echoTimer->SetPriority(Timer::Priority::Hi);
+    }
+    gLog.Optional(Log::Session, "(id=%u) Echo function started, interval %u.", m_id, m_echoInterval);
+    m_lastEchoTime = TimeSpec::MonoNow();
+    m_echoTimer->SetMicroTimer(0);
+  }
+  else
+  {
+    gLog.Optional(Log::Session, "(id=%u) Echo function stopped.", m_id);
+    if (m_echoTimer)
+      m_echoTimer->Stop();
+    if (m_echoConfirmed)
+      setIntervalFloor(m_backoffInterval, false);
+  }
+  publishStatus();
+}
+
+/**
+ * Called when m_echoTimer expires. Checks for an echo detection timeout, and
+ * otherwise sends the next echo packet.
+ */
+void Session::handleEchoTimer(Timer *ATTR_UNUSED(timer))
+{
+  TimeSpec now(TimeSpec::MonoNow());
+
+  if (!LogVerify(m_echoActive))
+    return;
+
+  if (now - m_lastEchoTime > TimeSpec(TimeSpec::Microsec, int64_t(m_detectMult) * m_echoInterval))
+  {
+    if (!m_echoConfirmed)
+    {
+      // The peer does not loop back our echo packets, which is normal for
+      // anything but OpenBFDD. The control packets still run at full rate, so
+      // detection is unchanged.
+      gLog.LogWarn("Session (id=%u) no echo packets came back from %s. Echo function given up until the session next comes up.",
+                   m_id, m_remoteAddr.ToString());
+      m_echoUnanswered = true;
+      updateEcho();
+      return;
+    }
+
+    gLog.Optional(Log::Session, "Session (id=%u) echo detection timeout.", m_id);
+    // This stops the echo function.
+    setSessionState(bfd::State::Down, bfd::Diag::EchoFailed);
+    return;
+  }
+
+  sendEchoPacket();
+  m_echoTimer->SetMicroTimer(m_echoInterval);
+}
+
+/**
+ * Sends an echo packet, from the beacon's echo socket. Echo packets do not go
+ * through the transmit queue, since each is sent alone, and on time.
+ */
+void Session::sendEchoPacket()
+{
+  if (m_isSuspended)
+    return;
+
+  int socket = m_beacon->GetEchoSocket(m_localAddr);
+  if (socket == -1)
+    return;
+
+  EchoPacket packet;
+  packet.magic = htonl(bfd::EchoMagic);
+  packet.instance = htonl(m_beacon->GetEchoInstance());
+  packet.myDisc = htonl(m_localDiscr);
+  packet.sequence = htonl(++m_echoSequence);
+
+  SockAddr target(m_remoteAddr, bfd::EchoPort);
+  if (::sendto(socket, &packet, sizeof(packet), MSG_NOSIGNAL | MSG_DONTWAIT, &target.GetSockAddr(), target.GetSize()) < 0)
+  {
+    gLog.Optional(Log::Packet, "Failed to send echo packet for session %u: %s", m_id, ErrnoToString());
+    return;
+  }
+
+  m_counters.echoSent++;
+  m_beacon->CountEchoSent();
+}
+
+void Session::ProcessEchoPacket(uint32_t sequence, const TimeSpec &receiveTime)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!m_echoActive)
+    return;
+
+  // One sent more than a detection time ago proves nothing now.
+  if (uint32_t(m_echoSequence - sequence) >= m_detectMult)
+  {
+    gLog.Optional(Log::Discard, "Discard echo packet for session %u: sequence %u is stale.", m_id, sequence);
+    return;
+  }
+
+  m_counters.echoReceived++;
+  if (m_lastEchoTime < receiveTime)
+    m_lastEchoTime = receiveTime;
+
+  if (!m_echoConfirmed)
+  {
+    // Detection no longer depends on the control packets alone, so they can be
+    // slowed. v10/6.8.3
+    gLog.Optional(Log::Session, "(id=%u) Echo packets are coming back.", m_id);
+    setIntervalFloor(m_backoffInterval, true);
+  }
+}
+
+/**
+ * @return uint32_t - The least transmit and receive intervals, in
+ *         microseconds, from any backoff and the echo function. 0 for none.
+ */
+uint32_t Session::intervalFloor()
+{
+  uint32_t floor = m_backoffInterval;
+  if (m_echoConfirmed && m_beacon && m_beacon->GetEchoControlInterval() > floor)
+    floor = m_beacon->GetEchoControlInterval();
+  return floor;
+}
+
+/**
+ * Changes what intervalFloor() is made from, and moves the intervals to match.
+ * The configured intervals are kept.
+ */
+void Session::setIntervalFloor(uint32_t backoffInterval, bool echoConfirmed)
+{
+  uint32_t minRx = intervalFloor() ? m_backoffMinRx : m_requiredMinRxInterval;
+
+  m_backoffInterval = backoffInterval;
+  m_echoConfirmed = echoConfirmed;
+  m_backoffMinRx = minRx;
+
+  // As in setSessionState(), the transmit interval is only lowered below
+  // bfd::BaseMinTxInterval when Up.
+  uint32_t minTx = backedOffMinTx(m_defaultDesiredMinTxInterval);
+  if (m_sessionState == bfd::State::Up && m_desiredMinTxInterval != minTx)
+    setDesiredMinTxInterval(minTx);
+  if (m_requiredMinRxInterval != backedOffMinRx(minRx))
+    setRequiredMinRxInterval(backedOffMinRx(minRx));
+  publishStatus();
+}
+
 /**
  *
  *
@@ -1412,6 +2465,8 @@ void Session::setDesiredMinTxInterval(uint32_t newValue, SetValueFlags::Flag fla
   // We can always change this immediately, but it will not effect transmit timing
   // until getUseDesiredMinTxInterval() is changed.
   m_desiredMinTxInterval = newValue;
+  m_txPacket.header.txDesiredMinInt = htonl(newValue);
+  refreshTransmitEngine();
 
   if (m_sessionState != bfd::State::Up || newValue <= getUseDesiredMinTxInterval())
   {
@@ -1478,6 +2533,8 @@ void Session::setRequiredMinRxInterval(uint32_t newValue, SetValueFlags::Flag fl
   // We can always change this immediately, but it will not effect detection
   // timing until getUseRequiredMinRxInterval() is changed.
   m_requiredMinRxInterval = newValue;
+  m_txPacket.header.rxRequiredMinInt = htonl(newValue);
+  refreshTransmitEngine();
 
   if (m_sessionState != bfd::State::Up || newValue >= getUseRequiredMinRxInterval() || newValue == 0)
   {
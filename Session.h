@@ -14,12 +14,22 @@
 #include "SmartPointer.h"
 #include "TimeSpec.h"
 #include "Socket.h"
-#include <list>
+#include "AddrKey.h"
+#include "threads.h"
+#include "StatusTable.h"
+#include "SessionEvents.h"
+#include "Scheduler.h"
 
+#ifndef UPTIME_HISTORY_DEPTH
+  #define UPTIME_HISTORY_DEPTH 4
+#endif
+
+class AuthKey;
 class Beacon;
 class Scheduler;
 class Timer;
 struct BfdPacket;
+struct StatusExportRecord;
 class SockAddr;
 
 /**
@@ -39,6 +49,10 @@ public:
     uint32_t requiredMinRx;
     bool controlPlaneIndependent;
     bool adminUpPollWorkaround;
+    bool lowPriority;
+    uint32_t echoInterval;
+    bool demandMode;
+    uint32_t authKey; // Beacon::NoAuthKey for no authentication.
   };
 
 
@@ -53,8 +67,10 @@ public:
    * @param beacon
    * @param descriminator
    * @param params
+   * @param id [in] - The id to use, such as for a session restored after a
+   *           restart. 0 to take the next one.
    */
-  Session(Scheduler &scheduler, Beacon *beacon, uint32_t descriminator, const InitialParams &params);
+  Session(Scheduler &scheduler, Beacon *beacon, uint32_t descriminator, const InitialParams &params, uint32_t id = 0);
   ~Session();
 
   /**
@@ -79,10 +95,87 @@ public:
    * @param remoteAddr [in] - remote address.
    * @param localAddr [in]- address on which to receive and send packets. May not
    *                  be 'any'
+   * @param startDelayUs [in] - Time until the first packet is sent, in
+   *                     microseconds. 0 to send it immediately.
    *
    * @return - False on failure.
    **/
-  bool StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr);
+  bool StartActiveSession(const IpAddr &remoteAddr, const IpAddr &localAddr, uint32_t startDelayUs = 0);
+
+  /**
+   * What a session needs to resume after a restart, so that its peer does not
+   * notice. See Beacon::SetCheckpointFile(). Plain data, written to the
+   * checkpoint file as is, so any change to it needs a new
+   * SessionCheckpoint::Version.
+   */
+  struct SavedState
+  {
+    AddrKey remoteAddr;
+    AddrKey localAddr;
+    uint32_t id;
+    uint32_t localDiscr;
+    uint32_t remoteDiscr;
+    uint32_t desiredMinTxInterval;
+    uint32_t useDesiredMinTxInterval;
+    uint32_t defaultDesiredMinTxInterval;
+    uint32_t requiredMinRxInterval;
+    uint32_t useRequiredMinRxInterval;
+    uint32_t remoteMinRxInterval;
+    uint32_t remoteDesiredMinTxInterval;
+    uint16_t remoteSourcePort;
+    uint16_t sendPort;
+    uint8_t state;        // bfd::State::Value
+    uint8_t remoteState;  // bfd::State::Value
+    uint8_t localDiag;    // bfd::Diag::Value
+    uint8_t remoteDiag;   // bfd::Diag::Value
+    uint8_t detectMult;
+    uint8_t remoteDetectMult;
+    uint8_t flags;        // SavedFlags
+    uint8_t authType;     // bfd::AuthType::Value. Such sessions are not restored, see Beacon::restoreSessions().
+
+    /**
+     * @return uint64_t - The detection time that the peer uses for us, in
+     *         microseconds. If we are silent for longer, then it has taken the
+     *         session down. 0 if it does not expect packets.
+     */
+    uint64_t GetPeerDetectionTime() const;
+  };
+
+  struct SavedFlags
+  {
+    enum Flag
+    {
+      Active = 0x01,
+      ControlPlaneIndependent = 0x02,
+      AdminUpPollWorkaround = 0x04,
+      Suspended = 0x08,
+      HoldingState = 0x10,
+      LowPriority = 0x20,
+      DemandMode = 0x40
+    };
+  };
+
+  /**
+   * Fills outState with what is needed to resume the session in another
+   * process.
+   */
+  void GetSavedState(SavedState &outState);
+
+  /**
+   * Resumes a session from a previous process, instead of
+   * StartActiveSession() or StartPassiveSession(). This must be a new session,
+   * with the discriminator and id from state. The first packet is sent right
+   * away, and the detection time starts now.
+   *
+   * @param state [in] - From GetSavedState().
+   * @param peerTimedOut [in] - The peer will already have taken the session
+   *                     down, so it starts again from Down, with the saved
+   *                     settings.
+   *
+   * @return bool - false on failure, such as an invalid state. The session
+   *         should then be deleted.
+   */
+  bool Restore(const SavedState &state, bool peerTimedOut);
 
   /**
    * Upgrades a passive to active session.
@@ -112,6 +205,13 @@ public:
    */
   const IpAddr& GetLocalAddress();
 
+  /**
+   * The remote and local addresses, as keys for comparing with received
+   * packets. Invalid until the addresses are set.
+   */
+  const AddrKey& GetRemoteKey() const { return m_remoteKey;}
+  const AddrKey& GetLocalKey() const { return m_localKey;}
+
   /**
    * Checks if the session is active (StartActiveSession)
    *
@@ -121,7 +221,8 @@ public:
 
   /**
    * Takes a wire control packet data and converts it into a BfdPacket. Also does
-   * preliminary checks to see if the packet needs to be dropped.
+   * preliminary checks to see if the packet needs to be dropped. See
+   * BfdPacketView, which does the same without the copy.
    *
    * @note Does not need to be called on main thread.
    *
@@ -143,10 +244,12 @@ public:
    * @param packet
    * @param port [in] - The source port for the packet. Needed for active role
    *             only.
+   * @param receiveTime [in] - Monotonic time that the packet arrived. The
+   *                    detection time starts from here. Not after now.
    *
    * @return bool - false if packet was dropped.
    */
-  bool ProcessControlPacket(const BfdPacket &packet, in_port_t port);
+  bool ProcessControlPacket(const BfdPacket &packet, in_port_t port, const TimeSpec &receiveTime);
 
   /**
    * Gets the current session state.
@@ -164,6 +267,69 @@ public:
     bool forced;  // True if held down (or admin down).
   };
 
+  /**
+   * The last few transitions, newest first, held in a fixed array so that
+   * neither a transition nor a copy for status uses the heap. Once full, each
+   * new transition replaces the oldest.
+   *
+   * The depth is set at build time, see "--with-uptime-history" in configure.
+   */
+  class UptimeHistory
+  {
+  public:
+    static const size_t Capacity = UPTIME_HISTORY_DEPTH;
+
+    UptimeHistory() : m_first(0), m_count(0) { }
+
+    size_t size() const { return m_count;}
+    bool empty() const { return m_count == 0;}
+    void clear() { m_first = 0; m_count = 0;}
+
+    /**
+     * @param index [in] - 0 for the newest. Must be less than size().
+     */
+    UptimeInfo& operator[](size_t index) { return m_items[(m_first + index) % Capacity];}
+    const UptimeInfo& operator[](size_t index) const { return m_items[(m_first + index) % Capacity];}
+
+    UptimeInfo& front() { return m_items[m_first];}
+    const UptimeInfo& front() const { return m_items[m_first];}
+
+    /**
+     * Adds a new newest entry, dropping the oldest if full.
+     */
+    void push_front(const UptimeInfo &uptime)
+    {
+      m_first = (m_first + Capacity - 1) % Capacity;
+      m_items[m_first] = uptime;
+      if (m_count < Capacity)
+        m_count++;
+    }
+
+  private:
+    UptimeInfo m_items[Capacity];
+    size_t m_first; // Index of the newest.
+    size_t m_count;
+  };
+
+  /**
+   * Counts for the session since it was created. These are plain counters,
+   * written only on the scheduler's thread. The beacon keeps the totals, with
+   * the reasons for discards, see Beacon::PacketCounters.
+   */
+  struct Counters
+  {
+    Counters() { Reset();}
+    void Reset() { received = 0; sent = 0; discarded = 0; stateChanges = 0; pollSequences = 0; echoSent = 0; echoReceived = 0;}
+
+    uint64_t received;      // Control packets passed to the session.
+    uint64_t sent;          // Control packets sent, including by any transmit engine.
+    uint64_t discarded;     // Of received, packets that the session discarded.
+    uint64_t stateChanges;  // Changes of the local state.
+    uint64_t pollSequences; // Poll sequences started.
+    uint64_t echoSent;      // Echo packets sent.
+    uint64_t echoReceived;  // Echo packets that came back.
+  };
+
 
   struct ExtendedStateInfo
   {
@@ -188,8 +354,21 @@ public:
 
     bool isHoldingState;
     bool isSuspended;
-
-    std::list<UptimeInfo> uptimeList; // last few transitions.
+    bool isLowPriority;
+    uint32_t backoffInterval; // See SetBackoff(). 0 for none.
+    uint32_t desiredMinEchoTxInterval; // See SetEchoInterval(). 0 for none.
+    uint32_t remoteMinEchoRxInterval;
+    bool isEchoActive;
+    bool isEchoConfirmed;    // See IsEchoConfirmed().
+    bool isEchoUnanswered;   // Given up until the session next comes Up.
+    bool demandMode;         // See SetDemandMode().
+    bool isDemandActive;     // The remote system has been asked to stop sending.
+    bool isRemoteDemandActive; // We have stopped sending periodic packets.
+    bfd::AuthType::Value authType; // See SetAuthKey().
+    uint32_t authKey;        // Beacon::NoAuthKey for none.
+
+    UptimeHistory uptimeList; // last few transitions.
+    Counters counters;
   };
 
   /**
@@ -201,6 +380,19 @@ public:
    */
   void GetExtendedState(ExtendedStateInfo &outState);
 
+  /**
+   * Gets the packet counts for the session.
+   *
+   * @param outCounters [out] - The counts.
+   */
+  void GetCounters(Counters &outCounters);
+
+  /**
+   * Writes the published status and the counters to the session's status
+   * export record, if it has one. See Beacon::SetStatusExport().
+   */
+  void ExportStatus();
+
   /**
    *
    * Gets the discriminator for this end of the session.
@@ -289,6 +481,124 @@ public:
    */
   void SetAdminUpPollWorkaround(bool enable);
 
+  /**
+   * Marks the session as one whose intervals may be raised when the shard is
+   * overloaded. See Beacon::SetOverload(). A session that is no longer low
+   * priority has any backoff removed.
+   */
+  void SetLowPriority(bool lowPriority);
+
+  bool IsLowPriority() { return m_lowPriority;}
+
+  /**
+   * Raises the session's intervals, both transmit and receive, to at least
+   * interval, until it is called again with 0. The configured intervals are
+   * kept, and used again once the backoff is removed. Changes take effect with
+   * a poll sequence, as for SetMinTxInterval() and SetMinRxInterval().
+   *
+   * @param interval [in] - In microseconds. 0 for none.
+   */
+  void SetBackoff(uint32_t interval);
+
+  uint32_t GetBackoff() { return m_backoffInterval;}
+
+  /**
+   * Sets the Desired Min Echo TX Interval: how often the session sends echo
+   * packets, if the peer loops them back. The echo function is active while the
+   * session is Up, this is not 0, the peer's Required Min Echo RX Interval is
+   * not 0, and the beacon has an echo socket for the local address.
+   *
+   * Echo packets are sent to the peer's echo port, to be looped back by the
+   * peer's beacon, so only an OpenBFDD peer returns them. Until one comes
+   * back, nothing else changes. If none does for the detection multiplier
+   * times the echo interval, the echo function is given up until the session
+   * next comes Up, and the session stays Up. Once echo packets have come back,
+   * the control packets are slowed, see Beacon::SetEcho(), and the session goes
+   * down if echo packets stop coming back for that long.
+   *
+   * @param val [in] - In microseconds. 0 to not send echo packets.
+   */
+  void SetEchoInterval(uint32_t val);
+
+  bool IsEchoActive() { return m_echoActive;}
+
+  /**
+   * @return bool - True if echo packets have come back since the echo function
+   *         last started.
+   */
+  bool IsEchoConfirmed() { return m_echoConfirmed;}
+
+  /**
+   * Sets whether the session asks the remote system to use Demand mode. While
+   * both systems are Up, the Demand bit is set in our control packets, so the
+   * remote system stops sending periodic packets, and the detection time only
+   * runs during a poll sequence, see RequestPoll(). Should only be used with a
+   * remote system that has some other way to verify connectivity. A poll
+   * sequence is started whenever Demand mode starts or stops, so that the
+   * remote system learns of it at once. v10/6.6
+   *
+   * Demand mode of the remote system is always honored: we stop sending
+   * periodic packets while its Demand bit is set.
+   */
+  void SetDemandMode(bool enable);
+
+  /**
+   * Starts a poll sequence, unless one is already underway. In Demand mode,
+   * the session goes down if the remote system does not answer within the
+   * detection time. v10/6.8.4
+   *
+   * @return bool - false if the session is not Up.
+   */
+  bool RequestPoll();
+
+  /**
+   * Sets the key that authenticates the session's control packets, in both
+   * directions. Once set, packets without the A bit, or that do not match the
+   * key, are discarded. The key's settings are read each time it is used, so a
+   * key that is changed with Beacon::SetAuthKey() needs only
+   * RefreshAuthKey(). v10/6.7
+   *
+   * @param keyId [in] - The beacon's id for the key, or Beacon::NoAuthKey for
+   *              no authentication. An id that the beacon does not have is
+   *              taken as NoAuthKey.
+   */
+  void SetAuthKey(uint32_t keyId);
+
+  /**
+   * Call when the settings of the session's key change, so that the next
+   * packets are signed with them.
+   */
+  void RefreshAuthKey();
+
+  uint32_t GetAuthKeyId() { return m_authKeyId;}
+
+  /**
+   * Records the profile that the session belongs to, and the version of the
+   * profile's settings that it has. See Beacon::SetProfileParams().
+   *
+   * @param version [in] - 0 if the session does not have the settings yet.
+   */
+  void SetProfile(uint32_t profileId, uint32_t version) { m_profileId = profileId; m_profileVersion = version;}
+
+  uint32_t GetProfileId() { return m_profileId;}
+  uint32_t GetProfileVersion() { return m_profileVersion;}
+
+  /**
+   * Changes every setting to that of a profile, as though each had been set
+   * on its own. Only the settings that differ have any effect, so a change of
+   * interval still takes a poll sequence. Records the profile, as for
+   * SetProfile().
+   */
+  void ApplyProfile(uint32_t profileId, uint32_t version, const InitialParams &params);
+
+  /**
+   * Called by the beacon for one of the session's echo packets that came back.
+   *
+   * @param sequence [in] - From the packet, in host order.
+   * @param receiveTime [in] - Monotonic time that the packet arrived.
+   */
+  void ProcessEchoPacket(uint32_t sequence, const TimeSpec &receiveTime);
+
   /**
    * Logs packet contents if PacketContents is enabled.
    *
@@ -318,10 +628,13 @@ private:
   };
 
   void sendControlPacket();
-  void send(const BfdPacket &packet);
+  bool send(const BfdPacket &packet);
   bool isRemoteDemandModeActive();
-  void scheduleReceiveTimeout();
+  bool isLocalDemandModeActive();
+  void updateDemand();
+  void scheduleReceiveTimeout(const TimeSpec &receiveTime);
   void reScheduleReceiveTimeout();
+  void armReceiveTimer(const TimeSpec &start, uint64_t micro, const TimeSpec &now);
   uint64_t getDetectionTimeout();
   void scheduleTransmit();
   uint32_t getBaseTransmitTime();
@@ -329,6 +642,9 @@ private:
 
   void setSessionState(bfd::State::Value newState,  bfd::Diag::Value diag = bfd::Diag::None, SetValueFlags::Flag flags = SetValueFlags::None);
   void logSessionTransition();
+  void publishStatus();
+  void fillStatus(SessionStatus &outStatus);
+  void publishEvent(SessionEvent::Type::Value type, bfd::State::Value oldState);
   bool ensureSendSocket();
 
   static void handleReceiveTimeoutTimerCallback(Timer *timer, void *userdata) { reinterpret_cast<Session *>(userdata)->handleReceiveTimeoutTimer(timer);}
@@ -337,11 +653,20 @@ private:
   static void handletTransmitNextTimerCallback(Timer *timer, void *userdata) { reinterpret_cast<Session *>(userdata)->handletTransmitNextTimer(timer);}
   void handletTransmitNextTimer(Timer *timer);
 
+  static void handleEchoTimerCallback(Timer *timer, void *userdata) { reinterpret_cast<Session *>(userdata)->handleEchoTimer(timer);}
+  void handleEchoTimer(Timer *timer);
+  void updateEcho();
+  void sendEchoPacket();
+
   bool transitionPollState(PollState::Value nextState, bool allowAmbiguous = false);
   void forceState(bfd::State::Value state, bfd::Diag::Value diag);
 
   void setDesiredMinTxInterval(uint32_t newValue, SetValueFlags::Flag flags = SetValueFlags::None);
   void setRequiredMinRxInterval(uint32_t newValue, SetValueFlags::Flag flags = SetValueFlags::None);
+  uint32_t intervalFloor();
+  void setIntervalFloor(uint32_t backoffInterval, bool echoConfirmed);
+  uint32_t backedOffMinTx(uint32_t value) { uint32_t floor = intervalFloor(); return value < floor ? floor : value;}
+  uint32_t backedOffMinRx(uint32_t value) { uint32_t floor = intervalFloor(); return (value != 0 && value < floor) ? floor : value;}
 
   static void logPacketContents(const BfdPacket &packet, bool outPacket, bool inHostOrder, const IpAddr &remoteAddr, in_port_t remotePort, const IpAddr &localAddr, in_port_t localPort);
   static void doLogPacketContents(const BfdPacket &packet, bool outPacket, bool inHostOrder, const SockAddr &remoteAddr, const SockAddr &localAddr);
@@ -349,8 +674,9 @@ private:
 private:
 
 
-  // Only access m_nextId from main scheduler thread. This is not protected, so if
-  // there were more than one scheduler, we would have a problem.
+  // Sessions are created on every shard's scheduler thread, so m_nextId is
+  // protected by m_nextIdLock.
+  static QuickLock m_nextIdLock;
   static uint32_t m_nextId;  // used to generate the human readable id.
 
   Beacon *m_beacon;      //For lifetime management only.
@@ -358,6 +684,8 @@ private:
   IpAddr m_remoteAddr;
   in_port_t m_remoteSourcePort;
   IpAddr m_localAddr; // The ip local address for the session, from which packets are sent.
+  AddrKey m_remoteKey; // Same as m_remoteAddr.
+  AddrKey m_localKey;  // Same as m_localAddr.
   in_port_t m_sendPort; // The port we are using to send to the remote machine for this session.
   bool m_isActive;  // are we taking an active role ... that is, we start sending periodic packets until session comes up.
   uint32_t m_id;  //Human readable id.
@@ -365,6 +693,7 @@ private:
 
   // For sending data back to the source
   Socket m_sendSocket;
+  int m_sharedSendSocket; // Owned by the TransmitQueue. Used instead of m_sendSocket if not -1.
 
   // State variables from spec
   bfd::State::Value m_sessionState;
@@ -375,13 +704,23 @@ private:
   uint32_t m_desiredMinTxInterval;  // in microseconds
   uint32_t m_requiredMinRxInterval; // in microseconds
   uint32_t m_remoteMinRxInterval;   // in microseconds
-  bool m_demandMode;  // Never set ... we do not currently support this.
+  bool m_demandMode;  // Configured, see SetDemandMode(). See isLocalDemandModeActive().
   bool m_remoteDemandMode;
   uint8_t m_detectMult;
   bfd::AuthType::Value m_authType;
-  uint32_t m_rcvAuthSeq;  // we do not use this since we do not do  MD5 or SHA1 authentication
-  uint32_t m_xmitAuthSeq; // we do not use this since we do not do  MD5 or SHA1 authentication
-  bool m_authSeqKnown; // we do not use this since we do not do  MD5 or SHA1 authentication
+  uint32_t m_rcvAuthSeq;
+  uint32_t m_xmitAuthSeq;
+  bool m_authSeqKnown;
+
+  // Authentication, see SetAuthKey(). m_authKey is owned by the beacon, and is
+  // only tested on receive for sessions without it.
+  const AuthKey *m_authKey;
+  uint32_t m_authKeyId;
+  bool m_txSigned;  // m_txPacket has a digest for m_signedHeader.
+  BfdPacketHeader m_signedHeader;
+  bool verifyAuth(const BfdPacket &packet, uint32_t &outSequence);
+  void acceptAuthSequence(uint32_t sequence) { m_rcvAuthSeq = sequence; m_authSeqKnown = true;}
+  void signTxPacket();
 
   // Our state variables
   PollState::Value m_pollState; // Current state of polling.
@@ -412,6 +751,48 @@ private:
   bool m_immediateControlPacket;  // signals that we are looking to send an immediate response due to a state or other change.
   bool m_controlPlaneIndependent;
   bool m_adminUpPollWorkaround;
+  bool m_lowPriority;
+  uint32_t m_profileId;      // See SetProfile().
+  uint32_t m_profileVersion;
+  uint32_t m_backoffInterval; // See SetBackoff().
+  uint32_t m_backoffMinRx; // The configured RequiredMinRxInterval, while intervalFloor() is not 0.
+  uint32_t m_desiredMinEchoTxInterval; // See SetEchoInterval().
+  uint32_t m_remoteMinEchoRxInterval;
+  bool m_echoActive;
+  bool m_echoConfirmed;  // See IsEchoConfirmed(). Control packets are only slowed while true.
+  bool m_echoUnanswered; // None came back, so the echo function is off until the session leaves Up.
+  uint32_t m_echoInterval; // Between echo packets, while m_echoActive.
+  uint32_t m_echoSequence;
+  TimeSpec m_lastEchoTime; // When the last echo packet came back, or echo started.
+
+  // Host order header of the last control packet that was fully processed. A
+  // packet that matches it, in steady state, only restarts the detection timer.
+  BfdPacketHeader m_lastRxHeader;
+  bool m_hasLastRxHeader;
+  Counters m_counters;
+  bool isSteadyStatePacket(const BfdPacketHeader &header, in_port_t port);
+
+  // Network order image of our next control packet. This is patched when the
+  // state variables that it contains change, so it need not be rebuilt for each
+  // transmit. Poll and final are set just before sending.
+  BfdPacket m_txPacket;
+  void buildTxPacket(BfdPacket &outPacket);
+
+  // While the session only sends the same packet at a fixed interval, the
+  // beacon's TransmitEngine, if any, sends it, and m_transmitNextTimer is
+  // stopped.
+  uint32_t m_engineSlot; // TransmitEngine::NoSlot until first used.
+  bool m_engineActive;   // Is the engine sending for us.
+  uint32_t m_engineInterval; // Interval given to the engine, before jitter.
+  BfdPacketHeader m_engineImage; // Packet given to the engine.
+  bool isTransmitting();
+  bool canUseTransmitEngine();
+  bool handOffTransmit(uint32_t interval, uint64_t firstDelay);
+  void takeBackTransmit();
+  void refreshTransmitEngine();
+  void stopTransmit();
+  void setLocalDiag(bfd::Diag::Value diag);
+  void setRemoteDiscr(uint32_t disc);
 
 
   // Forced state
@@ -429,13 +810,28 @@ private:
   void setUseRequiredMinRxInterval(uint32_t val);
 
   // Keep last few transitions for logging.
-  std::list<UptimeInfo> m_uptimeList;
+  UptimeHistory m_uptimeList;
+
+  // Status published for readers on other threads.
+  SessionStatusTable *m_statusTable; // NULL if the session does not publish status.
+  size_t m_statusSlot;
+  SessionStatus m_status; // Last published status.
+  StatusExportRecord *m_exportRecord; // NULL if the session is not exported.
 
 
-  // Timers
+  // Timers. The receive and transmit timers, which every session runs, are
+  // made in the session itself. Storage is declared first, so that it outlives
+  // the timers.
   void deleteTimer(Timer *timer);
+  TimerStorage m_receiveTimerStorage;
+  TimerStorage m_transmitTimerStorage;
   RaiiClassCall<Timer, Session, &Session::deleteTimer> m_receiveTimeoutTimer; // Timer for the receive packet timeout.
+  // The receive timer is not moved for each packet. See scheduleReceiveTimeout().
+  TimeSpec m_lastReceiveTime; // Start of the current detection time.
+  TimeSpec m_receiveTimerStart; // When m_receiveTimeoutTimer was last armed for.
+  TimeSpec m_receiveTimerDeadline; // When m_receiveTimeoutTimer will expire, if running.
   RaiiClassCall<Timer, Session, &Session::deleteTimer> m_transmitNextTimer;  // Timer for the next control packet.
+  RaiiClassCall<Timer, Session, &Session::deleteTimer> m_echoTimer;  // Sends echo packets. Made when first needed.
 };
 
 inline Session::SetValueFlags::Flag operator|(Session::SetValueFlags::Flag f1, Session::SetValueFlags::Flag f2) { return Session::SetValueFlags::Flag((int)f1 | (int)f2);}
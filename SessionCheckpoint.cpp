@@ -0,0 +1,201 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "SessionCheckpoint.h"
+#include "lookup3.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+const uint32_t SessionCheckpoint::Magic;
+const uint32_t SessionCheckpoint::Version;
+
+SessionCheckpoint::SessionCheckpoint() :
+   m_map(NULL),
+   m_mapSize(0),
+   m_shardCount(0),
+   m_discKey(0),
+   m_discNextValues(NULL),
+   m_sessionCount(0),
+   m_sessions(NULL),
+   m_age(0)
+{
+}
+
+SessionCheckpoint::~SessionCheckpoint()
+{
+  Close();
+}
+
+uint64_t SessionCheckpoint::realTimeMicro()
+{
+  TimeSpec now(TimeSpec::RealNow());
+  return uint64_t(now.tv_sec) * 1000000 + uint64_t(now.tv_nsec / 1000);
+}
+
+// static
+bool SessionCheckpoint::Write(const char *path, uint32_t discKey, const vector<uint32_t> &discNextValues,
+                              const vector<Session::SavedState> &sessions)
+{
+  if (!LogVerify(!discNextValues.empty()))
+    return false;
+
+  size_t shardSize = shardBytes(discNextValues.size());
+  size_t sessionSize = sessions.size() * sizeof(Session::SavedState);
+  size_t fileSize = sizeof(FileHeader) + shardSize + sessionSize;
+  char tempPath[PATH_MAX];
+
+  if (size_t(snprintf(tempPath, sizeof(tempPath), "%s.tmp", path)) >= sizeof(tempPath))
+  {
+    gLog.LogError("Checkpoint file name %s is too long.", path);
+    return false;
+  }
+
+  FileDescriptor file(::open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0600));
+  if (!file.IsValid())
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to create checkpoint file %s", tempPath));
+    return false;
+  }
+
+  if (0 != ::ftruncate(file, off_t(fileSize)))
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to size checkpoint file %s", tempPath));
+    ::unlink(tempPath);
+    return false;
+  }
+
+  void *map = ::mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (map == MAP_FAILED)
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to map checkpoint file %s", tempPath));
+    ::unlink(tempPath);
+    return false;
+  }
+
+  uint8_t *body = reinterpret_cast<uint8_t *>(map) + sizeof(FileHeader);
+  memset(body, 0, shardSize);
+  memcpy(body, &discNextValues.front(), discNextValues.size() * sizeof(uint32_t));
+  if (sessionSize)
+    memcpy(body + shardSize, &sessions.front(), sessionSize);
+
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = Magic;
+  header.version = Version;
+  header.headerSize = sizeof(FileHeader);
+  header.recordSize = sizeof(Session::SavedState);
+  header.shardCount = uint32_t(discNextValues.size());
+  header.discKey = discKey;
+  header.sessionCount = sessions.size();
+  header.saveTime = realTimeMicro();
+  header.checksum = hashlittle(body, shardSize + sessionSize);
+  memcpy(map, &header, sizeof(header));
+
+  ::munmap(map, fileSize);
+
+  if (0 != ::rename(tempPath, path))
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to rename checkpoint file to %s", path));
+    ::unlink(tempPath);
+    return false;
+  }
+
+  return true;
+}
+
+bool SessionCheckpoint::Open(const char *path)
+{
+  struct stat info;
+
+  Close();
+
+  FileDescriptor file(::open(path, O_RDONLY));
+  if (!file.IsValid())
+  {
+    if (errno != ENOENT)
+      gLog.ErrnoError(errno, FormatShortStr("Failed to open checkpoint file %s", path));
+    return false;
+  }
+
+  if (0 != ::fstat(file, &info))
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to read checkpoint file %s", path));
+    return false;
+  }
+
+  if (info.st_size < off_t(sizeof(FileHeader)))
+  {
+    gLog.LogError("Checkpoint file %s is too short.", path);
+    return false;
+  }
+
+  size_t fileSize = size_t(info.st_size);
+  void *map = ::mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, file, 0);
+  if (map == MAP_FAILED)
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to map checkpoint file %s", path));
+    return false;
+  }
+
+  FileHeader header;
+  memcpy(&header, map, sizeof(header));
+
+  const uint8_t *body = reinterpret_cast<const uint8_t *>(map) + sizeof(FileHeader);
+  size_t shardSize = shardBytes(header.shardCount);
+  const char *problem = NULL;
+
+  if (header.magic != Magic)
+    problem = "is not a checkpoint file";
+  else if (header.version != Version
+           || header.headerSize != sizeof(FileHeader)
+           || header.recordSize != sizeof(Session::SavedState))
+    problem = "was written by a different version";
+  else if (header.shardCount == 0
+           || header.sessionCount > (fileSize - sizeof(FileHeader)) / sizeof(Session::SavedState)
+           || fileSize != sizeof(FileHeader) + shardSize + size_t(header.sessionCount) * sizeof(Session::SavedState))
+    problem = "has the wrong size";
+  else if (header.checksum != hashlittle(body, fileSize - sizeof(FileHeader)))
+    problem = "is corrupt";
+
+  if (problem)
+  {
+    gLog.LogError("Checkpoint file %s %s. It is ignored.", path, problem);
+    ::munmap(map, fileSize);
+    return false;
+  }
+
+  uint64_t now = realTimeMicro();
+
+  m_map = map;
+  m_mapSize = fileSize;
+  m_shardCount = header.shardCount;
+  m_discKey = header.discKey;
+  m_discNextValues = reinterpret_cast<const uint32_t *>(body);
+  m_sessionCount = size_t(header.sessionCount);
+  m_sessions = reinterpret_cast<const Session::SavedState *>(body + shardSize);
+  m_age = now >= header.saveTime ? now - header.saveTime : UINT64_MAX;
+  return true;
+}
+
+void SessionCheckpoint::Close()
+{
+  if (m_map)
+    ::munmap(m_map, m_mapSize);
+  m_map = NULL;
+  m_mapSize = 0;
+  m_shardCount = 0;
+  m_discNextValues = NULL;
+  m_sessionCount = 0;
+  m_sessions = NULL;
+}
@@ -0,0 +1,109 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   A file holding the state of every session, for resuming them after a
+   restart.
+
+ */
+#pragma once
+
+#include "Session.h"
+#include <vector>
+
+/**
+ * A file that holds what a restarted beacon needs to resume its sessions, so
+ * that their peers do not notice the restart. See Beacon::SetCheckpointFile().
+ *
+ * The file is a header, the discriminator allocator position of each shard, and
+ * a Session::SavedState for each session. Records are written as they are in
+ * memory, so a file can only be read by a build with the same layout, which the
+ * header checks. The file is memory mapped for both writing and reading, so
+ * that tens of thousands of sessions take milliseconds either way. It is written
+ * under a temporary name, and renamed into place, so a partial file is never
+ * read.
+ *
+ * Not thread safe, but once Open() has succeeded, the const members may be
+ * called from any thread.
+ */
+class SessionCheckpoint
+{
+public:
+  SessionCheckpoint();
+  ~SessionCheckpoint();
+
+  /**
+   * Writes a checkpoint file, replacing any that exists. Errors are logged.
+   *
+   * @param path [in] - The file.
+   * @param discKey [in] - The key that all shards' discriminator allocators
+   *                share.
+   * @param discNextValues [in] - The allocator position for each shard. The
+   *                       number of shards is its size.
+   * @param sessions [in] - The sessions of all shards.
+   *
+   * @return bool - false on failure.
+   */
+  static bool Write(const char *path, uint32_t discKey, const std::vector<uint32_t> &discNextValues,
+                    const std::vector<Session::SavedState> &sessions);
+
+  /**
+   * Maps and checks a checkpoint file. Errors, other than a missing file, are
+   * logged.
+   *
+   * @return bool - false if there is no valid checkpoint in the file.
+   */
+  bool Open(const char *path);
+
+  /**
+   * Unmaps the file. Records from GetSession() are no longer valid.
+   */
+  void Close();
+
+  bool IsOpen() const { return m_map != NULL;}
+
+  size_t GetShardCount() const { return m_shardCount;}
+  uint32_t GetDiscKey() const { return m_discKey;}
+  uint32_t GetDiscNextValue(size_t shard) const { return m_discNextValues[shard];}
+  size_t GetSessionCount() const { return m_sessionCount;}
+  const Session::SavedState& GetSession(size_t index) const { return m_sessions[index];}
+
+  /**
+   * @return uint64_t - Microseconds from when the file was written until it was
+   *         opened. UINT64_MAX if the real time clock went backwards.
+   */
+  uint64_t GetAge() const { return m_age;}
+
+private:
+  static const uint32_t Magic = 0x42464443; // "BFDC"
+  static const uint32_t Version = 2;
+
+  struct FileHeader
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;  // sizeof(FileHeader)
+    uint32_t recordSize;  // sizeof(Session::SavedState)
+    uint32_t shardCount;
+    uint32_t discKey;
+    uint64_t sessionCount;
+    uint64_t saveTime;    // Real time clock, in microseconds since the epoch.
+    uint32_t checksum;    // Of everything after the header.
+    uint32_t reserved;
+  };
+
+  static size_t shardBytes(size_t shardCount) { return (shardCount * sizeof(uint32_t) + 7) & ~size_t(7);}
+  static uint64_t realTimeMicro();
+
+  void *m_map;
+  size_t m_mapSize;
+  size_t m_shardCount;
+  uint32_t m_discKey;
+  const uint32_t *m_discNextValues;
+  size_t m_sessionCount;
+  const Session::SavedState *m_sessions;
+  uint64_t m_age;
+};
@@ -0,0 +1,137 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "SessionEvents.h"
+#include "utils.h"
+#include "Atomic.h"
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace std;
+
+const size_t SessionEventQueue::DefaultCapacity;
+
+SessionEventQueue::SessionEventQueue(size_t capacity, int types, int wakeFd) :
+   m_types(types),
+   m_wakeFd(wakeFd),
+   m_lock(true),
+   m_events(max(capacity, size_t(1))),
+   m_head(0),
+   m_count(0),
+   m_lostCount(0)
+{
+}
+
+bool SessionEventQueue::Push(const SessionEvent &event)
+{
+  bool wake;
+
+  {
+    AutoQuickLock lock(m_lock, true);
+
+    if (m_count == m_events.size())
+    {
+      m_lostCount++;
+      return false;
+    }
+
+    m_events[(m_head + m_count) % m_events.size()] = event;
+    m_count++;
+    wake = (m_count == 1);
+  }
+
+  if (wake)
+  {
+    char sig = 'x';
+    // A full pipe already has a wake pending.
+    if (::write(m_wakeFd, &sig, sizeof(sig)) < 0 && errno != EAGAIN)
+      gLog.LogError("Failed to signal event subscriber: %s", ErrnoToString());
+  }
+  return true;
+}
+
+bool SessionEventQueue::Pop(SessionEvent &outEvent)
+{
+  AutoQuickLock lock(m_lock, true);
+
+  if (m_count == 0)
+    return false;
+
+  outEvent = m_events[m_head];
+  m_head = (m_head + 1) % m_events.size();
+  m_count--;
+  return true;
+}
+
+uint32_t SessionEventQueue::TakeLostCount()
+{
+  AutoQuickLock lock(m_lock, true);
+
+  uint32_t lost = m_lostCount;
+  m_lostCount = 0;
+  return lost;
+}
+
+SessionEventHub::SessionEventHub() :
+   m_types(0),
+   m_lock(true)
+{
+}
+
+bool SessionEventHub::HasSubscribers(SessionEvent::Type::Value type)
+{
+  return (atomicLoad(&m_types) & type) != 0;
+}
+
+void SessionEventHub::Publish(const SessionEvent &event)
+{
+  AutoQuickLock lock(m_lock, true);
+
+  for (vector<SessionEventQueue *>::iterator it = m_queues.begin(); it != m_queues.end(); it++)
+  {
+    if ((*it)->WantsType(event.type))
+      (*it)->Push(event);
+  }
+}
+
+bool SessionEventHub::Subscribe(SessionEventQueue *queue)
+{
+  AutoQuickLock lock(m_lock, true);
+
+  try
+  {
+    m_queues.push_back(queue);
+  }
+  catch (std::bad_alloc &)
+  {
+    return false;
+  }
+  updateTypes();
+  return true;
+}
+
+void SessionEventHub::Unsubscribe(SessionEventQueue *queue)
+{
+  AutoQuickLock lock(m_lock, true);
+
+  vector<SessionEventQueue *>::iterator found = find(m_queues.begin(), m_queues.end(), queue);
+  if (found != m_queues.end())
+    m_queues.erase(found);
+  updateTypes();
+}
+
+/**
+ * Call with m_lock held.
+ */
+void SessionEventHub::updateTypes()
+{
+  int types = 0;
+
+  for (vector<SessionEventQueue *>::iterator it = m_queues.begin(); it != m_queues.end(); it++)
+    types |= (*it)->GetTypes();
+  atomicStore(&m_types, types);
+}
@@ -0,0 +1,157 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Session change events, passed from the scheduler threads to subscribers on
+   other threads.
+
+ */
+#pragma once
+
+#include "StatusTable.h"
+#include "threads.h"
+#include <vector>
+
+/**
+ * A single change to a session.
+ */
+struct SessionEvent
+{
+  struct Type
+  {
+    enum Value
+    {
+      State = 0x01, // Local state transition.
+      Parameters = 0x02, // Change to the transmit interval or detection time.
+      Removed = 0x04, // Session was deleted.
+    };
+  };
+
+  Type::Value type;
+  bfd::State::Value oldState; // Only for Type::State
+  timespec time; // Real (wall clock) time of the change.
+  SessionStatus status; // The session after the change.
+};
+
+/**
+ * A bounded queue of events for a single subscriber. Events are added on the
+ * scheduler threads, and removed on the subscriber's thread. When the queue is
+ * full new events are dropped and counted, so that the subscriber knows to
+ * resynchronize.
+ */
+class SessionEventQueue
+{
+public:
+  static const size_t DefaultCapacity = 4096;
+
+  /**
+   * @throw - std::bad_alloc
+   *
+   * @param capacity [in] - Maximum events held.
+   * @param types [in] - Bitwise 'or' of the SessionEvent::Type to receive.
+   * @param wakeFd [in] - A byte is written here when an event is added to an
+   *               empty queue. Should be non-blocking. The caller owns it.
+   */
+  SessionEventQueue(size_t capacity, int types, int wakeFd);
+
+  /**
+   * Adds an event, if the queue is not full.
+   *
+   * @Note can be called from any thread.
+   *
+   * @return bool - false if the event was dropped.
+   */
+  bool Push(const SessionEvent &event);
+
+  /**
+   * Removes the oldest event.
+   *
+   * @Note can be called from any thread.
+   *
+   * @return bool - false if there are no events.
+   */
+  bool Pop(SessionEvent &outEvent);
+
+  /**
+   * Gets the number of events dropped since the last call, and resets it.
+   *
+   * @Note can be called from any thread.
+   */
+  uint32_t TakeLostCount();
+
+  /**
+   * @Note can be called from any thread.
+   */
+  bool WantsType(SessionEvent::Type::Value type) const { return (m_types & type) != 0;}
+
+  /**
+   * @return int - Bitwise 'or' of the SessionEvent::Type wanted.
+   */
+  int GetTypes() const { return m_types;}
+
+private:
+  const int m_types;
+  const int m_wakeFd;
+
+  // The items in this block are protected by m_lock.
+  QuickLock m_lock;
+  std::vector<SessionEvent> m_events; // Ring buffer.
+  size_t m_head;  // Oldest event
+  size_t m_count;
+  uint32_t m_lostCount;
+};
+
+/**
+ * Passes events to all subscribed queues. Publishing costs a single atomic
+ * read when there are no subscribers for the type.
+ */
+class SessionEventHub
+{
+public:
+  SessionEventHub();
+
+  /**
+   * @Note can be called from any thread.
+   *
+   * @return bool - true if Publish() of the type would reach any queue.
+   */
+  bool HasSubscribers(SessionEvent::Type::Value type);
+
+  /**
+   * Adds the event to every queue that wants it.
+   *
+   * @Note can be called from any thread.
+   */
+  void Publish(const SessionEvent &event);
+
+  /**
+   * Starts passing events to the queue.
+   *
+   * @Note can be called from any thread.
+   *
+   * @param queue [in] - Not owned. Must remain valid until Unsubscribe().
+   *
+   * @return bool - false on failure.
+   */
+  bool Subscribe(SessionEventQueue *queue);
+
+  /**
+   * Stops passing events to the queue. Once this returns, no thread is
+   * accessing the queue through the hub.
+   *
+   * @Note can be called from any thread.
+   */
+  void Unsubscribe(SessionEventQueue *queue);
+
+private:
+  void updateTypes();
+
+  int m_types; // Types wanted by any queue. Read atomically without the lock.
+
+  // The items in this block are protected by m_lock.
+  QuickLock m_lock;
+  std::vector<SessionEventQueue *> m_queues;
+};
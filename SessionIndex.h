@@ -0,0 +1,94 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Keys and hashes for finding sessions in a FlatIndex.
+
+ */
+#pragma once
+
+#include "FlatIndex.h"
+#include "AddrKey.h"
+#include "lookup3.h"
+
+/**
+ * Hash for both discriminators and session ids. These are often sequential, or
+ * share low bits, so they are mixed. This is the MurmurHash3 finalizer, which
+ * is reversible, so different values always have different hashes.
+ */
+inline uint32_t HashSessionNumber(uint32_t value)
+{
+  value ^= value >> 16;
+  value *= 0x85ebca6b;
+  value ^= value >> 13;
+  value *= 0xc2b2ae35;
+  value ^= value >> 16;
+  return value;
+}
+
+/**
+ * Hash for a remote and local address pair. Unlike adding the address hashes,
+ * swapping the addresses gives a different hash.
+ */
+inline uint32_t HashAddressPair(const AddrKey &remoteAddr, const AddrKey &localAddr)
+{
+  uint32_t hashes[2] = { remoteAddr.Hash(), localAddr.Hash()};
+  return hashword(hashes, 2);
+}
+
+inline uint32_t HashAddressPair(const IpAddr &remoteAddr, const IpAddr &localAddr)
+{
+  return HashAddressPair(AddrKey(remoteAddr), AddrKey(localAddr));
+}
+
+/**
+ * A remote and local address, held by reference so that lookups do not copy
+ * the addresses.
+ */
+struct AddressPairKey
+{
+  AddressPairKey(const AddrKey &remoteAddr, const AddrKey &localAddr) : remoteAddr(remoteAddr), localAddr(localAddr) { }
+  const AddrKey &remoteAddr;
+  const AddrKey &localAddr;
+};
+
+/**
+ * FlatIndex traits for lookup by local discriminator. T must have
+ * GetLocalDiscriminator().
+ */
+template<typename T> struct DiscIndexTraits
+{
+  typedef uint32_t Key;
+  static const bool UniqueHash = true;
+  static uint32_t Hash(uint32_t disc) { return HashSessionNumber(disc);}
+  static bool Matches(T *item, uint32_t disc) { return item->GetLocalDiscriminator() == disc;}
+};
+
+/**
+ * FlatIndex traits for lookup by session id. T must have GetId().
+ */
+template<typename T> struct IdIndexTraits
+{
+  typedef uint32_t Key;
+  static const bool UniqueHash = true;
+  static uint32_t Hash(uint32_t id) { return HashSessionNumber(id);}
+  static bool Matches(T *item, uint32_t id) { return item->GetId() == id;}
+};
+
+/**
+ * FlatIndex traits for lookup by address pair. T must have GetRemoteKey() and
+ * GetLocalKey().
+ */
+template<typename T> struct AddressIndexTraits
+{
+  typedef AddressPairKey Key;
+  static const bool UniqueHash = false;
+  static uint32_t Hash(const AddressPairKey &key) { return HashAddressPair(key.remoteAddr, key.localAddr);}
+  static bool Matches(T *item, const AddressPairKey &key)
+  {
+    return item->GetRemoteKey() == key.remoteAddr && item->GetLocalKey() == key.localAddr;
+  }
+};
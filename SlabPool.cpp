@@ -0,0 +1,83 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "SlabPool.h"
+#include <new>
+
+using namespace std;
+
+const size_t SlabPool::Alignment;
+
+SlabPool::SlabPool(size_t itemSize, size_t itemsPerSlab) :
+   m_itemSize((max(itemSize, sizeof(FreeItem)) + Alignment - 1) / Alignment * Alignment),
+   m_itemsPerSlab(max(itemsPerSlab, size_t(1))),
+   m_freeList(NULL),
+   m_inUse(0)
+{
+}
+
+SlabPool::~SlabPool()
+{
+  for (vector<char *>::iterator it = m_slabs.begin(); it != m_slabs.end(); ++it)
+    ::operator delete(*it);
+}
+
+void* SlabPool::Allocate()
+{
+  if (!m_freeList)
+    addSlab();
+
+  FreeItem *item = m_freeList;
+  m_freeList = item->next;
+  m_inUse++;
+  return item;
+}
+
+void SlabPool::Free(void *item)
+{
+  if (!item)
+    return;
+
+  FreeItem *freeItem = reinterpret_cast<FreeItem *>(item);
+  freeItem->next = m_freeList;
+  m_freeList = freeItem;
+  m_inUse--;
+}
+
+void SlabPool::Reserve(size_t count)
+{
+  while (m_slabs.size() * m_itemsPerSlab < count)
+    addSlab();
+}
+
+void SlabPool::GetStats(Stats &outStats) const
+{
+  outStats.itemSize = m_itemSize;
+  outStats.inUse = m_inUse;
+  outStats.capacity = m_slabs.size() * m_itemsPerSlab;
+  outStats.slabBytes = outStats.capacity * m_itemSize;
+}
+
+/**
+ * Adds a slab, and puts all of its blocks on the free list. The blocks are
+ * listed in address order, so that they are handed out that way.
+ *
+ * @throw - std::bad_alloc
+ */
+void SlabPool::addSlab()
+{
+  m_slabs.reserve(m_slabs.size() + 1);
+  // operator new memory is aligned for any type.
+  char *slab = reinterpret_cast<char *>(::operator new(m_itemSize * m_itemsPerSlab));
+  m_slabs.push_back(slab);
+
+  for (size_t index = m_itemsPerSlab; index > 0; index--)
+  {
+    FreeItem *item = reinterpret_cast<FreeItem *>(slab + (index - 1) * m_itemSize);
+    item->next = m_freeList;
+    m_freeList = item;
+  }
+}
@@ -0,0 +1,90 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Fixed size object storage, allocated in large slabs.
+
+ */
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Hands out fixed size blocks of memory that are carved from large slabs, so
+ * that many small objects are packed together, rather than scattered across
+ * the heap. Freed blocks are kept for reuse, and slabs are only released when
+ * the pool is destroyed. Use placement new to construct objects in a block,
+ * and call the destructor explicitly before Free().
+ *
+ * Not thread safe.
+ */
+class SlabPool
+{
+public:
+  // Every block is aligned to this.
+  static const size_t Alignment = 16;
+
+  struct Stats
+  {
+    size_t itemSize;  // Bytes per block, including alignment padding.
+    size_t inUse;     // Blocks handed out.
+    size_t capacity;  // Blocks in all slabs.
+    size_t slabBytes; // Bytes in all slabs.
+  };
+
+  /**
+   * @param itemSize [in] - Size of each block.
+   * @param itemsPerSlab [in] - Blocks to allocate at a time.
+   */
+  SlabPool(size_t itemSize, size_t itemsPerSlab);
+
+  /**
+   * Releases all slabs, including any blocks that are still in use. Their
+   * destructors are not called.
+   */
+  ~SlabPool();
+
+  /**
+   * Gets an unused block.
+   *
+   * @throw - std::bad_alloc
+   *
+   * @return void* - Never NULL.
+   */
+  void* Allocate();
+
+  /**
+   * Returns a block from Allocate() for reuse.
+   *
+   * @param item [in] - May be NULL.
+   */
+  void Free(void *item);
+
+  /**
+   * Adds slabs until there are at least count blocks, so that Allocate() does
+   * not allocate memory until more than count are in use.
+   *
+   * @throw - std::bad_alloc
+   */
+  void Reserve(size_t count);
+
+  void GetStats(Stats &outStats) const;
+
+private:
+  struct FreeItem
+  {
+    FreeItem *next;
+  };
+
+  void addSlab();
+
+  size_t m_itemSize;
+  size_t m_itemsPerSlab;
+  std::vector<char *> m_slabs;
+  FreeItem *m_freeList;
+  size_t m_inUse;
+};
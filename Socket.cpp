@@ -266,6 +266,16 @@ bool Socket::SetReusePort(bool reuse)
   return setIntSockOpt(SOL_SOCKET, SO_REUSEADDR, "SO_REUSEADDR", reuse ? 1 : 0);
 }
 
+bool Socket::SetSharePort(bool share)
+{
+#ifdef SO_REUSEPORT
+  return setIntSockOpt(SOL_SOCKET, SO_REUSEPORT, "SO_REUSEPORT", share ? 1 : 0);
+#else
+  (void)share;
+  return setErrorAndLog(ENOTSUP, "Platform does not support SO_REUSEPORT");
+#endif
+}
+
 bool Socket::SetSendBufferSize(int bufsize)
 {
   return setIntSockOpt(SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", bufsize);
@@ -291,6 +301,15 @@ bool Socket::SetUseTimestamp(bool timestamp)
   return setIntSockOpt(SOL_SOCKET, SO_TIMESTAMP, "SO_TIMESTAMP", timestamp ? 1 : 0);
 }
 
+bool Socket::SetReceiveTimestamp(bool receive)
+{
+#ifdef SO_TIMESTAMPNS
+  return setIntSockOpt(SOL_SOCKET, SO_TIMESTAMPNS, "SO_TIMESTAMPNS", receive ? 1 : 0);
+#else
+  return SetUseTimestamp(receive);
+#endif
+}
+
 bool Socket::SetTTLOrHops(int hops)
 {
   if (!ensureSocket())
@@ -546,7 +565,7 @@ bool Socket::SendMsgStream(struct msghdr *message, int flags /*0*/)
       //  Partial write to here
       message->msg_iov[whichIOVec].iov_len = thisLen - result;
       message->msg_iov[whichIOVec].iov_base = reinterpret_cast<uint8_t *>(message->msg_iov[whichIOVec].iov_base) + result;
-      result -= thisLen;
+      result = 0;
       break;
     }
     result -= thisLen;
@@ -664,6 +683,12 @@ size_t Socket::GetMaxControlSizeReceiveTTLOrHops()
 
 }
 
+size_t Socket::GetMaxControlSizeReceiveTimestamp()
+{
+  // SO_TIMESTAMPNS uses timespec, and SO_TIMESTAMP uses timeval.
+  return max(CMSG_SPACE(sizeof(timespec)), CMSG_SPACE(sizeof(timeval)));
+}
+
 size_t Socket::GetMaxControlSizeReceiveDestinationAddress()
 {
   // We could assume that in6_pktinfo is going to be the largest, but the
@@ -238,6 +238,14 @@ public:
    */
   bool SetReusePort(bool reuse);
 
+  /**
+   * Sets whether several sockets may bind to the same address and port, with
+   * incoming packets divided among them.
+   * See SO_REUSEPORT.
+   * @note Use GetLastError() for error code on failure.
+   */
+  bool SetSharePort(bool share);
+
   /**
    * Sets whether receive timestamp is included.
    * See SO_TIMESTAMP.
@@ -245,6 +253,19 @@ public:
    */
   bool SetUseTimestamp(bool timestamp);
 
+  /**
+   * Sets whether the time that each packet arrived is included, with the best
+   * resolution available. Uses SO_TIMESTAMPNS where available, and SO_TIMESTAMP
+   * otherwise. See RecvMsg::GetReceiveTime().
+   * @note Use GetLastError() for error code on failure.
+   */
+  bool SetReceiveTimestamp(bool receive);
+
+  /**
+   * @return size_t - Maximum needed control size when using SetReceiveTimestamp
+   */
+  static size_t GetMaxControlSizeReceiveTimestamp();
+
   /**
    * Sets send buffer size.
    * See SO_SNDBUF.
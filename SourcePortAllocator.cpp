@@ -0,0 +1,207 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "SourcePortAllocator.h"
+#include "Socket.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+const size_t SourcePortAllocator::MaxBindAttempts;
+const size_t SourcePortAllocator::PortCount;
+const size_t SourcePortAllocator::PortWords;
+const size_t SourcePortAllocator::SummaryWords;
+
+static const size_t NoPort = size_t(-1);
+
+SourcePortAllocator::PortSet::PortSet() :
+   cursor(rand() % PortCount)
+{
+  memset(freeBits, 0xff, sizeof(freeBits));
+  memset(summary, 0, sizeof(summary));
+
+  // Bits past the end of the range are never free.
+  if (PortCount % 64)
+    freeBits[PortWords - 1] = (uint64_t(1) << (PortCount % 64)) - 1;
+  for (size_t word = 0; word < PortWords; word++)
+    summary[word / 64] |= uint64_t(1) << (word % 64);
+}
+
+/**
+ * Finds the first free index at, or after, start, wrapping around to the
+ * beginning.
+ *
+ * @return size_t - NoPort if there are no free ports.
+ */
+size_t SourcePortAllocator::PortSet::findFree(size_t start) const
+{
+  size_t word = start / 64;
+  uint64_t bits = freeBits[word] & (~uint64_t(0) << (start % 64));
+  if (bits)
+    return word * 64 + __builtin_ctzll(bits);
+
+  // The summary finds the next word with a free port, without looking at each.
+  size_t nextWord = word + 1;
+  for (size_t pass = 0; pass < 2; pass++)
+  {
+    for (size_t summaryWord = nextWord / 64; summaryWord < SummaryWords; summaryWord++)
+    {
+      uint64_t words = summary[summaryWord];
+      if (summaryWord == nextWord / 64)
+        words &= ~uint64_t(0) << (nextWord % 64);
+      if (words)
+      {
+        size_t found = summaryWord * 64 + __builtin_ctzll(words);
+        return found * 64 + __builtin_ctzll(freeBits[found]);
+      }
+    }
+    nextWord = 0;
+  }
+
+  return NoPort;
+}
+
+void SourcePortAllocator::PortSet::markUsed(size_t index)
+{
+  size_t word = index / 64;
+
+  freeBits[word] &= ~(uint64_t(1) << (index % 64));
+  if (!freeBits[word])
+    summary[word / 64] &= ~(uint64_t(1) << (word % 64));
+}
+
+void SourcePortAllocator::PortSet::markFree(size_t index)
+{
+  size_t word = index / 64;
+
+  freeBits[word] |= uint64_t(1) << (index % 64);
+  summary[word / 64] |= uint64_t(1) << (word % 64);
+}
+
+SourcePortAllocator::SourcePortAllocator() :
+   m_lock(true)
+{
+}
+
+SourcePortAllocator::~SourcePortAllocator()
+{
+  for (PortSetMap::iterator it = m_portSets.begin(); it != m_portSets.end(); ++it)
+    delete it->second;
+}
+
+in_port_t SourcePortAllocator::Bind(Socket &socket, const IpAddr &localAddr, in_port_t preferredPort)
+{
+  in_port_t inUse[MaxBindAttempts];
+  size_t inUseCount = 0;
+  in_port_t result = 0;
+
+  if (!LogVerify(localAddr.IsValid()) || !LogVerify(!localAddr.IsAny()))
+    return 0;
+
+  // We need the socket to be quiet so we do not get warnings for each port tried.
+  RaiiObjCallVar<bool, Socket, bool, &Socket::SetQuiet> socketQuiet(&socket);
+  socketQuiet = socket.SetQuiet(true);
+
+  while (inUseCount < MaxBindAttempts)
+  {
+    in_port_t port = allocate(localAddr, inUseCount == 0 ? preferredPort : 0);
+    if (port == 0)
+    {
+      gLog.LogError("No free source port on %s for %s.", localAddr.ToString(), socket.LogName());
+      break;
+    }
+
+    if (socket.Bind(SockAddr(localAddr, port)))
+    {
+      result = port;
+      break;
+    }
+
+    int error = socket.GetLastError();
+    if (error != EAGAIN && error != EADDRINUSE)
+    {
+      gLog.LogError("Unable to bind %s to %s : (%d) %s", socket.LogName(),
+                    SockAddr(localAddr, port).ToString(false),
+                    error, SystemErrorToString(error));
+      Release(localAddr, port);
+      break;
+    }
+
+    // Used by another program. Hold it for now, so that it is not tried again.
+    inUse[inUseCount++] = port;
+  }
+
+  if (result == 0 && inUseCount == MaxBindAttempts)
+    gLog.LogError("Cant find valid send port on %s for %s after %zu tries.", localAddr.ToString(), socket.LogName(), inUseCount);
+
+  // These are only retried once the rotation comes back around.
+  for (size_t index = 0; index < inUseCount; index++)
+    Release(localAddr, inUse[index]);
+
+  return result;
+}
+
+/**
+ * Marks a free port as used.
+ *
+ * @return in_port_t - 0 if there are no free ports, or on failure.
+ */
+in_port_t SourcePortAllocator::allocate(const IpAddr &localAddr, in_port_t preferredPort)
+{
+  AutoQuickLock lock(m_lock, true);
+  PortSet *portSet;
+
+  PortSetMap::iterator found = m_portSets.find(localAddr);
+  if (found != m_portSets.end())
+    portSet = found->second;
+  else
+  {
+    try
+    {
+      Raii<PortSet>::Delete newSet(new PortSet);
+      m_portSets[localAddr] = newSet.val;
+      portSet = newSet.Detach();
+    }
+    catch (std::bad_alloc &)
+    {
+      return 0;
+    }
+  }
+
+  size_t index;
+  if (preferredPort >= bfd::MinSourcePort && portSet->isFree(preferredPort - bfd::MinSourcePort))
+    index = preferredPort - bfd::MinSourcePort;
+  else
+  {
+    index = portSet->findFree(portSet->cursor);
+    if (index == NoPort)
+      return 0;
+    portSet->cursor = (index + 1) % PortCount;
+  }
+
+  portSet->markUsed(index);
+  return in_port_t(bfd::MinSourcePort + index);
+}
+
+void SourcePortAllocator::Release(const IpAddr &localAddr, in_port_t port)
+{
+  AutoQuickLock lock(m_lock, true);
+
+  if (!LogVerify(port >= bfd::MinSourcePort))
+    return;
+
+  PortSetMap::iterator found = m_portSets.find(localAddr);
+  if (!LogVerify(found != m_portSets.end()))
+    return;
+
+  size_t index = port - bfd::MinSourcePort;
+  if (!LogVerify(!found->second->isFree(index)))
+    return;
+  found->second->markFree(index);
+}
@@ -0,0 +1,83 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Hands out source ports for outgoing control packets.
+
+ */
+#pragma once
+
+#include "bfd.h"
+#include "SockAddr.h"
+#include "threads.h"
+#include <map>
+
+class Socket;
+
+/**
+ * Tracks which ports in [bfd::MinSourcePort, bfd::MaxSourcePort] the beacon is
+ * using for each local address, so that sending sockets can be bound without
+ * probing the kernel one port at a time. Ports are handed out in rotation, so
+ * that a released port is not reused right away.
+ *
+ * Can be called from any thread.
+ */
+class SourcePortAllocator
+{
+public:
+  SourcePortAllocator();
+  ~SourcePortAllocator();
+
+  /**
+   * Binds the socket to a free source port on the local address. Ports that
+   * turn out to be used by another program are skipped. Will log failure.
+   *
+   * @param socket [in] - An open UDP socket.
+   * @param localAddr [in] - May not be 'any'.
+   * @param preferredPort [in] - Port to try first, if it is free. 0 for none.
+   *
+   * @return in_port_t - The bound port, or 0 on failure.
+   */
+  in_port_t Bind(Socket &socket, const IpAddr &localAddr, in_port_t preferredPort);
+
+  /**
+   * Returns a port from Bind(), for reuse. Call after the socket is closed, or
+   * when it will be closed shortly.
+   */
+  void Release(const IpAddr &localAddr, in_port_t port);
+
+private:
+  // Number of ports that are tried by Bind() before giving up.
+  static const size_t MaxBindAttempts = 64;
+
+  static const size_t PortCount = size_t(bfd::MaxSourcePort) - bfd::MinSourcePort + 1;
+  static const size_t PortWords = (PortCount + 63) / 64;
+  static const size_t SummaryWords = (PortWords + 63) / 64;
+
+  /**
+   * The ports of a single local address. A set bit is a free port.
+   */
+  struct PortSet
+  {
+    PortSet();
+    size_t findFree(size_t start) const;
+    void markUsed(size_t index);
+    void markFree(size_t index);
+    bool isFree(size_t index) const { return (freeBits[index / 64] >> (index % 64)) & 1;}
+
+    uint64_t freeBits[PortWords];
+    uint64_t summary[SummaryWords]; // A set bit for each word of freeBits that is not 0.
+    size_t cursor; // Next index to hand out, if free.
+  };
+
+  in_port_t allocate(const IpAddr &localAddr, in_port_t preferredPort);
+
+  typedef std::map<IpAddr, PortSet *, IpAddr::LessClass> PortSetMap;
+
+  // The items in this block are protected by m_lock.
+  QuickLock m_lock;
+  PortSetMap m_portSets;
+};
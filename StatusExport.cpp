@@ -0,0 +1,284 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "StatusExport.h"
+#include "Atomic.h"
+#include "SmartPointer.h"
+#include "TimeSpec.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const size_t RecordWords = sizeof(StatusExportRecord) / sizeof(uint32_t);
+
+StatusExport::StatusExport() :
+   m_map(NULL),
+   m_mapSize(0),
+   m_header(NULL),
+   m_shards(NULL),
+   m_records(NULL),
+   m_owner(false)
+{
+}
+
+StatusExport::~StatusExport()
+{
+  Close();
+}
+
+/**
+ * Records start on a cache line, so that no record shares one with the totals.
+ */
+size_t StatusExport::recordsOffset(size_t shardCount)
+{
+  size_t offset = sizeof(StatusExportHeader) + shardCount * sizeof(StatusExportShard);
+  return (offset + 63) & ~size_t(63);
+}
+
+bool StatusExport::Create(const char *path, size_t shardCount, size_t recordsPerShard, uint32_t refreshMs)
+{
+  char tempPath[PATH_MAX];
+
+  Close();
+
+  // Words are copied one at a time, see Write().
+  LogAssert(sizeof(StatusExportRecord) % sizeof(uint64_t) == 0);
+
+  if (!LogVerify(shardCount != 0 && recordsPerShard != 0 && recordsPerShard <= UINT32_MAX))
+    return false;
+
+  size_t offset = recordsOffset(shardCount);
+  size_t fileSize = offset + shardCount * recordsPerShard * sizeof(StatusExportRecord);
+
+  if (!path)
+  {
+    void *map = ::mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+      gLog.ErrnoError(errno, "Failed to map status export memory");
+      return false;
+    }
+    initialize(map, fileSize, shardCount, recordsPerShard, refreshMs);
+    return true;
+  }
+
+  if (size_t(snprintf(tempPath, sizeof(tempPath), "%s.tmp", path)) >= sizeof(tempPath))
+  {
+    gLog.LogError("Status export file name %s is too long.", path);
+    return false;
+  }
+
+  // Readers need only read access. The file is built under another name, so
+  // that a reader never maps it half made.
+  FileDescriptor file(::open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0644));
+  if (!file.IsValid())
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to create status export file %s", tempPath));
+    return false;
+  }
+
+  if (0 != ::ftruncate(file, off_t(fileSize)))
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to size status export file %s", tempPath));
+    ::unlink(tempPath);
+    return false;
+  }
+
+  void *map = ::mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (map == MAP_FAILED)
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to map status export file %s", tempPath));
+    ::unlink(tempPath);
+    return false;
+  }
+
+  initialize(map, fileSize, shardCount, recordsPerShard, refreshMs);
+
+  if (0 != ::rename(tempPath, path))
+  {
+    gLog.ErrnoError(errno, FormatShortStr("Failed to rename status export file to %s", path));
+    Close();
+    ::unlink(tempPath);
+    return false;
+  }
+
+  m_owner = true;
+  m_path = path;
+  return true;
+}
+
+/**
+ * Fills in the header of a new, zeroed, map, and takes it over.
+ */
+void StatusExport::initialize(void *map, size_t mapSize, size_t shardCount, size_t recordsPerShard, uint32_t refreshMs)
+{
+  // A new map is all zeros, which is an unused record, and zero totals.
+  StatusExportHeader *header = reinterpret_cast<StatusExportHeader *>(map);
+  TimeSpec now(TimeSpec::RealNow());
+  header->version = StatusExportVersion;
+  header->headerSize = sizeof(StatusExportHeader);
+  header->shardSize = sizeof(StatusExportShard);
+  header->recordSize = sizeof(StatusExportRecord);
+  header->shardCount = uint32_t(shardCount);
+  header->recordsPerShard = uint32_t(recordsPerShard);
+  header->pid = uint32_t(getpid());
+  header->recordsOffset = recordsOffset(shardCount);
+  header->startTime = uint64_t(now.tv_sec) * 1000000 + uint64_t(now.tv_nsec / 1000);
+  header->refreshMs = refreshMs;
+  atomicStore(&header->magic, StatusExportMagic);
+
+  m_map = map;
+  m_mapSize = mapSize;
+  m_header = header;
+  m_shards = reinterpret_cast<StatusExportShard *>(header + 1);
+  m_records = reinterpret_cast<StatusExportRecord *>(reinterpret_cast<uint8_t *>(map) + header->recordsOffset);
+  m_owner = false;
+}
+
+bool StatusExport::Attach(const char *path, const char **outError)
+{
+  struct stat info;
+  const char *error = NULL;
+
+  Close();
+
+  FileDescriptor file(::open(path, O_RDONLY));
+  if (!file.IsValid() || 0 != ::fstat(file, &info))
+    error = SystemErrorToString(errno);
+  else if (info.st_size < off_t(sizeof(StatusExportHeader)))
+    error = "file is too short";
+
+  void *map = MAP_FAILED;
+  if (!error)
+  {
+    map = ::mmap(NULL, size_t(info.st_size), PROT_READ, MAP_SHARED, file, 0);
+    if (map == MAP_FAILED)
+      error = SystemErrorToString(errno);
+  }
+
+  if (!error)
+  {
+    const StatusExportHeader *header = reinterpret_cast<const StatusExportHeader *>(map);
+    size_t fileSize = size_t(info.st_size);
+
+    if (atomicLoad(const_cast<uint32_t *>(&header->magic)) != StatusExportMagic)
+      error = "not a status export file";
+    else if (header->version != StatusExportVersion
+             || header->headerSize != sizeof(StatusExportHeader)
+             || header->shardSize != sizeof(StatusExportShard)
+             || header->recordSize != sizeof(StatusExportRecord))
+      error = "written by a different version";
+    else if (header->shardCount == 0
+             || header->recordsOffset != recordsOffset(header->shardCount)
+             || fileSize < header->recordsOffset
+             || (fileSize - header->recordsOffset) / sizeof(StatusExportRecord) / header->shardCount < header->recordsPerShard)
+      error = "file has the wrong size";
+    else
+    {
+      m_map = map;
+      m_mapSize = fileSize;
+      m_header = const_cast<StatusExportHeader *>(header);
+      m_shards = reinterpret_cast<StatusExportShard *>(m_header + 1);
+      m_records = reinterpret_cast<StatusExportRecord *>(reinterpret_cast<uint8_t *>(map) + header->recordsOffset);
+      m_owner = false;
+      return true;
+    }
+    ::munmap(map, size_t(info.st_size));
+  }
+
+  if (outError)
+    *outError = error;
+  return false;
+}
+
+void StatusExport::Close()
+{
+  if (m_map)
+  {
+    if (m_owner && 0 != ::unlink(m_path.c_str()))
+      gLog.ErrnoError(errno, FormatShortStr("Failed to delete status export file %s", m_path.c_str()));
+    ::munmap(m_map, m_mapSize);
+  }
+  m_map = NULL;
+  m_mapSize = 0;
+  m_header = NULL;
+  m_shards = NULL;
+  m_records = NULL;
+  m_owner = false;
+  m_path.clear();
+}
+
+StatusExportShard* StatusExport::GetShard(size_t shard)
+{
+  if (!m_header || shard >= m_header->shardCount)
+    return NULL;
+  return m_shards + shard;
+}
+
+StatusExportRecord* StatusExport::GetRecord(size_t shard, size_t index)
+{
+  if (!m_header || shard >= m_header->shardCount || index >= m_header->recordsPerShard)
+    return NULL;
+  return m_records + shard * m_header->recordsPerShard + index;
+}
+
+// static
+void StatusExport::Write(StatusExportRecord &record, const StatusExportRecord &content)
+{
+  uint32_t *dest = reinterpret_cast<uint32_t *>(&record);
+  const uint32_t *src = reinterpret_cast<const uint32_t *>(&content);
+  uint32_t sequence = record.sequence; // Only this thread writes.
+
+  atomicStore(&record.sequence, sequence + 1);
+  atomicFence();
+  // Word by word, so that a reader that overlaps the writer sees a merely
+  // inconsistent copy, which the sequence check catches.
+  for (size_t index = 1; index < RecordWords; index++)
+    atomicStoreRelaxed(dest + index, src[index]);
+  atomicStore(&record.sequence, sequence + 2);
+}
+
+// static
+void StatusExport::Clear(StatusExportRecord &record)
+{
+  StatusExportRecord empty;
+  memset(&empty, 0, sizeof(empty));
+  Write(record, empty);
+}
+
+// static
+bool StatusExport::Read(const StatusExportRecord &record, StatusExportRecord &outContent)
+{
+  uint32_t *src = reinterpret_cast<uint32_t *>(const_cast<StatusExportRecord *>(&record));
+  uint32_t *dest = reinterpret_cast<uint32_t *>(&outContent);
+
+  for (uint32_t tries = 1; tries <= 10000; tries++)
+  {
+    uint32_t sequence = atomicLoad(src);
+    if ((sequence & 1) == 0)
+    {
+      for (size_t index = 1; index < RecordWords; index++)
+        atomicStoreRelaxed(dest + index, atomicLoadRelaxed(src + index));
+      atomicFence();
+      if (atomicLoad(src) == sequence)
+      {
+        outContent.sequence = sequence;
+        return true;
+      }
+    }
+    if (tries % 64 == 0)
+      sched_yield();
+  }
+  return false;
+}
@@ -0,0 +1,191 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Session status in a memory mapped file, for local monitoring agents. See
+   the --statusexport option in the bfdd-beacon man page.
+
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// Version of the layout below. Readers must check it, and the sizes in the
+// header, before using the file.
+const uint32_t StatusExportVersion = 1;
+const uint32_t StatusExportMagic = 0x42464453; // "BFDS"
+
+/**
+ * The start of the file. Written once, when the file is created. magic is
+ * written last, so a reader that sees it sees the rest.
+ */
+struct StatusExportHeader
+{
+  uint32_t magic;           // StatusExportMagic
+  uint32_t version;         // StatusExportVersion
+  uint32_t headerSize;      // sizeof(StatusExportHeader)
+  uint32_t shardSize;       // sizeof(StatusExportShard)
+  uint32_t recordSize;      // sizeof(StatusExportRecord)
+  uint32_t shardCount;      // A StatusExportShard follows the header for each.
+  uint32_t recordsPerShard; // Records for shard n start at record n * recordsPerShard.
+  uint32_t pid;             // Of the beacon.
+  uint64_t recordsOffset;   // File offset of the first record.
+  uint64_t startTime;       // When the file was created, in microseconds since the epoch.
+  uint32_t refreshMs;       // Counters in every used record are rewritten about this often.
+  uint32_t reserved[5];
+};
+
+/**
+ * Per shard totals. Each is a naturally aligned word written by the shard's
+ * thread only, so each can be read on its own, without a lock.
+ */
+struct StatusExportShard
+{
+  uint64_t sessions;    // Sessions with a record.
+  uint64_t missing;     // Sessions that did not fit in the shard's records.
+  uint64_t refreshTime; // CLOCK_MONOTONIC nanoseconds at the last counter refresh pass.
+  uint64_t reserved[5];
+};
+
+/**
+ * The status of one session. All values are in host order.
+ *
+ * The beacon updates a record in place, guarded by sequence: it is odd while
+ * the record is being written. To read a record, read sequence, and retry if it
+ * is odd; copy the record; then read sequence again, after a read barrier, and
+ * retry if it changed. The writer never waits, so a retry succeeds right away.
+ */
+struct StatusExportRecord
+{
+  struct Flag
+  {
+    enum Value
+    {
+      Active = 0x01,       // Active role. Otherwise passive.
+      HoldingState = 0x02, // State is forced with "session state".
+      Suspended = 0x04,
+      HasUptime = 0x08,    // lastChange is valid.
+      UptimeForced = 0x10, // The current state was forced.
+    };
+  };
+
+  uint32_t sequence;
+  uint32_t id;            // 0 for an unused record.
+  uint32_t localDisc;
+  uint32_t remoteDisc;
+  uint8_t localAddr[16];  // IPv4 addresses use the first 4 bytes.
+  uint8_t remoteAddr[16];
+  uint8_t localFamily;    // 4 or 6
+  uint8_t remoteFamily;
+  uint8_t localState;     // bfd::State
+  uint8_t localDiag;      // bfd::Diag
+  uint8_t remoteState;
+  uint8_t remoteDiag;
+  uint8_t flags;          // Flag
+  uint8_t reserved1;
+  uint32_t transmitInterval; // Current transmit interval, in microseconds.
+  uint32_t reserved2;
+  uint64_t detectionTime; // Current receive timeout, in microseconds.
+  uint64_t lastChange;    // CLOCK_MONOTONIC nanoseconds when the current state was entered.
+  uint64_t updateTime;    // CLOCK_MONOTONIC nanoseconds when the record was written.
+  uint64_t received;      // Control packets passed to the session.
+  uint64_t sent;          // Control packets sent.
+  uint64_t discarded;     // Of received, packets that the session discarded.
+  uint64_t stateChanges;
+  uint64_t pollSequences;
+  uint64_t reserved3[2];
+};
+
+/**
+ * The memory mapped status file. The beacon uses Create(), and writes records
+ * with Write(). A reader uses Attach(), and reads records with Read().
+ *
+ * Not thread safe, except that each shard may write its own records and totals.
+ */
+class StatusExport
+{
+public:
+  StatusExport();
+  ~StatusExport();
+
+  /**
+   * Creates the file, replacing any that exists, and maps it. All records are
+   * unused. Errors are logged.
+   *
+   * @param path [in] - The file. Usually in /dev/shm, so that it is never
+   *             written to disk. NULL for memory that only this process, and
+   *             its threads, can read.
+   * @param refreshMs [in] - See StatusExportHeader::refreshMs.
+   *
+   * @return bool - false on failure.
+   */
+  bool Create(const char *path, size_t shardCount, size_t recordsPerShard, uint32_t refreshMs);
+
+  /**
+   * Maps an existing file for reading, and checks its layout.
+   *
+   * @param outError [out] - Why it failed. May be NULL.
+   *
+   * @return bool - false on failure.
+   */
+  bool Attach(const char *path, const char **outError = NULL);
+
+  /**
+   * Unmaps the file. If it was made with Create(), it is also deleted, so that
+   * readers do not mistake it for a running beacon.
+   */
+  void Close();
+
+  bool IsOpen() const { return m_map != NULL;}
+
+  const StatusExportHeader* GetHeader() const { return m_header;}
+  size_t GetShardCount() const { return m_header ? m_header->shardCount : 0;}
+  size_t GetRecordsPerShard() const { return m_header ? m_header->recordsPerShard : 0;}
+
+  /**
+   * @return StatusExportShard* - NULL if shard is out of range.
+   */
+  StatusExportShard* GetShard(size_t shard);
+
+  /**
+   * @return StatusExportRecord* - NULL if shard or index is out of range.
+   */
+  StatusExportRecord* GetRecord(size_t shard, size_t index);
+
+  /**
+   * Replaces the contents of a record, for readers on any thread or process.
+   * Call only from the one thread that owns the record.
+   *
+   * @param content [in] - The new content. sequence is ignored.
+   */
+  static void Write(StatusExportRecord &record, const StatusExportRecord &content);
+
+  /**
+   * Marks a record as unused.
+   */
+  static void Clear(StatusExportRecord &record);
+
+  /**
+   * Makes a consistent copy of a record.
+   *
+   * @return bool - false if the record kept changing, which should not happen.
+   */
+  static bool Read(const StatusExportRecord &record, StatusExportRecord &outContent);
+
+private:
+  static size_t recordsOffset(size_t shardCount);
+  void initialize(void *map, size_t mapSize, size_t shardCount, size_t recordsPerShard, uint32_t refreshMs);
+
+  void *m_map;
+  size_t m_mapSize;
+  StatusExportHeader *m_header;
+  StatusExportShard *m_shards;
+  StatusExportRecord *m_records;
+  bool m_owner; // From Create() with a file.
+  std::string m_path; // Only for Create()
+};
@@ -0,0 +1,78 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Binary records sent by the beacon in reply to "status ... binary". See the
+   bfdd-control man page.
+
+ */
+#pragma once
+
+#include <stdint.h>
+
+// Version of the records below. Fields are only ever added to the end of a
+// record, so readers should use the record length to skip unknown data.
+const uint8_t StatusRecordVersion = 1;
+
+struct StatusRecordType
+{
+  enum Value
+  {
+    Session = 1,  // StatusSessionRecord
+    End = 2,      // StatusEndRecord. Always the last record.
+  };
+};
+
+// All values are in network order.
+#pragma pack(push, 1)
+struct StatusRecordHeader
+{
+  uint16_t length;  // Length of the whole record, including this header.
+  uint8_t type;     // StatusRecordType
+  uint8_t version;  // StatusRecordVersion
+};
+
+struct StatusSessionRecord
+{
+  struct Flag
+  {
+    enum Value
+    {
+      Active = 0x01,  // Active role. Otherwise passive.
+      HoldingState = 0x02, // State is forced with "session state".
+      Suspended = 0x04,
+      HasUptime = 0x08, // uptimeState and uptimeMs are valid.
+      UptimeForced = 0x10,
+    };
+  };
+
+  StatusRecordHeader header;
+  uint32_t id;
+  uint32_t localDisc;
+  uint32_t remoteDisc;
+  uint8_t localState;   // bfd::State
+  uint8_t localDiag;    // bfd::Diag
+  uint8_t remoteState;
+  uint8_t remoteDiag;
+  uint8_t flags;        // Flag
+  uint8_t localFamily;  // 4 or 6
+  uint8_t remoteFamily;
+  uint8_t uptimeState;  // The state being timed by uptimeMs.
+  uint8_t localAddr[16];  // IPv4 addresses use the first 4 bytes.
+  uint8_t remoteAddr[16];
+  uint32_t transmitInterval;  // Current transmit interval, in microseconds.
+  uint32_t detectionTimeHi;   // Current receive timeout, in microseconds.
+  uint32_t detectionTimeLo;
+  uint32_t uptimeMsHi;        // Milliseconds spent in uptimeState.
+  uint32_t uptimeMsLo;
+};
+
+struct StatusEndRecord
+{
+  StatusRecordHeader header;
+  uint32_t sessionCount;  // Number of StatusSessionRecord sent.
+};
+#pragma pack(pop)
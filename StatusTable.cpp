@@ -0,0 +1,208 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "StatusTable.h"
+#include "Atomic.h"
+#include <string.h>
+#include <sched.h>
+
+using namespace std;
+
+const size_t SessionStatusTable::NoSlot;
+const size_t SessionStatusTable::ChunkSize;
+const size_t SessionStatusTable::MaxChunks;
+const size_t SessionStatusTable::StatusWords;
+
+void SessionStatus::Clear()
+{
+  memset(this, 0, sizeof(*this));
+}
+
+void SessionStatus::setAddress(Address &outAddress, const IpAddr &addr)
+{
+  outAddress.length = addr.GetSize();
+  if (!LogVerify(outAddress.length <= sizeof(outAddress.in6)))
+    outAddress.length = sizeof(outAddress.in6);
+  memcpy(&outAddress.sa, &addr.GetSockAddr(), outAddress.length);
+}
+
+SessionStatusTable::SessionStatusTable() :
+   m_chunkCount(0),
+   m_nextSlot(0),
+   m_missingCount(0)
+{
+  // copyStatus() moves whole words.
+  LogAssert(sizeof(SessionStatus) % sizeof(uint32_t) == 0);
+}
+
+SessionStatusTable::~SessionStatusTable()
+{
+  for (size_t index = 0; index < m_chunkCount; index++)
+    delete [] m_chunks[index];
+}
+
+size_t SessionStatusTable::Allocate()
+{
+  size_t slot;
+
+  if (!m_freeSlots.empty())
+  {
+    slot = m_freeSlots.back();
+    m_freeSlots.pop_back();
+    return slot;
+  }
+
+  if (m_nextSlot == m_chunkCount * ChunkSize && !addChunk())
+  {
+    gLog.LogError("Session status table full. Status will be gathered from the scheduler.");
+    atomicFetchAdd(&m_missingCount, uint32_t(1));
+    return NoSlot;
+  }
+
+  return m_nextSlot++;
+}
+
+bool SessionStatusTable::Reserve(size_t count)
+{
+  try
+  {
+    m_freeSlots.reserve(count);
+  }
+  catch (std::bad_alloc &)
+  {
+    return false;
+  }
+
+  while (m_chunkCount * ChunkSize < count)
+  {
+    if (!addChunk())
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Adds a chunk of empty slots.
+ *
+ * @return bool - false if the table is at its limit, or memory ran out.
+ */
+bool SessionStatusTable::addChunk()
+{
+  Slot *chunk = NULL;
+
+  if (m_chunkCount >= MaxChunks)
+    return false;
+
+  try
+  {
+    chunk = new Slot[ChunkSize];
+  }
+  catch (std::bad_alloc &)
+  {
+    return false;
+  }
+
+  memset(chunk, 0, sizeof(Slot) * ChunkSize);
+  m_chunks[m_chunkCount] = chunk;
+  // Readers use m_chunkCount to find the chunks, so it must be set last.
+  atomicStore(&m_chunkCount, m_chunkCount + 1);
+  return true;
+}
+
+void SessionStatusTable::Free(size_t slot)
+{
+  if (slot == NoSlot)
+  {
+    atomicFetchAdd(&m_missingCount, uint32_t(-1));
+    return;
+  }
+
+  SessionStatus empty;
+  empty.Clear();
+  Write(slot, empty);
+
+  try
+  {
+    m_freeSlots.push_back(slot);
+  }
+  catch (std::bad_alloc &)
+  {
+    // The slot is lost, but remains cleared.
+  }
+}
+
+void SessionStatusTable::Write(size_t slot, const SessionStatus &status)
+{
+  Slot &entry = getSlot(slot);
+  uint32_t sequence = entry.sequence; // Only this thread writes.
+
+  atomicStore(&entry.sequence, sequence + 1);
+  atomicFence();
+  copyStatus(entry.status, status);
+  atomicStore(&entry.sequence, sequence + 2);
+}
+
+bool SessionStatusTable::Read(std::vector<SessionStatus> &outList)
+{
+  return Visit(addToList, &outList);
+}
+
+void SessionStatusTable::addToList(const SessionStatus &status, void *userdata)
+{
+  reinterpret_cast<std::vector<SessionStatus> *>(userdata)->push_back(status);
+}
+
+bool SessionStatusTable::Visit(Visitor visitor, void *userdata)
+{
+  size_t chunkCount = atomicLoad(&m_chunkCount);
+  SessionStatus status;
+
+  for (size_t chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++)
+  {
+    Slot *chunk = m_chunks[chunkIndex];
+    for (size_t index = 0; index < ChunkSize; index++)
+    {
+      Slot &entry = chunk[index];
+      for (uint32_t tries = 1;; tries++)
+      {
+        uint32_t sequence = atomicLoad(&entry.sequence);
+        if ((sequence & 1) == 0)
+        {
+          copyStatus(status, entry.status);
+          atomicFence();
+          if (atomicLoad(&entry.sequence) == sequence)
+            break;
+        }
+        // The writer never waits, so it will be done very soon.
+        if (tries % 64 == 0)
+          sched_yield();
+      }
+
+      if (status.id != 0)
+        visitor(status, userdata);
+    }
+  }
+
+  return IsComplete();
+}
+
+bool SessionStatusTable::IsComplete()
+{
+  return atomicLoad(&m_missingCount) == 0;
+}
+
+/**
+ * Copies the status one word at a time, so that a copy made while the writer
+ * is active is merely inconsistent, which the sequence check catches.
+ */
+void SessionStatusTable::copyStatus(SessionStatus &outStatus, const SessionStatus &status)
+{
+  uint32_t *dest = reinterpret_cast<uint32_t *>(&outStatus);
+  uint32_t *src = reinterpret_cast<uint32_t *>(const_cast<SessionStatus *>(&status));
+
+  for (size_t index = 0; index < StatusWords; index++)
+    atomicStoreRelaxed(dest + index, atomicLoadRelaxed(src + index));
+}
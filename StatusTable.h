@@ -0,0 +1,187 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Session status published by the scheduler thread, for readers on other
+   threads.
+
+ */
+#pragma once
+
+#include "bfd.h"
+#include "SockAddr.h"
+#include "TimeSpec.h"
+#include <vector>
+
+/**
+ * A snapshot of the state of a single session. This holds everything that the
+ * control "status" command shows, up to level 3. Only the most recent state
+ * transition is included.
+ *
+ * This is plain data, so that it can be copied word by word, and compared with
+ * memcmp(). Always Clear() before filling it in, so that padding is zeroed.
+ */
+struct SessionStatus
+{
+  void Clear();
+
+  void SetRemoteAddress(const IpAddr &addr) { setAddress(remoteAddress, addr);}
+  IpAddr GetRemoteAddress() const { return IpAddr(&remoteAddress.sa, remoteAddress.length);}
+  void SetLocalAddress(const IpAddr &addr) { setAddress(localAddress, addr);}
+  IpAddr GetLocalAddress() const { return IpAddr(&localAddress.sa, localAddress.length);}
+
+  struct Address
+  {
+    union
+    {
+      sockaddr sa;
+      sockaddr_in in4;
+      sockaddr_in6 in6;
+    };
+    socklen_t length;
+  };
+
+  uint32_t id; // Human readable id. 0 for an unused slot.
+  uint32_t localDisc;
+  uint32_t remoteDisc;
+  Address remoteAddress;
+  Address localAddress;
+  bool isActiveSession; //active or passive role.
+  bool isHoldingState;
+  bool isSuspended;
+  bool hasUptime;  // Are uptimeState, uptimeForced and uptimeStart valid.
+  bool uptimeForced;  // For the current state. See Session::UptimeInfo.
+  bfd::State::Value localState;
+  bfd::Diag::Value localDiag;
+  bfd::State::Value remoteState;
+  bfd::Diag::Value remoteDiag;
+  bfd::State::Value uptimeState; // The current state, as in Session::UptimeInfo.
+  uint32_t transmitInterval;  // scheduled transmit interval
+  uint64_t detectionTime; // Current detection time for timeouts
+  timespec uptimeStart; // When uptimeState was entered. See TimeSpec::MonoNow().
+
+private:
+  static void setAddress(Address &outAddress, const IpAddr &addr);
+};
+
+/**
+ * Holds a SessionStatus for each session on a shard. Each entry is guarded by
+ * a sequence lock, so that the scheduler thread can update it without ever
+ * waiting, and readers on other threads can copy it without ever stopping the
+ * scheduler.
+ *
+ * Entries are allocated in fixed size chunks that are never moved or freed
+ * until the table is destroyed, so a reader never sees storage disappear.
+ *
+ * Unless otherwise specified, all calls must be made on the owning scheduler's
+ * main thread.
+ */
+class SessionStatusTable
+{
+public:
+  static const size_t NoSlot = size_t(-1);
+  static const size_t ChunkSize = 1024;
+  static const size_t MaxChunks = 4096;  // Slots per shard is ChunkSize * MaxChunks.
+
+  /**
+   * Called by Visit() for each session.
+   *
+   * @param status [in] - A consistent copy of the status of one session. Valid
+   *               only during the call.
+   * @param userdata [in] - As passed to Visit().
+   */
+  typedef void (*Visitor)(const SessionStatus &status, void *userdata);
+
+  SessionStatusTable();
+  ~SessionStatusTable();
+
+  /**
+   * Allocates an unused slot.
+   *
+   * @return size_t - The slot, or NoSlot if the table is full or memory runs out.
+   *         Free() must still be called with NoSlot when the session is
+   *         removed, so that readers know when the table is complete again.
+   */
+  size_t Allocate();
+
+  /**
+   * Allocates room for count slots, so that Allocate() does not allocate memory
+   * until more than count are in use.
+   *
+   * @return bool - false if the table can not hold that many, or memory ran out.
+   *         Whatever room was allocated is kept.
+   */
+  bool Reserve(size_t count);
+
+  /**
+   * Clears the slot and makes it available to Allocate().
+   *
+   * @param slot [in] - A value returned from Allocate(), which may be NoSlot.
+   */
+  void Free(size_t slot);
+
+  /**
+   * Publishes new status for a slot.
+   *
+   * @param slot [in] - A value returned from Allocate(). May not be NoSlot.
+   * @param status [in] - The status. id should not be 0.
+   */
+  void Write(size_t slot, const SessionStatus &status);
+
+  /**
+   * Appends the status of every session in the table to outList.
+   *
+   * @Note can be called from any thread, for as long as the table exists.
+   *
+   * @throw - std::bad_alloc
+   *
+   * @param outList [in/out] - Status is added to the end.
+   *
+   * @return bool - false if some sessions could not be given a slot, so
+   *         outList is incomplete.
+   */
+  bool Read(std::vector<SessionStatus> &outList);
+
+  /**
+   * Calls visitor with the status of every session in the table, without
+   * gathering them first.
+   *
+   * @Note can be called from any thread, for as long as the table exists.
+   *
+   * @throw - Only if visitor throws.
+   *
+   * @return bool - false if some sessions could not be given a slot, so some
+   *         sessions were not visited.
+   */
+  bool Visit(Visitor visitor, void *userdata);
+
+  /**
+   * @Note can be called from any thread.
+   *
+   * @return bool - false if some sessions could not be given a slot.
+   */
+  bool IsComplete();
+
+private:
+  struct Slot
+  {
+    uint32_t sequence;  // Odd while the status is being written.
+    SessionStatus status;
+  };
+
+  static const size_t StatusWords = sizeof(SessionStatus) / sizeof(uint32_t);
+
+  Slot& getSlot(size_t slot) { return m_chunks[slot / ChunkSize][slot % ChunkSize];}
+  static void copyStatus(SessionStatus &outStatus, const SessionStatus &status);
+  static void addToList(const SessionStatus &status, void *userdata);
+  bool addChunk();
+
+  Slot *m_chunks[MaxChunks];  // Only the first m_chunkCount are valid.
+  size_t m_chunkCount; // Read atomically by readers.
+  size_t m_nextSlot;  // Next never used slot.
+  std::vector<size_t> m_freeSlots;
+  uint32_t m_missingCount; // Sessions without a slot. Read atomically by readers.
+};
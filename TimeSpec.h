@@ -56,7 +56,7 @@ struct TimeSpec : public timespec
   /**
    * Test for time is 0 seconds.
    */
-  bool empty() { return tv_sec == 0 && tv_nsec == 0;}
+  bool empty() const { return tv_sec == 0 && tv_nsec == 0;}
 
   /**
    * Test for negative time value. Does not need to be normalized
@@ -0,0 +1,736 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "TransmitEngine.h"
+#include "Atomic.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+using namespace std;
+
+const uint32_t TransmitEngine::NoSlot;
+const size_t TransmitEngine::SentPageSize;
+const uint32_t TransmitEngine::BatchWindow;
+const size_t TransmitEngine::MaxBatch;
+
+#ifdef HAVE_SENDMMSG
+typedef struct mmsghdr EngineHeader;
+#else
+typedef struct msghdr EngineHeader;
+#endif
+
+TransmitEngine::TransmitEngine() :
+   m_batch(MaxBatch),
+   m_batchSent(MaxBatch),
+   m_headers(MaxBatch * sizeof(EngineHeader)),
+   m_iovecs(MaxBatch),
+   m_sendSlots(MaxBatch),
+   m_batchCount(0),
+   m_random(uint32_t(rand()) | 1),
+   m_activeSlots(0),
+   m_threadRunning(false),
+   m_conditionMonotonic(false),
+   m_engineSleeping(false),
+   m_stopRequested(false),
+   m_pushCount(0)
+{
+  pthread_mutex_init(&m_lock, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+  m_conditionMonotonic = (0 == pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+#endif
+  pthread_cond_init(&m_condition, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+TransmitEngine::~TransmitEngine()
+{
+  stop();
+
+  // Nothing is sending now. Close the duplicates that the engine did not get to.
+  MpscNode *node;
+  while ((node = m_changes.Pop()) != NULL)
+  {
+    Change *change = static_cast<Change *>(node);
+    if (change->closeSocket != -1)
+      ::close(change->closeSocket);
+    delete change;
+  }
+
+  for (SocketMap::iterator it = m_sockets.begin(); it != m_sockets.end(); ++it)
+    ::close(it->second.duplicate);
+
+  for (size_t i = 0; i < m_sentPages.size(); i++)
+    delete[] m_sentPages[i];
+
+  pthread_cond_destroy(&m_condition);
+  pthread_mutex_destroy(&m_lock);
+}
+
+bool TransmitEngine::Start()
+{
+  if (!LogVerify(!m_threadRunning))
+    return true;
+
+  if (pthread_create(&m_thread, NULL, engineThreadCallback, this))
+  {
+    gLog.LogError("Failed to start transmit engine thread.");
+    return false;
+  }
+  m_threadRunning = true;
+  return true;
+}
+
+/**
+ * Stops the engine thread, and waits for it to exit.
+ */
+void TransmitEngine::stop()
+{
+  if (!m_threadRunning)
+    return;
+
+  pthread_mutex_lock(&m_lock);
+  m_stopRequested = true;
+  pthread_cond_signal(&m_condition);
+  pthread_mutex_unlock(&m_lock);
+
+  if (pthread_join(m_thread, NULL))
+    gLog.LogError("Failed to join transmit engine thread.");
+  m_threadRunning = false;
+}
+
+void TransmitEngine::ResetStats()
+{
+  pthread_mutex_lock(&m_lock);
+  m_stats.Reset();
+  pthread_mutex_unlock(&m_lock);
+}
+
+uint64_t TransmitEngine::GetSlotSent(uint32_t slot)
+{
+  if (!LogVerify(slot < m_ownerSlots.size() && m_ownerSlots[slot].allocated))
+    return 0;
+  return atomicLoadRelaxed(sentCounter(slot)) - m_ownerSlots[slot].sentBase;
+}
+
+void TransmitEngine::GetStats(Stats &outStats)
+{
+  pthread_mutex_lock(&m_lock);
+  outStats = m_stats;
+  outStats.activeSlots = m_activeSlots;
+  pthread_mutex_unlock(&m_lock);
+}
+
+uint32_t TransmitEngine::AllocateSlot()
+{
+  uint32_t slot;
+
+  try
+  {
+    if (!m_freeSlots.empty())
+    {
+      slot = m_freeSlots.back();
+      m_freeSlots.pop_back();
+    }
+    else
+    {
+      if (m_ownerSlots.size() >= NoSlot)
+        return NoSlot;
+      addSentPages(m_ownerSlots.size() + 1);
+      m_ownerSlots.push_back(OwnerSlot());
+      slot = uint32_t(m_ownerSlots.size() - 1);
+    }
+  }
+  catch (std::exception &)
+  {
+    return NoSlot;
+  }
+
+  m_ownerSlots[slot].allocated = true;
+  m_ownerSlots[slot].socket = -1;
+  // The counter is never cleared, since the engine thread is its only writer.
+  m_ownerSlots[slot].sentBase = atomicLoadRelaxed(sentCounter(slot));
+  return slot;
+}
+
+/**
+ * Adds zeroed sent counter pages, so that there is a counter for each of count
+ * slots.
+ *
+ * @throw - std::bad_alloc
+ */
+void TransmitEngine::addSentPages(size_t count)
+{
+  while (m_sentPages.size() * SentPageSize < count)
+  {
+    m_sentPages.reserve(m_sentPages.size() + 1);
+    m_sentPages.push_back(new uint64_t[SentPageSize]());
+  }
+}
+
+void TransmitEngine::Reserve(size_t count)
+{
+  m_ownerSlots.reserve(count);
+  m_freeSlots.reserve(count);
+  addSentPages(count);
+
+  pthread_mutex_lock(&m_lock);
+  try
+  {
+    if (m_slots.size() < count)
+      m_slots.resize(count);
+    m_heap.reserve(count);
+    m_requeue.reserve(count);
+  }
+  catch (std::exception &)
+  {
+    pthread_mutex_unlock(&m_lock);
+    throw;
+  }
+  pthread_mutex_unlock(&m_lock);
+}
+
+void TransmitEngine::FreeSlot(uint32_t slot)
+{
+  if (slot == NoSlot || !LogVerify(slot < m_ownerSlots.size() && m_ownerSlots[slot].allocated))
+    return;
+
+  Change stackChange;
+  Change *change = new(std::nothrow) Change;
+
+  // On low memory the change is made directly. See push().
+  Change &use = change ? *change : stackChange;
+  use.command = Command::Free;
+  use.slot = slot;
+  use.socket = -1;
+  changeSocket(slot, -1, use);
+  push(change, use);
+
+  m_ownerSlots[slot].allocated = false;
+  try
+  {
+    m_freeSlots.push_back(slot);
+  }
+  catch (std::exception &)
+  {
+    // The slot is simply not reused.
+  }
+}
+
+bool TransmitEngine::Update(uint32_t slot, int socket, const void *data, size_t dataLength, const SockAddr &toAddress,
+                            uint32_t interval, uint8_t detectMult, uint64_t firstDelay)
+{
+  if (!LogVerify(slot < m_ownerSlots.size() && m_ownerSlots[slot].allocated))
+    return false;
+  if (!LogVerify(dataLength <= bfd::MaxPacketSize) || !LogVerify(socket != -1) || !LogVerify(interval != 0))
+  {
+    Pause(slot);
+    return false;
+  }
+
+  Change *change = new(std::nothrow) Change;
+  if (!change)
+  {
+    Pause(slot);
+    return false;
+  }
+
+  change->command = Command::Update;
+  change->slot = slot;
+  changeSocket(slot, socket, *change);
+  if (change->socket == -1)
+  {
+    // Still pass on any socket to close.
+    change->command = Command::Pause;
+    push(change, *change);
+    return false;
+  }
+
+  change->interval = interval;
+  change->detectMult = detectMult;
+  change->sentCounter = sentCounter(slot);
+  change->firstSend = TimeSpec::MonoNow() + TimeSpec(TimeSpec::Microsec, int64_t(firstDelay));
+  change->addressLength = toAddress.GetSize();
+  memcpy(&change->address, &toAddress.GetSockAddr(), change->addressLength);
+  change->length = dataLength;
+  memcpy(change->data, data, dataLength);
+
+  push(change, *change);
+  return true;
+}
+
+void TransmitEngine::Pause(uint32_t slot)
+{
+  if (!LogVerify(slot < m_ownerSlots.size() && m_ownerSlots[slot].allocated))
+    return;
+
+  Change stackChange;
+  Change *change = new(std::nothrow) Change;
+
+  Change &use = change ? *change : stackChange;
+  use.command = Command::Pause;
+  use.slot = slot;
+  use.socket = -1;
+  use.closeSocket = -1;
+  push(change, use);
+}
+
+/**
+ * Sets the socket that the slot sends on, and fills in the duplicate socket for
+ * change. Any duplicate that is no longer needed is set to be closed by the
+ * engine thread once the change is applied.
+ *
+ * @param slot [in] - The slot.
+ * @param socket [in] - The session's socket. -1 for none.
+ * @param change [out] - socket and closeSocket are set. socket is -1 on
+ *               failure.
+ */
+void TransmitEngine::changeSocket(uint32_t slot, int socket, Change &change)
+{
+  OwnerSlot &owner = m_ownerSlots[slot];
+
+  change.closeSocket = -1;
+  if (owner.socket == socket)
+  {
+    change.socket = (socket == -1) ? -1 : m_sockets[socket].duplicate;
+    return;
+  }
+
+  change.socket = (socket == -1) ? -1 : acquireSocket(socket);
+  if (owner.socket != -1)
+    change.closeSocket = releaseSocket(owner.socket);
+  owner.socket = (change.socket == -1) ? -1 : socket;
+}
+
+/**
+ * Gets the engine's duplicate of a session socket, creating it if needed.
+ *
+ * @return int - The duplicate, or -1 on failure.
+ */
+int TransmitEngine::acquireSocket(int socket)
+{
+  SocketMap::iterator found = m_sockets.find(socket);
+  if (found != m_sockets.end())
+  {
+    found->second.refs++;
+    return found->second.duplicate;
+  }
+
+  int duplicate = ::dup(socket);
+  if (duplicate == -1)
+  {
+    gLog.ErrnoError(errno, "Failed to duplicate socket for transmit engine");
+    return -1;
+  }
+
+  try
+  {
+    SocketRef &ref = m_sockets[socket];
+    ref.duplicate = duplicate;
+    ref.refs = 1;
+  }
+  catch (std::exception &)
+  {
+    ::close(duplicate);
+    return -1;
+  }
+  return duplicate;
+}
+
+/**
+ * Drops a reference taken with acquireSocket().
+ *
+ * @return int - The duplicate, if it is no longer used, for the engine thread
+ *         to close. -1 otherwise.
+ */
+int TransmitEngine::releaseSocket(int socket)
+{
+  SocketMap::iterator found = m_sockets.find(socket);
+  if (!LogVerify(found != m_sockets.end()))
+    return -1;
+
+  if (--found->second.refs != 0)
+    return -1;
+
+  int duplicate = found->second.duplicate;
+  m_sockets.erase(found);
+  return duplicate;
+}
+
+/**
+ * Passes a change to the engine thread.
+ *
+ * @param change [in] - The change to queue, which the engine thread will
+ *               delete. NULL if it could not be allocated, in which case
+ *               content is applied directly, after everything already queued.
+ * @param content [in] - The change.
+ */
+void TransmitEngine::push(Change *change, Change &content)
+{
+  if (!change)
+  {
+    // Holding m_lock keeps the engine thread out, so it is safe to take over
+    // the queue.
+    pthread_mutex_lock(&m_lock);
+    TimeSpec now(TimeSpec::MonoNow());
+    MpscNode *node;
+    while ((node = m_changes.Pop()) != NULL)
+    {
+      apply(static_cast<Change *>(node), now);
+      delete node;
+    }
+    apply(&content, now);
+    pthread_mutex_unlock(&m_lock);
+    return;
+  }
+
+  m_changes.Push(change);
+  atomicFetchAdd(&m_pushCount, uint32_t(1));
+
+  // The engine only needs a signal when it is waiting. See waitForChanges().
+  if (atomicLoad(&m_engineSleeping))
+  {
+    pthread_mutex_lock(&m_lock);
+    pthread_cond_signal(&m_condition);
+    pthread_mutex_unlock(&m_lock);
+  }
+}
+
+/**
+ * Applies a change on the engine thread. Must hold m_lock.
+ */
+void TransmitEngine::apply(Change *change, const TimeSpec &now)
+{
+  m_stats.updates++;
+
+  if (change->slot >= m_slots.size())
+  {
+    if (change->command != Command::Update)
+    {
+      // Never started, so nothing to stop.
+      if (change->closeSocket != -1)
+        ::close(change->closeSocket);
+      return;
+    }
+
+    try
+    {
+      m_slots.resize(max(size_t(change->slot) + 1, m_slots.size() * 2));
+    }
+    catch (std::exception &)
+    {
+      gLog.LogError("Transmit engine could not add slot %u.", change->slot);
+      if (change->closeSocket != -1)
+        ::close(change->closeSocket);
+      return;
+    }
+  }
+
+  Slot &slot = m_slots[change->slot];
+
+  if (change->command == Command::Update)
+  {
+    bool reschedule = !slot.active || slot.interval != change->interval;
+
+    slot.socket = change->socket;
+    slot.interval = change->interval;
+    slot.detectMult = change->detectMult;
+    slot.sentCounter = change->sentCounter;
+    slot.addressLength = change->addressLength;
+    memcpy(&slot.address, &change->address, change->addressLength);
+    slot.length = change->length;
+    memcpy(slot.data, change->data, change->length);
+
+    if (!reschedule && change->firstSend < slot.nextSend)
+      reschedule = true;
+
+    if (reschedule)
+    {
+      if (!slot.active)
+        m_activeSlots++;
+      slot.active = true;
+      slot.generation++;
+      slot.nextSend = max(change->firstSend, now);
+      pushHeap(HeapEntry(slot.nextSend, change->slot, slot.generation));
+    }
+  }
+  else
+  {
+    if (slot.active)
+    {
+      m_activeSlots--;
+      slot.active = false;
+      // Any heap entry is now stale.
+      slot.generation++;
+    }
+    if (change->command == Command::Free)
+    {
+      slot.socket = -1;
+      slot.sentCounter = NULL;
+    }
+  }
+
+  if (change->closeSocket != -1)
+    ::close(change->closeSocket);
+}
+
+void TransmitEngine::engineThread()
+{
+  pthread_mutex_lock(&m_lock);
+
+  while (!m_stopRequested)
+  {
+    m_stats.wakeups++;
+
+    uint32_t pushCount = atomicLoad(&m_pushCount);
+    TimeSpec now(TimeSpec::MonoNow());
+    MpscNode *node;
+    while ((node = m_changes.Pop()) != NULL)
+    {
+      apply(static_cast<Change *>(node), now);
+      delete node;
+    }
+
+    sendDue(now);
+
+    // Stale entries could only wake us early.
+    while (!m_heap.empty())
+    {
+      const HeapEntry &top = m_heap.front();
+      if (m_slots[top.slot].active && m_slots[top.slot].generation == top.generation)
+        break;
+      pop_heap(m_heap.begin(), m_heap.end());
+      m_heap.pop_back();
+    }
+
+    TimeSpec deadline;
+    if (m_heap.empty())
+      deadline = now + TimeSpec(TimeSpec::Millisec, 1000);
+    else
+      deadline = m_heap.front().due;
+
+    if (deadline > TimeSpec::MonoNow())
+      waitForChanges(pushCount, deadline);
+    else
+    {
+      // Let any thread waiting on m_lock in.
+      pthread_mutex_unlock(&m_lock);
+      pthread_mutex_lock(&m_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&m_lock);
+}
+
+/**
+ * Waits until the deadline, or until a change is pushed. Must hold m_lock.
+ *
+ * @param pushCount [in] - m_pushCount from before the queue was last drained.
+ * @param deadline [in] - Monotonic time.
+ */
+void TransmitEngine::waitForChanges(uint32_t pushCount, const TimeSpec &deadline)
+{
+  struct timespec waitUntil = deadline;
+  if (!m_conditionMonotonic)
+    waitUntil = TimeSpec::RealNow() + (deadline - TimeSpec::MonoNow());
+
+  // Producers only signal when we are sleeping. Since they signal with m_lock
+  // held, and count the change before checking the flag, checking the count
+  // after setting the flag prevents lost wakeups.
+  atomicStore(&m_engineSleeping, true);
+  if (atomicLoad(&m_pushCount) == pushCount && !m_stopRequested)
+    pthread_cond_timedwait(&m_condition, &m_lock, &waitUntil);
+  atomicStore(&m_engineSleeping, false);
+}
+
+/**
+ * Sends the packets that are due, or nearly due, and schedules the next packet
+ * for each. Must hold m_lock.
+ */
+void TransmitEngine::sendDue(const TimeSpec &now)
+{
+  TimeSpec limit = now + TimeSpec(TimeSpec::Microsec, BatchWindow);
+
+  m_batchCount = 0;
+  m_requeue.clear();
+  while (!m_heap.empty() && m_heap.front().due <= limit)
+  {
+    HeapEntry entry = m_heap.front();
+    pop_heap(m_heap.begin(), m_heap.end());
+    m_heap.pop_back();
+
+    Slot &slot = m_slots[entry.slot];
+    if (!slot.active || slot.generation != entry.generation)
+      continue;
+
+    int64_t lateNs = (now - entry.due).ToNanoseconds();
+    m_stats.lateness.Record(lateNs > 0 ? uint64_t(lateNs / TimeSpec::NSecPerUs) : 0);
+
+    // Keep the cadence, unless we have fallen a whole interval behind.
+    TimeSpec next = entry.due + TimeSpec(TimeSpec::Microsec, int64_t(jitter(slot.interval, slot.detectMult)));
+    if (next <= now)
+      next = now + TimeSpec(TimeSpec::Microsec, int64_t(jitter(slot.interval, slot.detectMult)));
+    slot.nextSend = next;
+    // Added after the loop, so that a short interval can not keep it going.
+    try
+    {
+      m_requeue.push_back(HeapEntry(next, entry.slot, entry.generation));
+    }
+    catch (std::exception &)
+    {
+      gLog.LogError("Transmit engine out of memory. Slot %u stopped sending.", entry.slot);
+    }
+
+    m_batch[m_batchCount] = &slot;
+    m_batchSent[m_batchCount] = false;
+    if (++m_batchCount == MaxBatch)
+    {
+      for (size_t i = 0; i < m_batchCount; i++)
+      {
+        if (!m_batchSent[i])
+          sendBatch(i);
+      }
+      m_batchCount = 0;
+    }
+  }
+
+  for (size_t i = 0; i < m_batchCount; i++)
+  {
+    if (!m_batchSent[i])
+      sendBatch(i);
+  }
+  m_batchCount = 0;
+
+  for (size_t i = 0; i < m_requeue.size(); i++)
+    pushHeap(m_requeue[i]);
+}
+
+/**
+ * Adds an entry to m_heap. Must hold m_lock.
+ */
+void TransmitEngine::pushHeap(const HeapEntry &entry)
+{
+  try
+  {
+    m_heap.push_back(entry);
+    push_heap(m_heap.begin(), m_heap.end());
+  }
+  catch (std::exception &)
+  {
+    gLog.LogError("Transmit engine out of memory. Slot %u stopped sending.", entry.slot);
+  }
+}
+
+/**
+ * Sends all the unsent batch entries that use the same socket as the one at
+ * first. Marks them as sent. See TransmitQueue::sendEntries().
+ *
+ * @param first [in] - The first entry to send.
+ */
+void TransmitEngine::sendBatch(size_t first)
+{
+  int socket = m_batch[first]->socket;
+  EngineHeader *headers = reinterpret_cast<EngineHeader *>(&m_headers.front());
+  size_t count = 0;
+
+  for (size_t i = first; i < m_batchCount; i++)
+  {
+    Slot &slot = *m_batch[i];
+
+    if (m_batchSent[i] || slot.socket != socket)
+      continue;
+    m_batchSent[i] = true;
+
+    m_iovecs[count].iov_base = slot.data;
+    m_iovecs[count].iov_len = slot.length;
+    m_sendSlots[count] = &slot;
+
+#ifdef HAVE_SENDMMSG
+    struct msghdr &message = headers[count].msg_hdr;
+    headers[count].msg_len = 0;
+#else
+    struct msghdr &message = headers[count];
+#endif
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &slot.address;
+    message.msg_namelen = slot.addressLength;
+    message.msg_iov = &m_iovecs[count];
+    message.msg_iovlen = 1;
+    count++;
+  }
+
+#ifdef HAVE_SENDMMSG
+  size_t done = 0;
+  while (done < count)
+  {
+    m_stats.sendCalls++;
+    int result = ::sendmmsg(socket, headers + done, (unsigned int)(count - done), MSG_NOSIGNAL);
+    if (result <= 0)
+    {
+      // Skip the failed packet, and try the rest.
+      if (result < 0)
+        gLog.Optional(Log::Packet, "Transmit engine error sending packet using sendmmsg: %s", ErrnoToString());
+      m_stats.failed++;
+      done++;
+      continue;
+    }
+    m_stats.sent += result;
+    for (int i = 0; i < result; i++)
+      countSent(*m_sendSlots[done + i]);
+    done += result;
+  }
+#else
+  for (size_t i = 0; i < count; i++)
+  {
+    m_stats.sendCalls++;
+    if (::sendmsg(socket, &headers[i], MSG_NOSIGNAL) < 0)
+    {
+      gLog.Optional(Log::Packet, "Transmit engine error sending packet using sendmsg: %s", ErrnoToString());
+      m_stats.failed++;
+    }
+    else
+    {
+      m_stats.sent++;
+      countSent(*m_sendSlots[i]);
+    }
+  }
+#endif
+}
+
+/**
+ * Counts a packet sent by the slot. The engine thread is the only writer of the
+ * counter, so this need not be a locked add.
+ */
+void TransmitEngine::countSent(Slot &slot)
+{
+  if (slot.sentCounter)
+    atomicStoreRelaxed(slot.sentCounter, atomicLoadRelaxed(slot.sentCounter) + 1);
+}
+
+/**
+ * Applies the jitter from v10/6.8.7 to interval. The engine thread has its own
+ * generator, since rand() is not thread safe.
+ *
+ * @return uint64_t - Microseconds until the next packet.
+ */
+uint64_t TransmitEngine::jitter(uint32_t interval, uint8_t detectMult)
+{
+  // xorshift32
+  m_random ^= m_random << 13;
+  m_random ^= m_random >> 17;
+  m_random ^= m_random << 5;
+
+  double fraction = 0.75 + 0.25 * double(m_random) / double(UINT32_MAX);
+  if (detectMult == 1 && fraction > 0.90)
+    fraction = 0.90;
+  return uint64_t(double(interval) * fraction);
+}
@@ -0,0 +1,274 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Sends periodic control packets on a dedicated thread.
+
+ */
+#pragma once
+
+#include "bfd.h"
+#include "SockAddr.h"
+#include "TimeSpec.h"
+#include "Histogram.h"
+#include "MpscQueue.h"
+#include <pthread.h>
+#include <map>
+#include <vector>
+
+/**
+ * Takes over the periodic transmits of sessions, so that they are not delayed
+ * by receive processing on the scheduler's thread, and do not delay it.
+ *
+ * A session that is only sending the same packet at a fixed interval hands the
+ * packet to a slot in the engine. The engine thread then sends it at the
+ * interval, with the usual jitter, until the session pauses the slot to send
+ * packets itself again. Packets that are due at about the same time are sent
+ * together, with a single sendmmsg() for each socket, where available.
+ *
+ * Changes are passed to the engine thread through an MpscQueue, so the calls on
+ * the scheduler's thread never wait for the engine. The engine sends on its own
+ * duplicate of each socket, so a session may close its socket as soon as it has
+ * freed its slot.
+ *
+ * Unless otherwise specified, all calls must be made on the scheduler's main
+ * thread.
+ */
+class TransmitEngine
+{
+public:
+  static const uint32_t NoSlot = UINT32_MAX;
+  static const size_t SentPageSize = 1024; // Slot sent counters in each allocation.
+  // Packets due within this many microseconds are sent with those that are due.
+  static const uint32_t BatchWindow = 100;
+  static const size_t MaxBatch = 256;
+
+  struct Stats
+  {
+    Stats() { Reset();}
+    void Reset() { updates = 0; sent = 0; failed = 0; sendCalls = 0; wakeups = 0; activeSlots = 0; lateness.Reset();}
+
+    uint64_t updates;   // Changes handed to the engine thread.
+    uint64_t sent;      // Packets successfully sent.
+    uint64_t failed;    // Packets that failed to send.
+    uint64_t sendCalls; // Number of send system calls.
+    uint64_t wakeups;   // Number of times the engine thread woke.
+    size_t activeSlots; // Slots that are currently sending.
+    Histogram lateness; // Microseconds each packet was sent after it was due.
+  };
+
+  TransmitEngine();
+
+  /**
+   * Stops the thread, if it is running.
+   */
+  ~TransmitEngine();
+
+  /**
+   * Starts the engine thread.
+   *
+   * @return bool - false on failure.
+   */
+  bool Start();
+
+  /**
+   * Gets a slot for a session. The slot does not send until Update() is called.
+   *
+   * @return uint32_t - The slot. NoSlot on failure.
+   */
+  uint32_t AllocateSlot();
+
+  /**
+   * Stops the slot, and frees it.
+   *
+   * @param slot [in] - From AllocateSlot(). NoSlot is ignored.
+   */
+  void FreeSlot(uint32_t slot);
+
+  /**
+   * Allocates room for count slots, on both threads, so that sessions up to that
+   * many do not grow the slot tables.
+   *
+   * @throw - std::bad_alloc
+   */
+  void Reserve(size_t count);
+
+  /**
+   * Starts, or changes, the packet sent by a slot.
+   *
+   * If the slot is already sending, with the same interval, then only the packet
+   * changes. Otherwise the first packet is sent after firstDelay. A slot whose
+   * next packet is due sooner than firstDelay keeps that time.
+   *
+   * @param slot [in] - From AllocateSlot().
+   * @param socket [in] - The socket to send on.
+   * @param data [in] - The packet.
+   * @param dataLength [in] - Must be no more than bfd::MaxPacketSize.
+   * @param toAddress [in] - The destination.
+   * @param interval [in] - Microseconds between packets, before jitter.
+   * @param detectMult [in] - The session's detection multiplier, which limits
+   *                   the jitter. See v10/6.8.7.
+   * @param firstDelay [in] - Microseconds until the first packet, including
+   *                   jitter.
+   *
+   * @return bool - false on failure. The slot is then paused.
+   */
+  bool Update(uint32_t slot, int socket, const void *data, size_t dataLength, const SockAddr &toAddress,
+              uint32_t interval, uint8_t detectMult, uint64_t firstDelay);
+
+  /**
+   * Stops the slot from sending until Update() is called again. A packet that
+   * the engine thread is already sending may still go out.
+   *
+   * @param slot [in] - From AllocateSlot().
+   */
+  void Pause(uint32_t slot);
+
+  /**
+   * Gets the number of packets that a slot has sent since it was allocated.
+   * This is kept per slot, and is not cleared by ResetStats().
+   *
+   * This does not take m_lock, so it is cheap enough to call for every session
+   * as status is published or exported. The engine thread keeps the count where
+   * it never moves, so it can be read with a relaxed load. A packet that the
+   * engine sends for the slot's previous user, before it sees that slot freed,
+   * may be counted.
+   *
+   * @param slot [in] - From AllocateSlot().
+   */
+  uint64_t GetSlotSent(uint32_t slot);
+
+  /**
+   * Copies the current statistics.
+   */
+  void GetStats(Stats &outStats);
+
+  /**
+   * Resets all statistics to 0.
+   */
+  void ResetStats();
+
+private:
+  struct Command
+  {
+    enum Value
+    {
+      Update,
+      Pause,
+      Free,
+    };
+  };
+
+  // A change, passed to the engine thread.
+  struct Change : public MpscNode
+  {
+    Command::Value command;
+    uint32_t slot;
+    int socket;       // Engine's duplicate. -1 for none.
+    int closeSocket;  // Duplicate for the engine to close. -1 for none.
+    uint32_t interval;
+    uint8_t detectMult;
+    uint64_t *sentCounter; // For Update.
+    TimeSpec firstSend;
+    socklen_t addressLength;
+    sockaddr_storage address;
+    size_t length;
+    uint8_t data[bfd::MaxPacketSize];
+  };
+
+  // Engine thread's view of a slot.
+  struct Slot
+  {
+    Slot() : active(false), generation(0), socket(-1), interval(0), detectMult(0), addressLength(0), length(0), sentCounter(NULL) { }
+    bool active;
+    uint32_t generation; // Changes whenever a heap entry for the slot becomes stale.
+    int socket;
+    uint32_t interval;
+    uint8_t detectMult;
+    TimeSpec nextSend;
+    socklen_t addressLength;
+    sockaddr_storage address;
+    size_t length;
+    uint8_t data[bfd::MaxPacketSize];
+    uint64_t *sentCounter; // Atomic. In m_sentPages. NULL once freed.
+  };
+
+  struct HeapEntry
+  {
+    HeapEntry(const TimeSpec &due, uint32_t slot, uint32_t generation) : due(due), slot(slot), generation(generation) { }
+    TimeSpec due;
+    uint32_t slot;
+    uint32_t generation;
+    // Makes the std heap functions a min heap.
+    bool operator<(const HeapEntry &other) const { return other.due < due;}
+  };
+
+  // Scheduler thread's view of a slot.
+  struct OwnerSlot
+  {
+    OwnerSlot() : allocated(false), socket(-1), sentBase(0) { }
+    bool allocated;
+    int socket; // The session's socket, or -1.
+    uint64_t sentBase; // The slot's sent counter when it was allocated.
+  };
+
+  struct SocketRef
+  {
+    SocketRef() : duplicate(-1), refs(0) { }
+    int duplicate;
+    size_t refs;
+  };
+  typedef std::map<int, SocketRef> SocketMap;
+
+  static void* engineThreadCallback(void *arg) { reinterpret_cast<TransmitEngine *>(arg)->engineThread(); return NULL;}
+  void engineThread();
+  void stop();
+  void push(Change *change, Change &content);
+  void apply(Change *change, const TimeSpec &now);
+  void waitForChanges(uint32_t pushCount, const TimeSpec &deadline);
+  void sendDue(const TimeSpec &now);
+  void sendBatch(size_t first);
+  static void countSent(Slot &slot);
+  void pushHeap(const HeapEntry &entry);
+  uint64_t jitter(uint32_t interval, uint8_t detectMult);
+  int acquireSocket(int socket);
+  int releaseSocket(int socket);
+  void changeSocket(uint32_t slot, int socket, Change &change);
+  void addSentPages(size_t count);
+  uint64_t* sentCounter(uint32_t slot) { return m_sentPages[slot / SentPageSize] + slot % SentPageSize;}
+
+  // Scheduler thread only.
+  std::vector<OwnerSlot> m_ownerSlots;
+  std::vector<uint32_t> m_freeSlots;
+  SocketMap m_sockets;
+  // The pages are written by the engine thread, through Slot::sentCounter,
+  // and never move or are freed while it runs.
+  std::vector<uint64_t *> m_sentPages;
+
+  // Only used while holding m_lock.
+  std::vector<Slot> m_slots;
+  std::vector<HeapEntry> m_heap;
+  std::vector<HeapEntry> m_requeue; // Used during sendDue().
+  std::vector<Slot *> m_batch;
+  std::vector<bool> m_batchSent;
+  std::vector<uint8_t> m_headers; // Storage for MaxBatch mmsghdr.
+  std::vector<struct iovec> m_iovecs;
+  std::vector<Slot *> m_sendSlots; // Slot for each of m_iovecs.
+  size_t m_batchCount;
+  uint32_t m_random;
+  size_t m_activeSlots;
+
+  MpscQueue m_changes;
+  pthread_t m_thread;
+  bool m_threadRunning;    // Scheduler thread only.
+  pthread_mutex_t m_lock;  // Held by the engine thread, except while it waits.
+  pthread_cond_t m_condition;
+  bool m_conditionMonotonic; // Is m_condition using the monotonic clock.
+  bool m_engineSleeping;   // Atomic. Set, with m_lock, while the engine waits.
+  bool m_stopRequested;    // Protected by m_lock.
+  uint32_t m_pushCount;    // Atomic. Changes pushed.
+  Stats m_stats;           // Protected by m_lock.
+};
@@ -0,0 +1,287 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+#include "common.h"
+#include "TransmitQueue.h"
+#include "Scheduler.h"
+#include "SourcePortAllocator.h"
+#include "utils.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+const uint32_t TransmitQueue::DefaultWindow;
+const size_t TransmitQueue::DefaultMaxDepth;
+const size_t TransmitQueue::MaxMaxDepth;
+
+#ifdef HAVE_SENDMMSG
+typedef struct mmsghdr TransmitHeader;
+#else
+typedef struct msghdr TransmitHeader;
+#endif
+
+TransmitQueue::TransmitQueue(Scheduler &scheduler, SourcePortAllocator &portAllocator, size_t maxDepth, uint32_t window, bool sharedSockets) :
+   m_scheduler(&scheduler),
+   m_portAllocator(&portAllocator),
+   m_maxDepth(max(size_t(1), min(maxDepth, MaxMaxDepth))),
+   m_window(window),
+   m_sharedSockets(sharedSockets),
+   m_entries(m_maxDepth),
+   m_order(m_maxDepth),
+   m_headers(m_maxDepth * sizeof(TransmitHeader)),
+   m_iovecs(m_maxDepth),
+   m_count(0),
+   m_flushTimer(this)
+{
+  ResetStats();
+
+  m_flushTimer = m_scheduler->MakeTimer("<TxFlush>");
+  m_flushTimer->SetCallback(handleFlushTimerCallback,  this);
+  m_flushTimer->SetPriority(Timer::Priority::Hi);
+}
+
+TransmitQueue::~TransmitQueue()
+{
+  Flush();
+  m_scheduler->FlushDatagrams();
+
+  for (SharedSocketMap::iterator it = m_sharedSocketMap.begin(); it != m_sharedSocketMap.end(); ++it)
+  {
+    m_portAllocator->Release(it->first, it->second->GetAddress().Port());
+    delete it->second;
+  }
+}
+
+void TransmitQueue::deleteTimer(Timer *timer)
+{
+  if (m_scheduler && timer)
+    m_scheduler->FreeTimer(timer);
+}
+
+void TransmitQueue::ResetStats()
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+bool TransmitQueue::Queue(int socket, const void *data, size_t dataLength, const SockAddr &toAddress)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  if (!LogVerify(dataLength <= bfd::MaxPacketSize) || !LogVerify(socket != -1))
+    return false;
+
+  if (!LogVerify(m_count < m_maxDepth))
+    Flush();
+
+  Entry &entry = m_entries[m_count];
+  entry.socket = socket;
+  entry.length = dataLength;
+  entry.addressLength = toAddress.GetSize();
+  memcpy(&entry.address, &toAddress.GetSockAddr(), entry.addressLength);
+  memcpy(entry.data, data, dataLength);
+
+  if (m_count++ == 0)
+  {
+    m_firstQueueTime = TimeSpec::MonoNow();
+    m_flushTimer->SetMicroTimer(m_window);
+  }
+  m_stats.queued++;
+
+  if (m_count == m_maxDepth)
+  {
+    m_stats.fullFlushes++;
+    Flush();
+  }
+
+  return true;
+}
+
+void TransmitQueue::Discard(int socket)
+{
+  size_t kept = 0;
+
+  LogAssert(m_scheduler->IsMainThread());
+
+  for (size_t i = 0; i < m_count; i++)
+  {
+    if (m_entries[i].socket == socket)
+    {
+      m_stats.discarded++;
+      continue;
+    }
+    if (kept != i)
+      m_entries[kept] = m_entries[i];
+    kept++;
+  }
+  m_count = kept;
+
+  if (m_count == 0)
+    m_flushTimer->Stop();
+
+  // Packets already handed to the scheduler must leave before the socket
+  // closes.
+  m_scheduler->FlushDatagrams();
+}
+
+void TransmitQueue::Flush()
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  m_flushTimer->Stop();
+
+  if (m_count == 0)
+    return;
+
+  uint64_t delay = uint64_t((TimeSpec::MonoNow() - m_firstQueueTime).ToNanoseconds() / TimeSpec::NSecPerUs);
+  m_stats.flushes++;
+  m_stats.lastDepth = m_count;
+  m_stats.maxDepth = max(m_stats.maxDepth, m_count);
+  m_stats.totalDelay += delay;
+  m_stats.maxDelay = max(m_stats.maxDelay, delay);
+
+  // A scheduler that sends datagrams itself sends them all with its next
+  // wait, with no system call here.
+  if (m_scheduler->HandlesDatagrams())
+  {
+    for (size_t i = 0; i < m_count; i++)
+    {
+      Entry &entry = m_entries[i];
+      if (m_scheduler->QueueDatagram(entry.socket, entry.data, entry.length, reinterpret_cast<const sockaddr *>(&entry.address), entry.addressLength))
+        m_stats.sent++;
+      else
+        m_stats.failed++;
+    }
+    m_count = 0;
+    return;
+  }
+
+  // Sort by socket, and then by index, so that each socket's entries are
+  // together, in the order queued.
+  for (size_t i = 0; i < m_count; i++)
+    m_order[i] = (uint64_t(uint32_t(m_entries[i].socket)) << 32) | i;
+  sort(m_order.begin(), m_order.begin() + m_count);
+
+  size_t begin = 0;
+  for (size_t i = 1; i <= m_count; i++)
+  {
+    if (i == m_count || (m_order[i] >> 32) != (m_order[begin] >> 32))
+    {
+      sendEntries(begin, i);
+      begin = i;
+    }
+  }
+
+  m_count = 0;
+}
+
+/**
+ * Sends the entries in m_order from begin to end, which all use one socket.
+ */
+void TransmitQueue::sendEntries(size_t begin, size_t end)
+{
+  int socket = m_entries[uint32_t(m_order[begin])].socket;
+  TransmitHeader *headers = reinterpret_cast<TransmitHeader *>(&m_headers.front());
+  size_t count = 0;
+
+  for (size_t i = begin; i < end; i++)
+  {
+    Entry &entry = m_entries[uint32_t(m_order[i])];
+
+    m_iovecs[count].iov_base = entry.data;
+    m_iovecs[count].iov_len = entry.length;
+
+#ifdef HAVE_SENDMMSG
+    struct msghdr &message = headers[count].msg_hdr;
+    headers[count].msg_len = 0;
+#else
+    struct msghdr &message = headers[count];
+#endif
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &entry.address;
+    message.msg_namelen = entry.addressLength;
+    message.msg_iov = &m_iovecs[count];
+    message.msg_iovlen = 1;
+    count++;
+  }
+
+#ifdef HAVE_SENDMMSG
+  size_t done = 0;
+  while (done < count)
+  {
+    m_stats.sendCalls++;
+    int result = ::sendmmsg(socket, headers + done, (unsigned int)(count - done), MSG_NOSIGNAL);
+    if (result <= 0)
+    {
+      // Skip the failed packet, and try the rest.
+      if (result < 0)
+        gLog.Optional(Log::Packet, "Error sending packet using sendmmsg: %s", ErrnoToString());
+      m_stats.failed++;
+      done++;
+      continue;
+    }
+    m_stats.sent += result;
+    done += result;
+  }
+#else
+  for (size_t i = 0; i < count; i++)
+  {
+    m_stats.sendCalls++;
+    if (::sendmsg(socket, &headers[i], MSG_NOSIGNAL) < 0)
+    {
+      gLog.Optional(Log::Packet, "Error sending packet using sendmsg: %s", ErrnoToString());
+      m_stats.failed++;
+    }
+    else
+      m_stats.sent++;
+  }
+#endif
+}
+
+int TransmitQueue::GetSharedSocket(const IpAddr &localAddr, in_port_t &outPort)
+{
+  LogAssert(m_scheduler->IsMainThread());
+
+  SharedSocketMap::iterator found = m_sharedSocketMap.find(localAddr);
+  if (found != m_sharedSocketMap.end())
+  {
+    outPort = found->second->GetAddress().Port();
+    return *found->second;
+  }
+
+  if (!LogVerify(localAddr.IsValid()) || !LogVerify(!localAddr.IsAny()))
+    return -1;
+
+  Raii<Socket>::Delete sendSocket(new Socket());
+
+  sendSocket->SetLogName(FormatShortStr("Shared %s send sock", localAddr.ToString()));
+  // Note that all sockets will log errors, so we do not have to.
+  if (!sendSocket->OpenUDP(localAddr.Type()))
+    return -1;
+  if (!sendSocket->SetTTLOrHops(bfd::TTLValue))
+    return -1;
+
+  /* Find an available port in the proper range */
+  in_port_t port = m_portAllocator->Bind(*sendSocket, localAddr, 0);
+  if (port == 0)
+    return -1;
+  SockAddr sendAddr(localAddr, port);
+
+  try
+  {
+    m_sharedSocketMap[localAddr] = sendSocket;
+  }
+  catch (std::bad_alloc &)
+  {
+    m_portAllocator->Release(localAddr, port);
+    return -1;
+  }
+  gLog.Optional(Log::Session, "Shared source socket %s opened.", sendAddr.ToString());
+
+  outPort = sendAddr.Port();
+  return *sendSocket.Detach();
+}
@@ -0,0 +1,170 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Batches outgoing control packets, so that they can be sent with a single
+   system call.
+
+ */
+#pragma once
+
+#include "bfd.h"
+#include "SockAddr.h"
+#include "Socket.h"
+#include "TimeSpec.h"
+#include <map>
+#include <vector>
+
+class Scheduler;
+class Timer;
+class SourcePortAllocator;
+
+/**
+ * Queues control packets from all sessions, and sends them in batches. The
+ * queue is flushed when the batching window expires, or when it is full.
+ * Packets for the same socket are sent with a single sendmmsg() call, where
+ * available. With a scheduler that sends datagrams itself, see
+ * Scheduler::HandlesDatagrams(), the packets are handed to the scheduler
+ * instead. Stats::sent then counts the packets handed over, and the scheduler
+ * counts any that fail.
+ *
+ * Optionally, sockets can be shared by all sessions using the same local
+ * address. In that case all packets for a local address go out with a single
+ * call.
+ *
+ * Unless otherwise specified, all calls must be made on the scheduler's main
+ * thread.
+ */
+class TransmitQueue
+{
+public:
+  static const uint32_t DefaultWindow = 0;  // in microseconds
+  static const size_t DefaultMaxDepth = 64;
+  static const size_t MaxMaxDepth = 1024;
+
+  struct Stats
+  {
+    uint64_t queued;    // Packets queued
+    uint64_t sent;      // Packets successfully sent
+    uint64_t failed;    // Packets that failed to send
+    uint64_t discarded; // Packets discarded before being sent (session removed).
+    uint64_t flushes;   // Number of times the queue was flushed.
+    uint64_t fullFlushes;  // Number of flushes due to reaching max depth.
+    uint64_t sendCalls; // Number of send system calls.
+    size_t maxDepth;    // Largest number of packets in the queue at flush time.
+    size_t lastDepth;   // Number of packets in the queue at the last flush.
+    uint64_t totalDelay;  // Sum of microseconds from first packet queued to flush.
+    uint64_t maxDelay;  // Largest number of microseconds from first packet queued to flush.
+  };
+
+  /**
+   * @throw - yes
+   *
+   * @param scheduler
+   * @param portAllocator [in] - Picks the ports of shared sockets. Must outlive
+   *                      this queue.
+   * @param maxDepth [in] - The maximum number of packets that can be queued.
+   * @param window [in] - Maximum time, in microseconds, that a packet will be
+   *               held before sending. 0 means that packets are sent after
+   *               the current high priority timers are handled.
+   * @param sharedSockets [in] - Should sessions with the same local address share
+   *                      a single socket.
+   */
+  TransmitQueue(Scheduler &scheduler, SourcePortAllocator &portAllocator, size_t maxDepth, uint32_t window, bool sharedSockets);
+  ~TransmitQueue();
+
+  /**
+   * Queues a packet for sending.
+   *
+   * @param socket [in] - The socket to send on. Must remain open until the
+   *               packet is sent, or Discard() is called.
+   * @param data [in] - The packet.
+   * @param dataLength [in] - Must be no more than bfd::MaxPacketSize.
+   * @param toAddress [in] - The destination.
+   *
+   * @return bool - false if the packet could not be queued.
+   */
+  bool Queue(int socket, const void *data, size_t dataLength, const SockAddr &toAddress);
+
+  /**
+   * Discards all queued packets for the socket. Call before closing a socket
+   * that may have pending packets.
+   *
+   * @param socket
+   */
+  void Discard(int socket);
+
+  /**
+   * Sends all queued packets now.
+   */
+  void Flush();
+
+  /**
+   * Are sockets being shared by sessions with the same local address.
+   *
+   * @return bool
+   */
+  bool UseSharedSockets() { return m_sharedSockets;}
+
+  /**
+   * Gets the shared socket for the local address, opening it if needed.
+   *
+   * @param localAddr [in] - The local address.
+   * @param outPort [out] - The port that the socket is bound to.
+   *
+   * @return int - The socket, or -1 on failure.
+   */
+  int GetSharedSocket(const IpAddr &localAddr, in_port_t &outPort);
+
+  uint32_t GetWindow() { return m_window;}
+  size_t GetMaxDepth() { return m_maxDepth;}
+
+  /**
+   * @return size_t - The number of packets currently queued.
+   */
+  size_t GetDepth() { return m_count;}
+
+  /**
+   * Copies the current statistics.
+   */
+  void GetStats(Stats &outStats) { outStats = m_stats;}
+
+  /**
+   * Resets all statistics to 0.
+   */
+  void ResetStats();
+
+private:
+  struct Entry
+  {
+    int socket;
+    size_t length;
+    sockaddr_storage address;
+    socklen_t addressLength;
+    uint8_t data[bfd::MaxPacketSize];
+  };
+
+  static void handleFlushTimerCallback(Timer *timer, void *userdata) { reinterpret_cast<TransmitQueue *>(userdata)->Flush(); (void)timer;}
+  void sendEntries(size_t begin, size_t end);
+  void deleteTimer(Timer *timer);
+
+  typedef std::map<IpAddr, Socket *, IpAddr::LessClass> SharedSocketMap;
+
+  Scheduler *m_scheduler;
+  SourcePortAllocator *m_portAllocator;
+  size_t m_maxDepth;
+  uint32_t m_window;
+  bool m_sharedSockets;
+  std::vector<Entry> m_entries; // Always m_maxDepth in size.
+  std::vector<uint64_t> m_order; // Used during flush. Socket in the high half, entry index in the low half.
+  std::vector<uint8_t> m_headers; // Used during flush. Storage for m_maxDepth mmsghdr.
+  std::vector<struct iovec> m_iovecs; // Used during flush.
+  size_t m_count; // Number of valid items in m_entries
+  TimeSpec m_firstQueueTime; // When the first item in the queue was queued.
+  SharedSocketMap m_sharedSocketMap;
+  Stats m_stats;
+  RaiiClassCall<Timer, TransmitQueue, &TransmitQueue::deleteTimer> m_flushTimer;
+};
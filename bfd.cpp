@@ -18,6 +18,18 @@ const char* StateName(bfd::State::Value state)
 }
 
 
+const char *AuthTypeNameArray[] =
+{
+  "none", "password", "md5", "meticulous-md5", "sha1", "meticulous-sha1"
+};
+const char* AuthTypeName(AuthType::Value type)
+{
+  if (type < 0 || type > bfd::AuthType::MeticulousSHA1)
+    return "unknown";
+  return AuthTypeNameArray[type];
+}
+
+
 const char *DiagNameArray[] =
 {
   "No Diagnostic",
@@ -18,6 +18,8 @@ const uint16_t MaxAuthDataSize = 26; // Keyed SHA1 is the biggest at 26 bytes?
 const uint16_t AuthHeaderSize = 2; // just the "fixed" info.
 const uint16_t MaxPacketSize = (BasePacketSize + MaxAuthDataSize + AuthHeaderSize);
 const uint16_t ListenPort = 3784;
+const uint16_t EchoPort = 3785;
+const uint32_t EchoMagic = 0x4F424645; // "OBFE", see EchoPacket
 const uint8_t TTLValue = 255;
 const uint16_t MinSourcePort = 49142U;  // Per draft-ietf-bfd-v4v6-1hop-11.txt
 const uint16_t MaxSourcePort = 65535U;  // Per draft-ietf-bfd-v4v6-1hop-11.txt
@@ -72,6 +74,8 @@ enum Value
   MeticulousSHA1 = 5,
 };
 }
+
+const char* AuthTypeName(AuthType::Value type);
 } // namespace
 
 
@@ -137,3 +141,18 @@ struct BfdPacket
   BFDAuthData auth;
 };
 #pragma pack(pop)
+
+/**
+ * The contents of an echo packet are up to the system that sends it, since it
+ * is looped back to that system (v10/6.4). This is the format used here. All
+ * values are in network order.
+ */
+#pragma pack(push, 1)
+struct EchoPacket
+{
+  uint32_t magic;     // bfd::EchoMagic
+  uint32_t instance;  // Identifies the beacon that sent it.
+  uint32_t myDisc;    // Local discriminator of the session that sent it.
+  uint32_t sequence;
+};
+#pragma pack(pop)
@@ -0,0 +1,944 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Load generator and benchmark for the beacon.
+
+   Runs a Beacon in process, and drives it with simulated BFD peers on their
+   own scheduler thread. The peers each use a separate address, so that every
+   peer is a separate session on the Beacon. On Linux any address in 127/8 is
+   local, so the defaults need no setup. For veth or other interfaces, the peer
+   addresses must already be configured.
+
+ */
+#include "common.h"
+#include "Beacon.h"
+#include "Histogram.h"
+#include "Session.h"
+#include "TransmitQueue.h"
+#include "SelectScheduler.h"
+#include "KeventScheduler.h"
+#include "EpollScheduler.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+
+using namespace std;
+
+static const char *BenchAppName = "bfdd-bench";
+
+/**
+ * Settings from the command line.
+ */
+struct BenchOptions
+{
+  BenchOptions();
+
+  size_t sessions;
+  uint32_t interval;  // Transmit and receive interval, in microseconds.
+  uint8_t detectMulti;
+  uint32_t duration;  // Seconds to measure.
+  uint32_t warmup;    // Maximum seconds to wait for all sessions to come up.
+  size_t detectCount; // Sessions to stop, in order to measure detection time.
+  IpAddr dutAddr;     // The Beacon's listen address.
+  IpAddr firstPeerAddr;
+  SockAddr controlAddr;
+  size_t shards;
+  uint32_t txWindow;
+  bool sharedTx;
+  bool uring;
+};
+
+BenchOptions::BenchOptions() :
+   sessions(100),
+   interval(100000),
+   detectMulti(3),
+   duration(10),
+   warmup(30),
+   detectCount(10),
+   dutAddr("127.0.0.1"),
+   firstPeerAddr("127.1.0.1"),
+   controlAddr("127.0.0.1", 9959),
+   shards(1),
+   txWindow(TransmitQueue::DefaultWindow),
+   sharedTx(false),
+   uring(false)
+{
+}
+
+class Bench;
+
+/**
+ * A simulated peer. Runs a minimal version of the BFD state machine, from its
+ * own address, on the bfd listen port.
+ */
+struct BenchPeer
+{
+  BenchPeer(Bench &owner, size_t peerIndex, const IpAddr &peerAddr) :
+     bench(&owner),
+     index(peerIndex),
+     addr(peerAddr),
+     txTimer(NULL),
+     myDisc(uint32_t(peerIndex + 1)),
+     yourDisc(0),
+     state(bfd::State::Down),
+     remoteState(bfd::State::Down),
+     remoteRequiredMinRx(1),
+     stopped(false),
+     remoteDownTime(),
+     detected(false)
+  {
+  }
+
+  Bench *bench;
+  size_t index;
+  IpAddr addr;
+  Socket socket;
+  Timer *txTimer;
+  TimeSpec txTarget;  // When txTimer is expected to fire.
+  TimeSpec lastTx;
+  TimeSpec lastRx;
+  uint32_t myDisc;
+  uint32_t yourDisc;
+  bfd::State::Value state;
+  bfd::State::Value remoteState;
+  uint32_t remoteRequiredMinRx;
+  bool stopped; // No longer transmitting, so that the Beacon will time out.
+  TimeSpec remoteDownTime; // When the Beacon session went down. Filled in by the Beacon thread.
+  bool detected; // remoteDownTime is valid.
+};
+
+/**
+ * Runs the benchmark.
+ */
+class Bench
+{
+public:
+  Bench(const BenchOptions &options) :
+     m_options(options),
+     m_beaconThreadStarted(false),
+     m_beaconExited(false),
+     m_beaconLock(true),
+     m_scheduler(NULL),
+     m_phaseTimer(NULL),
+     m_phase(Phase::Warmup),
+     m_upCount(0),
+     m_txPackets(0),
+     m_rxPackets(0),
+     m_sendErrors(0),
+     m_lateDutTx(0),
+     m_measureSeconds(0),
+     m_dutCpuSeconds(0),
+     m_peerCpuSeconds(0),
+     m_stoppedCount(0)
+  {
+  }
+
+  ~Bench();
+
+  /**
+   * Runs the benchmark, and prints the results to stdout.
+   *
+   * @return bool - false on failure.
+   */
+  bool Run();
+
+private:
+  struct Phase
+  {enum Value
+    {Warmup, Measure, Detect, Done};};
+
+  bool startBeacon();
+  void stopBeacon();
+  bool beaconExited();
+  static void* beaconThreadCallback(void *arg) { reinterpret_cast<Bench *>(arg)->beaconThread(); return NULL;}
+  void beaconThread();
+  bool waitForBeacon();
+  static void configureBeaconCallback(Beacon *beacon, void *userdata) { reinterpret_cast<Bench *>(userdata)->configureBeacon(beacon);}
+  void configureBeacon(Beacon *beacon);
+  static void collectDetectionCallback(Beacon *beacon, void *userdata) { reinterpret_cast<Bench *>(userdata)->collectDetection(beacon);}
+  void collectDetection(Beacon *beacon);
+
+  bool startPeers();
+  void stopPeers();
+  void sendPacket(BenchPeer &peer, bool final);
+  void scheduleTx(BenchPeer &peer);
+  void setPeerState(BenchPeer &peer, bfd::State::Value state);
+  static void handleTxTimerCallback(Timer *timer, void *userdata);
+  void handleTxTimer(BenchPeer &peer);
+  static void handleSocketCallback(int socket, void *userdata);
+  void handleSocket(BenchPeer &peer);
+  void handlePacket(BenchPeer &peer, const BfdPacket &packet);
+  static void handlePhaseTimerCallback(Timer *timer, void *userdata) { reinterpret_cast<Bench *>(userdata)->handlePhaseTimer(); (void)timer;}
+  void handlePhaseTimer();
+  void beginMeasure();
+  void endMeasure();
+  bool report();
+
+  const BenchOptions m_options;
+  Beacon m_beacon;
+  pthread_t m_beaconThread;
+  bool m_beaconThreadStarted;
+  bool m_beaconExited; // Protected by m_beaconLock.
+  QuickLock m_beaconLock;
+
+  Scheduler *m_scheduler; // For the peers.
+  Timer *m_phaseTimer;
+  std::vector<BenchPeer *> m_peers;
+  Phase::Value m_phase;
+  TimeSpec m_phaseStart;
+  size_t m_upCount;
+
+  // Measurements. These are only recorded during Phase::Measure
+  uint64_t m_txPackets;
+  uint64_t m_rxPackets;
+  uint64_t m_sendErrors;
+  uint64_t m_lateDutTx;  // Beacon packets that arrived later than the negotiated interval.
+  Histogram m_peerTimerLateness;  // In microseconds.
+  Histogram m_dutTxGap;  // In microseconds.
+  double m_measureSeconds;
+  double m_dutCpuSeconds;
+  double m_peerCpuSeconds;
+  TimeSpec m_measureStartTime;
+  TimeSpec m_processCpuStart;
+  TimeSpec m_peerCpuStart;
+
+  size_t m_stoppedCount;
+};
+
+/**
+ * Gets the cpu time used by the whole process.
+ */
+static TimeSpec processCpuTime()
+{
+  struct rusage usage;
+  if (0 != getrusage(RUSAGE_SELF, &usage))
+    return TimeSpec();
+  return TimeSpec(usage.ru_utime) + TimeSpec(usage.ru_stime);
+}
+
+/**
+ * Gets the cpu time used by the calling thread.
+ */
+static TimeSpec threadCpuTime()
+{
+  TimeSpec now;
+  if (0 != clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now))
+    return TimeSpec();
+  return now;
+}
+
+static uint64_t toMicroseconds(const TimeSpec &time)
+{
+  int64_t nsec = time.ToNanoseconds();
+  return nsec <= 0 ? 0 : uint64_t(nsec / TimeSpec::NSecPerUs);
+}
+
+/**
+ * Gets the address after addr. For IPv6 only the low 32 bits are changed.
+ */
+static IpAddr nextAddress(const IpAddr &addr)
+{
+  sockaddr_storage storage;
+
+  memcpy(&storage, &addr.GetSockAddr(), addr.GetSize());
+  if (addr.IsIPv4())
+  {
+    sockaddr_in *sin = (sockaddr_in *)&storage;
+    sin->sin_addr.s_addr = htonl(ntohl(sin->sin_addr.s_addr) + 1);
+  }
+  else
+  {
+    sockaddr_in6 *sin6 = (sockaddr_in6 *)&storage;
+    uint32_t low;
+    memcpy(&low, &sin6->sin6_addr.s6_addr[12], sizeof(low));
+    low = htonl(ntohl(low) + 1);
+    memcpy(&sin6->sin6_addr.s6_addr[12], &low, sizeof(low));
+  }
+
+  return IpAddr((const sockaddr *)&storage, addr.GetSize());
+}
+
+Bench::~Bench()
+{
+  stopPeers();
+  stopBeacon();
+}
+
+bool Bench::Run()
+{
+  if (!startBeacon() || !waitForBeacon())
+    return false;
+
+  if (!m_beacon.QueueOperation(configureBeaconCallback, this, true /*waitForCompletion*/))
+  {
+    fprintf(stderr, "Failed to configure the beacon.\n");
+    return false;
+  }
+
+#ifdef USE_KEVENT_SCHEDULER
+  m_scheduler = new KeventScheduler();
+#elif defined(USE_EPOLL_SCHEDULER)
+  m_scheduler = new EpollScheduler();
+#else
+  m_scheduler = new SelectScheduler();
+#endif
+
+  if (!startPeers())
+    return false;
+
+  fprintf(stderr, "Waiting for %zu sessions to come up.\n", m_peers.size());
+  if (!m_scheduler->Run())
+  {
+    fprintf(stderr, "Failed to run the peer scheduler.\n");
+    return false;
+  }
+
+  if (m_phase != Phase::Done)
+    return false;
+
+  if (m_options.detectCount != 0)
+    m_beacon.QueueOperation(collectDetectionCallback, this, true /*waitForCompletion*/);
+
+  return report();
+}
+
+bool Bench::startBeacon()
+{
+  m_beacon.SetShardCount(m_options.shards);
+  m_beacon.SetTransmitBatching(TransmitQueue::DefaultMaxDepth, m_options.txWindow, m_options.sharedTx);
+  m_beacon.SetIoUringScheduler(m_options.uring);
+
+  if (0 != pthread_create(&m_beaconThread, NULL, beaconThreadCallback, this))
+  {
+    fprintf(stderr, "Failed to start the beacon thread.\n");
+    return false;
+  }
+  m_beaconThreadStarted = true;
+  return true;
+}
+
+void Bench::stopBeacon()
+{
+  if (!m_beaconThreadStarted)
+    return;
+
+  m_beacon.RequestShutdown();
+  pthread_join(m_beaconThread, NULL);
+  m_beaconThreadStarted = false;
+}
+
+void Bench::beaconThread()
+{
+  list<SockAddr> controlPorts;
+  list<IpAddr> listenAddrs;
+
+  if (UtilsInitThread())
+  {
+    controlPorts.push_back(m_options.controlAddr);
+    listenAddrs.push_back(m_options.dutAddr);
+    if (!m_beacon.Run(controlPorts, listenAddrs))
+      fprintf(stderr, "The beacon failed to run.\n");
+  }
+
+  AutoQuickLock lock(m_beaconLock, true);
+  m_beaconExited = true;
+}
+
+bool Bench::beaconExited()
+{
+  AutoQuickLock lock(m_beaconLock, true);
+  return m_beaconExited;
+}
+
+/**
+ * The command processors are started after everything else, so once the
+ * control port answers a command, the beacon can handle operations.
+ *
+ * @return bool - false if the beacon did not start.
+ */
+bool Bench::waitForBeacon()
+{
+  static const char command[] = "version";
+  uint8_t buffer[sizeof(uint32_t) + sizeof(command)];
+  uint32_t magic = htonl(MagicMessageNumber);
+
+  memcpy(buffer, &magic, sizeof(magic));
+  memcpy(buffer + sizeof(magic), command, sizeof(command));
+
+  for (int attempt = 0; attempt < 500 && !beaconExited(); attempt++)
+  {
+    Socket socket;
+
+    socket.SetQuiet(true);
+    if (socket.OpenTCP(m_options.controlAddr.Type())
+        && socket.Connect(m_options.controlAddr)
+        && socket.Send(buffer, sizeof(buffer)))
+    {
+      // Read the reply until the beacon closes the connection.
+      char reply[256];
+      while (0 < ::recv(socket.GetSocket(), reply, sizeof(reply), 0))
+        ;
+      return true;
+    }
+    usleep(10000);
+  }
+
+  fprintf(stderr, "The beacon did not start.\n");
+  return false;
+}
+
+/**
+ * Called on each beacon shard's scheduler thread.
+ */
+void Bench::configureBeacon(Beacon *beacon)
+{
+  beacon->AllowAllPassiveConnections(true);
+  beacon->SetDefMulti(m_options.detectMulti);
+  beacon->SetDefMinTxInterval(m_options.interval);
+  beacon->SetDefMinRxInterval(m_options.interval);
+}
+
+/**
+ * Called on each beacon shard's scheduler thread, after the peers have finished.
+ * Gets the time that each stopped peer's session went down.
+ */
+void Bench::collectDetection(Beacon *beacon)
+{
+  for (size_t index = 0; index < m_peers.size(); index++)
+  {
+    BenchPeer *peer = m_peers[index];
+    if (!peer->stopped || peer->detected)
+      continue;
+
+    Session *session = beacon->FindSessionIp(peer->addr, m_options.dutAddr);
+    if (!session)
+      continue;
+
+    try
+    {
+      Session::ExtendedStateInfo info;
+
+      session->GetExtendedState(info);
+      if (!info.uptimeList.empty()
+          && info.uptimeList.front().state == bfd::State::Down
+          && info.localDiag == bfd::Diag::ControlDetectExpired)
+      {
+        peer->remoteDownTime = info.uptimeList.front().startTime;
+        peer->detected = true;
+      }
+    }
+    catch (std::exception &)
+    {
+    }
+  }
+}
+
+bool Bench::startPeers()
+{
+  struct rlimit limit;
+  IpAddr addr = m_options.firstPeerAddr;
+
+  // Each peer uses a socket, as does each session on the beacon.
+  if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  m_peers.reserve(m_options.sessions);
+  for (size_t index = 0; index < m_options.sessions; index++, addr = nextAddress(addr))
+  {
+    BenchPeer *peer = new BenchPeer(*this, index, addr);
+    m_peers.push_back(peer);
+
+    peer->socket.SetLogName(FormatShortStr("bench peer %s", addr.ToString()));
+    if (!peer->socket.OpenUDP(addr.Type())
+        || !peer->socket.SetBlocking(false)
+        || !peer->socket.SetTTLOrHops(bfd::TTLValue)
+        || !peer->socket.Bind(SockAddr(addr, bfd::ListenPort)))
+    {
+      fprintf(stderr, "Failed to open socket for peer %s.\n", addr.ToString());
+      return false;
+    }
+
+    if (!m_scheduler->SetSocketCallback(peer->socket.GetSocket(), handleSocketCallback, peer))
+    {
+      fprintf(stderr, "Failed to add socket for peer %s.\n", addr.ToString());
+      return false;
+    }
+
+    peer->txTimer = m_scheduler->MakeTimer(FormatShortStr("peer %zu tx", index));
+    peer->txTimer->SetCallback(handleTxTimerCallback, peer);
+    peer->txTimer->SetPriority(Timer::Priority::Hi);
+  }
+
+  m_phaseTimer = m_scheduler->MakeTimer("bench phase");
+  m_phaseTimer->SetCallback(handlePhaseTimerCallback, this);
+  m_phaseTimer->SetMsTimer(100);
+  m_phaseStart = TimeSpec::MonoNow();
+
+  // Spread the initial packets over one interval.
+  for (size_t index = 0; index < m_peers.size(); index++)
+  {
+    BenchPeer *peer = m_peers[index];
+    uint64_t delay = uint64_t(m_options.interval) * index / m_peers.size();
+    peer->txTarget = TimeSpec::MonoNow() + TimeSpec(TimeSpec::Microsec, int64_t(delay));
+    peer->txTimer->SetMicroTimer(delay);
+  }
+
+  return true;
+}
+
+void Bench::stopPeers()
+{
+  for (size_t index = 0; index < m_peers.size(); index++)
+  {
+    BenchPeer *peer = m_peers[index];
+    if (m_scheduler && peer->txTimer)
+      m_scheduler->FreeTimer(peer->txTimer);
+    if (m_scheduler && !peer->socket.empty())
+      m_scheduler->RemoveSocketCallback(peer->socket.GetSocket());
+    delete peer;
+  }
+  m_peers.clear();
+
+  if (m_scheduler)
+  {
+    if (m_phaseTimer)
+      m_scheduler->FreeTimer(m_phaseTimer);
+    m_phaseTimer = NULL;
+    delete m_scheduler;
+    m_scheduler = NULL;
+  }
+}
+
+void Bench::sendPacket(BenchPeer &peer, bool final)
+{
+  BfdPacketHeader header;
+  SockAddr dutAddr(m_options.dutAddr, bfd::ListenPort);
+
+  memset(&header, 0, sizeof(header));
+  header.SetVersion(bfd::Version);
+  header.length = sizeof(header);
+  header.SetState(peer.state);
+  header.SetFinal(final);
+  header.detectMult = m_options.detectMulti;
+  header.myDisc = htonl(peer.myDisc);
+  header.yourDisc = htonl(peer.yourDisc);
+  header.txDesiredMinInt = htonl(m_options.interval);
+  header.rxRequiredMinInt = htonl(m_options.interval);
+  header.rxRequiredMinEchoInt = htonl(0);
+
+  // Timed before the send, since the beacon may have the packet before sendto()
+  // returns.
+  TimeSpec sendTime = TimeSpec::MonoNow();
+  if (0 > ::sendto(peer.socket.GetSocket(), &header, sizeof(header), 0, &dutAddr.GetSockAddr(), dutAddr.GetSize()))
+  {
+    if (m_phase == Phase::Measure)
+      m_sendErrors++;
+    return;
+  }
+
+  peer.lastTx = sendTime;
+  if (m_phase == Phase::Measure)
+    m_txPackets++;
+}
+
+/**
+ * Schedules the next packet, at the negotiated interval, reduced by 0 to 25%
+ * as in v10/6.8.7.
+ */
+void Bench::scheduleTx(BenchPeer &peer)
+{
+  uint64_t interval = max(m_options.interval, peer.remoteRequiredMinRx);
+  uint64_t delay = interval * (75 + uint64_t(rand() % 26)) / 100;
+
+  peer.txTarget = TimeSpec::MonoNow() + TimeSpec(TimeSpec::Microsec, int64_t(delay));
+  peer.txTimer->SetMicroTimer(delay);
+}
+
+void Bench::setPeerState(BenchPeer &peer, bfd::State::Value state)
+{
+  if (state == peer.state)
+    return;
+  if (peer.state == bfd::State::Up)
+    m_upCount--;
+  else if (state == bfd::State::Up)
+    m_upCount++;
+  peer.state = state;
+}
+
+void Bench::handleTxTimerCallback(Timer *timer, void *userdata)
+{
+  BenchPeer *peer = reinterpret_cast<BenchPeer *>(userdata);
+  (void)timer;
+  peer->bench->handleTxTimer(*peer);
+}
+
+void Bench::handleTxTimer(BenchPeer &peer)
+{
+  if (m_phase == Phase::Measure)
+    m_peerTimerLateness.Record(toMicroseconds(TimeSpec::MonoNow() - peer.txTarget));
+
+  if (peer.stopped)
+    return;
+
+  sendPacket(peer, false);
+  scheduleTx(peer);
+}
+
+void Bench::handleSocketCallback(int socket, void *userdata)
+{
+  BenchPeer *peer = reinterpret_cast<BenchPeer *>(userdata);
+  (void)socket;
+  peer->bench->handleSocket(*peer);
+}
+
+void Bench::handleSocket(BenchPeer &peer)
+{
+  uint8_t buffer[bfd::MaxPacketSize];
+  BfdPacket packet;
+
+  // Limit the reads per callback, so one peer can not starve the others.
+  for (int count = 0; count < 8; count++)
+  {
+    ssize_t received = ::recv(peer.socket.GetSocket(), buffer, sizeof(buffer), 0);
+    if (received < 0)
+      break;
+    if (Session::InitialProcessControlPacket(buffer, size_t(received), packet))
+      handlePacket(peer, packet);
+  }
+}
+
+/**
+ * Handles a packet from the beacon, which is in host order. The state machine
+ * is v10/6.8.6, without demand, echo or authentication.
+ */
+void Bench::handlePacket(BenchPeer &peer, const BfdPacket &packet)
+{
+  const BfdPacketHeader &header = packet.header;
+  TimeSpec now(TimeSpec::MonoNow());
+  bfd::State::Value received = header.GetState();
+
+  if (m_phase == Phase::Measure)
+  {
+    m_rxPackets++;
+
+    // Poll and final packets are sent outside the normal schedule.
+    if (peer.state == bfd::State::Up && received == bfd::State::Up
+        && peer.remoteState == bfd::State::Up
+        && !header.GetPoll() && !header.GetFinal() && !peer.lastRx.empty())
+    {
+      uint64_t gap = toMicroseconds(now - peer.lastRx);
+      m_dutTxGap.Record(gap);
+      if (gap > max(header.txDesiredMinInt, m_options.interval))
+        m_lateDutTx++;
+    }
+  }
+
+  peer.lastRx = now;
+  peer.yourDisc = header.myDisc;
+  peer.remoteState = received;
+  peer.remoteRequiredMinRx = header.rxRequiredMinInt;
+
+  if (received == bfd::State::AdminDown)
+    setPeerState(peer, bfd::State::Down);
+  else if (peer.state == bfd::State::Down)
+  {
+    if (received == bfd::State::Down)
+      setPeerState(peer, bfd::State::Init);
+    else if (received == bfd::State::Init)
+      setPeerState(peer, bfd::State::Up);
+  }
+  else if (peer.state == bfd::State::Init)
+  {
+    if (received == bfd::State::Init || received == bfd::State::Up)
+      setPeerState(peer, bfd::State::Up);
+  }
+  else if (received == bfd::State::Down)
+    setPeerState(peer, bfd::State::Down);
+
+  if (header.GetPoll() && !peer.stopped)
+    sendPacket(peer, true);
+}
+
+void Bench::handlePhaseTimer()
+{
+  TimeSpec elapsed = TimeSpec::MonoNow() - m_phaseStart;
+
+  if (m_phase == Phase::Warmup)
+  {
+    if (m_upCount == m_peers.size())
+    {
+      fprintf(stderr, "All sessions up after %.2f seconds. Measuring for %u seconds.\n", elapsed.ToDecimal(), m_options.duration);
+      beginMeasure();
+      m_phaseTimer->SetMsTimer(m_options.duration * 1000);
+      return;
+    }
+
+    if (beaconExited() || elapsed.ToDecimal() > m_options.warmup)
+    {
+      fprintf(stderr, "Only %zu of %zu sessions came up. Aborting.\n", m_upCount, m_peers.size());
+      m_scheduler->RequestShutdown();
+      return;
+    }
+
+    m_phaseTimer->SetMsTimer(100);
+  }
+  else if (m_phase == Phase::Measure)
+  {
+    endMeasure();
+
+    m_phase = Phase::Detect;
+    m_phaseStart = TimeSpec::MonoNow();
+
+    // Stop several peers, spread across the range.
+    size_t count = min(m_options.detectCount, m_peers.size());
+    for (size_t index = 0; index < count; index++)
+    {
+      BenchPeer *peer = m_peers[index * m_peers.size() / count];
+      peer->stopped = true;
+      peer->txTimer->Stop();
+      m_stoppedCount++;
+    }
+
+    if (count)
+      fprintf(stderr, "Stopped %zu peers to measure detection time.\n", count);
+
+    // Detection takes detectMulti intervals. Allow extra, in case the beacon is busy.
+    uint64_t wait = uint64_t(m_options.interval) * m_options.detectMulti * 2 / 1000 + 1000;
+    m_phaseTimer->SetMsTimer(count ? uint32_t(wait) : 1);
+  }
+  else if (m_phase == Phase::Detect)
+  {
+    m_phase = Phase::Done;
+    m_scheduler->RequestShutdown();
+  }
+}
+
+void Bench::beginMeasure()
+{
+  m_phase = Phase::Measure;
+  m_phaseStart = TimeSpec::MonoNow();
+  m_measureStartTime = m_phaseStart;
+  m_processCpuStart = processCpuTime();
+  m_peerCpuStart = threadCpuTime();
+}
+
+void Bench::endMeasure()
+{
+  TimeSpec processCpu = processCpuTime() - m_processCpuStart;
+  TimeSpec peerCpu = threadCpuTime() - m_peerCpuStart;
+
+  m_measureSeconds = (TimeSpec::MonoNow() - m_measureStartTime).ToDecimal();
+  m_peerCpuSeconds = peerCpu.ToDecimal();
+  // Everything but the peer thread is the beacon (including logging).
+  m_dutCpuSeconds = max(0.0, processCpu.ToDecimal() - m_peerCpuSeconds);
+}
+
+/**
+ * Prints the results as "key value" lines.
+ */
+bool Bench::report()
+{
+  char buf[256];
+  double seconds = m_measureSeconds > 0 ? m_measureSeconds : 1;
+  Histogram detection;
+  Histogram detectionError;
+  uint64_t expected = uint64_t(m_options.interval) * m_options.detectMulti;
+  uint64_t early = 0;
+
+  for (size_t index = 0; index < m_peers.size(); index++)
+  {
+    BenchPeer *peer = m_peers[index];
+    if (!peer->stopped || !peer->detected)
+      continue;
+
+    uint64_t detect = toMicroseconds(peer->remoteDownTime - peer->lastTx);
+    detection.Record(detect);
+    if (detect < expected)
+      early++;
+    else
+      detectionError.Record(detect - expected);
+  }
+
+  fprintf(stdout, "sessions %zu\n", m_peers.size());
+  fprintf(stdout, "shards %zu\n", m_options.shards);
+  fprintf(stdout, "interval_us %u\n", m_options.interval);
+  fprintf(stdout, "detect_multi %hhu\n", m_options.detectMulti);
+  fprintf(stdout, "duration_s %.3f\n", m_measureSeconds);
+  fprintf(stdout, "rx_pps %.1f\n", double(m_txPackets) / seconds);
+  fprintf(stdout, "tx_pps %.1f\n", double(m_rxPackets) / seconds);
+  fprintf(stdout, "peer_send_errors %" PRIu64 "\n", m_sendErrors);
+  fprintf(stdout, "beacon_cpu_percent %.2f\n", m_dutCpuSeconds * 100.0 / seconds);
+  fprintf(stdout, "beacon_cpu_us_per_session_per_s %.3f\n", m_dutCpuSeconds * 1000000.0 / seconds / double(max(m_peers.size(), size_t(1))));
+  fprintf(stdout, "peer_cpu_percent %.2f\n", m_peerCpuSeconds * 100.0 / seconds);
+  fprintf(stdout, "beacon_tx_gap_us %s\n", m_dutTxGap.Summary(buf, sizeof(buf)));
+  fprintf(stdout, "beacon_tx_late %" PRIu64 "\n", m_lateDutTx);
+  fprintf(stdout, "peer_timer_late_us %s\n", m_peerTimerLateness.Summary(buf, sizeof(buf)));
+  fprintf(stdout, "detect_stopped %zu\n", m_stoppedCount);
+  fprintf(stdout, "detect_missed %zu\n", m_stoppedCount - size_t(detection.Count()));
+  fprintf(stdout, "detect_expected_us %" PRIu64 "\n", expected);
+  fprintf(stdout, "detect_us %s\n", detection.Summary(buf, sizeof(buf)));
+  fprintf(stdout, "detect_early %" PRIu64 "\n", early);
+  fprintf(stdout, "detect_late_us %s\n", detectionError.Summary(buf, sizeof(buf)));
+
+  return true;
+}
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --sessions=N     Number of simulated peers (default 100).\n"
+          "  --interval=US    Transmit and receive interval in microseconds (default 100000).\n"
+          "  --multi=N        Detection multiplier (default 3).\n"
+          "  --duration=SEC   Seconds to measure, once all sessions are up (default 10).\n"
+          "  --warmup=SEC     Maximum seconds to wait for sessions to come up (default 30).\n"
+          "  --detect=N       Peers to stop to measure detection time (default 10).\n"
+          "  --dut=ADDR       Beacon listen address (default 127.0.0.1).\n"
+          "  --peers=ADDR     First peer address. Each peer uses the next address (default 127.1.0.1).\n"
+          "  --control=ADDR   Beacon control address and port (default 127.0.0.1:9959).\n"
+          "  --shards=N       Beacon scheduler threads (default 1).\n"
+          "  --txwindow=US    Beacon transmit batching window (default 0).\n"
+          "  --sharedtx       Beacon sessions share transmit sockets.\n"
+          "  --uring          Beacon uses the io_uring scheduler, where supported.\n",
+          BenchAppName);
+}
+
+static bool parseUInt(const char *name, const char *valueString, uint64_t minVal, uint64_t maxVal, uint64_t &outValue)
+{
+  if (!valueString || !StringToInt(valueString, outValue) || outValue < minVal || outValue > maxVal)
+  {
+    fprintf(stderr, "%s must be followed by an '=' and a number from %" PRIu64 " to %" PRIu64 ".\n", name, minVal, maxVal);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions options;
+  const char *valueString;
+  uint64_t value;
+
+  if (!UtilsInit() || !UtilsInitThread())
+  {
+    fprintf(stderr, "Unable to init thread local storage. Exiting.\n");
+    exit(1);
+  }
+
+  for (int argIndex = 1; argIndex < argc; argIndex++)
+  {
+    bool ok = true;
+
+    if (CheckArg("--sessions", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--sessions", valueString, 1, 1000000, value)))
+        options.sessions = size_t(value);
+    }
+    else if (CheckArg("--interval", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--interval", valueString, 1000, 10000000, value)))
+        options.interval = uint32_t(value);
+    }
+    else if (CheckArg("--multi", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--multi", valueString, 1, 255, value)))
+        options.detectMulti = uint8_t(value);
+    }
+    else if (CheckArg("--duration", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--duration", valueString, 1, 86400, value)))
+        options.duration = uint32_t(value);
+    }
+    else if (CheckArg("--warmup", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--warmup", valueString, 1, 3600, value)))
+        options.warmup = uint32_t(value);
+    }
+    else if (CheckArg("--detect", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--detect", valueString, 0, 1000000, value)))
+        options.detectCount = size_t(value);
+    }
+    else if (CheckArg("--shards", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--shards", valueString, 1, Beacon::MaxShardCount, value)))
+        options.shards = size_t(value);
+    }
+    else if (CheckArg("--txwindow", argv[argIndex], &valueString))
+    {
+      if ((ok = parseUInt("--txwindow", valueString, 0, 1000000, value)))
+        options.txWindow = uint32_t(value);
+    }
+    else if (0 == strcmp("--sharedtx", argv[argIndex]))
+      options.sharedTx = true;
+    else if (0 == strcmp("--uring", argv[argIndex]))
+      options.uring = true;
+    else if (CheckArg("--dut", argv[argIndex], &valueString))
+    {
+      if (!valueString || !options.dutAddr.FromString(valueString))
+      {
+        fprintf(stderr, "--dut must be followed by an '=' and an IPv4 or IPv6 address.\n");
+        ok = false;
+      }
+    }
+    else if (CheckArg("--peers", argv[argIndex], &valueString))
+    {
+      if (!valueString || !options.firstPeerAddr.FromString(valueString))
+      {
+        fprintf(stderr, "--peers must be followed by an '=' and an IPv4 or IPv6 address.\n");
+        ok = false;
+      }
+    }
+    else if (CheckArg("--control", argv[argIndex], &valueString))
+    {
+      if (!valueString || !options.controlAddr.FromString(valueString) || !options.controlAddr.HasPort())
+      {
+        fprintf(stderr, "--control must be followed by an '=' and an ip address with a port.\n");
+        ok = false;
+      }
+    }
+    else if (0 == strcmp("--help", argv[argIndex]))
+    {
+      usage();
+      exit(0);
+    }
+    else
+    {
+      fprintf(stderr, "Unrecognized %s command line option %s.\n", BenchAppName, argv[argIndex]);
+      usage();
+      ok = false;
+    }
+
+    if (!ok)
+      exit(1);
+  }
+
+  if (options.dutAddr.Type() != options.firstPeerAddr.Type())
+  {
+    fprintf(stderr, "--dut and --peers must be the same address family.\n");
+    exit(1);
+  }
+
+  // Errors only, so that logging does not skew the results.
+  gLog.SetLogLevel(Log::Minimal);
+  gLog.SetStdErr(Log::Minimal, true);
+
+  srand(time(NULL));
+
+  Bench bench(options);
+
+  return bench.Run() ? 0 : 1;
+}
@@ -6,11 +6,19 @@
 #include "common.h"
 #include "SmartPointer.h"
 #include "Socket.h"
+#include "ControlFrame.h"
+#include "StatusExport.h"
+#include "TimeSpec.h"
+#include "bfd.h"
 #include <vector>
+#include <deque>
 #include <errno.h>
 #include <fstream>
+#include <iostream>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include "utils.h"
 #include <unistd.h>
 
@@ -81,12 +89,34 @@ static bool SendData(const char *message, size_t message_size, const SockAddr &c
   }
 
   // Read until done
-  while (fgets(&buffer.front(), buffer.size(), fileHandle))
+  if (outPrefix)
   {
-    if (outPrefix)
+    while (fgets(&buffer.front(), buffer.size(), fileHandle))
+    {
       fputs(outPrefix, stdout);
-
-    fputs(&buffer.front(), stdout);
+      fputs(&buffer.front(), stdout);
+    }
+  }
+  else
+  {
+    // Copy as is, since the reply may be binary. See "status ... binary". The
+    // socket is read directly, so that "subscribe" events appear as they arrive.
+    ssize_t length;
+    while (true)
+    {
+      length = ::read(sendSocket, &buffer.front(), buffer.size());
+      if (length < 0 && errno == EINTR)
+        continue;
+      if (length <= 0)
+        break;
+      fwrite(&buffer.front(), 1, size_t(length), stdout);
+      fflush(stdout);
+    }
+    if (length < 0)
+    {
+      perror("\nConnection failed. Partial completion may have occurred: \n");
+      return true;
+    }
   }
 
   if (ferror(fileHandle))
@@ -121,23 +151,277 @@ static void AddParamToBuffer(vector<char> &buffer, const char *param)
   memcpy(&buffer[pos], param,  length);
 }
 
-static bool doLoadScript(const char *path, const SockAddr &connectAddr)
+/**
+ * A connection that carries many requests, using the framing in ControlFrame.h.
+ * Requests are sent without waiting for replies, up to MaxRequestsInFlight at a
+ * time, and the replies are printed as they arrive.
+ */
+class FramedConnection
+{
+public:
+  static const size_t MaxRequestsInFlight = 32;
+
+  /**
+   * @param outPrefix [in] - If not null, then every response line will be
+   *                  prefixed with this string.
+   */
+  FramedConnection(const char *outPrefix) : m_prefix(outPrefix), m_nextTag(1), m_lineStart(true)
+  {
+  }
+
+  bool Connect(const SockAddr &connectAddr)
+  {
+    uint32_t magic = htonl(MagicFramedNumber);
+
+    if (!m_socket.OpenTCP(connectAddr.Type()))
+    {
+      fprintf(stderr, "Error creating %s socket: %s\n",
+              Addr::TypeToString(connectAddr.Type()),
+              SystemErrorToString(m_socket.GetLastError()));
+      return false;
+    }
+
+    if (!m_socket.Connect(connectAddr))
+    {
+      fprintf(stderr, "Error connecting to beacon on %s: %s\n",
+              connectAddr.ToString(),
+              SystemErrorToString(m_socket.GetLastError()));
+      return false;
+    }
+
+    if (!m_socket.Send(&magic, sizeof(magic)))
+    {
+      fprintf(stderr, "Error sending to beacon: %s\n", SystemErrorToString(m_socket.GetLastError()));
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Sends a request, first waiting for replies if too many are outstanding.
+   *
+   * @param commands [in] - Each double null terminated.
+   * @param length [in] - Length of commands. No more than MaxControlRequestSize.
+   * @param echo [in] - Printed before the reply.
+   *
+   * @return bool - false on failure.
+   */
+  bool Send(const char *commands, size_t length, const string &echo)
+  {
+    ControlFrameHeader header;
+
+    while (m_pending.size() >= MaxRequestsInFlight)
+    {
+      if (!readReply())
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.length = htonl(uint32_t(length));
+    header.tag = htonl(m_nextTag);
+    header.type = ControlFrameType::Request;
+    m_output.assign(reinterpret_cast<const char *>(&header), sizeof(header));
+    m_output.append(commands, length);
+
+    if (!m_socket.Send(m_output.data(), m_output.size()))
+    {
+      fprintf(stderr, "Error sending command to beacon: %s\n", SystemErrorToString(m_socket.GetLastError()));
+      return false;
+    }
+
+    m_pending.push_back(Request(m_nextTag++, echo));
+    return true;
+  }
+
+  /**
+   * Waits for the replies to all requests.
+   *
+   * @return bool - false on failure.
+   */
+  bool Finish()
+  {
+    while (!m_pending.empty())
+    {
+      if (!readReply())
+        return false;
+    }
+    return true;
+  }
+
+private:
+  struct Request
+  {
+    Request(uint32_t inTag, const string &inEcho) : tag(inTag), echo(inEcho), started(false) { }
+    uint32_t tag;
+    string echo;
+    bool started; // echo has been printed.
+  };
+
+  /**
+   * Reads until at least one more request has been fully answered.
+   */
+  bool readReply()
+  {
+    size_t pending = m_pending.size();
+    char buffer[16 * 1024];
+
+    while (true)
+    {
+      if (!handleInput())
+        return false;
+      if (m_pending.size() < pending)
+        return true;
+
+      ssize_t length = ::recv(m_socket, buffer, sizeof(buffer), 0);
+      if (length < 0 && errno == EINTR)
+        continue;
+      if (length < 0)
+      {
+        perror("\nConnection failed. Partial completion may have occurred: \n");
+        return false;
+      }
+      if (length == 0)
+      {
+        fprintf(stderr, "\nBeacon closed the connection. Partial completion may have occurred.\n");
+        return false;
+      }
+      m_input.append(buffer, size_t(length));
+    }
+  }
+
+  /**
+   * Prints each complete frame in m_input.
+   */
+  bool handleInput()
+  {
+    ControlFrameHeader header;
+    size_t pos = 0;
+
+    while (m_input.size() - pos >= sizeof(header))
+    {
+      memcpy(&header, m_input.data() + pos, sizeof(header));
+      uint32_t length = ntohl(header.length);
+      if (m_input.size() - pos - sizeof(header) < length)
+        break;
+
+      if (m_pending.empty() || ntohl(header.tag) != m_pending.front().tag
+          || (header.type != ControlFrameType::Data && header.type != ControlFrameType::End))
+      {
+        fprintf(stderr, "\nUnexpected reply from beacon.\n");
+        return false;
+      }
+
+      Request &request = m_pending.front();
+      if (!request.started)
+      {
+        fputs(request.echo.c_str(), stdout);
+        request.started = true;
+      }
+
+      pos += sizeof(header);
+      if (header.type == ControlFrameType::Data)
+        writeReply(m_input.data() + pos, length);
+      else
+      {
+        if (m_prefix && !m_lineStart)
+          fputc('\n', stdout);
+        m_lineStart = true;
+        m_pending.pop_front();
+      }
+      pos += length;
+    }
+
+    m_input.erase(0, pos);
+    fflush(stdout);
+    return true;
+  }
+
+  void writeReply(const char *data, size_t length)
+  {
+    if (!m_prefix)
+    {
+      fwrite(data, 1, length, stdout);
+      return;
+    }
+
+    const char *end = data + length;
+    while (data < end)
+    {
+      if (m_lineStart)
+        fputs(m_prefix, stdout);
+      const char *lineEnd = reinterpret_cast<const char *>(memchr(data, '\n', end - data));
+      m_lineStart = (lineEnd != NULL);
+      lineEnd = lineEnd ? lineEnd + 1 : end;
+      fwrite(data, 1, lineEnd - data, stdout);
+      data = lineEnd;
+    }
+  }
+
+  const char *m_prefix;
+  Socket m_socket;
+  uint32_t m_nextTag;
+  deque<Request> m_pending; // Sent, and not yet fully answered. In order.
+  string m_input;   // Received and not yet printed.
+  string m_output;
+  bool m_lineStart; // Next reply data starts a line.
+};
+
+const size_t FramedConnection::MaxRequestsInFlight;
+
+/**
+ * Sends the batch of commands, if there are any, and clears it.
+ *
+ * @param batch [in/out] - Commands, each of which is double null terminated.
+ * @param commands [in/out] - The text of each command in batch.
+ * @param echo [in] - Print each command before its reply.
+ *
+ * @return bool - false on failure.
+ */
+static bool sendBatch(FramedConnection &connection, vector<char> &batch, vector<string> &commands, bool echo)
+{
+  string echoText;
+
+  if (batch.empty())
+    return true;
+
+  if (echo)
+  {
+    for (size_t index = 0; index < commands.size(); index++)
+      echoText.append(FormatBigStr(" Command <%s>\n", commands[index].c_str()));
+  }
+
+  bool success = connection.Send(&batch.front(), batch.size(), echoText);
+  batch.resize(0);
+  commands.clear();
+  return success;
+}
+
+/**
+ * Runs the commands in the script. As many commands as will fit are sent in
+ * each request, so that the beacon can run them as a batch, and all requests
+ * share one framed connection.
+ *
+ * @param input [in] - The script.
+ * @param name [in] - For errors.
+ * @param echo [in] - Print each command, and indent the replies. Otherwise only
+ *             the replies are printed, as is.
+ */
+static bool runScript(istream &input, const char *name, const SockAddr &connectAddr, bool echo)
 {
-  ifstream file;
   string line;
   int lines = 0;
   vector<char> buffer;
+  vector<char> batch;
+  vector<string> batchCommands;
   const char *seps = " \t";
+  FramedConnection connection(echo ? "   " : NULL);
 
-  file.open(path);
-  if (!file.is_open())
-  {
-    fprintf(stderr, "Failed to open file <%s> : %s\n", path, ErrnoToString());
+  if (!connection.Connect(connectAddr))
     return false;
-  }
 
   buffer.reserve(MaxCommandSize);
-  while (getline(file, line), file.good())
+  batch.reserve(MaxCommandSize);
+  while (getline(input, line), input.good())
   {
     size_t pos = 0;
     lines++;
@@ -167,22 +451,126 @@ static bool doLoadScript(const char *path, const SockAddr &connectAddr)
 
     if (buffer.size() != 0)
     {
-      fprintf(stdout, " Command <%s>\n", line.c_str());
-
       // buffer is double null terminated.
       buffer.push_back('\0');
-      if (!SendData(&buffer.front(), buffer.size(), connectAddr, "   "))
+
+      if (buffer.size() > MaxControlRequestSize)
+      {
+        fprintf(stderr, "Command too long on line %d of <%s>. Not Sent.\n", lines, name);
         return false;
+      }
+
+      if (batch.size() + buffer.size() > MaxControlRequestSize)
+      {
+        if (!sendBatch(connection, batch, batchCommands, echo))
+          return false;
+      }
+
+      batch.insert(batch.end(), buffer.begin(), buffer.end());
+      batchCommands.push_back(line);
     }
   }
 
-  if (!file.eof())
+  if (!sendBatch(connection, batch, batchCommands, echo))
+    return false;
+
+  if (!connection.Finish())
+    return false;
+
+  if (!input.eof())
   {
-    fprintf(stderr, "Failed to read from file <%s>. %d lines processed: %s\n", path, lines, ErrnoToString());
+    fprintf(stderr, "Failed to read from <%s>. %d lines processed: %s\n", name, lines, ErrnoToString());
     return false;
   }
 
-  file.close();
+  return true;
+}
+
+static bool doLoadScript(const char *path, const SockAddr &connectAddr)
+{
+  ifstream file;
+
+  file.open(path);
+  if (!file.is_open())
+  {
+    fprintf(stderr, "Failed to open file <%s> : %s\n", path, ErrnoToString());
+    return false;
+  }
+
+  return runScript(file, path, connectAddr, true);
+}
+
+static const char* exportAddressString(const uint8_t *addr, uint8_t family, char *outBuffer, size_t bufferSize)
+{
+  if (!inet_ntop(family == 6 ? AF_INET6 : AF_INET, addr, outBuffer, socklen_t(bufferSize)))
+    return "?";
+  return outBuffer;
+}
+
+/**
+ * Prints the status export file of a beacon started with --statusexport. This
+ * reads the file directly, so it does not contact the beacon.
+ */
+static bool doShowExport(const char *path)
+{
+  StatusExport statusExport;
+  const char *error = "";
+
+  if (!statusExport.Attach(path, &error))
+  {
+    fprintf(stderr, "Failed to read status export file <%s> : %s\n", path, error);
+    return false;
+  }
+
+  const StatusExportHeader *header = statusExport.GetHeader();
+  uint64_t now = uint64_t(TimeSpec::MonoNow().ToNanoseconds());
+  char localAddr[INET6_ADDRSTRLEN];
+  char remoteAddr[INET6_ADDRSTRLEN];
+
+  fprintf(stdout, "Status export version %u from pid %u. %zu shards with room for %zu sessions each.\n",
+          header->version, header->pid, statusExport.GetShardCount(), statusExport.GetRecordsPerShard());
+
+  for (size_t shard = 0; shard < statusExport.GetShardCount(); shard++)
+  {
+    const StatusExportShard *totals = statusExport.GetShard(shard);
+    uint64_t refreshTime = totals->refreshTime;
+    uint64_t refreshAgeMs = (refreshTime && now > refreshTime) ? (now - refreshTime) / 1000000 : 0;
+
+    fprintf(stdout, "shard=%zu sessions=%" PRIu64 " missing=%" PRIu64 " refreshed=%" PRIu64 "ms\n",
+            shard, totals->sessions, totals->missing, refreshAgeMs);
+
+    for (size_t index = 0; index < statusExport.GetRecordsPerShard(); index++)
+    {
+      StatusExportRecord record;
+      if (!StatusExport::Read(*statusExport.GetRecord(shard, index), record))
+      {
+        fprintf(stdout, " shard=%zu record=%zu is changing too fast to read\n", shard, index);
+        continue;
+      }
+      if (record.id == 0)
+        continue;
+
+      uint64_t uptimeMs = 0;
+      if ((record.flags & StatusExportRecord::Flag::HasUptime) && now > record.lastChange)
+        uptimeMs = (now - record.lastChange) / 1000000;
+
+      fprintf(stdout, " id=%u local=%s remote=%s %s state=%s diag=%s remoteState=%s"
+              " txInterval=%u detect=%" PRIu64 " uptime=%" PRIu64 "ms"
+              " received=%" PRIu64 " sent=%" PRIu64 " discarded=%" PRIu64 " changes=%" PRIu64 " polls=%" PRIu64 "%s%s\n",
+              record.id,
+              exportAddressString(record.localAddr, record.localFamily, localAddr, sizeof(localAddr)),
+              exportAddressString(record.remoteAddr, record.remoteFamily, remoteAddr, sizeof(remoteAddr)),
+              (record.flags & StatusExportRecord::Flag::Active) ? "active" : "passive",
+              bfd::StateName(bfd::State::Value(record.localState)),
+              bfd::DiagString(bfd::Diag::Value(record.localDiag)),
+              bfd::StateName(bfd::State::Value(record.remoteState)),
+              record.transmitInterval, record.detectionTime, uptimeMs,
+              record.received, record.sent, record.discarded, record.stateChanges, record.pollSequences,
+              (record.flags & StatusExportRecord::Flag::HoldingState) ? " holding" : "",
+              (record.flags & StatusExportRecord::Flag::Suspended) ? " suspended" : "");
+    }
+  }
+
   return true;
 }
 
@@ -276,14 +664,75 @@ static int bfddMain(int argc, char *argv[])
     exit(0);
   }
 
+  // "batch" is like "load", but only the replies are shown. "-" reads the
+  // commands from stdin.
+  if (0 == strcmp(argv[argIndex], "batch"))
+  {
+    argIndex++;
+
+    if (argIndex >=  argc)
+    {
+      fprintf(stderr, "Must supply a script file, or '-' for stdin, after 'batch'\n");
+      exit(1);
+    }
+
+    bool success;
+    if (0 == strcmp(argv[argIndex], "-"))
+      success = runScript(cin, "stdin", connectAddr, false);
+    else
+    {
+      ifstream file(argv[argIndex]);
+      if (!file.is_open())
+      {
+        fprintf(stderr, "Failed to open file <%s> : %s\n", argv[argIndex], ErrnoToString());
+        exit(1);
+      }
+      success = runScript(file, argv[argIndex], connectAddr, false);
+    }
+    exit(success ? 0 : 1);
+  }
+
+  // "export" reads the status export file, and does not contact the beacon.
+  if (0 == strcmp(argv[argIndex], "export"))
+  {
+    argIndex++;
+
+    if (argIndex >=  argc)
+    {
+      fprintf(stderr, "Must supply a status export file after 'export'\n");
+      exit(1);
+    }
+
+    exit(doShowExport(argv[argIndex]) ? 0 : 1);
+  }
+
   // To allow for quotes, we concatenate all the arguments, separating them with
   // "NULL".
   vector<char> buffer;
 
   buffer.reserve(MaxCommandSize);
 
+  // The word before a file path, if the command has one.
+  const char *pathKeyword = NULL;
+  if (0 == strcmp(argv[argIndex], "connect") || 0 == strcmp(argv[argIndex], "sync"))
+    pathKeyword = "file";
+  else if (0 == strcmp(argv[argIndex], "capture"))
+    pathKeyword = "start";
   for (; argIndex < argc; argIndex++)
   {
+    // The beacon opens the 'connect file', 'sync file' and 'capture start'
+    // files, so they must not depend on our working directory.
+    if (pathKeyword && argv[argIndex][0] != '/' && 0 == strcmp(argv[argIndex - 1], pathKeyword))
+    {
+      char cwd[PATH_MAX];
+      if (!getcwd(cwd, sizeof(cwd)))
+      {
+        fprintf(stderr, "Failed to get current directory : %s\n", ErrnoToString());
+        exit(1);
+      }
+      AddParamToBuffer(buffer, (string(cwd) + "/" + argv[argIndex]).c_str());
+      continue;
+    }
     AddParamToBuffer(buffer, argv[argIndex]);
   }
 
@@ -0,0 +1,328 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Microbenchmark for the Beacon's session indexes.
+
+   Compares the FlatIndex used by the Beacon with the hash_map based indexes
+   that it replaced, at a given number of sessions. Results are printed as
+   "name value" lines.
+
+ */
+#include "common.h"
+#include "SessionIndex.h"
+#include "hash_map.h"
+#include "TimeSpec.h"
+#include "utils.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static const char *BenchAppName = "bfdd-index-bench";
+
+/**
+ * Has the same keys as a Session.
+ */
+class BenchItem
+{
+public:
+  BenchItem(uint32_t disc, uint32_t id, const IpAddr &remoteAddr, const IpAddr &localAddr) :
+     m_disc(disc), m_id(id), m_remoteAddr(remoteAddr), m_localAddr(localAddr), m_remoteKey(remoteAddr), m_localKey(localAddr) { }
+  uint32_t GetLocalDiscriminator() const { return m_disc;}
+  uint32_t GetId() const { return m_id;}
+  const IpAddr& GetRemoteAddress() const { return m_remoteAddr;}
+  const IpAddr& GetLocalAddress() const { return m_localAddr;}
+  const AddrKey& GetRemoteKey() const { return m_remoteKey;}
+  const AddrKey& GetLocalKey() const { return m_localKey;}
+
+private:
+  uint32_t m_disc;
+  uint32_t m_id;
+  IpAddr m_remoteAddr;
+  IpAddr m_localAddr;
+  AddrKey m_remoteKey;
+  AddrKey m_localKey;
+};
+
+/**
+ * The address key that the Beacon used with hash_map.
+ */
+struct OldSourceKey
+{
+  OldSourceKey(IpAddr remoteAddr, IpAddr localAddr) :  remoteAddr(remoteAddr), localAddr(localAddr) { }
+  IpAddr remoteAddr;
+  IpAddr localAddr;
+  bool operator==(const OldSourceKey &other) const { return remoteAddr == other.remoteAddr &&  localAddr == other.localAddr;}
+  struct hasher
+  {size_t operator ()(const OldSourceKey &me) const { return me.remoteAddr.hash() + me.localAddr.hash();}
+  };
+};
+
+typedef hash_map<uint32_t, BenchItem *>::Type OldDiscMap;
+typedef hash_map<OldSourceKey, BenchItem *, OldSourceKey::hasher>::Type OldSourceMap;
+typedef FlatIndex<BenchItem, DiscIndexTraits<BenchItem> > NewDiscMap;
+typedef FlatIndex<BenchItem, AddressIndexTraits<BenchItem> > NewSourceMap;
+
+/**
+ * Timings, in nanoseconds per operation.
+ */
+struct IndexResult
+{
+  double insert;
+  double findDisc;
+  double missDisc;
+  double findAddr;
+  double missAddr;
+  double erase;
+  size_t bytes;
+};
+
+// Keeps found items live, so that lookups are not optimized away.
+static volatile uintptr_t gSink;
+
+static IpAddr makeAddress(uint32_t value)
+{
+  in_addr addr;
+  addr.s_addr = htonl(value);
+  return IpAddr(&addr);
+}
+
+class IndexBench
+{
+public:
+  IndexBench(size_t count) : m_count(count) { }
+  ~IndexBench();
+
+  void Prepare();
+  void RunOld(IndexResult &outResult);
+  void RunNew(IndexResult &outResult);
+
+private:
+  double perOp(const TimeSpec &start, size_t ops) { return double((TimeSpec::MonoNow() - start).ToNanoseconds()) / double(max(ops, size_t(1)));}
+
+  size_t m_count;
+  vector<BenchItem *> m_items;
+  vector<BenchItem *> m_missing; // Same style of keys, never inserted.
+  vector<size_t> m_order; // Random lookup order.
+};
+
+IndexBench::~IndexBench()
+{
+  for (size_t index = 0; index < m_items.size(); index++)
+    delete m_items[index];
+  for (size_t index = 0; index < m_missing.size(); index++)
+    delete m_missing[index];
+}
+
+/**
+ * Creates items much like a Beacon would have. Discriminators are random, ids
+ * are sequential, and there are a few local addresses with many remotes.
+ */
+void IndexBench::Prepare()
+{
+  IpAddr localAddrs[4];
+  for (uint32_t index = 0; index < 4; index++)
+    localAddrs[index] = makeAddress(0x0a000001 + index);
+
+  for (size_t index = 0; index < m_count * 2; index++)
+  {
+    uint32_t disc = uint32_t(rand()) ^ (uint32_t(rand()) << 16);
+    BenchItem *item = new BenchItem(disc, uint32_t(index + 1),
+                                    makeAddress(0x0b000000 + uint32_t(index / 4)),
+                                    localAddrs[index % 4]);
+    if (index % 2)
+      m_missing.push_back(item);
+    else
+      m_items.push_back(item);
+  }
+
+  m_order.resize(m_count);
+  for (size_t index = 0; index < m_count; index++)
+    m_order[index] = index;
+  random_shuffle(m_order.begin(), m_order.end());
+}
+
+void IndexBench::RunOld(IndexResult &outResult)
+{
+  OldDiscMap discMap;
+  OldSourceMap sourceMap;
+  TimeSpec start;
+
+  start = TimeSpec::MonoNow();
+  HashMapReserve(discMap, m_count);
+  HashMapReserve(sourceMap, m_count);
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_items[index];
+    discMap[item->GetLocalDiscriminator()] = item;
+    sourceMap[OldSourceKey(item->GetRemoteAddress(), item->GetLocalAddress())] = item;
+  }
+  outResult.insert = perOp(start, m_count);
+  outResult.bytes = HashMapBytes(discMap) + HashMapBytes(sourceMap);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+  {
+    OldDiscMap::iterator found = discMap.find(m_items[m_order[index]]->GetLocalDiscriminator());
+    gSink = gSink + uintptr_t(found->second);
+  }
+  outResult.findDisc = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+    gSink = gSink + (discMap.find(m_missing[m_order[index]]->GetLocalDiscriminator()) == discMap.end());
+  outResult.missDisc = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_items[m_order[index]];
+    OldSourceMap::iterator found = sourceMap.find(OldSourceKey(item->GetRemoteAddress(), item->GetLocalAddress()));
+    gSink = gSink + uintptr_t(found->second);
+  }
+  outResult.findAddr = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_missing[m_order[index]];
+    gSink = gSink + (sourceMap.find(OldSourceKey(item->GetRemoteAddress(), item->GetLocalAddress())) == sourceMap.end());
+  }
+  outResult.missAddr = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_items[m_order[index]];
+    discMap.erase(item->GetLocalDiscriminator());
+    sourceMap.erase(OldSourceKey(item->GetRemoteAddress(), item->GetLocalAddress()));
+  }
+  outResult.erase = perOp(start, m_count);
+}
+
+void IndexBench::RunNew(IndexResult &outResult)
+{
+  NewDiscMap discMap;
+  NewSourceMap sourceMap;
+  TimeSpec start;
+
+  start = TimeSpec::MonoNow();
+  discMap.Reserve(m_count);
+  sourceMap.Reserve(m_count);
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_items[index];
+    discMap.Insert(item->GetLocalDiscriminator(), item);
+    sourceMap.Insert(AddressPairKey(item->GetRemoteKey(), item->GetLocalKey()), item);
+  }
+  outResult.insert = perOp(start, m_count);
+  outResult.bytes = discMap.GetMemoryBytes() + sourceMap.GetMemoryBytes();
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+    gSink = gSink + uintptr_t(discMap.Find(m_items[m_order[index]]->GetLocalDiscriminator()));
+  outResult.findDisc = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+    gSink = gSink + uintptr_t(discMap.Find(m_missing[m_order[index]]->GetLocalDiscriminator()));
+  outResult.missDisc = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_items[m_order[index]];
+    gSink = gSink + uintptr_t(sourceMap.Find(AddressPairKey(item->GetRemoteKey(), item->GetLocalKey())));
+  }
+  outResult.findAddr = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_missing[m_order[index]];
+    gSink = gSink + uintptr_t(sourceMap.Find(AddressPairKey(item->GetRemoteKey(), item->GetLocalKey())));
+  }
+  outResult.missAddr = perOp(start, m_count);
+
+  start = TimeSpec::MonoNow();
+  for (size_t index = 0; index < m_count; index++)
+  {
+    BenchItem *item = m_items[m_order[index]];
+    discMap.Erase(item->GetLocalDiscriminator());
+    sourceMap.Erase(AddressPairKey(item->GetRemoteKey(), item->GetLocalKey()));
+  }
+  outResult.erase = perOp(start, m_count);
+}
+
+static void printResult(const char *name, const IndexResult &result)
+{
+  fprintf(stdout, "%s_insert_ns %.1f\n", name, result.insert);
+  fprintf(stdout, "%s_find_disc_ns %.1f\n", name, result.findDisc);
+  fprintf(stdout, "%s_miss_disc_ns %.1f\n", name, result.missDisc);
+  fprintf(stdout, "%s_find_addr_ns %.1f\n", name, result.findAddr);
+  fprintf(stdout, "%s_miss_addr_ns %.1f\n", name, result.missAddr);
+  fprintf(stdout, "%s_erase_ns %.1f\n", name, result.erase);
+  fprintf(stdout, "%s_bytes %zu\n", name, result.bytes);
+}
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --sessions=N     Number of items in each index (default 100000).\n",
+          BenchAppName);
+}
+
+int main(int argc, char **argv)
+{
+  size_t sessions = 100000;
+  const char *valueString;
+  uint64_t value;
+
+  for (int argIndex = 1; argIndex < argc; argIndex++)
+  {
+    if (CheckArg("--sessions", argv[argIndex], &valueString))
+    {
+      if (!valueString || !StringToInt(valueString, value) || value < 1 || value > 10000000)
+      {
+        fprintf(stderr, "--sessions must be followed by an '=' and a number from 1 to 10000000.\n");
+        exit(1);
+      }
+      sessions = size_t(value);
+    }
+    else if (0 == strcmp("--help", argv[argIndex]))
+    {
+      usage();
+      exit(0);
+    }
+    else
+    {
+      fprintf(stderr, "Unrecognized %s command line option %s.\n", BenchAppName, argv[argIndex]);
+      usage();
+      exit(1);
+    }
+  }
+
+  srand(time(NULL));
+
+  IndexBench bench(sessions);
+  IndexResult oldResult, newResult;
+
+  bench.Prepare();
+  // Alternate, so that neither gets all of the warm caches.
+  bench.RunOld(oldResult);
+  bench.RunNew(newResult);
+  bench.RunOld(oldResult);
+  bench.RunNew(newResult);
+
+  fprintf(stdout, "sessions %zu\n", sessions);
+  printResult("hash_map", oldResult);
+  printResult("flat", newResult);
+  return 0;
+}
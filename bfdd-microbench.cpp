@@ -0,0 +1,650 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Microbenchmarks for the parts of the beacon that run for every packet or
+   timer: packet parsing, authentication, session lookup, address hashing,
+   timers, receiving and logging.
+
+   Results are printed as "name value" lines, with the unit at the end of the
+   name, so that they can be compared across releases with a script. Each time
+   is the best of several runs. Run with "make bench".
+
+ */
+#include "common.h"
+#include "Session.h"
+#include "BfdAuth.h"
+#include "SessionIndex.h"
+#include "SelectScheduler.h"
+#include "KeventScheduler.h"
+#include "EpollScheduler.h"
+#include "RecvMsg.h"
+#include "Socket.h"
+#include "lookup3.h"
+#include "TimeSpec.h"
+#include "utils.h"
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static const char *BenchAppName = "bfdd-microbench";
+
+// Runs of each measurement. The fastest is reported.
+static const size_t BenchRuns = 3;
+
+// Keeps results live, so that the work is not optimized away.
+static volatile uintptr_t gSink;
+
+/**
+ * Times a number of operations, and keeps the fastest of BenchRuns runs.
+ */
+class BenchTimer
+{
+public:
+  BenchTimer() : m_best(0), m_runs(0) { }
+
+  void Start() { m_start = TimeSpec::MonoNow();}
+
+  void Stop(size_t ops) { Record(TimeSpec::MonoNow() - m_start, ops);}
+
+  /**
+   * Adds a run that was timed elsewhere.
+   */
+  void Record(const TimeSpec &elapsed, size_t ops)
+  {
+    double perOp = double(elapsed.ToNanoseconds()) / double(max(ops, size_t(1)));
+    if (m_runs++ == 0 || perOp < m_best)
+      m_best = perOp;
+  }
+
+  /**
+   * @return double - Nanoseconds per operation, for the fastest run.
+   */
+  double Best() const { return m_best;}
+
+private:
+  TimeSpec m_start;
+  double m_best;
+  size_t m_runs;
+};
+
+static void printResult(const char *name, double value)
+{
+  fprintf(stdout, "%s %.1f\n", name, value);
+}
+
+static IpAddr makeAddress(uint32_t value)
+{
+  in_addr addr;
+  addr.s_addr = htonl(value);
+  return IpAddr(&addr);
+}
+
+/**
+ * Session::InitialProcessControlPacket(), which every received control packet
+ * goes through, on a good packet and on each kind of early discard.
+ */
+static void benchPacketParse(size_t iterations)
+{
+  struct Case
+  {
+    const char *name;
+    uint8_t data[bfd::MaxPacketSize];
+    size_t length;
+  };
+
+  BfdPacketHeader header;
+  memset(&header, 0, sizeof(header));
+  header.SetVersion(bfd::Version);
+  header.length = sizeof(header);
+  header.SetState(bfd::State::Up);
+  header.detectMult = 3;
+  header.myDisc = htonl(0x12345678);
+  header.yourDisc = htonl(0x9abcdef0);
+  header.txDesiredMinInt = htonl(100000);
+  header.rxRequiredMinInt = htonl(100000);
+
+  Case cases[5];
+  for (size_t index = 0; index < 5; index++)
+  {
+    memcpy(cases[index].data, &header, sizeof(header));
+    cases[index].length = sizeof(header);
+  }
+  BfdPacketHeader *bad;
+  cases[0].name = "parse_valid_ns";
+  cases[1].name = "parse_bad_version_ns";
+  bad = reinterpret_cast<BfdPacketHeader *>(cases[1].data);
+  bad->SetVersion(bfd::Version + 1);
+  cases[2].name = "parse_bad_length_ns";
+  cases[2].length = sizeof(header) - 4;
+  cases[3].name = "parse_zero_my_disc_ns";
+  bad = reinterpret_cast<BfdPacketHeader *>(cases[3].data);
+  bad->myDisc = 0;
+  cases[4].name = "parse_zero_your_disc_ns";
+  bad = reinterpret_cast<BfdPacketHeader *>(cases[4].data);
+  bad->yourDisc = 0;
+
+  for (size_t index = 0; index < 5; index++)
+  {
+    BenchTimer timer;
+    BfdPacket packet;
+    for (size_t run = 0; run < BenchRuns; run++)
+    {
+      timer.Start();
+      for (size_t iter = 0; iter < iterations; iter++)
+        gSink = gSink + Session::InitialProcessControlPacket(cases[index].data, cases[index].length, packet);
+      timer.Stop(iterations);
+    }
+    printResult(cases[index].name, timer.Best());
+  }
+}
+
+/**
+ * AuthKey::Sign() and AuthKey::Verify(), for each type, on a good packet and
+ * on one with a bad digest.
+ */
+static void benchAuth(size_t iterations)
+{
+  static const bfd::AuthType::Value types[] =
+  {
+    bfd::AuthType::MD5, bfd::AuthType::MeticulousMD5, bfd::AuthType::SHA1, bfd::AuthType::MeticulousSHA1
+  };
+  static const uint8_t secret[] = "0123456789abcdefghij";
+
+  for (size_t index = 0; index < sizeof(types) / sizeof(types[0]); index++)
+  {
+    AuthKey key;
+    key.Set(types[index], 1, secret, 16);
+
+    BfdPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.header.SetVersion(bfd::Version);
+    packet.header.SetState(bfd::State::Up);
+    packet.header.detectMult = 3;
+    packet.header.myDisc = htonl(0x12345678);
+    packet.header.yourDisc = htonl(0x9abcdef0);
+    packet.header.txDesiredMinInt = htonl(100000);
+    packet.header.rxRequiredMinInt = htonl(100000);
+
+    BenchTimer signTimer, verifyTimer, badTimer;
+    uint32_t sequence = 0;
+    for (size_t run = 0; run < BenchRuns; run++)
+    {
+      signTimer.Start();
+      for (size_t iter = 0; iter < iterations; iter++)
+        key.Sign(packet, sequence++);
+      signTimer.Stop(iterations);
+
+      verifyTimer.Start();
+      for (size_t iter = 0; iter < iterations; iter++)
+        gSink = gSink + key.Verify(packet, sequence);
+      verifyTimer.Stop(iterations);
+
+      BfdPacket bad = packet;
+      bad.auth.data[10] ^= 1;
+      badTimer.Start();
+      for (size_t iter = 0; iter < iterations; iter++)
+        gSink = gSink + key.Verify(bad, sequence);
+      badTimer.Stop(iterations);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "auth_sign_%s_ns", bfd::AuthTypeName(types[index]));
+    printResult(name, signTimer.Best());
+    snprintf(name, sizeof(name), "auth_verify_%s_ns", bfd::AuthTypeName(types[index]));
+    printResult(name, verifyTimer.Best());
+    snprintf(name, sizeof(name), "auth_verify_bad_%s_ns", bfd::AuthTypeName(types[index]));
+    printResult(name, badTimer.Best());
+  }
+}
+
+/**
+ * Has the same keys as a Session, for the Beacon's session indexes.
+ */
+class BenchItem
+{
+public:
+  BenchItem(uint32_t disc, const IpAddr &remoteAddr, const IpAddr &localAddr) :
+     m_disc(disc), m_remoteKey(remoteAddr), m_localKey(localAddr) { }
+  uint32_t GetLocalDiscriminator() const { return m_disc;}
+  const AddrKey& GetRemoteKey() const { return m_remoteKey;}
+  const AddrKey& GetLocalKey() const { return m_localKey;}
+
+private:
+  uint32_t m_disc;
+  AddrKey m_remoteKey;
+  AddrKey m_localKey;
+};
+
+/**
+ * Lookups in the indexes that the Beacon uses to find the session for a
+ * received packet: by discriminator, and by address pair for packets with no
+ * "your discriminator".
+ */
+static void benchLookup(size_t sessions, size_t iterations)
+{
+  FlatIndex<BenchItem, DiscIndexTraits<BenchItem> > discMap;
+  FlatIndex<BenchItem, AddressIndexTraits<BenchItem> > sourceMap;
+  vector<BenchItem *> items;
+  vector<size_t> order;
+  IpAddr localAddrs[4];
+  BenchTimer discTimer, addrTimer, missTimer;
+  char name[64];
+
+  for (uint32_t index = 0; index < 4; index++)
+    localAddrs[index] = makeAddress(0x0a000001 + index);
+
+  discMap.Reserve(sessions);
+  sourceMap.Reserve(sessions);
+  for (size_t index = 0; index < sessions; index++)
+  {
+    uint32_t disc;
+    do
+      disc = uint32_t(rand()) ^ (uint32_t(rand()) << 16);
+    while (disc == 0 || discMap.Find(disc));
+    BenchItem *item = new BenchItem(disc, makeAddress(0x0b000000 + uint32_t(index / 4)), localAddrs[index % 4]);
+    items.push_back(item);
+    discMap.Insert(item->GetLocalDiscriminator(), item);
+    sourceMap.Insert(AddressPairKey(item->GetRemoteKey(), item->GetLocalKey()), item);
+  }
+
+  // Random order, so that lookups are not helped by the cache more than in a
+  // real beacon.
+  order.resize(iterations);
+  for (size_t index = 0; index < iterations; index++)
+    order[index] = size_t(rand()) % sessions;
+
+  for (size_t run = 0; run < BenchRuns; run++)
+  {
+    discTimer.Start();
+    for (size_t index = 0; index < iterations; index++)
+      gSink = gSink + uintptr_t(discMap.Find(items[order[index]]->GetLocalDiscriminator()));
+    discTimer.Stop(iterations);
+
+    missTimer.Start();
+    for (size_t index = 0; index < iterations; index++)
+      gSink = gSink + uintptr_t(discMap.Find(items[order[index]]->GetLocalDiscriminator() ^ 0x80000001));
+    missTimer.Stop(iterations);
+
+    addrTimer.Start();
+    for (size_t index = 0; index < iterations; index++)
+    {
+      BenchItem *item = items[order[index]];
+      gSink = gSink + uintptr_t(sourceMap.Find(AddressPairKey(item->GetRemoteKey(), item->GetLocalKey())));
+    }
+    addrTimer.Stop(iterations);
+  }
+
+  snprintf(name, sizeof(name), "lookup_disc_%zu_ns", sessions);
+  printResult(name, discTimer.Best());
+  snprintf(name, sizeof(name), "lookup_disc_miss_%zu_ns", sessions);
+  printResult(name, missTimer.Best());
+  snprintf(name, sizeof(name), "lookup_addr_%zu_ns", sessions);
+  printResult(name, addrTimer.Best());
+
+  for (size_t index = 0; index < items.size(); index++)
+    delete items[index];
+}
+
+/**
+ * hashlittle() from lookup3.cpp on the address bytes of IpAddr keys, and the
+ * hashes that are built on it.
+ */
+static void benchHash(size_t iterations)
+{
+  static const size_t KeyCount = 1024;
+  vector<IpAddr> ipv4, ipv6;
+  vector<AddrKey> keys;
+  BenchTimer v4Timer, v6Timer, ipHashTimer, pairTimer;
+
+  for (size_t index = 0; index < KeyCount; index++)
+  {
+    char str[64];
+    ipv4.push_back(makeAddress(0x0b000000 + uint32_t(index)));
+    snprintf(str, sizeof(str), "2001:db8::%x:%x", unsigned(index >> 8), unsigned(index & 0xff));
+    ipv6.push_back(IpAddr(str));
+    keys.push_back(AddrKey(ipv4.back()));
+  }
+
+  for (size_t run = 0; run < BenchRuns; run++)
+  {
+    v4Timer.Start();
+    for (size_t index = 0; index < iterations; index++)
+    {
+      const sockaddr_in &addr = reinterpret_cast<const sockaddr_in &>(ipv4[index % KeyCount].GetSockAddr());
+      gSink = gSink + hashlittle(&addr.sin_addr, sizeof(addr.sin_addr));
+    }
+    v4Timer.Stop(iterations);
+
+    v6Timer.Start();
+    for (size_t index = 0; index < iterations; index++)
+    {
+      const sockaddr_in6 &addr = reinterpret_cast<const sockaddr_in6 &>(ipv6[index % KeyCount].GetSockAddr());
+      gSink = gSink + hashlittle(&addr.sin6_addr, sizeof(addr.sin6_addr));
+    }
+    v6Timer.Stop(iterations);
+
+    ipHashTimer.Start();
+    for (size_t index = 0; index < iterations; index++)
+      gSink = gSink + ipv6[index % KeyCount].hash();
+    ipHashTimer.Stop(iterations);
+
+    pairTimer.Start();
+    for (size_t index = 0; index < iterations; index++)
+      gSink = gSink + HashAddressPair(keys[index % KeyCount], keys[(index + 1) % KeyCount]);
+    pairTimer.Stop(iterations);
+  }
+
+  printResult("hashlittle_ipv4_ns", v4Timer.Best());
+  printResult("hashlittle_ipv6_ns", v6Timer.Best());
+  printResult("ipaddr_hash_ipv6_ns", ipHashTimer.Best());
+  printResult("hash_address_pair_ns", pairTimer.Best());
+}
+
+/**
+ * Timers, through the scheduler that the beacon uses. A scheduler runs only
+ * once, so each run uses a new one.
+ */
+class TimerBench
+{
+public:
+  TimerBench(size_t count) : m_count(count), m_expired(0), m_scheduler(NULL) { }
+  ~TimerBench() { freeScheduler();}
+
+  bool Run();
+
+private:
+  static void timerCallback(Timer *, void *userdata) { reinterpret_cast<TimerBench *>(userdata)->handleTimer();}
+  void handleTimer();
+  bool runOnce();
+  void freeScheduler();
+
+  size_t m_count;
+  size_t m_expired;
+  Scheduler *m_scheduler;
+  vector<Timer *> m_timers;
+  BenchTimer m_armTimer;
+  BenchTimer m_reArmTimer;
+  BenchTimer m_updateTimer;
+  BenchTimer m_stopTimer;
+  BenchTimer m_expireTimer;
+};
+
+void TimerBench::freeScheduler()
+{
+  if (!m_scheduler)
+    return;
+  for (size_t index = 0; index < m_timers.size(); index++)
+    m_scheduler->FreeTimer(m_timers[index]);
+  m_timers.clear();
+  delete m_scheduler;
+  m_scheduler = NULL;
+}
+
+void TimerBench::handleTimer()
+{
+  if (++m_expired == m_count)
+    m_scheduler->RequestShutdown();
+}
+
+bool TimerBench::runOnce()
+{
+#ifdef USE_KEVENT_SCHEDULER
+  m_scheduler = new KeventScheduler();
+#elif defined(USE_EPOLL_SCHEDULER)
+  m_scheduler = new EpollScheduler();
+#else
+  m_scheduler = new SelectScheduler();
+#endif
+
+  m_scheduler->ReserveTimers(m_count);
+  for (size_t index = 0; index < m_count; index++)
+  {
+    Timer *timer = m_scheduler->MakeTimer("bench", uint32_t(index));
+    if (!timer)
+      return false;
+    timer->SetCallback(timerCallback, this);
+    m_timers.push_back(timer);
+  }
+
+  // Spread, as session timers are, so that the timers are not all in order.
+  m_armTimer.Start();
+  for (size_t index = 0; index < m_count; index++)
+    m_timers[index]->SetMicroTimer(1000000 + (index * 7919) % 1000000);
+  m_armTimer.Stop(m_count);
+
+  // The common case for a session: a packet pushes the detection timer out.
+  m_reArmTimer.Start();
+  for (size_t index = 0; index < m_count; index++)
+    m_timers[index]->SetMicroTimer(2000000 + (index * 7919) % 1000000);
+  m_reArmTimer.Stop(m_count);
+
+  m_updateTimer.Start();
+  for (size_t index = 0; index < m_count; index++)
+    m_timers[index]->UpdateMicroTimer(3000000 + (index * 7919) % 1000000);
+  m_updateTimer.Stop(m_count);
+
+  m_stopTimer.Start();
+  for (size_t index = 0; index < m_count; index++)
+    m_timers[index]->Stop();
+  m_stopTimer.Stop(m_count);
+
+  // Expiring includes the scheduler loop that runs the callbacks.
+  for (size_t index = 0; index < m_count; index++)
+    m_timers[index]->SetMicroTimer(0);
+  m_expired = 0;
+  m_expireTimer.Start();
+  if (!m_scheduler->Run() || m_expired != m_count)
+    return false;
+  m_expireTimer.Stop(m_count);
+
+  freeScheduler();
+  return true;
+}
+
+bool TimerBench::Run()
+{
+  char name[64];
+
+  for (size_t run = 0; run < BenchRuns; run++)
+  {
+    if (!runOnce())
+      return false;
+  }
+
+  snprintf(name, sizeof(name), "timer_arm_%zu_ns", m_count);
+  printResult(name, m_armTimer.Best());
+  snprintf(name, sizeof(name), "timer_rearm_%zu_ns", m_count);
+  printResult(name, m_reArmTimer.Best());
+  snprintf(name, sizeof(name), "timer_update_%zu_ns", m_count);
+  printResult(name, m_updateTimer.Best());
+  snprintf(name, sizeof(name), "timer_stop_%zu_ns", m_count);
+  printResult(name, m_stopTimer.Best());
+  snprintf(name, sizeof(name), "timer_expire_%zu_ns", m_count);
+  printResult(name, m_expireTimer.Best());
+  return true;
+}
+
+/**
+ * RecvMsg::DoRecvMsg() with the control messages that the beacon's listen
+ * sockets ask for, compared with DoRecv(), which parses none. Packets are sent
+ * over loopback in batches that fit in the socket buffer, and only the receives
+ * are timed.
+ */
+static bool benchRecvMsg(size_t iterations)
+{
+  static const size_t BatchSize = 64;
+  Socket receiver, sender;
+  RecvMsg message(bfd::MaxPacketSize,
+                  Socket::GetMaxControlSizeReceiveDestinationAddress() +
+                  Socket::GetMaxControlSizeReceiveTTLOrHops() +
+                  Socket::GetMaxControlSizeReceiveTimestamp() +
+                  8);
+  BenchTimer recvMsgTimer, recvTimer;
+  uint8_t packet[bfd::BasePacketSize];
+
+  memset(packet, 0, sizeof(packet));
+  if (!receiver.OpenUDP(Addr::IPv4) || !receiver.Bind(SockAddr("127.0.0.1", 0))
+      || !receiver.SetReceiveTTLOrHops(true) || !receiver.SetReceiveDestinationAddress(true)
+      || !receiver.SetReceiveBufferSize(1024 * 1024)
+      || !sender.OpenUDP(Addr::IPv4))
+    return false;
+  receiver.SetReceiveTimestamp(true);
+
+  SockAddr dest;
+  socklen_t destLength = sizeof(sockaddr_in);
+  sockaddr_in bound;
+  if (0 != ::getsockname(receiver, reinterpret_cast<sockaddr *>(&bound), &destLength))
+    return false;
+  dest = SockAddr(reinterpret_cast<sockaddr *>(&bound), destLength);
+
+  for (size_t run = 0; run < BenchRuns; run++)
+  {
+    for (size_t useMsg = 0; useMsg < 2; useMsg++)
+    {
+      BenchTimer &timer = useMsg ? recvMsgTimer : recvTimer;
+      TimeSpec elapsed;
+      size_t received = 0;
+
+      while (received < iterations)
+      {
+        for (size_t index = 0; index < BatchSize; index++)
+        {
+          if (!sender.SendTo(packet, sizeof(packet), dest))
+            return false;
+        }
+
+        TimeSpec start(TimeSpec::MonoNow());
+        for (size_t index = 0; index < BatchSize; index++)
+        {
+          bool ok = useMsg ? message.DoRecvMsg(receiver, MSG_DONTWAIT) : message.DoRecv(receiver, MSG_DONTWAIT);
+          if (!ok)
+            return false;
+          gSink = gSink + message.GetDataSize();
+        }
+        elapsed += TimeSpec::MonoNow() - start;
+        received += BatchSize;
+      }
+
+      timer.Record(elapsed, received);
+    }
+  }
+
+  printResult("recvmsg_cmsg_ns", recvMsgTimer.Best());
+  printResult("recv_no_cmsg_ns", recvTimer.Best());
+  return true;
+}
+
+/**
+ * Logger::Optional() on a log type that is disabled, which is what nearly every
+ * call in the beacon costs, and enabled, to a file.
+ */
+static void benchLogging(size_t iterations)
+{
+  BenchTimer disabledTimer, enabledTimer;
+  size_t enabledIterations = max(iterations / 100, size_t(1));
+
+  gLog.EnableLogType(Log::Temp, false);
+  for (size_t run = 0; run < BenchRuns; run++)
+  {
+    disabledTimer.Start();
+    for (size_t index = 0; index < iterations; index++)
+      gLog.Optional(Log::Temp, "Benchmark message %zu for session %u.", index, 12345);
+    disabledTimer.Stop(iterations);
+  }
+  printResult("log_optional_disabled_ns", disabledTimer.Best());
+
+  if (!gLog.LogToFile("/dev/null"))
+    return;
+  gLog.EnableLogType(Log::Temp, true);
+  for (size_t run = 0; run < BenchRuns; run++)
+  {
+    enabledTimer.Start();
+    for (size_t index = 0; index < enabledIterations; index++)
+      gLog.Optional(Log::Temp, "Benchmark message %zu for session %u.", index, 12345);
+    enabledTimer.Stop(enabledIterations);
+  }
+  gLog.EnableLogType(Log::Temp, false);
+  printResult("log_optional_enabled_ns", enabledTimer.Best());
+}
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --iterations=N   Operations in each timed loop (default 1000000).\n",
+          BenchAppName);
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = 1000000;
+  const char *valueString;
+  uint64_t value;
+
+  for (int argIndex = 1; argIndex < argc; argIndex++)
+  {
+    if (CheckArg("--iterations", argv[argIndex], &valueString))
+    {
+      if (!valueString || !StringToInt(valueString, value) || value < 1000 || value > 1000000000)
+      {
+        fprintf(stderr, "--iterations must be followed by an '=' and a number from 1000 to 1000000000.\n");
+        exit(1);
+      }
+      iterations = size_t(value);
+    }
+    else if (0 == strcmp("--help", argv[argIndex]))
+    {
+      usage();
+      exit(0);
+    }
+    else
+    {
+      fprintf(stderr, "Unrecognized %s command line option %s.\n", BenchAppName, argv[argIndex]);
+      usage();
+      exit(1);
+    }
+  }
+
+  gLog.SetLogLevel(Log::Minimal);
+  gLog.SetStdErr(Log::Minimal, true);
+  srand(time(NULL));
+
+  fprintf(stdout, "iterations %zu\n", iterations);
+
+  benchPacketParse(iterations);
+
+  // Hashing is slower, so fewer are timed.
+  benchAuth(max(iterations / 10, size_t(BenchRuns)));
+
+  benchLookup(1000, iterations);
+  benchLookup(10000, iterations);
+  benchLookup(100000, iterations);
+
+  benchHash(iterations);
+
+  TimerBench timerBench(10000);
+  if (!timerBench.Run())
+  {
+    fprintf(stderr, "Timer benchmark failed.\n");
+    exit(1);
+  }
+
+  if (!benchRecvMsg(max(iterations / 10, size_t(BenchRuns))))
+  {
+    fprintf(stderr, "Receive benchmark failed.\n");
+    exit(1);
+  }
+
+  // Last, because it sends the log to /dev/null.
+  benchLogging(iterations);
+  return 0;
+}
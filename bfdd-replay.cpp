@@ -0,0 +1,554 @@
+/**************************************************************
+* Copyright (c) 2010-2013, Dynamic Network Services, Inc.
+* Jake Montgomery (jmontgomery@dyn.com) & Tom Daly (tom@dyn.com)
+* Distributed under the FreeBSD License - see LICENSE
+***************************************************************/
+/**
+
+   Replays a packet capture through the beacon's receive path.
+
+   Runs a Beacon in process, with a single shard and no listen sockets, and
+   hands it each captured UDP datagram as if it had just been received. See
+   Beacon::ReplayPacket(). The capture can come from bfdd-beacon --capture, or
+   from tcpdump.
+
+   The receive times are those from the capture, moved so that the first packet
+   is received when the replay starts. With --speed=recorded packets are handed
+   over on that timeline. With --speed=max they are handed over as fast as the
+   beacon takes them, so the receive times run ahead of the clock, and session
+   timers do not expire during the replay.
+
+   Unless --keepaddrs is given, each destination address is replaced by one in
+   127.0.0.0/16, and each source address by one in 127.128.0.0/9, so that
+   sessions can be created, and the packets that they send go nowhere.
+
+   The Your Discriminator in each packet was chosen by the beacon that made the
+   capture. Unless --keepdiscs is given, it is replaced by the discriminator of
+   the replayed session with the same addresses. For each pair of addresses
+   whose first packet already has a Your Discriminator, the session is
+   assumed to have been made with "connect", and an active session is started
+   for it before the replay.
+
+ */
+#include "common.h"
+#include "Beacon.h"
+#include "PacketCapture.h"
+#include "Session.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+static const char *ReplayAppName = "bfdd-replay";
+
+// Offset of Your Discriminator in a control packet.
+static const size_t YourDiscOffset = 8;
+
+/**
+ * Settings from the command line.
+ */
+struct ReplayOptions
+{
+  ReplayOptions() :
+     path(NULL),
+     recordedSpeed(false),
+     keepAddrs(false),
+     keepDiscs(false),
+     controlAddr("127.0.0.1", 9960),
+     chunkSize(256)
+  {
+  }
+
+  const char *path;
+  bool recordedSpeed;
+  bool keepAddrs;
+  bool keepDiscs;
+  SockAddr controlAddr;
+  size_t chunkSize;  // Packets handed to the beacon at a time.
+};
+
+/**
+ * Orders addresses by their bytes. For remapping only.
+ */
+struct AddrKeyLess
+{
+  bool operator()(const AddrKey &left, const AddrKey &right) const
+  {
+    if (left.Type() != right.Type())
+      return left.Type() < right.Type();
+    return memcmp(left.GetBytes(), right.GetBytes(), 16) < 0;
+  }
+
+  bool operator()(const std::pair<AddrKey, AddrKey> &left, const std::pair<AddrKey, AddrKey> &right) const
+  {
+    if ((*this)(left.first, right.first))
+      return true;
+    if ((*this)(right.first, left.first))
+      return false;
+    return (*this)(left.second, right.second);
+  }
+};
+
+/**
+ * Runs the replay.
+ */
+class Replay
+{
+public:
+  Replay(const ReplayOptions &options) :
+     m_options(options),
+     m_beaconThreadStarted(false),
+     m_beaconExited(false),
+     m_beaconLock(true),
+     m_skipped(0),
+     m_chunkStart(0),
+     m_chunkEnd(0),
+     m_sessions(0)
+  {
+  }
+
+  ~Replay() { stopBeacon();}
+
+  /**
+   * Runs the replay, and prints the results to stdout.
+   *
+   * @return bool - false on failure.
+   */
+  bool Run();
+
+private:
+  typedef std::map<AddrKey, AddrKey, AddrKeyLess> AddrMap;
+
+  bool load();
+  void remap(AddrMap &addrMap, uint32_t base, uint32_t limit, AddrKey &ioAddr);
+  bool startBeacon();
+  void stopBeacon();
+  bool beaconExited();
+  static void* beaconThreadCallback(void *arg) { reinterpret_cast<Replay *>(arg)->beaconThread(); return NULL;}
+  void beaconThread();
+  bool waitForBeacon();
+  static void configureBeaconCallback(Beacon *beacon, void *userdata) { reinterpret_cast<Replay *>(userdata)->configureBeacon(beacon);}
+  void configureBeacon(Beacon *beacon);
+  static void replayChunkCallback(Beacon *beacon, void *userdata) { reinterpret_cast<Replay *>(userdata)->replayChunk(beacon);}
+  void replayChunk(Beacon *beacon);
+  void remapDisc(Beacon *beacon, CapturedPacket &packet);
+  static void countSessionsCallback(Beacon *beacon, void *userdata) { reinterpret_cast<Replay *>(userdata)->countSessions(beacon);}
+  void countSessions(Beacon *beacon);
+  void report(double seconds);
+
+  const ReplayOptions m_options;
+  Beacon m_beacon;
+  pthread_t m_beaconThread;
+  bool m_beaconThreadStarted;
+  bool m_beaconExited; // Protected by m_beaconLock.
+  QuickLock m_beaconLock;
+
+  std::vector<CapturedPacket> m_packets;
+  std::vector<Beacon::AddressPair> m_activePairs; // Sessions to start before the replay.
+  std::map<uint32_t, uint32_t> m_discMap; // Captured discriminator to that of the replayed session.
+  uint64_t m_skipped;
+  TimeSpec m_captureStart; // Receive time of the first packet, from the file.
+  TimeSpec m_replayStart;  // Monotonic time that the first packet is received.
+
+  // Only changed while the beacon is not running an operation.
+  size_t m_chunkStart;
+  size_t m_chunkEnd;
+  Beacon::ReceiveStageTimes m_times;
+  size_t m_sessions;
+};
+
+bool Replay::Run()
+{
+  if (!load())
+    return false;
+
+  if (!startBeacon() || !waitForBeacon())
+    return false;
+
+  if (!m_beacon.QueueOperation(configureBeaconCallback, this, true /*waitForCompletion*/))
+  {
+    fprintf(stderr, "Failed to configure the beacon.\n");
+    return false;
+  }
+
+  fprintf(stderr, "Replaying %zu packets, with %zu active sessions.\n", m_packets.size(), m_activePairs.size());
+
+  TimeSpec recordedWindow(TimeSpec::Millisec, 1);
+  m_replayStart = TimeSpec::MonoNow();
+  while (m_chunkEnd < m_packets.size())
+  {
+    m_chunkStart = m_chunkEnd;
+    m_chunkEnd = min(m_packets.size(), m_chunkStart + m_options.chunkSize);
+
+    if (m_options.recordedSpeed)
+    {
+      // Hand over, together, the packets received within a short window.
+      TimeSpec first = m_packets[m_chunkStart].receiveTime - m_captureStart;
+      for (size_t index = m_chunkStart + 1; index < m_chunkEnd; index++)
+      {
+        if (m_packets[index].receiveTime - m_captureStart > first + recordedWindow)
+        {
+          m_chunkEnd = index;
+          break;
+        }
+      }
+
+      TimeSpec wait = m_replayStart + first - TimeSpec::MonoNow();
+      if (wait > TimeSpec())
+      {
+        int64_t waitUs = wait.ToNanoseconds() / TimeSpec::NSecPerUs;
+        if (waitUs > 0)
+          usleep(useconds_t(waitUs));
+      }
+    }
+
+    if (!m_beacon.QueueOperation(replayChunkCallback, this, true /*waitForCompletion*/))
+    {
+      fprintf(stderr, "Failed to hand packets to the beacon.\n");
+      return false;
+    }
+  }
+  double seconds = (TimeSpec::MonoNow() - m_replayStart).ToDecimal();
+
+  m_beacon.QueueOperation(countSessionsCallback, this, true /*waitForCompletion*/);
+  report(seconds);
+  return true;
+}
+
+/**
+ * Reads the whole capture, so that file I/O is not part of the replay.
+ */
+bool Replay::load()
+{
+  CaptureReader reader;
+  std::string error;
+  CapturedPacket packet;
+  AddrMap destMap, sourceMap;
+  std::set<std::pair<AddrKey, AddrKey>, AddrKeyLess> seenPairs;
+
+  if (!reader.Open(m_options.path, error))
+  {
+    fprintf(stderr, "Failed to open capture %s: %s\n", m_options.path, error.c_str());
+    return false;
+  }
+
+  while (reader.Next(packet))
+  {
+    if (!m_options.keepAddrs)
+    {
+      remap(destMap, 0x7F000001, 0x7F00FFFF, packet.destAddr);
+      remap(sourceMap, 0x7F800001, 0x7FFFFFFE, packet.sourceAddr);
+    }
+    m_packets.push_back(packet);
+
+    if (!m_options.keepDiscs && seenPairs.insert(std::make_pair(packet.sourceAddr, packet.destAddr)).second)
+    {
+      uint32_t yourDisc = 0;
+      if (packet.captureLength >= YourDiscOffset + sizeof(yourDisc))
+        memcpy(&yourDisc, packet.data + YourDiscOffset, sizeof(yourDisc));
+      if (yourDisc != 0)
+      {
+        Beacon::AddressPair pair;
+        pair.remoteAddr = packet.sourceAddr.ToIpAddr();
+        pair.localAddr = packet.destAddr.ToIpAddr();
+        m_activePairs.push_back(pair);
+      }
+    }
+  }
+  m_skipped = reader.GetSkipped();
+
+  if (reader.IsTruncated())
+    fprintf(stderr, "Capture %s is cut short. Replaying the %zu complete packets.\n", m_options.path, m_packets.size());
+
+  if (m_packets.empty())
+  {
+    fprintf(stderr, "Capture %s has no UDP packets to replay.\n", m_options.path);
+    return false;
+  }
+
+  m_captureStart = m_packets.front().receiveTime;
+  return true;
+}
+
+/**
+ * Replaces ioAddr with the IPv4 address it was given before, or the next one
+ * from base.
+ */
+void Replay::remap(AddrMap &addrMap, uint32_t base, uint32_t limit, AddrKey &ioAddr)
+{
+  AddrMap::iterator found = addrMap.find(ioAddr);
+  if (found != addrMap.end())
+  {
+    ioAddr = found->second;
+    return;
+  }
+
+  in_addr addr;
+  AddrKey key;
+
+  // Past the end, addresses are shared, which merges sessions.
+  addr.s_addr = htonl(uint32_t(min(uint64_t(base) + addrMap.size(), uint64_t(limit))));
+  key.SetIPv4(addr);
+  addrMap[ioAddr] = key;
+  ioAddr = key;
+}
+
+bool Replay::startBeacon()
+{
+  if (0 != pthread_create(&m_beaconThread, NULL, beaconThreadCallback, this))
+  {
+    fprintf(stderr, "Failed to start the beacon thread.\n");
+    return false;
+  }
+  m_beaconThreadStarted = true;
+  return true;
+}
+
+void Replay::stopBeacon()
+{
+  if (!m_beaconThreadStarted)
+    return;
+
+  m_beacon.RequestShutdown();
+  pthread_join(m_beaconThread, NULL);
+  m_beaconThreadStarted = false;
+}
+
+void Replay::beaconThread()
+{
+  list<SockAddr> controlPorts;
+  list<IpAddr> listenAddrs;
+
+  if (UtilsInitThread())
+  {
+    controlPorts.push_back(m_options.controlAddr);
+    if (!m_beacon.Run(controlPorts, listenAddrs))
+      fprintf(stderr, "The beacon failed to run.\n");
+  }
+
+  AutoQuickLock lock(m_beaconLock, true);
+  m_beaconExited = true;
+}
+
+bool Replay::beaconExited()
+{
+  AutoQuickLock lock(m_beaconLock, true);
+  return m_beaconExited;
+}
+
+/**
+ * The command processors are started after everything else, so once the
+ * control port answers a command, the beacon can handle operations.
+ *
+ * @return bool - false if the beacon did not start.
+ */
+bool Replay::waitForBeacon()
+{
+  static const char command[] = "version";
+  uint8_t buffer[sizeof(uint32_t) + sizeof(command)];
+  uint32_t magic = htonl(MagicMessageNumber);
+
+  memcpy(buffer, &magic, sizeof(magic));
+  memcpy(buffer + sizeof(magic), command, sizeof(command));
+
+  for (int attempt = 0; attempt < 500 && !beaconExited(); attempt++)
+  {
+    Socket socket;
+
+    socket.SetQuiet(true);
+    if (socket.OpenTCP(m_options.controlAddr.Type())
+        && socket.Connect(m_options.controlAddr)
+        && socket.Send(buffer, sizeof(buffer)))
+    {
+      // Read the reply until the beacon closes the connection.
+      char reply[256];
+      while (0 < ::recv(socket.GetSocket(), reply, sizeof(reply), 0))
+        ;
+      return true;
+    }
+    usleep(10000);
+  }
+
+  fprintf(stderr, "The beacon did not start.\n");
+  return false;
+}
+
+/**
+ * Called on the beacon's scheduler thread.
+ */
+void Replay::configureBeacon(Beacon *beacon)
+{
+  std::vector<uint8_t> results(m_activePairs.size(), 0);
+
+  beacon->AllowAllPassiveConnections(true);
+  if (!m_activePairs.empty())
+    beacon->StartActiveSessions(m_activePairs, 0, results);
+}
+
+/**
+ * Called on the beacon's scheduler thread.
+ */
+void Replay::replayChunk(Beacon *beacon)
+{
+  for (size_t index = m_chunkStart; index < m_chunkEnd; index++)
+  {
+    CapturedPacket &packet = m_packets[index];
+    if (!m_options.keepDiscs)
+      remapDisc(beacon, packet);
+
+    TimeSpec receiveTime = m_replayStart + (packet.receiveTime - m_captureStart);
+
+    beacon->ReplayPacket(packet.data, packet.captureLength, packet.sourceAddr, packet.sourcePort,
+                         packet.destAddr, packet.ttlOrHops, receiveTime, m_times);
+  }
+}
+
+/**
+ * Replaces the Your Discriminator with that of the session that the replay
+ * created for the same addresses. This is not timed.
+ */
+void Replay::remapDisc(Beacon *beacon, CapturedPacket &packet)
+{
+  uint32_t yourDisc;
+
+  if (packet.captureLength < YourDiscOffset + sizeof(yourDisc))
+    return;
+  memcpy(&yourDisc, packet.data + YourDiscOffset, sizeof(yourDisc));
+  if (yourDisc == 0)
+    return;
+
+  std::map<uint32_t, uint32_t>::iterator found = m_discMap.find(yourDisc);
+  if (found == m_discMap.end())
+  {
+    Session *session = beacon->FindSessionIp(packet.sourceAddr.ToIpAddr(), packet.destAddr.ToIpAddr());
+    if (!session)
+      return;
+    found = m_discMap.insert(std::make_pair(yourDisc, htonl(session->GetLocalDiscriminator()))).first;
+  }
+  memcpy(packet.data + YourDiscOffset, &found->second, sizeof(found->second));
+}
+
+/**
+ * Called on the beacon's scheduler thread.
+ */
+void Replay::countSessions(Beacon *beacon)
+{
+  std::vector<uint32_t> ids;
+
+  beacon->GetSessionIdList(ids);
+  m_sessions = ids.size();
+}
+
+static double perPacket(uint64_t nanoseconds, uint64_t packets)
+{
+  return packets ? double(nanoseconds) / double(packets) : 0;
+}
+
+void Replay::report(double seconds)
+{
+  uint64_t matched = m_times.packets - m_times.screened - m_times.unmatched;
+
+  fprintf(stdout, "speed %s\n", m_options.recordedSpeed ? "recorded" : "max");
+  fprintf(stdout, "packets %" PRIu64 "\n", m_times.packets);
+  fprintf(stdout, "skipped %" PRIu64 "\n", m_skipped);
+  fprintf(stdout, "screened %" PRIu64 "\n", m_times.screened);
+  fprintf(stdout, "unmatched %" PRIu64 "\n", m_times.unmatched);
+  fprintf(stdout, "sessions %zu\n", m_sessions);
+  fprintf(stdout, "seconds %.3f\n", seconds);
+  fprintf(stdout, "packets_per_sec %.0f\n", seconds > 0 ? double(m_times.packets) / seconds : 0);
+  fprintf(stdout, "screen_ns %.1f\n", perPacket(m_times.screenTime, m_times.packets));
+  fprintf(stdout, "lookup_ns %.1f\n", perPacket(m_times.lookupTime, m_times.packets - m_times.screened));
+  fprintf(stdout, "session_ns %.1f\n", perPacket(m_times.sessionTime, matched));
+  fprintf(stdout, "receive_ns %.1f\n", perPacket(m_times.screenTime + m_times.lookupTime + m_times.sessionTime, m_times.packets));
+}
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: %s [options] capture-file\n"
+          "  --speed=max|recorded  Replay as fast as possible, or with the captured timing (default max).\n"
+          "  --keepaddrs           Use the captured addresses, rather than loopback ones.\n"
+          "  --keepdiscs           Use the captured Your Discriminator values.\n"
+          "  --control=ADDR        Beacon control address and port (default 127.0.0.1:9960).\n",
+          ReplayAppName);
+}
+
+int main(int argc, char **argv)
+{
+  ReplayOptions options;
+  const char *valueString;
+
+  if (!UtilsInit() || !UtilsInitThread())
+  {
+    fprintf(stderr, "Unable to init thread local storage. Exiting.\n");
+    exit(1);
+  }
+
+  for (int argIndex = 1; argIndex < argc; argIndex++)
+  {
+    bool ok = true;
+
+    if (CheckArg("--speed", argv[argIndex], &valueString))
+    {
+      if (valueString && 0 == strcmp(valueString, "max"))
+        options.recordedSpeed = false;
+      else if (valueString && 0 == strcmp(valueString, "recorded"))
+        options.recordedSpeed = true;
+      else
+      {
+        fprintf(stderr, "--speed must be followed by an '=' and 'max' or 'recorded'.\n");
+        ok = false;
+      }
+    }
+    else if (0 == strcmp("--keepaddrs", argv[argIndex]))
+      options.keepAddrs = true;
+    else if (0 == strcmp("--keepdiscs", argv[argIndex]))
+      options.keepDiscs = true;
+    else if (CheckArg("--control", argv[argIndex], &valueString))
+    {
+      if (!valueString || !options.controlAddr.FromString(valueString) || !options.controlAddr.HasPort())
+      {
+        fprintf(stderr, "--control must be followed by an '=' and an ip address with a port.\n");
+        ok = false;
+      }
+    }
+    else if (0 == strcmp("--help", argv[argIndex]))
+    {
+      usage();
+      exit(0);
+    }
+    else if (argv[argIndex][0] != '-' && !options.path)
+      options.path = argv[argIndex];
+    else
+    {
+      fprintf(stderr, "Unrecognized %s command line option %s.\n", ReplayAppName, argv[argIndex]);
+      usage();
+      ok = false;
+    }
+
+    if (!ok)
+      exit(1);
+  }
+
+  if (!options.path)
+  {
+    usage();
+    exit(1);
+  }
+
+  // Errors only, so that logging does not skew the results.
+  gLog.SetLogLevel(Log::Minimal);
+  gLog.SetStdErr(Log::Minimal, true);
+
+  Replay replay(options);
+
+  return replay.Run() ? 0 : 1;
+}
@@ -7,6 +7,7 @@
 #include "common.h"
 
 const uint32_t MagicMessageNumber = 0xfeed1966;
+const uint32_t MagicFramedNumber = 0xfeed1967;
 const char *SofwareVesrion = PACKAGE_VERSION;
 const char *ControlAppName = "bfdd-control";
 const char *BeaconAppName = "bfdd-beacon";
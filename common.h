@@ -17,6 +17,9 @@
   /// magic message header .. in network order
   extern const uint32_t MagicMessageNumber;
 
+  /// header for a framed connection .. in network order. See ControlFrame.h
+  extern const uint32_t MagicFramedNumber;
+
   // Maximum length of a single line in the beacon->control reply.
   const size_t MaxReplyLineSize = 2046;
 
@@ -30,10 +33,32 @@
   extern const char *BeaconAppName;
 
   // This is like gLog.Optional(), but does not evaluate the parameters if logging
-  // is off. It incurs extra locking overhead, so only use when parameters include
-  // expensive function calls.
+  // is off. The check is inlined, and does not lock.
 #define LogOptional(type, format, ...) \
-  do { if(gLog.LogTypeEnabled(type)) gLog.Message(type,  format,   ## __VA_ARGS__); } while(0)
+  do { if(gLog.LogTypeEnabledHint(type)) gLog.Optional(type,  format,   ## __VA_ARGS__); } while(0)
+
+  /**
+   * Adapts a typed formatter for Logger::Deferred(). See LogDeferred().
+   */
+  template <typename T, void (*Format)(char *outBuf, size_t bufSize, const T &data)>
+  struct LogDeferredFormatter
+  {
+    typedef char SizeCheck[sizeof(T) <= Logger::MaxDeferredDataSize ? 1 : -1];
+
+    static void Call(char *outBuf, size_t bufSize, const void *data)
+    {
+      Format(outBuf, bufSize, *reinterpret_cast<const T *>(data));
+    }
+  };
+
+  // Logs a message that is formatted by formatter(char*, size_t, const dataType&)
+  // only when the message is written out, which may be on the log writer thread.
+  // data is evaluated only if the type is enabled, and is copied, so dataType
+  // must be trivially copyable, and must not point to temporary storage (such as
+  // a ToString() result). Use raw addresses instead.
+#define LogDeferred(type, dataType, formatter, data) \
+  do { if(gLog.LogTypeEnabledHint(type)) { const dataType &logDeferredData = (data); \
+    gLog.Deferred(type, &LogDeferredFormatter<dataType, formatter>::Call, &logDeferredData, sizeof(dataType)); } } while(0)
 
   /**
    * An assertion that is thrown to the log in debug builds only. 
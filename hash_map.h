@@ -51,3 +51,29 @@
 #else
 #error no unordered_map implementation found.
 #endif
+
+/**
+ * Grows the map so that it can hold count items without rehashing.
+ *
+ * @throw - std::bad_alloc
+ */
+template<class Map> void HashMapReserve(Map &map, size_t count)
+{
+#ifdef HAS_STD_UNORDERED_MAP
+  map.reserve(count);
+#elif defined(HAS_TR1_UNORDERED_MAP)
+  map.rehash(size_t(count / map.max_load_factor()) + 1);
+#else
+  map.resize(count);
+#endif
+}
+
+/**
+ * Estimates the heap memory used by the map. Each item is assumed to be a
+ * separately allocated node with a value, a link and a cached hash.
+ */
+template<class Map> size_t HashMapBytes(const Map &map)
+{
+  return map.bucket_count() * sizeof(void *)
+         + map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void *));
+}
@@ -7,6 +7,7 @@
 #include "utils.h"
 #include "compat.h"
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -21,116 +22,55 @@ static const size_t formatShortBuffersCount = 12;
 
 static const size_t formatMediumBuffersSize = 1024;  // must be big enough for full, escaped, domain name.
 static const size_t formatMediumBuffersCount = 4;
-static pthread_key_t gUtilsTLSKey;
-static bool gHasUtilsTLSKey = false;
 static const size_t bigBufferMaxSize = 4096;
 
 
+/**
+ * Per thread formatting buffers.
+ *
+ * This is plain data, with no constructor, so that it can be __thread. That
+ * puts it in the thread's static TLS block, which is zeroed when the thread is
+ * created, and is reached with a single offset from the thread pointer. The
+ * formatting functions are called for nearly every reply line, so this avoids
+ * a pthread_getspecific() call, and the heap, on each one.
+ */
 struct UtilsTLSData
 {
-  UtilsTLSData() :
-     nextFormatShortBuffer(0),
-     nextFormatMediumBuffer(0),
-     bigBuffer(NULL),
-     bigBufferSize(0)
-  { }
-
-  ~UtilsTLSData()
-  {
-    delete[] bigBuffer;
-  }
-
   char formatShortBuffers[formatShortBuffersCount][formatShortBuffersSize];   // For "human readable" numbers. Big enough for a signed int64_t with commas.
   uint32_t nextFormatShortBuffer;
 
   char formatMediumBuffers[formatMediumBuffersCount][formatMediumBuffersSize]; // Big Enough for domain name as text
   uint32_t nextFormatMediumBuffer;
 
-  char *bigBuffer;
-  size_t bigBufferSize;
-
+  char bigBuffer[bigBufferMaxSize];
 };
 
-
-static void deleteUtilsTLS(void *data)
-{
-  if (data)
-  {
-    delete (reinterpret_cast<UtilsTLSData *>(data));
-  }
-}
-
-static UtilsTLSData* getUtilsTLS()
-{
-  if (!gHasUtilsTLSKey)
-    return NULL;
-  void *data = pthread_getspecific(gUtilsTLSKey);
-  if (data != NULL)
-    return reinterpret_cast<UtilsTLSData *>(data);
-
-  UtilsTLSData *tlsData = new(std::nothrow) UtilsTLSData;
-  if (!tlsData)
-    return NULL;
-
-  if (0 != pthread_setspecific(gUtilsTLSKey, tlsData))
-  {
-    delete tlsData;
-    return NULL;
-  }
-
-  return tlsData;
-}
-
+static __thread UtilsTLSData gUtilsTLS;
 
 
 bool UtilsInit()
 {
-  if (gHasUtilsTLSKey)
-    return true;
-
-  int ret = pthread_key_create(&gUtilsTLSKey, deleteUtilsTLS);
-  if (ret != 0)
-    return false;
-  gHasUtilsTLSKey = true;
-
-  // This is a 'kludgy' attempt to detect when the pthread libraries have been
-  // 'stubbed', as there are on FreeBSD without the -pthread flag.
-
-  if (0 != pthread_setspecific(gUtilsTLSKey, (void *)(uintptr_t)(0xbefed)))
-    return false;
-
-  void *data = pthread_getspecific(gUtilsTLSKey);
-  if ((uintptr_t)data != (uintptr_t)(0xbefed))
-    return false;
-
-  if (0 != pthread_setspecific(gUtilsTLSKey, NULL))
-    return false;
-
   return true;
 }
 
 static char* nextFormatShortBuffer()
 {
-  UtilsTLSData *tls = getUtilsTLS();
-  if (!tls)
-    return NULL;
+  UtilsTLSData &tls = gUtilsTLS;
 
-  char *nextBuf = tls->formatShortBuffers[tls->nextFormatShortBuffer++];
-  if (tls->nextFormatShortBuffer >= countof(tls->formatShortBuffers))
-    tls->nextFormatShortBuffer = 0;
+  char *nextBuf = tls.formatShortBuffers[tls.nextFormatShortBuffer++];
+  if (tls.nextFormatShortBuffer >= countof(tls.formatShortBuffers))
+    tls.nextFormatShortBuffer = 0;
   return nextBuf;
 }
 
 
 static char* nextFormatMeduimBuffer()
 {
-  UtilsTLSData *tls = getUtilsTLS();
-  if (!tls)
-    return NULL;
+  UtilsTLSData &tls = gUtilsTLS;
 
-  char *nextBuf = tls->formatMediumBuffers[tls->nextFormatMediumBuffer++];
-  if (tls->nextFormatMediumBuffer >= countof(tls->formatMediumBuffers))
-    tls->nextFormatMediumBuffer = 0;
+  char *nextBuf = tls.formatMediumBuffers[tls.nextFormatMediumBuffer++];
+  if (tls.nextFormatMediumBuffer >= countof(tls.formatMediumBuffers))
+    tls.nextFormatMediumBuffer = 0;
   return nextBuf;
 }
 
@@ -148,23 +88,9 @@ static size_t getBigBuffer(char **outBuf)
 {
   if (!outBuf)
     return 0;
-  *outBuf = NULL;
-
-  UtilsTLSData *tls = getUtilsTLS();
-  if (!tls)
-    return 0;
-
-  if (tls->bigBufferSize == 0)
-  {
-    tls->bigBuffer = new(std::nothrow) char[bigBufferMaxSize];
-    if (!tls->bigBuffer)
-      return 0;
-
-    tls->bigBufferSize = bigBufferMaxSize;
-  }
 
-  *outBuf = tls->bigBuffer;
-  return tls->bigBufferSize;
+  *outBuf = gUtilsTLS.bigBuffer;
+  return sizeof(gUtilsTLS.bigBuffer);
 }
 
 bool UtilsInitThread()
@@ -23,14 +23,14 @@ struct in_addr;
 * Call before using certain functions.
 * Not thread safe
 *
-*  Note that pthread_key_delete() is never called, so this may be a very small
-*  leak if used from a dynamically loaded library.
+* The thread local buffers are __thread data, so this no longer has anything to
+* set up. It is kept so that callers need not change.
 */
 bool UtilsInit();
 
 /**
- * Optional call to pre-allocate thread local storage for the current thread.
- * This calf be used to ensure that the tls functions will not fail later.
+ * Optional call to prepare thread local storage for the current thread.
+ * The buffers are part of the thread's static TLS, so this can not fail.
  *
  * Call after calling UtilsInit().
  *